@@ -0,0 +1,462 @@
+/*
+ * afcbench.c
+ * Measures AFC throughput, operation rates and latencies
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+
+#define BENCH_DIR "/afcbench"
+#define MAX_CONNECTIONS 16
+#define SMALL_FILE_SIZE 4096
+
+static const uint32_t chunk_sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+#define NUM_CHUNK_SIZES (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+enum bench_test {
+	TEST_SEQ_WRITE,
+	TEST_SEQ_READ,
+	TEST_SMALL_CREATE,
+	TEST_SMALL_STAT,
+	TEST_LIST,
+	TEST_SMALL_REMOVE
+};
+
+static const char *test_names[] = {
+	"seq_write",
+	"seq_read",
+	"small_create",
+	"small_stat",
+	"list",
+	"small_remove"
+};
+
+typedef struct {
+	afc_client_t afc;
+	int id;
+	enum bench_test test;
+	uint32_t chunk;
+	uint64_t bytes;
+	uint32_t files;
+	uint32_t rounds;
+	char *buffer;
+	/* results */
+	uint64_t bytes_done;
+	uint64_t entries;
+	uint32_t errors;
+	uint32_t *latencies;
+	uint32_t num_latencies;
+	uint32_t max_latencies;
+} bench_worker;
+
+static uint64_t now_us()
+{
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return ((uint64_t)tv.tv_sec * G_USEC_PER_SEC) + tv.tv_usec;
+}
+
+static void add_latency(bench_worker *w, uint64_t start)
+{
+	uint64_t elapsed = now_us() - start;
+
+	if (w->num_latencies == w->max_latencies) {
+		w->max_latencies = w->max_latencies ? w->max_latencies * 2 : 1024;
+		w->latencies = (uint32_t*)realloc(w->latencies, sizeof(uint32_t) * w->max_latencies);
+	}
+	w->latencies[w->num_latencies++] = (elapsed > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)elapsed;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t*)a;
+	uint32_t lb = *(const uint32_t*)b;
+	return (la < lb) ? -1 : (la > lb);
+}
+
+static void free_list(char **list)
+{
+	int i;
+
+	for (i = 0; list[i]; i++)
+		free(list[i]);
+	free(list);
+}
+
+static void seq_path(char *path, size_t size, int id)
+{
+	snprintf(path, size, BENCH_DIR "/seq_%d", id);
+}
+
+static void small_path(char *path, size_t size, int id, uint32_t index)
+{
+	snprintf(path, size, BENCH_DIR "/small_%d_%u", id, index);
+}
+
+static void bench_seq(bench_worker *w)
+{
+	char path[64];
+	uint64_t handle = 0;
+	uint64_t start;
+
+	seq_path(path, sizeof(path), w->id);
+	if (afc_file_open(w->afc, path, (w->test == TEST_SEQ_WRITE) ? AFC_FOPEN_WRONLY : AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS) {
+		w->errors++;
+		return;
+	}
+
+	while (w->bytes_done < w->bytes) {
+		uint32_t len = w->chunk;
+		uint32_t bytes = 0;
+		afc_error_t err;
+
+		if (w->bytes - w->bytes_done < len)
+			len = (uint32_t)(w->bytes - w->bytes_done);
+
+		start = now_us();
+		if (w->test == TEST_SEQ_WRITE)
+			err = afc_file_write(w->afc, handle, w->buffer, len, &bytes);
+		else
+			err = afc_file_read(w->afc, handle, w->buffer, len, &bytes);
+		add_latency(w, start);
+
+		if ((err != AFC_E_SUCCESS) || (bytes == 0)) {
+			w->errors++;
+			break;
+		}
+		w->bytes_done += bytes;
+	}
+
+	afc_file_close(w->afc, handle);
+}
+
+static void bench_small(bench_worker *w)
+{
+	char path[64];
+	uint32_t i;
+
+	for (i = 0; i < w->files; i++) {
+		uint64_t start;
+		int ok = 0;
+
+		small_path(path, sizeof(path), w->id, i);
+		start = now_us();
+		if (w->test == TEST_SMALL_CREATE) {
+			uint64_t handle = 0;
+			uint32_t bytes = 0;
+			if (afc_file_open(w->afc, path, AFC_FOPEN_WRONLY, &handle) == AFC_E_SUCCESS) {
+				ok = (afc_file_write(w->afc, handle, w->buffer, SMALL_FILE_SIZE, &bytes) == AFC_E_SUCCESS) && (bytes == SMALL_FILE_SIZE);
+				ok = (afc_file_close(w->afc, handle) == AFC_E_SUCCESS) && ok;
+			}
+			if (ok)
+				w->bytes_done += SMALL_FILE_SIZE;
+		} else if (w->test == TEST_SMALL_STAT) {
+			char **info = NULL;
+			ok = (afc_get_file_info(w->afc, path, &info) == AFC_E_SUCCESS);
+			if (info)
+				free_list(info);
+		} else {
+			ok = (afc_remove_path(w->afc, path) == AFC_E_SUCCESS);
+		}
+		add_latency(w, start);
+
+		if (!ok)
+			w->errors++;
+	}
+}
+
+static void bench_list(bench_worker *w)
+{
+	uint32_t i;
+
+	for (i = 0; i < w->rounds; i++) {
+		char **list = NULL;
+		uint64_t start = now_us();
+		afc_error_t err = afc_read_directory(w->afc, BENCH_DIR, &list);
+		add_latency(w, start);
+
+		if (err != AFC_E_SUCCESS) {
+			w->errors++;
+			continue;
+		}
+		if (list) {
+			int j;
+			for (j = 0; list[j]; j++)
+				w->entries++;
+			free_list(list);
+		}
+	}
+}
+
+static gpointer bench_thread(gpointer data)
+{
+	bench_worker *w = (bench_worker*)data;
+
+	switch (w->test) {
+	case TEST_SEQ_WRITE:
+	case TEST_SEQ_READ:
+		bench_seq(w);
+		break;
+	case TEST_SMALL_CREATE:
+	case TEST_SMALL_STAT:
+	case TEST_SMALL_REMOVE:
+		bench_small(w);
+		break;
+	case TEST_LIST:
+		bench_list(w);
+		break;
+	default:
+		break;
+	}
+	return NULL;
+}
+
+/**
+ * Runs one test on the given number of connections at once and prints a
+ * line of key=value pairs with the results.
+ */
+static void run_test(bench_worker *workers, int connections, enum bench_test test, uint32_t chunk, uint64_t total_bytes, uint32_t total_files, uint32_t rounds)
+{
+	GThread *threads[MAX_CONNECTIONS];
+	uint64_t bytes = 0;
+	uint64_t entries = 0;
+	uint32_t errors = 0;
+	uint32_t ops = 0;
+	uint32_t *all;
+	uint64_t start;
+	double seconds;
+	int i;
+
+	for (i = 0; i < connections; i++) {
+		bench_worker *w = &workers[i];
+		w->test = test;
+		w->chunk = chunk;
+		w->bytes = total_bytes / connections;
+		w->files = total_files / connections;
+		w->rounds = rounds;
+		w->bytes_done = 0;
+		w->entries = 0;
+		w->errors = 0;
+		w->num_latencies = 0;
+	}
+
+	start = now_us();
+	for (i = 0; i < connections; i++) {
+		threads[i] = g_thread_create(bench_thread, &workers[i], TRUE, NULL);
+	}
+	for (i = 0; i < connections; i++) {
+		if (threads[i])
+			g_thread_join(threads[i]);
+		else
+			workers[i].errors++;
+	}
+	seconds = (double)(now_us() - start) / G_USEC_PER_SEC;
+	if (seconds <= 0)
+		seconds = 1e-6;
+
+	for (i = 0; i < connections; i++) {
+		bytes += workers[i].bytes_done;
+		entries += workers[i].entries;
+		errors += workers[i].errors;
+		ops += workers[i].num_latencies;
+	}
+
+	all = (uint32_t*)malloc(sizeof(uint32_t) * (ops ? ops : 1));
+	ops = 0;
+	for (i = 0; i < connections; i++) {
+		memcpy(all + ops, workers[i].latencies, sizeof(uint32_t) * workers[i].num_latencies);
+		ops += workers[i].num_latencies;
+	}
+	qsort(all, ops, sizeof(uint32_t), compare_latency);
+
+	printf("test=%s connections=%d chunk=%u ops=%u bytes=%llu entries=%llu errors=%u seconds=%.6f ops_per_sec=%.1f mb_per_sec=%.3f",
+		test_names[test], connections, chunk, ops, (unsigned long long)bytes, (unsigned long long)entries, errors, seconds,
+		ops / seconds, (bytes / seconds) / (1024 * 1024));
+	if (ops > 0) {
+		printf(" p50_us=%u p90_us=%u p99_us=%u max_us=%u",
+			all[(ops - 1) * 50 / 100], all[(ops - 1) * 90 / 100], all[(ops - 1) * 99 / 100], all[ops - 1]);
+	}
+	if (test == TEST_LIST)
+		printf(" entries_per_sec=%.1f", entries / seconds);
+	printf("\n");
+	fflush(stdout);
+
+	free(all);
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	printf("Measure AFC throughput, operation rates and latencies.\n");
+	printf("Results are printed as one line of key=value pairs per test.\n\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID\n");
+	printf("  -s, --size MB\t\tsize of the sequential transfers (default 32)\n");
+	printf("  -c, --connections N\tmaximum number of connections (default 4)\n");
+	printf("  -n, --files N\t\tnumber of small files (default 256)\n");
+	printf("  -r, --rounds N\t\tnumber of directory listings per connection (default 20)\n");
+	printf("  -p, --pipeline N\tnumber of requests kept in flight per connection (default 1)\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	lockdownd_client_t client = NULL;
+	idevice_t phone = NULL;
+	uint16_t port = 0;
+	bench_worker workers[MAX_CONNECTIONS];
+	int max_connections = 4;
+	int connection_counts[2];
+	int num_counts;
+	uint64_t size = 32;
+	uint32_t files = 256;
+	uint32_t rounds = 20;
+	uint32_t depth = 1;
+	const char *uuid = NULL;
+	int i;
+	int c;
+	unsigned int k;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--uuid")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) != 40)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			uuid = argv[i];
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--size")) && (i + 1 < argc)) {
+			size = strtoull(argv[++i], NULL, 10);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-c") || !strcmp(argv[i], "--connections")) && (i + 1 < argc)) {
+			max_connections = atoi(argv[++i]);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--files")) && (i + 1 < argc)) {
+			files = strtoul(argv[++i], NULL, 10);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rounds")) && (i + 1 < argc)) {
+			rounds = strtoul(argv[++i], NULL, 10);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-p") || !strcmp(argv[i], "--pipeline")) && (i + 1 < argc)) {
+			depth = strtoul(argv[++i], NULL, 10);
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if ((size == 0) || (max_connections < 1) || (max_connections > MAX_CONNECTIONS)) {
+		print_usage(argc, argv);
+		return 0;
+	}
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (IDEVICE_E_SUCCESS != idevice_new(&phone, uuid)) {
+		printf("No device found, is it plugged in?\n");
+		return 1;
+	}
+
+	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(phone, &client, "afcbench")) {
+		idevice_free(phone);
+		return 1;
+	}
+
+	if ((lockdownd_start_service(client, "com.apple.afc", &port) != LOCKDOWN_E_SUCCESS) || !port) {
+		lockdownd_client_free(client);
+		idevice_free(phone);
+		fprintf(stderr, "Something went wrong when starting AFC.\n");
+		return 1;
+	}
+	lockdownd_client_free(client);
+
+	memset(workers, '\0', sizeof(workers));
+	for (i = 0; i < max_connections; i++) {
+		if (afc_client_new(phone, port, &workers[i].afc) != AFC_E_SUCCESS) {
+			fprintf(stderr, "Could only open %d of %d connections.\n", i, max_connections);
+			max_connections = i;
+			break;
+		}
+		afc_client_set_pipeline_depth(workers[i].afc, depth);
+		workers[i].id = i;
+		workers[i].buffer = (char*)malloc(chunk_sizes[NUM_CHUNK_SIZES - 1]);
+		memset(workers[i].buffer, 'A' + i, chunk_sizes[NUM_CHUNK_SIZES - 1]);
+	}
+	if (max_connections == 0) {
+		idevice_free(phone);
+		return 1;
+	}
+
+	afc_make_directory(workers[0].afc, BENCH_DIR);
+
+	connection_counts[0] = 1;
+	connection_counts[1] = max_connections;
+	num_counts = (max_connections > 1) ? 2 : 1;
+
+	for (c = 0; c < num_counts; c++) {
+		int conns = connection_counts[c];
+		for (k = 0; k < NUM_CHUNK_SIZES; k++) {
+			run_test(workers, conns, TEST_SEQ_WRITE, chunk_sizes[k], size * 1024 * 1024, 0, 0);
+			run_test(workers, conns, TEST_SEQ_READ, chunk_sizes[k], size * 1024 * 1024, 0, 0);
+		}
+		run_test(workers, conns, TEST_SMALL_CREATE, SMALL_FILE_SIZE, 0, files, 0);
+		run_test(workers, conns, TEST_SMALL_STAT, 0, 0, files, 0);
+		run_test(workers, conns, TEST_LIST, 0, 0, 0, rounds);
+		run_test(workers, conns, TEST_SMALL_REMOVE, 0, 0, files, 0);
+	}
+
+	/* clean up what is left on the device */
+	for (i = 0; i < max_connections; i++) {
+		char path[64];
+		seq_path(path, sizeof(path), i);
+		afc_remove_path(workers[0].afc, path);
+	}
+	afc_remove_path(workers[0].afc, BENCH_DIR);
+
+	for (i = 0; i < max_connections; i++) {
+		afc_client_free(workers[i].afc);
+		free(workers[i].buffer);
+		free(workers[i].latencies);
+	}
+	idevice_free(phone);
+
+	return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * connbench.c
+ * Measures the latency of each phase of the connection setup to a service
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+#define LOCKDOWN_PORT 0xf27e
+
+enum bench_phase {
+	PHASE_DEVICE_NEW,
+	PHASE_CONNECT_LOCKDOWN,
+	PHASE_LOCKDOWN_CLIENT_NEW,
+	PHASE_QUERY_TYPE,
+	PHASE_VALIDATE_PAIR,
+	PHASE_PAIR,
+	PHASE_SSL_HANDSHAKE,
+	PHASE_START_SESSION,
+	PHASE_START_SERVICE,
+	PHASE_CONNECT_SERVICE,
+	PHASE_TOTAL,
+	NUM_PHASES
+};
+
+static const char *phase_names[] = {
+	"device_new",
+	"connect_lockdown",
+	"lockdown_client_new",
+	"query_type",
+	"validate_pair",
+	"pair",
+	"ssl_handshake",
+	"start_session",
+	"start_service",
+	"connect_service",
+	"total"
+};
+
+typedef struct {
+	uint32_t *samples;
+	uint32_t num_samples;
+	uint32_t max_samples;
+	uint32_t errors;
+} phase_stats;
+
+typedef struct {
+	char *uuid;
+	phase_stats phases[NUM_PHASES];
+} device_stats;
+
+static uint64_t now_us()
+{
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return ((uint64_t)tv.tv_sec * G_USEC_PER_SEC) + tv.tv_usec;
+}
+
+static void add_sample(phase_stats *stats, uint64_t duration, int result)
+{
+	if (result != 0) {
+		stats->errors++;
+		return;
+	}
+	if (stats->num_samples == stats->max_samples) {
+		stats->max_samples = stats->max_samples ? stats->max_samples * 2 : 64;
+		stats->samples = (uint32_t*)realloc(stats->samples, sizeof(uint32_t) * stats->max_samples);
+	}
+	stats->samples[stats->num_samples++] = (duration > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)duration;
+}
+
+static int compare_sample(const void *a, const void *b)
+{
+	uint32_t sa = *(const uint32_t*)a;
+	uint32_t sb = *(const uint32_t*)b;
+	return (sa < sb) ? -1 : (sa > sb);
+}
+
+/**
+ * Maps the phases reported by the library to the ones of the benchmark.
+ * Connections are told apart by the port at the end of their target.
+ */
+static void trace_cb(int phase, const char *target, uint64_t duration, int result, void *user_data)
+{
+	device_stats *dev = *(device_stats**)user_data;
+	const char *port;
+	int p = -1;
+
+	if (!dev)
+		return;
+
+	switch (phase) {
+	case IDEVICE_TRACE_DEVICE_NEW:
+		p = PHASE_DEVICE_NEW;
+		break;
+	case IDEVICE_TRACE_CONNECT:
+		port = strrchr(target, ':');
+		if (port && (atoi(port + 1) == LOCKDOWN_PORT))
+			p = PHASE_CONNECT_LOCKDOWN;
+		else
+			p = PHASE_CONNECT_SERVICE;
+		break;
+	case IDEVICE_TRACE_SSL_HANDSHAKE:
+		p = PHASE_SSL_HANDSHAKE;
+		break;
+	case IDEVICE_TRACE_LOCKDOWN_CLIENT_NEW:
+		p = PHASE_LOCKDOWN_CLIENT_NEW;
+		break;
+	case IDEVICE_TRACE_LOCKDOWN_QUERY_TYPE:
+		p = PHASE_QUERY_TYPE;
+		break;
+	case IDEVICE_TRACE_LOCKDOWN_VALIDATE_PAIR:
+		p = PHASE_VALIDATE_PAIR;
+		break;
+	case IDEVICE_TRACE_LOCKDOWN_PAIR:
+		p = PHASE_PAIR;
+		break;
+	case IDEVICE_TRACE_LOCKDOWN_START_SESSION:
+		p = PHASE_START_SESSION;
+		break;
+	case IDEVICE_TRACE_LOCKDOWN_START_SERVICE:
+		p = PHASE_START_SERVICE;
+		break;
+	default:
+		return;
+	}
+	add_sample(&dev->phases[p], duration, result);
+}
+
+/**
+ * Performs one complete connection setup to the given service and tears
+ * it down again. The phases are recorded by the trace callback.
+ */
+static void run_once(device_stats *dev, const char *service)
+{
+	idevice_t phone = NULL;
+	lockdownd_client_t client = NULL;
+	idevice_connection_t connection = NULL;
+	uint16_t port = 0;
+	int result = -1;
+	uint64_t start = now_us();
+
+	if (idevice_new(&phone, dev->uuid) != IDEVICE_E_SUCCESS)
+		goto leave;
+	if (lockdownd_client_new_with_handshake(phone, &client, "connbench") != LOCKDOWN_E_SUCCESS)
+		goto leave;
+	if (lockdownd_start_service(client, service, &port) != LOCKDOWN_E_SUCCESS || !port)
+		goto leave;
+	if (idevice_connect(phone, port, &connection) != IDEVICE_E_SUCCESS)
+		goto leave;
+	result = 0;
+
+leave:
+	add_sample(&dev->phases[PHASE_TOTAL], now_us() - start, result);
+	if (connection)
+		idevice_disconnect(connection);
+	if (client)
+		lockdownd_client_free(client);
+	if (phone)
+		idevice_free(phone);
+}
+
+static void print_stats(const char *uuid, const char *service, phase_stats *phases)
+{
+	int i;
+
+	for (i = 0; i < NUM_PHASES; i++) {
+		phase_stats *s = &phases[i];
+		uint32_t n = s->num_samples;
+
+		if ((n == 0) && (s->errors == 0))
+			continue;
+		qsort(s->samples, n, sizeof(uint32_t), compare_sample);
+		printf("device=%s service=%s phase=%s count=%u errors=%u", uuid, service, phase_names[i], n, s->errors);
+		if (n > 0) {
+			printf(" min_us=%u p50_us=%u p90_us=%u p99_us=%u max_us=%u",
+				s->samples[0], s->samples[(n - 1) * 50 / 100], s->samples[(n - 1) * 90 / 100],
+				s->samples[(n - 1) * 99 / 100], s->samples[n - 1]);
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	printf("Measure the latency of each phase of setting up a service connection.\n");
+	printf("Results are printed as one line of key=value pairs per device and phase,\n");
+	printf("followed by the phases of all devices combined.\n\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID,\n");
+	printf("\t\t\tall attached devices are measured otherwise\n");
+	printf("  -n, --runs N\t\tnumber of connection setups per device (default 20)\n");
+	printf("  -s, --service NAME\tservice to start (default com.apple.afc)\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	device_stats *devices = NULL;
+	device_stats *current = NULL;
+	phase_stats combined[NUM_PHASES];
+	const char *service = "com.apple.afc";
+	const char *uuid = NULL;
+	char **dev_list = NULL;
+	int num_devices = 0;
+	uint32_t runs = 20;
+	uint32_t r;
+	int i;
+	int k;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--uuid")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) != 40)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			uuid = argv[i];
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--runs")) && (i + 1 < argc)) {
+			runs = strtoul(argv[++i], NULL, 10);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "--service")) && (i + 1 < argc)) {
+			service = argv[++i];
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if (runs == 0) {
+		print_usage(argc, argv);
+		return 0;
+	}
+
+	if (uuid) {
+		num_devices = 1;
+		devices = (device_stats*)calloc(1, sizeof(device_stats));
+		devices[0].uuid = strdup(uuid);
+	} else {
+		if ((idevice_get_device_list(&dev_list, &num_devices) != IDEVICE_E_SUCCESS) || (num_devices == 0)) {
+			printf("No device found, is it plugged in?\n");
+			return -1;
+		}
+		devices = (device_stats*)calloc(num_devices, sizeof(device_stats));
+		for (i = 0; i < num_devices; i++)
+			devices[i].uuid = strdup(dev_list[i]);
+		idevice_device_list_free(dev_list);
+	}
+
+	idevice_set_trace_callback(trace_cb, &current);
+
+	/* interleave the devices so that all of them see the same conditions */
+	for (r = 0; r < runs; r++) {
+		for (i = 0; i < num_devices; i++) {
+			current = &devices[i];
+			run_once(current, service);
+		}
+	}
+	current = NULL;
+	idevice_set_trace_callback(NULL, NULL);
+
+	memset(combined, '\0', sizeof(combined));
+	for (i = 0; i < num_devices; i++) {
+		for (k = 0; k < NUM_PHASES; k++) {
+			phase_stats *s = &devices[i].phases[k];
+			uint32_t n;
+			for (n = 0; n < s->num_samples; n++)
+				add_sample(&combined[k], s->samples[n], 0);
+			combined[k].errors += s->errors;
+		}
+		print_stats(devices[i].uuid, service, devices[i].phases);
+	}
+	if (num_devices > 1)
+		print_stats("all", service, combined);
+
+	for (k = 0; k < NUM_PHASES; k++)
+		free(combined[k].samples);
+	for (i = 0; i < num_devices; i++) {
+		for (k = 0; k < NUM_PHASES; k++)
+			free(devices[i].phases[k].samples);
+		free(devices[i].uuid);
+	}
+	free(devices);
+
+	return 0;
+}
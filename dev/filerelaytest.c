@@ -67,6 +67,16 @@ int main(int argc, char **argv)
 	}
 	printf("\n");
 
+	if (argc > 1) {
+		/* extract straight into the given directory */
+		printf("extracting to %s\n", argv[1]);
+		file_relay_error_t err = file_relay_request_sources_to_directory(frc, sources, argv[1]);
+		if (err != FILE_RELAY_E_SUCCESS) {
+			printf("could not extract sources, error %d\n", err);
+		}
+		goto leave_cleanup;
+	}
+
 	if (file_relay_request_sources(frc, sources, &dump) != FILE_RELAY_E_SUCCESS) {
 		printf("could not get sources\n");
 		goto leave_cleanup;
@@ -0,0 +1,522 @@
+/*
+ * plistbench.c
+ * Measures plist encoding, decoding and framing of service messages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <plist/plist.h>
+
+#define MAX_MESSAGES 32
+#define BENCH_UUID "0000000000000000000000000000000000000000"
+
+typedef struct {
+	char *name;
+	plist_t request;
+	plist_t reply;
+	/* exercises the reply through the public API instead of lockdownd_send() */
+	int (*api)(lockdownd_client_t client);
+} bench_message;
+
+/* reply the loopback server answers every request with */
+typedef struct {
+	GMutex *mutex;
+	char *reply;
+	uint32_t reply_length;
+} bench_server;
+
+typedef struct {
+	bench_server *server;
+	int fd;
+} bench_peer;
+
+static uint64_t now_us()
+{
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return ((uint64_t)tv.tv_sec * G_USEC_PER_SEC) + tv.tv_usec;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t*)a;
+	uint32_t lb = *(const uint32_t*)b;
+	return (la < lb) ? -1 : (la > lb);
+}
+
+static int read_exact(int fd, char *buf, uint32_t length)
+{
+	uint32_t done = 0;
+
+	while (done < length) {
+		ssize_t r = read(fd, buf + done, length - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+	return 0;
+}
+
+static int write_exact(int fd, const char *buf, uint32_t length)
+{
+	uint32_t done = 0;
+
+	while (done < length) {
+		ssize_t w = write(fd, buf + done, length - done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		done += w;
+	}
+	return 0;
+}
+
+/**
+ * Plays the device side: reads each framed request and answers it with
+ * the framed reply that is currently set, without looking at the request.
+ */
+static gpointer server_thread(gpointer data)
+{
+	bench_peer *peer = (bench_peer*)data;
+	char *buf = NULL;
+	uint32_t size = 0;
+
+	while (1) {
+		uint32_t pktlen = 0;
+		char *reply;
+		uint32_t reply_length;
+
+		if (read_exact(peer->fd, (char*)&pktlen, sizeof(pktlen)) < 0)
+			break;
+		pktlen = ntohl(pktlen);
+		if (pktlen > size) {
+			free(buf);
+			buf = (char*)malloc(pktlen);
+			size = buf ? pktlen : 0;
+			if (!buf)
+				break;
+		}
+		if (read_exact(peer->fd, buf, pktlen) < 0)
+			break;
+
+		g_mutex_lock(peer->server->mutex);
+		reply = peer->server->reply;
+		reply_length = peer->server->reply_length;
+		g_mutex_unlock(peer->server->mutex);
+		if (write_exact(peer->fd, reply, reply_length) < 0)
+			break;
+	}
+
+	free(buf);
+	close(peer->fd);
+	free(peer);
+	return NULL;
+}
+
+static void loopback_cb(uint16_t port, int fd, void *user_data)
+{
+	bench_peer *peer = (bench_peer*)malloc(sizeof(bench_peer));
+
+	peer->server = (bench_server*)user_data;
+	peer->fd = fd;
+	if (!g_thread_create(server_thread, peer, FALSE, NULL)) {
+		close(fd);
+		free(peer);
+	}
+}
+
+/**
+ * Sets the reply of the loopback server, framed like the device does.
+ */
+static uint32_t server_set_reply(bench_server *server, plist_t reply, int binary)
+{
+	char *content = NULL;
+	uint32_t length = 0;
+	uint32_t nlen;
+	char *frame;
+
+	if (binary)
+		plist_to_bin(reply, &content, &length);
+	else
+		plist_to_xml(reply, &content, &length);
+
+	frame = (char*)malloc(sizeof(uint32_t) + length);
+	nlen = htonl(length);
+	memcpy(frame, &nlen, sizeof(uint32_t));
+	memcpy(frame + sizeof(uint32_t), content, length);
+	free(content);
+
+	g_mutex_lock(server->mutex);
+	free(server->reply);
+	server->reply = frame;
+	server->reply_length = sizeof(uint32_t) + length;
+	g_mutex_unlock(server->mutex);
+
+	return length;
+}
+
+static plist_t string_dict(const char *first_key, ...)
+{
+	plist_t dict = plist_new_dict();
+	const char *key;
+	va_list args;
+
+	va_start(args, first_key);
+	for (key = first_key; key; key = va_arg(args, const char*)) {
+		const char *value = va_arg(args, const char*);
+		plist_dict_insert_item(dict, key, plist_new_string(value));
+	}
+	va_end(args);
+	return dict;
+}
+
+static int api_get_value(lockdownd_client_t client)
+{
+	plist_t value = NULL;
+	int res = lockdownd_get_value(client, NULL, "ProductVersion", &value);
+	plist_free(value);
+	return res;
+}
+
+static int api_query_type(lockdownd_client_t client)
+{
+	char *type = NULL;
+	int res = lockdownd_query_type(client, &type);
+	free(type);
+	return res;
+}
+
+/**
+ * Builds messages shaped like the ones lockdownd, installation_proxy
+ * and mobilebackup2 exchange.
+ */
+static int add_builtin_messages(bench_message *messages)
+{
+	plist_t node, list;
+	int n = 0;
+	int i;
+
+	messages[n].name = strdup("lockdown_query_type");
+	messages[n].request = string_dict("Label", "plistbench", "Request", "QueryType", NULL);
+	messages[n].reply = string_dict("Request", "QueryType", "Result", "Success", "Type", "com.apple.mobile.lockdown", NULL);
+	messages[n].api = api_query_type;
+	n++;
+
+	messages[n].name = strdup("lockdown_get_value");
+	messages[n].request = string_dict("Label", "plistbench", "Key", "ProductVersion", "Request", "GetValue", NULL);
+	messages[n].reply = string_dict("Key", "ProductVersion", "Request", "GetValue", "Result", "Success", "Value", "4.3.3", NULL);
+	messages[n].api = api_get_value;
+	n++;
+
+	messages[n].name = strdup("lockdown_start_service");
+	messages[n].request = string_dict("Label", "plistbench", "Request", "StartService", "Service", "com.apple.afc", NULL);
+	messages[n].reply = string_dict("Request", "StartService", "Result", "Success", "Service", "com.apple.afc", NULL);
+	plist_dict_insert_item(messages[n].reply, "Port", plist_new_uint(49152));
+	n++;
+
+	messages[n].name = strdup("instproxy_browse");
+	messages[n].request = plist_new_dict();
+	node = plist_new_dict();
+	plist_dict_insert_item(node, "ApplicationType", plist_new_string("User"));
+	plist_dict_insert_item(messages[n].request, "ClientOptions", node);
+	plist_dict_insert_item(messages[n].request, "Command", plist_new_string("Browse"));
+	messages[n].reply = plist_new_dict();
+	list = plist_new_array();
+	for (i = 0; i < 20; i++) {
+		char id[64];
+		char path[128];
+		snprintf(id, sizeof(id), "com.example.application%d", i);
+		snprintf(path, sizeof(path), "/private/var/mobile/Applications/%08X-0000/App%d.app", i, i);
+		node = string_dict("CFBundleIdentifier", id, "CFBundleDisplayName", id + 12,
+			"CFBundleExecutable", "App", "CFBundleVersion", "1.0.0", "CFBundleShortVersionString", "1.0",
+			"ApplicationType", "User", "Path", path, "DTPlatformName", "iphoneos", NULL);
+		plist_dict_insert_item(node, "MinimumOSVersion", plist_new_string("4.0"));
+		plist_dict_insert_item(node, "UIStatusBarHidden", plist_new_bool(0));
+		plist_array_append_item(list, node);
+	}
+	plist_dict_insert_item(messages[n].reply, "CurrentAmount", plist_new_uint(20));
+	plist_dict_insert_item(messages[n].reply, "CurrentIndex", plist_new_uint(0));
+	plist_dict_insert_item(messages[n].reply, "CurrentList", list);
+	plist_dict_insert_item(messages[n].reply, "Status", plist_new_string("BrowsingApplications"));
+	plist_dict_insert_item(messages[n].reply, "Total", plist_new_uint(20));
+	n++;
+
+	messages[n].name = strdup("mobilebackup2_download_files");
+	messages[n].request = plist_new_array();
+	plist_array_append_item(messages[n].request, plist_new_string("DLMessageDownloadFiles"));
+	list = plist_new_array();
+	for (i = 0; i < 100; i++) {
+		char path[128];
+		snprintf(path, sizeof(path), "%040x/%040x", i, i * 7919);
+		plist_array_append_item(list, plist_new_string(path));
+	}
+	plist_array_append_item(messages[n].request, list);
+	node = plist_new_dict();
+	plist_dict_insert_item(node, "FreeDiskSpace", plist_new_uint(1073741824));
+	plist_array_append_item(messages[n].request, node);
+	plist_array_append_item(messages[n].request, plist_new_uint(1));
+	plist_array_append_item(messages[n].request, plist_new_uint(0));
+	messages[n].reply = plist_new_array();
+	plist_array_append_item(messages[n].reply, plist_new_string("DLMessageStatusResponse"));
+	plist_array_append_item(messages[n].reply, plist_new_uint(0));
+	plist_array_append_item(messages[n].reply, plist_new_string("___EmptyParameterString___"));
+	plist_array_append_item(messages[n].reply, plist_new_dict());
+	n++;
+
+	return n;
+}
+
+/**
+ * Loads a captured plist, binary or xml, which is then used as request
+ * and as reply.
+ */
+static int load_message(const char *path, bench_message *message)
+{
+	gchar *content = NULL;
+	gsize length = 0;
+	plist_t plist = NULL;
+	const char *name;
+
+	if (!g_file_get_contents(path, &content, &length, NULL)) {
+		fprintf(stderr, "Could not read %s\n", path);
+		return -1;
+	}
+	if ((length >= 8) && !memcmp(content, "bplist00", 8))
+		plist_from_bin(content, length, &plist);
+	else
+		plist_from_xml(content, length, &plist);
+	g_free(content);
+	if (!plist) {
+		fprintf(stderr, "Could not parse %s\n", path);
+		return -1;
+	}
+
+	name = strrchr(path, '/');
+	message->name = strdup(name ? name + 1 : path);
+	message->request = plist;
+	message->reply = plist_copy(plist);
+	message->api = NULL;
+	return 0;
+}
+
+static void print_result(const char *message, const char *format, const char *test, uint32_t bytes, uint32_t *latencies, uint32_t count, uint64_t total)
+{
+	double seconds = (double)total / G_USEC_PER_SEC;
+
+	if (seconds <= 0)
+		seconds = 1e-6;
+	printf("message=%s format=%s test=%s bytes=%u ops=%u avg_us=%.3f ops_per_sec=%.1f",
+		message, format, test, bytes, count, (double)total / (count ? count : 1), count / seconds);
+	if (latencies && (count > 0)) {
+		qsort(latencies, count, sizeof(uint32_t), compare_latency);
+		printf(" p50_us=%u p90_us=%u p99_us=%u max_us=%u",
+			latencies[(count - 1) * 50 / 100], latencies[(count - 1) * 90 / 100],
+			latencies[(count - 1) * 99 / 100], latencies[count - 1]);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/**
+ * Measures the codec alone. Single small operations are below the clock
+ * resolution, so only the average over all iterations is reported.
+ */
+static void bench_codec(bench_message *m, int binary, uint32_t iterations)
+{
+	const char *format = binary ? "binary" : "xml";
+	char *content = NULL;
+	uint32_t length = 0;
+	uint64_t start;
+	uint32_t i;
+
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		free(content);
+		content = NULL;
+		if (binary)
+			plist_to_bin(m->reply, &content, &length);
+		else
+			plist_to_xml(m->reply, &content, &length);
+	}
+	print_result(m->name, format, "encode", length, NULL, iterations, now_us() - start);
+
+	start = now_us();
+	for (i = 0; i < iterations; i++) {
+		plist_t plist = NULL;
+		if (binary)
+			plist_from_bin(content, length, &plist);
+		else
+			plist_from_xml(content, length, &plist);
+		plist_free(plist);
+	}
+	print_result(m->name, format, "decode", length, NULL, iterations, now_us() - start);
+	free(content);
+}
+
+/**
+ * Measures complete round trips through the framing of the library.
+ */
+static void bench_roundtrip(lockdownd_client_t client, bench_server *server, bench_message *m, int binary, uint32_t iterations)
+{
+	const char *format = binary ? "binary" : "xml";
+	uint32_t *latencies = (uint32_t*)malloc(sizeof(uint32_t) * iterations);
+	uint32_t bytes = server_set_reply(server, m->reply, binary);
+	uint32_t done = 0;
+	uint64_t start, total;
+	uint32_t i;
+
+	total = now_us();
+	for (i = 0; i < iterations; i++) {
+		plist_t reply = NULL;
+		start = now_us();
+		if (lockdownd_send(client, m->request) != LOCKDOWN_E_SUCCESS)
+			break;
+		if (lockdownd_receive(client, &reply) != LOCKDOWN_E_SUCCESS)
+			break;
+		latencies[done++] = (uint32_t)(now_us() - start);
+		plist_free(reply);
+	}
+	print_result(m->name, format, "roundtrip", bytes, latencies, done, now_us() - total);
+
+	if (m->api) {
+		done = 0;
+		total = now_us();
+		for (i = 0; i < iterations; i++) {
+			start = now_us();
+			if (m->api(client) != LOCKDOWN_E_SUCCESS)
+				break;
+			latencies[done++] = (uint32_t)(now_us() - start);
+		}
+		print_result(m->name, format, "api", bytes, latencies, done, now_us() - total);
+	}
+	free(latencies);
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	printf("Measure plist encoding, decoding and round trips through the message\n");
+	printf("framing over a loopback connection, in xml and binary format. Results\n");
+	printf("are printed as one line of key=value pairs per message and test.\n\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -n, --iterations N\tnumber of operations per test (default 2000)\n");
+	printf("  -f, --file FILE\tadd a captured plist as message, can be repeated;\n");
+	printf("\t\t\tthe built-in messages are used if none is given\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	bench_message messages[MAX_MESSAGES];
+	bench_server server;
+	idevice_t phone = NULL;
+	uint32_t iterations = 2000;
+	int num_messages = 0;
+	int binary;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-n") || !strcmp(argv[i], "--iterations")) && (i + 1 < argc)) {
+			iterations = strtoul(argv[++i], NULL, 10);
+			continue;
+		}
+		else if ((!strcmp(argv[i], "-f") || !strcmp(argv[i], "--file")) && (i + 1 < argc)) {
+			if (num_messages == MAX_MESSAGES) {
+				fprintf(stderr, "At most %d messages are supported\n", MAX_MESSAGES);
+				return -1;
+			}
+			if (load_message(argv[++i], &messages[num_messages]) < 0)
+				return -1;
+			num_messages++;
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if (iterations == 0) {
+		print_usage(argc, argv);
+		return 0;
+	}
+	if (num_messages == 0)
+		num_messages = add_builtin_messages(messages);
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+	server.mutex = g_mutex_new();
+	server.reply = NULL;
+	server.reply_length = 0;
+	server_set_reply(&server, messages[0].reply, 0);
+
+	if (idevice_new_loopback(&phone, BENCH_UUID, loopback_cb, &server) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Could not create loopback device\n");
+		return -1;
+	}
+
+	for (binary = 0; binary <= 1; binary++) {
+		lockdownd_client_t client = NULL;
+
+		for (i = 0; i < num_messages; i++)
+			bench_codec(&messages[i], binary, iterations);
+
+		/* a fresh client, as the format it sends follows the replies */
+		if (lockdownd_client_new(phone, &client, "plistbench") != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "Could not connect to loopback server\n");
+			break;
+		}
+		for (i = 0; i < num_messages; i++)
+			bench_roundtrip(client, &server, &messages[i], binary, iterations);
+		lockdownd_client_free(client);
+	}
+
+	idevice_free(phone);
+	for (i = 0; i < num_messages; i++) {
+		free(messages[i].name);
+		plist_free(messages[i].request);
+		plist_free(messages[i].reply);
+	}
+	g_mutex_lock(server.mutex);
+	free(server.reply);
+	server.reply = NULL;
+	server.reply_length = 0;
+	g_mutex_unlock(server.mutex);
+
+	return 0;
+}
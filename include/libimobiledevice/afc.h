@@ -91,18 +91,52 @@ typedef enum {
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+/** Reports the progress of a single file transfer */
+typedef void (*afc_progress_cb_t)(uint64_t bytes_done, uint64_t bytes_total, void *user_data);
+
+/** Direction of a file transfer */
+typedef enum {
+	AFC_TRANSFER_DOWNLOAD = 0, /**< copy from the device to the host */
+	AFC_TRANSFER_UPLOAD   = 1  /**< copy from the host to the device */
+} afc_transfer_direction_t;
+
+/** A file copied by afc_transfer_files() */
+typedef struct {
+	const char *source;                 /**< path of the file to copy */
+	const char *destination;            /**< path of the copy */
+	afc_transfer_direction_t direction; /**< direction of the copy */
+	afc_error_t result;                 /**< set to the result of the copy */
+} afc_transfer_item_t;
+
+/** Reports the aggregate progress of afc_transfer_files() */
+typedef void (*afc_transfer_progress_cb_t)(uint32_t files_done, uint32_t files_total, uint64_t bytes_done, void *user_data);
+
+/** Callback for afc_walk(), return non-zero to stop the walk */
+typedef int (*afc_walk_cb_t)(const char *path, char **info, void *user_data);
+
 /* Interface */
 afc_error_t afc_client_new_from_connection(idevice_connection_t connection, afc_client_t *client);
 afc_error_t afc_client_new(idevice_t device, uint16_t port, afc_client_t *client);
 afc_error_t afc_client_free(afc_client_t client);
+afc_error_t afc_client_set_pipeline_depth(afc_client_t client, uint32_t depth);
+afc_error_t afc_client_get_pipeline_depth(afc_client_t client, uint32_t *depth);
+afc_error_t afc_client_set_segment_sizes(afc_client_t client, uint32_t read_size, uint32_t write_size);
+afc_error_t afc_client_set_auto_tune(afc_client_t client, int enable);
+afc_error_t afc_client_set_multiplexing(afc_client_t client, int enable);
+afc_error_t afc_client_get_metrics(afc_client_t client, idevice_connection_metrics_t *metrics);
 afc_error_t afc_get_device_info(afc_client_t client, char ***infos);
 afc_error_t afc_read_directory(afc_client_t client, const char *dir, char ***list);
 afc_error_t afc_get_file_info(afc_client_t client, const char *filename, char ***infolist);
+afc_error_t afc_walk(afc_client_t client, const char *path, afc_walk_cb_t callback, void *user_data);
+afc_error_t afc_upload_file(afc_client_t client, const char *local_path, const char *remote_path, afc_progress_cb_t callback, void *user_data);
+afc_error_t afc_transfer_files(idevice_t device, uint16_t port, uint32_t connections, afc_transfer_item_t *items, uint32_t count, afc_transfer_progress_cb_t callback, void *user_data);
 afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle);
 afc_error_t afc_file_close(afc_client_t client, uint64_t handle);
 afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation);
 afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read);
 afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written);
+afc_error_t afc_file_pread(afc_client_t client, uint64_t handle, uint64_t offset, char *data, uint64_t length, uint64_t *bytes_read);
+afc_error_t afc_file_pwrite(afc_client_t client, uint64_t handle, uint64_t offset, const char *data, uint64_t length, uint64_t *bytes_written);
 afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence);
 afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position);
 afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t newsize);
@@ -37,6 +37,7 @@ extern "C" {
 #define FILE_RELAY_E_MUX_ERROR             -3
 #define FILE_RELAY_E_INVALID_SOURCE        -4
 #define FILE_RELAY_E_STAGING_EMPTY         -5
+#define FILE_RELAY_E_ARCHIVE_ERROR         -6
 
 #define FILE_RELAY_E_UNKNOWN_ERROR       -256
 /*@}*/
@@ -47,10 +48,24 @@ typedef int16_t file_relay_error_t;
 typedef struct file_relay_client_private file_relay_client_private;
 typedef file_relay_client_private *file_relay_client_t; /**< The client handle. */
 
+/** An entry of the archive sent by the device. */
+typedef struct {
+	const char *name; /**< Path relative to the archive root. */
+	uint32_t mode; /**< File type and permissions, see stat(2). */
+	uint32_t mtime; /**< Modification time in seconds since the epoch. */
+	uint64_t size; /**< Size of the entry data. */
+} file_relay_entry;
+typedef file_relay_entry *file_relay_entry_t; /**< An archive entry. */
+
+/** Called with consecutive pieces of the data of an archive entry. Return non-zero to stop. */
+typedef int (*file_relay_entry_cb_t) (file_relay_entry_t entry, uint64_t offset, const char *data, uint32_t length, void *user_data);
+
 file_relay_error_t file_relay_client_new(idevice_t device, uint16_t port, file_relay_client_t *client);
 file_relay_error_t file_relay_client_free(file_relay_client_t client);
 
 file_relay_error_t file_relay_request_sources(file_relay_client_t client, const char **sources, idevice_connection_t *connection);
+file_relay_error_t file_relay_request_sources_with_callback(file_relay_client_t client, const char **sources, file_relay_entry_cb_t callback, void *user_data);
+file_relay_error_t file_relay_request_sources_to_directory(file_relay_client_t client, const char **sources, const char *path);
 
 #ifdef __cplusplus
 }
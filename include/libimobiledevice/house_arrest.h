@@ -37,6 +37,7 @@ extern "C" {
 #define HOUSE_ARREST_E_PLIST_ERROR           -2
 #define HOUSE_ARREST_E_CONN_FAILED           -3
 #define HOUSE_ARREST_E_INVALID_MODE          -4
+#define HOUSE_ARREST_E_VEND_FAILED           -5
 
 #define HOUSE_ARREST_E_UNKNOWN_ERROR       -256
 /*@}*/
@@ -47,6 +48,9 @@ typedef int16_t house_arrest_error_t;
 typedef struct house_arrest_client_private house_arrest_client_private;
 typedef house_arrest_client_private *house_arrest_client_t; /**< The client handle. */
 
+typedef struct house_arrest_pool_private house_arrest_pool_private;
+typedef house_arrest_pool_private *house_arrest_pool_t; /**< A pool of AFC clients for app containers. */
+
 /* Interface */
 house_arrest_error_t house_arrest_client_new(idevice_t device, uint16_t port, house_arrest_client_t *client);
 house_arrest_error_t house_arrest_client_free(house_arrest_client_t client);
@@ -57,6 +61,11 @@ house_arrest_error_t house_arrest_get_result(house_arrest_client_t client, plist
 
 afc_error_t afc_client_new_from_house_arrest_client(house_arrest_client_t client, afc_client_t *afc_client);
 
+house_arrest_error_t house_arrest_pool_new(idevice_t device, uint32_t max_clients, house_arrest_pool_t *pool);
+house_arrest_error_t house_arrest_pool_free(house_arrest_pool_t pool);
+house_arrest_error_t house_arrest_pool_acquire(house_arrest_pool_t pool, const char *command, const char *appid, afc_client_t *afc);
+house_arrest_error_t house_arrest_pool_release(house_arrest_pool_t pool, afc_client_t afc);
+
 #ifdef __cplusplus
 }
 #endif
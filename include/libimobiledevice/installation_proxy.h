@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/afc.h>
 #include <glib.h>
 
 /** @name Error Codes */
@@ -51,11 +52,23 @@ typedef instproxy_client_private *instproxy_client_t; /**< The client handle. */
 /** Reports the status of the given operation */
 typedef void (*instproxy_status_cb_t) (const char *operation, plist_t status, void *user_data);
 
+/** Receives a batch of applications found by instproxy_browse_with_callback() */
+typedef void (*instproxy_browse_cb_t) (plist_t apps, void *user_data);
+
+typedef struct instproxy_queue_private instproxy_queue_private;
+typedef instproxy_queue_private *instproxy_queue_t; /**< The operation queue handle. */
+
+/** Reports the status of a queued operation on the given item, which is
+ *  the package path on the device or the application identifier */
+typedef void (*instproxy_queue_cb_t) (const char *operation, const char *item, plist_t status, instproxy_error_t result, void *user_data);
+
 /* Interface */
 instproxy_error_t instproxy_client_new(idevice_t device, uint16_t port, instproxy_client_t *client);
 instproxy_error_t instproxy_client_free(instproxy_client_t client);
+instproxy_error_t instproxy_client_get_metrics(instproxy_client_t client, idevice_connection_metrics_t *metrics);
 
 instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result);
+instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_browse_cb_t callback, void *user_data);
 instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 instproxy_error_t instproxy_uninstall(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
@@ -65,8 +78,15 @@ instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid
 instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 instproxy_error_t instproxy_remove_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+instproxy_error_t instproxy_queue_new(instproxy_client_t client, afc_client_t afc, instproxy_queue_cb_t callback, void *user_data, instproxy_queue_t *queue);
+instproxy_error_t instproxy_queue_free(instproxy_queue_t queue);
+instproxy_error_t instproxy_queue_add_install(instproxy_queue_t queue, const char *local_path, plist_t client_options, int upgrade);
+instproxy_error_t instproxy_queue_add_uninstall(instproxy_queue_t queue, const char *appid, plist_t client_options);
+instproxy_error_t instproxy_queue_wait(instproxy_queue_t queue);
+
 plist_t instproxy_client_options_new();
 void instproxy_client_options_add(plist_t client_options, ...) G_GNUC_NULL_TERMINATED;
+void instproxy_client_options_set_return_attributes(plist_t client_options, ...) G_GNUC_NULL_TERMINATED;
 void instproxy_client_options_free(plist_t client_options);
 
 #ifdef __cplusplus
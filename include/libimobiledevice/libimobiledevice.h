@@ -30,6 +30,7 @@ extern "C" {
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <plist/plist.h>
 
 /** @name Error Codes */
@@ -41,6 +42,8 @@ extern "C" {
 #define IDEVICE_E_NOT_ENOUGH_DATA       -4
 #define IDEVICE_E_BAD_HEADER            -5
 #define IDEVICE_E_SSL_ERROR             -6
+#define IDEVICE_E_TIMEOUT               -7
+#define IDEVICE_E_CANCELLED             -8
 /*@}*/
 
 /** Represents an error code. */
@@ -52,8 +55,97 @@ typedef idevice_private *idevice_t; /**< The device handle. */
 typedef struct idevice_connection_private idevice_connection_private;
 typedef idevice_connection_private *idevice_connection_t; /**< The connection handle. */
 
+typedef struct idevice_reactor_private idevice_reactor_private;
+typedef idevice_reactor_private *idevice_reactor_t; /**< The reactor handle. */
+
+typedef struct idevice_event_hub_private idevice_event_hub_private;
+typedef idevice_event_hub_private *idevice_event_hub_t; /**< The event hub handle. */
+
+typedef struct idevice_cancel_private idevice_cancel_private;
+typedef idevice_cancel_private *idevice_cancel_t; /**< The cancellation token handle. */
+
+/** Number of buckets in the round trip time histogram of a connection */
+#define IDEVICE_METRICS_RTT_BUCKETS 16
+
+/**
+ * Transfer statistics of a connection. Times are in microseconds.
+ *
+ * Bucket 0 of rtt_histogram counts round trips below 64us, bucket i counts
+ * round trips from 32us << i up to 64us << i, and the last bucket counts
+ * everything longer. A round trip is the time from a send to the next
+ * receive that returns data.
+ */
+typedef struct {
+	uint64_t bytes_sent; /**< Payload bytes sent by the application. */
+	uint64_t bytes_received; /**< Payload bytes received by the application. */
+	uint64_t wire_bytes_sent; /**< Bytes written to the transport, including TLS overhead. */
+	uint64_t wire_bytes_received; /**< Bytes read from the transport, including TLS overhead. */
+	uint64_t send_calls; /**< Number of send calls. */
+	uint64_t recv_calls; /**< Number of receive calls. */
+	uint64_t partial_reads; /**< Receives that returned less data than requested. */
+	uint64_t io_time; /**< Time spent in transport reads and writes, including waiting for the device. */
+	uint64_t ssl_time; /**< Time spent in TLS, not counting transport I/O. */
+	uint64_t plist_xml_bytes_sent; /**< Bytes of XML plists sent. */
+	uint64_t plist_xml_bytes_received; /**< Bytes of XML plists received. */
+	uint64_t plist_binary_bytes_sent; /**< Bytes of binary plists sent. */
+	uint64_t plist_binary_bytes_received; /**< Bytes of binary plists received. */
+	uint64_t rtt_count; /**< Number of round trips measured. */
+	uint64_t rtt_total; /**< Sum of all round trip times. */
+	uint64_t rtt_histogram[IDEVICE_METRICS_RTT_BUCKETS]; /**< Round trip time histogram. */
+	uint64_t lock_acquisitions; /**< Times the lock of the service client was taken, see idevice_set_lock_profiling(). */
+	uint64_t lock_contended; /**< Acquisitions that had to wait for another thread. */
+	uint64_t lock_wait_time; /**< Total time spent waiting for the lock. */
+	uint64_t lock_wait_max; /**< Longest wait for the lock. */
+	uint64_t lock_hold_time; /**< Total time the lock was held. */
+	uint64_t lock_hold_max; /**< Longest time the lock was held. */
+} idevice_connection_metrics_t;
+
+/**
+ * Callback that serves the device side of a connection to a loopback
+ * device. It is called from idevice_connect() and has to return quickly,
+ * usually after passing the socket to a thread that speaks the protocol
+ * of the service. The callback owns the socket and has to close it.
+ */
+typedef void (*idevice_loopback_cb_t) (uint16_t port, int fd, void *user_data);
+
+/** Callback to notify that data can be received from a connection. */
+typedef void (*idevice_reactor_cb_t) (idevice_connection_t connection, void *user_data);
+
+/** @name Connection setup phases reported to the trace callback */
+/*@{*/
+#define IDEVICE_TRACE_DEVICE_NEW              1 /**< idevice_new() */
+#define IDEVICE_TRACE_CONNECT                 2 /**< idevice_connect() */
+#define IDEVICE_TRACE_SSL_HANDSHAKE           3 /**< SSL handshake of a connection */
+#define IDEVICE_TRACE_LOCKDOWN_CLIENT_NEW     4 /**< lockdownd_client_new() */
+#define IDEVICE_TRACE_LOCKDOWN_QUERY_TYPE     5 /**< QueryType request */
+#define IDEVICE_TRACE_LOCKDOWN_VALIDATE_PAIR  6 /**< ValidatePair request */
+#define IDEVICE_TRACE_LOCKDOWN_PAIR           7 /**< Pair request */
+#define IDEVICE_TRACE_LOCKDOWN_START_SESSION  8 /**< StartSession request including the SSL handshake */
+#define IDEVICE_TRACE_LOCKDOWN_START_SERVICE  9 /**< StartService request */
+/*@}*/
+
+/**
+ * Callback to report how long a connection setup phase took.
+ *
+ * @param phase One of the IDEVICE_TRACE_* phases.
+ * @param target The UUID of the device, or "UUID:port" for connections.
+ * @param duration The duration of the phase in microseconds.
+ * @param result The error code the phase finished with.
+ */
+typedef void (*idevice_trace_cb_t) (int phase, const char *target, uint64_t duration, int result, void *user_data);
+
+/** @name Debug domains */
+/*@{*/
+#define IDEVICE_DEBUG_DOMAIN_GENERAL     0
+#define IDEVICE_DEBUG_DOMAIN_AFC         1
+#define IDEVICE_DEBUG_DOMAIN_SSL         2
+#define IDEVICE_DEBUG_DOMAIN_PLIST       3
+#define IDEVICE_DEBUG_DOMAIN_LOCKDOWN    4
+/*@}*/
+
 /* generic */
 void idevice_set_debug_level(int level);
+void idevice_set_debug_domain_level(int domain, int level);
 
 /* discovery (events/asynchronous) */
 /** The event type for device add or removal */
@@ -77,14 +169,26 @@ typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_dat
 /* functions */
 idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data);
 idevice_error_t idevice_event_unsubscribe();
+idevice_error_t idevice_event_hub_new(unsigned int workers, unsigned int max_pending, unsigned int debounce, idevice_event_hub_t *hub);
+idevice_error_t idevice_event_hub_free(idevice_event_hub_t hub);
+idevice_error_t idevice_event_hub_subscribe(idevice_event_hub_t hub, idevice_event_cb_t callback, void *user_data);
+idevice_error_t idevice_event_hub_unsubscribe(idevice_event_hub_t hub, idevice_event_cb_t callback, void *user_data);
 
 /* discovery (synchronous) */
 idevice_error_t idevice_get_device_list(char ***devices, int *count);
 idevice_error_t idevice_device_list_free(char **devices);
+idevice_error_t idevice_set_device_list_cache(int enable);
 
 /* device structure creation and destruction */
 idevice_error_t idevice_new(idevice_t *device, const char *uuid);
 idevice_error_t idevice_free(idevice_t device);
+idevice_error_t idevice_new_network(idevice_t *device, const char *uuid, const char *host);
+idevice_error_t idevice_new_loopback(idevice_t *device, const char *uuid, idevice_loopback_cb_t callback, void *user_data);
+idevice_error_t idevice_new_replay(idevice_t *device, const char *path);
+
+/* recording of sessions for idevice_new_replay() */
+idevice_error_t idevice_start_recording(idevice_t device, const char *path);
+idevice_error_t idevice_stop_recording(idevice_t device);
 
 /* connection/disconnection */
 idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection);
@@ -92,8 +196,32 @@ idevice_error_t idevice_disconnect(idevice_connection_t connection);
 
 /* communication */
 idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes);
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const struct iovec *iov, int iovcnt, uint32_t *sent_bytes);
 idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout);
 idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes);
+idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd);
+
+/* deadlines and cancellation */
+idevice_error_t idevice_cancel_new(idevice_cancel_t *token);
+idevice_error_t idevice_cancel_free(idevice_cancel_t token);
+idevice_error_t idevice_cancel_trigger(idevice_cancel_t token);
+idevice_error_t idevice_cancel_reset(idevice_cancel_t token);
+idevice_error_t idevice_cancel_set_deadline(idevice_cancel_t token, unsigned int timeout);
+int idevice_cancel_is_triggered(idevice_cancel_t token);
+idevice_error_t idevice_set_cancel(idevice_t device, idevice_cancel_t token);
+idevice_error_t idevice_connection_set_cancel(idevice_connection_t connection, idevice_cancel_t token);
+
+/* instrumentation */
+idevice_error_t idevice_connection_get_metrics(idevice_connection_t connection, idevice_connection_metrics_t *metrics);
+idevice_error_t idevice_connection_reset_metrics(idevice_connection_t connection);
+void idevice_set_lock_profiling(int enable);
+void idevice_set_trace_callback(idevice_trace_cb_t callback, void *user_data);
+
+/* event-driven communication */
+idevice_error_t idevice_reactor_new(unsigned int threads, idevice_reactor_t *reactor);
+idevice_error_t idevice_reactor_free(idevice_reactor_t reactor);
+idevice_error_t idevice_reactor_add(idevice_reactor_t reactor, idevice_connection_t connection, idevice_reactor_cb_t callback, void *user_data);
+idevice_error_t idevice_reactor_remove(idevice_reactor_t reactor, idevice_connection_t connection);
 
 /* misc */
 idevice_error_t idevice_get_handle(idevice_t device, uint32_t *handle);
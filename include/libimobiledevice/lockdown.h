@@ -70,6 +70,12 @@ struct lockdownd_pair_record {
 /** A pair record holding device, host and root certificates along the host_id */
 typedef struct lockdownd_pair_record *lockdownd_pair_record_t;
 
+/** Reports a changed value to the lockdown value cache callback. */
+typedef void (*lockdownd_value_changed_cb_t)(const char *uuid, const char *domain, const char *key, plist_t value, void *user_data);
+
+typedef struct lockdownd_pool_private lockdownd_pool_private;
+typedef lockdownd_pool_private *lockdownd_pool_t; /**< A pool of lockdownd clients. */
+
 /* Interface */
 lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *client, const char *label);
 lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t *client, const char *label);
@@ -77,6 +83,7 @@ lockdownd_error_t lockdownd_client_free(lockdownd_client_t client);
 
 lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type);
 lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value);
+lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, uint32_t count, plist_t *values);
 lockdownd_error_t lockdownd_set_value(lockdownd_client_t client, const char *domain, const char *key, plist_t value);
 lockdownd_error_t lockdownd_remove_value(lockdownd_client_t client, const char *domain, const char *key);
 lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char *service, uint16_t *port);
@@ -85,6 +92,7 @@ lockdownd_error_t lockdownd_stop_session(lockdownd_client_t client, const char *
 lockdownd_error_t lockdownd_send(lockdownd_client_t client, plist_t plist);
 lockdownd_error_t lockdownd_receive(lockdownd_client_t client, plist_t *plist);
 lockdownd_error_t lockdownd_pair(lockdownd_client_t client, lockdownd_pair_record_t pair_record);
+void lockdownd_prepare_pairing(void);
 lockdownd_error_t lockdownd_validate_pair(lockdownd_client_t client, lockdownd_pair_record_t pair_record);
 lockdownd_error_t lockdownd_unpair(lockdownd_client_t client, lockdownd_pair_record_t pair_record);
 lockdownd_error_t lockdownd_activate(lockdownd_client_t client, plist_t activation_record);
@@ -92,8 +100,21 @@ lockdownd_error_t lockdownd_deactivate(lockdownd_client_t client);
 lockdownd_error_t lockdownd_enter_recovery(lockdownd_client_t client);
 lockdownd_error_t lockdownd_goodbye(lockdownd_client_t client);
 
+/* Pooling */
+lockdownd_error_t lockdownd_pool_new(lockdownd_pool_t *pool);
+lockdownd_error_t lockdownd_pool_free(lockdownd_pool_t pool);
+lockdownd_error_t lockdownd_pool_set_limits(lockdownd_pool_t pool, unsigned int max_idle, unsigned int idle_timeout);
+lockdownd_error_t lockdownd_pool_acquire(lockdownd_pool_t pool, idevice_t device, const char *label, lockdownd_client_t *client);
+lockdownd_error_t lockdownd_pool_release(lockdownd_pool_t pool, lockdownd_client_t client, int reusable);
+
+/* value cache */
+lockdownd_error_t lockdownd_value_cache_set_ttl(const char *domain, const char *key, unsigned int ttl);
+lockdownd_error_t lockdownd_value_cache_set_callback(lockdownd_value_changed_cb_t callback, void *user_data);
+lockdownd_error_t lockdownd_value_cache_flush(const char *uuid);
+
 /* Helper */
 void lockdownd_client_set_label(lockdownd_client_t client, const char *label);
+lockdownd_error_t lockdownd_client_get_metrics(lockdownd_client_t client, idevice_connection_metrics_t *metrics);
 lockdownd_error_t lockdownd_get_device_uuid(lockdownd_client_t control, char **uuid);
 lockdownd_error_t lockdownd_get_device_name(lockdownd_client_t client, char **device_name);
 lockdownd_error_t lockdownd_get_sync_data_classes(lockdownd_client_t client, char ***classes, int *count);
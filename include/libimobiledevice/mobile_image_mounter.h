@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/afc.h>
 
 /** @name Error Codes */
 /*@{*/
@@ -35,6 +36,7 @@ extern "C" {
 #define MOBILE_IMAGE_MOUNTER_E_INVALID_ARG           -1
 #define MOBILE_IMAGE_MOUNTER_E_PLIST_ERROR           -2
 #define MOBILE_IMAGE_MOUNTER_E_CONN_FAILED           -3
+#define MOBILE_IMAGE_MOUNTER_E_UPLOAD_FAILED         -4
 
 #define MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR       -256
 /*@}*/
@@ -48,8 +50,10 @@ typedef mobile_image_mounter_client_private *mobile_image_mounter_client_t; /**<
 /* Interface */
 mobile_image_mounter_error_t mobile_image_mounter_new(idevice_t device, uint16_t port, mobile_image_mounter_client_t *client);
 mobile_image_mounter_error_t mobile_image_mounter_free(mobile_image_mounter_client_t client);
+mobile_image_mounter_error_t mobile_image_mounter_client_get_metrics(mobile_image_mounter_client_t client, idevice_connection_metrics_t *metrics);
 mobile_image_mounter_error_t mobile_image_mounter_lookup_image(mobile_image_mounter_client_t client, const char *image_type, plist_t *result);
 mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mounter_client_t client, const char *image_path, const char *image_signature, uint16_t signature_length, const char *image_type, plist_t *result);
+mobile_image_mounter_error_t mobile_image_mounter_upload_and_mount_image(mobile_image_mounter_client_t client, afc_client_t afc, const char *local_path, const char *image_signature, uint16_t signature_length, const char *image_type, afc_progress_cb_t callback, void *user_data, plist_t *result);
 mobile_image_mounter_error_t mobile_image_mounter_hangup(mobile_image_mounter_client_t client);
 
 #ifdef __cplusplus
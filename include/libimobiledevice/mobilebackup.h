@@ -56,6 +56,7 @@ typedef enum {
 mobilebackup_error_t mobilebackup_client_new(idevice_t device, uint16_t port, mobilebackup_client_t * client);
 mobilebackup_error_t mobilebackup_client_free(mobilebackup_client_t client);
 mobilebackup_error_t mobilebackup_receive(mobilebackup_client_t client, plist_t *plist);
+mobilebackup_error_t mobilebackup_receive_with_data(mobilebackup_client_t client, plist_t *plist, const char **data, uint64_t *length);
 mobilebackup_error_t mobilebackup_send(mobilebackup_client_t client, plist_t plist);
 mobilebackup_error_t mobilebackup_request_backup(mobilebackup_client_t client, plist_t backup_manifest, const char *base_path, const char *proto_version);
 mobilebackup_error_t mobilebackup_send_backup_file_received(mobilebackup_client_t client);
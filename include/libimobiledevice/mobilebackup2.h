@@ -50,8 +50,10 @@ typedef mobilebackup2_client_private *mobilebackup2_client_t; /**< The client ha
 
 mobilebackup2_error_t mobilebackup2_client_new(idevice_t device, uint16_t port, mobilebackup2_client_t * client);
 mobilebackup2_error_t mobilebackup2_client_free(mobilebackup2_client_t client);
+mobilebackup2_error_t mobilebackup2_client_get_metrics(mobilebackup2_client_t client, idevice_connection_metrics_t *metrics);
 mobilebackup2_error_t mobilebackup2_receive_message(mobilebackup2_client_t client, plist_t *msg_plist, char **dlmessage);
 mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, const char *data, uint32_t length, uint32_t *bytes);
+mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const struct iovec *iov, int iovcnt, uint32_t *bytes);
 mobilebackup2_error_t mobilebackup2_receive_raw(mobilebackup2_client_t client, char *data, uint32_t length, uint32_t *bytes);
 mobilebackup2_error_t mobilebackup2_version_exchange(mobilebackup2_client_t client, double local_versions[], char count, double *remote_version);
 mobilebackup2_error_t mobilebackup2_send_request(mobilebackup2_client_t client, const char *request, const char *target_identifier, const char *source_identifier, plist_t options);
@@ -65,6 +65,9 @@ typedef struct {
 } mobilesync_anchors;
 typedef mobilesync_anchors *mobilesync_anchors_t; /**< Anchors used by the device and computer. */
 
+/** Called for every batch of changes received by mobilesync_receive_changes_with_callback(). Return non-zero to stop. */
+typedef int (*mobilesync_changes_cb_t) (plist_t entities, plist_t actions, uint8_t is_last_record, void *user_data);
+
 /* Interface */
 mobilesync_error_t mobilesync_client_new(idevice_t device, uint16_t port, mobilesync_client_t * client);
 mobilesync_error_t mobilesync_client_free(mobilesync_client_t client);
@@ -81,6 +84,8 @@ mobilesync_error_t mobilesync_get_changes_from_device(mobilesync_client_t client
 mobilesync_error_t mobilesync_clear_all_records_on_device(mobilesync_client_t client);
 
 mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions);
+mobilesync_error_t mobilesync_receive_changes_message(mobilesync_client_t client, plist_t *message, plist_t *entities, uint8_t *is_last_record, plist_t *actions);
+mobilesync_error_t mobilesync_receive_changes_with_callback(mobilesync_client_t client, mobilesync_changes_cb_t callback, void *user_data);
 mobilesync_error_t mobilesync_acknowledge_changes_from_device(mobilesync_client_t client);
 
 mobilesync_error_t mobilesync_ready_to_send_changes_from_computer(mobilesync_client_t client);
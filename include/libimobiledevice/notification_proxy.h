@@ -92,10 +92,13 @@ typedef void (*np_notify_cb_t) (const char *notification, void *user_data);
 /* Interface */
 np_error_t np_client_new(idevice_t device, uint16_t port, np_client_t *client);
 np_error_t np_client_free(np_client_t client);
+np_error_t np_client_get_metrics(np_client_t client, idevice_connection_metrics_t *metrics);
 np_error_t np_post_notification(np_client_t client, const char *notification);
+np_error_t np_post_notifications(np_client_t client, const char **notification_spec);
 np_error_t np_observe_notification(np_client_t client, const char *notification);
 np_error_t np_observe_notifications(np_client_t client, const char **notification_spec);
 np_error_t np_set_notify_callback(np_client_t client, np_notify_cb_t notify_cb, void *userdata);
+np_error_t np_observe_notifications_with_callback(np_client_t client, const char **notification_spec, np_notify_cb_t notify_cb, void *user_data);
 
 #ifdef __cplusplus
 }
@@ -49,6 +49,15 @@ typedef int16_t restored_error_t;
 typedef struct restored_client_private restored_client_private;
 typedef restored_client_private *restored_client_t; /**< The client handle. */
 
+typedef struct restored_data_channel_private restored_data_channel_private;
+typedef restored_data_channel_private *restored_data_channel_t; /**< A data channel handle. */
+
+/** Called for every message received from restored while attached to a reactor. */
+typedef void (*restored_message_cb_t) (restored_client_t client, plist_t message, void *user_data);
+
+/** Reports the progress of a file sent over a data channel. */
+typedef void (*restored_progress_cb_t) (uint64_t bytes_done, uint64_t bytes_total, void *user_data);
+
 /* Interface */
 restored_error_t restored_client_new(idevice_t device, restored_client_t *client, const char *label);
 restored_error_t restored_client_free(restored_client_t client);
@@ -62,6 +71,15 @@ restored_error_t restored_goodbye(restored_client_t client);
 restored_error_t restored_start_restore(restored_client_t client);
 restored_error_t restored_reboot(restored_client_t client);
 
+restored_error_t restored_client_attach(restored_client_t client, idevice_reactor_t reactor, restored_message_cb_t callback, void *user_data);
+restored_error_t restored_client_detach(restored_client_t client);
+
+restored_error_t restored_data_channel_new(restored_client_t client, uint16_t port, restored_data_channel_t *channel);
+restored_error_t restored_data_channel_get_connection(restored_data_channel_t channel, idevice_connection_t *connection);
+restored_error_t restored_data_channel_send_file(restored_data_channel_t channel, const char *path, restored_progress_cb_t callback, void *user_data);
+restored_error_t restored_data_channel_wait(restored_data_channel_t channel);
+restored_error_t restored_data_channel_free(restored_data_channel_t channel);
+
 /* Helper */
 void restored_client_set_label(restored_client_t client, const char *label);
 
@@ -35,6 +35,7 @@ extern "C" {
 #define SBSERVICES_E_INVALID_ARG           -1
 #define SBSERVICES_E_PLIST_ERROR           -2
 #define SBSERVICES_E_CONN_FAILED           -3
+#define SBSERVICES_E_BUFFER_TOO_SMALL      -4
 
 #define SBSERVICES_E_UNKNOWN_ERROR       -256
 /*@}*/
@@ -45,12 +46,23 @@ typedef int16_t sbservices_error_t;
 typedef struct sbservices_client_private sbservices_client_private;
 typedef sbservices_client_private *sbservices_client_t; /**< The client handle. */
 
+/** Called for each icon fetched by sbservices_get_icons_pngdata(). Return non-zero to stop. */
+typedef int (*sbservices_icon_cb_t) (const char *bundleId, const char *pngdata, uint64_t pngsize, void *user_data);
+
+/** Returns a buffer of at least size bytes for the PNG data, or NULL. */
+typedef char* (*sbservices_buffer_cb_t) (uint64_t size, void *user_data);
+
 /* Interface */
 sbservices_error_t sbservices_client_new(idevice_t device, uint16_t port, sbservices_client_t *client);
 sbservices_error_t sbservices_client_free(sbservices_client_t client);
+sbservices_error_t sbservices_client_get_metrics(sbservices_client_t client, idevice_connection_metrics_t *metrics);
 sbservices_error_t sbservices_get_icon_state(sbservices_client_t client, plist_t *state, const char *format_version);
 sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist_t newstate);
 sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const char *bundleId, char **pngdata, uint64_t *pngsize);
+sbservices_error_t sbservices_get_icon_pngdata_to_buffer(sbservices_client_t client, const char *bundleId, char *buffer, uint64_t bufsize, uint64_t *pngsize);
+sbservices_error_t sbservices_get_icon_pngdata_with_buffer_cb(sbservices_client_t client, const char *bundleId, sbservices_buffer_cb_t get_buffer, void *user_data, uint64_t *pngsize);
+sbservices_error_t sbservices_get_icons_pngdata(sbservices_client_t client, const char **bundleIds, const char **bundleVersions, uint32_t count, sbservices_icon_cb_t callback, void *user_data);
+sbservices_error_t sbservices_set_icon_cache(sbservices_client_t client, const char *path);
 sbservices_error_t sbservices_get_home_screen_wallpaper_pngdata(sbservices_client_t client, char **pngdata, uint64_t *pngsize);
 
 #ifdef __cplusplus
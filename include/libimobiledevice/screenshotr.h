@@ -37,6 +37,7 @@ extern "C" {
 #define SCREENSHOTR_E_PLIST_ERROR           -2
 #define SCREENSHOTR_E_MUX_ERROR             -3
 #define SCREENSHOTR_E_BAD_VERSION           -4
+#define SCREENSHOTR_E_BUFFER_TOO_SMALL      -5
 
 #define SCREENSHOTR_E_UNKNOWN_ERROR       -256
 /*@}*/
@@ -47,9 +48,18 @@ typedef int16_t screenshotr_error_t;
 typedef struct screenshotr_client_private screenshotr_client_private;
 typedef screenshotr_client_private *screenshotr_client_t; /**< The client handle. */
 
+/** Receives a captured frame; return 0 to continue capturing. */
+typedef int (*screenshotr_frame_cb_t) (const char *imgdata, uint64_t imgsize, void *user_data);
+
+/** Returns a buffer of at least size bytes for the image data, or NULL. */
+typedef char* (*screenshotr_buffer_cb_t) (uint64_t size, void *user_data);
+
 screenshotr_error_t screenshotr_client_new(idevice_t device, uint16_t port, screenshotr_client_t * client);
 screenshotr_error_t screenshotr_client_free(screenshotr_client_t client);
 screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize);
+screenshotr_error_t screenshotr_take_screenshot_to_buffer(screenshotr_client_t client, char *buffer, uint64_t bufsize, uint64_t *imgsize);
+screenshotr_error_t screenshotr_take_screenshot_with_buffer_cb(screenshotr_client_t client, screenshotr_buffer_cb_t get_buffer, void *user_data, uint64_t *imgsize);
+screenshotr_error_t screenshotr_capture(screenshotr_client_t client, unsigned int interval, unsigned int count, screenshotr_frame_cb_t callback, void *user_data);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,64 @@
+/**
+ * @file libimobiledevice/syslog_relay.h
+ * @brief Relay the device's syslog line by line.
+ * \internal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ISYSLOG_RELAY_H
+#define ISYSLOG_RELAY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+
+/** @name Error Codes */
+/*@{*/
+#define SYSLOG_RELAY_E_SUCCESS                0
+#define SYSLOG_RELAY_E_INVALID_ARG           -1
+#define SYSLOG_RELAY_E_MUX_ERROR             -2
+#define SYSLOG_RELAY_E_TIMEOUT               -3
+
+#define SYSLOG_RELAY_E_UNKNOWN_ERROR       -256
+/*@}*/
+
+/** Represents an error code. */
+typedef int16_t syslog_relay_error_t;
+
+typedef struct syslog_relay_client_private syslog_relay_client_private;
+typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client handle. */
+
+/**
+ * Receives one line of the syslog, without the line break. The line
+ * points into the client's buffer and is only valid during the call.
+ */
+typedef void (*syslog_relay_line_cb_t) (const char *line, uint32_t length, void *user_data);
+
+syslog_relay_error_t syslog_relay_client_new(idevice_t device, uint16_t port, syslog_relay_client_t *client);
+syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client);
+
+syslog_relay_error_t syslog_relay_set_filter(syslog_relay_client_t client, const char *process, const char *pattern);
+syslog_relay_error_t syslog_relay_receive(syslog_relay_client_t client, syslog_relay_line_cb_t callback, void *user_data, unsigned int timeout);
+syslog_relay_error_t syslog_relay_client_attach(syslog_relay_client_t client, idevice_reactor_t reactor, syslog_relay_line_cb_t callback, void *user_data);
+syslog_relay_error_t syslog_relay_client_detach(syslog_relay_client_t client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,14 +23,52 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "afc.h"
 #include "idevice.h"
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_AFC
 #include "debug.h"
 
-/** The maximum size an AFC data packet can be */
+/** The default maximum size an AFC data packet can be */
 static const int MAXIMUM_PACKET_SIZE = (2 << 15);
 
+/** The default size of a single FileRefRead request */
+static const uint32_t MAXIMUM_READ_SIZE = (1 << 16);
+
+/** The default size of a single FileRefWrite request */
+static const uint32_t MAXIMUM_WRITE_SIZE = (1 << 15);
+
+/** Upper bound for configured segment sizes (the device's socket block size) */
+static const uint32_t MAXIMUM_SEGMENT_SIZE = 0x800000;
+
+/** Upper bound for segment sizes tried by auto-tuning */
+static const uint32_t MAXIMUM_TUNED_SEGMENT_SIZE = (1 << 20);
+
+/** Number of full segments measured per size while auto-tuning */
+static const int TUNING_SAMPLES = 4;
+
+/** The maximum number of requests that may be in flight at the same time */
+static const uint32_t MAXIMUM_PIPELINE_DEPTH = 32;
+
+/** Interval in milliseconds at which the demultiplexer checks for shutdown */
+static const int MUX_POLL_INTERVAL = 500;
+
+/**
+ * Frees a reply received by the demultiplexer.
+ */
+static void afc_mux_reply_free(gpointer data)
+{
+	afc_mux_reply_t *reply = (afc_mux_reply_t*)data;
+
+	if (!reply)
+		return;
+	free(reply->data);
+	free(reply);
+}
+
 /**
  * Locks an AFC client, done for thread safety stuff
  * 
@@ -39,7 +77,7 @@ static const int MAXIMUM_PACKET_SIZE = (2 << 15);
 static void afc_lock(afc_client_t client)
 {
 	debug_info("Locked");
-	g_mutex_lock(client->mutex);
+	client->lock_time = idevice_connection_lock_mutex(client->connection, client->mutex);
 }
 
 /**
@@ -50,7 +88,11 @@ static void afc_lock(afc_client_t client)
 static void afc_unlock(afc_client_t client)
 {
 	debug_info("Unlocked");
-	g_mutex_unlock(client->mutex);
+	if (client->mux_reply) {
+		afc_mux_reply_free(client->mux_reply);
+		client->mux_reply = NULL;
+	}
+	idevice_connection_unlock_mutex(client->connection, client->mutex, client->lock_time);
 }
 
 /**
@@ -94,6 +136,19 @@ afc_error_t afc_client_new_from_connection(idevice_connection_t connection, afc_
 	client_loc->file_handle = 0;
 	client_loc->lock = 0;
 	client_loc->mutex = g_mutex_new();
+	client_loc->pipeline_depth = 1;
+	client_loc->max_packet_size = MAXIMUM_PACKET_SIZE;
+	memset(&client_loc->read_segment, '\0', sizeof(afc_segment_t));
+	client_loc->read_segment.size = MAXIMUM_READ_SIZE;
+	memset(&client_loc->write_segment, '\0', sizeof(afc_segment_t));
+	client_loc->write_segment.size = MAXIMUM_WRITE_SIZE;
+	client_loc->mux_thread = NULL;
+	client_loc->mux_mutex = NULL;
+	client_loc->mux_cond = NULL;
+	client_loc->mux_pending = NULL;
+	client_loc->mux_running = 0;
+	client_loc->mux_error = 0;
+	client_loc->mux_reply = NULL;
 
 	*client = client_loc;
 	return AFC_E_SUCCESS;
@@ -150,6 +205,8 @@ afc_error_t afc_client_free(afc_client_t client)
 	if (!client || !client->afc_packet)
 		return AFC_E_INVALID_ARG;
 
+	afc_client_set_multiplexing(client, 0);
+
 	if (client->own_connection && client->connection) {
 		idevice_disconnect(client->connection);
 		client->connection = NULL;
@@ -162,6 +219,471 @@ afc_error_t afc_client_free(afc_client_t client)
 	return AFC_E_SUCCESS;
 }
 
+/**
+ * Gets the transfer statistics of the connection used by an AFC client,
+ * including the round trip times of its requests and the lock statistics
+ * of the client when enabled with idevice_set_lock_profiling().
+ *
+ * @param client The AFC client.
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG when a parameter
+ *     is invalid.
+ */
+afc_error_t afc_client_get_metrics(afc_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->connection || !metrics)
+		return AFC_E_INVALID_ARG;
+
+	if (idevice_connection_get_metrics(client->connection, metrics) != IDEVICE_E_SUCCESS)
+		return AFC_E_INVALID_ARG;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives exactly length bytes from the connection of a client.
+ *
+ * @return 1 on success, 0 if the connection failed or was closed.
+ */
+static int afc_mux_receive_all(afc_client_t client, char *data, uint32_t length)
+{
+	uint32_t current_count = 0, bytes = 0;
+
+	while (current_count < length) {
+		bytes = 0;
+		if ((idevice_connection_receive(client->connection, data + current_count, length - current_count, &bytes) != IDEVICE_E_SUCCESS) || (bytes == 0))
+			return 0;
+		current_count += bytes;
+	}
+	return 1;
+}
+
+/**
+ * Thread reading all replies arriving on a multiplexed client. Every reply
+ * is received completely and handed to the thread waiting for its packet
+ * number. Replies nobody waits for are dropped.
+ */
+static gpointer afc_mux_reader(gpointer data)
+{
+	afc_client_t client = (afc_client_t)data;
+	struct pollfd pfd;
+	AFCPacket header;
+	int fd = -1;
+	int res;
+
+	if (idevice_connection_get_fd(client->connection, &fd) != IDEVICE_E_SUCCESS)
+		goto leave;
+
+	while (1) {
+		g_mutex_lock(client->mux_mutex);
+		res = client->mux_running;
+		g_mutex_unlock(client->mux_mutex);
+		if (!res)
+			break;
+
+		/* wait for data so that a shutdown request is noticed */
+		if (!idevice_connection_has_pending_data(client->connection)) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			res = poll(&pfd, 1, MUX_POLL_INTERVAL);
+			if ((res < 0) && (errno == EINTR))
+				continue;
+			if (res == 0)
+				continue;
+			if (res < 0)
+				break;
+		}
+
+		if (!afc_mux_receive_all(client, (char*)&header, sizeof(AFCPacket))) {
+			debug_info("connection closed");
+			break;
+		}
+
+		uint64_t entire_length = GUINT64_FROM_LE(header.entire_length);
+		uint64_t packet_num = GUINT64_FROM_LE(header.packet_num);
+		if ((entire_length < sizeof(AFCPacket)) || (entire_length > sizeof(AFCPacket) + MAXIMUM_SEGMENT_SIZE)) {
+			debug_info("Invalid AFCPacket header received!");
+			break;
+		}
+
+		afc_mux_reply_t *reply = (afc_mux_reply_t*)malloc(sizeof(afc_mux_reply_t));
+		reply->length = (uint32_t)entire_length;
+		reply->offset = 0;
+		reply->data = (char*)malloc(reply->length);
+		memcpy(reply->data, &header, sizeof(AFCPacket));
+		if (!afc_mux_receive_all(client, reply->data + sizeof(AFCPacket), reply->length - sizeof(AFCPacket))) {
+			debug_info("could not receive the packet contents");
+			afc_mux_reply_free(reply);
+			break;
+		}
+
+		/* route the reply to its requester */
+		gpointer key = GUINT_TO_POINTER((guint)packet_num);
+		g_mutex_lock(client->mux_mutex);
+		if (g_hash_table_lookup_extended(client->mux_pending, key, NULL, NULL)) {
+			g_hash_table_replace(client->mux_pending, key, reply);
+			g_cond_broadcast(client->mux_cond);
+		} else {
+			debug_info("dropping reply to packet %lld nobody waits for", packet_num);
+			afc_mux_reply_free(reply);
+		}
+		g_mutex_unlock(client->mux_mutex);
+	}
+
+leave:
+	/* wake up everybody so that they notice the connection is gone */
+	g_mutex_lock(client->mux_mutex);
+	client->mux_error = 1;
+	g_cond_broadcast(client->mux_cond);
+	g_mutex_unlock(client->mux_mutex);
+
+	return NULL;
+}
+
+/**
+ * Registers the request with the given packet number as waiting for a
+ * reply from the demultiplexer. Has to be done before the request is sent.
+ * The caller must hold the client lock.
+ */
+static void afc_mux_expect(afc_client_t client, uint64_t packet_num)
+{
+	if (!client->mux_thread)
+		return;
+	g_mutex_lock(client->mux_mutex);
+	g_hash_table_insert(client->mux_pending, GUINT_TO_POINTER((guint)packet_num), NULL);
+	g_mutex_unlock(client->mux_mutex);
+}
+
+/**
+ * Unregisters a request registered with afc_mux_expect() whose reply will
+ * not be waited for, dropping the reply if it arrived already.
+ * The caller must hold the client lock.
+ */
+static void afc_mux_forget(afc_client_t client, uint64_t packet_num)
+{
+	if (!client->mux_thread)
+		return;
+	g_mutex_lock(client->mux_mutex);
+	g_hash_table_remove(client->mux_pending, GUINT_TO_POINTER((guint)packet_num));
+	g_mutex_unlock(client->mux_mutex);
+}
+
+/**
+ * Waits for the demultiplexer to deliver the reply to the request with the
+ * given packet number. The client lock is released while waiting, so other
+ * threads can send their requests in the meantime. Afterwards the reply is
+ * the current reply of the client, from which afc_receive_raw() reads.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_MUX_ERROR when the connection
+ *     failed before the reply arrived.
+ */
+static afc_error_t afc_mux_wait(afc_client_t client, uint64_t packet_num)
+{
+	gpointer key = GUINT_TO_POINTER((guint)packet_num);
+	gpointer reply = NULL;
+
+	if (client->mux_reply) {
+		afc_mux_reply_free(client->mux_reply);
+		client->mux_reply = NULL;
+	}
+
+	/* other requests may go out while this one waits for its reply */
+	idevice_connection_unlock_mutex(client->connection, client->mutex, client->lock_time);
+	g_mutex_lock(client->mux_mutex);
+	while (1) {
+		if (!g_hash_table_lookup_extended(client->mux_pending, key, NULL, &reply)) {
+			/* never registered */
+			reply = NULL;
+			break;
+		}
+		if (reply || client->mux_error)
+			break;
+		g_cond_wait(client->mux_cond, client->mux_mutex);
+	}
+	if (reply) {
+		g_hash_table_steal(client->mux_pending, key);
+	} else {
+		g_hash_table_remove(client->mux_pending, key);
+	}
+	g_mutex_unlock(client->mux_mutex);
+	client->lock_time = idevice_connection_lock_mutex(client->connection, client->mutex);
+
+	if (!reply)
+		return AFC_E_MUX_ERROR;
+	client->mux_reply = (afc_mux_reply_t*)reply;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives reply data for a client, either from the connection or, on a
+ * multiplexed client, from the reply currently being processed.
+ */
+static idevice_error_t afc_receive_raw(afc_client_t client, char *data, uint32_t length, uint32_t *bytes)
+{
+	if (client->mux_thread) {
+		afc_mux_reply_t *reply = client->mux_reply;
+		uint32_t available = reply ? (reply->length - reply->offset) : 0;
+		if (length > available)
+			length = available;
+		if (length > 0) {
+			memcpy(data, reply->data + reply->offset, length);
+			reply->offset += length;
+		}
+		*bytes = length;
+		return IDEVICE_E_SUCCESS;
+	}
+	return idevice_connection_receive(client->connection, data, length, bytes);
+}
+
+/**
+ * Enables or disables the request demultiplexer of an AFC client.
+ *
+ * Without it, every operation holds the client lock from sending its
+ * request until its reply is received, so threads sharing a client are
+ * fully serialized. With it, a reader thread receives all replies and
+ * routes them back to the waiting threads by packet number. The lock is
+ * then only held while a request is sent or a reply is processed, so
+ * independent operations of many threads overlap on one connection.
+ *
+ * @note The demultiplexer must not be disabled while other threads are
+ *     using the client.
+ *
+ * @param client The AFC client.
+ * @param enable 1 to enable the demultiplexer, 0 to disable it.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG when client is NULL,
+ *     AFC_E_OP_NOT_SUPPORTED when the connection has no file descriptor the
+ *     reader thread could wait on (e.g. a replayed session) or
+ *     AFC_E_UNKNOWN_ERROR when the reader thread could not be started.
+ */
+afc_error_t afc_client_set_multiplexing(afc_client_t client, int enable)
+{
+	if (!client || !client->connection)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	if (enable && !client->mux_thread) {
+		int fd = -1;
+		if (idevice_connection_get_fd(client->connection, &fd) != IDEVICE_E_SUCCESS) {
+			debug_info("connection has no file descriptor to wait on");
+			afc_unlock(client);
+			return AFC_E_OP_NOT_SUPPORTED;
+		}
+		client->mux_mutex = g_mutex_new();
+		client->mux_cond = g_cond_new();
+		client->mux_pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, afc_mux_reply_free);
+		client->mux_running = 1;
+		client->mux_error = 0;
+		client->mux_thread = g_thread_create(afc_mux_reader, client, TRUE, NULL);
+		if (!client->mux_thread) {
+			debug_info("could not start the reader thread");
+			g_hash_table_destroy(client->mux_pending);
+			client->mux_pending = NULL;
+			g_cond_free(client->mux_cond);
+			client->mux_cond = NULL;
+			g_mutex_free(client->mux_mutex);
+			client->mux_mutex = NULL;
+			afc_unlock(client);
+			return AFC_E_UNKNOWN_ERROR;
+		}
+	} else if (!enable && client->mux_thread) {
+		g_mutex_lock(client->mux_mutex);
+		client->mux_running = 0;
+		g_mutex_unlock(client->mux_mutex);
+		g_thread_join(client->mux_thread);
+		client->mux_thread = NULL;
+		if (client->mux_reply) {
+			afc_mux_reply_free(client->mux_reply);
+			client->mux_reply = NULL;
+		}
+		g_hash_table_destroy(client->mux_pending);
+		client->mux_pending = NULL;
+		g_cond_free(client->mux_cond);
+		client->mux_cond = NULL;
+		g_mutex_free(client->mux_mutex);
+		client->mux_mutex = NULL;
+	}
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Sets the number of requests an AFC client may keep in flight when reading
+ * from or writing to a file. With a depth greater than 1, afc_file_read()
+ * and afc_file_write() send several FileRefRead or FileRefWrite requests
+ * before waiting for the first reply, which hides the round trip latency of
+ * the connection during bulk transfers.
+ *
+ * @param client The AFC client to configure.
+ * @param depth Number of outstanding requests. 1 (the default) disables
+ *     pipelining, values larger than 32 are clamped.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if client is NULL
+ *     or depth is 0.
+ */
+afc_error_t afc_client_set_pipeline_depth(afc_client_t client, uint32_t depth)
+{
+	if (!client || depth == 0)
+		return AFC_E_INVALID_ARG;
+
+	if (depth > MAXIMUM_PIPELINE_DEPTH)
+		depth = MAXIMUM_PIPELINE_DEPTH;
+
+	afc_lock(client);
+	client->pipeline_depth = depth;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Gets the number of requests an AFC client keeps in flight when reading
+ * from or writing to a file.
+ *
+ * @param client The AFC client.
+ * @param depth Will be set to the pipeline depth of the client.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if client or depth
+ *     is NULL.
+ */
+afc_error_t afc_client_get_pipeline_depth(afc_client_t client, uint32_t *depth)
+{
+	if (!client || !depth)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	*depth = client->pipeline_depth;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Sets the segment sizes an AFC client uses for file transfers. Larger
+ * segments mean fewer round trips, but not every device accepts them.
+ *
+ * @param client The AFC client to configure.
+ * @param read_size Maximum number of bytes requested by a single read
+ *     request, or 0 to keep the current value.
+ * @param write_size Maximum number of bytes sent with a single write
+ *     request, or 0 to keep the current value.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if client is NULL
+ *     or a size exceeds 8 MB.
+ */
+afc_error_t afc_client_set_segment_sizes(afc_client_t client, uint32_t read_size, uint32_t write_size)
+{
+	if (!client || (read_size > MAXIMUM_SEGMENT_SIZE) || (write_size > MAXIMUM_SEGMENT_SIZE))
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	if (read_size) {
+		client->read_segment.size = read_size;
+		client->read_segment.tuning = 0;
+	}
+	if (write_size) {
+		client->write_segment.size = write_size;
+		client->write_segment.tuning = 0;
+	}
+	if (client->read_segment.size > client->max_packet_size)
+		client->max_packet_size = client->read_segment.size;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Initializes auto-tuning for the given segment.
+ */
+static void afc_segment_start_tuning(afc_segment_t *segment)
+{
+	segment->tuning = 1;
+	segment->best_size = segment->size;
+	segment->best_rate = 0;
+	segment->bytes = 0;
+	segment->elapsed = 0;
+	segment->samples = 0;
+}
+
+/**
+ * Enables or disables auto-tuning of the transfer segment sizes.
+ * While tuning, the client measures the throughput of the first full-sized
+ * segments, doubles the segment size as long as throughput improves, and
+ * then keeps the size that performed best. Reads and writes are tuned
+ * independently.
+ *
+ * @param client The AFC client to configure.
+ * @param enable 1 to start auto-tuning, 0 to stop it and keep the current
+ *     segment sizes.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if client is NULL.
+ */
+afc_error_t afc_client_set_auto_tune(afc_client_t client, int enable)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	if (enable) {
+		afc_segment_start_tuning(&client->read_segment);
+		afc_segment_start_tuning(&client->write_segment);
+		if (MAXIMUM_TUNED_SEGMENT_SIZE > client->max_packet_size)
+			client->max_packet_size = MAXIMUM_TUNED_SEGMENT_SIZE;
+	} else {
+		client->read_segment.tuning = 0;
+		client->write_segment.tuning = 0;
+	}
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Records the time a full segment took to transfer while auto-tuning and
+ * moves on to the next segment size once enough samples were collected.
+ *
+ * @param segment The segment being tuned.
+ * @param bytes Number of bytes transferred.
+ * @param start Time the transfer was started.
+ */
+static void afc_segment_sample(afc_segment_t *segment, uint32_t bytes, GTimeVal *start)
+{
+	GTimeVal now;
+	double rate = 0;
+
+	if (!segment->tuning || (bytes < segment->size))
+		return;
+
+	g_get_current_time(&now);
+	segment->elapsed += (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_usec - start->tv_usec) / G_USEC_PER_SEC;
+	segment->bytes += bytes;
+	if (++segment->samples < TUNING_SAMPLES)
+		return;
+
+	if (segment->elapsed > 0)
+		rate = (double)segment->bytes / segment->elapsed;
+	debug_info("segment size %d: %.0f bytes/s", segment->size, rate);
+
+	segment->bytes = 0;
+	segment->elapsed = 0;
+	segment->samples = 0;
+
+	/* only keep growing while it is a measurable improvement */
+	if (rate > segment->best_rate * 1.05) {
+		segment->best_rate = rate;
+		segment->best_size = segment->size;
+		if (segment->size * 2 <= MAXIMUM_TUNED_SEGMENT_SIZE) {
+			segment->size *= 2;
+			return;
+		}
+	}
+	segment->size = segment->best_size;
+	segment->tuning = 0;
+	debug_info("using segment size %d", segment->size);
+}
+
 /**
  * Dispatches an AFC packet over a client.
  * 
@@ -191,6 +713,7 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, const char *data, ui
 		length = 0;
 
 	client->afc_packet->packet_num++;
+	afc_mux_expect(client, client->afc_packet->packet_num);
 	if (!client->afc_packet->entire_length) {
 		client->afc_packet->entire_length = (length) ? sizeof(AFCPacket) + length : sizeof(AFCPacket);
 		client->afc_packet->this_length = client->afc_packet->entire_length;
@@ -209,6 +732,7 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, const char *data, ui
 			debug_info("Length did not resemble what it was supposed to based on packet");
 			debug_info("length minus offset: %i", length - offset);
 			debug_info("rest of packet: %i\n", client->afc_packet->entire_length - client->afc_packet->this_length);
+			afc_mux_forget(client, client->afc_packet->packet_num);
 			return AFC_E_INTERNAL_ERROR;
 		}
 
@@ -270,56 +794,82 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, const char *data, ui
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
- * 
+ * Receives and validates the AFC header of the reply to the request with
+ * the given packet number.
+ *
  * @param client The client to receive data on.
- * @param dump_here The char* to point to the newly-received data.
- * @param bytes_recv How much data was received.
- * 
+ * @param packet_num The packet number of the request this reply belongs to.
+ * @param header Will be filled with the received header in host byte order.
+ *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **dump_here, uint32_t *bytes_recv)
+static afc_error_t afc_receive_header(afc_client_t client, uint64_t packet_num, AFCPacket *header)
 {
-	AFCPacket header;
-	uint32_t entire_len = 0;
-	uint32_t this_len = 0;
-	uint32_t current_count = 0;
-	uint64_t param1 = -1;
+	uint32_t bytes = 0;
 
-	*bytes_recv = 0;
+	if (client->mux_thread && (afc_mux_wait(client, packet_num) != AFC_E_SUCCESS))
+		return AFC_E_MUX_ERROR;
 
 	/* first, read the AFC header */
-	idevice_connection_receive(client->connection, (char*)&header, sizeof(AFCPacket), bytes_recv);
-	AFCPacket_from_LE(&header);
-	if (*bytes_recv == 0) {
+	afc_receive_raw(client, (char*)header, sizeof(AFCPacket), &bytes);
+	AFCPacket_from_LE(header);
+	if (bytes == 0) {
 		debug_info("Just didn't get enough.");
-		*dump_here = NULL;
 		return AFC_E_MUX_ERROR;
-	} else if (*bytes_recv < sizeof(AFCPacket)) {
+	} else if (bytes < sizeof(AFCPacket)) {
 		debug_info("Did not even get the AFCPacket header");
-		*dump_here = NULL;
 		return AFC_E_MUX_ERROR;
 	}
 
 	/* check if it's a valid AFC header */
-	if (strncmp(header.magic, AFC_MAGIC, AFC_MAGIC_LEN)) {
+	if (strncmp(header->magic, AFC_MAGIC, AFC_MAGIC_LEN)) {
 		debug_info("Invalid AFC packet received (magic != " AFC_MAGIC ")!");
 	}
 
 	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
+	if (header->packet_num != packet_num) {
 		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
-		*dump_here = NULL;
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header->packet_num, packet_num);
 		return AFC_E_OP_HEADER_INVALID;
 	}
 
-	/* then, read the attached packet */
-	if (header.this_length < sizeof(AFCPacket)) {
+	if (header->this_length < sizeof(AFCPacket)) {
 		debug_info("Invalid AFCPacket header received!");
-		*dump_here = NULL;
 		return AFC_E_OP_HEADER_INVALID;
-	} else if ((header.this_length == header.entire_length)
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives the reply to the request with the given packet number.
+ * 
+ * @param client The client to receive data on.
+ * @param packet_num The packet number of the request this reply belongs to.
+ * @param dump_here The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ * 
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_reply(afc_client_t client, uint64_t packet_num, char **dump_here, uint32_t *bytes_recv)
+{
+	AFCPacket header;
+	uint32_t entire_len = 0;
+	uint32_t this_len = 0;
+	uint32_t current_count = 0;
+	uint64_t param1 = -1;
+	afc_error_t ret;
+
+	*bytes_recv = 0;
+
+	ret = afc_receive_header(client, packet_num, &header);
+	if (ret != AFC_E_SUCCESS) {
+		*dump_here = NULL;
+		return ret;
+	}
+
+	/* then, read the attached packet */
+	if ((header.this_length == header.entire_length)
 			&& header.entire_length == sizeof(AFCPacket)) {
 		debug_info("Empty AFCPacket received!");
 		*dump_here = NULL;
@@ -337,13 +887,13 @@ static afc_error_t afc_receive_data(afc_client_t client, char **dump_here, uint3
 	this_len = (uint32_t)header.this_length - sizeof(AFCPacket);
 
 	/* this is here as a check (perhaps a different upper limit is good?) */
-	if (entire_len > (uint32_t)MAXIMUM_PACKET_SIZE) {
-		fprintf(stderr, "%s: entire_len is larger than MAXIMUM_PACKET_SIZE, (%d > %d)!", __func__, entire_len, MAXIMUM_PACKET_SIZE);
+	if (entire_len > client->max_packet_size) {
+		fprintf(stderr, "%s: entire_len is larger than the maximum packet size, (%d > %d)!", __func__, entire_len, client->max_packet_size);
 	}
 
 	*dump_here = (char*)malloc(entire_len);
 	if (this_len > 0) {
-		idevice_connection_receive(client->connection, *dump_here, this_len, bytes_recv);
+		afc_receive_raw(client, *dump_here, this_len, bytes_recv);
 		if (*bytes_recv <= 0) {
 			free(*dump_here);
 			*dump_here = NULL;
@@ -361,7 +911,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **dump_here, uint3
 
 	if (entire_len > this_len) {
 		while (current_count < entire_len) {
-			idevice_connection_receive(client->connection, (*dump_here)+current_count, entire_len - current_count, bytes_recv);
+			afc_receive_raw(client, (*dump_here)+current_count, entire_len - current_count, bytes_recv);
 			if (*bytes_recv <= 0) {
 				debug_info("Error receiving data (recv returned %d)", *bytes_recv);
 				break;
@@ -419,28 +969,187 @@ static afc_error_t afc_receive_data(afc_client_t client, char **dump_here, uint3
 }
 
 /**
- * Returns counts of null characters within a string.
+ * Reads and throws away the given number of bytes from the connection.
+ *
+ * @return The number of bytes that were actually received.
  */
-static uint32_t count_nullspaces(char *string, uint32_t number)
+static uint32_t afc_receive_discard(afc_client_t client, uint32_t length)
 {
-	uint32_t i = 0, nulls = 0;
+	char scratch[256];
+	uint32_t current_count = 0, bytes = 0;
 
-	for (i = 0; i < number; i++) {
-		if (string[i] == '\0')
-			nulls++;
+	while (current_count < length) {
+		uint32_t size = ((length - current_count) < sizeof(scratch)) ? (length - current_count) : sizeof(scratch);
+		afc_receive_raw(client, scratch, size, &bytes);
+		if (bytes <= 0)
+			break;
+		current_count += bytes;
 	}
-
-	return nulls;
+	return current_count;
 }
 
 /**
- * Splits a string of tokens by null characters and returns each token in a
- * char array/list.
+ * Receives the reply to the request with the given packet number directly
+ * into a caller-supplied buffer. This avoids the temporary allocation and
+ * the extra copy that afc_receive_reply() does, which matters for bulk
+ * file reads. Data beyond the size of the buffer is discarded.
  *
- * @param tokens The characters to split into a list.
- * @param length The length of the tokens string.
+ * @param client The client to receive data on.
+ * @param packet_num The packet number of the request this reply belongs to.
+ * @param buffer The buffer to receive the payload of a data reply into, or
+ *     NULL to receive and discard it.
+ * @param length Size of buffer.
+ * @param bytes_recv Number of payload bytes received (or discarded).
  *
- * @return A char ** list with each token found in the string. The caller is
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_reply_into(afc_client_t client, uint64_t packet_num, char *buffer, uint32_t length, uint32_t *bytes_recv)
+{
+	AFCPacket header;
+	uint32_t entire_len = 0;
+	uint32_t current_count = 0, bytes = 0;
+	afc_error_t ret;
+
+	*bytes_recv = 0;
+
+	ret = afc_receive_header(client, packet_num, &header);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	entire_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
+	if (entire_len == 0) {
+		debug_info("Empty AFCPacket received!");
+		return (header.operation == AFC_OP_DATA) ? AFC_E_SUCCESS : AFC_E_IO_ERROR;
+	}
+
+	if (header.operation != AFC_OP_DATA) {
+		uint64_t param1 = -1;
+
+		/* not a data reply; only the leading status code is of interest */
+		if (entire_len >= sizeof(uint64_t)) {
+			afc_receive_raw(client, (char*)&param1, sizeof(uint64_t), &bytes);
+			if (bytes < sizeof(uint64_t))
+				return AFC_E_NOT_ENOUGH_DATA;
+			param1 = GUINT64_FROM_LE(param1);
+			afc_receive_discard(client, entire_len - sizeof(uint64_t));
+		} else {
+			afc_receive_discard(client, entire_len);
+		}
+		if (header.operation == AFC_OP_STATUS) {
+			debug_info("got a status response, code=%lld", param1);
+			return (afc_error_t)param1;
+		}
+		debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
+		return AFC_E_OP_NOT_SUPPORTED;
+	}
+
+	if (buffer) {
+		uint32_t wanted = (entire_len < length) ? entire_len : length;
+		while (current_count < wanted) {
+			afc_receive_raw(client, buffer + current_count, wanted - current_count, &bytes);
+			if (bytes <= 0) {
+				debug_info("Error receiving data (recv returned %d)", bytes);
+				break;
+			}
+			current_count += bytes;
+		}
+		if (current_count < wanted) {
+			*bytes_recv = current_count;
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+	}
+	if (current_count < entire_len) {
+		bytes = afc_receive_discard(client, entire_len - current_count);
+		if (bytes < entire_len - current_count)
+			return AFC_E_NOT_ENOUGH_DATA;
+		if (!buffer)
+			current_count += bytes;
+	}
+
+	debug_info("got a data response, size = %i", current_count);
+	*bytes_recv = current_count;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives data through an AFC client and sets a variable to the received data.
+ * The reply is expected to belong to the most recently dispatched packet.
+ * 
+ * @param client The client to receive data on.
+ * @param dump_here The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ * 
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **dump_here, uint32_t *bytes_recv)
+{
+	return afc_receive_reply(client, client->afc_packet->packet_num, dump_here, bytes_recv);
+}
+
+/**
+ * Receives the reply to the last request when only its status is of
+ * interest, without allocating a buffer for it.
+ *
+ * @param client The client to receive the reply on.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_status(afc_client_t client)
+{
+	uint32_t bytes = 0;
+	return afc_receive_reply_into(client, client->afc_packet->packet_num, NULL, 0, &bytes);
+}
+
+/**
+ * Returns a buffer for building the payload of a request. Payloads that
+ * fit are built in the scratch area of the client, which is free to use
+ * as long as the client lock is held, so paths and handles don't cost a
+ * malloc() per request. Larger ones are allocated.
+ *
+ * @param client The client, which has to be locked.
+ * @param size The size of the payload.
+ *
+ * @return The buffer, to be given back with afc_scratch_release().
+ */
+static char *afc_scratch_get(afc_client_t client, uint32_t size)
+{
+	if (size <= AFC_SCRATCH_SIZE)
+		return client->scratch;
+	return (char*)malloc(size);
+}
+
+/**
+ * Gives back a buffer returned by afc_scratch_get().
+ */
+static void afc_scratch_release(afc_client_t client, char *buffer)
+{
+	if (buffer != client->scratch)
+		free(buffer);
+}
+
+/**
+ * Returns counts of null characters within a string.
+ */
+static uint32_t count_nullspaces(char *string, uint32_t number)
+{
+	uint32_t i = 0, nulls = 0;
+
+	for (i = 0; i < number; i++) {
+		if (string[i] == '\0')
+			nulls++;
+	}
+
+	return nulls;
+}
+
+/**
+ * Splits a string of tokens by null characters and returns each token in a
+ * char array/list.
+ *
+ * @param tokens The characters to split into a list.
+ * @param length The length of the tokens string.
+ *
+ * @return A char ** list with each token found in the string. The caller is
  *  responsible for freeing the memory.
  */
 static char **make_strings_list(char *tokens, uint32_t length)
@@ -462,6 +1171,36 @@ static char **make_strings_list(char *tokens, uint32_t length)
 	return list;
 }
 
+/**
+ * Splits a string of tokens by null characters like make_strings_list(),
+ * but instead of duplicating each token the returned list points into the
+ * tokens buffer itself.
+ *
+ * @param tokens The characters to split into a list.
+ * @param length The length of the tokens string.
+ *
+ * @return A NULL-terminated char ** list that is only valid as long as the
+ *  tokens buffer is. Only the list itself has to be freed by the caller.
+ */
+static char **make_strings_index(char *tokens, uint32_t length)
+{
+	uint32_t nulls = 0, i = 0, j = 0;
+	char **list = NULL;
+
+	if (!tokens || !length)
+		return NULL;
+
+	nulls = count_nullspaces(tokens, length);
+	list = (char **) malloc(sizeof(char *) * (nulls + 1));
+	for (i = 0; i < nulls; i++) {
+		list[i] = tokens + j;
+		j += strlen(list[i]) + 1;
+	}
+	list[i] = NULL;
+
+	return list;
+}
+
 /**
  * Gets a directory listing of the directory requested.
  * 
@@ -603,7 +1342,6 @@ afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char *
  */
 afc_error_t afc_remove_path(afc_client_t client, const char *path)
 {
-	char *response = NULL;
 	uint32_t bytes = 0;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
@@ -621,9 +1359,7 @@ afc_error_t afc_remove_path(afc_client_t client, const char *path)
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &response, &bytes);
-	if (response)
-		free(response);
+	ret = afc_receive_status(client);
 
 	/* special case; unknown error actually means directory not empty */
 	if (ret == AFC_E_UNKNOWN_ERROR)
@@ -645,31 +1381,32 @@ afc_error_t afc_remove_path(afc_client_t client, const char *path)
  */
 afc_error_t afc_rename_path(afc_client_t client, const char *from, const char *to)
 {
-	char *response = NULL;
-	char *send = (char *) malloc(sizeof(char) * (strlen(from) + strlen(to) + 1 + sizeof(uint32_t)));
+	char *send = NULL;
 	uint32_t bytes = 0;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
 	if (!client || !from || !to || !client->afc_packet || !client->connection)
 		return AFC_E_INVALID_ARG;
 
+	uint32_t from_len = strlen(from) + 1;
+	uint32_t to_len = strlen(to) + 1;
+
 	afc_lock(client);
 
 	/* Send command */
-	memcpy(send, from, strlen(from) + 1);
-	memcpy(send + strlen(from) + 1, to, strlen(to) + 1);
+	send = afc_scratch_get(client, from_len + to_len);
+	memcpy(send, from, from_len);
+	memcpy(send + from_len, to, to_len);
 	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
 	client->afc_packet->operation = AFC_OP_RENAME_PATH;
-	ret = afc_dispatch_packet(client, send, strlen(to)+1 + strlen(from)+1, &bytes);
-	free(send);
+	ret = afc_dispatch_packet(client, send, from_len + to_len, &bytes);
+	afc_scratch_release(client, send);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &response, &bytes);
-	if (response)
-		free(response);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
@@ -688,7 +1425,6 @@ afc_error_t afc_rename_path(afc_client_t client, const char *from, const char *t
 afc_error_t afc_make_directory(afc_client_t client, const char *dir)
 {
 	uint32_t bytes = 0;
-	char *response = NULL;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
 	if (!client)
@@ -705,9 +1441,7 @@ afc_error_t afc_make_directory(afc_client_t client, const char *dir)
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &response, &bytes);
-	if (response)
-		free(response);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
@@ -725,171 +1459,732 @@ afc_error_t afc_make_directory(afc_client_t client, const char *dir)
  * 
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***infolist)
+afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***infolist)
+{
+	char *received = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !infolist)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	/* Send command */
+	client->afc_packet->operation = AFC_OP_GET_FILE_INFO;
+	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
+	ret = afc_dispatch_packet(client, path, strlen(path)+1, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive data */
+	ret = afc_receive_data(client, &received, &bytes);
+	if (received) {
+		*infolist = make_strings_list(received, bytes);
+		free(received);
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/** Minimum number of GetFileInfo requests kept in flight by afc_walk() */
+static const uint32_t WALK_PIPELINE_DEPTH = 16;
+
+/** A directory entry collected by afc_walk() */
+struct afc_walk_entry {
+	char *path;
+	char *info_data;
+	char **info;
+	uint64_t packet_num;
+};
+
+/**
+ * Frees a list of directory entries collected by afc_walk_directory().
+ */
+static void afc_walk_entries_free(struct afc_walk_entry *entries, uint32_t count)
+{
+	uint32_t i;
+
+	if (!entries)
+		return;
+	for (i = 0; i < count; i++) {
+		free(entries[i].path);
+		free(entries[i].info_data);
+		free(entries[i].info);
+	}
+	free(entries);
+}
+
+/**
+ * Lists a directory and gets the file information of every entry, keeping
+ * several GetFileInfo requests in flight. Entries that disappear between
+ * listing and querying them are returned without file information.
+ * The caller must hold the client lock.
+ *
+ * @param client The client to use.
+ * @param dir The directory to list.
+ * @param entries Will be set to a newly allocated list of entries.
+ * @param count Will be set to the number of entries, "." and ".." excluded.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_walk_directory(afc_client_t client, const char *dir, struct afc_walk_entry **entries, uint32_t *count)
+{
+	char *data = NULL, **names = NULL;
+	uint32_t bytes = 0, n = 0, i = 0, sent = 0, done = 0;
+	uint32_t depth = (client->pipeline_depth > WALK_PIPELINE_DEPTH) ? client->pipeline_depth : WALK_PIPELINE_DEPTH;
+	size_t dirlen = strlen(dir);
+	struct afc_walk_entry *list = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	*entries = NULL;
+	*count = 0;
+
+	/* get the directory listing */
+	client->afc_packet->operation = AFC_OP_READ_DIR;
+	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
+	ret = afc_dispatch_packet(client, dir, dirlen+1, &bytes);
+	if (ret != AFC_E_SUCCESS)
+		return AFC_E_NOT_ENOUGH_DATA;
+	ret = afc_receive_data(client, &data, &bytes);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	names = make_strings_index(data, bytes);
+	if (!names) {
+		free(data);
+		return AFC_E_SUCCESS;
+	}
+	for (i = 0; names[i]; i++) {
+		n++;
+	}
+	list = (struct afc_walk_entry *) calloc(n, sizeof(struct afc_walk_entry));
+	n = 0;
+	/* avoid a double slash when joining the entry names */
+	if (dirlen > 0 && dir[dirlen-1] == '/')
+		dirlen--;
+	for (i = 0; names[i]; i++) {
+		if (!strcmp(names[i], ".") || !strcmp(names[i], ".."))
+			continue;
+		list[n].path = (char *) malloc(dirlen + 1 + strlen(names[i]) + 1);
+		memcpy(list[n].path, dir, dirlen);
+		list[n].path[dirlen] = '/';
+		strcpy(list[n].path + dirlen + 1, names[i]);
+		n++;
+	}
+	free(names);
+	free(data);
+
+	/* get the file information of all entries */
+	while (done < n) {
+		while ((sent < n) && (sent - done < depth)) {
+			client->afc_packet->operation = AFC_OP_GET_FILE_INFO;
+			client->afc_packet->entire_length = client->afc_packet->this_length = 0;
+			if (afc_dispatch_packet(client, list[sent].path, strlen(list[sent].path)+1, &bytes) != AFC_E_SUCCESS) {
+				afc_mux_forget(client, client->afc_packet->packet_num);
+				for (; done < sent; done++)
+					afc_mux_forget(client, list[done].packet_num);
+				afc_walk_entries_free(list, n);
+				return AFC_E_NOT_ENOUGH_DATA;
+			}
+			list[sent].packet_num = client->afc_packet->packet_num;
+			sent++;
+		}
+		ret = afc_receive_reply(client, list[done].packet_num, &list[done].info_data, &bytes);
+		if (ret == AFC_E_SUCCESS) {
+			list[done].info = make_strings_index(list[done].info_data, bytes);
+		} else if ((ret == AFC_E_MUX_ERROR) || (ret == AFC_E_NOT_ENOUGH_DATA) || (ret == AFC_E_OP_HEADER_INVALID)) {
+			for (done++; done < sent; done++)
+				afc_mux_forget(client, list[done].packet_num);
+			afc_walk_entries_free(list, n);
+			return ret;
+		}
+		done++;
+	}
+
+	*entries = list;
+	*count = n;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Checks whether a file information list describes a directory.
+ */
+static int afc_info_is_directory(char **info)
+{
+	int i;
+
+	if (!info)
+		return 0;
+	for (i = 0; info[i] && info[i+1]; i += 2) {
+		if (!strcmp(info[i], "st_ifmt"))
+			return !strcmp(info[i+1], "S_IFDIR");
+	}
+	return 0;
+}
+
+/**
+ * Recursively walks a directory tree on the device and calls a callback
+ * function for every entry together with its file information.
+ *
+ * Each directory is listed and the information of all of its entries is
+ * requested with several GetFileInfo requests in flight, which is much
+ * faster than calling afc_read_directory() and afc_get_file_info() for every
+ * entry. The client is not locked while the callback runs, so it may use
+ * the same client to access the reported entries. Symbolic links are not
+ * followed.
+ *
+ * @param client The client to use.
+ * @param path The directory to walk. (must be a fully-qualified path)
+ * @param callback Function called for every entry. The path and the
+ *     NULL-terminated key/value list of file information passed to it are
+ *     only valid during the call. Return a non-zero value to stop the walk.
+ * @param user_data Pointer passed to the callback function.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *     stopped the walk, or an AFC_E_* error value.
+ */
+afc_error_t afc_walk(afc_client_t client, const char *path, afc_walk_cb_t callback, void *user_data)
+{
+	GQueue *dirs = NULL;
+	char *dir = NULL;
+	int toplevel = 1;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->connection || !path || !callback)
+		return AFC_E_INVALID_ARG;
+
+	dirs = g_queue_new();
+	g_queue_push_tail(dirs, strdup(path));
+
+	while ((dir = (char *) g_queue_pop_head(dirs))) {
+		struct afc_walk_entry *entries = NULL;
+		uint32_t count = 0, i;
+
+		afc_lock(client);
+		ret = afc_walk_directory(client, dir, &entries, &count);
+		afc_unlock(client);
+		free(dir);
+
+		if (ret != AFC_E_SUCCESS) {
+			if (toplevel || (ret == AFC_E_MUX_ERROR) || (ret == AFC_E_NOT_ENOUGH_DATA) || (ret == AFC_E_OP_HEADER_INVALID))
+				break;
+			/* skip subdirectories we are not allowed to list */
+			ret = AFC_E_SUCCESS;
+			continue;
+		}
+		toplevel = 0;
+
+		for (i = 0; i < count; i++) {
+			if (!entries[i].info)
+				continue;
+			if (callback(entries[i].path, entries[i].info, user_data)) {
+				ret = AFC_E_OP_INTERRUPTED;
+				break;
+			}
+			if (afc_info_is_directory(entries[i].info)) {
+				g_queue_push_tail(dirs, entries[i].path);
+				entries[i].path = NULL;
+			}
+		}
+		afc_walk_entries_free(entries, count);
+		if (ret != AFC_E_SUCCESS)
+			break;
+	}
+
+	while ((dir = (char *) g_queue_pop_head(dirs))) {
+		free(dir);
+	}
+	g_queue_free(dirs);
+
+	return ret;
+}
+
+/**
+ * Opens a file on the phone.
+ * 
+ * @param client The client to use to open the file. 
+ * @param filename The file to open. (must be a fully-qualified path)
+ * @param file_mode The mode to use to open the file. Can be AFC_FILE_READ or
+ * 		    AFC_FILE_WRITE; the former lets you read and write,
+ * 		    however, and the second one will *create* the file,
+ * 		    destroying anything previously there.
+ * @param handle Pointer to a uint64_t that will hold the handle of the file
+ * 
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+idevice_error_t
+afc_file_open(afc_client_t client, const char *filename,
+					 afc_file_mode_t file_mode, uint64_t *handle)
+{
+	uint64_t file_mode_loc = GUINT64_TO_LE(file_mode);
+	uint32_t bytes = 0;
+	char *data = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	/* set handle to 0 so in case an error occurs, the handle is invalid */
+	*handle = 0;
+
+	if (!client || !client->connection || !client->afc_packet || !filename)
+		return AFC_E_INVALID_ARG;
+
+	uint32_t filename_len = strlen(filename) + 1;
+
+	afc_lock(client);
+
+	/* Send command */
+	data = afc_scratch_get(client, 8 + filename_len);
+	memcpy(data, &file_mode_loc, 8);
+	memcpy(data + 8, filename, filename_len);
+	client->afc_packet->operation = AFC_OP_FILE_OPEN;
+	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
+	ret = afc_dispatch_packet(client, data, 8 + filename_len, &bytes);
+	afc_scratch_release(client, data);
+	data = NULL;
+
+	if (ret != AFC_E_SUCCESS) {
+		debug_info("Didn't receive a response to the command");
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data */
+	ret = afc_receive_data(client, &data, &bytes);
+	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
+		afc_unlock(client);
+
+		/* Get the file handle */
+		memcpy(handle, data, sizeof(uint64_t));
+		free(data);
+		return ret;
+	}
+
+	debug_info("Didn't get any further data");
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Sends a FileRefSeek request and waits for its reply.
+ * The caller must hold the client lock.
+ *
+ * @see afc_file_seek
+ */
+static afc_error_t afc_file_seek_internal(afc_client_t client, uint64_t handle, int64_t offset, int whence)
+{
+	char buffer[24];
+	int64_t offset_loc = (int64_t)GUINT64_TO_LE(offset);
+	uint64_t whence_loc = GUINT64_TO_LE(whence);
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	/* Send the command */
+	memcpy(buffer, &handle, sizeof(uint64_t));	/* handle */
+	memcpy(buffer + 8, &whence_loc, sizeof(uint64_t));	/* fromwhere */
+	memcpy(buffer + 16, &offset_loc, sizeof(uint64_t));	/* offset */
+	client->afc_packet->operation = AFC_OP_FILE_SEEK;
+	client->afc_packet->this_length = client->afc_packet->entire_length = 0;
+	ret = afc_dispatch_packet(client, buffer, 24, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_status(client);
+
+	return ret;
+}
+
+/**
+ * Sends a FileRefRead request for the given number of bytes.
+ * The caller must hold the client lock.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param size Number of bytes to request
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_send_read_request(afc_client_t client, uint64_t handle, uint32_t size)
+{
+	AFCFilePacket packet;
+	uint32_t bytes_loc = 0;
+
+	packet.filehandle = handle;
+	packet.size = GUINT64_TO_LE(size);
+	client->afc_packet->operation = AFC_OP_READ;
+	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
+	return afc_dispatch_packet(client, (char *) &packet, sizeof(AFCFilePacket), &bytes_loc);
+}
+
+/**
+ * Reads from a file keeping up to client->pipeline_depth FileRefRead
+ * requests in flight. Replies are matched by packet number and copied in
+ * order into the caller's buffer. The caller must hold the client lock.
+ *
+ * If the device returns less data than requested (end of file), the
+ * remaining outstanding replies are drained, and any data they carry is
+ * given back to the device by seeking backwards so that the file position
+ * matches the number of bytes returned.
+ *
+ * @see afc_file_read
+ */
+static afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	uint32_t requested = 0, current_count = 0, discarded = 0, bytes_loc = 0;
+	uint32_t inflight = 0;
+	uint32_t depth = client->pipeline_depth;
+	uint32_t issued = 0;
+	uint32_t *sizes = (uint32_t *) malloc(sizeof(uint32_t) * depth);
+	uint64_t *packets = (uint64_t *) malloc(sizeof(uint64_t) * depth);
+	int eof = 0;
+	GTimeVal last;
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t err = AFC_E_SUCCESS;
+
+	if (!sizes || !packets) {
+		free(sizes);
+		free(packets);
+		return AFC_E_NO_MEM;
+	}
+
+	g_get_current_time(&last);
+	while ((inflight > 0) || (requested < length)) {
+		/* fill up the pipeline */
+		while (!eof && (err == AFC_E_SUCCESS) && (inflight < depth) && (requested < length)) {
+			uint32_t size = ((length - requested) < client->read_segment.size) ? (length - requested) : client->read_segment.size;
+			if (afc_send_read_request(client, handle, size) != AFC_E_SUCCESS) {
+				afc_mux_forget(client, client->afc_packet->packet_num);
+				err = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			/* other threads may send in between on a multiplexed client,
+			 * so the packet numbers are not necessarily consecutive */
+			packets[issued % depth] = client->afc_packet->packet_num;
+			sizes[issued % depth] = size;
+			issued++;
+			requested += size;
+			inflight++;
+		}
+		if (inflight == 0)
+			break;
+
+		/* collect the oldest outstanding reply */
+		uint64_t packet_num = packets[(issued - inflight) % depth];
+		uint32_t size = sizes[(issued - inflight) % depth];
+		int keep = (!eof && (err == AFC_E_SUCCESS));
+		ret = afc_receive_reply_into(client, packet_num, keep ? data + current_count : NULL, size, &bytes_loc);
+		inflight--;
+		if (ret != AFC_E_SUCCESS) {
+			if (err == AFC_E_SUCCESS)
+				err = ret;
+			if ((ret == AFC_E_MUX_ERROR) || (ret == AFC_E_NOT_ENOUGH_DATA) || (ret == AFC_E_OP_HEADER_INVALID)) {
+				/* the stream is out of sync, don't try to drain it */
+				break;
+			}
+			continue;
+		}
+
+		/* in steady state replies arrive at the rate the link delivers them */
+		afc_segment_sample(&client->read_segment, bytes_loc, &last);
+		g_get_current_time(&last);
+		if (!keep) {
+			discarded += bytes_loc;
+		} else {
+			current_count += bytes_loc;
+			if (bytes_loc < size)
+				eof = 1;
+		}
+		if ((requested >= length) && (inflight == 0))
+			break;
+		if ((eof || (err != AFC_E_SUCCESS)) && (inflight == 0))
+			break;
+	}
+	/* nobody waits for the replies left when bailing out */
+	for (; inflight > 0; inflight--)
+		afc_mux_forget(client, packets[(issued - inflight) % depth]);
+	free(sizes);
+	free(packets);
+
+	if (discarded > 0) {
+		/* rewind the file position to what we actually returned */
+		debug_info("rewinding %d bytes read beyond end of data", discarded);
+		afc_file_seek_internal(client, handle, -(int64_t)discarded, SEEK_CUR);
+	}
+
+	*bytes_read = current_count;
+	return err;
+}
+
+/**
+ * Reads up to length bytes from the current position of a file.
+ * The caller must hold the client lock.
+ *
+ * @see afc_file_read
+ */
+static afc_error_t afc_file_read_internal(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+{
+	uint32_t current_count = 0, bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+	GTimeVal start;
+
+	*bytes_read = 0;
+
+	if ((client->pipeline_depth > 1) && (length > client->read_segment.size)) {
+		return afc_file_read_pipelined(client, handle, data, length, bytes_read);
+	}
+
+	/* Looping here to get around the maximum amount of data that
+	   a single read request can return */
+	while (current_count < length) {
+		debug_info("current count is %i but length is %i", current_count, length);
+
+		/* Send the read command */
+		uint32_t size = ((length - current_count) < client->read_segment.size) ? (length - current_count) : client->read_segment.size;
+		g_get_current_time(&start);
+		ret = afc_send_read_request(client, handle, size);
+		if (ret != AFC_E_SUCCESS) {
+			*bytes_read = current_count;
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+		/* Receive the data straight into the caller's buffer */
+		ret = afc_receive_reply_into(client, client->afc_packet->packet_num, data + current_count, size, &bytes_loc);
+		debug_info("afc_receive_reply_into returned error: %d", ret);
+		debug_info("bytes returned: %i", bytes_loc);
+		if (ret != AFC_E_SUCCESS) {
+			*bytes_read = current_count;
+			return ret;
+		}
+		if (bytes_loc == 0) {
+			/* end of file */
+			break;
+		}
+		afc_segment_sample(&client->read_segment, bytes_loc, &start);
+		current_count += bytes_loc;
+	}
+	debug_info("returning current_count as %i", current_count);
+
+	*bytes_read = current_count;
+	return ret;
+}
+
+/**
+ * Attempts to the read the given number of bytes from the given file.
+ * 
+ * If a pipeline depth greater than 1 has been set with
+ * afc_client_set_pipeline_depth(), multiple read requests are kept in
+ * flight at the same time.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param data The pointer to the memory region to store the read data
+ * @param length The number of bytes to read
+ * @param bytes_read The number of bytes actually read.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+idevice_error_t
+afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
 {
-	char *received = NULL;
-	uint32_t bytes = 0;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	afc_error_t ret = AFC_E_SUCCESS;
 
-	if (!client || !path || !infolist)
+	if (!client || !client->afc_packet || !client->connection || handle == 0)
 		return AFC_E_INVALID_ARG;
+	debug_info("called for length %i", length);
 
 	afc_lock(client);
-
-	/* Send command */
-	client->afc_packet->operation = AFC_OP_GET_FILE_INFO;
-	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
-	ret = afc_dispatch_packet(client, path, strlen(path)+1, &bytes);
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
-	}
-
-	/* Receive data */
-	ret = afc_receive_data(client, &received, &bytes);
-	if (received) {
-		*infolist = make_strings_list(received, bytes);
-		free(received);
-	}
-
+	ret = afc_file_read_internal(client, handle, data, length, bytes_read);
 	afc_unlock(client);
 
 	return ret;
 }
 
 /**
- * Opens a file on the phone.
- * 
- * @param client The client to use to open the file. 
- * @param filename The file to open. (must be a fully-qualified path)
- * @param file_mode The mode to use to open the file. Can be AFC_FILE_READ or
- * 		    AFC_FILE_WRITE; the former lets you read and write,
- * 		    however, and the second one will *create* the file,
- * 		    destroying anything previously there.
- * @param handle Pointer to a uint64_t that will hold the handle of the file
- * 
+ * Sends a single FileRefWrite packet. The packet header, the file handle
+ * and the payload are passed to the connection as separate buffers, so
+ * the payload is sent straight from the caller's memory.
+ * The caller must hold the client lock.
+ *
+ * @param client The client to use to write to the file.
+ * @param handle File handle of previously opened file.
+ * @param data The data to write.
+ * @param length Size of data.
+ * @param bytes_written Number of payload bytes that were sent.
+ *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-idevice_error_t
-afc_file_open(afc_client_t client, const char *filename,
-					 afc_file_mode_t file_mode, uint64_t *handle)
+static afc_error_t afc_dispatch_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
 {
-	uint64_t file_mode_loc = GUINT64_TO_LE(file_mode);
-	uint32_t bytes = 0;
-	char *data = (char *) malloc(sizeof(char) * (8 + strlen(filename) + 1));
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	AFCPacket header;
+	struct iovec iov[3];
+	uint32_t sent = 0;
+	idevice_error_t res;
 
-	/* set handle to 0 so in case an error occurs, the handle is invalid */
-	*handle = 0;
+	*bytes_written = 0;
 
-	if (!client || !client->connection || !client->afc_packet)
-		return AFC_E_INVALID_ARG;
+	client->afc_packet->packet_num++;
+	afc_mux_expect(client, client->afc_packet->packet_num);
+	client->afc_packet->operation = AFC_OP_WRITE;
+	client->afc_packet->this_length = sizeof(AFCPacket) + 8;
+	client->afc_packet->entire_length = client->afc_packet->this_length + length;
 
-	afc_lock(client);
+	memcpy(&header, client->afc_packet, sizeof(AFCPacket));
+	AFCPacket_to_LE(&header);
 
-	/* Send command */
-	memcpy(data, &file_mode_loc, 8);
-	memcpy(data + 8, filename, strlen(filename));
-	data[8 + strlen(filename)] = '\0';
-	client->afc_packet->operation = AFC_OP_FILE_OPEN;
-	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
-	ret = afc_dispatch_packet(client, data, 8 + strlen(filename) + 1, &bytes);
-	free(data);
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(AFCPacket);
+	iov[1].iov_base = &handle;
+	iov[1].iov_len = sizeof(uint64_t);
+	iov[2].iov_base = (void*)data;
+	iov[2].iov_len = length;
 
-	if (ret != AFC_E_SUCCESS) {
-		debug_info("Didn't receive a response to the command");
-		afc_unlock(client);
+	res = idevice_connection_sendv(client->connection, iov, 3, &sent);
+	if (sent > sizeof(AFCPacket) + 8) {
+		*bytes_written = sent - sizeof(AFCPacket) - 8;
+	}
+	if (res != IDEVICE_E_SUCCESS) {
+		debug_info("ERROR: sending write packet failed (%d)", res);
+		afc_mux_forget(client, client->afc_packet->packet_num);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
-	/* Receive the data */
-	ret = afc_receive_data(client, &data, &bytes);
-	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
-		afc_unlock(client);
+	return AFC_E_SUCCESS;
+}
 
-		/* Get the file handle */
-		memcpy(handle, data, sizeof(uint64_t));
-		free(data);
-		return ret;
+/**
+ * Writes to a file keeping up to client->pipeline_depth FileRefWrite
+ * requests in flight before waiting for the oldest status reply.
+ * The caller must hold the client lock.
+ *
+ * If the device rejects a segment, no more segments are sent, the
+ * outstanding replies are drained and only the bytes acknowledged before
+ * the failed segment are reported as written.
+ *
+ * @see afc_file_write
+ */
+static afc_error_t afc_file_write_pipelined(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
+{
+	uint32_t sent = 0, acknowledged = 0, bytes_loc = 0;
+	uint32_t inflight = 0;
+	uint32_t depth = client->pipeline_depth;
+	uint32_t issued = 0;
+	uint32_t *sizes = (uint32_t *) malloc(sizeof(uint32_t) * depth);
+	uint64_t *packets = (uint64_t *) malloc(sizeof(uint64_t) * depth);
+	int failed = 0;
+	GTimeVal last;
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t err = AFC_E_SUCCESS;
+
+	if (!sizes || !packets) {
+		free(sizes);
+		free(packets);
+		return AFC_E_NO_MEM;
 	}
 
-	debug_info("Didn't get any further data");
+	g_get_current_time(&last);
+	while ((inflight > 0) || (!failed && (sent < length))) {
+		/* fill up the pipeline */
+		while (!failed && (inflight < depth) && (sent < length)) {
+			uint32_t size = ((length - sent) < client->write_segment.size) ? (length - sent) : client->write_segment.size;
+			ret = afc_dispatch_write(client, handle, data + sent, size, &bytes_loc);
+			if (ret != AFC_E_SUCCESS) {
+				/* a partial packet leaves the stream out of sync */
+				err = ret;
+				for (; inflight > 0; inflight--)
+					afc_mux_forget(client, packets[(issued - inflight) % depth]);
+				failed = 1;
+				break;
+			}
+			packets[issued % depth] = client->afc_packet->packet_num;
+			sizes[issued % depth] = size;
+			issued++;
+			sent += size;
+			inflight++;
+		}
+		if (inflight == 0)
+			break;
 
-	afc_unlock(client);
+		/* collect the oldest outstanding reply */
+		uint64_t packet_num = packets[(issued - inflight) % depth];
+		uint32_t size = sizes[(issued - inflight) % depth];
+		ret = afc_receive_reply_into(client, packet_num, NULL, 0, &bytes_loc);
+		inflight--;
+		if (ret != AFC_E_SUCCESS) {
+			if (err == AFC_E_SUCCESS)
+				err = ret;
+			failed = 1;
+			if ((ret == AFC_E_MUX_ERROR) || (ret == AFC_E_NOT_ENOUGH_DATA) || (ret == AFC_E_OP_HEADER_INVALID)) {
+				/* the stream is out of sync, don't try to drain it */
+				break;
+			}
+			continue;
+		}
 
-	return ret;
+		/* in steady state replies arrive at the rate the link takes the data */
+		afc_segment_sample(&client->write_segment, size, &last);
+		g_get_current_time(&last);
+		if (!failed)
+			acknowledged += size;
+	}
+	/* nobody waits for the replies left when bailing out */
+	for (; inflight > 0; inflight--)
+		afc_mux_forget(client, packets[(issued - inflight) % depth]);
+	free(sizes);
+	free(packets);
+
+	*bytes_written = acknowledged;
+	return err;
 }
 
 /**
- * Attempts to the read the given number of bytes from the given file.
- * 
- * @param client The relevant AFC client
- * @param handle File handle of a previously opened file
- * @param data The pointer to the memory region to store the read data
- * @param length The number of bytes to read
- * @param bytes_read The number of bytes actually read.
+ * Writes length bytes at the current position of a file.
+ * The caller must hold the client lock.
  *
- * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ * @see afc_file_write
  */
-idevice_error_t
-afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+static afc_error_t afc_file_write_internal(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
 {
-	char *input = NULL;
-	uint32_t current_count = 0, bytes_loc = 0;
-	const uint32_t MAXIMUM_READ_SIZE = 1 << 16;
+	char *acknowledgement = NULL;
+	uint32_t current_count = 0;
+	uint32_t bytes_loc = 0;
 	afc_error_t ret = AFC_E_SUCCESS;
+	GTimeVal start;
 
-	if (!client || !client->afc_packet || !client->connection || handle == 0)
-		return AFC_E_INVALID_ARG;
-	debug_info("called for length %i", length);
+	debug_info("Write length: %i", length);
 
-	afc_lock(client);
+	if ((client->pipeline_depth > 1) && (length > client->write_segment.size)) {
+		return afc_file_write_pipelined(client, handle, data, length, bytes_written);
+	}
 
-	/* Looping here to get around the maximum amount of data that
-	   afc_receive_data can handle */
+	/* Divide the file into segments. */
 	while (current_count < length) {
-		debug_info("current count is %i but length is %i", current_count, length);
-
-		/* Send the read command */
-		AFCFilePacket *packet = (AFCFilePacket *) malloc(sizeof(AFCFilePacket));
-		packet->filehandle = handle;
-		packet->size = GUINT64_TO_LE(((length - current_count) < MAXIMUM_READ_SIZE) ? (length - current_count) : MAXIMUM_READ_SIZE);
-		client->afc_packet->operation = AFC_OP_READ;
-		client->afc_packet->entire_length = client->afc_packet->this_length = 0;
-		ret = afc_dispatch_packet(client, (char *) packet, sizeof(AFCFilePacket), &bytes_loc);
-		free(packet);
+		uint32_t size = ((length - current_count) < client->write_segment.size) ? (length - current_count) : client->write_segment.size;
 
+		/* Send the segment */
+		g_get_current_time(&start);
+		ret = afc_dispatch_write(client, handle, data + current_count, size, &bytes_loc);
+		current_count += bytes_loc;
 		if (ret != AFC_E_SUCCESS) {
-			afc_unlock(client);
-			return AFC_E_NOT_ENOUGH_DATA;
+			*bytes_written = current_count;
+			return ret;
+		}
+
+		ret = afc_receive_data(client, &acknowledgement, &bytes_loc);
+		if (acknowledgement) {
+			free(acknowledgement);
+			acknowledgement = NULL;
 		}
-		/* Receive the data */
-		ret = afc_receive_data(client, &input, &bytes_loc);
-		debug_info("afc_receive_data returned error: %d", ret);
-		debug_info("bytes returned: %i", bytes_loc);
 		if (ret != AFC_E_SUCCESS) {
-			afc_unlock(client);
-			return ret;
-		} else if (bytes_loc == 0) {
-			if (input)
-				free(input);
-			afc_unlock(client);
-			*bytes_read = current_count;
-			/* FIXME: check that's actually a success */
-			return ret;
-		} else {
-			if (input) {
-				debug_info("%d", bytes_loc);
-				memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
-				free(input);
-				input = NULL;
-				current_count += (bytes_loc > length) ? length : bytes_loc;
-			}
+			debug_info("device did not acknowledge the write of %u bytes, error %d", size, ret);
+			break;
 		}
+		afc_segment_sample(&client->write_segment, size, &start);
 	}
-	debug_info("returning current_count as %i", current_count);
 
-	afc_unlock(client);
-	*bytes_read = current_count;
+	*bytes_written = current_count;
 	return ret;
 }
 
@@ -907,82 +2202,108 @@ afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length,
 idevice_error_t
 afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
 {
-	char *acknowledgement = NULL;
-	const uint32_t MAXIMUM_WRITE_SIZE = 1 << 15;
-	uint32_t current_count = 0, i = 0;
-	uint32_t segments = (length / MAXIMUM_WRITE_SIZE);
-	uint32_t bytes_loc = 0;
-	char *out_buffer = NULL;
 	afc_error_t ret = AFC_E_SUCCESS;
 
 	if (!client || !client->afc_packet || !client->connection || !bytes_written || (handle == 0))
 		return AFC_E_INVALID_ARG;
 
 	afc_lock(client);
+	ret = afc_file_write_internal(client, handle, data, length, bytes_written);
+	afc_unlock(client);
 
-	debug_info("Write length: %i", length);
+	return ret;
+}
 
-	/* Divide the file into segments. */
-	for (i = 0; i < segments; i++) {
-		/* Send the segment */
-		client->afc_packet->this_length = sizeof(AFCPacket) + 8;
-		client->afc_packet->entire_length = client->afc_packet->this_length + MAXIMUM_WRITE_SIZE;
-		client->afc_packet->operation = AFC_OP_WRITE;
-		out_buffer = (char *) malloc(sizeof(char) * client->afc_packet->entire_length - sizeof(AFCPacket));
-		memcpy(out_buffer, (char *)&handle, sizeof(uint64_t));
-		memcpy(out_buffer + 8, data + current_count, MAXIMUM_WRITE_SIZE);
-		ret = afc_dispatch_packet(client, out_buffer, MAXIMUM_WRITE_SIZE + 8, &bytes_loc);
-		if (ret != AFC_E_SUCCESS) {
-			afc_unlock(client);
-			return AFC_E_NOT_ENOUGH_DATA;
-		}
-		free(out_buffer);
-		out_buffer = NULL;
+/** The largest chunk afc_file_pread() and afc_file_pwrite() pass on at once */
+static const uint32_t MAXIMUM_RANGE_CHUNK = (1 << 30);
+
+/**
+ * Reads a range of a file without the caller having to seek first.
+ *
+ * Seeking and reading happen under one hold of the client lock, so
+ * several threads sharing a client can read different ranges of the same
+ * file without racing on the file position. Lengths beyond 4 GB are
+ * split into multiple reads.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param offset The position in the file to start reading at
+ * @param data The pointer to the memory region to store the read data
+ * @param length The number of bytes to read
+ * @param bytes_read The number of bytes actually read. Less than length
+ *     if the end of the file was reached.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_file_pread(afc_client_t client, uint64_t handle, uint64_t offset, char *data, uint64_t length, uint64_t *bytes_read)
+{
+	uint64_t current_count = 0;
+	uint32_t bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->connection || !bytes_read || (handle == 0) || (offset > INT64_MAX))
+		return AFC_E_INVALID_ARG;
+
+	*bytes_read = 0;
 
+	afc_lock(client);
+
+	ret = afc_file_seek_internal(client, handle, (int64_t)offset, SEEK_SET);
+	while ((ret == AFC_E_SUCCESS) && (current_count < length)) {
+		uint32_t size = ((length - current_count) < MAXIMUM_RANGE_CHUNK) ? (uint32_t)(length - current_count) : MAXIMUM_RANGE_CHUNK;
+		ret = afc_file_read_internal(client, handle, data + current_count, size, &bytes_loc);
 		current_count += bytes_loc;
-		ret = afc_receive_data(client, &acknowledgement, &bytes_loc);
-		if (ret != AFC_E_SUCCESS) {
-			afc_unlock(client);
-			return ret;
-		} else {
-			free(acknowledgement);
+		if (bytes_loc < size) {
+			/* end of file */
+			break;
 		}
 	}
 
-	/* By this point, we should be at the end. i.e. the last segment that didn't
-	   get sent in the for loop. This length is fine because it's always
-	   sizeof(AFCPacket) + 8, but to be sure we do it again */
-	if (current_count == length) {
-		afc_unlock(client);
-		*bytes_written = current_count;
-		return ret;
-	}
+	afc_unlock(client);
 
-	client->afc_packet->this_length = sizeof(AFCPacket) + 8;
-	client->afc_packet->entire_length = client->afc_packet->this_length + (length - current_count);
-	client->afc_packet->operation = AFC_OP_WRITE;
-	out_buffer = (char *) malloc(sizeof(char) * client->afc_packet->entire_length - sizeof(AFCPacket));
-	memcpy(out_buffer, (char *) &handle, sizeof(uint64_t));
-	memcpy(out_buffer + 8, data + current_count, (length - current_count));
-	ret = afc_dispatch_packet(client, out_buffer, (length - current_count) + 8, &bytes_loc);
-	free(out_buffer);
-	out_buffer = NULL;
+	*bytes_read = current_count;
+	return ret;
+}
 
-	current_count += bytes_loc;
+/**
+ * Writes a range of a file without the caller having to seek first.
+ *
+ * Seeking and writing happen under one hold of the client lock, so
+ * several threads sharing a client can write different ranges of the same
+ * file without racing on the file position. Lengths beyond 4 GB are
+ * split into multiple writes.
+ *
+ * @param client The client to use to write to the file.
+ * @param handle File handle of previously opened file.
+ * @param offset The position in the file to start writing at
+ * @param data The data to write to the file.
+ * @param length How much data to write.
+ * @param bytes_written The number of bytes actually written to the file.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_file_pwrite(afc_client_t client, uint64_t handle, uint64_t offset, const char *data, uint64_t length, uint64_t *bytes_written)
+{
+	uint64_t current_count = 0;
+	uint32_t bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
 
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		*bytes_written = current_count;
-		return AFC_E_SUCCESS;
+	if (!client || !client->afc_packet || !client->connection || !bytes_written || (handle == 0) || (offset > INT64_MAX))
+		return AFC_E_INVALID_ARG;
+
+	*bytes_written = 0;
+
+	afc_lock(client);
+
+	ret = afc_file_seek_internal(client, handle, (int64_t)offset, SEEK_SET);
+	while ((ret == AFC_E_SUCCESS) && (current_count < length)) {
+		uint32_t size = ((length - current_count) < MAXIMUM_RANGE_CHUNK) ? (uint32_t)(length - current_count) : MAXIMUM_RANGE_CHUNK;
+		ret = afc_file_write_internal(client, handle, data + current_count, size, &bytes_loc);
+		current_count += bytes_loc;
 	}
 
-	ret = afc_receive_data(client, &acknowledgement, &bytes_loc);
 	afc_unlock(client);
-	if (ret != AFC_E_SUCCESS) {
-		debug_info("uh oh?");
-	} else {
-		free(acknowledgement);
-	}
+
 	*bytes_written = current_count;
 	return ret;
 }
@@ -995,7 +2316,7 @@ afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t
  */
 afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
 {
-	char *buffer = malloc(sizeof(char) * 8);
+	char buffer[8];
 	uint32_t bytes = 0;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
@@ -1011,8 +2332,6 @@ afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
 	client->afc_packet->operation = AFC_OP_FILE_CLOSE;
 	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
 	ret = afc_dispatch_packet(client, buffer, 8, &bytes);
-	free(buffer);
-	buffer = NULL;
 
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
@@ -1020,9 +2339,7 @@ afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
 	}
 
 	/* Receive the response */
-	ret = afc_receive_data(client, &buffer, &bytes);
-	if (buffer)
-		free(buffer);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
@@ -1043,7 +2360,7 @@ afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
  */
 afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation)
 {
-	char *buffer = malloc(16);
+	char buffer[16];
 	uint32_t bytes = 0;
 	uint64_t op = GUINT64_TO_LE(operation);
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
@@ -1062,8 +2379,6 @@ afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t op
 	client->afc_packet->operation = AFC_OP_FILE_LOCK;
 	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
 	ret = afc_dispatch_packet(client, buffer, 16, &bytes);
-	free(buffer);
-	buffer = NULL;
 
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
@@ -1071,11 +2386,7 @@ afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t op
 		return AFC_E_UNKNOWN_ERROR;
 	}
 	/* Receive the response */
-	ret = afc_receive_data(client, &buffer, &bytes);
-	if (buffer) {
-		debug_buffer(buffer, bytes);
-		free(buffer);
-	}
+	ret = afc_receive_status(client);
 	afc_unlock(client);
 
 	return ret;
@@ -1093,36 +2404,13 @@ afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t op
  */
 afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
 {
-	char *buffer = (char *) malloc(sizeof(char) * 24);
-	int64_t offset_loc = (int64_t)GUINT64_TO_LE(offset);
-	uint64_t whence_loc = GUINT64_TO_LE(whence);
-	uint32_t bytes = 0;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
 	if (!client || (handle == 0))
 		return AFC_E_INVALID_ARG;
 
 	afc_lock(client);
-
-	/* Send the command */
-	memcpy(buffer, &handle, sizeof(uint64_t));	/* handle */
-	memcpy(buffer + 8, &whence_loc, sizeof(uint64_t));	/* fromwhere */
-	memcpy(buffer + 16, &offset_loc, sizeof(uint64_t));	/* offset */
-	client->afc_packet->operation = AFC_OP_FILE_SEEK;
-	client->afc_packet->this_length = client->afc_packet->entire_length = 0;
-	ret = afc_dispatch_packet(client, buffer, 24, &bytes);
-	free(buffer);
-	buffer = NULL;
-
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
-	}
-	/* Receive response */
-	ret = afc_receive_data(client, &buffer, &bytes);
-	if (buffer)
-		free(buffer);
-
+	ret = afc_file_seek_internal(client, handle, offset, whence);
 	afc_unlock(client);
 
 	return ret;
@@ -1139,7 +2427,8 @@ afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset,
  */
 afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position)
 {
-	char *buffer = (char *) malloc(sizeof(char) * 8);
+	char request[8];
+	char *buffer = NULL;
 	uint32_t bytes = 0;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
@@ -1149,12 +2438,10 @@ afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *positi
 	afc_lock(client);
 
 	/* Send the command */
-	memcpy(buffer, &handle, sizeof(uint64_t));	/* handle */
+	memcpy(request, &handle, sizeof(uint64_t));	/* handle */
 	client->afc_packet->operation = AFC_OP_FILE_TELL;
 	client->afc_packet->this_length = client->afc_packet->entire_length = 0;
-	ret = afc_dispatch_packet(client, buffer, 8, &bytes);
-	free(buffer);
-	buffer = NULL;
+	ret = afc_dispatch_packet(client, request, 8, &bytes);
 
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
@@ -1190,7 +2477,7 @@ afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *positi
  */
 afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t newsize)
 {
-	char *buffer = (char *) malloc(sizeof(char) * 16);
+	char buffer[16];
 	uint32_t bytes = 0;
 	uint64_t newsize_loc = GUINT64_TO_LE(newsize);
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
@@ -1206,17 +2493,13 @@ afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t new
 	client->afc_packet->operation = AFC_OP_FILE_SET_SIZE;
 	client->afc_packet->this_length = client->afc_packet->entire_length = 0;
 	ret = afc_dispatch_packet(client, buffer, 16, &bytes);
-	free(buffer);
-	buffer = NULL;
 
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &buffer, &bytes);
-	if (buffer)
-		free(buffer);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
@@ -1234,8 +2517,7 @@ afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t new
  */
 afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize)
 {
-	char *response = NULL;
-	char *send = (char *) malloc(sizeof(char) * (strlen(path) + 1 + 8));
+	char *send = NULL;
 	uint32_t bytes = 0;
 	uint64_t size_requested = GUINT64_TO_LE(newsize);
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
@@ -1243,23 +2525,24 @@ afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize
 	if (!client || !path || !client->afc_packet || !client->connection)
 		return AFC_E_INVALID_ARG;
 
+	uint32_t path_len = strlen(path) + 1;
+
 	afc_lock(client);
 
 	/* Send command */
+	send = afc_scratch_get(client, 8 + path_len);
 	memcpy(send, &size_requested, 8);
-	memcpy(send + 8, path, strlen(path) + 1);
+	memcpy(send + 8, path, path_len);
 	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
 	client->afc_packet->operation = AFC_OP_TRUNCATE;
-	ret = afc_dispatch_packet(client, send, 8 + strlen(path) + 1, &bytes);
-	free(send);
+	ret = afc_dispatch_packet(client, send, 8 + path_len, &bytes);
+	afc_scratch_release(client, send);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &response, &bytes);
-	if (response)
-		free(response);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
@@ -1278,8 +2561,7 @@ afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize
  */
 afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const char *target, const char *linkname)
 {
-	char *response = NULL;
-	char *send = (char *) malloc(sizeof(char) * (strlen(target)+1 + strlen(linkname)+1 + 8));
+	char *send = NULL;
 	uint32_t bytes = 0;
 	uint64_t type = GUINT64_TO_LE(linktype);
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
@@ -1287,6 +2569,9 @@ afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const c
 	if (!client || !target || !linkname || !client->afc_packet || !client->connection)
 		return AFC_E_INVALID_ARG;
 
+	uint32_t target_len = strlen(target) + 1;
+	uint32_t linkname_len = strlen(linkname) + 1;
+
 	afc_lock(client);
 
 	debug_info("link type: %lld", type);
@@ -1294,21 +2579,20 @@ afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const c
 	debug_info("linkname: %s, length:%d", linkname, strlen(linkname));
 
 	/* Send command */
+	send = afc_scratch_get(client, 8 + target_len + linkname_len);
 	memcpy(send, &type, 8);
-	memcpy(send + 8, target, strlen(target) + 1);
-	memcpy(send + 8 + strlen(target) + 1, linkname, strlen(linkname) + 1);
+	memcpy(send + 8, target, target_len);
+	memcpy(send + 8 + target_len, linkname, linkname_len);
 	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
 	client->afc_packet->operation = AFC_OP_MAKE_LINK;
-	ret = afc_dispatch_packet(client, send, 8 + strlen(linkname) + 1 + strlen(target) + 1, &bytes);
-	free(send);
+	ret = afc_dispatch_packet(client, send, 8 + target_len + linkname_len, &bytes);
+	afc_scratch_release(client, send);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &response, &bytes);
-	if (response)
-		free(response);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
@@ -1326,8 +2610,7 @@ afc_error_t afc_make_link(afc_client_t client, afc_link_type_t linktype, const c
  */
 afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mtime)
 {
-	char *response = NULL;
-	char *send = (char *) malloc(sizeof(char) * (strlen(path) + 1 + 8));
+	char *send = NULL;
 	uint32_t bytes = 0;
 	uint64_t mtime_loc = GUINT64_TO_LE(mtime);
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
@@ -1335,23 +2618,24 @@ afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mt
 	if (!client || !path || !client->afc_packet || !client->connection)
 		return AFC_E_INVALID_ARG;
 
+	uint32_t path_len = strlen(path) + 1;
+
 	afc_lock(client);
 
 	/* Send command */
+	send = afc_scratch_get(client, 8 + path_len);
 	memcpy(send, &mtime_loc, 8);
-	memcpy(send + 8, path, strlen(path) + 1);
+	memcpy(send + 8, path, path_len);
 	client->afc_packet->entire_length = client->afc_packet->this_length = 0;
 	client->afc_packet->operation = AFC_OP_SET_FILE_TIME;
-	ret = afc_dispatch_packet(client, send, 8 + strlen(path) + 1, &bytes);
-	free(send);
+	ret = afc_dispatch_packet(client, send, 8 + path_len, &bytes);
+	afc_scratch_release(client, send);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive response */
-	ret = afc_receive_data(client, &response, &bytes);
-	if (response)
-		free(response);
+	ret = afc_receive_status(client);
 
 	afc_unlock(client);
 
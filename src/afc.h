@@ -48,13 +48,47 @@ typedef struct {
 	uint64_t filehandle, size;
 } AFCFilePacket;
 
+/** Transfer segment size, optionally tuned for throughput at runtime */
+typedef struct {
+	uint32_t size;
+	int tuning;
+	uint32_t best_size;
+	double best_rate;
+	uint64_t bytes;
+	double elapsed;
+	int samples;
+} afc_segment_t;
+
+/** A complete reply routed to its requester by the demultiplexer */
+typedef struct {
+	char *data;
+	uint32_t length;
+	uint32_t offset;
+} afc_mux_reply_t;
+
+/** Size of the per-client area request payloads are built in */
+#define AFC_SCRATCH_SIZE 1024
+
 struct afc_client_private {
 	idevice_connection_t connection;
 	AFCPacket *afc_packet;
 	int file_handle;
 	int lock;
 	GMutex *mutex;
+	uint64_t lock_time;
 	int own_connection;
+	uint32_t pipeline_depth;
+	uint32_t max_packet_size;
+	afc_segment_t read_segment;
+	afc_segment_t write_segment;
+	char scratch[AFC_SCRATCH_SIZE];
+	GThread *mux_thread;
+	GMutex *mux_mutex;
+	GCond *mux_cond;
+	GHashTable *mux_pending;
+	int mux_running;
+	int mux_error;
+	afc_mux_reply_t *mux_reply;
 };
 
 /* AFC Operations */
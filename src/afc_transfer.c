@@ -0,0 +1,462 @@
+/*
+ * afc_transfer.c
+ * Transfers many files at once over a pool of AFC connections.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "afc.h"
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_AFC
+#include "debug.h"
+
+/** Size of the buffer used to copy a single file */
+static const uint32_t TRANSFER_BUFFER_SIZE = (1 << 16);
+
+/** Size of the file window mapped at once by afc_upload_file() */
+static const uint32_t UPLOAD_WINDOW_SIZE = (16 << 20);
+
+/** Amount of data passed to afc_file_write() between progress reports */
+static const uint32_t UPLOAD_CHUNK_SIZE = (1 << 20);
+
+/** The maximum number of connections used by afc_transfer_files() */
+static const uint32_t MAXIMUM_TRANSFER_CONNECTIONS = 16;
+
+struct afc_transfer;
+
+/**
+ * A worker owning one AFC connection and a range of items. The owner takes
+ * items from the front of its range while idle workers steal from the back.
+ */
+struct afc_transfer_worker {
+	struct afc_transfer *transfer;
+	afc_client_t client;
+	GThread *thread;
+	uint32_t first;
+	uint32_t last;
+};
+
+/** State shared by all workers of one afc_transfer_files() call */
+struct afc_transfer {
+	afc_transfer_item_t *items;
+	uint32_t count;
+	struct afc_transfer_worker *workers;
+	uint32_t num_workers;
+	GMutex *queue_mutex;
+	GMutex *progress_mutex;
+	uint32_t files_done;
+	uint64_t bytes_done;
+	afc_transfer_progress_cb_t callback;
+	void *user_data;
+};
+
+/**
+ * Adds transferred bytes and/or a finished file to the aggregate progress
+ * and notifies the progress callback. Calls to the callback are serialized.
+ */
+static void afc_transfer_progress(struct afc_transfer *transfer, uint32_t bytes, int file_done)
+{
+	g_mutex_lock(transfer->progress_mutex);
+	transfer->bytes_done += bytes;
+	if (file_done)
+		transfer->files_done++;
+	if (transfer->callback)
+		transfer->callback(transfer->files_done, transfer->count, transfer->bytes_done, transfer->user_data);
+	g_mutex_unlock(transfer->progress_mutex);
+}
+
+/**
+ * Gets the next item for a worker, stealing half of the remaining items of
+ * the busiest other worker when its own range is exhausted.
+ *
+ * @return 1 if index was set to the item to transfer, 0 if all items have
+ *  been handed out.
+ */
+static int afc_transfer_next_item(struct afc_transfer_worker *worker, uint32_t *index)
+{
+	struct afc_transfer *transfer = worker->transfer;
+	struct afc_transfer_worker *victim = NULL;
+	uint32_t i, half;
+	int res = 0;
+
+	g_mutex_lock(transfer->queue_mutex);
+	if (worker->first == worker->last) {
+		for (i = 0; i < transfer->num_workers; i++) {
+			struct afc_transfer_worker *w = &transfer->workers[i];
+			if ((w->last - w->first > 1) && (!victim || (w->last - w->first > victim->last - victim->first)))
+				victim = w;
+		}
+		if (victim) {
+			half = (victim->last - victim->first) / 2;
+			worker->first = victim->last - half;
+			worker->last = victim->last;
+			victim->last = worker->first;
+			debug_info("worker %d stole %d items from worker %d", (int)(worker - transfer->workers), half, (int)(victim - transfer->workers));
+		}
+	}
+	if (worker->first < worker->last) {
+		*index = worker->first++;
+		res = 1;
+	}
+	g_mutex_unlock(transfer->queue_mutex);
+
+	return res;
+}
+
+/**
+ * Copies a file from the device to the host.
+ */
+static afc_error_t afc_transfer_download(struct afc_transfer_worker *worker, afc_transfer_item_t *item, char *buffer)
+{
+	uint64_t handle = 0;
+	uint32_t bytes = 0;
+	FILE *f = NULL;
+	afc_error_t ret = afc_file_open(worker->client, item->source, AFC_FOPEN_RDONLY, &handle);
+
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	f = fopen(item->destination, "wb");
+	if (!f) {
+		afc_file_close(worker->client, handle);
+		return AFC_E_IO_ERROR;
+	}
+
+	while (1) {
+		ret = afc_file_read(worker->client, handle, buffer, TRANSFER_BUFFER_SIZE, &bytes);
+		if ((ret != AFC_E_SUCCESS) || (bytes == 0))
+			break;
+		if (fwrite(buffer, 1, bytes, f) != bytes) {
+			ret = AFC_E_IO_ERROR;
+			break;
+		}
+		afc_transfer_progress(worker->transfer, bytes, 0);
+	}
+
+	if ((fclose(f) != 0) && (ret == AFC_E_SUCCESS))
+		ret = AFC_E_IO_ERROR;
+	afc_file_close(worker->client, handle);
+
+	return ret;
+}
+
+/**
+ * Writes a buffer to an open file in chunks, reporting progress after
+ * each chunk.
+ */
+static afc_error_t afc_upload_buffer(afc_client_t client, uint64_t handle, const char *data, uint64_t length, uint64_t *done, uint64_t total, afc_progress_cb_t callback, void *user_data)
+{
+	uint64_t current = 0;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	while (current < length) {
+		uint32_t size = ((length - current) < UPLOAD_CHUNK_SIZE) ? (uint32_t)(length - current) : UPLOAD_CHUNK_SIZE;
+		ret = afc_file_write(client, handle, data + current, size, &bytes);
+		current += bytes;
+		*done += bytes;
+		if (ret == AFC_E_SUCCESS && bytes != size)
+			ret = AFC_E_IO_ERROR;
+		if (ret != AFC_E_SUCCESS)
+			break;
+		if (callback)
+			callback(*done, total, user_data);
+	}
+
+	return ret;
+}
+
+/**
+ * Uploads a local file to the device.
+ *
+ * The file is memory mapped in windows of 16 MB and written to the device
+ * straight from the mapping. The kernel is asked to read ahead the next
+ * window while the current one is being sent, so disk reads overlap with
+ * the transfer. Files that cannot be mapped are streamed through a buffer
+ * instead. The remote file is created or truncated.
+ *
+ * @param client The client to use.
+ * @param local_path Path of the file on the host.
+ * @param remote_path Path of the file on the device.
+ * @param callback Function called after every chunk that has been written,
+ *     or NULL. The total passed to it is 0 if the size of the local file
+ *     is not known in advance.
+ * @param user_data Pointer passed to the callback function.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if an argument is
+ *  invalid, AFC_E_IO_ERROR if the local file could not be read, or an
+ *  AFC_E_* error value returned by the device.
+ */
+afc_error_t afc_upload_file(afc_client_t client, const char *local_path, const char *remote_path, afc_progress_cb_t callback, void *user_data)
+{
+	struct stat st;
+	uint64_t handle = 0;
+	uint64_t offset = 0;
+	uint64_t done = 0;
+	int fd = -1;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !local_path || !remote_path)
+		return AFC_E_INVALID_ARG;
+
+	fd = open(local_path, O_RDONLY);
+	if (fd < 0) {
+		debug_info("could not open %s", local_path);
+		return AFC_E_IO_ERROR;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return AFC_E_IO_ERROR;
+	}
+
+	ret = afc_file_open(client, remote_path, AFC_FOPEN_WRONLY, &handle);
+	if (ret != AFC_E_SUCCESS) {
+		close(fd);
+		return ret;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		uint64_t total = (uint64_t)st.st_size;
+		while ((ret == AFC_E_SUCCESS) && (offset < total)) {
+			size_t size = ((total - offset) < UPLOAD_WINDOW_SIZE) ? (size_t)(total - offset) : UPLOAD_WINDOW_SIZE;
+			void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, (off_t)offset);
+			if (map == MAP_FAILED) {
+				debug_info("mmap failed, falling back to reading");
+				break;
+			}
+			madvise(map, size, MADV_SEQUENTIAL);
+#ifdef HAVE_POSIX_FADVISE
+			if (offset + size < total) {
+				/* let the kernel fetch the next window while we send */
+				posix_fadvise(fd, (off_t)(offset + size), UPLOAD_WINDOW_SIZE, POSIX_FADV_WILLNEED);
+			}
+#endif
+			ret = afc_upload_buffer(client, handle, (const char *) map, size, &done, total, callback, user_data);
+			munmap(map, size);
+			offset += size;
+		}
+	}
+
+	if ((ret == AFC_E_SUCCESS) && (!S_ISREG(st.st_mode) || (offset < (uint64_t)st.st_size))) {
+		/* stream whatever could not be mapped */
+		uint64_t total = S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0;
+		char *buffer = (char *) malloc(UPLOAD_CHUNK_SIZE);
+		ssize_t len = 0;
+
+		if (!buffer) {
+			ret = AFC_E_NO_MEM;
+		} else if (lseek(fd, (off_t)offset, SEEK_SET) < 0 && S_ISREG(st.st_mode)) {
+			ret = AFC_E_IO_ERROR;
+		} else {
+			while ((len = read(fd, buffer, UPLOAD_CHUNK_SIZE)) > 0) {
+				ret = afc_upload_buffer(client, handle, buffer, (uint64_t)len, &done, total, callback, user_data);
+				if (ret != AFC_E_SUCCESS)
+					break;
+			}
+			if ((ret == AFC_E_SUCCESS) && (len < 0))
+				ret = AFC_E_IO_ERROR;
+		}
+		free(buffer);
+	}
+
+	afc_file_close(client, handle);
+	close(fd);
+
+	return ret;
+}
+
+/** Progress state of an upload done by a transfer worker */
+struct afc_transfer_upload_state {
+	struct afc_transfer_worker *worker;
+	uint64_t reported;
+};
+
+/**
+ * Forwards the progress of afc_upload_file() to the aggregate progress.
+ */
+static void afc_transfer_upload_progress(uint64_t bytes_done, uint64_t bytes_total, void *user_data)
+{
+	struct afc_transfer_upload_state *state = (struct afc_transfer_upload_state *) user_data;
+
+	afc_transfer_progress(state->worker->transfer, (uint32_t)(bytes_done - state->reported), 0);
+	state->reported = bytes_done;
+}
+
+/**
+ * Copies a file from the host to the device.
+ */
+static afc_error_t afc_transfer_upload(struct afc_transfer_worker *worker, afc_transfer_item_t *item)
+{
+	struct afc_transfer_upload_state state;
+
+	state.worker = worker;
+	state.reported = 0;
+	return afc_upload_file(worker->client, item->source, item->destination, afc_transfer_upload_progress, &state);
+}
+
+/**
+ * Thread function of a transfer worker.
+ */
+static gpointer afc_transfer_worker_run(gpointer arg)
+{
+	struct afc_transfer_worker *worker = (struct afc_transfer_worker *) arg;
+	char *buffer = (char *) malloc(TRANSFER_BUFFER_SIZE);
+	uint32_t index = 0;
+
+	while (afc_transfer_next_item(worker, &index)) {
+		afc_transfer_item_t *item = &worker->transfer->items[index];
+		if (!buffer) {
+			item->result = AFC_E_NO_MEM;
+		} else if (item->direction == AFC_TRANSFER_UPLOAD) {
+			item->result = afc_transfer_upload(worker, item);
+		} else {
+			item->result = afc_transfer_download(worker, item, buffer);
+		}
+		if (item->result != AFC_E_SUCCESS) {
+			debug_info("transfer of %s failed with error %d", item->source, item->result);
+		}
+		afc_transfer_progress(worker->transfer, 0, 1);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Copies a list of files between the host and the device using a pool of
+ * AFC connections to the same service.
+ *
+ * Each connection is served by its own thread, so the device can work on
+ * several requests at once instead of handling one file after the other.
+ * The items are split evenly across the connections and a connection that
+ * runs out of work takes over half of the items left to another one.
+ * If not all connections can be established, the transfer continues with
+ * the ones that could.
+ *
+ * @param device The device to transfer the files from or to.
+ * @param port The port of the AFC service, as returned by
+ *     lockdownd_start_service().
+ * @param connections The number of AFC connections to use (at most 16).
+ * @param items The files to transfer. The result of every item is stored
+ *     in its result member.
+ * @param count The number of items.
+ * @param callback Function called when data is transferred or a file has
+ *     been completed, or NULL. It is called from the worker threads, but
+ *     never concurrently.
+ * @param user_data Pointer passed to the callback function.
+ *
+ * @return AFC_E_SUCCESS if all files have been transferred, the error of
+ *  the first item that failed, AFC_E_INVALID_ARG if an argument is invalid,
+ *  or AFC_E_MUX_ERROR if no connection could be established.
+ */
+afc_error_t afc_transfer_files(idevice_t device, uint16_t port, uint32_t connections, afc_transfer_item_t *items, uint32_t count, afc_transfer_progress_cb_t callback, void *user_data)
+{
+	struct afc_transfer transfer;
+	uint32_t i, n;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!device || (port == 0) || (connections == 0) || (!items && count > 0))
+		return AFC_E_INVALID_ARG;
+
+	if (count == 0)
+		return AFC_E_SUCCESS;
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (connections > MAXIMUM_TRANSFER_CONNECTIONS)
+		connections = MAXIMUM_TRANSFER_CONNECTIONS;
+	if (connections > count)
+		connections = count;
+
+	memset(&transfer, '\0', sizeof(struct afc_transfer));
+	transfer.items = items;
+	transfer.count = count;
+	transfer.callback = callback;
+	transfer.user_data = user_data;
+	transfer.workers = (struct afc_transfer_worker *) calloc(connections, sizeof(struct afc_transfer_worker));
+	if (!transfer.workers)
+		return AFC_E_NO_MEM;
+
+	for (i = 0; i < connections; i++) {
+		afc_client_t client = NULL;
+		if (afc_client_new(device, port, &client) != AFC_E_SUCCESS) {
+			debug_info("could only open %d of %d connections", i, connections);
+			break;
+		}
+		transfer.workers[i].transfer = &transfer;
+		transfer.workers[i].client = client;
+	}
+	transfer.num_workers = i;
+	if (transfer.num_workers == 0) {
+		free(transfer.workers);
+		return AFC_E_MUX_ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		items[i].result = AFC_E_UNKNOWN_ERROR;
+	}
+
+	/* give every worker a contiguous share of the items */
+	n = transfer.num_workers;
+	for (i = 0; i < n; i++) {
+		transfer.workers[i].first = (uint32_t)(((uint64_t)count * i) / n);
+		transfer.workers[i].last = (uint32_t)(((uint64_t)count * (i + 1)) / n);
+	}
+
+	transfer.queue_mutex = g_mutex_new();
+	transfer.progress_mutex = g_mutex_new();
+
+	for (i = 0; i < n; i++) {
+		transfer.workers[i].thread = g_thread_create(afc_transfer_worker_run, &transfer.workers[i], TRUE, NULL);
+	}
+	/* run the work of workers whose thread could not be created here */
+	for (i = 0; i < n; i++) {
+		if (!transfer.workers[i].thread) {
+			afc_transfer_worker_run(&transfer.workers[i]);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (transfer.workers[i].thread)
+			g_thread_join(transfer.workers[i].thread);
+		afc_client_free(transfer.workers[i].client);
+	}
+
+	g_mutex_free(transfer.queue_mutex);
+	g_mutex_free(transfer.progress_mutex);
+	free(transfer.workers);
+
+	for (i = 0; i < count; i++) {
+		if (items[i].result != AFC_E_SUCCESS) {
+			ret = items[i].result;
+			break;
+		}
+	}
+
+	return ret;
+}
@@ -33,17 +33,38 @@
 #include "debug.h"
 #include "libimobiledevice/libimobiledevice.h"
 
-int debug_level = 0;
+int debug_levels[DEBUG_DOMAIN_COUNT] = { 0, };
 
 /**
- * Sets the level of debugging. Currently the only acceptable values are 0 and
- * 1.
+ * Sets the level of debugging for all domains. Currently the only
+ * acceptable values are 0 and 1.
  *
  * @param level Set to 0 for no debugging or 1 for debugging.
  */
 void idevice_set_debug_level(int level)
 {
-	debug_level = level;
+	int i;
+
+	for (i = 0; i < DEBUG_DOMAIN_COUNT; i++) {
+		debug_levels[i] = level;
+	}
+}
+
+/**
+ * Sets the level of debugging for one subsystem, leaving the others as
+ * they are. Messages of a disabled domain are never formatted.
+ *
+ * @param domain One of the IDEVICE_DEBUG_DOMAIN_* values. Plist dumps are
+ *     controlled by IDEVICE_DEBUG_DOMAIN_PLIST regardless of the subsystem
+ *     that prints them.
+ * @param level Set to 0 for no debugging or 1 for debugging.
+ */
+void idevice_set_debug_domain_level(int domain, int level)
+{
+	if ((domain < 0) || (domain >= DEBUG_DOMAIN_COUNT))
+		return;
+
+	debug_levels[domain] = level;
 }
 
 #ifndef STRIP_DEBUG_CODE
@@ -82,9 +103,6 @@ inline void debug_info_real(const char *func, const char *file, int line, const
 	va_list args;
 	char *buffer = NULL;
 
-	if (!debug_level)
-		return;
-
 	/* run the real fprintf */
 	va_start(args, format);
 	(void)vasprintf(&buffer, format, args);
@@ -96,50 +114,48 @@ inline void debug_info_real(const char *func, const char *file, int line, const
 #endif
 }
 
-inline void debug_buffer(const char *data, const int length)
+inline void debug_buffer_real(const char *data, const int length)
 {
 #ifndef STRIP_DEBUG_CODE
 	int i;
 	int j;
 	unsigned char c;
 
-	if (debug_level) {
-		for (i = 0; i < length; i += 16) {
-			fprintf(stderr, "%04x: ", i);
-			for (j = 0; j < 16; j++) {
-				if (i + j >= length) {
-					fprintf(stderr, "   ");
-					continue;
-				}
-				fprintf(stderr, "%02hhx ", *(data + i + j));
+	for (i = 0; i < length; i += 16) {
+		fprintf(stderr, "%04x: ", i);
+		for (j = 0; j < 16; j++) {
+			if (i + j >= length) {
+				fprintf(stderr, "   ");
+				continue;
 			}
-			fprintf(stderr, "  | ");
-			for (j = 0; j < 16; j++) {
-				if (i + j >= length)
-					break;
-				c = *(data + i + j);
-				if ((c < 32) || (c > 127)) {
-					fprintf(stderr, ".");
-					continue;
-				}
-				fprintf(stderr, "%c", c);
+			fprintf(stderr, "%02hhx ", *(data + i + j));
+		}
+		fprintf(stderr, "  | ");
+		for (j = 0; j < 16; j++) {
+			if (i + j >= length)
+				break;
+			c = *(data + i + j);
+			if ((c < 32) || (c > 127)) {
+				fprintf(stderr, ".");
+				continue;
 			}
-			fprintf(stderr, "\n");
+			fprintf(stderr, "%c", c);
 		}
 		fprintf(stderr, "\n");
 	}
+	fprintf(stderr, "\n");
 #endif
 }
 
-inline void debug_buffer_to_file(const char *file, const char *data, const int length)
+inline void debug_buffer_to_file_real(const char *file, const char *data, const int length)
 {
 #ifndef STRIP_DEBUG_CODE
-	if (debug_level) {
-		FILE *f = fopen(file, "w+");
-		fwrite(data, 1, length, f);
-		fflush(f);
-		fclose(f);
-	}
+	FILE *f = fopen(file, "w+");
+	if (!f)
+		return;
+	fwrite(data, 1, length, f);
+	fflush(f);
+	fclose(f);
 #endif
 }
 
@@ -26,15 +26,38 @@
 #include <plist/plist.h>
 #include <glib.h>
 
+#include "libimobiledevice/libimobiledevice.h"
+
+/* Files set DEBUG_DOMAIN before including this header to log under their
+ * subsystem's level instead of the general one. */
+#ifndef DEBUG_DOMAIN
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_GENERAL
+#endif
+
+#define DEBUG_DOMAIN_COUNT (IDEVICE_DEBUG_DOMAIN_LOCKDOWN + 1)
+
+G_GNUC_INTERNAL extern int debug_levels[DEBUG_DOMAIN_COUNT];
+
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L && !defined(STRIP_DEBUG_CODE)
-#define debug_info(...) debug_info_real (__func__, __FILE__, __LINE__, __VA_ARGS__)
-#define debug_plist(a) debug_plist_real (__func__, __FILE__, __LINE__, a)
+#define DEBUG_FUNC __func__
 #elif defined(__GNUC__) && __GNUC__ >= 3 && !defined(STRIP_DEBUG_CODE)
-#define debug_info(...) debug_info_real (__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
-#define debug_plist(a) debug_plist_real (__FUNCTION__, __FILE__, __LINE__, a)
+#define DEBUG_FUNC __FUNCTION__
+#endif
+
+/* The arguments are only evaluated, and a message only formatted, when the
+ * domain is enabled. Otherwise a call costs a load and a branch. */
+#ifdef DEBUG_FUNC
+#define debug_enabled(domain) G_UNLIKELY(debug_levels[(domain)] > 0)
+#define debug_info(...) do { if (debug_enabled(DEBUG_DOMAIN)) debug_info_real (DEBUG_FUNC, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define debug_plist(a) do { if (debug_enabled(IDEVICE_DEBUG_DOMAIN_PLIST)) debug_plist_real (DEBUG_FUNC, __FILE__, __LINE__, a); } while (0)
+#define debug_buffer(data, length) do { if (debug_enabled(DEBUG_DOMAIN)) debug_buffer_real (data, length); } while (0)
+#define debug_buffer_to_file(file, data, length) do { if (debug_enabled(DEBUG_DOMAIN)) debug_buffer_to_file_real (file, data, length); } while (0)
 #else
-#define debug_info(...)
-#define debug_plist(a)
+#define debug_enabled(domain) 0
+#define debug_info(...) do { } while (0)
+#define debug_plist(a) do { } while (0)
+#define debug_buffer(data, length) do { } while (0)
+#define debug_buffer_to_file(file, data, length) do { } while (0)
 #endif
 
 G_GNUC_INTERNAL inline void debug_info_real(const char *func,
@@ -42,8 +65,8 @@ G_GNUC_INTERNAL inline void debug_info_real(const char *func,
 											int	line,
 											const char *format, ...);
 
-G_GNUC_INTERNAL inline void debug_buffer(const char *data, const int length);
-G_GNUC_INTERNAL inline void debug_buffer_to_file(const char *file, const char *data, const int length);
+G_GNUC_INTERNAL inline void debug_buffer_real(const char *data, const int length);
+G_GNUC_INTERNAL inline void debug_buffer_to_file_real(const char *file, const char *data, const int length);
 G_GNUC_INTERNAL inline void debug_plist_real(const char *func,
 											const char *file,
 											int	line,
@@ -24,6 +24,9 @@
 #include "property_list_service.h"
 #include "debug.h"
 
+/* DeviceLink peers send runs of small messages, read ahead of them */
+#define DEVICE_LINK_RECEIVE_AHEAD_SIZE 65536
+
 /**
  * Internally used function to extract the message string from a DL* message
  * plist.
@@ -92,6 +95,7 @@ device_link_service_error_t device_link_service_client_new(idevice_t device, uin
 	if (property_list_service_client_new(device, port, &plistclient) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		return DEVICE_LINK_SERVICE_E_MUX_ERROR;
 	}
+	property_list_service_set_receive_ahead(plistclient, DEVICE_LINK_RECEIVE_AHEAD_SIZE);
 
 	/* create client object */
 	device_link_service_client_t client_loc = (device_link_service_client_t) malloc(sizeof(struct device_link_service_client_private));
@@ -321,6 +325,54 @@ device_link_service_error_t device_link_service_send_process_message(device_link
 	return err;
 }
 
+/**
+ * Sends several DLMessageProcessMessage plists at once. The messages are
+ * written back to back with as few writes as possible instead of one
+ * write per message.
+ *
+ * @param client The device link service client to use.
+ * @param messages Array of PLIST_DICT messages to send.
+ * @param count Number of messages in the array.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if client or messages is invalid or
+ *     one of the messages is not a PLIST_DICT, or
+ *     DEVICE_LINK_SERVICE_E_MUX_ERROR if the messages could not be sent.
+ */
+device_link_service_error_t device_link_service_send_process_messages(device_link_service_client_t client, plist_t *messages, uint32_t count)
+{
+	uint32_t i;
+
+	if (!client || !client->parent || !messages || (count == 0))
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	for (i = 0; i < count; i++) {
+		if (!messages[i] || (plist_get_node_type(messages[i]) != PLIST_DICT))
+			return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+	}
+
+	plist_t *arrays = (plist_t*)malloc(sizeof(plist_t) * count);
+	if (!arrays)
+		return DEVICE_LINK_SERVICE_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < count; i++) {
+		arrays[i] = plist_new_array();
+		plist_array_append_item(arrays[i], plist_new_string("DLMessageProcessMessage"));
+		plist_array_append_item(arrays[i], plist_copy(messages[i]));
+	}
+
+	device_link_service_error_t err = DEVICE_LINK_SERVICE_E_SUCCESS;
+	if (property_list_service_send_binary_plists(client->parent, arrays, count) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		err = DEVICE_LINK_SERVICE_E_MUX_ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		plist_free(arrays[i]);
+	}
+	free(arrays);
+	return err;
+}
+
 /**
  * Receives a DL* message plist
  *
@@ -457,3 +509,35 @@ device_link_service_error_t device_link_service_receive(device_link_service_clie
 	return DEVICE_LINK_SERVICE_E_SUCCESS;
 }
 
+/**
+ * Generic device link service receive function that passes the contents
+ * of the first data element of the message by reference instead of as
+ * part of the plist.
+ * @see property_list_service_receive_plist_with_data
+ *
+ * @param client The device link service client to use for receiving
+ * @param plist Pointer that will point to the property list received upon
+ *     successful return.
+ * @param key Key of the data object, or NULL for the first data object of
+ *     the message.
+ * @param data Set to point to the data, or to NULL when it is part of the
+ *     plist. Valid until the next message is received.
+ * @param length Set to the length of the data.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG when a parameter is NULL,
+ *     or DEVICE_LINK_SERVICE_E_MUX_ERROR when no property list could be
+ *     received.
+ */
+device_link_service_error_t device_link_service_receive_with_data(device_link_service_client_t client, plist_t *plist, const char *key, const char **data, uint64_t *length)
+{
+	if (!client || !plist || (plist && *plist) || !data || !length) {
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+	}
+
+	if (property_list_service_receive_plist_with_data(client->parent, plist, key, data, length) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		return DEVICE_LINK_SERVICE_E_MUX_ERROR;
+	}
+	return DEVICE_LINK_SERVICE_E_SUCCESS;
+}
+
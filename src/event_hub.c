@@ -0,0 +1,447 @@
+/*
+ * event_hub.c
+ * Distributes device events to many subscribers and per-device workers.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "idevice.h"
+#include "debug.h"
+
+/** A callback registered with an event hub */
+struct hub_subscriber {
+	idevice_event_cb_t callback;
+	void *user_data;
+	int active;
+};
+
+/** State of a device known to an event hub */
+struct hub_device {
+	char *uuid;
+	int state;
+	int target;
+	int debouncing;
+	GTimeVal deadline;
+	GQueue *events;
+	int scheduled;
+};
+
+struct idevice_event_hub_private {
+	GMutex *mutex;
+	GCond *cond;
+	GCond *space;
+	GCond *idle;
+	GThread *timer;
+	GThreadPool *pool;
+	GHashTable *devices;
+	GList *subscribers;
+	unsigned int debounce;
+	unsigned int max_pending;
+	unsigned int pending;
+	int quit;
+};
+
+/**
+ * Forgets a device that is gone and has nothing left to deliver, so the
+ * table does not grow with every device ever seen. The hub must be
+ * locked.
+ */
+static void hub_device_prune(idevice_event_hub_t hub, struct hub_device *dev)
+{
+	if ((dev->state == IDEVICE_DEVICE_REMOVE) && (dev->target == IDEVICE_DEVICE_REMOVE) && !dev->debouncing && !dev->scheduled && g_queue_is_empty(dev->events)) {
+		g_hash_table_remove(hub->devices, dev->uuid);
+	}
+}
+
+/**
+ * Queues the current state of a device for delivery if it differs from
+ * the state delivered last. Blocks while the hub has max_pending events
+ * queued. The hub must be locked.
+ */
+static void hub_enqueue(idevice_event_hub_t hub, struct hub_device *dev)
+{
+	dev->debouncing = 0;
+	if (dev->target == dev->state) {
+		hub_device_prune(hub, dev);
+		return;
+	}
+
+	while ((hub->pending >= hub->max_pending) && !hub->quit) {
+		g_cond_wait(hub->space, hub->mutex);
+	}
+	if (hub->quit)
+		return;
+
+	dev->state = dev->target;
+	g_queue_push_tail(dev->events, GINT_TO_POINTER(dev->state));
+	hub->pending++;
+	if (!dev->scheduled) {
+		dev->scheduled = 1;
+		g_thread_pool_push(hub->pool, dev, NULL);
+	}
+}
+
+/**
+ * Receives raw device events.
+ */
+static void hub_event_cb(const idevice_event_t *event, void *user_data)
+{
+	idevice_event_hub_t hub = (idevice_event_hub_t)user_data;
+	struct hub_device *dev;
+
+	if (!event->uuid)
+		return;
+
+	g_mutex_lock(hub->mutex);
+	if (!hub->quit) {
+		dev = (struct hub_device*)g_hash_table_lookup(hub->devices, event->uuid);
+		if (!dev) {
+			dev = (struct hub_device*)malloc(sizeof(struct hub_device));
+			dev->uuid = strdup(event->uuid);
+			dev->state = IDEVICE_DEVICE_REMOVE;
+			dev->target = IDEVICE_DEVICE_REMOVE;
+			dev->debouncing = 0;
+			dev->events = g_queue_new();
+			dev->scheduled = 0;
+			g_hash_table_insert(hub->devices, dev->uuid, dev);
+		}
+		dev->target = event->event;
+		if (hub->debounce == 0) {
+			hub_enqueue(hub, dev);
+		} else {
+			/* every event restarts the quiet period of the device */
+			g_get_current_time(&dev->deadline);
+			g_time_val_add(&dev->deadline, hub->debounce * 1000);
+			dev->debouncing = 1;
+			g_cond_signal(hub->cond);
+		}
+	}
+	g_mutex_unlock(hub->mutex);
+}
+
+/** Used by hub_timer_check() to collect the next deadline */
+struct hub_timer_state {
+	GTimeVal now;
+	GTimeVal next;
+	int waiting;
+	GList *expired;
+};
+
+static int hub_time_before(const GTimeVal *a, const GTimeVal *b)
+{
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_usec < b->tv_usec));
+}
+
+/**
+ * Collects a device whose quiet period is over, or records when it will be.
+ */
+static void hub_timer_check(gpointer key, gpointer value, gpointer user_data)
+{
+	struct hub_device *dev = (struct hub_device*)value;
+	struct hub_timer_state *ts = (struct hub_timer_state*)user_data;
+
+	if (!dev->debouncing)
+		return;
+
+	if (!hub_time_before(&ts->now, &dev->deadline)) {
+		ts->expired = g_list_prepend(ts->expired, dev);
+	} else if (!ts->waiting || hub_time_before(&dev->deadline, &ts->next)) {
+		ts->next = dev->deadline;
+		ts->waiting = 1;
+	}
+}
+
+/**
+ * Thread function delivering the state of devices that have been quiet
+ * for the debounce interval.
+ */
+static gpointer hub_timer(gpointer data)
+{
+	idevice_event_hub_t hub = (idevice_event_hub_t)data;
+	struct hub_timer_state ts;
+
+	g_mutex_lock(hub->mutex);
+	while (!hub->quit) {
+		ts.waiting = 0;
+		ts.expired = NULL;
+		g_get_current_time(&ts.now);
+		g_hash_table_foreach(hub->devices, hub_timer_check, &ts);
+		/* hub_enqueue() may wait for space, which unlocks the hub, so
+		   it can't be called while iterating the devices */
+		while (ts.expired) {
+			struct hub_device *dev = (struct hub_device*)ts.expired->data;
+			if (dev->debouncing && !hub_time_before(&ts.now, &dev->deadline)) {
+				hub_enqueue(hub, dev);
+			}
+			ts.expired = g_list_delete_link(ts.expired, ts.expired);
+		}
+		if (hub->quit)
+			break;
+		if (ts.waiting) {
+			g_cond_timed_wait(hub->cond, hub->mutex, &ts.next);
+		} else {
+			g_cond_wait(hub->cond, hub->mutex);
+		}
+	}
+	g_mutex_unlock(hub->mutex);
+
+	return NULL;
+}
+
+/**
+ * Worker function delivering the queued events of one device to all
+ * subscribers. Events of the same device are delivered in order and never
+ * concurrently; different devices are handled in parallel.
+ */
+static void hub_worker(gpointer data, gpointer user_data)
+{
+	struct hub_device *dev = (struct hub_device*)data;
+	idevice_event_hub_t hub = (idevice_event_hub_t)user_data;
+	gpointer item;
+
+	g_mutex_lock(hub->mutex);
+	while ((item = g_queue_pop_head(dev->events)) != NULL) {
+		idevice_event_t ev;
+		GList *subscribers;
+		GList *l;
+
+		hub->pending--;
+		g_cond_signal(hub->space);
+
+		ev.event = GPOINTER_TO_INT(item);
+		ev.uuid = dev->uuid;
+		ev.conn_type = CONNECTION_USBMUXD;
+
+		subscribers = g_list_copy(hub->subscribers);
+		for (l = subscribers; l; l = l->next) {
+			((struct hub_subscriber*)l->data)->active++;
+		}
+		g_mutex_unlock(hub->mutex);
+
+		for (l = subscribers; l; l = l->next) {
+			struct hub_subscriber *sub = (struct hub_subscriber*)l->data;
+			sub->callback(&ev, sub->user_data);
+		}
+
+		g_mutex_lock(hub->mutex);
+		for (l = subscribers; l; l = l->next) {
+			((struct hub_subscriber*)l->data)->active--;
+		}
+		g_list_free(subscribers);
+		g_cond_broadcast(hub->idle);
+	}
+	dev->scheduled = 0;
+	hub_device_prune(hub, dev);
+	g_mutex_unlock(hub->mutex);
+}
+
+static void hub_device_free(gpointer data)
+{
+	struct hub_device *dev = (struct hub_device*)data;
+	g_queue_free(dev->events);
+	free(dev->uuid);
+	free(dev);
+}
+
+/**
+ * Creates an event hub. The hub receives device add/remove events and
+ * delivers them to any number of subscribers on a pool of worker threads.
+ *
+ * Events of a device that follow each other within the debounce interval
+ * are collapsed, so a flapping device only produces an event once its
+ * state has settled, and nothing at all if it ends up in the state last
+ * delivered. Events are delivered for every device in order, but never
+ * for the same device in two workers at once.
+ *
+ * When max_pending events are waiting for a worker, the thread reading
+ * events from usbmuxd is held up until the workers catch up.
+ *
+ * @param workers Number of worker threads delivering events, 0 for 4.
+ * @param max_pending Maximum number of queued events, 0 for 256.
+ * @param debounce Debounce interval in milliseconds, 0 to deliver events
+ *   immediately.
+ * @param hub Pointer that will be set to the newly created hub.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG when hub is
+ *   NULL, or IDEVICE_E_UNKNOWN_ERROR when the hub could not be set up.
+ */
+idevice_error_t idevice_event_hub_new(unsigned int workers, unsigned int max_pending, unsigned int debounce, idevice_event_hub_t *hub)
+{
+	idevice_event_hub_t hub_loc;
+	char **devices = NULL;
+	int count = 0;
+	int i;
+
+	if (!hub)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	hub_loc = (idevice_event_hub_t)malloc(sizeof(struct idevice_event_hub_private));
+	hub_loc->mutex = g_mutex_new();
+	hub_loc->cond = g_cond_new();
+	hub_loc->space = g_cond_new();
+	hub_loc->idle = g_cond_new();
+	hub_loc->devices = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, hub_device_free);
+	hub_loc->subscribers = NULL;
+	hub_loc->debounce = debounce;
+	hub_loc->max_pending = max_pending ? max_pending : 256;
+	hub_loc->pending = 0;
+	hub_loc->quit = 0;
+	hub_loc->pool = g_thread_pool_new(hub_worker, hub_loc, workers ? (gint)workers : 4, FALSE, NULL);
+	hub_loc->timer = g_thread_create(hub_timer, hub_loc, TRUE, NULL);
+
+	if (!hub_loc->pool || !hub_loc->timer || (idevice_event_add_listener(hub_event_cb, hub_loc) != IDEVICE_E_SUCCESS)) {
+		debug_info("ERROR: could not set up event hub");
+		idevice_event_hub_free(hub_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	/* usbmuxd only reports devices already attached to its first
+	   subscriber, so add them here; duplicates are filtered anyway */
+	if (idevice_get_device_list(&devices, &count) == IDEVICE_E_SUCCESS) {
+		for (i = 0; i < count; i++) {
+			idevice_event_t ev;
+			ev.event = IDEVICE_DEVICE_ADD;
+			ev.uuid = devices[i];
+			ev.conn_type = CONNECTION_USBMUXD;
+			hub_event_cb(&ev, hub_loc);
+		}
+		idevice_device_list_free(devices);
+	}
+
+	*hub = hub_loc;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Frees an event hub. Events already queued for a worker are still
+ * delivered before this function returns.
+ *
+ * @param hub The hub to free.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_INVALID_ARG when hub
+ *   is NULL.
+ */
+idevice_error_t idevice_event_hub_free(idevice_event_hub_t hub)
+{
+	GList *l;
+
+	if (!hub)
+		return IDEVICE_E_INVALID_ARG;
+
+	g_mutex_lock(hub->mutex);
+	hub->quit = 1;
+	g_cond_broadcast(hub->cond);
+	g_cond_broadcast(hub->space);
+	g_mutex_unlock(hub->mutex);
+
+	idevice_event_remove_listener(hub_event_cb, hub);
+	if (hub->timer) {
+		g_thread_join(hub->timer);
+	}
+	if (hub->pool) {
+		g_thread_pool_free(hub->pool, FALSE, TRUE);
+	}
+
+	for (l = hub->subscribers; l; l = l->next) {
+		free(l->data);
+	}
+	g_list_free(hub->subscribers);
+	g_hash_table_destroy(hub->devices);
+	g_cond_free(hub->idle);
+	g_cond_free(hub->space);
+	g_cond_free(hub->cond);
+	g_mutex_free(hub->mutex);
+	free(hub);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Adds a subscriber to an event hub. A new subscriber only receives events
+ * delivered after it has been added.
+ *
+ * @param hub The event hub.
+ * @param callback Function called on a worker thread for every event.
+ * @param user_data Data passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_INVALID_ARG when hub
+ *   or callback is NULL.
+ */
+idevice_error_t idevice_event_hub_subscribe(idevice_event_hub_t hub, idevice_event_cb_t callback, void *user_data)
+{
+	struct hub_subscriber *sub;
+
+	if (!hub || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	sub = (struct hub_subscriber*)malloc(sizeof(struct hub_subscriber));
+	sub->callback = callback;
+	sub->user_data = user_data;
+	sub->active = 0;
+
+	g_mutex_lock(hub->mutex);
+	hub->subscribers = g_list_append(hub->subscribers, sub);
+	g_mutex_unlock(hub->mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Removes a subscriber from an event hub. When this function returns, the
+ * callback is not running anymore and will not be called again, so it
+ * must not be called from the callback itself.
+ *
+ * @param hub The event hub.
+ * @param callback The callback function that was subscribed.
+ * @param user_data The data it was subscribed with.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_INVALID_ARG when no
+ *   such subscriber exists.
+ */
+idevice_error_t idevice_event_hub_unsubscribe(idevice_event_hub_t hub, idevice_event_cb_t callback, void *user_data)
+{
+	struct hub_subscriber *sub = NULL;
+	GList *l;
+
+	if (!hub)
+		return IDEVICE_E_INVALID_ARG;
+
+	g_mutex_lock(hub->mutex);
+	for (l = hub->subscribers; l; l = l->next) {
+		struct hub_subscriber *cur = (struct hub_subscriber*)l->data;
+		if ((cur->callback == callback) && (cur->user_data == user_data)) {
+			sub = cur;
+			hub->subscribers = g_list_delete_link(hub->subscribers, l);
+			break;
+		}
+	}
+	while (sub && sub->active) {
+		g_cond_wait(hub->idle, hub->mutex);
+	}
+	g_mutex_unlock(hub->mutex);
+
+	if (!sub)
+		return IDEVICE_E_INVALID_ARG;
+
+	free(sub);
+	return IDEVICE_E_SUCCESS;
+}
@@ -18,12 +18,28 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
  */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <glib.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "file_relay.h"
 #include "property_list_service.h"
 #include "debug.h"
 
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
 /**
  * Connects to the file_relay service on the specified device.
  *
@@ -125,7 +141,7 @@ file_relay_error_t file_relay_request_sources(file_relay_client_t client, const
 	plist_t dict = plist_new_dict();
 	plist_dict_insert_item(dict, "Sources", array);
 
-	if (property_list_service_send_xml_plist(client->parent, dict) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+	if (property_list_service_send_plist(client->parent, dict) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		debug_info("ERROR: Could not send request to device!");
 		err = FILE_RELAY_E_MUX_ERROR;
 		goto leave;
@@ -196,3 +212,548 @@ leave:
 	}
 	return err;
 }
+
+#ifdef HAVE_ZLIB
+
+/** Size of the buffers used for receiving and inflating the archive. */
+#define FILE_RELAY_BUFFER_SIZE 65536
+/** Number of receive buffers; the receiver can run this far ahead. */
+#define FILE_RELAY_BUFFER_COUNT 4
+
+#define CPIO_ODC_HEADER_SIZE 76
+#define CPIO_NEWC_HEADER_SIZE 110
+#define CPIO_MAGIC_SIZE 6
+#define CPIO_MAX_NAME_SIZE 4096
+#define CPIO_TRAILER "TRAILER!!!"
+
+enum cpio_state {
+	CPIO_HEADER,
+	CPIO_NAME,
+	CPIO_SKIP,
+	CPIO_DATA,
+	CPIO_DONE
+};
+
+/** Incremental decoder for odc (070707) and newc (070701) cpio archives. */
+struct cpio_decoder {
+	enum cpio_state state;
+	enum cpio_state next_state;
+	int newc;
+	char header[CPIO_NEWC_HEADER_SIZE];
+	char name[CPIO_MAX_NAME_SIZE];
+	uint32_t have;
+	uint32_t header_size;
+	uint32_t name_size;
+	uint32_t skip;
+	uint64_t offset;
+	file_relay_entry entry;
+};
+
+static uint64_t cpio_number(const char *field, int length, int base)
+{
+	char buf[16];
+
+	memcpy(buf, field, length);
+	buf[length] = '\0';
+	return strtoull(buf, NULL, base);
+}
+
+/**
+ * Parses a complete cpio header.
+ *
+ * @return 0 on success, -1 if the header is invalid.
+ */
+static int cpio_parse_header(struct cpio_decoder *cpio)
+{
+	const char *h = cpio->header;
+
+	if (cpio->newc) {
+		cpio->entry.mode = (uint32_t)cpio_number(h + 14, 8, 16);
+		cpio->entry.mtime = (uint32_t)cpio_number(h + 46, 8, 16);
+		cpio->entry.size = cpio_number(h + 54, 8, 16);
+		cpio->name_size = (uint32_t)cpio_number(h + 94, 8, 16);
+	} else {
+		cpio->entry.mode = (uint32_t)cpio_number(h + 18, 6, 8);
+		cpio->entry.mtime = (uint32_t)cpio_number(h + 48, 11, 8);
+		cpio->name_size = (uint32_t)cpio_number(h + 59, 6, 8);
+		cpio->entry.size = cpio_number(h + 65, 11, 8);
+	}
+
+	if ((cpio->name_size == 0) || (cpio->name_size > CPIO_MAX_NAME_SIZE)) {
+		debug_info("invalid name size %d", cpio->name_size);
+		return -1;
+	}
+	return 0;
+}
+
+static void cpio_skip(struct cpio_decoder *cpio, uint32_t skip, enum cpio_state next_state)
+{
+	cpio->skip = skip;
+	cpio->state = (skip > 0) ? CPIO_SKIP : next_state;
+	cpio->next_state = next_state;
+	cpio->have = 0;
+}
+
+/**
+ * Feeds uncompressed archive data to the decoder, calling the callback for
+ * every piece of entry data. Entry data is passed straight from the given
+ * buffer.
+ *
+ * @return 0 to continue, 1 if the callback asked to stop, or -1 if the
+ *     archive is invalid.
+ */
+static int cpio_feed(struct cpio_decoder *cpio, const char *data, uint32_t length, file_relay_entry_cb_t callback, void *user_data)
+{
+	uint32_t n;
+
+	while ((length > 0) || ((cpio->state == CPIO_DATA) && (cpio->entry.size == 0))) {
+		switch (cpio->state) {
+		case CPIO_HEADER:
+			n = ((cpio->have < CPIO_MAGIC_SIZE) ? CPIO_MAGIC_SIZE : cpio->header_size) - cpio->have;
+			if (n > length)
+				n = length;
+			memcpy(cpio->header + cpio->have, data, n);
+			cpio->have += n;
+			data += n;
+			length -= n;
+			if (cpio->have == CPIO_MAGIC_SIZE) {
+				if (!memcmp(cpio->header, "070707", CPIO_MAGIC_SIZE)) {
+					cpio->newc = 0;
+					cpio->header_size = CPIO_ODC_HEADER_SIZE;
+				} else if (!memcmp(cpio->header, "070701", CPIO_MAGIC_SIZE) || !memcmp(cpio->header, "070702", CPIO_MAGIC_SIZE)) {
+					cpio->newc = 1;
+					cpio->header_size = CPIO_NEWC_HEADER_SIZE;
+				} else {
+					debug_info("invalid cpio magic");
+					return -1;
+				}
+			} else if ((cpio->have > CPIO_MAGIC_SIZE) && (cpio->have == cpio->header_size)) {
+				if (cpio_parse_header(cpio) < 0)
+					return -1;
+				cpio->state = CPIO_NAME;
+				cpio->have = 0;
+			}
+			break;
+		case CPIO_NAME:
+			n = cpio->name_size - cpio->have;
+			if (n > length)
+				n = length;
+			memcpy(cpio->name + cpio->have, data, n);
+			cpio->have += n;
+			data += n;
+			length -= n;
+			if (cpio->have == cpio->name_size) {
+				cpio->name[cpio->name_size - 1] = '\0';
+				if (!strcmp(cpio->name, CPIO_TRAILER)) {
+					cpio->state = CPIO_DONE;
+					return 0;
+				}
+				/* hand out names relative to the archive root */
+				cpio->entry.name = cpio->name;
+				while ((cpio->entry.name[0] == '.') && (cpio->entry.name[1] == '/'))
+					cpio->entry.name += 2;
+				while (cpio->entry.name[0] == '/')
+					cpio->entry.name++;
+				if (!strcmp(cpio->entry.name, "."))
+					cpio->entry.name = "";
+				cpio->offset = 0;
+				cpio_skip(cpio, cpio->newc ? (4 - (cpio->header_size + cpio->name_size) % 4) % 4 : 0, CPIO_DATA);
+			}
+			break;
+		case CPIO_SKIP:
+			n = (cpio->skip < length) ? cpio->skip : length;
+			cpio->skip -= n;
+			data += n;
+			length -= n;
+			if (cpio->skip == 0)
+				cpio->state = cpio->next_state;
+			break;
+		case CPIO_DATA:
+			n = length;
+			if (n > (cpio->entry.size - cpio->offset))
+				n = (uint32_t)(cpio->entry.size - cpio->offset);
+			if ((cpio->entry.name[0] != '\0') && callback(&cpio->entry, cpio->offset, data, n, user_data)) {
+				return 1;
+			}
+			cpio->offset += n;
+			data += n;
+			length -= n;
+			if (cpio->offset == cpio->entry.size) {
+				cpio_skip(cpio, cpio->newc ? (uint32_t)((4 - cpio->entry.size % 4) % 4) : 0, CPIO_HEADER);
+			}
+			break;
+		case CPIO_DONE:
+			return 0;
+		default:
+			debug_info("invalid cpio decoder state %d", cpio->state);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** A buffer passed from the receiver thread to the decoder. */
+struct file_relay_buffer {
+	char data[FILE_RELAY_BUFFER_SIZE];
+	uint32_t length;
+	int eof;
+};
+
+struct file_relay_stream {
+	idevice_connection_t connection;
+	GAsyncQueue *free_buffers;
+	GAsyncQueue *full_buffers;
+};
+
+/**
+ * Receives the archive into the free buffers until the device closes the
+ * connection, so the transfer continues while the decoder works.
+ */
+static gpointer file_relay_receiver(gpointer data)
+{
+	struct file_relay_stream *stream = (struct file_relay_stream*)data;
+	struct file_relay_buffer *buffer;
+	int eof = 0;
+
+	while (!eof) {
+		buffer = (struct file_relay_buffer*)g_async_queue_pop(stream->free_buffers);
+		buffer->length = 0;
+		if ((idevice_connection_receive(stream->connection, buffer->data, FILE_RELAY_BUFFER_SIZE, &buffer->length) != IDEVICE_E_SUCCESS) || (buffer->length == 0)) {
+			eof = 1;
+		}
+		buffer->eof = eof;
+		g_async_queue_push(stream->full_buffers, buffer);
+	}
+
+	return NULL;
+}
+
+#endif
+
+/**
+ * Request data for the given sources and decode the received archive while
+ * it arrives. Nothing but a few receive buffers is held in memory; the
+ * entries are passed to the callback piece by piece as they are inflated.
+ *
+ * @param client The connected file_relay client.
+ * @param sources A NULL-terminated list of sources to retrieve, see
+ *     file_relay_request_sources().
+ * @param callback Function called with consecutive pieces of the data of
+ *     each entry, starting at offset 0. Directories and other entries without
+ *     data are passed once with a length of 0. Returning a non-zero value
+ *     stops decoding; the rest of the archive is still received so the device
+ *     can clean up.
+ * @param user_data Passed to the callback.
+ *
+ * @return FILE_RELAY_E_SUCCESS on success, FILE_RELAY_E_ARCHIVE_ERROR if the
+ *     received archive could not be decoded, or an error returned by
+ *     file_relay_request_sources() otherwise.
+ */
+file_relay_error_t file_relay_request_sources_with_callback(file_relay_client_t client, const char **sources, file_relay_entry_cb_t callback, void *user_data)
+{
+#ifdef HAVE_ZLIB
+	struct file_relay_stream stream;
+	struct file_relay_buffer *buffers;
+	struct file_relay_buffer *buffer;
+	struct cpio_decoder *cpio;
+	idevice_connection_t connection = NULL;
+	GThread *receiver;
+	z_stream zs;
+	char *out;
+	int stopped = 0;
+	int eof = 0;
+	int i;
+
+	if (!callback) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+	file_relay_error_t err = file_relay_request_sources(client, sources, &connection);
+	if (err != FILE_RELAY_E_SUCCESS) {
+		return err;
+	}
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	memset(&zs, '\0', sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		debug_info("could not initialize zlib");
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	stream.connection = connection;
+	stream.free_buffers = g_async_queue_new();
+	stream.full_buffers = g_async_queue_new();
+	buffers = (struct file_relay_buffer*)malloc(sizeof(struct file_relay_buffer) * FILE_RELAY_BUFFER_COUNT);
+	for (i = 0; i < FILE_RELAY_BUFFER_COUNT; i++) {
+		g_async_queue_push(stream.free_buffers, &buffers[i]);
+	}
+	out = (char*)malloc(FILE_RELAY_BUFFER_SIZE);
+	cpio = (struct cpio_decoder*)malloc(sizeof(struct cpio_decoder));
+	memset(cpio, '\0', sizeof(struct cpio_decoder));
+
+	receiver = g_thread_create(file_relay_receiver, &stream, TRUE, NULL);
+
+	while (!eof && receiver) {
+		buffer = (struct file_relay_buffer*)g_async_queue_pop(stream.full_buffers);
+		eof = buffer->eof;
+
+		zs.next_in = (Bytef*)buffer->data;
+		zs.avail_in = buffer->length;
+		while (!stopped && (cpio->state != CPIO_DONE) && (zs.avail_in > 0)) {
+			zs.next_out = (Bytef*)out;
+			zs.avail_out = FILE_RELAY_BUFFER_SIZE;
+			int zr = inflate(&zs, Z_NO_FLUSH);
+			if ((zr != Z_OK) && (zr != Z_STREAM_END)) {
+				debug_info("could not inflate archive, error %d", zr);
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				stopped = 1;
+				break;
+			}
+			int res = cpio_feed(cpio, out, FILE_RELAY_BUFFER_SIZE - zs.avail_out, callback, user_data);
+			if (res < 0) {
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+			}
+			if (res != 0) {
+				stopped = 1;
+			}
+			if (zr == Z_STREAM_END) {
+				/* gzip allows several members in a row */
+				inflateReset(&zs);
+			}
+		}
+
+		g_async_queue_push(stream.free_buffers, buffer);
+	}
+
+	if (receiver) {
+		g_thread_join(receiver);
+	} else {
+		debug_info("could not create receiver thread");
+		err = FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+	if ((err == FILE_RELAY_E_SUCCESS) && !stopped && (cpio->state != CPIO_DONE)) {
+		debug_info("archive is truncated");
+		err = FILE_RELAY_E_ARCHIVE_ERROR;
+	}
+
+	inflateEnd(&zs);
+	g_async_queue_unref(stream.free_buffers);
+	g_async_queue_unref(stream.full_buffers);
+	free(buffers);
+	free(out);
+	free(cpio);
+
+	return err;
+#else
+	debug_info("built without zlib, archives cannot be decoded");
+	return FILE_RELAY_E_UNKNOWN_ERROR;
+#endif
+}
+
+struct file_relay_extract {
+	const char *path;
+	char *current;
+	int fd;
+	GString *link;
+	int skip;
+	file_relay_error_t err;
+};
+
+/**
+ * Checks that an archive entry stays inside the target directory.
+ */
+static int file_relay_path_is_safe(const char *name)
+{
+	const char *p = name;
+	const char *end;
+
+	while (*p) {
+		end = strchr(p, '/');
+		if ((end ? (size_t)(end - p) : strlen(p)) == 2 && !strncmp(p, "..", 2))
+			return 0;
+		if (!end)
+			break;
+		p = end + 1;
+	}
+	return 1;
+}
+
+/**
+ * Creates the directories leading to an archive entry below the target
+ * directory. Components that exist already must be directories and not
+ * symbolic links, as an earlier entry of the archive could have created a
+ * link pointing outside of the target directory.
+ *
+ * @return 1 on success, 0 if the entry has to be skipped.
+ */
+static int file_relay_make_parents(const char *root, const char *name)
+{
+	char **parts = g_strsplit(name, "/", 0);
+	GString *path = g_string_new(root);
+	struct stat st;
+	int res = 1;
+	int i;
+
+	for (i = 0; parts[i] && parts[i + 1]; i++) {
+		if (!parts[i][0] || !strcmp(parts[i], "."))
+			continue;
+		g_string_append_c(path, G_DIR_SEPARATOR);
+		g_string_append(path, parts[i]);
+		if (lstat(path->str, &st) == 0) {
+			if (!S_ISDIR(st.st_mode)) {
+				debug_info("%s is not a directory", path->str);
+				res = 0;
+				break;
+			}
+		} else if (mkdir(path->str, 0755) < 0) {
+			debug_info("could not create directory %s: %s", path->str, strerror(errno));
+			res = 0;
+			break;
+		}
+	}
+	g_string_free(path, TRUE);
+	g_strfreev(parts);
+
+	return res;
+}
+
+static int file_relay_extract_entry(file_relay_entry_t entry, uint64_t offset, const char *data, uint32_t length, void *user_data)
+{
+	struct file_relay_extract *ex = (struct file_relay_extract*)user_data;
+	uint64_t end = offset + length;
+
+	if (offset == 0) {
+		ex->skip = 0;
+		if (!file_relay_path_is_safe(entry->name)) {
+			debug_info("skipping unsafe entry %s", entry->name);
+			ex->skip = 1;
+			return 0;
+		}
+		if (!file_relay_make_parents(ex->path, entry->name)) {
+			debug_info("skipping entry %s below a link or file", entry->name);
+			ex->skip = 1;
+			return 0;
+		}
+		ex->current = g_build_filename(ex->path, entry->name, NULL);
+
+		struct stat st;
+		int exists = (lstat(ex->current, &st) == 0);
+
+		if (S_ISDIR(entry->mode)) {
+			if (exists ? !S_ISDIR(st.st_mode) : (mkdir(ex->current, 0755) < 0)) {
+				debug_info("could not create directory %s", ex->current);
+				goto error;
+			}
+		} else if (S_ISREG(entry->mode)) {
+			/* replace a link instead of writing to its target */
+			if (exists && S_ISLNK(st.st_mode))
+				unlink(ex->current);
+			ex->fd = open(ex->current, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, (entry->mode & 0777) | 0600);
+			if (ex->fd < 0) {
+				debug_info("could not create %s: %s", ex->current, strerror(errno));
+				goto error;
+			}
+		} else if (S_ISLNK(entry->mode)) {
+			ex->link = g_string_sized_new((gsize)entry->size);
+		} else {
+			debug_info("skipping special file %s", entry->name);
+		}
+	}
+	if (ex->skip) {
+		return 0;
+	}
+
+	if (ex->fd >= 0) {
+		while (length > 0) {
+			ssize_t written = write(ex->fd, data, length);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				debug_info("could not write %s: %s", ex->current, strerror(errno));
+				goto error;
+			}
+			data += written;
+			length -= written;
+		}
+	} else if (ex->link) {
+		g_string_append_len(ex->link, data, length);
+	}
+
+	if (end >= entry->size) {
+		if (ex->fd >= 0) {
+			struct utimbuf times;
+			close(ex->fd);
+			ex->fd = -1;
+			times.actime = times.modtime = entry->mtime;
+			utime(ex->current, &times);
+		}
+		if (ex->link) {
+			unlink(ex->current);
+			if (symlink(ex->link->str, ex->current) < 0) {
+				debug_info("could not create link %s: %s", ex->current, strerror(errno));
+			}
+			g_string_free(ex->link, TRUE);
+			ex->link = NULL;
+		}
+		g_free(ex->current);
+		ex->current = NULL;
+	}
+	return 0;
+
+error:
+	ex->err = FILE_RELAY_E_UNKNOWN_ERROR;
+	return 1;
+}
+
+/**
+ * Request data for the given sources and extract the received archive into
+ * a directory while it arrives.
+ *
+ * @param client The connected file_relay client.
+ * @param sources A NULL-terminated list of sources to retrieve, see
+ *     file_relay_request_sources().
+ * @param path The directory to extract to, created when needed. Entries
+ *     leading outside of it, also through links created by earlier
+ *     entries, are skipped.
+ *
+ * @return FILE_RELAY_E_SUCCESS on success, FILE_RELAY_E_UNKNOWN_ERROR if
+ *     a file could not be written, or an error returned by
+ *     file_relay_request_sources_with_callback() otherwise.
+ */
+file_relay_error_t file_relay_request_sources_to_directory(file_relay_client_t client, const char **sources, const char *path)
+{
+	struct file_relay_extract ex;
+	file_relay_error_t err;
+
+	if (!path) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+	if (g_mkdir_with_parents(path, 0755) < 0) {
+		debug_info("could not create %s", path);
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	memset(&ex, '\0', sizeof(ex));
+	ex.path = path;
+	ex.fd = -1;
+	ex.err = FILE_RELAY_E_SUCCESS;
+
+	err = file_relay_request_sources_with_callback(client, sources, file_relay_extract_entry, &ex);
+	if (err == FILE_RELAY_E_SUCCESS) {
+		err = ex.err;
+	}
+
+	if (ex.fd >= 0) {
+		close(ex.fd);
+	}
+	if (ex.link) {
+		g_string_free(ex.link, TRUE);
+	}
+	g_free(ex.current);
+
+	return err;
+}
@@ -29,6 +29,8 @@
 #include "afc.h"
 #include "debug.h"
 
+static void house_arrest_pool_entry_free(struct house_arrest_pool_entry *entry);
+
 /**
  * Convert a property_list_service_error_t value to a house_arrest_error_t
  * value. Used internally to get correct error codes.
@@ -140,7 +142,7 @@ house_arrest_error_t house_arrest_send_request(house_arrest_client_t client, pli
 	if (client->mode != HOUSE_ARREST_CLIENT_MODE_NORMAL)
 		return HOUSE_ARREST_E_INVALID_MODE;
 
-	house_arrest_error_t res = house_arrest_error(property_list_service_send_xml_plist(client->parent, dict));
+	house_arrest_error_t res = house_arrest_error(property_list_service_send_plist(client->parent, dict));
         if (res != HOUSE_ARREST_E_SUCCESS) {
                 debug_info("could not send plist, error %d", res);
         }
@@ -248,3 +250,287 @@ afc_error_t afc_client_new_from_house_arrest_client(house_arrest_client_t client
 	}
 	return err;
 }
+
+/**
+ * Creates a pool of house_arrest AFC clients for the given device. The pool
+ * keeps a lockdown session open for starting the house_arrest service and
+ * keeps the vended AFC clients by application identifier, so accessing the
+ * same container again needs no setup at all.
+ *
+ * @param device The device to connect to.
+ * @param max_clients Maximum number of idle AFC clients to keep around.
+ *     When more are needed the least recently used ones are closed.
+ * @param pool Pointer that will point to a newly allocated
+ *     house_arrest_pool_t upon successful return.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success, HOUSE_ARREST_E_INVALID_ARG when
+ *     device or pool is NULL or max_clients is 0, or
+ *     HOUSE_ARREST_E_CONN_FAILED if lockdownd could not be reached.
+ */
+house_arrest_error_t house_arrest_pool_new(idevice_t device, uint32_t max_clients, house_arrest_pool_t *pool)
+{
+	if (!device || !pool || (max_clients == 0))
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	lockdownd_client_t lockdown = NULL;
+	if (lockdownd_client_new_with_handshake(device, &lockdown, "house_arrest_pool") != LOCKDOWN_E_SUCCESS) {
+		debug_info("could not connect to lockdownd");
+		return HOUSE_ARREST_E_CONN_FAILED;
+	}
+
+	house_arrest_pool_t pool_loc = (house_arrest_pool_t) malloc(sizeof(struct house_arrest_pool_private));
+	pool_loc->device = device;
+	pool_loc->lockdown = lockdown;
+	pool_loc->max_clients = max_clients;
+	pool_loc->clock = 0;
+	pool_loc->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)house_arrest_pool_entry_free);
+	pool_loc->mutex = g_mutex_new();
+
+	*pool = pool_loc;
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+/**
+ * Closes all AFC clients of the pool and frees it.
+ *
+ * @note AFC clients acquired from the pool must not be used anymore after
+ *     calling this function.
+ *
+ * @param pool The pool to free.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success, or HOUSE_ARREST_E_INVALID_ARG
+ *     when pool is NULL.
+ */
+house_arrest_error_t house_arrest_pool_free(house_arrest_pool_t pool)
+{
+	if (!pool)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	g_hash_table_destroy(pool->entries);
+	if (pool->lockdown) {
+		lockdownd_client_free(pool->lockdown);
+	}
+	g_mutex_free(pool->mutex);
+	free(pool);
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+static void house_arrest_pool_entry_free(struct house_arrest_pool_entry *entry)
+{
+	if (entry->afc) {
+		afc_client_free(entry->afc);
+	}
+	if (entry->client) {
+		house_arrest_client_free(entry->client);
+	}
+	free(entry);
+}
+
+struct house_arrest_pool_victim {
+	const char *key;
+	uint64_t last_used;
+};
+
+static void house_arrest_pool_find_victim(gpointer key, gpointer value, gpointer user_data)
+{
+	struct house_arrest_pool_entry *entry = (struct house_arrest_pool_entry*)value;
+	struct house_arrest_pool_victim *victim = (struct house_arrest_pool_victim*)user_data;
+
+	if ((entry->users == 0) && (!victim->key || (entry->last_used < victim->last_used))) {
+		victim->key = (const char*)key;
+		victim->last_used = entry->last_used;
+	}
+}
+
+/**
+ * Closes least recently used idle clients until there is room for one more.
+ */
+static void house_arrest_pool_evict(house_arrest_pool_t pool)
+{
+	struct house_arrest_pool_victim victim;
+
+	while (g_hash_table_size(pool->entries) >= pool->max_clients) {
+		victim.key = NULL;
+		victim.last_used = 0;
+		g_hash_table_foreach(pool->entries, house_arrest_pool_find_victim, &victim);
+		if (!victim.key) {
+			/* all clients are in use, the pool grows for now */
+			break;
+		}
+		debug_info("evicting %s", victim.key);
+		g_hash_table_remove(pool->entries, victim.key);
+	}
+}
+
+/**
+ * Starts the house_arrest service using the pool's lockdown session. The
+ * session is opened again once if the device dropped it.
+ */
+static house_arrest_error_t house_arrest_pool_connect(house_arrest_pool_t pool, house_arrest_client_t *client)
+{
+	uint16_t port = 0;
+
+	if (!pool->lockdown || (lockdownd_start_service(pool->lockdown, "com.apple.mobile.house_arrest", &port) != LOCKDOWN_E_SUCCESS)) {
+		if (pool->lockdown) {
+			lockdownd_client_free(pool->lockdown);
+			pool->lockdown = NULL;
+		}
+		if (lockdownd_client_new_with_handshake(pool->device, &pool->lockdown, "house_arrest_pool") != LOCKDOWN_E_SUCCESS) {
+			debug_info("could not connect to lockdownd");
+			pool->lockdown = NULL;
+			return HOUSE_ARREST_E_CONN_FAILED;
+		}
+		if (lockdownd_start_service(pool->lockdown, "com.apple.mobile.house_arrest", &port) != LOCKDOWN_E_SUCCESS) {
+			debug_info("could not start house_arrest service");
+			return HOUSE_ARREST_E_CONN_FAILED;
+		}
+	}
+
+	return house_arrest_client_new(pool->device, port, client);
+}
+
+/**
+ * Vends the container of an application and creates an AFC client for it.
+ */
+static house_arrest_error_t house_arrest_pool_vend(house_arrest_pool_t pool, const char *command, const char *appid, struct house_arrest_pool_entry **entry)
+{
+	house_arrest_client_t client = NULL;
+	afc_client_t afc = NULL;
+	plist_t dict = NULL;
+
+	house_arrest_error_t res = house_arrest_pool_connect(pool, &client);
+	if (res != HOUSE_ARREST_E_SUCCESS) {
+		return res;
+	}
+
+	res = house_arrest_send_command(client, command, appid);
+	if (res == HOUSE_ARREST_E_SUCCESS) {
+		res = house_arrest_get_result(client, &dict);
+	}
+	if (res == HOUSE_ARREST_E_SUCCESS) {
+		plist_t node = plist_dict_get_item(dict, "Error");
+		if (node) {
+			char *errmsg = NULL;
+			plist_get_string_val(node, &errmsg);
+			debug_info("could not vend container of %s: %s", appid, errmsg);
+			free(errmsg);
+			res = HOUSE_ARREST_E_VEND_FAILED;
+		}
+	}
+	if (dict) {
+		plist_free(dict);
+	}
+	if ((res == HOUSE_ARREST_E_SUCCESS) && (afc_client_new_from_house_arrest_client(client, &afc) != AFC_E_SUCCESS)) {
+		res = HOUSE_ARREST_E_CONN_FAILED;
+	}
+
+	if (res != HOUSE_ARREST_E_SUCCESS) {
+		house_arrest_client_free(client);
+		return res;
+	}
+
+	*entry = (struct house_arrest_pool_entry*) malloc(sizeof(struct house_arrest_pool_entry));
+	(*entry)->client = client;
+	(*entry)->afc = afc;
+	(*entry)->users = 0;
+	(*entry)->last_used = 0;
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+/**
+ * Gets an AFC client for the container of an application from the pool.
+ * A client vended before is returned right away; otherwise the container is
+ * vended, possibly closing the least recently used idle client.
+ *
+ * @param pool The pool to use.
+ * @param command The command used to vend the container, VendContainer or
+ *     VendDocuments.
+ * @param appid The application identifier of the container.
+ * @param afc Pointer that will be set to the AFC client. It stays owned by
+ *     the pool and must be returned with house_arrest_pool_release().
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success, HOUSE_ARREST_E_INVALID_ARG when
+ *     one of the parameters is invalid, HOUSE_ARREST_E_VEND_FAILED if the
+ *     device refused to vend the container, or an HOUSE_ARREST_E_* error
+ *     code otherwise.
+ */
+house_arrest_error_t house_arrest_pool_acquire(house_arrest_pool_t pool, const char *command, const char *appid, afc_client_t *afc)
+{
+	if (!pool || !command || !appid || !afc)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	house_arrest_error_t res = HOUSE_ARREST_E_SUCCESS;
+	char *key = g_strconcat(command, "/", appid, NULL);
+
+	g_mutex_lock(pool->mutex);
+
+	struct house_arrest_pool_entry *entry = (struct house_arrest_pool_entry*)g_hash_table_lookup(pool->entries, key);
+	if (!entry) {
+		house_arrest_pool_evict(pool);
+		res = house_arrest_pool_vend(pool, command, appid, &entry);
+		if (res == HOUSE_ARREST_E_SUCCESS) {
+			g_hash_table_insert(pool->entries, key, entry);
+			key = NULL;
+		}
+	}
+	if (res == HOUSE_ARREST_E_SUCCESS) {
+		entry->users++;
+		entry->last_used = ++pool->clock;
+		*afc = entry->afc;
+	}
+
+	g_mutex_unlock(pool->mutex);
+	g_free(key);
+
+	return res;
+}
+
+struct house_arrest_pool_search {
+	afc_client_t afc;
+	struct house_arrest_pool_entry *entry;
+};
+
+static void house_arrest_pool_find_afc(gpointer key, gpointer value, gpointer user_data)
+{
+	struct house_arrest_pool_entry *entry = (struct house_arrest_pool_entry*)value;
+	struct house_arrest_pool_search *search = (struct house_arrest_pool_search*)user_data;
+
+	if (entry->afc == search->afc)
+		search->entry = entry;
+}
+
+/**
+ * Returns an AFC client acquired with house_arrest_pool_acquire() to the
+ * pool. The client stays open for later use until it gets evicted.
+ *
+ * @param pool The pool the client was acquired from.
+ * @param afc The AFC client to return.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success, or HOUSE_ARREST_E_INVALID_ARG
+ *     when pool is NULL or afc was not acquired from it.
+ */
+house_arrest_error_t house_arrest_pool_release(house_arrest_pool_t pool, afc_client_t afc)
+{
+	struct house_arrest_pool_search search;
+
+	if (!pool || !afc)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	search.afc = afc;
+	search.entry = NULL;
+
+	g_mutex_lock(pool->mutex);
+	g_hash_table_foreach(pool->entries, house_arrest_pool_find_afc, &search);
+	if (search.entry && (search.entry->users > 0)) {
+		search.entry->users--;
+	}
+	g_mutex_unlock(pool->mutex);
+
+	return search.entry ? HOUSE_ARREST_E_SUCCESS : HOUSE_ARREST_E_INVALID_ARG;
+}
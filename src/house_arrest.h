@@ -25,6 +25,7 @@
 
 #include "libimobiledevice/house_arrest.h"
 #include "property_list_service.h"
+#include "libimobiledevice/lockdown.h"
 
 enum house_arrest_client_mode {
 	HOUSE_ARREST_CLIENT_MODE_NORMAL = 0,
@@ -36,4 +37,20 @@ struct house_arrest_client_private {
 	enum house_arrest_client_mode mode;
 };
 
+struct house_arrest_pool_entry {
+	house_arrest_client_t client;
+	afc_client_t afc;
+	uint32_t users;
+	uint64_t last_used;
+};
+
+struct house_arrest_pool_private {
+	idevice_t device;
+	lockdownd_client_t lockdown;
+	uint32_t max_clients;
+	uint64_t clock;
+	GHashTable *entries;
+	GMutex *mutex;
+};
+
 #endif
@@ -20,29 +20,135 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <glib.h>
 
 #include <usbmuxd.h>
 #include <gnutls/gnutls.h>
 #include "idevice.h"
 #include "userpref.h"
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_SSL
 #include "debug.h"
 
 static idevice_event_cb_t event_cb = NULL;
+static void *event_user_data = NULL;
+
+/** Additional receivers of device events, used by event hubs */
+struct idevice_event_listener {
+	idevice_event_cb_t callback;
+	void *user_data;
+	int refs;
+	int removed;
+};
+
+static GStaticMutex event_listener_mutex = G_STATIC_MUTEX_INIT;
+static GList *event_listeners = NULL;
+/* set while listener callbacks run, which is done without the mutex */
+static GThread *event_dispatch_thread = NULL;
+static GCond *event_dispatch_done = NULL;
+
+/**
+ * Drops a reference of a listener. The caller must hold
+ * event_listener_mutex.
+ */
+static void event_listener_unref(struct idevice_event_listener *listener)
+{
+	if (--listener->refs == 0)
+		free(listener);
+}
+
+static GStaticMutex event_subscription_mutex = G_STATIC_MUTEX_INIT;
+static int event_subscribed = 0;
 
 static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
 {
 	idevice_event_t ev;
+	idevice_event_cb_t callback = event_cb;
+	GList *listeners;
+	GList *l;
 
 	ev.event = event->event;
 	ev.uuid = event->device.uuid;
 	ev.conn_type = CONNECTION_USBMUXD;
 
-	if (event_cb) {
-		event_cb(&ev, user_data);
+	if (callback) {
+		callback(&ev, event_user_data);
+	}
+
+	/* the callbacks run without the mutex, so they may block or add and
+	   remove listeners themselves */
+	g_static_mutex_lock(&event_listener_mutex);
+	listeners = g_list_copy(event_listeners);
+	for (l = listeners; l; l = l->next) {
+		((struct idevice_event_listener*)l->data)->refs++;
+	}
+	event_dispatch_thread = g_thread_self();
+	for (l = listeners; l; l = l->next) {
+		struct idevice_event_listener *listener = (struct idevice_event_listener*)l->data;
+		if (listener->removed)
+			continue;
+		g_static_mutex_unlock(&event_listener_mutex);
+		listener->callback(&ev, listener->user_data);
+		g_static_mutex_lock(&event_listener_mutex);
+	}
+	event_dispatch_thread = NULL;
+	for (l = listeners; l; l = l->next) {
+		event_listener_unref((struct idevice_event_listener*)l->data);
+	}
+	g_list_free(listeners);
+	if (event_dispatch_done)
+		g_cond_broadcast(event_dispatch_done);
+	g_static_mutex_unlock(&event_listener_mutex);
+}
+
+/**
+ * Subscribes to or unsubscribes from usbmuxd events depending on whether
+ * anybody is interested in them.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_UNKNOWN_ERROR when
+ *   usbmuxd refused the subscription.
+ */
+static idevice_error_t event_subscription_update()
+{
+	idevice_error_t ret = IDEVICE_E_SUCCESS;
+	int needed;
+	int res;
+
+	g_static_mutex_lock(&event_subscription_mutex);
+	g_static_mutex_lock(&event_listener_mutex);
+	needed = (event_cb != NULL) || (event_listeners != NULL);
+	g_static_mutex_unlock(&event_listener_mutex);
+
+	if (needed && !event_subscribed) {
+		res = usbmuxd_subscribe(usbmux_event_cb, NULL);
+		if (res != 0) {
+			debug_info("Error %d when subscribing usbmux event callback!", res);
+			ret = IDEVICE_E_UNKNOWN_ERROR;
+		} else {
+			event_subscribed = 1;
+		}
+	} else if (!needed && event_subscribed) {
+		res = usbmuxd_unsubscribe();
+		if (res != 0) {
+			debug_info("Error %d when unsubscribing usbmux event callback!", res);
+			ret = IDEVICE_E_UNKNOWN_ERROR;
+		}
+		event_subscribed = 0;
 	}
+	g_static_mutex_unlock(&event_subscription_mutex);
+
+	return ret;
 }
 
 /**
@@ -57,11 +163,10 @@ static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
  */
 idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
 {
+	event_user_data = user_data;
 	event_cb = callback;
-	int res = usbmuxd_subscribe(usbmux_event_cb, user_data);
-        if (res != 0) {
+	if (event_subscription_update() != IDEVICE_E_SUCCESS) {
 		event_cb = NULL;
-		debug_info("Error %d when subscribing usbmux event callback!", res);
 		return IDEVICE_E_UNKNOWN_ERROR;
 	}
 	return IDEVICE_E_SUCCESS;
@@ -76,17 +181,270 @@ idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_
 idevice_error_t idevice_event_unsubscribe()
 {
 	event_cb = NULL;
-	int res = usbmuxd_unsubscribe();
-	if (res != 0) {
-		debug_info("Error %d when unsubscribing usbmux event callback!", res);
-		return IDEVICE_E_UNKNOWN_ERROR;
+	return event_subscription_update();
+}
+
+/**
+ * Adds a receiver of device events in addition to the callback registered
+ * with idevice_event_subscribe().
+ *
+ * @param callback Function to call for every event.
+ * @param user_data Data passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occured.
+ */
+idevice_error_t idevice_event_add_listener(idevice_event_cb_t callback, void *user_data)
+{
+	struct idevice_event_listener *listener;
+	idevice_error_t ret;
+
+	if (!callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	listener = (struct idevice_event_listener*)malloc(sizeof(struct idevice_event_listener));
+	listener->callback = callback;
+	listener->user_data = user_data;
+	listener->refs = 1;
+	listener->removed = 0;
+
+	g_static_mutex_lock(&event_listener_mutex);
+	if (!event_dispatch_done)
+		event_dispatch_done = g_cond_new();
+	event_listeners = g_list_append(event_listeners, listener);
+	g_static_mutex_unlock(&event_listener_mutex);
+
+	ret = event_subscription_update();
+	if (ret != IDEVICE_E_SUCCESS) {
+		idevice_event_remove_listener(callback, user_data);
+	}
+	return ret;
+}
+
+/**
+ * Removes a receiver of device events added with
+ *  idevice_event_add_listener(). When this function returns the callback
+ *  is not running anymore and will not be called again, unless it is
+ *  called from the callback itself.
+ *
+ * @param callback The callback function that was added.
+ * @param user_data The data it was added with.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occured.
+ */
+idevice_error_t idevice_event_remove_listener(idevice_event_cb_t callback, void *user_data)
+{
+	struct idevice_event_listener *listener = NULL;
+	GList *l;
+
+	g_static_mutex_lock(&event_listener_mutex);
+	for (l = event_listeners; l; l = l->next) {
+		struct idevice_event_listener *cur = (struct idevice_event_listener*)l->data;
+		if ((cur->callback == callback) && (cur->user_data == user_data)) {
+			listener = cur;
+			event_listeners = g_list_delete_link(event_listeners, l);
+			break;
+		}
+	}
+	if (listener) {
+		listener->removed = 1;
+		/* wait for a callback running on the event thread */
+		while (event_dispatch_thread && (event_dispatch_thread != g_thread_self())) {
+			g_cond_wait(event_dispatch_done, g_static_mutex_get_mutex(&event_listener_mutex));
+		}
+		event_listener_unref(listener);
+	}
+	g_static_mutex_unlock(&event_listener_mutex);
+
+	if (!listener)
+		return IDEVICE_E_INVALID_ARG;
+
+	return event_subscription_update();
+}
+
+/** Table of the available devices kept up to date from usbmuxd events */
+static GStaticMutex device_cache_mutex = G_STATIC_MUTEX_INIT;
+static GList *device_cache = NULL;
+static int device_cache_enabled = 0;
+/* events arriving while the table is seeded, replayed on top of it */
+static int device_cache_seeding = 0;
+static GList *device_cache_pending = NULL;
+
+/**
+ * Applies a device event to the cached table.
+ * The caller must hold device_cache_mutex.
+ */
+static void device_cache_apply(enum idevice_event_type type, const char *uuid)
+{
+	GList *l;
+
+	for (l = device_cache; l; l = l->next) {
+		if (!strcmp((char*)l->data, uuid))
+			break;
+	}
+	if ((type == IDEVICE_DEVICE_ADD) && !l) {
+		device_cache = g_list_append(device_cache, strdup(uuid));
+	} else if ((type == IDEVICE_DEVICE_REMOVE) && l) {
+		free(l->data);
+		device_cache = g_list_delete_link(device_cache, l);
+	}
+}
+
+static void device_cache_event_cb(const idevice_event_t *event, void *user_data)
+{
+	g_static_mutex_lock(&device_cache_mutex);
+	if (device_cache_seeding) {
+		idevice_event_t *copy = (idevice_event_t*)malloc(sizeof(idevice_event_t));
+		copy->event = event->event;
+		copy->uuid = strdup(event->uuid);
+		copy->conn_type = event->conn_type;
+		device_cache_pending = g_list_append(device_cache_pending, copy);
+	} else {
+		device_cache_apply(event->event, event->uuid);
+	}
+	g_static_mutex_unlock(&device_cache_mutex);
+}
+
+/**
+ * Replays the events queued while seeding, or drops them when replay is 0.
+ * The caller must hold device_cache_mutex.
+ */
+static void device_cache_flush_pending(int replay)
+{
+	GList *l;
+
+	for (l = device_cache_pending; l; l = l->next) {
+		idevice_event_t *event = (idevice_event_t*)l->data;
+		if (replay)
+			device_cache_apply(event->event, event->uuid);
+		free((char*)event->uuid);
+		free(event);
+	}
+	g_list_free(device_cache_pending);
+	device_cache_pending = NULL;
+	device_cache_seeding = 0;
+}
+
+static void device_cache_clear()
+{
+	GList *l;
+
+	for (l = device_cache; l; l = l->next) {
+		free(l->data);
+	}
+	g_list_free(device_cache);
+	device_cache = NULL;
+}
+
+/**
+ * Enables or disables the cached device list. While enabled, the library
+ * keeps a table of the available devices which is updated from usbmuxd
+ * device events, and idevice_get_device_list() reads from this table
+ * instead of asking usbmuxd each time.
+ *
+ * @param enable 1 to enable the cache, 0 to disable it.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_NO_DEVICE when usbmuxd
+ *   is not running or IDEVICE_E_UNKNOWN_ERROR when subscribing to
+ *   usbmuxd events failed.
+ */
+idevice_error_t idevice_set_device_list_cache(int enable)
+{
+	usbmuxd_device_info_t *dev_list;
+	idevice_error_t ret;
+	int i;
+
+	if (!enable) {
+		if (!device_cache_enabled)
+			return IDEVICE_E_SUCCESS;
+		g_static_mutex_lock(&device_cache_mutex);
+		device_cache_enabled = 0;
+		g_static_mutex_unlock(&device_cache_mutex);
+		ret = idevice_event_remove_listener(device_cache_event_cb, NULL);
+		g_static_mutex_lock(&device_cache_mutex);
+		device_cache_clear();
+		g_static_mutex_unlock(&device_cache_mutex);
+		return ret;
+	}
+
+	if (device_cache_enabled)
+		return IDEVICE_E_SUCCESS;
+
+	/* subscribe first so that no event gets lost while seeding the table;
+	 * the events arriving until the list is installed are queued */
+	g_static_mutex_lock(&device_cache_mutex);
+	device_cache_seeding = 1;
+	g_static_mutex_unlock(&device_cache_mutex);
+	ret = idevice_event_add_listener(device_cache_event_cb, NULL);
+	if (ret != IDEVICE_E_SUCCESS) {
+		g_static_mutex_lock(&device_cache_mutex);
+		device_cache_flush_pending(0);
+		g_static_mutex_unlock(&device_cache_mutex);
+		return ret;
 	}
+
+	if (usbmuxd_get_device_list(&dev_list) < 0) {
+		debug_info("ERROR: usbmuxd is not running!");
+		idevice_event_remove_listener(device_cache_event_cb, NULL);
+		g_static_mutex_lock(&device_cache_mutex);
+		device_cache_flush_pending(0);
+		device_cache_clear();
+		g_static_mutex_unlock(&device_cache_mutex);
+		return IDEVICE_E_NO_DEVICE;
+	}
+
+	/* the queued events may predate the list, but replaying them in order
+	 * ends with the state of their last one, which is at least as new */
+	g_static_mutex_lock(&device_cache_mutex);
+	device_cache_clear();
+	for (i = 0; dev_list[i].handle > 0; i++) {
+		device_cache = g_list_append(device_cache, strdup(dev_list[i].uuid));
+	}
+	device_cache_flush_pending(1);
+	device_cache_enabled = 1;
+	g_static_mutex_unlock(&device_cache_mutex);
+	usbmuxd_device_list_free(&dev_list);
+
 	return IDEVICE_E_SUCCESS;
 }
 
+/**
+ * Copies the cached device table into a newly allocated uuid list.
+ *
+ * @return 1 if the cache is enabled and was copied, 0 otherwise.
+ */
+static int device_cache_get_list(char ***devices, int *count)
+{
+	GList *l;
+	char **newlist;
+	int i = 0;
+
+	g_static_mutex_lock(&device_cache_mutex);
+	if (!device_cache_enabled) {
+		g_static_mutex_unlock(&device_cache_mutex);
+		return 0;
+	}
+	newlist = (char**)malloc(sizeof(char*) * (g_list_length(device_cache) + 1));
+	for (l = device_cache; l; l = l->next) {
+		newlist[i++] = strdup((char*)l->data);
+	}
+	g_static_mutex_unlock(&device_cache_mutex);
+
+	newlist[i] = NULL;
+	*devices = newlist;
+	*count = i;
+	return 1;
+}
+
 /**
  * Get a list of currently available devices.
  *
+ * @note When the cached device list is enabled with
+ *   idevice_set_device_list_cache() the list is read from memory.
+ *
  * @param devices List of uuids of devices that are currently available.
  *   This list is terminated by a NULL pointer.
  * @param count Number of devices found.
@@ -100,6 +458,9 @@ idevice_error_t idevice_get_device_list(char ***devices, int *count)
 	*devices = NULL;
 	*count = 0;
 
+	if (device_cache_get_list(devices, count))
+		return IDEVICE_E_SUCCESS;
+
 	if (usbmuxd_get_device_list(&dev_list) < 0) {
 		debug_info("ERROR: usbmuxd is not running!\n", __func__);
 		return IDEVICE_E_NO_DEVICE;
@@ -142,6 +503,34 @@ idevice_error_t idevice_device_list_free(char **devices)
 	return IDEVICE_E_SUCCESS;
 }
 
+/**
+ * Internally used function to look up the network address of a device in
+ * the IDEVICE_NETWORK_DEVICES environment variable.
+ *
+ * @return The host name or address of the device, which has to be freed,
+ *  or NULL if the device is not listed.
+ */
+static char *internal_get_network_address(const char *uuid)
+{
+	const char *list = getenv("IDEVICE_NETWORK_DEVICES");
+	char **entries;
+	char *host = NULL;
+	int i;
+
+	if (!list)
+		return NULL;
+
+	entries = g_strsplit(list, ",", 0);
+	for (i = 0; entries[i] && !host; i++) {
+		char *sep = strchr(entries[i], '=');
+		if (sep && ((size_t)(sep - entries[i]) == strlen(uuid)) && !strncmp(entries[i], uuid, sep - entries[i]) && sep[1]) {
+			host = strdup(sep + 1);
+		}
+	}
+	g_strfreev(entries);
+	return host;
+}
+
 /**
  * Creates an idevice_t structure for the device specified by uuid,
  *  if the device is available.
@@ -157,19 +546,179 @@ idevice_error_t idevice_device_list_free(char **devices)
  */
 idevice_error_t idevice_new(idevice_t * device, const char *uuid)
 {
+	uint64_t trace_start = idevice_trace_begin();
+	idevice_error_t ret = IDEVICE_E_NO_DEVICE;
 	usbmuxd_device_info_t muxdev;
 	int res = usbmuxd_get_device_by_uuid(uuid, &muxdev);
 	if (res > 0) {
-		idevice_t phone = (idevice_t) malloc(sizeof(struct idevice_private));
+		idevice_t phone = (idevice_t) calloc(1, sizeof(struct idevice_private));
 		phone->uuid = strdup(muxdev.uuid);
 		phone->conn_type = CONNECTION_USBMUXD;
 		phone->conn_data = (void*)(long)muxdev.handle;
+		phone->recorder = NULL;
 		*device = phone;
-		return IDEVICE_E_SUCCESS;
+		ret = IDEVICE_E_SUCCESS;
+	} else if (uuid) {
+		/* other connection types could follow here */
+		char *host = internal_get_network_address(uuid);
+		if (host) {
+			ret = idevice_new_network(device, uuid, host);
+			free(host);
+		}
 	}
-	/* other connection types could follow here */
 
-	return IDEVICE_E_NO_DEVICE;
+	idevice_trace_end(IDEVICE_TRACE_DEVICE_NEW, (ret == IDEVICE_E_SUCCESS) ? (*device)->uuid : uuid, trace_start, ret);
+	return ret;
+}
+
+/**
+ * Creates an idevice_t structure for a device that is reachable over the
+ * network. Connections to it are made with TCP straight to the ports of
+ * the device instead of through usbmuxd.
+ *
+ * @note idevice_new() creates such devices as well for UUIDs listed in the
+ *  IDEVICE_NETWORK_DEVICES environment variable, a comma separated list of
+ *  UUID=host entries, when usbmuxd does not know the device.
+ *
+ * @param device Pointer that will be set to the new device.
+ * @param uuid The UUID of the device.
+ * @param host Host name or address of the device.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_new_network(idevice_t *device, const char *uuid, const char *host)
+{
+	if (!device || !uuid || !host)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_t phone = (idevice_t) calloc(1, sizeof(struct idevice_private));
+	phone->uuid = strdup(uuid);
+	phone->conn_type = CONNECTION_TCP;
+	phone->conn_data = strdup(host);
+	phone->recorder = NULL;
+	*device = phone;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Creates an idevice_t structure for a device that only exists in the
+ * process. Every connection made to it is a socket pair: the library side
+ * behaves like a connection to a real device, the other side is passed
+ * to the callback, which plays the part of the service on the device.
+ * This allows to exercise and benchmark the protocol code without
+ * hardware and without usbmuxd.
+ *
+ * @param device Pointer that will be set to the new device.
+ * @param uuid The UUID the device reports, used for pairing records and
+ *  SSL session caching.
+ * @param callback Function that serves the device side of new connections.
+ * @param user_data Passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_new_loopback(idevice_t *device, const char *uuid, idevice_loopback_cb_t callback, void *user_data)
+{
+	if (!device || !uuid || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	struct loopback_device *loopback = (struct loopback_device*)malloc(sizeof(struct loopback_device));
+	loopback->callback = callback;
+	loopback->user_data = user_data;
+
+	idevice_t phone = (idevice_t) calloc(1, sizeof(struct idevice_private));
+	phone->uuid = strdup(uuid);
+	phone->conn_type = CONNECTION_LOOPBACK;
+	phone->conn_data = loopback;
+	phone->recorder = NULL;
+	*device = phone;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Creates an idevice_t structure that plays back a session recorded with
+ * idevice_start_recording(). Connections to a port play back the recorded
+ * connections to that port in order, as fast as the application reads.
+ * What the application sends is not compared to the recording.
+ *
+ * @note SSL is not negotiated on played back connections, as the recorded
+ *  data is the data before encryption. Enabling SSL succeeds and has no
+ *  effect. idevice_connection_get_fd() is not supported.
+ *
+ * @param device Pointer that will be set to the new device.
+ * @param path The session file to play back.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_BAD_HEADER if the file is not
+ *  a session file, otherwise an error code.
+ */
+idevice_error_t idevice_new_replay(idevice_t *device, const char *path)
+{
+	replay_session_t session = NULL;
+	idevice_error_t res;
+
+	if (!device || !path)
+		return IDEVICE_E_INVALID_ARG;
+
+	res = replay_session_load(path, &session);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+
+	idevice_t phone = (idevice_t) calloc(1, sizeof(struct idevice_private));
+	phone->uuid = strdup(replay_session_get_uuid(session));
+	phone->conn_type = CONNECTION_REPLAY;
+	phone->conn_data = session;
+	phone->recorder = NULL;
+	*device = phone;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Records all data sent and received over connections to the device made
+ * from now on to a session file, which can be played back with
+ * idevice_new_replay(). The data is recorded as the application sees it,
+ * that is before encryption for connections with SSL enabled.
+ *
+ * @param device The device to record the connections of.
+ * @param path The session file to write. An existing file is overwritten.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_start_recording(idevice_t device, const char *path)
+{
+	replay_recorder_t recorder = NULL;
+	idevice_error_t res;
+
+	if (!device || !path)
+		return IDEVICE_E_INVALID_ARG;
+
+	res = replay_recorder_new(path, device->uuid, &recorder);
+	if (res != IDEVICE_E_SUCCESS)
+		return res;
+
+	if (device->recorder)
+		replay_recorder_unref(device->recorder);
+	device->recorder = recorder;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Stops recording new connections to the device. Connections that are
+ * being recorded continue to be until they are closed and the session
+ * file is complete after that.
+ *
+ * @param device The device to stop recording.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_stop_recording(idevice_t device)
+{
+	if (!device)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (device->recorder) {
+		replay_recorder_unref(device->recorder);
+		device->recorder = NULL;
+	}
+	return IDEVICE_E_SUCCESS;
 }
 
 /**
@@ -189,8 +738,17 @@ idevice_error_t idevice_free(idevice_t device)
 
 	free(device->uuid);
 
+	if (device->recorder) {
+		replay_recorder_unref(device->recorder);
+	}
+	if (device->cancel) {
+		idevice_cancel_free(device->cancel);
+	}
 	if (device->conn_type == CONNECTION_USBMUXD) {
 		device->conn_data = 0;
+	} else if (device->conn_type == CONNECTION_REPLAY) {
+		replay_session_unref((replay_session_t)device->conn_data);
+		device->conn_data = 0;
 	}
 	if (device->conn_data) {
 		free(device->conn_data);
@@ -199,68 +757,770 @@ idevice_error_t idevice_free(idevice_t device)
 	return ret;
 }
 
+/** Size of the socket buffers of TCP connections */
+#define TCP_SOCKET_BUFFER_SIZE (1 << 20)
+
+/**
+ * Internally used function to open a TCP connection to a port of a
+ * network attached device. Nagle's algorithm is disabled, as the protocols
+ * wait for the reply to every small request, and the socket buffers are
+ * enlarged to keep bulk transfers going over links with higher latency.
+ *
+ * @return The socket or -1 on error.
+ */
+static int internal_tcp_connect(const char *host, uint16_t port)
+{
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+	struct addrinfo *ai;
+	char service[8];
+	int sfd = -1;
+	int res;
+
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%u", port);
+
+	res = getaddrinfo(host, service, &hints, &result);
+	if (res != 0) {
+		debug_info("ERROR: could not resolve %s: %s", host, gai_strerror(res));
+		return -1;
+	}
+
+	for (ai = result; ai; ai = ai->ai_next) {
+		int yes = 1;
+		int bufsize = TCP_SOCKET_BUFFER_SIZE;
+
+		sfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sfd < 0)
+			continue;
+
+		setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+		setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+#ifdef SO_NOSIGPIPE
+		setsockopt(sfd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+
+		if (connect(sfd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		debug_info("ERROR: connecting to %s port %d failed: %d (%s)", host, port, errno, strerror(errno));
+		close(sfd);
+		sfd = -1;
+	}
+	freeaddrinfo(result);
+
+	return sfd;
+}
+
+/**
+ * Opens the transport connection to the given port of the device.
+ */
+static idevice_error_t internal_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+{
+	if (!device) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	void *data = NULL;
+	if (device->conn_type == CONNECTION_USBMUXD) {
+		int sfd = usbmuxd_connect((uint32_t)(long)device->conn_data, port);
+		if (sfd < 0) {
+			debug_info("ERROR: Connecting to usbmuxd failed: %d (%s)", sfd, strerror(-sfd));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		data = (void*)(long)sfd;
+	} else if (device->conn_type == CONNECTION_LOOPBACK) {
+		struct loopback_device *loopback = (struct loopback_device*)device->conn_data;
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			debug_info("ERROR: socketpair failed: %d (%s)", errno, strerror(errno));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		loopback->callback(port, fds[1], loopback->user_data);
+		data = (void*)(long)fds[0];
+	} else if (device->conn_type == CONNECTION_TCP) {
+		int sfd = internal_tcp_connect((const char*)device->conn_data, port);
+		if (sfd < 0) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		data = (void*)(long)sfd;
+	} else if (device->conn_type == CONNECTION_REPLAY) {
+		replay_stream_t stream = NULL;
+		if (replay_stream_open((replay_session_t)device->conn_data, port, &stream) != IDEVICE_E_SUCCESS) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		data = stream;
+	} else {
+		debug_info("Unknown connection type %d", device->conn_type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+	idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
+	memset(new_connection, '\0', sizeof(struct idevice_connection_private));
+	new_connection->type = device->conn_type;
+	new_connection->data = data;
+	new_connection->ssl_data = NULL;
+	new_connection->session_key = g_strdup_printf("%s:%d", device->uuid, port);
+	new_connection->metrics_mutex = g_mutex_new();
+	if (device->recorder) {
+		new_connection->recorder = replay_recorder_ref(device->recorder);
+		new_connection->record_id = replay_recorder_open(device->recorder, port);
+	}
+	if (device->cancel) {
+		g_atomic_int_inc(&device->cancel->refcount);
+		new_connection->cancel = device->cancel;
+	}
+	*connection = new_connection;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Set up a connection to the given device.
+ *
+ * @param device The device to connect to.
+ * @param port The destination port to connect to.
+ * @param connection Pointer to an idevice_connection_t that will be filled
+ *   with the necessary data of the connection.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+{
+	uint64_t trace_start = idevice_trace_begin();
+	idevice_error_t ret = internal_connect(device, port, connection);
+	if (trace_start) {
+		char *target = g_strdup_printf("%s:%d", device ? device->uuid : "", port);
+		idevice_trace_end(IDEVICE_TRACE_CONNECT, target, trace_start, ret);
+		g_free(target);
+	}
+	return ret;
+}
+
+/**
+ * Disconnect from the device and clean up the connection structure.
+ *
+ * @param connection The connection to close.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_disconnect(idevice_connection_t connection)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	/* shut down ssl if enabled */
+	if (connection->ssl_data) {
+		idevice_connection_disable_ssl(connection);
+	}
+	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
+	if (connection->type == CONNECTION_USBMUXD) {
+		usbmuxd_disconnect((int)(long)connection->data);
+		result = IDEVICE_E_SUCCESS;
+	} else if ((connection->type == CONNECTION_LOOPBACK) || (connection->type == CONNECTION_TCP)) {
+		close((int)(long)connection->data);
+		result = IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_REPLAY) {
+		replay_stream_close((replay_stream_t)connection->data);
+		result = IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+	if (connection->recorder) {
+		replay_recorder_write(connection->recorder, connection->record_id, REPLAY_RECORD_CLOSE, NULL, 0);
+		replay_recorder_unref(connection->recorder);
+	}
+	if (connection->cancel) {
+		idevice_cancel_free(connection->cancel);
+	}
+	g_free(connection->session_key);
+	g_mutex_free(connection->metrics_mutex);
+	free(connection);
+	return result;
+}
+
+/**
+ * Returns the current time in microseconds.
+ */
+static uint64_t internal_time_us()
+{
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return ((uint64_t)tv.tv_sec * G_USEC_PER_SEC) + tv.tv_usec;
+}
+
+/**
+ * Creates a cancellation token. A token bounds all blocking receives of the
+ * connections it is set on, see idevice_set_cancel() and
+ * idevice_connection_set_cancel(). One token can be shared by any number
+ * of connections, for example by all service clients of one job.
+ *
+ * @param token Pointer that will be set to the new token. It has to be
+ *  freed with idevice_cancel_free().
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_cancel_new(idevice_cancel_t *token)
+{
+	int i;
+
+	if (!token)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	idevice_cancel_t token_loc = (idevice_cancel_t)malloc(sizeof(struct idevice_cancel_private));
+	if (pipe(token_loc->fds) < 0) {
+		debug_info("ERROR: pipe failed: %d (%s)", errno, strerror(errno));
+		free(token_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	/* the pipe only ever holds the wakeup byte of a triggered token */
+	for (i = 0; i < 2; i++) {
+		fcntl(token_loc->fds[i], F_SETFL, fcntl(token_loc->fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(token_loc->fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	token_loc->refcount = 1;
+	token_loc->triggered = 0;
+	token_loc->mutex = g_mutex_new();
+	token_loc->deadline = 0;
+
+	*token = token_loc;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Frees a cancellation token. Connections and devices it is set on keep
+ * their own reference, so it stays valid until they are freed as well.
+ *
+ * @param token The token to free.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_cancel_free(idevice_cancel_t token)
+{
+	if (!token)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (!g_atomic_int_dec_and_test(&token->refcount))
+		return IDEVICE_E_SUCCESS;
+
+	close(token->fds[0]);
+	close(token->fds[1]);
+	g_mutex_free(token->mutex);
+	free(token);
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Cancels all blocking receives of the connections the token is set on.
+ * Receives waiting right now return IDEVICE_E_CANCELLED at once, and so do
+ * all further receives and sends until idevice_cancel_reset() is called.
+ * This can be called from any thread.
+ *
+ * @note A connection whose receive was cancelled may have dropped part of
+ *  a message and should be closed.
+ *
+ * @param token The token to trigger.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_cancel_trigger(idevice_cancel_t token)
+{
+	if (!token)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (g_atomic_int_compare_and_exchange(&token->triggered, 0, 1)) {
+		/* wake up all poll()s waiting for the token */
+		char c = 0;
+		if (write(token->fds[1], &c, 1) < 0) {
+			debug_info("ERROR: could not wake up waiting receives: %s", strerror(errno));
+		}
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Makes a token usable again after it was triggered or its deadline has
+ * passed. The deadline is cleared as well.
+ *
+ * @param token The token to reset.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_cancel_reset(idevice_cancel_t token)
+{
+	if (!token)
+		return IDEVICE_E_INVALID_ARG;
+
+	g_mutex_lock(token->mutex);
+	token->deadline = 0;
+	g_mutex_unlock(token->mutex);
+	if (g_atomic_int_compare_and_exchange(&token->triggered, 1, 0)) {
+		char c;
+		while (read(token->fds[0], &c, 1) > 0);
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Sets a deadline for all blocking receives of the connections the token
+ * is set on. Once it has passed, receives return IDEVICE_E_TIMEOUT, also
+ * the ones that wait for more data of a message already partially received.
+ * Receives with a shorter timeout of their own still return after it with
+ * no data, like before.
+ *
+ * @param token The token to set the deadline of.
+ * @param timeout Time from now in milliseconds, or 0 to remove the deadline.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_cancel_set_deadline(idevice_cancel_t token, unsigned int timeout)
+{
+	if (!token)
+		return IDEVICE_E_INVALID_ARG;
+
+	g_mutex_lock(token->mutex);
+	token->deadline = (timeout > 0) ? internal_time_us() + (uint64_t)timeout * 1000 : 0;
+	g_mutex_unlock(token->mutex);
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Tells whether a token was triggered, e.g. to find out why a service call
+ * failed.
+ *
+ * @param token The token to check.
+ *
+ * @return 1 if the token was triggered, 0 otherwise.
+ */
+int idevice_cancel_is_triggered(idevice_cancel_t token)
+{
+	return (token && g_atomic_int_get(&token->triggered)) ? 1 : 0;
+}
+
+/**
+ * Sets the cancellation token of all connections made to the device from
+ * now on, which includes the connections of all service clients created
+ * for it afterwards. Existing connections are not changed.
+ *
+ * @param device The device to set the token of.
+ * @param token The token, or NULL to remove the token.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_set_cancel(idevice_t device, idevice_cancel_t token)
+{
+	if (!device)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (token)
+		g_atomic_int_inc(&token->refcount);
+	if (device->cancel)
+		idevice_cancel_free(device->cancel);
+	device->cancel = token;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Sets the cancellation token of a single connection.
+ *
+ * @param connection The connection to set the token of.
+ * @param token The token, or NULL to remove the token.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_set_cancel(idevice_connection_t connection, idevice_cancel_t token)
+{
+	if (!connection)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (token)
+		g_atomic_int_inc(&token->refcount);
+	if (connection->cancel)
+		idevice_cancel_free(connection->cancel);
+	connection->cancel = token;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to wait until data can be read from the
+ * transport of a connection with a cancellation token.
+ *
+ * @param connection The connection to wait for.
+ * @param timeout Time to wait in milliseconds, or -1 to wait until the
+ *  deadline of the token.
+ * @param ready Set to 1 if data can be read, 0 if the timeout passed.
+ *
+ * @return IDEVICE_E_SUCCESS if data can be read or the timeout passed,
+ *  IDEVICE_E_TIMEOUT if the deadline of the token passed,
+ *  IDEVICE_E_CANCELLED if the token was triggered.
+ */
+static idevice_error_t internal_connection_wait(idevice_connection_t connection, int timeout, int *ready)
+{
+	idevice_cancel_t token = connection->cancel;
+	struct pollfd pfd[2];
+	uint64_t deadline;
+	int wait_ms;
+	int res;
+
+	*ready = 0;
+
+	do {
+		if (g_atomic_int_get(&token->triggered))
+			return IDEVICE_E_CANCELLED;
+
+		g_mutex_lock(token->mutex);
+		deadline = token->deadline;
+		g_mutex_unlock(token->mutex);
+
+		wait_ms = timeout;
+		if (deadline) {
+			uint64_t now = internal_time_us();
+			if (now >= deadline)
+				return IDEVICE_E_TIMEOUT;
+			/* round up, so the deadline has passed when poll() returns */
+			uint64_t left = (deadline - now + 999) / 1000;
+			if ((wait_ms < 0) || (left < (uint64_t)wait_ms))
+				wait_ms = (left > G_MAXINT) ? G_MAXINT : (int)left;
+		}
+
+		if (connection->type == CONNECTION_REPLAY) {
+			/* recorded data is always available */
+			*ready = 1;
+			return IDEVICE_E_SUCCESS;
+		}
+
+		pfd[0].fd = (int)(long)connection->data;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = token->fds[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		res = poll(pfd, 2, wait_ms);
+		if (res > 0) {
+			if (pfd[1].revents)
+				return IDEVICE_E_CANCELLED;
+			*ready = 1;
+			return IDEVICE_E_SUCCESS;
+		}
+		if ((res < 0) && (errno != EINTR)) {
+			debug_info("ERROR: poll failed: %s", strerror(errno));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		/* the deadline is checked again at the top */
+	} while ((res < 0) || (wait_ms != timeout) || (timeout < 0));
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to account for a transport read or write that
+ * started at the given time.
+ */
+static void internal_metrics_io(idevice_connection_t connection, int sent, uint32_t bytes, uint64_t start)
+{
+	uint64_t elapsed = internal_time_us() - start;
+
+	g_mutex_lock(connection->metrics_mutex);
+	if (sent)
+		connection->metrics.wire_bytes_sent += bytes;
+	else
+		connection->metrics.wire_bytes_received += bytes;
+	connection->metrics.io_time += elapsed;
+	g_mutex_unlock(connection->metrics_mutex);
+}
+
+/**
+ * Internally used function to read the transport I/O time, so the TLS
+ * time of a call can be told apart from the I/O it caused.
+ */
+static uint64_t internal_metrics_io_time(idevice_connection_t connection)
+{
+	uint64_t io_time;
+
+	g_mutex_lock(connection->metrics_mutex);
+	io_time = connection->metrics.io_time;
+	g_mutex_unlock(connection->metrics_mutex);
+	return io_time;
+}
+
+/**
+ * Internally used function to account for the time spent in a TLS call
+ * that started at the given time, minus the transport I/O it did.
+ */
+static void internal_metrics_ssl(idevice_connection_t connection, uint64_t start, uint64_t io_before)
+{
+	uint64_t elapsed = internal_time_us() - start;
+
+	g_mutex_lock(connection->metrics_mutex);
+	uint64_t io = connection->metrics.io_time - io_before;
+	if (elapsed > io)
+		connection->metrics.ssl_time += elapsed - io;
+	g_mutex_unlock(connection->metrics_mutex);
+}
+
+/**
+ * Internally used function to account for a send by the application.
+ * The first send after a receive starts a round trip measurement.
+ */
+static void internal_metrics_sent(idevice_connection_t connection, uint32_t bytes)
+{
+	g_mutex_lock(connection->metrics_mutex);
+	connection->metrics.send_calls++;
+	connection->metrics.bytes_sent += bytes;
+	if (!connection->rtt_pending) {
+		connection->rtt_start = internal_time_us();
+		connection->rtt_pending = 1;
+	}
+	g_mutex_unlock(connection->metrics_mutex);
+}
+
+/**
+ * Internally used function to account for a receive by the application.
+ * The first data received after a send completes a round trip.
+ */
+static void internal_metrics_received(idevice_connection_t connection, uint32_t requested, uint32_t bytes)
+{
+	g_mutex_lock(connection->metrics_mutex);
+	connection->metrics.recv_calls++;
+	connection->metrics.bytes_received += bytes;
+	if ((bytes > 0) && (bytes < requested))
+		connection->metrics.partial_reads++;
+	if ((bytes > 0) && connection->rtt_pending) {
+		uint64_t rtt = internal_time_us() - connection->rtt_start;
+		int bucket = 0;
+		while ((bucket < IDEVICE_METRICS_RTT_BUCKETS - 1) && (rtt >= ((uint64_t)64 << bucket)))
+			bucket++;
+		connection->metrics.rtt_histogram[bucket]++;
+		connection->metrics.rtt_count++;
+		connection->metrics.rtt_total += rtt;
+		connection->rtt_pending = 0;
+	}
+	g_mutex_unlock(connection->metrics_mutex);
+}
+
+/* whether the client locks account their wait and hold times */
+static volatile gint lock_profiling = 0;
+
+/**
+ * Enables or disables measuring how long service clients wait for and
+ * hold their locks. The results are part of the metrics of the connection
+ * of each client, see idevice_connection_get_metrics(). Profiling is off by
+ * default as it reads the clock twice per lock.
+ *
+ * @param enable 1 to enable, 0 to disable profiling.
+ */
+void idevice_set_lock_profiling(int enable)
+{
+	g_atomic_int_set(&lock_profiling, enable ? 1 : 0);
+}
+
+/**
+ * Internally used by the service clients to take their lock, accounting
+ * the wait for it to the given connection if profiling is enabled.
+ *
+ * @return The time the lock was taken at, to be passed to
+ *  idevice_connection_unlock_mutex(), or 0 if profiling is disabled.
+ */
+uint64_t idevice_connection_lock_mutex(idevice_connection_t connection, GMutex *mutex)
+{
+	uint64_t start, locked_at, wait;
+	int contended;
+
+	if (!connection || !g_atomic_int_get(&lock_profiling)) {
+		g_mutex_lock(mutex);
+		return 0;
+	}
+
+	contended = !g_mutex_trylock(mutex);
+	if (contended) {
+		start = internal_time_us();
+		g_mutex_lock(mutex);
+		locked_at = internal_time_us();
+		wait = locked_at - start;
+	} else {
+		locked_at = internal_time_us();
+		wait = 0;
+	}
+
+	g_mutex_lock(connection->metrics_mutex);
+	connection->metrics.lock_acquisitions++;
+	if (contended) {
+		connection->metrics.lock_contended++;
+		connection->metrics.lock_wait_time += wait;
+		if (wait > connection->metrics.lock_wait_max)
+			connection->metrics.lock_wait_max = wait;
+	}
+	g_mutex_unlock(connection->metrics_mutex);
+
+	return locked_at;
+}
+
+/**
+ * Internally used by the service clients to release their lock, accounting
+ * the time it was held to the given connection.
+ *
+ * @param locked_at The time returned by idevice_connection_lock_mutex().
+ */
+void idevice_connection_unlock_mutex(idevice_connection_t connection, GMutex *mutex, uint64_t locked_at)
+{
+	uint64_t hold;
+
+	if (!connection || (locked_at == 0)) {
+		g_mutex_unlock(mutex);
+		return;
+	}
+
+	hold = internal_time_us() - locked_at;
+	g_mutex_unlock(mutex);
+
+	g_mutex_lock(connection->metrics_mutex);
+	connection->metrics.lock_hold_time += hold;
+	if (hold > connection->metrics.lock_hold_max)
+		connection->metrics.lock_hold_max = hold;
+	g_mutex_unlock(connection->metrics_mutex);
+}
+
+/* trace callback for the connection setup phases */
+static GStaticMutex trace_mutex = G_STATIC_MUTEX_INIT;
+static idevice_trace_cb_t trace_callback = NULL;
+static void *trace_user_data = NULL;
+static volatile gint tracing = 0;
+
+/**
+ * Sets a callback that is told how long each phase of setting up a
+ * connection to a service took, from idevice_new() over the lockdown
+ * handshake to idevice_connect(). Nothing is measured while no callback
+ * is set. The callback is invoked from the thread that ran the phase.
+ *
+ * @param callback The callback, or NULL to disable tracing.
+ * @param user_data Data passed to the callback.
+ */
+void idevice_set_trace_callback(idevice_trace_cb_t callback, void *user_data)
+{
+	g_static_mutex_lock(&trace_mutex);
+	trace_user_data = user_data;
+	trace_callback = callback;
+	g_atomic_int_set(&tracing, callback ? 1 : 0);
+	g_static_mutex_unlock(&trace_mutex);
+}
+
+/**
+ * Internally used to mark the start of a traced phase.
+ *
+ * @return The start time to be passed to idevice_trace_end(), or 0 if no
+ *  trace callback is set.
+ */
+uint64_t idevice_trace_begin()
+{
+	if (!g_atomic_int_get(&tracing))
+		return 0;
+	return internal_time_us();
+}
+
+/**
+ * Internally used to report a finished phase to the trace callback.
+ *
+ * @param phase One of the IDEVICE_TRACE_* phases.
+ * @param target The UUID of the device or the session key of a connection.
+ * @param start The time returned by idevice_trace_begin().
+ * @param result The error code the phase finished with.
+ */
+void idevice_trace_end(int phase, const char *target, uint64_t start, int result)
+{
+	idevice_trace_cb_t callback;
+	void *user_data;
+
+	if (start == 0)
+		return;
+
+	uint64_t duration = internal_time_us() - start;
+
+	g_static_mutex_lock(&trace_mutex);
+	callback = trace_callback;
+	user_data = trace_user_data;
+	g_static_mutex_unlock(&trace_mutex);
+
+	if (callback)
+		callback(phase, target ? target : "", duration, result, user_data);
+}
+
+/**
+ * Internally used by property_list_service to count the plists sent and
+ * received over a connection by format.
+ */
+void idevice_connection_count_plist(idevice_connection_t connection, int binary, int sent, uint32_t length)
+{
+	if (!connection)
+		return;
+
+	g_mutex_lock(connection->metrics_mutex);
+	if (binary && sent)
+		connection->metrics.plist_binary_bytes_sent += length;
+	else if (binary)
+		connection->metrics.plist_binary_bytes_received += length;
+	else if (sent)
+		connection->metrics.plist_xml_bytes_sent += length;
+	else
+		connection->metrics.plist_xml_bytes_received += length;
+	g_mutex_unlock(connection->metrics_mutex);
+}
+
 /**
- * Set up a connection to the given device.
+ * Gets the transfer statistics of a connection. They can be read at any
+ * time while the connection is in use, also from another thread.
  *
- * @param device The device to connect to.
- * @param port The destination port to connect to.
- * @param connection Pointer to an idevice_connection_t that will be filled
- *   with the necessary data of the connection.
+ * @param connection The connection to get the statistics of.
+ * @param metrics Structure that will be filled with the statistics.
  *
  * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
  */
-idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+idevice_error_t idevice_connection_get_metrics(idevice_connection_t connection, idevice_connection_metrics_t *metrics)
 {
-	if (!device) {
+	if (!connection || !metrics)
 		return IDEVICE_E_INVALID_ARG;
-	}
-
-	if (device->conn_type == CONNECTION_USBMUXD) {
-		int sfd = usbmuxd_connect((uint32_t)(long)device->conn_data, port);
-		if (sfd < 0) {
-			debug_info("ERROR: Connecting to usbmuxd failed: %d (%s)", sfd, strerror(-sfd));
-			return IDEVICE_E_UNKNOWN_ERROR;
-		}
-		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
-		new_connection->type = CONNECTION_USBMUXD;
-		new_connection->data = (void*)(long)sfd;
-		new_connection->ssl_data = NULL;
-		*connection = new_connection;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", device->conn_type);
-	}
 
-	return IDEVICE_E_UNKNOWN_ERROR;
+	g_mutex_lock(connection->metrics_mutex);
+	memcpy(metrics, &connection->metrics, sizeof(idevice_connection_metrics_t));
+	g_mutex_unlock(connection->metrics_mutex);
+	return IDEVICE_E_SUCCESS;
 }
 
 /**
- * Disconnect from the device and clean up the connection structure.
+ * Sets all transfer statistics of a connection back to zero.
  *
- * @param connection The connection to close.
+ * @param connection The connection to reset the statistics of.
  *
  * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
  */
-idevice_error_t idevice_disconnect(idevice_connection_t connection)
+idevice_error_t idevice_connection_reset_metrics(idevice_connection_t connection)
 {
-	if (!connection) {
+	if (!connection)
 		return IDEVICE_E_INVALID_ARG;
-	}
-	/* shut down ssl if enabled */
-	if (connection->ssl_data) {
-		idevice_connection_disable_ssl(connection);
-	}
-	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
-	if (connection->type == CONNECTION_USBMUXD) {
-		usbmuxd_disconnect((int)(long)connection->data);
-		result = IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
-	}
-	free(connection);
-	return result;
+
+	g_mutex_lock(connection->metrics_mutex);
+	memset(&connection->metrics, '\0', sizeof(idevice_connection_metrics_t));
+	connection->rtt_pending = 0;
+	g_mutex_unlock(connection->metrics_mutex);
+	return IDEVICE_E_SUCCESS;
 }
 
+#ifdef MSG_NOSIGNAL
+#define SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SOCKET_SEND_FLAGS 0
+#endif
+
+/** Timeout of receives without explicit timeout, as used by usbmuxd_recv() */
+#define SOCKET_RECV_TIMEOUT 5000
+
 /**
  * Internally used function to send raw data over the given connection.
  */
@@ -271,12 +1531,30 @@ static idevice_error_t internal_connection_send(idevice_connection_t connection,
 	}
 
 	if (connection->type == CONNECTION_USBMUXD) {
+		uint64_t start = internal_time_us();
 		int res = usbmuxd_send((int)(long)connection->data, data, len, sent_bytes);
+		internal_metrics_io(connection, 1, (res < 0) ? 0 : *sent_bytes, start);
 		if (res < 0) {
 			debug_info("ERROR: usbmuxd_send returned %d (%s)", res, strerror(-res));
 			return IDEVICE_E_UNKNOWN_ERROR;
 		}
 		return IDEVICE_E_SUCCESS;
+	} else if ((connection->type == CONNECTION_LOOPBACK) || (connection->type == CONNECTION_TCP)) {
+		uint64_t start = internal_time_us();
+		ssize_t res;
+		do {
+			res = send((int)(long)connection->data, (const void*)data, len, SOCKET_SEND_FLAGS);
+		} while ((res < 0) && (errno == EINTR));
+		internal_metrics_io(connection, 1, (res < 0) ? 0 : (uint32_t)res, start);
+		if (res < 0) {
+			debug_info("ERROR: send returned %d (%s)", errno, strerror(errno));
+			*sent_bytes = 0;
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		*sent_bytes = (uint32_t)res;
+		return IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_REPLAY) {
+		return replay_stream_send((replay_stream_t)connection->data, len, sent_bytes);
 	} else {
 		debug_info("Unknown connection type %d", connection->type);
 	}
@@ -284,6 +1562,50 @@ static idevice_error_t internal_connection_send(idevice_connection_t connection,
 
 }
 
+/** Size of the buffer encrypted data is received into */
+#define SSL_RECV_BUFFER_SIZE 32768
+
+/** Size of the buffer outgoing TLS records are collected in */
+#define SSL_SEND_BUFFER_SIZE 65536
+
+/**
+ * Internally used function to send all TLS records that have been
+ * collected by internal_ssl_write() in a single write. The caller must
+ * hold the send mutex.
+ */
+static idevice_error_t internal_ssl_flush_locked(ssl_data_t ssl_data)
+{
+	uint32_t bytes = 0;
+	idevice_error_t res;
+
+	if (ssl_data->send_length == 0)
+		return IDEVICE_E_SUCCESS;
+
+	debug_info("flushing %d bytes", ssl_data->send_length);
+	res = internal_connection_send(ssl_data->connection, ssl_data->send_buffer, ssl_data->send_length, &bytes);
+	if ((res == IDEVICE_E_SUCCESS) && (bytes != ssl_data->send_length)) {
+		debug_info("ERROR: sent only %d of %d bytes", bytes, ssl_data->send_length);
+		res = IDEVICE_E_SSL_ERROR;
+	}
+	ssl_data->send_length = 0;
+	return res;
+}
+
+/**
+ * Internally used function to send the collected TLS records. It is
+ * called from the send functions as well as from the gnutls read
+ * callback, which may run on another thread than a sender.
+ */
+static idevice_error_t internal_ssl_flush(ssl_data_t ssl_data)
+{
+	idevice_error_t res;
+
+	g_mutex_lock(ssl_data->send_mutex);
+	res = internal_ssl_flush_locked(ssl_data);
+	g_mutex_unlock(ssl_data->send_mutex);
+	return res;
+}
+
 /**
  * Send data to a device via the given connection.
  *
@@ -300,17 +1622,195 @@ idevice_error_t idevice_connection_send(idevice_connection_t connection, const c
 	if (!connection || !data || (connection->ssl_data && !connection->ssl_data->session)) {
 		return IDEVICE_E_INVALID_ARG;
 	}
+	if (idevice_cancel_is_triggered(connection->cancel)) {
+		return IDEVICE_E_CANCELLED;
+	}
 
+	idevice_error_t res;
 	if (connection->ssl_data) {
+		uint64_t start = internal_time_us();
+		uint64_t io_before = internal_metrics_io_time(connection);
 		ssize_t sent = gnutls_record_send(connection->ssl_data->session, (void*)data, (size_t)len);
-		if ((uint32_t)sent == (uint32_t)len) {
+		if ((uint32_t)sent == (uint32_t)len && internal_ssl_flush(connection->ssl_data) == IDEVICE_E_SUCCESS) {
 			*sent_bytes = sent;
-			return IDEVICE_E_SUCCESS;
+			res = IDEVICE_E_SUCCESS;
+		} else {
+			*sent_bytes = 0;
+			res = IDEVICE_E_SSL_ERROR;
+		}
+		internal_metrics_ssl(connection, start, io_before);
+	} else {
+		res = internal_connection_send(connection, data, len, sent_bytes);
+	}
+	if (res == IDEVICE_E_SUCCESS) {
+		internal_metrics_sent(connection, *sent_bytes);
+		if (connection->recorder)
+			replay_recorder_write(connection->recorder, connection->record_id, REPLAY_RECORD_SEND, data, *sent_bytes);
+	}
+	return res;
+}
+
+/** The maximum number of buffers that are passed to a single writev() */
+#define IDEVICE_SENDV_MAX 16
+
+/**
+ * Internally used function to send a list of buffers over the given
+ * connection without joining them first.
+ */
+static idevice_error_t internal_connection_sendv(idevice_connection_t connection, const struct iovec *iov, int iovcnt, uint32_t *sent_bytes)
+{
+	struct iovec vec[IDEVICE_SENDV_MAX];
+	int i = 0;
+	uint32_t total = 0;
+
+	*sent_bytes = 0;
+
+	if ((connection->type != CONNECTION_USBMUXD) && (connection->type != CONNECTION_LOOPBACK) && (connection->type != CONNECTION_TCP) && (connection->type != CONNECTION_REPLAY)) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	if ((iovcnt > IDEVICE_SENDV_MAX) || (connection->type == CONNECTION_REPLAY)) {
+		/* too many buffers or no socket; send them one after another */
+		for (i = 0; i < iovcnt; i++) {
+			uint32_t sent = 0;
+			idevice_error_t res = internal_connection_send(connection, (const char*)iov[i].iov_base, iov[i].iov_len, &sent);
+			total += sent;
+			if (res != IDEVICE_E_SUCCESS) {
+				*sent_bytes = total;
+				return res;
+			}
+		}
+		*sent_bytes = total;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	/* the socket returned by usbmuxd_connect(), socketpair() or socket() is written to directly */
+	memcpy(vec, iov, sizeof(struct iovec) * iovcnt);
+	while (i < iovcnt) {
+		uint64_t start = internal_time_us();
+		ssize_t res = writev((int)(long)connection->data, vec + i, iovcnt - i);
+		internal_metrics_io(connection, 1, (res < 0) ? 0 : (uint32_t)res, start);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			debug_info("ERROR: writev returned %d (%s)", errno, strerror(errno));
+			*sent_bytes = total;
+			return IDEVICE_E_UNKNOWN_ERROR;
 		}
+		total += res;
+		/* skip what was written and continue after partial writes */
+		while ((i < iovcnt) && ((size_t)res >= vec[i].iov_len)) {
+			res -= vec[i].iov_len;
+			i++;
+		}
+		if (i < iovcnt) {
+			vec[i].iov_base = (char*)vec[i].iov_base + res;
+			vec[i].iov_len -= res;
+		}
+	}
+	*sent_bytes = total;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Send data from multiple buffers to a device via the given connection.
+ * For plain connections the buffers are handed to the socket in a single
+ * call, so a packet header and its payload can be sent without copying
+ * them into one contiguous buffer first.
+ *
+ * @param connection The connection to send data over.
+ * @param iov Array of buffers to send.
+ * @param iovcnt Number of entries in iov.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const struct iovec *iov, int iovcnt, uint32_t *sent_bytes)
+{
+	if (!connection || !iov || iovcnt <= 0 || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (idevice_cancel_is_triggered(connection->cancel)) {
+		return IDEVICE_E_CANCELLED;
+	}
+
+	idevice_error_t res;
+	if (connection->ssl_data) {
+		int i;
+		uint64_t start = internal_time_us();
+		uint64_t io_before = internal_metrics_io_time(connection);
 		*sent_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
+		res = IDEVICE_E_SUCCESS;
+		for (i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_len == 0)
+				continue;
+			ssize_t sent = gnutls_record_send(connection->ssl_data->session, iov[i].iov_base, iov[i].iov_len);
+			if ((size_t)sent != iov[i].iov_len) {
+				res = IDEVICE_E_SSL_ERROR;
+				break;
+			}
+			*sent_bytes += sent;
+		}
+		/* the records of all buffers go out in one write */
+		if (res == IDEVICE_E_SUCCESS) {
+			res = internal_ssl_flush(connection->ssl_data);
+		} else {
+			internal_ssl_flush(connection->ssl_data);
+		}
+		internal_metrics_ssl(connection, start, io_before);
+	} else {
+		res = internal_connection_sendv(connection, iov, iovcnt, sent_bytes);
+	}
+	if (res == IDEVICE_E_SUCCESS) {
+		internal_metrics_sent(connection, *sent_bytes);
+		if (connection->recorder) {
+			int i;
+			for (i = 0; i < iovcnt; i++) {
+				replay_recorder_write(connection->recorder, connection->record_id, REPLAY_RECORD_SEND, (const char*)iov[i].iov_base, iov[i].iov_len);
+			}
+		}
+	}
+	return res;
+}
+
+/**
+ * Internally used function for receiving from the socket of a loopback or
+ * TCP connection, with the same semantics as usbmuxd_recv_timeout().
+ */
+static idevice_error_t internal_socket_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	int fd = (int)(long)connection->data;
+	uint64_t start = internal_time_us();
+	struct pollfd pfd;
+	ssize_t res;
+	int ready;
+
+	*recv_bytes = 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	do {
+		ready = poll(&pfd, 1, timeout);
+	} while ((ready < 0) && (errno == EINTR));
+	if (ready <= 0) {
+		internal_metrics_io(connection, 0, 0, start);
+		/* a timeout is not an error, but nothing was received */
+		return (ready == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
 	}
-	return internal_connection_send(connection, data, len, sent_bytes);
+
+	do {
+		res = recv(fd, data, len, 0);
+	} while ((res < 0) && (errno == EINTR));
+	internal_metrics_io(connection, 0, (res < 0) ? 0 : (uint32_t)res, start);
+	if (res <= 0) {
+		debug_info("ERROR: recv returned %d (%s)", (int)res, (res < 0) ? strerror(errno) : "connection closed");
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	*recv_bytes = (uint32_t)res;
+	return IDEVICE_E_SUCCESS;
 }
 
 /**
@@ -323,19 +1823,62 @@ static idevice_error_t internal_connection_receive_timeout(idevice_connection_t
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	if (connection->cancel) {
+		int ready = 0;
+		idevice_error_t err = internal_connection_wait(connection, (int)timeout, &ready);
+		if (err != IDEVICE_E_SUCCESS) {
+			return err;
+		}
+		if (!ready) {
+			*recv_bytes = 0;
+			return IDEVICE_E_SUCCESS;
+		}
+	}
+
 	if (connection->type == CONNECTION_USBMUXD) {
+		uint64_t start = internal_time_us();
 		int res = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
+		internal_metrics_io(connection, 0, (res < 0) ? 0 : *recv_bytes, start);
 		if (res < 0) {
 			debug_info("ERROR: usbmuxd_recv_timeout returned %d (%s)", res, strerror(-res));
 			return IDEVICE_E_UNKNOWN_ERROR;
 		}
 		return IDEVICE_E_SUCCESS;
+	} else if ((connection->type == CONNECTION_LOOPBACK) || (connection->type == CONNECTION_TCP)) {
+		return internal_socket_receive(connection, data, len, recv_bytes, timeout);
+	} else if (connection->type == CONNECTION_REPLAY) {
+		return replay_stream_receive((replay_stream_t)connection->data, data, len, recv_bytes);
 	} else {
 		debug_info("Unknown connection type %d", connection->type);
 	}
 	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
+/**
+ * Internally used function for receiving decrypted data from a connection
+ * with SSL enabled.
+ */
+static idevice_error_t internal_ssl_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	idevice_error_t res = IDEVICE_E_SSL_ERROR;
+	uint64_t start = internal_time_us();
+	uint64_t io_before = internal_metrics_io_time(connection);
+
+	connection->recv_error = IDEVICE_E_SUCCESS;
+	ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
+	if (received > 0) {
+		*recv_bytes = received;
+		res = IDEVICE_E_SUCCESS;
+	} else {
+		*recv_bytes = 0;
+		/* tell a passed deadline or a cancellation apart from TLS errors */
+		if ((connection->recv_error == IDEVICE_E_TIMEOUT) || (connection->recv_error == IDEVICE_E_CANCELLED))
+			res = connection->recv_error;
+	}
+	internal_metrics_ssl(connection, start, io_before);
+	return res;
+}
+
 /**
  * Receive data from a device via the given connection.
  * This function will return after the given timeout even if no data has been
@@ -357,16 +1900,16 @@ idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connecti
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	idevice_error_t res;
 	if (connection->ssl_data) {
-		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
-		if (received > 0) {
-			*recv_bytes = received;
-			return IDEVICE_E_SUCCESS;
-		}
-		*recv_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
+		res = internal_ssl_receive(connection, data, len, recv_bytes);
+	} else {
+		res = internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
 	}
-	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+	internal_metrics_received(connection, len, (res == IDEVICE_E_SUCCESS) ? *recv_bytes : 0);
+	if (connection->recorder && (res == IDEVICE_E_SUCCESS) && (*recv_bytes > 0))
+		replay_recorder_write(connection->recorder, connection->record_id, REPLAY_RECORD_RECV, data, *recv_bytes);
+	return res;
 }
 
 /**
@@ -378,14 +1921,28 @@ static idevice_error_t internal_connection_receive(idevice_connection_t connecti
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	if (connection->cancel) {
+		int ready = 0;
+		idevice_error_t err = internal_connection_wait(connection, -1, &ready);
+		if (err != IDEVICE_E_SUCCESS) {
+			return err;
+		}
+	}
+
 	if (connection->type == CONNECTION_USBMUXD) {
+		uint64_t start = internal_time_us();
 		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
+		internal_metrics_io(connection, 0, (res < 0) ? 0 : *recv_bytes, start);
 		if (res < 0) {
 			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
 			return IDEVICE_E_UNKNOWN_ERROR;
 		}
 
 		return IDEVICE_E_SUCCESS;
+	} else if ((connection->type == CONNECTION_LOOPBACK) || (connection->type == CONNECTION_TCP)) {
+		return internal_socket_receive(connection, data, len, recv_bytes, SOCKET_RECV_TIMEOUT);
+	} else if (connection->type == CONNECTION_REPLAY) {
+		return replay_stream_receive((replay_stream_t)connection->data, data, len, recv_bytes);
 	} else {
 		debug_info("Unknown connection type %d", connection->type);
 	}
@@ -411,16 +1968,68 @@ idevice_error_t idevice_connection_receive(idevice_connection_t connection, char
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	idevice_error_t res;
 	if (connection->ssl_data) {
-		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
-		if (received > 0) {
-			*recv_bytes = received;
-			return IDEVICE_E_SUCCESS;
-		}
-		*recv_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
+		res = internal_ssl_receive(connection, data, len, recv_bytes);
+	} else {
+		res = internal_connection_receive(connection, data, len, recv_bytes);
+	}
+	internal_metrics_received(connection, len, (res == IDEVICE_E_SUCCESS) ? *recv_bytes : 0);
+	if (connection->recorder && (res == IDEVICE_E_SUCCESS) && (*recv_bytes > 0))
+		replay_recorder_write(connection->recorder, connection->record_id, REPLAY_RECORD_RECV, data, *recv_bytes);
+	return res;
+}
+
+/**
+ * Gets the file descriptor of a connection, for waiting on it with poll()
+ * or select() instead of blocking in idevice_connection_receive().
+ *
+ * @note With SSL enabled, data may already have been read from the file
+ *  descriptor and be buffered by the connection, so readability of the
+ *  descriptor alone does not tell whether data can be received.
+ *  idevice_reactor_add() takes care of this.
+ *
+ * @param connection The connection to get the file descriptor of.
+ * @param fd Pointer that will be set to the file descriptor.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
+{
+	if (!connection || !fd)
+		return IDEVICE_E_INVALID_ARG;
+
+	if ((connection->type == CONNECTION_USBMUXD) || (connection->type == CONNECTION_LOOPBACK) || (connection->type == CONNECTION_TCP)) {
+		*fd = (int)(long)connection->data;
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
 	}
-	return internal_connection_receive(connection, data, len, recv_bytes);
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+/**
+ * Checks whether a connection holds received data that has not been
+ * handed out yet.
+ *
+ * @return 1 if data can be received without waiting, 0 otherwise.
+ */
+int idevice_connection_has_pending_data(idevice_connection_t connection)
+{
+	ssl_data_t ssl_data;
+
+	if (connection && (connection->type == CONNECTION_REPLAY))
+		return replay_stream_has_data((replay_stream_t)connection->data);
+
+	if (!connection || !connection->ssl_data)
+		return 0;
+
+	ssl_data = connection->ssl_data;
+	if (ssl_data->recv_end > ssl_data->recv_start)
+		return 1;
+	if (ssl_data->session && (gnutls_record_check_pending(ssl_data->session) > 0))
+		return 1;
+	return 0;
 }
 
 /**
@@ -454,60 +2063,87 @@ idevice_error_t idevice_get_uuid(idevice_t device, char **uuid)
 
 /**
  * Internally used gnutls callback function for receiving encrypted data.
+ *
+ * Whatever the connection has available is received into a per-connection
+ * buffer, so the small reads gnutls does for every record header don't
+ * each cost a round trip to the socket. Reads of at least the size of
+ * that buffer go straight into the buffer passed by gnutls.
  */
 static ssize_t internal_ssl_read(gnutls_transport_ptr_t transport, char *buffer, size_t length)
 {
-	int bytes = 0, pos_start_fill = 0;
+	uint32_t bytes = 0;
 	size_t tbytes = 0;
-	int this_len = length;
 	idevice_error_t res;
-	idevice_connection_t connection = (idevice_connection_t)transport;
-	char *recv_buffer;
+	ssl_data_t ssl_data = (ssl_data_t)transport;
 
 	debug_info("pre-read client wants %zi bytes", length);
 
-	recv_buffer = (char *) malloc(sizeof(char) * this_len);
+	/* gnutls only reads after it has written all it wants to */
+	if (internal_ssl_flush(ssl_data) != IDEVICE_E_SUCCESS) {
+		return -1;
+	}
 
 	/* repeat until we have the full data or an error occurs */
-	do {
-		if ((res = internal_connection_receive(connection, recv_buffer, this_len, (uint32_t*)&bytes)) != IDEVICE_E_SUCCESS) {
+	while (tbytes < length) {
+		uint32_t avail = ssl_data->recv_end - ssl_data->recv_start;
+		if (avail > 0) {
+			/* serve from what has already been received */
+			uint32_t this_len = ((length - tbytes) < avail) ? (uint32_t)(length - tbytes) : avail;
+			memcpy(buffer + tbytes, ssl_data->recv_buffer + ssl_data->recv_start, this_len);
+			ssl_data->recv_start += this_len;
+			tbytes += this_len;
+			continue;
+		}
+		ssl_data->recv_start = ssl_data->recv_end = 0;
+
+		if (length - tbytes >= SSL_RECV_BUFFER_SIZE) {
+			res = internal_connection_receive(ssl_data->connection, buffer + tbytes, length - tbytes, &bytes);
+		} else {
+			res = internal_connection_receive(ssl_data->connection, ssl_data->recv_buffer, SSL_RECV_BUFFER_SIZE, &bytes);
+			ssl_data->recv_end = bytes;
+			bytes = 0;
+		}
+		if (res != IDEVICE_E_SUCCESS) {
 			debug_info("ERROR: idevice_connection_receive returned %d", res);
+			ssl_data->connection->recv_error = res;
 			return res;
 		}
-		debug_info("post-read we got %i bytes", bytes);
-
-		/* increase read count */
 		tbytes += bytes;
-
-		/* fill the buffer with what we got right now */
-		memcpy(buffer + pos_start_fill, recv_buffer, bytes);
-		pos_start_fill += bytes;
-
-		if (tbytes >= length) {
-			break;
-		}
-
-		this_len = length - tbytes;
-		debug_info("re-read trying to read missing %i bytes", this_len);
-	} while (tbytes < length);
-
-	if (recv_buffer) {
-		free(recv_buffer);
+		debug_info("post-read we got %i bytes", (int)tbytes);
 	}
+
 	return tbytes;
 }
 
 /**
  * Internally used gnutls callback function for sending encrypted data.
+ *
+ * The records are collected and sent by internal_ssl_flush() once gnutls
+ * is done, so a message split into many records goes out in one write.
  */
 static ssize_t internal_ssl_write(gnutls_transport_ptr_t transport, char *buffer, size_t length)
 {
 	uint32_t bytes = 0;
-	idevice_connection_t connection = (idevice_connection_t)transport;
+	ssl_data_t ssl_data = (ssl_data_t)transport;
+
 	debug_info("pre-send length = %zi", length);
-	internal_connection_send(connection, buffer, length, &bytes);
-	debug_info("post-send sent %i bytes", bytes);
-	return bytes;
+	g_mutex_lock(ssl_data->send_mutex);
+	if (ssl_data->send_length + length > SSL_SEND_BUFFER_SIZE) {
+		if (internal_ssl_flush_locked(ssl_data) != IDEVICE_E_SUCCESS) {
+			g_mutex_unlock(ssl_data->send_mutex);
+			return -1;
+		}
+	}
+	if (length > SSL_SEND_BUFFER_SIZE) {
+		internal_connection_send(ssl_data->connection, buffer, length, &bytes);
+		g_mutex_unlock(ssl_data->send_mutex);
+		debug_info("post-send sent %i bytes", bytes);
+		return bytes;
+	}
+	memcpy(ssl_data->send_buffer + ssl_data->send_length, buffer, length);
+	ssl_data->send_length += length;
+	g_mutex_unlock(ssl_data->send_mutex);
+	return length;
 }
 
 /**
@@ -524,17 +2160,17 @@ static void internal_ssl_cleanup(ssl_data_t ssl_data)
 	if (ssl_data->certificate) {
 		gnutls_certificate_free_credentials(ssl_data->certificate);
 	}
-	if (ssl_data->root_cert) {
-		gnutls_x509_crt_deinit(ssl_data->root_cert);
+	if (ssl_data->credentials) {
+		userpref_release_credentials(ssl_data->credentials);
 	}
-	if (ssl_data->host_cert) {
-		gnutls_x509_crt_deinit(ssl_data->host_cert);
+	if (ssl_data->recv_buffer) {
+		free(ssl_data->recv_buffer);
 	}
-	if (ssl_data->root_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->root_privkey);
+	if (ssl_data->send_buffer) {
+		free(ssl_data->send_buffer);
 	}
-	if (ssl_data->host_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->host_privkey);
+	if (ssl_data->send_mutex) {
+		g_mutex_free(ssl_data->send_mutex);
 	}
 }
 
@@ -547,12 +2183,12 @@ static int internal_cert_callback (gnutls_session_t session, const gnutls_datum_
 	gnutls_certificate_type_t type = gnutls_certificate_type_get (session);
 	if (type == GNUTLS_CRT_X509) {
 		ssl_data_t ssl_data = (ssl_data_t)gnutls_session_get_ptr (session);
-		if (ssl_data && ssl_data->host_privkey && ssl_data->host_cert) {
+		if (ssl_data && ssl_data->credentials) {
 			debug_info("Passing certificate");
 			st->type = type;
 			st->ncerts = 1;
-			st->cert.x509 = &ssl_data->host_cert;
-			st->key.x509 = ssl_data->host_privkey;
+			st->cert.x509 = &ssl_data->credentials->host_cert;
+			st->key.x509 = ssl_data->credentials->host_privkey;
 			st->deinit_all = 0;
 			res = 0;
 		}
@@ -560,6 +2196,82 @@ static int internal_cert_callback (gnutls_session_t session, const gnutls_datum_
 	return res;
 }
 
+/** TLS session data of a previous connection to the same device and port */
+struct ssl_session_data {
+	void *data;
+	size_t size;
+};
+
+static GStaticMutex ssl_session_mutex = G_STATIC_MUTEX_INIT;
+static GHashTable *ssl_session_cache = NULL;
+
+static void ssl_session_data_free(gpointer data)
+{
+	struct ssl_session_data *session_data = (struct ssl_session_data*)data;
+	free(session_data->data);
+	free(session_data);
+}
+
+/**
+ * Internally used function that prepares a session for resuming the last
+ * TLS session of the same device and port, if there is one.
+ *
+ * @return 1 if session data has been set, 0 otherwise.
+ */
+static int internal_ssl_session_restore(idevice_connection_t connection, gnutls_session_t session)
+{
+	struct ssl_session_data *session_data;
+	int res = 0;
+
+	if (!connection->session_key)
+		return 0;
+
+	g_static_mutex_lock(&ssl_session_mutex);
+	if (ssl_session_cache) {
+		session_data = (struct ssl_session_data*)g_hash_table_lookup(ssl_session_cache, connection->session_key);
+		if (session_data && (gnutls_session_set_data(session, session_data->data, session_data->size) == GNUTLS_E_SUCCESS)) {
+			res = 1;
+		}
+	}
+	g_static_mutex_unlock(&ssl_session_mutex);
+
+	return res;
+}
+
+/**
+ * Internally used function that remembers the TLS session of a connection
+ * for later resumption, or forgets it if session is NULL.
+ */
+static void internal_ssl_session_store(idevice_connection_t connection, gnutls_session_t session)
+{
+	struct ssl_session_data *session_data = NULL;
+	size_t size = 0;
+
+	if (!connection->session_key)
+		return;
+
+	if (session && (gnutls_session_get_data(session, NULL, &size) == GNUTLS_E_SUCCESS) && (size > 0)) {
+		session_data = (struct ssl_session_data*)malloc(sizeof(struct ssl_session_data));
+		session_data->data = malloc(size);
+		session_data->size = size;
+		if (gnutls_session_get_data(session, session_data->data, &session_data->size) != GNUTLS_E_SUCCESS) {
+			ssl_session_data_free(session_data);
+			session_data = NULL;
+		}
+	}
+
+	g_static_mutex_lock(&ssl_session_mutex);
+	if (!ssl_session_cache) {
+		ssl_session_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, ssl_session_data_free);
+	}
+	if (session_data) {
+		g_hash_table_replace(ssl_session_cache, g_strdup(connection->session_key), session_data);
+	} else {
+		g_hash_table_remove(ssl_session_cache, connection->session_key);
+	}
+	g_static_mutex_unlock(&ssl_session_mutex);
+}
+
 /**
  * Enables SSL for the given connection.
  *
@@ -574,10 +2286,19 @@ idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
 	if (!connection || connection->ssl_data)
 		return IDEVICE_E_INVALID_ARG;
 
+	if (connection->type == CONNECTION_REPLAY) {
+		/* recorded data was recorded before encryption */
+		return IDEVICE_E_SUCCESS;
+	}
+
 	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
 	uint32_t return_me = 0;
 
-	ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
+	ssl_data_t ssl_data_loc = (ssl_data_t)calloc(1, sizeof(struct ssl_data_private));
+	ssl_data_loc->connection = connection;
+	ssl_data_loc->recv_buffer = (char*)malloc(SSL_RECV_BUFFER_SIZE);
+	ssl_data_loc->send_buffer = (char*)malloc(SSL_SEND_BUFFER_SIZE);
+	ssl_data_loc->send_mutex = g_mutex_new();
 
 	/* Set up GnuTLS... */
 	debug_info("enabling SSL mode");
@@ -602,35 +2323,45 @@ idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
 	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, ssl_data_loc->certificate);
 	gnutls_session_set_ptr(ssl_data_loc->session, ssl_data_loc);
 
-	gnutls_x509_crt_init(&ssl_data_loc->root_cert);
-	gnutls_x509_crt_init(&ssl_data_loc->host_cert);
-	gnutls_x509_privkey_init(&ssl_data_loc->root_privkey);
-	gnutls_x509_privkey_init(&ssl_data_loc->host_privkey);
-
-	userpref_error_t uerr = userpref_get_keys_and_certs(ssl_data_loc->root_privkey, ssl_data_loc->root_cert, ssl_data_loc->host_privkey, ssl_data_loc->host_cert);
+	userpref_error_t uerr = userpref_get_credentials(&ssl_data_loc->credentials);
 	if (uerr != USERPREF_E_SUCCESS) {
 		debug_info("Error %d when loading keys and certificates! %d", uerr);
 	}
 
 	debug_info("GnuTLS step 1...");
-	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)connection);
+	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)ssl_data_loc);
 	debug_info("GnuTLS step 2...");
 	gnutls_transport_set_push_function(ssl_data_loc->session, (gnutls_push_func) & internal_ssl_write);
 	debug_info("GnuTLS step 3...");
 	gnutls_transport_set_pull_function(ssl_data_loc->session, (gnutls_pull_func) & internal_ssl_read);
+	if (internal_ssl_session_restore(connection, ssl_data_loc->session)) {
+		debug_info("trying to resume previous session");
+	}
 	debug_info("GnuTLS step 4 -- now handshaking...");
 	if (errno)
 		debug_info("WARN: errno says %s before handshake!", strerror(errno));
+	uint64_t trace_start = idevice_trace_begin();
 	return_me = gnutls_handshake(ssl_data_loc->session);
+	if ((internal_ssl_flush(ssl_data_loc) != IDEVICE_E_SUCCESS) && (return_me == GNUTLS_E_SUCCESS)) {
+		return_me = GNUTLS_E_PUSH_ERROR;
+	}
+	idevice_trace_end(IDEVICE_TRACE_SSL_HANDSHAKE, connection->session_key, trace_start, (return_me == GNUTLS_E_SUCCESS) ? IDEVICE_E_SUCCESS : IDEVICE_E_SSL_ERROR);
 	debug_info("GnuTLS handshake done...");
 
 	if (return_me != GNUTLS_E_SUCCESS) {
+		/* don't offer a session the device refused again */
+		internal_ssl_session_store(connection, NULL);
 		internal_ssl_cleanup(ssl_data_loc);
 		free(ssl_data_loc);
 		debug_info("GnuTLS reported something wrong.");
 		gnutls_perror(return_me);
 		debug_info("oh.. errno says %s", strerror(errno));
 	} else {
+		if (gnutls_session_is_resumed(ssl_data_loc->session)) {
+			debug_info("resumed previous session");
+		} else {
+			internal_ssl_session_store(connection, ssl_data_loc->session);
+		}
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
 		debug_info("SSL mode enabled");
@@ -644,11 +2375,16 @@ idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
  * @param connection The connection to disable SSL for.
  *
  * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG when connection
- *     is NULL. This function also returns IDEVICE_E_SUCCESS when SSL is not
- *     enabled and does no further error checking on cleanup.
+ *     is NULL, or IDEVICE_E_SSL_ERROR when the device had already sent data
+ *     that was not read. That data is lost, so the connection is out of
+ *     sync; SSL is disabled nevertheless. This function also returns
+ *     IDEVICE_E_SUCCESS when SSL is not enabled and does no further error
+ *     checking on cleanup.
  */
 idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection)
 {
+	idevice_error_t ret = IDEVICE_E_SUCCESS;
+
 	if (!connection)
 		return IDEVICE_E_INVALID_ARG;
 	if (!connection->ssl_data) {
@@ -658,6 +2394,11 @@ idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection)
 
 	if (connection->ssl_data->session) {
 		gnutls_bye(connection->ssl_data->session, GNUTLS_SHUT_RDWR);
+		internal_ssl_flush(connection->ssl_data);
+	}
+	if (connection->ssl_data->recv_end > connection->ssl_data->recv_start) {
+		debug_info("ERROR: discarding %d bytes of unread data", connection->ssl_data->recv_end - connection->ssl_data->recv_start);
+		ret = IDEVICE_E_SSL_ERROR;
 	}
 	internal_ssl_cleanup(connection->ssl_data);
 	free(connection->ssl_data);
@@ -665,6 +2406,6 @@ idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection)
 
 	debug_info("SSL mode disabled");
 
-	return IDEVICE_E_SUCCESS;
+	return ret;
 }
 
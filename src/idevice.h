@@ -23,36 +23,79 @@
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#include <glib.h>
 
 #include "libimobiledevice/libimobiledevice.h"
+#include "replay.h"
 
 enum connection_type {
-	CONNECTION_USBMUXD = 1
+	CONNECTION_USBMUXD = 1,
+	CONNECTION_LOOPBACK,
+	CONNECTION_REPLAY,
+	CONNECTION_TCP
+};
+
+/** Device side of a loopback device */
+struct loopback_device {
+	idevice_loopback_cb_t callback;
+	void *user_data;
 };
 
 struct ssl_data_private {
+	struct idevice_connection_private *connection;
 	gnutls_certificate_credentials_t certificate;
 	gnutls_session_t session;
-	gnutls_x509_privkey_t root_privkey;
-	gnutls_x509_crt_t root_cert;
-	gnutls_x509_privkey_t host_privkey;
-	gnutls_x509_crt_t host_cert;
+	struct userpref_credentials *credentials;
+	char *recv_buffer;
+	uint32_t recv_start;
+	uint32_t recv_end;
+	char *send_buffer;
+	uint32_t send_length;
+	/* the read callback flushes too, possibly while another thread sends */
+	GMutex *send_mutex;
 };
 typedef struct ssl_data_private *ssl_data_t;
 
+struct idevice_cancel_private {
+	volatile gint refcount;
+	volatile gint triggered;
+	GMutex *mutex;
+	uint64_t deadline;
+	int fds[2];
+};
+
 struct idevice_connection_private {
 	enum connection_type type;
 	void *data;
 	ssl_data_t ssl_data;
+	char *session_key;
+	GMutex *metrics_mutex;
+	idevice_connection_metrics_t metrics;
+	uint64_t rtt_start;
+	int rtt_pending;
+	replay_recorder_t recorder;
+	uint32_t record_id;
+	idevice_cancel_t cancel;
+	idevice_error_t recv_error;
 };
 
 struct idevice_private {
 	char *uuid;
 	enum connection_type conn_type;
 	void *conn_data;
+	replay_recorder_t recorder;
+	idevice_cancel_t cancel;
 };
 
 idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection);
 idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection);
+G_GNUC_INTERNAL int idevice_connection_has_pending_data(idevice_connection_t connection);
+G_GNUC_INTERNAL void idevice_connection_count_plist(idevice_connection_t connection, int binary, int sent, uint32_t length);
+G_GNUC_INTERNAL uint64_t idevice_connection_lock_mutex(idevice_connection_t connection, GMutex *mutex);
+G_GNUC_INTERNAL void idevice_connection_unlock_mutex(idevice_connection_t connection, GMutex *mutex, uint64_t locked_at);
+G_GNUC_INTERNAL uint64_t idevice_trace_begin();
+G_GNUC_INTERNAL void idevice_trace_end(int phase, const char *target, uint64_t start, int result);
+G_GNUC_INTERNAL idevice_error_t idevice_event_add_listener(idevice_event_cb_t callback, void *user_data);
+G_GNUC_INTERNAL idevice_error_t idevice_event_remove_listener(idevice_event_cb_t callback, void *user_data);
 
 #endif
@@ -43,7 +43,7 @@ struct instproxy_status_data {
 static void instproxy_lock(instproxy_client_t client)
 {
 	debug_info("InstallationProxy: Locked");
-	g_mutex_lock(client->mutex);
+	client->lock_time = idevice_connection_lock_mutex(client->parent ? client->parent->connection : NULL, client->mutex);
 }
 
 /**
@@ -54,7 +54,7 @@ static void instproxy_lock(instproxy_client_t client)
 static void instproxy_unlock(instproxy_client_t client)
 {
 	debug_info("InstallationProxy: Unlocked");
-	g_mutex_unlock(client->mutex);
+	idevice_connection_unlock_mutex(client->parent ? client->parent->connection : NULL, client->mutex, client->lock_time);
 }
 
 /**
@@ -112,6 +112,7 @@ instproxy_error_t instproxy_client_new(idevice_t device, uint16_t port, instprox
 	client_loc->parent = plistclient;
 	client_loc->mutex = g_mutex_new();
 	client_loc->status_updater = NULL;
+	client_loc->queue = NULL;
 
 	*client = client_loc;
 	return INSTPROXY_E_SUCCESS;
@@ -131,6 +132,10 @@ instproxy_error_t instproxy_client_free(instproxy_client_t client)
 	if (!client)
 		return INSTPROXY_E_INVALID_ARG;
 
+	if (client->queue) {
+		debug_info("finishing queued operations");
+		instproxy_queue_free(client->queue);
+	}
 	property_list_service_client_free(client->parent);
 	client->parent = NULL;
 	if (client->status_updater) {
@@ -145,6 +150,27 @@ instproxy_error_t instproxy_client_free(instproxy_client_t client)
 	return INSTPROXY_E_SUCCESS;
 }
 
+/**
+ * Gets the transfer statistics of the connection used by a installation_proxy
+ * client, including the lock statistics of the client when enabled with
+ * idevice_set_lock_profiling().
+ *
+ * @param client The installation_proxy client.
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG when a parameter
+ *     is invalid.
+ */
+instproxy_error_t instproxy_client_get_metrics(instproxy_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->parent || !metrics)
+		return INSTPROXY_E_INVALID_ARG;
+
+	if (property_list_service_get_metrics(client->parent, metrics) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+		return INSTPROXY_E_INVALID_ARG;
+	return INSTPROXY_E_SUCCESS;
+}
+
 /**
  * Send a command with specified options to the device.
  * Only used internally.
@@ -175,28 +201,36 @@ static instproxy_error_t instproxy_send_command(instproxy_client_t client, const
 		plist_dict_insert_item(dict, "PackagePath", plist_new_string(package_path));
 	}
 
-	instproxy_error_t err = instproxy_error(property_list_service_send_xml_plist(client->parent, dict));
+	instproxy_error_t err = instproxy_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 	return err;
 }
 
 /**
- * List installed applications. This function runs synchronously.
+ * List installed applications, handing the results out batch by batch as
+ * the device sends them. The items are passed without being copied and
+ * nothing is kept after the callback returns, so memory use doesn't grow
+ * with the number of applications.
  *
  * @param client The connected installation_proxy client
  * @param client_options The client options to use, as PLIST_DICT, or NULL.
- *        Valid client options include:
- *          "ApplicationType" -> "User"
- *          "ApplicationType" -> "System"
- * @param result Pointer that will be set to a plist that will hold an array
- *        of PLIST_DICT holding information about the applications found.
+ *        See instproxy_browse() for valid options. Use
+ *        instproxy_client_options_set_return_attributes() to limit the
+ *        attributes the device sends for each application.
+ * @param callback Called for each batch with a PLIST_ARRAY of PLIST_DICT
+ *        items. The array belongs to the library and is only valid during
+ *        the call; use plist_copy() on the items that should be kept.
+ * @param user_data Passed to the callback.
+ *
+ * @note The client stays locked until the listing is complete, so the
+ *     callback must not use the same client.
  *
  * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
  *     an error occured.
  */
-instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_browse_cb_t callback, void *user_data)
 {
-	if (!client || !client->parent || !result)
+	if (!client || !client->parent || !callback)
 		return INSTPROXY_E_INVALID_ARG;
 
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
@@ -209,7 +243,6 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
 	}
 
 	int browsing = 0;
-	plist_t apps_array = plist_new_array();
 	plist_t dict = NULL;
 
 	do {
@@ -220,7 +253,6 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
 			break;
 		}
 		if (dict) {
-			uint64_t i;
 			uint64_t current_amount = 0;
 			char *status = NULL;
 			plist_t camount = plist_dict_get_item(dict, "CurrentAmount");
@@ -230,9 +262,8 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
 			}
 			if (current_amount > 0) {
 				plist_t current_list = plist_dict_get_item(dict, "CurrentList");
-				for (i = 0; current_list && (i < current_amount); i++) {
-					plist_t item = plist_array_get_item(current_list, i);
-					plist_array_append_item(apps_array, plist_copy(item));
+				if (current_list && (plist_get_node_type(current_list) == PLIST_ARRAY)) {
+					callback(current_list, user_data);
 				}
 			}
 			if (pstatus) {
@@ -251,12 +282,49 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
 		}
 	} while (browsing);
 
+leave_unlock:
+	instproxy_unlock(client);
+	return res;
+}
+
+static void instproxy_browse_collect(plist_t apps, void *user_data)
+{
+	uint32_t i;
+	uint32_t count = plist_array_get_size(apps);
+
+	for (i = 0; i < count; i++) {
+		plist_array_append_item((plist_t)user_data, plist_copy(plist_array_get_item(apps, i)));
+	}
+}
+
+/**
+ * List installed applications. This function runs synchronously.
+ *
+ * @param client The connected installation_proxy client
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        Valid client options include:
+ *          "ApplicationType" -> "User"
+ *          "ApplicationType" -> "System"
+ *          "ReturnAttributes" -> PLIST_ARRAY of attribute names, see
+ *          instproxy_client_options_set_return_attributes()
+ * @param result Pointer that will be set to a plist that will hold an array
+ *        of PLIST_DICT holding information about the applications found.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *     an error occured.
+ */
+instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
+{
+	if (!client || !client->parent || !result)
+		return INSTPROXY_E_INVALID_ARG;
+
+	plist_t apps_array = plist_new_array();
+	instproxy_error_t res = instproxy_browse_with_callback(client, client_options, instproxy_browse_collect, apps_array);
 	if (res == INSTPROXY_E_SUCCESS) {
 		*result = apps_array;
+	} else {
+		plist_free(apps_array);
 	}
-
-leave_unlock:
-	instproxy_unlock(client);
 	return res;
 }
 
@@ -429,7 +497,7 @@ static instproxy_error_t instproxy_install_or_upgrade(instproxy_client_t client,
 	if (!client || !client->parent || !pkg_path) {
 		return INSTPROXY_E_INVALID_ARG;
 	}
-	if (client->status_updater) {
+	if (client->status_updater || client->queue) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -530,7 +598,7 @@ instproxy_error_t instproxy_uninstall(instproxy_client_t client, const char *app
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->status_updater) {
+	if (client->status_updater || client->queue) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -622,7 +690,7 @@ instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	if (client->status_updater) {
+	if (client->status_updater || client->queue) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -663,7 +731,7 @@ instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	if (client->status_updater) {
+	if (client->status_updater || client->queue) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -704,7 +772,7 @@ instproxy_error_t instproxy_remove_archive(instproxy_client_t client, const char
 	if (!client || !client->parent || !appid)
 		return INSTPROXY_E_INVALID_ARG;
 
-	if (client->status_updater) {
+	if (client->status_updater || client->queue) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -719,6 +787,317 @@ instproxy_error_t instproxy_remove_archive(instproxy_client_t client, const char
 	return instproxy_create_status_updater(client, status_cb, "RemoveArchive", user_data);
 }
 
+/** Number of packages uploaded ahead of the one being installed */
+#define INSTPROXY_QUEUE_UPLOAD_AHEAD 1
+
+/** Directory on the device packages are uploaded to */
+#define INSTPROXY_QUEUE_STAGING_DIR "PublicStaging"
+
+struct instproxy_queue_item {
+	char *command;
+	char *local_path;
+	char *target;
+	plist_t options;
+	instproxy_error_t result;
+};
+
+/** Marks the end of the items in the internal queues */
+static struct instproxy_queue_item instproxy_queue_end;
+
+static void instproxy_queue_item_free(struct instproxy_queue_item *item)
+{
+	free(item->command);
+	free(item->local_path);
+	free(item->target);
+	if (item->options)
+		plist_free(item->options);
+	free(item);
+}
+
+/**
+ * Internally used thread function that uploads the packages of queued
+ * installs, staying at most INSTPROXY_QUEUE_UPLOAD_AHEAD packages ahead of
+ * the dispatcher so the device doesn't fill up with staged packages.
+ */
+static gpointer instproxy_queue_uploader(gpointer arg)
+{
+	instproxy_queue_t queue = (instproxy_queue_t)arg;
+	struct instproxy_queue_item *item;
+
+	while (1) {
+		item = (struct instproxy_queue_item*)g_async_queue_pop(queue->upload_queue);
+		if (item == &instproxy_queue_end) {
+			g_async_queue_push(queue->ready_queue, item);
+			break;
+		}
+		if (item->local_path) {
+			g_mutex_lock(queue->mutex);
+			while (queue->staged >= INSTPROXY_QUEUE_UPLOAD_AHEAD + 1) {
+				g_cond_wait(queue->cond, queue->mutex);
+			}
+			queue->staged++;
+			g_mutex_unlock(queue->mutex);
+
+			debug_info("uploading %s to %s", item->local_path, item->target);
+			afc_error_t aerr = afc_upload_file(queue->afc, item->local_path, item->target, NULL, NULL);
+			if (aerr != AFC_E_SUCCESS) {
+				debug_info("upload of %s failed, error %d", item->local_path, aerr);
+				item->result = INSTPROXY_E_CONN_FAILED;
+			}
+		}
+		g_async_queue_push(queue->ready_queue, item);
+	}
+
+	return NULL;
+}
+
+struct instproxy_queue_status {
+	instproxy_queue_t queue;
+	struct instproxy_queue_item *item;
+};
+
+static void instproxy_queue_status_cb(const char *operation, plist_t status, void *user_data)
+{
+	struct instproxy_queue_status *st = (struct instproxy_queue_status*)user_data;
+	st->queue->callback(operation, st->item->target, status, INSTPROXY_E_OP_IN_PROGRESS, st->queue->user_data);
+}
+
+/**
+ * Internally used thread function that carries out the queued operations
+ * one after another on the installation_proxy client and reports their
+ * status.
+ */
+static gpointer instproxy_queue_dispatcher(gpointer arg)
+{
+	instproxy_queue_t queue = (instproxy_queue_t)arg;
+	struct instproxy_queue_item *item;
+	struct instproxy_queue_status st;
+
+	while ((item = (struct instproxy_queue_item*)g_async_queue_pop(queue->ready_queue)) != &instproxy_queue_end) {
+		if (item->result == INSTPROXY_E_SUCCESS) {
+			instproxy_lock(queue->client);
+			if (item->local_path) {
+				item->result = instproxy_send_command(queue->client, item->command, item->options, NULL, item->target);
+			} else {
+				item->result = instproxy_send_command(queue->client, item->command, item->options, item->target, NULL);
+			}
+			instproxy_unlock(queue->client);
+			if (item->result == INSTPROXY_E_SUCCESS) {
+				st.queue = queue;
+				st.item = item;
+				item->result = instproxy_perform_operation(queue->client, instproxy_queue_status_cb, item->command, &st);
+			}
+		}
+
+		if (item->local_path) {
+			/* the next package may be uploaded now */
+			g_mutex_lock(queue->mutex);
+			queue->staged--;
+			g_cond_broadcast(queue->cond);
+			g_mutex_unlock(queue->mutex);
+		}
+
+		queue->callback(item->command, item->target, NULL, item->result, queue->user_data);
+		instproxy_queue_item_free(item);
+
+		g_mutex_lock(queue->mutex);
+		queue->pending--;
+		g_cond_broadcast(queue->cond);
+		g_mutex_unlock(queue->mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates a queue that carries out installs and uninstalls one after
+ * another on a long-lived dispatcher thread. The package of the next
+ * install is uploaded over AFC while the device is still installing the
+ * current one.
+ *
+ * @param client The connected installation_proxy client. It may not be
+ *     used for other operations until the queue is freed.
+ * @param afc An AFC client used to upload packages, or NULL if only
+ *     uninstalls are queued. It may not be used by anyone else until the
+ *     queue is freed.
+ * @param callback Called with status updates (result is
+ *     INSTPROXY_E_OP_IN_PROGRESS) and once more with a NULL status and the
+ *     result when an item is finished. It is called from the dispatcher
+ *     thread.
+ * @param user_data Passed to the callback.
+ * @param queue Pointer that will be set to the new queue.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_INVALID_ARG if an
+ *     argument is invalid, or INSTPROXY_E_OP_IN_PROGRESS if the client is
+ *     busy with another operation.
+ */
+instproxy_error_t instproxy_queue_new(instproxy_client_t client, afc_client_t afc, instproxy_queue_cb_t callback, void *user_data, instproxy_queue_t *queue)
+{
+	if (!client || !client->parent || !callback || !queue)
+		return INSTPROXY_E_INVALID_ARG;
+	if (client->status_updater || client->queue)
+		return INSTPROXY_E_OP_IN_PROGRESS;
+
+	instproxy_queue_t queue_loc = (instproxy_queue_t)malloc(sizeof(struct instproxy_queue_private));
+	memset(queue_loc, '\0', sizeof(struct instproxy_queue_private));
+	queue_loc->client = client;
+	queue_loc->afc = afc;
+	queue_loc->callback = callback;
+	queue_loc->user_data = user_data;
+	queue_loc->mutex = g_mutex_new();
+	queue_loc->cond = g_cond_new();
+	queue_loc->upload_queue = g_async_queue_new();
+	queue_loc->ready_queue = g_async_queue_new();
+
+	if (afc) {
+		afc_make_directory(afc, INSTPROXY_QUEUE_STAGING_DIR);
+	}
+
+	queue_loc->dispatcher = g_thread_create(instproxy_queue_dispatcher, queue_loc, TRUE, NULL);
+	queue_loc->uploader = g_thread_create(instproxy_queue_uploader, queue_loc, TRUE, NULL);
+	if (!queue_loc->dispatcher || !queue_loc->uploader) {
+		if (queue_loc->uploader) {
+			g_async_queue_push(queue_loc->upload_queue, &instproxy_queue_end);
+			g_thread_join(queue_loc->uploader);
+		} else if (queue_loc->dispatcher) {
+			g_async_queue_push(queue_loc->ready_queue, &instproxy_queue_end);
+		}
+		if (queue_loc->dispatcher) {
+			g_thread_join(queue_loc->dispatcher);
+		}
+		g_async_queue_unref(queue_loc->upload_queue);
+		g_async_queue_unref(queue_loc->ready_queue);
+		g_cond_free(queue_loc->cond);
+		g_mutex_free(queue_loc->mutex);
+		free(queue_loc);
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	client->queue = queue_loc;
+	*queue = queue_loc;
+	return INSTPROXY_E_SUCCESS;
+}
+
+static void instproxy_queue_push(instproxy_queue_t queue, struct instproxy_queue_item *item)
+{
+	g_mutex_lock(queue->mutex);
+	queue->pending++;
+	g_mutex_unlock(queue->mutex);
+	g_async_queue_push(queue->upload_queue, item);
+}
+
+/**
+ * Queues the installation of a package.
+ *
+ * @param queue The queue.
+ * @param local_path Path of the package on the host. It is uploaded to
+ *     the PublicStaging directory of the AFC jail before it is installed.
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *     See instproxy_install(). The options are copied.
+ * @param upgrade Non-zero to upgrade an installed application instead.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG if an
+ *     argument is invalid or the queue has no AFC client.
+ */
+instproxy_error_t instproxy_queue_add_install(instproxy_queue_t queue, const char *local_path, plist_t client_options, int upgrade)
+{
+	if (!queue || !queue->afc || !local_path)
+		return INSTPROXY_E_INVALID_ARG;
+
+	const char *name = strrchr(local_path, '/');
+	name = name ? name + 1 : local_path;
+	if (!*name)
+		return INSTPROXY_E_INVALID_ARG;
+
+	struct instproxy_queue_item *item = (struct instproxy_queue_item*)malloc(sizeof(struct instproxy_queue_item));
+	memset(item, '\0', sizeof(struct instproxy_queue_item));
+	item->command = strdup(upgrade ? "Upgrade" : "Install");
+	item->local_path = strdup(local_path);
+	item->target = (char*)malloc(strlen(INSTPROXY_QUEUE_STAGING_DIR) + 1 + strlen(name) + 1);
+	strcpy(item->target, INSTPROXY_QUEUE_STAGING_DIR "/");
+	strcat(item->target, name);
+	item->options = client_options ? plist_copy(client_options) : NULL;
+	item->result = INSTPROXY_E_SUCCESS;
+
+	instproxy_queue_push(queue, item);
+	return INSTPROXY_E_SUCCESS;
+}
+
+/**
+ * Queues the removal of an application.
+ *
+ * @param queue The queue.
+ * @param appid ApplicationIdentifier of the app to uninstall.
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *     The options are copied.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG if an
+ *     argument is invalid.
+ */
+instproxy_error_t instproxy_queue_add_uninstall(instproxy_queue_t queue, const char *appid, plist_t client_options)
+{
+	if (!queue || !appid)
+		return INSTPROXY_E_INVALID_ARG;
+
+	struct instproxy_queue_item *item = (struct instproxy_queue_item*)malloc(sizeof(struct instproxy_queue_item));
+	memset(item, '\0', sizeof(struct instproxy_queue_item));
+	item->command = strdup("Uninstall");
+	item->target = strdup(appid);
+	item->options = client_options ? plist_copy(client_options) : NULL;
+	item->result = INSTPROXY_E_SUCCESS;
+
+	instproxy_queue_push(queue, item);
+	return INSTPROXY_E_SUCCESS;
+}
+
+/**
+ * Waits until all queued operations are finished.
+ *
+ * @param queue The queue.
+ *
+ * @return INSTPROXY_E_SUCCESS or INSTPROXY_E_INVALID_ARG if queue is NULL.
+ */
+instproxy_error_t instproxy_queue_wait(instproxy_queue_t queue)
+{
+	if (!queue)
+		return INSTPROXY_E_INVALID_ARG;
+
+	g_mutex_lock(queue->mutex);
+	while (queue->pending > 0) {
+		g_cond_wait(queue->cond, queue->mutex);
+	}
+	g_mutex_unlock(queue->mutex);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+/**
+ * Finishes the queued operations, stops the queue's threads and frees it.
+ * The installation_proxy and AFC clients can be used again afterwards.
+ *
+ * @param queue The queue to free.
+ *
+ * @return INSTPROXY_E_SUCCESS or INSTPROXY_E_INVALID_ARG if queue is NULL.
+ */
+instproxy_error_t instproxy_queue_free(instproxy_queue_t queue)
+{
+	if (!queue)
+		return INSTPROXY_E_INVALID_ARG;
+
+	g_async_queue_push(queue->upload_queue, &instproxy_queue_end);
+	g_thread_join(queue->uploader);
+	g_thread_join(queue->dispatcher);
+
+	queue->client->queue = NULL;
+	g_async_queue_unref(queue->upload_queue);
+	g_async_queue_unref(queue->ready_queue);
+	g_cond_free(queue->cond);
+	g_mutex_free(queue->mutex);
+	free(queue);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
 /**
  * Create a new client_options plist.
  *
@@ -772,6 +1151,31 @@ void instproxy_client_options_add(plist_t client_options, ...)
 	va_end(args);
 }
 
+/**
+ * Limit the attributes returned for each application by instproxy_browse()
+ * and instproxy_browse_with_callback(). Asking only for what is needed
+ * makes browsing a lot faster on devices with many applications.
+ *
+ * @param client_options The client options to modify.
+ * @param ... Attribute names like "CFBundleIdentifier" or
+ *       "CFBundleDisplayName", followed by NULL
+ */
+void instproxy_client_options_set_return_attributes(plist_t client_options, ...)
+{
+	if (!client_options)
+		return;
+	plist_t attributes = plist_new_array();
+	va_list args;
+	va_start(args, client_options);
+	char *arg = va_arg(args, char*);
+	while (arg) {
+		plist_array_append_item(attributes, plist_new_string(arg));
+		arg = va_arg(args, char*);
+	}
+	va_end(args);
+	plist_dict_insert_item(client_options, "ReturnAttributes", attributes);
+}
+
 /**
  * Free client_options plist.
  *
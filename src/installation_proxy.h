@@ -29,7 +29,24 @@
 struct instproxy_client_private {
 	property_list_service_client_t parent;
 	GMutex *mutex;
+	uint64_t lock_time;
 	GThread *status_updater;
+	instproxy_queue_t queue;
+};
+
+struct instproxy_queue_private {
+	instproxy_client_t client;
+	afc_client_t afc;
+	instproxy_queue_cb_t callback;
+	void *user_data;
+	GAsyncQueue *upload_queue;
+	GAsyncQueue *ready_queue;
+	GThread *uploader;
+	GThread *dispatcher;
+	GMutex *mutex;
+	GCond *cond;
+	unsigned int pending;
+	unsigned int staged;
 };
 
 #endif
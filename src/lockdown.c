@@ -25,6 +25,7 @@
 #define _GNU_SOURCE 1
 #define __USE_GNU 1
 #include <stdio.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <glib.h>
 #include <libtasn1.h>
@@ -34,6 +35,7 @@
 #include "property_list_service.h"
 #include "lockdown.h"
 #include "idevice.h"
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_LOCKDOWN
 #include "debug.h"
 #include "userpref.h"
 
@@ -236,6 +238,25 @@ void lockdownd_client_set_label(lockdownd_client_t client, const char *label)
 	}
 }
 
+/**
+ * Gets the transfer statistics of the connection to lockdownd.
+ *
+ * @param client The lockdown client
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success or LOCKDOWN_E_INVALID_ARG when a
+ *     parameter is invalid.
+ */
+lockdownd_error_t lockdownd_client_get_metrics(lockdownd_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->parent || !metrics)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	if (property_list_service_get_metrics(client->parent, metrics) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+		return LOCKDOWN_E_INVALID_ARG;
+	return LOCKDOWN_E_SUCCESS;
+}
+
 /**
  * Receives a plist from lockdownd.
  *
@@ -283,38 +304,113 @@ lockdownd_error_t lockdownd_send(lockdownd_client_t client, plist_t plist)
 	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
 	idevice_error_t err;
 
-	err = property_list_service_send_xml_plist(client->parent, plist);
+	err = property_list_service_send_plist(client->parent, plist);
 	if (err != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		ret = LOCKDOWN_E_UNKNOWN_ERROR;
 	}
 	return ret;
 }
 
+/** Start of the xml requests built by lockdownd_send_request() */
+#define LOCKDOWN_XML_HEADER "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" \
+	"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n" \
+	"<plist version=\"1.0\">\n<dict>\n"
+
+/** End of the xml requests built by lockdownd_send_request() */
+#define LOCKDOWN_XML_FOOTER "</dict>\n</plist>\n"
+
 /**
- * Query the type of the service daemon. Depending on whether the device is
- * queried in normal mode or restore mode, different types will be returned.
+ * Appends text to an xml document, escaping the markup characters.
+ */
+static void lockdownd_xml_append(GString *xml, const char *text)
+{
+	const char *p;
+
+	for (p = text; *p; p++) {
+		switch (*p) {
+		case '&':
+			g_string_append(xml, "&amp;");
+			break;
+		case '<':
+			g_string_append(xml, "&lt;");
+			break;
+		case '>':
+			g_string_append(xml, "&gt;");
+			break;
+		default:
+			g_string_append_c(xml, *p);
+			break;
+		}
+	}
+}
+
+/**
+ * Sends a request dictionary that holds only strings. The request is
+ * filled into a prebuilt xml template instead of building a plist and
+ * serializing it, which is what most requests to lockdownd look like.
+ * The label of the client goes first, followed by the NULL terminated
+ * list of key and value pairs. Pairs with a NULL value are left out.
  *
  * @param client The lockdownd client
- * @param type The type returned by the service daemon. Pass NULL to ignore.
  *
- * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG when client is NULL
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client
+ *  is NULL or LOCKDOWN_E_UNKNOWN_ERROR when sending failed
  */
-lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type)
+static lockdownd_error_t lockdownd_send_request(lockdownd_client_t client, ...)
+{
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	GString *xml;
+	const char *key;
+	const char *value;
+	va_list args;
+
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	xml = g_string_sized_new(512);
+	g_string_append(xml, LOCKDOWN_XML_HEADER);
+	if (client->label) {
+		g_string_append(xml, "\t<key>Label</key>\n\t<string>");
+		lockdownd_xml_append(xml, client->label);
+		g_string_append(xml, "</string>\n");
+	}
+	va_start(args, client);
+	while ((key = va_arg(args, const char*))) {
+		value = va_arg(args, const char*);
+		if (!value)
+			continue;
+		g_string_append(xml, "\t<key>");
+		lockdownd_xml_append(xml, key);
+		g_string_append(xml, "</key>\n\t<string>");
+		lockdownd_xml_append(xml, value);
+		g_string_append(xml, "</string>\n");
+	}
+	va_end(args);
+	g_string_append(xml, LOCKDOWN_XML_FOOTER);
+
+	if (property_list_service_send_serialized_plist(client->parent, xml->str, xml->len, 0) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		ret = LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	g_string_free(xml, TRUE);
+	return ret;
+}
+
+/**
+ * Internally used function to perform the QueryType request.
+ */
+static lockdownd_error_t lockdownd_do_query_type(lockdownd_client_t client, char **type)
 {
 	if (!client)
 		return LOCKDOWN_E_INVALID_ARG;
 
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
-	plist_t dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	plist_dict_insert_item(dict,"Request", plist_new_string("QueryType"));
+	plist_t dict = NULL;
 
 	debug_info("called");
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
+	ret = lockdownd_send_request(client, "Request", "QueryType", NULL);
+	if (LOCKDOWN_E_SUCCESS != ret)
+		return ret;
 
 	ret = lockdownd_receive(client, &dict);
 
@@ -337,9 +433,332 @@ lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type)
 	return ret;
 }
 
+/**
+ * Query the type of the service daemon. Depending on whether the device is
+ * queried in normal mode or restore mode, different types will be returned.
+ *
+ * @param client The lockdownd client
+ * @param type The type returned by the service daemon. Pass NULL to ignore.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG when client is NULL
+ */
+lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type)
+{
+	uint64_t trace_start = idevice_trace_begin();
+	lockdownd_error_t ret = lockdownd_do_query_type(client, type);
+	idevice_trace_end(IDEVICE_TRACE_LOCKDOWN_QUERY_TYPE, client ? client->uuid : NULL, trace_start, ret);
+	return ret;
+}
+
+/**
+ * Internally used function to send a GetValue request.
+ */
+static lockdownd_error_t lockdownd_send_get_value(lockdownd_client_t client, const char *domain, const char *key)
+{
+	return lockdownd_send_request(client, "Domain", domain, "Key", key, "Request", "GetValue", NULL);
+}
+
+/**
+ * Internally used function to extract the value from a GetValue reply.
+ */
+static lockdownd_error_t lockdownd_get_value_result(plist_t dict, plist_t *value)
+{
+	if (lockdown_check_result(dict, "GetValue") != RESULT_SUCCESS) {
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	debug_info("success");
+
+	plist_t value_node = plist_dict_get_item(dict, "Value");
+	if (value_node) {
+		debug_info("has a value");
+		*value = plist_copy(value_node);
+	}
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/** A value cached by the lockdown value cache */
+struct lockdownd_cache_entry {
+	plist_t value;
+	glong expires;
+};
+
+static GStaticMutex value_cache_mutex = G_STATIC_MUTEX_INIT;
+/* "uuid\ndomain\nkey" -> struct lockdownd_cache_entry */
+static GHashTable *value_cache = NULL;
+/* "domain\nkey" -> time to live in seconds */
+static GHashTable *value_cache_ttls = NULL;
+static lockdownd_value_changed_cb_t value_cache_cb = NULL;
+static void *value_cache_user_data = NULL;
+
+static void lockdownd_cache_entry_free(gpointer data)
+{
+	struct lockdownd_cache_entry *entry = (struct lockdownd_cache_entry *) data;
+
+	if (entry->value)
+		plist_free(entry->value);
+	free(entry);
+}
+
+/**
+ * Makes sure the tables of the value cache exist. The caller must hold
+ * value_cache_mutex.
+ */
+static void lockdownd_value_cache_init()
+{
+	if (!value_cache) {
+		value_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, lockdownd_cache_entry_free);
+		value_cache_ttls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+}
+
+static char *lockdownd_value_cache_key(const char *uuid, const char *domain, const char *key)
+{
+	return g_strdup_printf("%s\n%s\n%s", uuid, domain ? domain : "", key ? key : "");
+}
+
+static glong lockdownd_value_cache_now()
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+	return now.tv_sec;
+}
+
+/**
+ * Returns the time to live configured for a value, 0 if it is not cached.
+ */
+static unsigned int lockdownd_value_cache_get_ttl(const char *domain, const char *key)
+{
+	unsigned int ttl = 0;
+	char *name;
+
+	if (!key)
+		return 0;
+
+	g_static_mutex_lock(&value_cache_mutex);
+	if (value_cache_ttls) {
+		name = g_strdup_printf("%s\n%s", domain ? domain : "", key);
+		ttl = GPOINTER_TO_UINT(g_hash_table_lookup(value_cache_ttls, name));
+		g_free(name);
+	}
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	return ttl;
+}
+
+/**
+ * Checks whether two plists hold the same value.
+ */
+static int lockdownd_value_equal(plist_t a, plist_t b)
+{
+	char *bin_a = NULL, *bin_b = NULL;
+	uint32_t len_a = 0, len_b = 0;
+	int res;
+
+	if (!a || !b)
+		return (a == b);
+
+	plist_to_bin(a, &bin_a, &len_a);
+	plist_to_bin(b, &bin_b, &len_b);
+	res = (len_a == len_b) && bin_a && bin_b && !memcmp(bin_a, bin_b, len_a);
+	free(bin_a);
+	free(bin_b);
+	return res;
+}
+
+/**
+ * Passes a change of a value to the callback registered with
+ * lockdownd_value_cache_set_callback(). Must be called without holding
+ * value_cache_mutex.
+ */
+static void lockdownd_value_cache_notify(const char *uuid, const char *domain, const char *key, plist_t value)
+{
+	lockdownd_value_changed_cb_t callback;
+	void *user_data;
+
+	g_static_mutex_lock(&value_cache_mutex);
+	callback = value_cache_cb;
+	user_data = value_cache_user_data;
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	if (callback)
+		callback(uuid, domain, key, value, user_data);
+}
+
+/**
+ * Looks up a value in the cache.
+ *
+ * @return 1 and a copy of the value if it was cached and has not expired
+ *     yet, 0 otherwise.
+ */
+static int lockdownd_value_cache_lookup(const char *uuid, const char *domain, const char *key, plist_t *value)
+{
+	struct lockdownd_cache_entry *entry;
+	char *name;
+	int found = 0;
+
+	g_static_mutex_lock(&value_cache_mutex);
+	if (value_cache) {
+		name = lockdownd_value_cache_key(uuid, domain, key);
+		entry = (struct lockdownd_cache_entry *) g_hash_table_lookup(value_cache, name);
+		if (entry && entry->value && (entry->expires > lockdownd_value_cache_now())) {
+			*value = plist_copy(entry->value);
+			found = 1;
+		}
+		g_free(name);
+	}
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	return found;
+}
+
+/**
+ * Stores a value freshly retrieved from the device in the cache and
+ * reports it if it differs from the value cached before.
+ */
+static void lockdownd_value_cache_store(const char *uuid, const char *domain, const char *key, plist_t value, unsigned int ttl)
+{
+	struct lockdownd_cache_entry *entry;
+	char *name;
+	int changed = 0;
+
+	g_static_mutex_lock(&value_cache_mutex);
+	lockdownd_value_cache_init();
+	name = lockdownd_value_cache_key(uuid, domain, key);
+	entry = (struct lockdownd_cache_entry *) g_hash_table_lookup(value_cache, name);
+	if (entry) {
+		g_free(name);
+		changed = !lockdownd_value_equal(entry->value, value);
+		if (entry->value)
+			plist_free(entry->value);
+	} else {
+		entry = (struct lockdownd_cache_entry *) malloc(sizeof(struct lockdownd_cache_entry));
+		g_hash_table_insert(value_cache, name, entry);
+	}
+	entry->value = plist_copy(value);
+	entry->expires = lockdownd_value_cache_now() + ttl;
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	if (changed)
+		lockdownd_value_cache_notify(uuid, domain, key, value);
+}
+
+static gboolean lockdownd_value_cache_match_prefix(gpointer key, gpointer value, gpointer user_data)
+{
+	return g_str_has_prefix((const char *) key, (const char *) user_data);
+}
+
+/**
+ * Drops cached values of a device after it was told to change them. With
+ * key NULL, all values of the domain are dropped.
+ */
+static void lockdownd_value_cache_invalidate(const char *uuid, const char *domain, const char *key)
+{
+	char *name;
+
+	g_static_mutex_lock(&value_cache_mutex);
+	if (value_cache) {
+		if (key) {
+			name = lockdownd_value_cache_key(uuid, domain, key);
+			g_hash_table_remove(value_cache, name);
+		} else {
+			name = g_strdup_printf("%s\n%s\n", uuid, domain ? domain : "");
+			g_hash_table_foreach_remove(value_cache, lockdownd_value_cache_match_prefix, name);
+		}
+		g_free(name);
+	}
+	g_static_mutex_unlock(&value_cache_mutex);
+}
+
+/**
+ * Sets how long a value retrieved with lockdownd_get_value() is cached.
+ * The cache is shared by all clients and keyed by device uuid, domain and
+ * key, so repeated requests for mostly static values like ProductVersion
+ * or DeviceName are answered without talking to the device. Nothing is
+ * cached unless a time to live was set for it.
+ *
+ * Cached values are dropped when they are changed or removed with
+ * lockdownd_set_value() or lockdownd_remove_value().
+ *
+ * @param domain The domain of the value or NULL for the global domain.
+ * @param key The key of the value.
+ * @param ttl Time to live in seconds, 0 to stop caching the value.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when key
+ *     is NULL.
+ */
+lockdownd_error_t lockdownd_value_cache_set_ttl(const char *domain, const char *key, unsigned int ttl)
+{
+	if (!key)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	g_static_mutex_lock(&value_cache_mutex);
+	lockdownd_value_cache_init();
+	char *name = g_strdup_printf("%s\n%s", domain ? domain : "", key);
+	if (ttl > 0) {
+		g_hash_table_replace(value_cache_ttls, name, GUINT_TO_POINTER(ttl));
+	} else {
+		g_hash_table_remove(value_cache_ttls, name);
+		g_free(name);
+	}
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Registers a function that gets called when a cached value changes:
+ * when a refreshed value differs from the one cached before, or when a
+ * value was set or removed through lockdownd_set_value() or
+ * lockdownd_remove_value().
+ *
+ * @param callback The function to call, or NULL to stop notifications.
+ *     It receives the new value, which is NULL for removed values and
+ *     only valid during the call.
+ * @param user_data Passed to the callback.
+ *
+ * @return LOCKDOWN_E_SUCCESS
+ */
+lockdownd_error_t lockdownd_value_cache_set_callback(lockdownd_value_changed_cb_t callback, void *user_data)
+{
+	g_static_mutex_lock(&value_cache_mutex);
+	value_cache_cb = callback;
+	value_cache_user_data = user_data;
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Drops the cached values of a device, or of all devices.
+ *
+ * @param uuid The uuid of the device, or NULL for all devices.
+ *
+ * @return LOCKDOWN_E_SUCCESS
+ */
+lockdownd_error_t lockdownd_value_cache_flush(const char *uuid)
+{
+	g_static_mutex_lock(&value_cache_mutex);
+	if (value_cache) {
+		if (uuid) {
+			char *prefix = g_strdup_printf("%s\n", uuid);
+			g_hash_table_foreach_remove(value_cache, lockdownd_value_cache_match_prefix, prefix);
+			g_free(prefix);
+		} else {
+			g_hash_table_remove_all(value_cache);
+		}
+	}
+	g_static_mutex_unlock(&value_cache_mutex);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
 /**
  * Retrieves a preferences plist using an optional domain and/or key name.
  *
+ * @note Values configured with lockdownd_value_cache_set_ttl() are
+ *     answered from the value cache while they are fresh.
+ *
  * @param client An initialized lockdownd client.
  * @param domain The domain to query on or NULL for global domain
  * @param key The key name to request or NULL to query for all keys
@@ -354,24 +773,15 @@ lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *dom
 
 	plist_t dict = NULL;
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+	unsigned int ttl = client->uuid ? lockdownd_value_cache_get_ttl(domain, key) : 0;
 
-	/* setup request plist */
-	dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	if (domain) {
-		plist_dict_insert_item(dict,"Domain", plist_new_string(domain));
-	}
-	if (key) {
-		plist_dict_insert_item(dict,"Key", plist_new_string(key));
+	if ((ttl > 0) && lockdownd_value_cache_lookup(client->uuid, domain, key, value)) {
+		debug_info("%s/%s answered from cache", domain ? domain : "(global)", key);
+		return LOCKDOWN_E_SUCCESS;
 	}
-	plist_dict_insert_item(dict,"Request", plist_new_string("GetValue"));
 
 	/* send to device */
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
-
+	ret = lockdownd_send_get_value(client, domain, key);
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
@@ -380,23 +790,74 @@ lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *dom
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
-	if (lockdown_check_result(dict, "GetValue") == RESULT_SUCCESS) {
-		debug_info("success");
-		ret = LOCKDOWN_E_SUCCESS;
-	}
-	if (ret != LOCKDOWN_E_SUCCESS) {
-		plist_free(dict);
-		return ret;
+	ret = lockdownd_get_value_result(dict, value);
+	if ((ret == LOCKDOWN_E_SUCCESS) && (ttl > 0)) {
+		lockdownd_value_cache_store(client->uuid, domain, key, *value, ttl);
 	}
 
-	plist_t value_node = plist_dict_get_item(dict, "Value");
+	plist_free(dict);
+	return ret;
+}
 
-	if (value_node) {
-		debug_info("has a value");
-		*value = plist_copy(value_node);
+/** Maximum number of GetValue requests lockdownd_get_values() keeps in flight */
+#define LOCKDOWN_GET_VALUES_WINDOW 16
+
+/**
+ * Retrieves several preferences values at once.
+ *
+ * Instead of waiting for the reply to every request before sending the
+ * next one, the GetValue requests are written back-to-back and the
+ * replies are collected in order afterwards, so reading many values costs
+ * about one round trip instead of one per value.
+ *
+ * @param client An initialized lockdownd client.
+ * @param domains Array of count domains to query on. The array itself or
+ *     any of its entries can be NULL for the global domain.
+ * @param keys Array of count key names. Any of its entries can be NULL to
+ *     query for all keys of the domain.
+ * @param count The number of values to retrieve.
+ * @param values Array of count plist nodes that will be set to the result
+ *     values. Entries are set to NULL if the device did not return a value.
+ *
+ * @return LOCKDOWN_E_SUCCESS if all requests were answered (even if some
+ *  values could not be retrieved), LOCKDOWN_E_INVALID_ARG when an argument
+ *  is invalid, or an error if the communication with the device failed.
+ */
+lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, uint32_t count, plist_t *values)
+{
+	uint32_t sent = 0, received = 0;
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+
+	if (!client || !keys || !values)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	memset(values, '\0', sizeof(plist_t) * count);
+
+	while (received < count) {
+		/* keep a bounded number of requests in flight so neither side
+		   blocks on a full socket buffer */
+		while ((ret == LOCKDOWN_E_SUCCESS) && (sent < count) && (sent - received < LOCKDOWN_GET_VALUES_WINDOW)) {
+			ret = lockdownd_send_get_value(client, domains ? domains[sent] : NULL, keys[sent]);
+			if (ret != LOCKDOWN_E_SUCCESS)
+				break;
+			sent++;
+		}
+		if (sent == received)
+			break;
+
+		plist_t dict = NULL;
+		lockdownd_error_t res = lockdownd_receive(client, &dict);
+		if (res != LOCKDOWN_E_SUCCESS) {
+			ret = res;
+			break;
+		}
+		if (lockdownd_get_value_result(dict, &values[received]) != LOCKDOWN_E_SUCCESS) {
+			debug_info("no value for %s/%s", (domains && domains[received]) ? domains[received] : "(global)", keys[received] ? keys[received] : "(all)");
+		}
+		plist_free(dict);
+		received++;
 	}
 
-	plist_free(dict);
 	return ret;
 }
 
@@ -431,24 +892,43 @@ lockdownd_error_t lockdownd_set_value(lockdownd_client_t client, const char *dom
 	plist_dict_insert_item(dict,"Request", plist_new_string("SetValue"));
 	plist_dict_insert_item(dict,"Value", value);
 
+	/* the request takes over the value, keep a copy to report the change */
+	plist_t new_value = (client->uuid) ? plist_copy(value) : NULL;
+
 	/* send to device */
 	ret = lockdownd_send(client, dict);
 
 	plist_free(dict);
 	dict = NULL;
 
-	if (ret != LOCKDOWN_E_SUCCESS)
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		if (new_value)
+			plist_free(new_value);
 		return ret;
+	}
 
 	/* Now get device's answer */
 	ret = lockdownd_receive(client, &dict);
-	if (ret != LOCKDOWN_E_SUCCESS)
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		if (new_value)
+			plist_free(new_value);
 		return ret;
+	}
 
 	if (lockdown_check_result(dict, "SetValue") == RESULT_SUCCESS) {
 		debug_info("success");
 		ret = LOCKDOWN_E_SUCCESS;
+	} else {
+		ret = LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+
+	if (client->uuid) {
+		lockdownd_value_cache_invalidate(client->uuid, domain, key);
+		if (ret == LOCKDOWN_E_SUCCESS)
+			lockdownd_value_cache_notify(client->uuid, domain, key, new_value);
 	}
+	if (new_value)
+		plist_free(new_value);
 
 	if (ret != LOCKDOWN_E_SUCCESS) {
 		plist_free(dict);
@@ -506,6 +986,14 @@ lockdownd_error_t lockdownd_remove_value(lockdownd_client_t client, const char *
 	if (lockdown_check_result(dict, "RemoveValue") == RESULT_SUCCESS) {
 		debug_info("success");
 		ret = LOCKDOWN_E_SUCCESS;
+	} else {
+		ret = LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+
+	if (client->uuid) {
+		lockdownd_value_cache_invalidate(client->uuid, domain, key);
+		if (ret == LOCKDOWN_E_SUCCESS)
+			lockdownd_value_cache_notify(client->uuid, domain, key, NULL);
 	}
 
 	if (ret != LOCKDOWN_E_SUCCESS) {
@@ -599,21 +1087,9 @@ lockdownd_error_t lockdownd_get_device_name(lockdownd_client_t client, char **de
 }
 
 /**
- * Creates a new lockdownd client for the device.
- *
- * @note This function does not pair with the device or start a session. This
- *  has to be done manually by the caller after the client is created.
- *  The device disconnects automatically if the lockdown connection idles
- *  for more than 10 seconds. Make sure to call lockdownd_client_free() as soon
- *  as the connection is no longer needed.
- *
- * @param device The device to create a lockdownd client for
- * @param client The pointer to the location of the new lockdownd_client
- * @param label The label to use for communication. Usually the program name.
- *
- * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG when client is NULL
+ * Internally used function to perform the lockdownd connection setup.
  */
-lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *client, const char *label)
+static lockdownd_error_t lockdownd_do_client_new(idevice_t device, lockdownd_client_t *client, const char *label)
 {
 	if (!client)
 		return LOCKDOWN_E_INVALID_ARG;
@@ -628,7 +1104,7 @@ lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *cli
 	client_loc->parent = plistclient;
 	client_loc->ssl_enabled = 0;
 	client_loc->session_id = NULL;
-	client_loc->uuid = NULL;
+	client_loc->uuid = device->uuid ? strdup(device->uuid) : NULL;
 	client_loc->label = label ? strdup(label) : NULL;
 
 	*client = client_loc;
@@ -636,6 +1112,29 @@ lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *cli
 	return LOCKDOWN_E_SUCCESS;
 }
 
+/**
+ * Creates a new lockdownd client for the device.
+ *
+ * @note This function does not pair with the device or start a session. This
+ *  has to be done manually by the caller after the client is created.
+ *  The device disconnects automatically if the lockdown connection idles
+ *  for more than 10 seconds. Make sure to call lockdownd_client_free() as soon
+ *  as the connection is no longer needed.
+ *
+ * @param device The device to create a lockdownd client for
+ * @param client The pointer to the location of the new lockdownd_client
+ * @param label The label to use for communication. Usually the program name.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG when client is NULL
+ */
+lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *client, const char *label)
+{
+	uint64_t trace_start = idevice_trace_begin();
+	lockdownd_error_t ret = lockdownd_do_client_new(device, client, label);
+	idevice_trace_end(IDEVICE_TRACE_LOCKDOWN_CLIENT_NEW, device ? device->uuid : NULL, trace_start, ret);
+	return ret;
+}
+
 /**
  * Creates a new lockdownd client for the device and starts initial handshake.
  * The handshake consists out of query_type, validate_pair, pair and
@@ -663,6 +1162,9 @@ lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdown
 	char *host_id = NULL;
 	char *type = NULL;
 
+	/* overlap loading the host credentials with the connection setup */
+	userpref_prepare_credentials();
+
 	ret = lockdownd_client_new(device, &client_loc, label);
 	if (LOCKDOWN_E_SUCCESS != ret) {
 		debug_info("failed to create lockdownd client.");
@@ -681,6 +1183,10 @@ lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdown
 			free(type);
 	}
 
+	if (client_loc->uuid) {
+		free(client_loc->uuid);
+		client_loc->uuid = NULL;
+	}
 	ret = idevice_get_uuid(device, &client_loc->uuid);
 	if (LOCKDOWN_E_SUCCESS != ret) {
 		debug_info("failed to get device uuid.");
@@ -949,7 +1455,10 @@ static lockdownd_error_t lockdownd_do_pair(lockdownd_client_t client, lockdownd_
  */
 lockdownd_error_t lockdownd_pair(lockdownd_client_t client, lockdownd_pair_record_t pair_record)
 {
-	return lockdownd_do_pair(client, pair_record, "Pair");
+	uint64_t trace_start = idevice_trace_begin();
+	lockdownd_error_t ret = lockdownd_do_pair(client, pair_record, "Pair");
+	idevice_trace_end(IDEVICE_TRACE_LOCKDOWN_PAIR, client ? client->uuid : NULL, trace_start, ret);
+	return ret;
 }
 
 /** 
@@ -971,7 +1480,10 @@ lockdownd_error_t lockdownd_pair(lockdownd_client_t client, lockdownd_pair_recor
  */
 lockdownd_error_t lockdownd_validate_pair(lockdownd_client_t client, lockdownd_pair_record_t pair_record)
 {
-	return lockdownd_do_pair(client, pair_record, "ValidatePair");
+	uint64_t trace_start = idevice_trace_begin();
+	lockdownd_error_t ret = lockdownd_do_pair(client, pair_record, "ValidatePair");
+	idevice_trace_end(IDEVICE_TRACE_LOCKDOWN_VALIDATE_PAIR, client ? client->uuid : NULL, trace_start, ret);
+	return ret;
 }
 
 /** 
@@ -1068,6 +1580,32 @@ lockdownd_error_t lockdownd_goodbye(lockdownd_client_t client)
 	return ret;
 }
 
+/**
+ * Parses the PKCS1 asn.1 definitions for lockdownd_gen_pair_cert().
+ */
+static gpointer lockdownd_load_pkcs1(gpointer data)
+{
+	ASN1_TYPE pkcs1 = ASN1_TYPE_EMPTY;
+
+	if (ASN1_SUCCESS != asn1_array2tree(pkcs1_asn1_tab, &pkcs1, NULL))
+		return ASN1_TYPE_EMPTY;
+	return pkcs1;
+}
+
+/**
+ * Starts loading, or on first use generating, the host keys and
+ * certificates needed to pair devices in the background.
+ *
+ * Generating the keys takes a few seconds. Applications expecting new
+ * devices can call this early so the first lockdownd_pair() does not have
+ * to wait for it. All pairings share the same loaded keys and certificates.
+ * lockdownd_client_new_with_handshake() calls this on its own.
+ */
+void lockdownd_prepare_pairing(void)
+{
+	userpref_prepare_credentials();
+}
+
 /**
  * Generates the device certificate from the public key as well as the host
  * and root certificates.
@@ -1096,9 +1634,10 @@ lockdownd_error_t lockdownd_gen_pair_cert(gnutls_datum_t public_key, gnutls_datu
 	gnutls_datum_t der_pub_key;
 	if (GNUTLS_E_SUCCESS == gnutls_pem_base64_decode_alloc("RSA PUBLIC KEY", &public_key, &der_pub_key)) {
 
-		/* initalize asn.1 parser */
-		ASN1_TYPE pkcs1 = ASN1_TYPE_EMPTY;
-		if (ASN1_SUCCESS == asn1_array2tree(pkcs1_asn1_tab, &pkcs1, NULL)) {
+		/* the asn.1 definitions are parsed once and shared */
+		static GOnce pkcs1_once = G_ONCE_INIT;
+		ASN1_TYPE pkcs1 = (ASN1_TYPE)g_once(&pkcs1_once, lockdownd_load_pkcs1, NULL);
+		if (pkcs1 != ASN1_TYPE_EMPTY) {
 
 			ASN1_TYPE asn1_pub_key = ASN1_TYPE_EMPTY;
 			asn1_create_element(pkcs1, "PKCS1.RSAPublicKey", &asn1_pub_key);
@@ -1120,8 +1659,6 @@ lockdownd_error_t lockdownd_gen_pair_cert(gnutls_datum_t public_key, gnutls_datu
 			if (asn1_pub_key)
 				asn1_delete_structure(&asn1_pub_key);
 		}
-		if (pkcs1)
-			asn1_delete_structure(&pkcs1);
 	}
 
 	/* now generate certificates */
@@ -1130,22 +1667,19 @@ lockdownd_error_t lockdownd_gen_pair_cert(gnutls_datum_t public_key, gnutls_datu
 		gnutls_global_init();
 		gnutls_datum_t essentially_null = { (unsigned char*)strdup("abababababababab"), strlen("abababababababab") };
 
-		gnutls_x509_privkey_t fake_privkey, root_privkey, host_privkey;
-		gnutls_x509_crt_t dev_cert, root_cert, host_cert;
+		gnutls_x509_privkey_t fake_privkey;
+		gnutls_x509_crt_t dev_cert;
+		userpref_credentials_t creds = NULL;
 
 		gnutls_x509_privkey_init(&fake_privkey);
 		gnutls_x509_crt_init(&dev_cert);
-		gnutls_x509_crt_init(&root_cert);
-		gnutls_x509_crt_init(&host_cert);
 
 		if (GNUTLS_E_SUCCESS ==
 			gnutls_x509_privkey_import_rsa_raw(fake_privkey, &modulus, &exponent, &essentially_null, &essentially_null,
 											   &essentially_null, &essentially_null)) {
 
-			gnutls_x509_privkey_init(&root_privkey);
-			gnutls_x509_privkey_init(&host_privkey);
-
-			uret = userpref_get_keys_and_certs(root_privkey, root_cert, host_privkey, host_cert);
+			/* the parsed root and host credentials are shared by all devices */
+			uret = userpref_get_credentials(&creds);
 
 			if (USERPREF_E_SUCCESS == uret) {
 				/* generate device certificate */
@@ -1155,43 +1689,33 @@ lockdownd_error_t lockdownd_gen_pair_cert(gnutls_datum_t public_key, gnutls_datu
 				gnutls_x509_crt_set_ca_status(dev_cert, 0);
 				gnutls_x509_crt_set_activation_time(dev_cert, time(NULL));
 				gnutls_x509_crt_set_expiration_time(dev_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
-				gnutls_x509_crt_sign(dev_cert, root_cert, root_privkey);
-
-				if (LOCKDOWN_E_SUCCESS == ret) {
-					/* if everything went well, export in PEM format */
-					size_t export_size = 0;
-					gnutls_datum_t dev_pem = { NULL, 0 };
-					gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, NULL, &export_size);
-					dev_pem.data = gnutls_malloc(export_size);
-					gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, dev_pem.data, &export_size);
-					dev_pem.size = export_size;
-
-					gnutls_datum_t pem_root_cert = { NULL, 0 };
-					gnutls_datum_t pem_host_cert = { NULL, 0 };
-
-					uret = userpref_get_certs_as_pem(&pem_root_cert, &pem_host_cert);
-
-					if (USERPREF_E_SUCCESS == uret) {
-						/* copy buffer for output */
-						odevice_cert->data = malloc(dev_pem.size);
-						memcpy(odevice_cert->data, dev_pem.data, dev_pem.size);
-						odevice_cert->size = dev_pem.size;
-
-						ohost_cert->data = malloc(pem_host_cert.size);
-						memcpy(ohost_cert->data, pem_host_cert.data, pem_host_cert.size);
-						ohost_cert->size = pem_host_cert.size;
-
-						oroot_cert->data = malloc(pem_root_cert.size);
-						memcpy(oroot_cert->data, pem_root_cert.data, pem_root_cert.size);
-						oroot_cert->size = pem_root_cert.size;
-
-						g_free(pem_root_cert.data);
-						g_free(pem_host_cert.data);
-
-						if (dev_pem.data)
-							gnutls_free(dev_pem.data);
-					}
-				}
+				gnutls_x509_crt_sign(dev_cert, creds->root_cert, creds->root_privkey);
+
+				/* if everything went well, export in PEM format */
+				size_t export_size = 0;
+				gnutls_datum_t dev_pem = { NULL, 0 };
+				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, NULL, &export_size);
+				dev_pem.data = gnutls_malloc(export_size);
+				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, dev_pem.data, &export_size);
+				dev_pem.size = export_size;
+
+				/* copy buffer for output */
+				odevice_cert->data = malloc(dev_pem.size);
+				memcpy(odevice_cert->data, dev_pem.data, dev_pem.size);
+				odevice_cert->size = dev_pem.size;
+
+				ohost_cert->data = malloc(creds->host_cert_pem.size);
+				memcpy(ohost_cert->data, creds->host_cert_pem.data, creds->host_cert_pem.size);
+				ohost_cert->size = creds->host_cert_pem.size;
+
+				oroot_cert->data = malloc(creds->root_cert_pem.size);
+				memcpy(oroot_cert->data, creds->root_cert_pem.data, creds->root_cert_pem.size);
+				oroot_cert->size = creds->root_cert_pem.size;
+
+				if (dev_pem.data)
+					gnutls_free(dev_pem.data);
+
+				userpref_release_credentials(creds);
 			}
 
 			switch(uret) {
@@ -1211,11 +1735,7 @@ lockdownd_error_t lockdownd_gen_pair_cert(gnutls_datum_t public_key, gnutls_datu
 		if (essentially_null.data)
 			free(essentially_null.data);
 		gnutls_x509_crt_deinit(dev_cert);
-		gnutls_x509_crt_deinit(root_cert);
-		gnutls_x509_crt_deinit(host_cert);
 		gnutls_x509_privkey_deinit(fake_privkey);
-		gnutls_x509_privkey_deinit(root_privkey);
-		gnutls_x509_privkey_deinit(host_privkey);
 
 	}
 
@@ -1228,19 +1748,9 @@ lockdownd_error_t lockdownd_gen_pair_cert(gnutls_datum_t public_key, gnutls_datu
 }
 
 /**
- * Opens a session with lockdownd and switches to SSL mode if device wants it.
- *
- * @param client The lockdownd client
- * @param host_id The HostID of the computer
- * @param session_id The new session_id of the created session
- * @param ssl_enabled Whether SSL communication is used in the session
- *
- * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG when a client or
- *  host_id is NULL, LOCKDOWN_E_PLIST_ERROR if the response plist had errors,
- *  LOCKDOWN_E_INVALID_HOST_ID if the device does not know the supplied HostID,
- *  LOCKDOWN_E_SSL_ERROR if enabling SSL communication failed
+ * Internally used function to perform the StartSession request.
  */
-lockdownd_error_t lockdownd_start_session(lockdownd_client_t client, const char *host_id, char **session_id, int *ssl_enabled)
+static lockdownd_error_t lockdownd_do_start_session(lockdownd_client_t client, const char *host_id, char **session_id, int *ssl_enabled)
 {
 	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
 	plist_t dict = NULL;
@@ -1328,18 +1838,30 @@ lockdownd_error_t lockdownd_start_session(lockdownd_client_t client, const char
 }
 
 /**
- * Requests to start a service and retrieve it's port on success.
+ * Opens a session with lockdownd and switches to SSL mode if device wants it.
  *
  * @param client The lockdownd client
- * @param service The name of the service to start
- * @param port The port number the service was started on
- 
- * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG if a parameter
- *  is NULL, LOCKDOWN_E_INVALID_SERVICE if the requested service is not known
- *  by the device, LOCKDOWN_E_START_SERVICE_FAILED if the service could not because
- *  started by the device
+ * @param host_id The HostID of the computer
+ * @param session_id The new session_id of the created session
+ * @param ssl_enabled Whether SSL communication is used in the session
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG when a client or
+ *  host_id is NULL, LOCKDOWN_E_PLIST_ERROR if the response plist had errors,
+ *  LOCKDOWN_E_INVALID_HOST_ID if the device does not know the supplied HostID,
+ *  LOCKDOWN_E_SSL_ERROR if enabling SSL communication failed
  */
-lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char *service, uint16_t *port)
+lockdownd_error_t lockdownd_start_session(lockdownd_client_t client, const char *host_id, char **session_id, int *ssl_enabled)
+{
+	uint64_t trace_start = idevice_trace_begin();
+	lockdownd_error_t ret = lockdownd_do_start_session(client, host_id, session_id, ssl_enabled);
+	idevice_trace_end(IDEVICE_TRACE_LOCKDOWN_START_SESSION, client ? client->uuid : NULL, trace_start, ret);
+	return ret;
+}
+
+/**
+ * Internally used function to perform the StartService request.
+ */
+static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, const char *service, uint16_t *port)
 {
 	if (!client || !service || !port)
 		return LOCKDOWN_E_INVALID_ARG;
@@ -1358,16 +1880,8 @@ lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char
 	free(host_id);
 	host_id = NULL;
 
-	dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	plist_dict_insert_item(dict,"Request", plist_new_string("StartService"));
-	plist_dict_insert_item(dict,"Service", plist_new_string(service));
-
 	/* send to device */
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
+	ret = lockdownd_send_request(client, "Request", "StartService", "Service", service, NULL);
 	if (LOCKDOWN_E_SUCCESS != ret)
 		return ret;
 
@@ -1412,6 +1926,26 @@ lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char
 	return ret;
 }
 
+/**
+ * Requests to start a service and retrieve it's port on success.
+ *
+ * @param client The lockdownd client
+ * @param service The name of the service to start
+ * @param port The port number the service was started on
+ 
+ * @return LOCKDOWN_E_SUCCESS on success, NP_E_INVALID_ARG if a parameter
+ *  is NULL, LOCKDOWN_E_INVALID_SERVICE if the requested service is not known
+ *  by the device, LOCKDOWN_E_START_SERVICE_FAILED if the service could not because
+ *  started by the device
+ */
+lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char *service, uint16_t *port)
+{
+	uint64_t trace_start = idevice_trace_begin();
+	lockdownd_error_t ret = lockdownd_do_start_service(client, service, port);
+	idevice_trace_end(IDEVICE_TRACE_LOCKDOWN_START_SERVICE, client ? client->uuid : NULL, trace_start, ret);
+	return ret;
+}
+
 /**
  * Activates the device. Only works within an open session.
  * The ActivationRecord plist dictionary must be obtained using the
@@ -1622,3 +2156,389 @@ lockdownd_error_t lockdownd_data_classes_free(char **classes)
 	}
 	return LOCKDOWN_E_SUCCESS;
 }
+
+/** Seconds a pooled client may idle before it is pinged to keep it alive */
+#define LOCKDOWN_POOL_KEEPALIVE_INTERVAL 5
+
+/** Default number of seconds an unused pooled client is kept open */
+#define LOCKDOWN_POOL_DEFAULT_IDLE_TIMEOUT 60
+
+/** Default number of idle clients kept per device and label */
+#define LOCKDOWN_POOL_DEFAULT_MAX_IDLE 2
+
+/** An idle client kept by a lockdownd_pool_t */
+struct lockdownd_pool_entry {
+	lockdownd_client_t client;
+	char *key;
+	GTimeVal last_used;
+	GTimeVal last_ping;
+};
+
+struct lockdownd_pool_private {
+	GMutex *mutex;
+	GCond *cond;
+	GThread *keeper;
+	int quit;
+	GHashTable *idle;
+	GHashTable *leased;
+	unsigned int max_idle;
+	unsigned int idle_timeout;
+};
+
+/**
+ * Builds the key pooled clients are grouped by.
+ */
+static char *lockdownd_pool_key(const char *uuid, const char *label)
+{
+	return g_strdup_printf("%s/%s", uuid, label ? label : "");
+}
+
+/**
+ * Frees a pooled entry and the client it holds.
+ */
+static void lockdownd_pool_entry_free(struct lockdownd_pool_entry *entry)
+{
+	if (!entry)
+		return;
+	lockdownd_client_free(entry->client);
+	g_free(entry->key);
+	free(entry);
+}
+
+static void lockdownd_pool_queue_free(gpointer data)
+{
+	GQueue *queue = (GQueue *) data;
+	struct lockdownd_pool_entry *entry;
+
+	while ((entry = (struct lockdownd_pool_entry *) g_queue_pop_head(queue))) {
+		lockdownd_pool_entry_free(entry);
+	}
+	g_queue_free(queue);
+}
+
+/**
+ * Collects the idle entries that have to be pinged or closed.
+ * The caller must hold the pool mutex.
+ */
+static void lockdownd_pool_collect(gpointer key, gpointer value, gpointer user_data)
+{
+	GQueue *queue = (GQueue *) value;
+	GList **due = (GList **) ((gpointer *) user_data)[0];
+	GTimeVal *now = (GTimeVal *) ((gpointer *) user_data)[1];
+	GList *node = queue->head;
+
+	while (node) {
+		GList *next = node->next;
+		struct lockdownd_pool_entry *entry = (struct lockdownd_pool_entry *) node->data;
+		if (now->tv_sec - entry->last_ping.tv_sec >= LOCKDOWN_POOL_KEEPALIVE_INTERVAL) {
+			g_queue_delete_link(queue, node);
+			*due = g_list_prepend(*due, entry);
+		}
+		node = next;
+	}
+}
+
+/**
+ * Thread function that keeps the idle clients of a pool alive, as the
+ * device drops lockdown connections that idle for more than 10 seconds,
+ * and closes clients that have not been used for the idle timeout.
+ */
+static gpointer lockdownd_pool_keeper(gpointer data)
+{
+	lockdownd_pool_t pool = (lockdownd_pool_t) data;
+	GTimeVal now;
+	GTimeVal wakeup;
+
+	g_mutex_lock(pool->mutex);
+	while (!pool->quit) {
+		GList *due = NULL;
+		GList *surplus = NULL;
+		GList *node;
+		gpointer args[2];
+		unsigned int idle_timeout;
+
+		g_get_current_time(&wakeup);
+		g_time_val_add(&wakeup, G_USEC_PER_SEC);
+		g_cond_timed_wait(pool->cond, pool->mutex, &wakeup);
+		if (pool->quit)
+			break;
+
+		g_get_current_time(&now);
+		args[0] = &due;
+		args[1] = &now;
+		g_hash_table_foreach(pool->idle, lockdownd_pool_collect, args);
+		if (!due)
+			continue;
+		idle_timeout = pool->idle_timeout;
+
+		/* don't block lockdownd_pool_acquire() while talking to devices */
+		g_mutex_unlock(pool->mutex);
+		for (node = due; node; node = node->next) {
+			struct lockdownd_pool_entry *entry = (struct lockdownd_pool_entry *) node->data;
+			char *type = NULL;
+			if (now.tv_sec - entry->last_used.tv_sec >= (glong)idle_timeout) {
+				debug_info("closing idle client %s", entry->key);
+				lockdownd_goodbye(entry->client);
+			} else if (lockdownd_query_type(entry->client, &type) == LOCKDOWN_E_SUCCESS) {
+				free(type);
+				entry->last_ping = now;
+				continue;
+			} else {
+				debug_info("dropping dead client %s", entry->key);
+			}
+			lockdownd_pool_entry_free(entry);
+			node->data = NULL;
+		}
+		g_mutex_lock(pool->mutex);
+
+		for (node = due; node; node = node->next) {
+			struct lockdownd_pool_entry *entry = (struct lockdownd_pool_entry *) node->data;
+			GQueue *queue;
+			if (!entry)
+				continue;
+			queue = (GQueue *) g_hash_table_lookup(pool->idle, entry->key);
+			/* clients may have been released or the limit lowered meanwhile */
+			if ((pool->max_idle == 0) || (queue && (queue->length >= pool->max_idle))) {
+				surplus = g_list_prepend(surplus, entry);
+				continue;
+			}
+			if (!queue) {
+				queue = g_queue_new();
+				g_hash_table_insert(pool->idle, g_strdup(entry->key), queue);
+			}
+			g_queue_push_tail(queue, entry);
+		}
+		g_list_free(due);
+
+		if (surplus) {
+			g_mutex_unlock(pool->mutex);
+			for (node = surplus; node; node = node->next) {
+				struct lockdownd_pool_entry *entry = (struct lockdownd_pool_entry *) node->data;
+				debug_info("closing surplus idle client %s", entry->key);
+				lockdownd_goodbye(entry->client);
+				lockdownd_pool_entry_free(entry);
+			}
+			g_list_free(surplus);
+			g_mutex_lock(pool->mutex);
+		}
+	}
+	g_mutex_unlock(pool->mutex);
+
+	return NULL;
+}
+
+/**
+ * Creates a pool of lockdownd clients.
+ *
+ * A pool keeps clients with an established session open after they have
+ * been used, so later requests for the same device and label do not have
+ * to connect, validate the pairing and start an SSL session again.
+ * Idle clients are kept alive in the background and closed after they
+ * have not been used for 60 seconds.
+ *
+ * @param pool Pointer that will be set to the newly allocated pool.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when pool
+ *  is NULL, or LOCKDOWN_E_UNKNOWN_ERROR if the pool could not be set up.
+ */
+lockdownd_error_t lockdownd_pool_new(lockdownd_pool_t *pool)
+{
+	lockdownd_pool_t pool_loc;
+
+	if (!pool)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	pool_loc = (lockdownd_pool_t) malloc(sizeof(struct lockdownd_pool_private));
+	pool_loc->mutex = g_mutex_new();
+	pool_loc->cond = g_cond_new();
+	pool_loc->quit = 0;
+	pool_loc->idle = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, lockdownd_pool_queue_free);
+	pool_loc->leased = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	pool_loc->max_idle = LOCKDOWN_POOL_DEFAULT_MAX_IDLE;
+	pool_loc->idle_timeout = LOCKDOWN_POOL_DEFAULT_IDLE_TIMEOUT;
+	pool_loc->keeper = g_thread_create(lockdownd_pool_keeper, pool_loc, TRUE, NULL);
+	if (!pool_loc->keeper) {
+		g_hash_table_destroy(pool_loc->idle);
+		g_hash_table_destroy(pool_loc->leased);
+		g_cond_free(pool_loc->cond);
+		g_mutex_free(pool_loc->mutex);
+		free(pool_loc);
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+
+	*pool = pool_loc;
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Frees a pool and closes all idle clients. Clients that are still leased
+ * are not affected and have to be freed with lockdownd_client_free().
+ *
+ * @param pool The pool to free.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, or LOCKDOWN_E_INVALID_ARG when
+ *  pool is NULL.
+ */
+lockdownd_error_t lockdownd_pool_free(lockdownd_pool_t pool)
+{
+	if (!pool)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	g_mutex_lock(pool->mutex);
+	pool->quit = 1;
+	g_cond_signal(pool->cond);
+	g_mutex_unlock(pool->mutex);
+	g_thread_join(pool->keeper);
+
+	g_hash_table_destroy(pool->idle);
+	g_hash_table_destroy(pool->leased);
+	g_cond_free(pool->cond);
+	g_mutex_free(pool->mutex);
+	free(pool);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Sets how many idle clients a pool keeps per device and label, and for
+ * how long an unused client is kept open.
+ *
+ * @param pool The pool to configure.
+ * @param max_idle Maximum number of idle clients per device and label.
+ *     Pass 0 to close every client when it is released.
+ * @param idle_timeout Number of seconds after which an unused client is
+ *     closed.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, or LOCKDOWN_E_INVALID_ARG when
+ *  pool is NULL.
+ */
+lockdownd_error_t lockdownd_pool_set_limits(lockdownd_pool_t pool, unsigned int max_idle, unsigned int idle_timeout)
+{
+	if (!pool)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	g_mutex_lock(pool->mutex);
+	pool->max_idle = max_idle;
+	pool->idle_timeout = idle_timeout;
+	g_mutex_unlock(pool->mutex);
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Leases a lockdownd client with a running session for the device.
+ *
+ * An idle client of the pool for the same device and label is reused if
+ * there is one, otherwise a new client is created with
+ * lockdownd_client_new_with_handshake(). The client has to be returned
+ * with lockdownd_pool_release() and must not be freed by the caller.
+ *
+ * @param pool The pool to lease the client from.
+ * @param device The device to get a client for.
+ * @param label The label to use for communication.
+ * @param client Pointer that will be set to the leased client.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when an
+ *  argument is NULL, or an error returned by
+ *  lockdownd_client_new_with_handshake().
+ */
+lockdownd_error_t lockdownd_pool_acquire(lockdownd_pool_t pool, idevice_t device, const char *label, lockdownd_client_t *client)
+{
+	struct lockdownd_pool_entry *entry = NULL;
+	lockdownd_client_t client_loc = NULL;
+	lockdownd_error_t ret;
+	GQueue *queue;
+	char *key;
+
+	if (!pool || !device || !client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	key = lockdownd_pool_key(device->uuid, label);
+
+	g_mutex_lock(pool->mutex);
+	queue = (GQueue *) g_hash_table_lookup(pool->idle, key);
+	if (queue) {
+		/* the most recently used client is the least likely to have timed out */
+		entry = (struct lockdownd_pool_entry *) g_queue_pop_tail(queue);
+	}
+	if (entry) {
+		client_loc = entry->client;
+		g_free(entry->key);
+		free(entry);
+		g_hash_table_insert(pool->leased, client_loc, key);
+		g_mutex_unlock(pool->mutex);
+		debug_info("reusing pooled client %s", key);
+		*client = client_loc;
+		return LOCKDOWN_E_SUCCESS;
+	}
+	g_mutex_unlock(pool->mutex);
+
+	ret = lockdownd_client_new_with_handshake(device, &client_loc, label);
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		g_free(key);
+		return ret;
+	}
+
+	g_mutex_lock(pool->mutex);
+	g_hash_table_insert(pool->leased, client_loc, key);
+	g_mutex_unlock(pool->mutex);
+
+	*client = client_loc;
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Returns a client leased with lockdownd_pool_acquire() to the pool.
+ *
+ * @param pool The pool the client was leased from.
+ * @param client The client to return.
+ * @param reusable Pass 0 if a request on the client failed in a way that
+ *     might have left the connection unusable. The client is closed then.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, or LOCKDOWN_E_INVALID_ARG when an
+ *  argument is NULL or client was not leased from pool.
+ */
+lockdownd_error_t lockdownd_pool_release(lockdownd_pool_t pool, lockdownd_client_t client, int reusable)
+{
+	struct lockdownd_pool_entry *entry;
+	GQueue *queue;
+	char *key;
+
+	if (!pool || !client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	g_mutex_lock(pool->mutex);
+	key = (char *) g_hash_table_lookup(pool->leased, client);
+	if (!key) {
+		g_mutex_unlock(pool->mutex);
+		return LOCKDOWN_E_INVALID_ARG;
+	}
+	key = g_strdup(key);
+	g_hash_table_remove(pool->leased, client);
+
+	queue = (GQueue *) g_hash_table_lookup(pool->idle, key);
+	if (!reusable || !client->session_id || (queue && (queue->length >= pool->max_idle)) || (pool->max_idle == 0)) {
+		g_mutex_unlock(pool->mutex);
+		g_free(key);
+		lockdownd_client_free(client);
+		return LOCKDOWN_E_SUCCESS;
+	}
+
+	entry = (struct lockdownd_pool_entry *) malloc(sizeof(struct lockdownd_pool_entry));
+	entry->client = client;
+	entry->key = key;
+	g_get_current_time(&entry->last_used);
+	entry->last_ping = entry->last_used;
+	if (!queue) {
+		queue = g_queue_new();
+		g_hash_table_insert(pool->idle, g_strdup(key), queue);
+	}
+	g_queue_push_tail(queue, entry);
+	g_mutex_unlock(pool->mutex);
+
+	return LOCKDOWN_E_SUCCESS;
+}
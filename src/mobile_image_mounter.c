@@ -28,6 +28,13 @@
 #include "property_list_service.h"
 #include "debug.h"
 
+/** Directory images are uploaded to, relative to the AFC root */
+#define IMAGE_STAGING_PATH "PublicStaging"
+/** Absolute path of the AFC root on the device */
+#define IMAGE_MEDIA_PREFIX "/private/var/mobile/Media"
+/** Number of AFC write requests kept in flight while uploading an image */
+#define IMAGE_UPLOAD_PIPELINE_DEPTH 8
+
 /**
  * Locks a mobile_image_mounter client, used for thread safety.
  *
@@ -35,7 +42,7 @@
  */
 static void mobile_image_mounter_lock(mobile_image_mounter_client_t client)
 {
-	g_mutex_lock(client->mutex);
+	client->lock_time = idevice_connection_lock_mutex(client->parent ? client->parent->connection : NULL, client->mutex);
 }
 
 /**
@@ -45,7 +52,7 @@ static void mobile_image_mounter_lock(mobile_image_mounter_client_t client)
  */
 static void mobile_image_mounter_unlock(mobile_image_mounter_client_t client)
 {
-	g_mutex_unlock(client->mutex);
+	idevice_connection_unlock_mutex(client->parent ? client->parent->connection : NULL, client->mutex, client->lock_time);
 }
 
 /**
@@ -135,6 +142,27 @@ mobile_image_mounter_error_t mobile_image_mounter_free(mobile_image_mounter_clie
 	return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
 }
 
+/**
+ * Gets the transfer statistics of the connection used by a mobile_image_mounter
+ * client, including the lock statistics of the client when enabled with
+ * idevice_set_lock_profiling().
+ *
+ * @param client The mobile_image_mounter client.
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success or MOBILE_IMAGE_MOUNTER_E_INVALID_ARG when a parameter
+ *     is invalid.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_client_get_metrics(mobile_image_mounter_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->parent || !metrics)
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+
+	if (property_list_service_get_metrics(client->parent, metrics) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+}
+
 /**
  * Tells if the image of ImageType is already mounted.
  *
@@ -159,7 +187,7 @@ mobile_image_mounter_error_t mobile_image_mounter_lookup_image(mobile_image_moun
 	plist_dict_insert_item(dict,"Command", plist_new_string("LookupImage"));
 	plist_dict_insert_item(dict,"ImageType", plist_new_string(image_type));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
@@ -211,7 +239,7 @@ mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mount
 	plist_dict_insert_item(dict, "ImageSignature", plist_new_data(image_signature, signature_length));
 	plist_dict_insert_item(dict, "ImageType", plist_new_string(image_type));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
@@ -250,7 +278,7 @@ mobile_image_mounter_error_t mobile_image_mounter_hangup(mobile_image_mounter_cl
 	plist_t dict = plist_new_dict();
 	plist_dict_insert_item(dict, "Command", plist_new_string("Hangup"));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
@@ -272,3 +300,109 @@ leave_unlock:
 	mobile_image_mounter_unlock(client);
 	return res;
 }
+
+/**
+ * Checks the result of a LookupImage request for a mounted image. Older
+ * firmware reports ImagePresent, newer firmware the signatures of the
+ * mounted images.
+ */
+static int mobile_image_mounter_is_mounted(plist_t lookup, const char *image_signature, uint16_t signature_length)
+{
+	plist_t node = plist_dict_get_item(lookup, "ImagePresent");
+	if (node && (plist_get_node_type(node) == PLIST_BOOLEAN)) {
+		uint8_t present = 0;
+		plist_get_bool_val(node, &present);
+		return present;
+	}
+
+	node = plist_dict_get_item(lookup, "ImageSignature");
+	if (node && (plist_get_node_type(node) == PLIST_ARRAY)) {
+		uint32_t i;
+		for (i = 0; i < plist_array_get_size(node); i++) {
+			char *sig = NULL;
+			uint64_t sig_length = 0;
+			int match;
+			plist_get_data_val(plist_array_get_item(node, i), &sig, &sig_length);
+			match = sig && (sig_length == signature_length) && !memcmp(sig, image_signature, signature_length);
+			free(sig);
+			if (match)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Uploads an image to the device and mounts it. The mount is skipped if
+ * mobile_image_mounter_lookup_image() reports the image as mounted already,
+ * so calling this for every connected device costs a single request for
+ * devices that have it. The image is written to PublicStaging with several
+ * AFC write requests in flight.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param afc A connected AFC client used for the upload.
+ * @param local_path Path of the image on the host.
+ * @param image_signature Pointer to a buffer holding the images' signature
+ * @param signature_length Length of the signature image_signature points to
+ * @param image_type Type of image to mount
+ * @param callback Function called with the upload progress, or NULL.
+ * @param user_data Passed to the callback.
+ * @param result Pointer to a plist that will receive the result of the
+ *    mount operation, or of the lookup if the image was mounted already.
+ *
+ * @note This function may return MOBILE_IMAGE_MOUNTER_E_SUCCESS even if the
+ *    operation has failed. Check the resulting plist for further information.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success,
+ *    MOBILE_IMAGE_MOUNTER_E_INVALID_ARG if on ore more parameters are
+ *    invalid, MOBILE_IMAGE_MOUNTER_E_UPLOAD_FAILED if the image could not
+ *    be uploaded, or another error code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_upload_and_mount_image(mobile_image_mounter_client_t client, afc_client_t afc, const char *local_path, const char *image_signature, uint16_t signature_length, const char *image_type, afc_progress_cb_t callback, void *user_data, plist_t *result)
+{
+	if (!client || !afc || !local_path || !image_signature || (signature_length == 0) || !image_type || !result) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+
+	plist_t lookup = NULL;
+	mobile_image_mounter_error_t res = mobile_image_mounter_lookup_image(client, image_type, &lookup);
+	if ((res == MOBILE_IMAGE_MOUNTER_E_SUCCESS) && lookup && mobile_image_mounter_is_mounted(lookup, image_signature, signature_length)) {
+		debug_info("%s image is mounted already", image_type);
+		*result = lookup;
+		return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+	}
+	if (lookup) {
+		plist_free(lookup);
+	}
+
+	char *name = g_path_get_basename(local_path);
+	char *target = g_build_path("/", IMAGE_STAGING_PATH, name, NULL);
+	char *mount_path = g_build_path("/", IMAGE_MEDIA_PREFIX, target, NULL);
+	g_free(name);
+
+	/* fails if the directory exists, the upload tells if it is missing */
+	afc_make_directory(afc, IMAGE_STAGING_PATH);
+
+	uint32_t depth = 1;
+	afc_client_get_pipeline_depth(afc, &depth);
+	if (depth < IMAGE_UPLOAD_PIPELINE_DEPTH) {
+		afc_client_set_pipeline_depth(afc, IMAGE_UPLOAD_PIPELINE_DEPTH);
+	}
+	afc_error_t afc_err = afc_upload_file(afc, local_path, target, callback, user_data);
+	if (depth < IMAGE_UPLOAD_PIPELINE_DEPTH) {
+		afc_client_set_pipeline_depth(afc, depth);
+	}
+
+	if (afc_err != AFC_E_SUCCESS) {
+		debug_info("could not upload %s to %s, error %d", local_path, target, afc_err);
+		res = MOBILE_IMAGE_MOUNTER_E_UPLOAD_FAILED;
+	} else {
+		res = mobile_image_mounter_mount_image(client, mount_path, image_signature, signature_length, image_type, result);
+	}
+
+	g_free(target);
+	g_free(mount_path);
+
+	return res;
+}
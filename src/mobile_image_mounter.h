@@ -29,6 +29,7 @@
 struct mobile_image_mounter_client_private {
 	property_list_service_client_t parent;
 	GMutex *mutex;
+	uint64_t lock_time;
 };
 
 #endif
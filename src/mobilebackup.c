@@ -138,6 +138,28 @@ mobilebackup_error_t mobilebackup_receive(mobilebackup_client_t client, plist_t
 	return ret;
 }
 
+/**
+ * Polls the device for mobilebackup data like mobilebackup_receive(), but
+ * passes the file contents of a DLSendFile message by reference, so they
+ * can be written out without being copied into and out of the plist. The
+ * data element of the message is left empty then.
+ *
+ * @param client The mobilebackup client
+ * @param plist A pointer to the location where the plist should be stored
+ * @param data Set to point to the file contents, or to NULL if they are
+ *     part of the plist, which is the case for XML messages. The contents
+ *     stay valid until the next message is received with the client.
+ * @param length Set to the length of the file contents.
+ *
+ * @return an error code
+ */
+mobilebackup_error_t mobilebackup_receive_with_data(mobilebackup_client_t client, plist_t *plist, const char **data, uint64_t *length)
+{
+	if (!client)
+		return MOBILEBACKUP_E_INVALID_ARG;
+	return mobilebackup_error(device_link_service_receive_with_data(client->parent, plist, NULL, data, length));
+}
+
 /**
  * Sends mobilebackup data to the device
  * 
@@ -123,6 +123,26 @@ mobilebackup2_error_t mobilebackup2_client_free(mobilebackup2_client_t client)
 	return err;
 }
 
+/**
+ * Gets the transfer statistics of the connection used by a mobilebackup2
+ * client, covering both the DeviceLink messages and the raw file data.
+ *
+ * @param client The mobilebackup2 client.
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS on success, or MOBILEBACKUP2_E_INVALID_ARG
+ *     if a parameter is invalid.
+ */
+mobilebackup2_error_t mobilebackup2_client_get_metrics(mobilebackup2_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->parent || !metrics)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	if (property_list_service_get_metrics(client->parent->parent, metrics) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+	return MOBILEBACKUP2_E_SUCCESS;
+}
+
 /**
  * Sends a backup message plist.
  *
@@ -298,6 +318,40 @@ mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, cons
 	}
 }
 
+/**
+ * Send binary data from multiple buffers to the device in one go, e.g. a
+ * frame header together with its payload.
+ *
+ * @note Like mobilebackup2_send_raw(), this function returns
+ *     MOBILEBACKUP2_E_SUCCESS even if less than the requested length has
+ *     been sent, so the fourth parameter must be checked.
+ *
+ * @param client The MobileBackup client to send to.
+ * @param iov Array of buffers to send
+ * @param iovcnt Number of entries in iov
+ * @param bytes Number of bytes actually sent
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if any data was successfully sent,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending of the data failed.
+ */
+mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const struct iovec *iov, int iovcnt, uint32_t *bytes)
+{
+	if (!client || !client->parent || !iov || (iovcnt <= 0) || !bytes)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	*bytes = 0;
+
+	idevice_connection_t conn = client->parent->parent->connection;
+
+	idevice_connection_sendv(conn, iov, iovcnt, bytes);
+	if (*bytes > 0) {
+		return MOBILEBACKUP2_E_SUCCESS;
+	} else {
+		return MOBILEBACKUP2_E_MUX_ERROR;
+	}
+}
+
 /**
  * Receive binary from the device.
  *
@@ -321,16 +375,15 @@ mobilebackup2_error_t mobilebackup2_receive_raw(mobilebackup2_client_t client, c
 	if (!client || !client->parent || !data || (length == 0) || !bytes)
 		return MOBILEBACKUP2_E_INVALID_ARG;
 
-	idevice_connection_t conn = client->parent->parent->connection;
-
 	*bytes = 0;
 
-	int bytes_loc = 0;
+	uint32_t bytes_loc = 0;
 	uint32_t received = 0;
 	do {
 		bytes_loc = 0;
-		idevice_connection_receive(conn, data+received, length-received, (uint32_t*)&bytes_loc);
-		if (bytes_loc <= 0) break;
+		/* part of the data may already sit in the receive-ahead buffer */
+		property_list_service_receive_raw(client->parent->parent, data+received, length-received, &bytes_loc);
+		if (bytes_loc == 0) break;
 		received += bytes_loc;
 	} while (received < length);
 	if (received > 0) {
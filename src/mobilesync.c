@@ -436,24 +436,11 @@ mobilesync_error_t mobilesync_get_changes_from_device(mobilesync_client_t client
 }
 
 /**
- * Receives changed entitites of the currently set data class from the device
- *
- * @param client The mobilesync client
- * @param entities A pointer to store the changed entity records as a PLIST_DICT
- * @param is_last_record A pointer to store a flag indicating if this submission is the last one
- * @param actions A pointer to additional flags the device is sending or NULL to ignore
- *
- * @retval MOBILESYNC_E_SUCCESS on success
- * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
- * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
- * session
+ * Receives the next batch of changes and checks the message type. On success
+ * the caller owns the message, the entities and actions nodes point into it.
  */
-mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions)
+static mobilesync_error_t mobilesync_receive_changes_internal(mobilesync_client_t client, plist_t *message, plist_t *entities, uint8_t *is_last_record, plist_t *actions)
 {
-	if (!client || !client->data_class) {
-		return MOBILESYNC_E_INVALID_ARG;
-	}
-
 	plist_t msg = NULL;
 	plist_t response_type_node = NULL;
 	plist_t actions_node = NULL;
@@ -487,7 +474,7 @@ mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_
 	}
 
 	if (entities != NULL) {
-		*entities = plist_copy(plist_array_get_item(msg, 2));
+		*entities = plist_array_get_item(msg, 2);
 	}
 
 	if (is_last_record != NULL) {
@@ -497,12 +484,15 @@ mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_
 
 	if (actions != NULL) {
 		actions_node = plist_array_get_item(msg, 4);
-		if (plist_get_node_type(actions) == PLIST_DICT)
-			*actions = plist_copy(actions_node);
+		if (actions_node && (plist_get_node_type(actions_node) == PLIST_DICT))
+			*actions = actions_node;
 		else
 			*actions = NULL;
 	}
 
+	*message = msg;
+	msg = NULL;
+
 	out:
 	if (response_type) {
 		free(response_type);
@@ -515,6 +505,223 @@ mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_
 	return err;
 }
 
+/**
+ * Receives changed entitites of the currently set data class from the device
+ *
+ * @note This function copies the records out of the received message. Use
+ *        mobilesync_receive_changes_message() or
+ *        mobilesync_receive_changes_with_callback() to avoid holding every
+ *        record twice.
+ *
+ * @param client The mobilesync client
+ * @param entities A pointer to store the changed entity records as a PLIST_DICT
+ * @param is_last_record A pointer to store a flag indicating if this submission is the last one
+ * @param actions A pointer to additional flags the device is sending or NULL to ignore
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
+ * session
+ */
+mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions)
+{
+	if (!client || !client->data_class) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	plist_t msg = NULL;
+	plist_t entities_node = NULL;
+	plist_t actions_node = NULL;
+
+	mobilesync_error_t err = mobilesync_receive_changes_internal(client, &msg, &entities_node, is_last_record, &actions_node);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		return err;
+	}
+
+	if (entities != NULL) {
+		*entities = entities_node ? plist_copy(entities_node) : NULL;
+	}
+	if (actions != NULL) {
+		*actions = actions_node ? plist_copy(actions_node) : NULL;
+	}
+
+	plist_free(msg);
+	return err;
+}
+
+/**
+ * Receives changed entitites of the currently set data class from the device
+ * without copying them. The caller takes ownership of the whole received
+ * message; entities and actions point into it and stay valid until the
+ * message is freed with plist_free().
+ *
+ * @param client The mobilesync client
+ * @param message A pointer to store the received message. Must be freed
+ *        by the caller.
+ * @param entities A pointer to store the changed entity records (a node of
+ *        message) or NULL to ignore
+ * @param is_last_record A pointer to store a flag indicating if this submission is the last one
+ * @param actions A pointer to store the device's actions (a node of message,
+ *        or NULL if there are none) or NULL to ignore
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
+ * session
+ */
+mobilesync_error_t mobilesync_receive_changes_message(mobilesync_client_t client, plist_t *message, plist_t *entities, uint8_t *is_last_record, plist_t *actions)
+{
+	if (!client || !client->data_class || !message) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	*message = NULL;
+	return mobilesync_receive_changes_internal(client, message, entities, is_last_record, actions);
+}
+
+/** A batch of changes handed from the receiver thread to the caller. */
+struct mobilesync_batch {
+	plist_t message;
+	plist_t entities;
+	plist_t actions;
+	uint8_t is_last_record;
+	mobilesync_error_t err;
+};
+
+struct mobilesync_pipeline {
+	mobilesync_client_t client;
+	GAsyncQueue *batches;
+	GAsyncQueue *credits;
+	volatile gint stop;
+};
+
+/**
+ * Receives and acknowledges batches until the last one arrived, an error
+ * occurred or the caller asked to stop. Every batch needs a credit from
+ * the caller, which keeps at most one batch ahead of the one being
+ * processed. The stop request is only checked after a receive, so the
+ * batch the device sends in reply to the last acknowledgement is always
+ * read, and it is not acknowledged anymore.
+ */
+static gpointer mobilesync_pipeline_receiver(gpointer data)
+{
+	struct mobilesync_pipeline *pipeline = (struct mobilesync_pipeline*)data;
+	struct mobilesync_batch *batch;
+	int done = 0;
+	int stop;
+
+	while (!done) {
+		g_async_queue_pop(pipeline->credits);
+
+		batch = (struct mobilesync_batch*)malloc(sizeof(struct mobilesync_batch));
+		memset(batch, '\0', sizeof(struct mobilesync_batch));
+		batch->err = mobilesync_receive_changes_internal(pipeline->client, &batch->message, &batch->entities, &batch->is_last_record, &batch->actions);
+		stop = g_atomic_int_get(&pipeline->stop);
+		if ((batch->err == MOBILESYNC_E_SUCCESS) && !stop) {
+			/* let the device prepare the next batch while this one is processed */
+			batch->err = mobilesync_acknowledge_changes_from_device(pipeline->client);
+		}
+		done = (batch->err != MOBILESYNC_E_SUCCESS) || batch->is_last_record || stop;
+		g_async_queue_push(pipeline->batches, batch);
+	}
+
+	return NULL;
+}
+
+static void mobilesync_batch_free(struct mobilesync_batch *batch)
+{
+	if (batch->message)
+		plist_free(batch->message);
+	free(batch);
+}
+
+/**
+ * Receives all changed entities of the currently set data class and passes
+ * them to a callback one batch at a time. Every batch is acknowledged as
+ * soon as it arrived, so the device sends the next one while the callback
+ * processes the current one. At most two batches are held in memory and
+ * the records are never copied.
+ *
+ * @note This replaces the loop of mobilesync_receive_changes() and
+ *        mobilesync_acknowledge_changes_from_device() calls and must be
+ *        called after mobilesync_get_changes_from_device() or
+ *        mobilesync_get_all_records_from_device().
+ *
+ * @param client The mobilesync client
+ * @param callback Function called for every batch. The entities and actions
+ *        passed are freed when it returns; use plist_copy() to keep them.
+ *        Returning a non-zero value stops the transfer.
+ * @param user_data Passed to the callback.
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_CANCELLED if the device cancelled the session or the
+ * callback stopped the transfer. After the latter the session should be
+ * cancelled with mobilesync_cancel().
+ */
+mobilesync_error_t mobilesync_receive_changes_with_callback(mobilesync_client_t client, mobilesync_changes_cb_t callback, void *user_data)
+{
+	struct mobilesync_pipeline pipeline;
+	struct mobilesync_batch *batch;
+	mobilesync_error_t err = MOBILESYNC_E_SUCCESS;
+	GThread *receiver;
+	int done = 0;
+
+	if (!client || !client->data_class || !callback) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	pipeline.client = client;
+	pipeline.batches = g_async_queue_new();
+	pipeline.credits = g_async_queue_new();
+	pipeline.stop = 0;
+
+	/* the device only sends the next batch after the acknowledgement,
+	   so one credit is enough to keep it busy */
+	g_async_queue_push(pipeline.credits, GINT_TO_POINTER(1));
+
+	receiver = g_thread_create(mobilesync_pipeline_receiver, &pipeline, TRUE, NULL);
+	if (!receiver) {
+		g_async_queue_unref(pipeline.batches);
+		g_async_queue_unref(pipeline.credits);
+		return MOBILESYNC_E_UNKNOWN_ERROR;
+	}
+
+	while (!done) {
+		batch = (struct mobilesync_batch*)g_async_queue_pop(pipeline.batches);
+		done = (batch->err != MOBILESYNC_E_SUCCESS) || batch->is_last_record;
+		if (!done) {
+			g_async_queue_push(pipeline.credits, GINT_TO_POINTER(1));
+		}
+
+		if (batch->err != MOBILESYNC_E_SUCCESS) {
+			err = batch->err;
+		} else if (callback(batch->entities, batch->actions, batch->is_last_record, user_data) != 0) {
+			debug_info("callback stopped the transfer");
+			err = MOBILESYNC_E_CANCELLED;
+			if (!done) {
+				/* the batch in flight is still received and discarded below;
+				   the extra credit lets the receiver get to it even if it
+				   already used the last one for a batch acknowledged before
+				   it saw the stop request */
+				g_atomic_int_set(&pipeline.stop, 1);
+				g_async_queue_push(pipeline.credits, GINT_TO_POINTER(1));
+				done = 1;
+			}
+		}
+		mobilesync_batch_free(batch);
+	}
+
+	g_thread_join(receiver);
+	while ((batch = (struct mobilesync_batch*)g_async_queue_try_pop(pipeline.batches)) != NULL) {
+		mobilesync_batch_free(batch);
+	}
+	g_async_queue_unref(pipeline.batches);
+	g_async_queue_unref(pipeline.credits);
+
+	return err;
+}
+
 /**
  * Requests the device to delete all records of the current data class
  *
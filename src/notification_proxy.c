@@ -22,6 +22,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <plist/plist.h>
 
 #include "notification_proxy.h"
@@ -32,8 +34,15 @@ struct np_thread {
 	np_client_t client;
 	np_notify_cb_t cbfunc;
 	void *user_data;
+	GThread *reader;
+	GThread *dispatcher;
+	GAsyncQueue *queue;
+	int wakeup[2];
+	volatile int quit;
 };
 
+static void np_notifier_stop(struct np_thread *npt);
+
 /**
  * Locks a notification_proxy client, used for thread safety.
  *
@@ -42,7 +51,7 @@ struct np_thread {
 static void np_lock(np_client_t client)
 {
 	debug_info("NP: Locked");
-	g_mutex_lock(client->mutex);
+	client->lock_time = idevice_connection_lock_mutex(client->parent ? client->parent->connection : NULL, client->mutex);
 }
 
 /**
@@ -53,7 +62,7 @@ static void np_lock(np_client_t client)
 static void np_unlock(np_client_t client)
 {
 	debug_info("NP: Unlocked");
-	g_mutex_unlock(client->mutex);
+	idevice_connection_unlock_mutex(client->parent ? client->parent->connection : NULL, client->mutex, client->lock_time);
 }
 
 /**
@@ -107,6 +116,8 @@ np_error_t np_client_new(idevice_t device, uint16_t port, np_client_t *client)
 	if (property_list_service_client_new(device, port, &plistclient) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		return NP_E_CONN_FAILED;
 	}
+	/* notification_proxy accepts binary plists */
+	property_list_service_set_format(plistclient, PROPERTY_LIST_SERVICE_FORMAT_BINARY);
 
 	np_client_t client_loc = (np_client_t) malloc(sizeof(struct np_client_private));
 	client_loc->parent = plistclient;
@@ -132,12 +143,12 @@ np_error_t np_client_free(np_client_t client)
 	if (!client)
 		return NP_E_INVALID_ARG;
 
-	property_list_service_client_free(client->parent);
-	client->parent = NULL;
 	if (client->notifier) {
-		debug_info("joining np callback");
-		g_thread_join(client->notifier);
+		np_notifier_stop(client->notifier);
+		client->notifier = NULL;
 	}
+	property_list_service_client_free(client->parent);
+	client->parent = NULL;
 	if (client->mutex) {
 		g_mutex_free(client->mutex);
 	}
@@ -147,40 +158,100 @@ np_error_t np_client_free(np_client_t client)
 }
 
 /**
- * Sends a notification to the device's notification_proxy.
+ * Gets the transfer statistics of the connection used by a notification_proxy
+ * client, including the lock statistics of the client when enabled with
+ * idevice_set_lock_profiling().
  *
- * @param client The client to send to
- * @param notification The notification message to send
+ * @param client The notification_proxy client.
+ * @param metrics Structure that will be filled with the statistics.
  *
- * @return NP_E_SUCCESS on success, or an error returned by np_plist_send
+ * @return NP_E_SUCCESS on success or NP_E_INVALID_ARG when a parameter
+ *     is invalid.
  */
-np_error_t np_post_notification(np_client_t client, const char *notification)
+np_error_t np_client_get_metrics(np_client_t client, idevice_connection_metrics_t *metrics)
 {
-	if (!client || !notification) {
+	if (!client || !client->parent || !metrics)
 		return NP_E_INVALID_ARG;
-	}
-	np_lock(client);
 
-	plist_t dict = plist_new_dict();
-	plist_dict_insert_item(dict,"Command", plist_new_string("PostNotification"));
-	plist_dict_insert_item(dict,"Name", plist_new_string(notification));
+	if (property_list_service_get_metrics(client->parent, metrics) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+		return NP_E_INVALID_ARG;
+	return NP_E_SUCCESS;
+}
 
-	np_error_t res = np_error(property_list_service_send_xml_plist(client->parent, dict));
-	plist_free(dict);
+/**
+ * Internally used function to send a command for each of the given
+ * notifications, followed by extra_command if not NULL, in a single write.
+ * The client must be locked.
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when nothing is to be
+ *    sent, or an error returned by property_list_service_send_plists.
+ */
+static np_error_t np_send_commands(np_client_t client, const char *command, const char **notifications, const char *extra_command)
+{
+	np_error_t res;
+	plist_t *dicts;
+	uint32_t count = 0;
+	uint32_t i;
 
-	dict = plist_new_dict();
-	plist_dict_insert_item(dict,"Command", plist_new_string("Shutdown"));
+	while (notifications[count]) {
+		count++;
+	}
+	if (count == 0) {
+		return NP_E_INVALID_ARG;
+	}
 
-	res = np_error(property_list_service_send_xml_plist(client->parent, dict));
-	plist_free(dict);
+	dicts = (plist_t*)malloc(sizeof(plist_t) * (count + 1));
+	for (i = 0; i < count; i++) {
+		dicts[i] = plist_new_dict();
+		plist_dict_insert_item(dicts[i], "Command", plist_new_string(command));
+		plist_dict_insert_item(dicts[i], "Name", plist_new_string(notifications[i]));
+	}
+	if (extra_command) {
+		dicts[count] = plist_new_dict();
+		plist_dict_insert_item(dicts[count], "Command", plist_new_string(extra_command));
+		count++;
+	}
 
+	res = np_error(property_list_service_send_plists(client->parent, dicts, count));
 	if (res != NP_E_SUCCESS) {
-		debug_info("Error sending XML plist to device!");
+		debug_info("Error sending %s commands to device!", command);
+	}
+
+	for (i = 0; i < count; i++) {
+		plist_free(dicts[i]);
+	}
+	free(dicts);
+
+	return res;
+}
+
+/**
+ * Sends notifications to the device's notification_proxy.
+ *
+ * All notifications and the final Shutdown command go out in one write.
+ *
+ * @param client The client to send to
+ * @param notification_spec The notifications to send. This is expected to
+ *  be an array of const char* that MUST have a terminating NULL entry.
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when client or
+ *    notification_spec are NULL or the list is empty, or an error returned
+ *    by np_plist_send.
+ */
+np_error_t np_post_notifications(np_client_t client, const char **notification_spec)
+{
+	if (!client || !notification_spec) {
+		return NP_E_INVALID_ARG;
 	}
+	np_lock(client);
+
+	np_error_t res = np_send_commands(client, "PostNotification", notification_spec, "Shutdown");
 
-	// try to read an answer, we just ignore errors here
-	dict = NULL;
-	property_list_service_receive_plist(client->parent, &dict);
+	// try to read an answer, we just ignore errors here;
+	// a running notifier will consume it instead
+	plist_t dict = NULL;
+	if ((res == NP_E_SUCCESS) && !client->notifier)
+		property_list_service_receive_plist(client->parent, &dict);
 	if (dict) {
 #ifndef STRIP_DEBUG_CODE
 		char *cmd_value = NULL;
@@ -203,6 +274,24 @@ np_error_t np_post_notification(np_client_t client, const char *notification)
 	return res;
 }
 
+/**
+ * Sends a notification to the device's notification_proxy.
+ *
+ * @param client The client to send to
+ * @param notification The notification message to send
+ *
+ * @return NP_E_SUCCESS on success, or an error returned by np_plist_send
+ */
+np_error_t np_post_notification(np_client_t client, const char *notification)
+{
+	const char *notifications[2] = { notification, NULL };
+
+	if (!client || !notification) {
+		return NP_E_INVALID_ARG;
+	}
+	return np_post_notifications(client, notifications);
+}
+
 /**
  * Tells the device to send a notification on the specified event.
  *
@@ -214,163 +303,240 @@ np_error_t np_post_notification(np_client_t client, const char *notification)
  */
 np_error_t np_observe_notification( np_client_t client, const char *notification )
 {
+	const char *notifications[2] = { notification, NULL };
+
 	if (!client || !notification) {
 		return NP_E_INVALID_ARG;
 	}
-	np_lock(client);
-
-	plist_t dict = plist_new_dict();
-	plist_dict_insert_item(dict,"Command", plist_new_string("ObserveNotification"));
-	plist_dict_insert_item(dict,"Name", plist_new_string(notification));
-
-	np_error_t res = np_error(property_list_service_send_xml_plist(client->parent, dict));
-	if (res != NP_E_SUCCESS) {
-		debug_info("Error sending XML plist to device!");
-	}
-	plist_free(dict);
-
-	np_unlock(client);
-	return res;
+	return np_observe_notifications(client, notifications);
 }
 
 /**
  * Tells the device to send a notification on specified events.
  *
+ * All ObserveNotification commands go out in one write.
+ *
  * @param client The client to send to
  * @param notification_spec Specification of the notifications that should be
  *  observed. This is expected to be an array of const char* that MUST have a
  *  terminating NULL entry.
  *
  * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when client is null,
- *   or an error returned by np_observe_notification.
+ *   or an error returned by np_plist_send.
  */
 np_error_t np_observe_notifications(np_client_t client, const char **notification_spec)
 {
-	int i = 0;
-	np_error_t res = NP_E_UNKNOWN_ERROR;
-	const char **notifications = notification_spec;
+	np_error_t res;
 
-	if (!client) {
+	if (!client || !notification_spec) {
 		return NP_E_INVALID_ARG;
 	}
 
-	if (!notifications) {
-		return NP_E_INVALID_ARG;
-	}
-
-	while (notifications[i]) {
-		res = np_observe_notification(client, notifications[i]);
-		if (res != NP_E_SUCCESS) {
-			break;
-		}
-		i++;
-	}
+	np_lock(client);
+	res = np_send_commands(client, "ObserveNotification", notification_spec, NULL);
+	np_unlock(client);
 
 	return res;
 }
 
 /**
- * Checks if a notification has been sent by the device.
+ * Extracts the notification name from a message sent by the device.
  *
- * @param client NP to get a notification from
- * @param notification Pointer to a buffer that will be allocated and filled
- *  with the notification that has been received.
+ * @param dict The message received from the notification_proxy
+ * @param notification Pointer that will be set to a newly allocated
+ *  string with the name of the notification if dict is a
+ *  RelayNotification message.
  *
- * @return 0 if a notification has been received or nothing has been received,
- *         or a negative value if an error occured.
- *
- * @note You probably want to check out np_set_notify_callback
- * @see np_set_notify_callback
+ * @return 0 if a notification has been extracted or the message can be
+ *         ignored, -1 if the notification_proxy has shut down, or -2 if
+ *         the message is invalid.
  */
-static int np_get_notification(np_client_t client, char **notification)
+static int np_parse_notification(plist_t dict, char **notification)
 {
-	int res = 0;
-	plist_t dict = NULL;
+	int res = -2;
+	char *cmd_value = NULL;
+	plist_t cmd_value_node = plist_dict_get_item(dict, "Command");
 
-	if (!client || !client->parent || *notification)
-		return -1;
+	if (plist_get_node_type(cmd_value_node) == PLIST_STRING) {
+		plist_get_string_val(cmd_value_node, &cmd_value);
+	}
 
-	np_lock(client);
+	if (cmd_value && !strcmp(cmd_value, "RelayNotification")) {
+		char *name_value = NULL;
+		plist_t name_value_node = plist_dict_get_item(dict, "Name");
 
-	property_list_service_receive_plist_with_timeout(client->parent, &dict, 500);
-	if (!dict) {
-		debug_info("NotificationProxy: no notification received!");
-		res = 0;
-	} else {
-		char *cmd_value = NULL;
-		plist_t cmd_value_node = plist_dict_get_item(dict, "Command");
+		if (plist_get_node_type(name_value_node) == PLIST_STRING) {
+			plist_get_string_val(name_value_node, &name_value);
+		}
 
-		if (plist_get_node_type(cmd_value_node) == PLIST_STRING) {
-			plist_get_string_val(cmd_value_node, &cmd_value);
+		if (name_value_node && name_value) {
+			*notification = name_value;
+			debug_info("got notification %s", name_value);
+			res = 0;
 		}
+	} else if (cmd_value && !strcmp(cmd_value, "ProxyDeath")) {
+		debug_info("NotificationProxy died!");
+		res = -1;
+	} else if (cmd_value) {
+		debug_info("unknown NotificationProxy command '%s' received!", cmd_value);
+		res = 0;
+	}
+	if (cmd_value) {
+		free(cmd_value);
+	}
 
-		if (cmd_value && !strcmp(cmd_value, "RelayNotification")) {
-			char *name_value = NULL;
-			plist_t name_value_node = plist_dict_get_item(dict, "Name");
+	return res;
+}
 
-			if (plist_get_node_type(name_value_node) == PLIST_STRING) {
-				plist_get_string_val(name_value_node, &name_value);
-			}
+/** Marks the end of the notification queue */
+static char np_queue_end;
 
-			res = -2;
-			if (name_value_node && name_value) {
-				*notification = name_value;
-				debug_info("got notification %s\n", __func__, name_value);
-				res = 0;
+/**
+ * Internally used thread function reading from the notification_proxy.
+ *
+ * It blocks until the device sends something and queues the names of
+ * received notifications for np_dispatcher(), so delivery is neither
+ * delayed by polling nor held up by a slow callback. The client lock is
+ * not taken, so np_observe_notification() and np_post_notification() can
+ * run concurrently.
+ */
+gpointer np_notifier( gpointer arg )
+{
+	struct np_thread *npt = (struct np_thread*)arg;
+	idevice_connection_t connection = npt->client->parent->connection;
+	int fd = -1;
+
+	debug_info("starting notifier.");
+	idevice_connection_get_fd(connection, &fd);
+	while (!npt->quit) {
+		plist_t dict = NULL;
+		char *notification = NULL;
+		int res;
+
+		if (!idevice_connection_has_pending_data(connection)) {
+			struct pollfd fds[2];
+			fds[0].fd = fd;
+			fds[0].events = POLLIN;
+			fds[0].revents = 0;
+			fds[1].fd = npt->wakeup[0];
+			fds[1].events = POLLIN;
+			fds[1].revents = 0;
+			if (poll(fds, 2, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				debug_info("ERROR: poll failed: %s", strerror(errno));
+				break;
+			}
+			if (fds[1].revents) {
+				break;
 			}
-		} else if (cmd_value && !strcmp(cmd_value, "ProxyDeath")) {
-			debug_info("ERROR: NotificationProxy died!");
-			res = -1;
-		} else if (cmd_value) {
-			debug_info("unknown NotificationProxy command '%s' received!", cmd_value);
-			res = -1;
-		} else {
-			res = -2;
 		}
-		if (cmd_value) {
-			free(cmd_value);
+
+		property_list_service_receive_plist(npt->client->parent, &dict);
+		if (!dict) {
+			debug_info("ERROR: could not receive from NotificationProxy");
+			break;
 		}
+		res = np_parse_notification(dict, &notification);
 		plist_free(dict);
-		dict = NULL;
+		if (notification) {
+			g_async_queue_push(npt->queue, notification);
+		}
+		if (res == -1) {
+			break;
+		}
 	}
+	g_async_queue_push(npt->queue, &np_queue_end);
 
-	np_unlock(client);
-
-	return res;
+	return NULL;
 }
 
 /**
- * Internally used thread function.
+ * Internally used thread function passing queued notifications to the
+ * callback function.
  */
-gpointer np_notifier( gpointer arg )
+static gpointer np_dispatcher( gpointer arg )
 {
-	char *notification = NULL;
 	struct np_thread *npt = (struct np_thread*)arg;
+	char *notification;
 
-	if (!npt) return NULL;
+	while ((notification = (char*)g_async_queue_pop(npt->queue)) != &np_queue_end) {
+		npt->cbfunc(notification, npt->user_data);
+		free(notification);
+	}
 
-	debug_info("starting callback.");
-	while (npt->client->parent) {
-		np_get_notification(npt->client, &notification);
-		if (notification) {
-			npt->cbfunc(notification, npt->user_data);
-			free(notification);
-			notification = NULL;
-		}
-		sleep(1);
+	return NULL;
+}
+
+/**
+ * Stops the notifier threads of a client and frees their data.
+ * Must not be called with the client locked, as the callback may use
+ * the client.
+ */
+static void np_notifier_stop(struct np_thread *npt)
+{
+	char c = 0;
+
+	npt->quit = 1;
+	if (write(npt->wakeup[1], &c, 1) < 0) {
+		debug_info("ERROR: could not wake up notifier");
 	}
-	if (npt) {
+	debug_info("joining np callback");
+	g_thread_join(npt->reader);
+	g_thread_join(npt->dispatcher);
+	close(npt->wakeup[0]);
+	close(npt->wakeup[1]);
+	g_async_queue_unref(npt->queue);
+	free(npt);
+}
+
+/**
+ * Starts the threads delivering notifications to a callback function.
+ *
+ * @return The notifier data or NULL on error.
+ */
+static struct np_thread *np_notifier_start(np_client_t client, np_notify_cb_t notify_cb, void *user_data)
+{
+	struct np_thread *npt = (struct np_thread*)malloc(sizeof(struct np_thread));
+	if (!npt)
+		return NULL;
+
+	npt->client = client;
+	npt->cbfunc = notify_cb;
+	npt->user_data = user_data;
+	npt->quit = 0;
+	npt->reader = NULL;
+	npt->dispatcher = NULL;
+	if (pipe(npt->wakeup) < 0) {
 		free(npt);
+		return NULL;
 	}
+	npt->queue = g_async_queue_new();
 
-	return NULL;
+	npt->dispatcher = g_thread_create(np_dispatcher, npt, TRUE, NULL);
+	if (npt->dispatcher) {
+		npt->reader = g_thread_create(np_notifier, npt, TRUE, NULL);
+	}
+	if (!npt->reader) {
+		if (npt->dispatcher) {
+			g_async_queue_push(npt->queue, &np_queue_end);
+			g_thread_join(npt->dispatcher);
+		}
+		close(npt->wakeup[0]);
+		close(npt->wakeup[1]);
+		g_async_queue_unref(npt->queue);
+		free(npt);
+		return NULL;
+	}
+
+	return npt;
 }
 
 /**
  * This function allows an application to define a callback function that will
  * be called when a notification has been received.
- * It will start a thread that polls for notifications and calls the callback
- * function if a notification has been received.
+ * It will start a thread that waits for notifications and calls the callback
+ * function as soon as a notification has been received.
  *
  * @param client the NP client
  * @param notify_cb pointer to a callback function or NULL to de-register a
@@ -380,6 +546,8 @@ gpointer np_notifier( gpointer arg )
  *
  * @note Only one callback function can be registered at the same time;
  *       any previously set callback function will be removed automatically.
+ * @note The callback is invoked from its own thread and may use the client,
+ *       but must not change or remove the callback function itself.
  *
  * @return NP_E_SUCCESS when the callback was successfully registered,
  *         NP_E_INVALID_ARG when client is NULL, or NP_E_UNKNOWN_ERROR when
@@ -391,33 +559,63 @@ np_error_t np_set_notify_callback( np_client_t client, np_notify_cb_t notify_cb,
 		return NP_E_INVALID_ARG;
 
 	np_error_t res = NP_E_UNKNOWN_ERROR;
+	struct np_thread *npt;
 
 	np_lock(client);
-	if (client->notifier) {
-		debug_info("callback already set, removing\n");
-		property_list_service_client_t parent = client->parent;
-		client->parent = NULL;
-		g_thread_join(client->notifier);
-		client->notifier = NULL;
-		client->parent = parent;
+	npt = client->notifier;
+	client->notifier = NULL;
+	np_unlock(client);
+
+	if (npt) {
+		debug_info("callback already set, removing");
+		np_notifier_stop(npt);
 	}
 
 	if (notify_cb) {
-		struct np_thread *npt = (struct np_thread*)malloc(sizeof(struct np_thread));
+		npt = np_notifier_start(client, notify_cb, user_data);
 		if (npt) {
-			npt->client = client;
-			npt->cbfunc = notify_cb;
-			npt->user_data = user_data;
-
-			client->notifier = g_thread_create(np_notifier, npt, TRUE, NULL);
-			if (client->notifier) {
-				res = NP_E_SUCCESS;
-			}
+			np_lock(client);
+			client->notifier = npt;
+			np_unlock(client);
+			res = NP_E_SUCCESS;
 		}
 	} else {
 		debug_info("no callback set");
 	}
-	np_unlock(client);
 
 	return res;
 }
+
+/**
+ * Tells the device to send a notification on specified events and delivers
+ * them to a callback function, like np_observe_notifications() followed by
+ * np_set_notify_callback().
+ *
+ * The notifier thread starts right after all ObserveNotification commands
+ * went out in one write, so it does not compete with them for the client.
+ *
+ * @param client The client to send to
+ * @param notification_spec Specification of the notifications that should be
+ *  observed. This is expected to be an array of const char* that MUST have a
+ *  terminating NULL entry.
+ * @param notify_cb Pointer to the callback function.
+ * @param user_data Pointer that will be passed to the callback function as
+ *        user data.
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when a parameter is
+ *   NULL, an error returned by np_plist_send, or NP_E_UNKNOWN_ERROR when
+ *   the callback thread could no be created.
+ */
+np_error_t np_observe_notifications_with_callback(np_client_t client, const char **notification_spec, np_notify_cb_t notify_cb, void *user_data)
+{
+	np_error_t res;
+
+	if (!client || !notification_spec || !notify_cb)
+		return NP_E_INVALID_ARG;
+
+	res = np_observe_notifications(client, notification_spec);
+	if (res != NP_E_SUCCESS)
+		return res;
+
+	return np_set_notify_callback(client, notify_cb, user_data);
+}
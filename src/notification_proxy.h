@@ -29,7 +29,8 @@
 struct np_client_private {
 	property_list_service_client_t parent;
 	GMutex *mutex;
-	GThread *notifier;
+	uint64_t lock_time;
+	struct np_thread *notifier;
 };
 
 gpointer np_notifier(gpointer arg);
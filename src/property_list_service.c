@@ -20,10 +20,13 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
 #include <glib.h>
 
 #include "property_list_service.h"
 #include "idevice.h"
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_PLIST
 #include "debug.h"
 
 /**
@@ -77,6 +80,20 @@ property_list_service_error_t property_list_service_client_new(idevice_t device,
 	/* create client object */
 	property_list_service_client_t client_loc = (property_list_service_client_t)malloc(sizeof(struct property_list_service_client_private));
 	client_loc->connection = connection;
+	client_loc->send_buffer = NULL;
+	client_loc->send_buffer_size = 0;
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_buffer_size = 0;
+	client_loc->format = PROPERTY_LIST_SERVICE_FORMAT_AUTO;
+	client_loc->peer_binary = 0;
+	client_loc->max_message_size = PLIST_DEFAULT_MAX_MESSAGE_SIZE;
+	client_loc->ahead_buffer = NULL;
+	client_loc->ahead_size = 0;
+	client_loc->ahead_pos = 0;
+	client_loc->ahead_length = 0;
+	client_loc->recv_buffer_held = 0;
+	client_loc->spool_map = NULL;
+	client_loc->spool_map_size = 0;
 
 	*client = client_loc;
 
@@ -98,17 +115,106 @@ property_list_service_error_t property_list_service_client_free(property_list_se
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 
 	property_list_service_error_t err = idevice_to_property_list_service_error(idevice_disconnect(client->connection));
+	if (client->spool_map) {
+		munmap(client->spool_map, client->spool_map_size);
+	}
+	free(client->send_buffer);
+	free(client->recv_buffer);
+	free(client->ahead_buffer);
 	free(client);
 	return err;
 }
 
+/** Largest framing buffer kept between sends */
+#define PLIST_SEND_BUFFER_KEEP_SIZE 65536
+
+/** Largest number of plists passed to a single vectored write */
+#define PLIST_SEND_BATCH_SIZE 64
+
 /**
- * Sends a plist using the given property list service client.
+ * Sends already serialized plists, each prefixed with its length.
+ *
+ * The length prefixes and the plists go out together: as one buffer under
+ * SSL, so they form as few TLS records as possible, and otherwise as one
+ * vectored write without copying the plists.
+ *
+ * @param client The property list service client to use for sending.
+ * @param content The serialized plists
+ * @param length The lengths of the serialized plists
+ * @param count Number of plists, at most PLIST_SEND_BATCH_SIZE
+ * @param binary 1 if the plists are binary, 0 if they are xml
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *      PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when not all data was sent.
+ */
+static property_list_service_error_t internal_send_serialized(property_list_service_client_t client, char **content, uint32_t *length, uint32_t count, int binary)
+{
+	uint32_t nlen[PLIST_SEND_BATCH_SIZE];
+	struct iovec iov[2 * PLIST_SEND_BATCH_SIZE];
+	uint32_t total = 0;
+	uint32_t bytes = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		nlen[i] = GUINT32_TO_BE(length[i]);
+		total += sizeof(uint32_t) + length[i];
+	}
+
+	debug_info("sending %d plists, %d bytes", count, total);
+	if (client->connection->ssl_data) {
+		if (client->send_buffer_size < total) {
+			free(client->send_buffer);
+			client->send_buffer = (char*)malloc(total);
+			client->send_buffer_size = client->send_buffer ? total : 0;
+		}
+		if (client->send_buffer) {
+			char *p = client->send_buffer;
+			for (i = 0; i < count; i++) {
+				memcpy(p, &nlen[i], sizeof(uint32_t));
+				memcpy(p + sizeof(uint32_t), content[i], length[i]);
+				p += sizeof(uint32_t) + length[i];
+			}
+			idevice_connection_send(client->connection, client->send_buffer, total, &bytes);
+		}
+		if (client->send_buffer_size > PLIST_SEND_BUFFER_KEEP_SIZE) {
+			/* don't keep the memory of an unusually large message */
+			free(client->send_buffer);
+			client->send_buffer = NULL;
+			client->send_buffer_size = 0;
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			iov[2 * i].iov_base = &nlen[i];
+			iov[2 * i].iov_len = sizeof(uint32_t);
+			iov[2 * i + 1].iov_base = content[i];
+			iov[2 * i + 1].iov_len = length[i];
+		}
+		idevice_connection_sendv(client->connection, iov, 2 * count, &bytes);
+	}
+
+	if (bytes == total) {
+		debug_info("sent %d bytes", bytes);
+		for (i = 0; i < count; i++) {
+			idevice_connection_count_plist(client->connection, binary, 1, length[i]);
+		}
+		return PROPERTY_LIST_SERVICE_E_SUCCESS;
+	}
+	if (bytes == 0) {
+		debug_info("ERROR: sending to device failed.");
+	} else {
+		debug_info("ERROR: Could not send all data (%d of %d)!", bytes, total);
+	}
+	return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+}
+
+/**
+ * Sends plists using the given property list service client.
  * Internally used generic plist send function.
  *
  * @param client The property list service client to use for sending.
- * @param plist plist to send
- * @param binary 1 = send binary plist, 0 = send xml plist
+ * @param plists plists to send
+ * @param count Number of plists
+ * @param binary 1 = send binary plists, 0 = send xml plists
  *
  * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
  *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when one or more parameters are
@@ -116,52 +222,65 @@ property_list_service_error_t property_list_service_client_free(property_list_se
  *      plist, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified
  *      error occurs.
  */
-static property_list_service_error_t internal_plist_send(property_list_service_client_t client, plist_t plist, int binary)
+static property_list_service_error_t internal_plists_send(property_list_service_client_t client, plist_t *plists, uint32_t count, int binary)
 {
-	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
-	char *content = NULL;
-	uint32_t length = 0;
-	uint32_t nlen = 0;
-	int bytes = 0;
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	char *content[PLIST_SEND_BATCH_SIZE];
+	uint32_t length[PLIST_SEND_BATCH_SIZE];
+	uint32_t first, batch, i;
 
-	if (!client || (client && !client->connection) || !plist) {
+	if (!client || (client && !client->connection) || !plists || (count == 0)) {
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 	}
 
-	if (binary) {
-		plist_to_bin(plist, &content, &length);
-	} else {
-		plist_to_xml(plist, &content, &length);
-	}
-
-	if (!content || length == 0) {
-		return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
-	}
-
-	nlen = GUINT32_TO_BE(length);
-	debug_info("sending %d bytes", length);
-	idevice_connection_send(client->connection, (const char*)&nlen, sizeof(nlen), (uint32_t*)&bytes);
-	if (bytes == sizeof(nlen)) {
-		idevice_connection_send(client->connection, content, length, (uint32_t*)&bytes);
-		if (bytes > 0) {
-			debug_info("sent %d bytes", bytes);
-			debug_plist(plist);
-			if ((uint32_t)bytes == length) {
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	for (first = 0; (first < count) && (res == PROPERTY_LIST_SERVICE_E_SUCCESS); first += batch) {
+		batch = ((count - first) < PLIST_SEND_BATCH_SIZE) ? (count - first) : PLIST_SEND_BATCH_SIZE;
+		for (i = 0; i < batch; i++) {
+			content[i] = NULL;
+			length[i] = 0;
+			if (!plists[first + i]) {
+				res = PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+			} else if (binary) {
+				plist_to_bin(plists[first + i], &content[i], &length[i]);
 			} else {
-				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
+				plist_to_xml(plists[first + i], &content[i], &length[i]);
+			}
+			if ((res == PROPERTY_LIST_SERVICE_E_SUCCESS) && (!content[i] || length[i] == 0)) {
+				res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
 			}
 		}
-	}
-	if (bytes <= 0) {
-		debug_info("ERROR: sending to device failed.");
-	}
+		if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			batch = i;
+			goto free_batch;
+		}
 
-	free(content);
+		res = internal_send_serialized(client, content, length, batch, binary);
+		if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			for (i = 0; i < batch; i++) {
+				debug_plist(plists[first + i]);
+			}
+		}
+
+free_batch:
+		for (i = 0; i < batch; i++) {
+			free(content[i]);
+		}
+	}
 
 	return res;
 }
 
+/**
+ * Sends a plist using the given property list service client.
+ * Internally used generic plist send function.
+ *
+ * @see internal_plists_send
+ */
+static property_list_service_error_t internal_plist_send(property_list_service_client_t client, plist_t plist, int binary)
+{
+	return internal_plists_send(client, &plist, 1, binary);
+}
+
 /**
  * Sends an XML plist.
  *
@@ -194,14 +313,716 @@ property_list_service_error_t property_list_service_send_binary_plist(property_l
 	return internal_plist_send(client, plist, 1);
 }
 
+/**
+ * Sends several binary plists in as few writes as possible. The device
+ * receives them as consecutive messages, exactly as if they had been sent
+ * one by one with property_list_service_send_binary_plist().
+ *
+ * @param client The property list service client to use for sending.
+ * @param plists Array of plists to send
+ * @param count Number of plists in the array
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client, plists or one of the
+ *      plists is NULL or count is 0,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when a plist is not valid,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified error occurs.
+ */
+property_list_service_error_t property_list_service_send_binary_plists(property_list_service_client_t client, plist_t *plists, uint32_t count)
+{
+	return internal_plists_send(client, plists, count, 1);
+}
+
+/**
+ * Tells whether plists have to be sent in binary format to comply with the
+ * format selected for the client with property_list_service_set_format().
+ */
+static int internal_send_binary(property_list_service_client_t client)
+{
+	switch (client->format) {
+	case PROPERTY_LIST_SERVICE_FORMAT_BINARY:
+		return 1;
+	case PROPERTY_LIST_SERVICE_FORMAT_AUTO:
+		return client->peer_binary;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Sends a plist encoded in the format selected for the client with
+ * property_list_service_set_format().
+ *
+ * @param client The property list service client to use for sending.
+ * @param plist plist to send
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or plist is NULL,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when dict is not a valid plist,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified error occurs.
+ */
+property_list_service_error_t property_list_service_send_plist(property_list_service_client_t client, plist_t plist)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	return internal_plist_send(client, plist, internal_send_binary(client));
+}
+
+/**
+ * Sends several plists in as few writes as possible, encoded in the format
+ * selected for the client with property_list_service_set_format().
+ *
+ * @see property_list_service_send_binary_plists
+ */
+property_list_service_error_t property_list_service_send_plists(property_list_service_client_t client, plist_t *plists, uint32_t count)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	return internal_plists_send(client, plists, count, internal_send_binary(client));
+}
+
+/**
+ * Sends a plist that was serialized by the caller, e.g. filled in from a
+ * prebuilt template. This saves building a plist tree only to serialize it
+ * again for the small requests that are sent most often. If the client has
+ * to send the other format, the content is converted through libplist.
+ *
+ * @param client The property list service client to use for sending.
+ * @param content The serialized plist
+ * @param length Length of the serialized plist
+ * @param binary 1 if content is a binary plist, 0 if it is xml
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or content is NULL,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when content has to be converted
+ *      but is not a valid plist, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *      when an unspecified error occurs.
+ */
+property_list_service_error_t property_list_service_send_serialized_plist(property_list_service_client_t client, const char *content, uint32_t length, int binary)
+{
+	property_list_service_error_t res;
+	char *data = (char*)content;
+	plist_t plist = NULL;
+
+	if (!client || !client->connection || !content || (length == 0))
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	if ((internal_send_binary(client) ? 1 : 0) != (binary ? 1 : 0)) {
+		if (binary)
+			plist_from_bin(content, length, &plist);
+		else
+			plist_from_xml(content, length, &plist);
+		if (!plist)
+			return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+		res = internal_plist_send(client, plist, !binary);
+		plist_free(plist);
+		return res;
+	}
+
+	res = internal_send_serialized(client, &data, &length, 1, binary);
+	if ((res == PROPERTY_LIST_SERVICE_E_SUCCESS) && !binary) {
+		debug_info("sent template:\n%.*s", (int)length, content);
+	}
+	return res;
+}
+
+/** Largest receive buffer kept between messages */
+#define PLIST_RECV_BUFFER_KEEP_SIZE (256 * 1024)
+
+/** Messages from this size on are spooled to a temporary file */
+#define PLIST_LARGE_MESSAGE_SIZE (1 << 24)
+
+/** Chunk size used when spooling a large message */
+#define PLIST_LARGE_CHUNK_SIZE 65536
+
+/**
+ * Reads a big endian integer of size bytes from a binary plist.
+ *
+ * @return 1 on success, 0 if it lies outside of the plist.
+ */
+static int internal_bplist_read_uint(const char *content, uint32_t length, uint64_t offset, uint8_t size, uint64_t *value)
+{
+	uint8_t i;
+
+	if ((size == 0) || (size > 8) || (offset >= length) || (length - offset < size))
+		return 0;
+	*value = 0;
+	for (i = 0; i < size; i++) {
+		*value = (*value << 8) | (uint8_t)content[offset + i];
+	}
+	return 1;
+}
+
+/**
+ * Reads the element count of a binary plist object, which follows the
+ * marker as an integer object when it doesn't fit into the marker.
+ *
+ * @return 1 on success with start set to the first byte after the count,
+ *     0 if the object is malformed.
+ */
+static int internal_bplist_read_count(const char *content, uint32_t length, uint64_t offset, uint64_t *count, uint64_t *start)
+{
+	uint8_t marker = (uint8_t)content[offset];
+
+	if ((marker & 0x0F) != 0x0F) {
+		*count = marker & 0x0F;
+		*start = offset + 1;
+		return 1;
+	}
+	if ((offset + 1 >= length) || (((uint8_t)content[offset + 1] & 0xF0) != 0x10))
+		return 0;
+	uint8_t size = 1 << ((uint8_t)content[offset + 1] & 0x0F);
+	if (!internal_bplist_read_uint(content, length, offset + 2, size, count))
+		return 0;
+	*start = offset + 2 + size;
+	return 1;
+}
+
+/** Layout of a binary plist as given by its trailer */
+struct bplist_layout {
+	uint8_t offset_size;
+	uint8_t ref_size;
+	uint64_t num_objects;
+	uint64_t table;
+};
+
+/**
+ * Resolves the index-th object reference stored at refs to the offset of
+ * the object.
+ *
+ * @return 1 on success, 0 if the reference is malformed.
+ */
+static int internal_bplist_object(const char *content, uint32_t length, const struct bplist_layout *layout, uint64_t refs, uint64_t index, uint64_t *obj)
+{
+	uint64_t ref = 0;
+
+	if (!internal_bplist_read_uint(content, length, refs + index * layout->ref_size, layout->ref_size, &ref) || (ref >= layout->num_objects))
+		return 0;
+	if (!internal_bplist_read_uint(content, length, layout->table + ref * layout->offset_size, layout->offset_size, obj) || (*obj >= length))
+		return 0;
+	return 1;
+}
+
+/**
+ * Takes the payload of the data object at obj. The object's marker is
+ * changed to that of empty data, so the parser leaves the payload alone and
+ * it does not get copied into the plist.
+ *
+ * @return 1 if obj is a data object, 0 otherwise.
+ */
+static int internal_bplist_take_object(char *content, uint32_t length, uint64_t obj, const char **data, uint64_t *data_length)
+{
+	uint64_t size = 0;
+	uint64_t start = 0;
+
+	if (((uint8_t)content[obj] & 0xF0) != 0x40)
+		return 0;
+	if (!internal_bplist_read_count(content, length, obj, &size, &start) || (start > length) || (length - start < size))
+		return 0;
+	*data = content + start;
+	*data_length = size;
+	content[obj] = 0x40;
+	return 1;
+}
+
+/**
+ * Takes the data object stored under key in the dictionary at obj.
+ *
+ * @return 1 if the dictionary has a data object under key, 0 otherwise.
+ */
+static int internal_bplist_take_dict_data(char *content, uint32_t length, const struct bplist_layout *layout, uint64_t obj, const char *key, const char **data, uint64_t *data_length)
+{
+	size_t key_length = strlen(key);
+	uint64_t count = 0;
+	uint64_t refs = 0;
+	uint64_t i;
+
+	if (((uint8_t)content[obj] & 0xF0) != 0xD0)
+		return 0;
+	if (!internal_bplist_read_count(content, length, obj, &count, &refs))
+		return 0;
+
+	/* the key references are followed by the value references */
+	for (i = 0; i < count; i++) {
+		uint64_t kobj = 0;
+		uint64_t vobj = 0;
+		uint64_t size = 0;
+		uint64_t start = 0;
+
+		if (!internal_bplist_object(content, length, layout, refs, i, &kobj))
+			return 0;
+		if (((uint8_t)content[kobj] & 0xF0) != 0x50)
+			continue;
+		if (!internal_bplist_read_count(content, length, kobj, &size, &start) || (start > length) || (length - start < size))
+			return 0;
+		if ((size != key_length) || memcmp(content + start, key, key_length))
+			continue;
+		if (!internal_bplist_object(content, length, layout, refs, count + i, &vobj))
+			return 0;
+		return internal_bplist_take_object(content, length, vobj, data, data_length);
+	}
+	return 0;
+}
+
+/**
+ * Takes a data object out of a binary plist. Without key this is the first
+ * data object of the top level array, as found in DLSendFile messages.
+ * With key it is the data object stored under key in the top level
+ * dictionary, or in a dictionary of the top level array, as found in
+ * replies carrying images.
+ *
+ * @return 1 if a data object was found, 0 otherwise.
+ */
+static int internal_bplist_take_data(char *content, uint32_t length, const char *key, const char **data, uint64_t *data_length)
+{
+	struct bplist_layout layout;
+	const char *trailer;
+	uint64_t top = 0;
+	uint64_t offset = 0;
+	uint64_t count = 0;
+	uint64_t refs = 0;
+	uint64_t i;
+
+	if ((length < 40) || memcmp(content, "bplist00", 8))
+		return 0;
+	trailer = content + length - 32;
+	layout.offset_size = (uint8_t)trailer[6];
+	layout.ref_size = (uint8_t)trailer[7];
+	if (!internal_bplist_read_uint(trailer, 32, 8, 8, &layout.num_objects) || !internal_bplist_read_uint(trailer, 32, 16, 8, &top) || !internal_bplist_read_uint(trailer, 32, 24, 8, &layout.table))
+		return 0;
+	if ((layout.num_objects > length) || (layout.table >= length) || (top >= layout.num_objects) || !internal_bplist_read_uint(content, length, layout.table + top * layout.offset_size, layout.offset_size, &offset) || (offset >= length))
+		return 0;
+
+	if (key && internal_bplist_take_dict_data(content, length, &layout, offset, key, data, data_length))
+		return 1;
+
+	/* otherwise the top object must be an array */
+	if (((uint8_t)content[offset] & 0xF0) != 0xA0)
+		return 0;
+	if (!internal_bplist_read_count(content, length, offset, &count, &refs))
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		uint64_t obj = 0;
+
+		if (!internal_bplist_object(content, length, &layout, refs, i, &obj))
+			return 0;
+		if (key) {
+			if (internal_bplist_take_dict_data(content, length, &layout, obj, key, data, data_length))
+				return 1;
+		} else if (internal_bplist_take_object(content, length, obj, data, data_length)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** Largest xml message tried with internal_xml_parse_flat() */
+#define PLIST_XML_FLAT_MAX_SIZE 4096
+
+/**
+ * Skips whitespace and the xml declaration, doctype and comments.
+ */
+static const char *internal_xml_skip(const char *p, const char *end)
+{
+	while (p < end) {
+		if ((*p == ' ') || (*p == '\t') || (*p == '\n') || (*p == '\r')) {
+			p++;
+		} else if ((end - p >= 2) && ((p[1] == '?') || (p[1] == '!')) && (*p == '<')) {
+			const char *close = memchr(p, '>', end - p);
+			if (!close)
+				return end;
+			p = close + 1;
+		} else {
+			break;
+		}
+	}
+	return p;
+}
+
+/**
+ * Consumes the given tag if p points to it after optional whitespace.
+ *
+ * @return The position after the tag or NULL if it is not there.
+ */
+static const char *internal_xml_expect(const char *p, const char *end, const char *tag)
+{
+	size_t len = strlen(tag);
+
+	p = internal_xml_skip(p, end);
+	if (((size_t)(end - p) < len) || memcmp(p, tag, len))
+		return NULL;
+	return p + len;
+}
+
+/**
+ * Reads character data up to the given closing tag and resolves the
+ * predefined entities.
+ *
+ * @return A newly allocated string or NULL if the text holds markup or
+ *  entities that are not handled here.
+ */
+static char *internal_xml_text(const char **pos, const char *end, const char *close)
+{
+	const char *p = *pos;
+	const char *lt = memchr(p, '<', end - p);
+	size_t close_len = strlen(close);
+	char *text, *out;
+
+	if (!lt || ((size_t)(end - lt) < close_len) || memcmp(lt, close, close_len))
+		return NULL;
+
+	text = out = (char*)malloc(lt - p + 1);
+	while (p < lt) {
+		if (*p != '&') {
+			*out++ = *p++;
+			continue;
+		}
+		if ((lt - p >= 5) && !memcmp(p, "&amp;", 5)) {
+			*out++ = '&'; p += 5;
+		} else if ((lt - p >= 4) && !memcmp(p, "&lt;", 4)) {
+			*out++ = '<'; p += 4;
+		} else if ((lt - p >= 4) && !memcmp(p, "&gt;", 4)) {
+			*out++ = '>'; p += 4;
+		} else if ((lt - p >= 6) && !memcmp(p, "&quot;", 6)) {
+			*out++ = '"'; p += 6;
+		} else if ((lt - p >= 6) && !memcmp(p, "&apos;", 6)) {
+			*out++ = '\''; p += 6;
+		} else {
+			free(text);
+			return NULL;
+		}
+	}
+	*out = '\0';
+	*pos = lt + close_len;
+	return text;
+}
+
+/**
+ * Parses an xml plist that consists of a single dictionary holding only
+ * strings, unsigned integers and booleans, which is what lockdownd answers
+ * to most requests. Such replies are converted without going through
+ * libxml, anything else is left to plist_from_xml().
+ *
+ * @return The plist or NULL if the message has a different structure.
+ */
+static plist_t internal_xml_parse_flat(const char *content, uint32_t length)
+{
+	const char *p = content;
+	const char *end = content + length;
+	plist_t dict;
+
+	/* a trailing NUL terminator is not part of the document */
+	while ((end > p) && (end[-1] == '\0'))
+		end--;
+
+	p = internal_xml_skip(p, end);
+	if (!(p = internal_xml_expect(p, end, "<plist")))
+		return NULL;
+	if (!(p = memchr(p, '>', end - p)))
+		return NULL;
+	p++;
+	if (!(p = internal_xml_expect(p, end, "<dict>")))
+		return NULL;
+
+	dict = plist_new_dict();
+	while (1) {
+		const char *next;
+		plist_t node = NULL;
+		char *key;
+		char *text;
+
+		if ((next = internal_xml_expect(p, end, "</dict>"))) {
+			p = next;
+			break;
+		}
+		if (!(p = internal_xml_expect(p, end, "<key>")))
+			goto fail;
+		if (!(key = internal_xml_text(&p, end, "</key>")))
+			goto fail;
+
+		if ((next = internal_xml_expect(p, end, "<string>"))) {
+			p = next;
+			if ((text = internal_xml_text(&p, end, "</string>"))) {
+				node = plist_new_string(text);
+				free(text);
+			}
+		} else if ((next = internal_xml_expect(p, end, "<string/>"))) {
+			p = next;
+			node = plist_new_string("");
+		} else if ((next = internal_xml_expect(p, end, "<integer>"))) {
+			p = next;
+			if ((text = internal_xml_text(&p, end, "</integer>"))) {
+				char *num_end = NULL;
+				if (text[0] && (text[0] != '-')) {
+					uint64_t val = g_ascii_strtoull(text, &num_end, 10);
+					if (num_end && (*num_end == '\0'))
+						node = plist_new_uint(val);
+				}
+				free(text);
+			}
+		} else if ((next = internal_xml_expect(p, end, "<true/>"))) {
+			p = next;
+			node = plist_new_bool(1);
+		} else if ((next = internal_xml_expect(p, end, "<false/>"))) {
+			p = next;
+			node = plist_new_bool(0);
+		}
+		if (!node) {
+			free(key);
+			goto fail;
+		}
+		plist_dict_insert_item(dict, key, node);
+		free(key);
+	}
+
+	if (!(p = internal_xml_expect(p, end, "</plist>")))
+		goto fail;
+	if (internal_xml_skip(p, end) != end)
+		goto fail;
+	return dict;
+
+fail:
+	plist_free(dict);
+	return NULL;
+}
+
+/**
+ * Parses a received plist payload, handling binary and XML encodings.
+ * The data may be modified in place for XML payloads.
+ *
+ * @param client The property list service client the data came from
+ * @param content The payload
+ * @param length Length of the payload
+ * @param plist pointer to a plist_t that will point to the parsed plist
+ * @param data_key If not NULL, the data object taken is the one stored
+ *      under this key as described for internal_bplist_take_data().
+ * @param data If not NULL, the first data object of a binary plist holding
+ *      an array is not parsed; this is set to point to the payload in
+ *      content instead, or to NULL when there is no such object.
+ * @param data_length Set to the length of the payload.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the data can't be parsed.
+ */
+static property_list_service_error_t internal_plist_parse(property_list_service_client_t client, char *content, uint32_t length, plist_t *plist, const char *data_key, const char **data, uint64_t *data_length)
+{
+	if (data) {
+		*data = NULL;
+		*data_length = 0;
+	}
+	if ((length >= 8) && !memcmp(content, "bplist00", 8)) {
+		if (data && internal_bplist_take_data(content, length, data_key, data, data_length)) {
+			debug_info("took %llu bytes of data from the message", (unsigned long long)*data_length);
+		}
+		idevice_connection_count_plist(client->connection, 1, 0, length);
+		plist_from_bin(content, length, plist);
+		if (*plist && !client->peer_binary) {
+			debug_info("peer sends binary plists");
+			client->peer_binary = 1;
+		}
+	} else {
+		/* iOS 4.3 hack: plist data might contain invalid null characters, thus we convert those to spaces */
+		char *nul = (length > 1) ? memchr(content, '\0', length-1) : NULL;
+		while (nul) {
+			*nul = ' ';
+			nul = memchr(nul+1, '\0', (content + length-1) - (nul+1));
+		}
+		idevice_connection_count_plist(client->connection, 0, 0, length);
+		*plist = NULL;
+		if (length <= PLIST_XML_FLAT_MAX_SIZE)
+			*plist = internal_xml_parse_flat(content, length);
+		if (!*plist)
+			plist_from_xml(content, length, plist);
+	}
+	if (!*plist) {
+		if (data)
+			*data = NULL;
+		return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+	}
+	debug_plist(*plist);
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives up to length bytes. Data left in the receive-ahead buffer is
+ * returned first; reads smaller than the buffer fill it with whatever the
+ * connection has available, so a run of small messages costs one read.
+ *
+ * @param timeout Maximum time in milliseconds to wait for data, or -1 to
+ *      wait like idevice_connection_receive() does.
+ */
+static idevice_error_t internal_receive(property_list_service_client_t client, char *data, uint32_t length, uint32_t *bytes, int timeout)
+{
+	idevice_error_t err;
+	uint32_t got = 0;
+
+	if (client->ahead_length > 0) {
+		got = (length < client->ahead_length) ? length : client->ahead_length;
+		memcpy(data, client->ahead_buffer + client->ahead_pos, got);
+		client->ahead_pos += got;
+		client->ahead_length -= got;
+		*bytes = got;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	if (!client->ahead_buffer || (length >= client->ahead_size)) {
+		if (timeout < 0)
+			return idevice_connection_receive(client->connection, data, length, bytes);
+		return idevice_connection_receive_timeout(client->connection, data, length, bytes, (unsigned int)timeout);
+	}
+
+	if (timeout < 0)
+		err = idevice_connection_receive(client->connection, client->ahead_buffer, client->ahead_size, &got);
+	else
+		err = idevice_connection_receive_timeout(client->connection, client->ahead_buffer, client->ahead_size, &got, (unsigned int)timeout);
+	if (got == 0) {
+		*bytes = 0;
+		return err;
+	}
+
+	*bytes = (length < got) ? length : got;
+	memcpy(data, client->ahead_buffer, *bytes);
+	client->ahead_pos = *bytes;
+	client->ahead_length = got - *bytes;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Reads exactly length bytes from the client's connection.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS when all data was read or
+ *      PROPERTY_LIST_SERVICE_E_MUX_ERROR otherwise.
+ */
+static property_list_service_error_t internal_receive_exact(property_list_service_client_t client, char *data, uint32_t length)
+{
+	uint32_t curlen = 0;
+	uint32_t bytes = 0;
+
+	while (curlen < length) {
+		internal_receive(client, data+curlen, length-curlen, &bytes, -1);
+		if (bytes <= 0) {
+			return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+		}
+		debug_info("received %d bytes", bytes);
+		curlen += bytes;
+	}
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Reads and drops a message payload, so the stream stays in sync when a
+ * message is refused.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *      PROPERTY_LIST_SERVICE_E_MUX_ERROR when the payload could not be
+ *      read; the connection is unusable then.
+ */
+static property_list_service_error_t internal_receive_discard(property_list_service_client_t client, uint32_t length)
+{
+	char scratch[4096];
+
+	while (length > 0) {
+		uint32_t part = (length > sizeof(scratch)) ? sizeof(scratch) : length;
+		if (internal_receive_exact(client, scratch, part) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+			return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+		length -= part;
+	}
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives a message of at least PLIST_LARGE_MESSAGE_SIZE bytes by writing
+ * it in chunks to an unlinked temporary file and parsing it from a private
+ * mapping of that file, so the payload never has to be held in one
+ * malloc()ed buffer.
+ */
+static property_list_service_error_t internal_plist_receive_large(property_list_service_client_t client, uint32_t pktlen, plist_t *plist, const char *data_key, const char **data, uint64_t *data_length)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	FILE *spool = NULL;
+	char *chunk = NULL;
+	char *content = NULL;
+	uint32_t curlen = 0;
+
+	spool = tmpfile();
+	chunk = (char*)malloc(PLIST_LARGE_CHUNK_SIZE);
+	if (!spool || !chunk) {
+		debug_info("ERROR: could not create spool for %d bytes", pktlen);
+		res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	}
+
+	/* always consume the whole frame to stay in sync with the stream */
+	while (curlen < pktlen) {
+		uint32_t part = pktlen - curlen;
+		if (part > PLIST_LARGE_CHUNK_SIZE)
+			part = PLIST_LARGE_CHUNK_SIZE;
+		if (!chunk) {
+			char scratch[1024];
+			part = (part > sizeof(scratch)) ? sizeof(scratch) : part;
+			if (internal_receive_exact(client, scratch, part) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+				break;
+			}
+		} else {
+			if (internal_receive_exact(client, chunk, part) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+				break;
+			}
+			if ((res == PROPERTY_LIST_SERVICE_E_SUCCESS) && (fwrite(chunk, 1, part, spool) != part)) {
+				debug_info("ERROR: could not write to spool file");
+				res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+			}
+		}
+		curlen += part;
+	}
+	free(chunk);
+
+	if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		fflush(spool);
+		content = mmap(NULL, pktlen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(spool), 0);
+		if (content == MAP_FAILED) {
+			debug_info("ERROR: could not map spool file");
+			res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		} else {
+			res = internal_plist_parse(client, content, pktlen, plist, data_key, data, data_length);
+			if (data && *data) {
+				/* the data is handed out, keep it mapped until the next message */
+				client->spool_map = content;
+				client->spool_map_size = pktlen;
+			} else {
+				munmap(content, pktlen);
+			}
+		}
+	}
+	if (spool) {
+		fclose(spool);
+	}
+	return res;
+}
+
 /**
  * Receives a plist using the given property list service client.
  * Internally used generic plist receive function.
  *
+ * The payload is read into a per-client buffer that is reused for the
+ * following messages as long as it does not exceed
+ * PLIST_RECV_BUFFER_KEEP_SIZE. Messages of PLIST_LARGE_MESSAGE_SIZE bytes
+ * or more are spooled through a temporary file instead, up to the limit
+ * set with property_list_service_set_max_message_size().
+ *
  * @param client The property list service client to use for receiving
  * @param plist pointer to a plist_t that will point to the received plist
  *      upon successful return
  * @param timeout Maximum time in milliseconds to wait for data.
+ * @param data_key Key of the data object to pass by reference, or NULL.
+ * @param data If not NULL, receives a pointer to the payload of the first
+ *      data object as described for internal_plist_parse(). It stays valid
+ *      until the next message is received.
+ * @param data_length Set to the length of the payload.
  *
  * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
  *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
@@ -210,7 +1031,7 @@ property_list_service_error_t property_list_service_send_binary_plist(property_l
  *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
  *      when an unspecified error occurs.
  */
-static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout, const char *data_key, const char **data, uint64_t *data_length)
 {
 	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 	uint32_t pktlen = 0;
@@ -220,48 +1041,67 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 	}
 
-	idevice_connection_receive_timeout(client->connection, (char*)&pktlen, sizeof(pktlen), &bytes, timeout);
+	/* data handed out with the previous message is no longer needed */
+	if (client->spool_map) {
+		munmap(client->spool_map, client->spool_map_size);
+		client->spool_map = NULL;
+		client->spool_map_size = 0;
+	}
+	if (client->recv_buffer_held) {
+		client->recv_buffer_held = 0;
+		if (client->recv_buffer_size > PLIST_RECV_BUFFER_KEEP_SIZE) {
+			free(client->recv_buffer);
+			client->recv_buffer = NULL;
+			client->recv_buffer_size = 0;
+		}
+	}
+
+	internal_receive(client, (char*)&pktlen, sizeof(pktlen), &bytes, (int)timeout);
+	if ((bytes > 0) && (bytes < sizeof(pktlen))) {
+		/* the length prefix was split across reads */
+		uint32_t rest = 0;
+		internal_receive(client, (char*)&pktlen + bytes, sizeof(pktlen) - bytes, &rest, (int)timeout);
+		bytes += rest;
+	}
 	debug_info("initial read=%i", bytes);
 	if (bytes < 4) {
 		debug_info("initial read failed!");
 		return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
 	} else {
 		pktlen = GUINT32_FROM_BE(pktlen);
-		if (pktlen < (1 << 24)) { /* prevent huge buffers */
-			uint32_t curlen = 0;
-			char *content = NULL;
-			debug_info("%d bytes following", pktlen);
-			content = (char*)malloc(pktlen);
-
-			while (curlen < pktlen) {
-				idevice_connection_receive(client->connection, content+curlen, pktlen-curlen, &bytes);
-				if (bytes <= 0) {
-					res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
-					break;
-				}
-				debug_info("received %d bytes", bytes);
-				curlen += bytes;
+		debug_info("%d bytes following", pktlen);
+		if (pktlen > client->max_message_size) {
+			/* prevent huge buffers */
+			debug_info("ERROR: message of %d bytes exceeds the limit of %d bytes", pktlen, client->max_message_size);
+			res = internal_receive_discard(client, pktlen);
+			if (res == PROPERTY_LIST_SERVICE_E_SUCCESS)
+				res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		} else if (pktlen >= PLIST_LARGE_MESSAGE_SIZE) {
+			res = internal_plist_receive_large(client, pktlen, plist, data_key, data, data_length);
+		} else {
+			if (client->recv_buffer_size < pktlen) {
+				free(client->recv_buffer);
+				client->recv_buffer = (char*)malloc(pktlen);
+				client->recv_buffer_size = client->recv_buffer ? pktlen : 0;
 			}
-			if (!memcmp(content, "bplist00", 8)) {
-				plist_from_bin(content, pktlen, plist);
-			} else {
-				/* iOS 4.3 hack: plist data might contain invalid null characters, thus we convert those to spaces */
-				for (bytes = 0; bytes < pktlen-1; bytes++) {
-					if (content[bytes] == 0x0)
-						content[bytes] = 0x20;
-				}
-				plist_from_xml(content, pktlen, plist);
+			if (!client->recv_buffer) {
+				if (internal_receive_discard(client, pktlen) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+					return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+				return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 			}
-			if (*plist) {
-				debug_plist(*plist);
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-			} else {
-				res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+			res = internal_receive_exact(client, client->recv_buffer, pktlen);
+			if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				res = internal_plist_parse(client, client->recv_buffer, pktlen, plist, data_key, data, data_length);
+			}
+			if (data && *data) {
+				/* the data is handed out, release the buffer with the next message */
+				client->recv_buffer_held = 1;
+			} else if (client->recv_buffer_size > PLIST_RECV_BUFFER_KEEP_SIZE) {
+				/* release the memory of an unusually large message */
+				free(client->recv_buffer);
+				client->recv_buffer = NULL;
+				client->recv_buffer_size = 0;
 			}
-			free(content);
-			content = NULL;
-		} else {
-			res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 		}
 	}
 	return res;
@@ -286,7 +1126,7 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
  */
 property_list_service_error_t property_list_service_receive_plist_with_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
 {
-	return internal_plist_receive_timeout(client, plist, timeout);
+	return internal_plist_receive_timeout(client, plist, timeout, NULL, NULL, NULL);
 }
 
 /**
@@ -310,7 +1150,39 @@ property_list_service_error_t property_list_service_receive_plist_with_timeout(p
  */
 property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist)
 {
-	return internal_plist_receive_timeout(client, plist, 10000);
+	return internal_plist_receive_timeout(client, plist, 10000, NULL, NULL, NULL);
+}
+
+/**
+ * Receives a plist like property_list_service_receive_plist(), but passes
+ * the payload of the first data object in the top level array of a binary
+ * plist by reference instead of copying it into the plist, where it is
+ * left empty. This is meant for messages carrying file contents inline,
+ * which can then be written out straight from the receive buffer. With a
+ * key, the data object stored under it in the top level dictionary, or in
+ * a dictionary of the top level array, is passed instead, as used for
+ * replies carrying images.
+ *
+ * @param client The property list service client to use for receiving
+ * @param plist pointer to a plist_t that will point to the received plist
+ *      upon successful return
+ * @param key Key of the data object, or NULL for the first data object of
+ *      the top level array.
+ * @param data Set to point to the payload, or to NULL when the message has
+ *      no such data object or is an XML plist; the data is part of the
+ *      plist then. The payload stays valid until the next message is
+ *      received with the client or the client is freed.
+ * @param length Set to the length of the payload.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when a parameter is NULL,
+ *      or an error code as for property_list_service_receive_plist().
+ */
+property_list_service_error_t property_list_service_receive_plist_with_data(property_list_service_client_t client, plist_t *plist, const char *key, const char **data, uint64_t *length)
+{
+	if (!data || !length)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	return internal_plist_receive_timeout(client, plist, 10000, key, data, length);
 }
 
 /**
@@ -348,3 +1220,114 @@ property_list_service_error_t property_list_service_disable_ssl(property_list_se
 	return idevice_to_property_list_service_error(idevice_connection_disable_ssl(client->connection));
 }
 
+/**
+ * Selects the encoding used by property_list_service_send_plist().
+ *
+ * With PROPERTY_LIST_SERVICE_FORMAT_AUTO (the default) plists are sent as
+ * XML until the service has sent a binary plist itself; from then on
+ * binary plists are sent, since the service evidently understands them.
+ *
+ * @param client The property list service client
+ * @param format The format to use for sending
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+property_list_service_error_t property_list_service_set_format(property_list_service_client_t client, property_list_service_format_t format)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->format = format;
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Sets the size limit for received messages. Larger messages are read and
+ * discarded, and reported as PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR; the
+ * next message can be received afterwards.
+ *
+ * @param client The property list service client
+ * @param max_size Maximum message size in bytes
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+property_list_service_error_t property_list_service_set_max_message_size(property_list_service_client_t client, uint32_t max_size)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->max_message_size = max_size;
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Lets the client read ahead of the current message. Small messages that
+ * arrive back to back are then taken from one read of the connection
+ * instead of two reads each.
+ *
+ * @note Once enabled, raw data following the messages must be received
+ *     with property_list_service_receive_raw(), as part of it may already
+ *     be buffered.
+ *
+ * @param client The property list service client
+ * @param size Size of the receive-ahead buffer in bytes, or 0 to disable it.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL or the
+ *     buffer still holds data.
+ */
+property_list_service_error_t property_list_service_set_receive_ahead(property_list_service_client_t client, uint32_t size)
+{
+	if (!client || (client->ahead_length > 0))
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	free(client->ahead_buffer);
+	client->ahead_buffer = (size > 0) ? (char*)malloc(size) : NULL;
+	client->ahead_size = client->ahead_buffer ? size : 0;
+	client->ahead_pos = 0;
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives raw data that is not framed as a plist message, taking data
+ * already read ahead into account.
+ *
+ * @param client The property list service client
+ * @param data Buffer that will be filled with the received data
+ * @param length Size of the buffer
+ * @param bytes Number of bytes received
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS if any data was received,
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when a parameter is invalid, or
+ *     PROPERTY_LIST_SERVICE_E_MUX_ERROR if receiving failed.
+ */
+property_list_service_error_t property_list_service_receive_raw(property_list_service_client_t client, char *data, uint32_t length, uint32_t *bytes)
+{
+	if (!client || !client->connection || !data || !bytes)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	*bytes = 0;
+	internal_receive(client, data, length, bytes, -1);
+	return (*bytes > 0) ? PROPERTY_LIST_SERVICE_E_SUCCESS : PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+}
+
+/**
+ * Gets the transfer statistics of the connection used by the client.
+ *
+ * @param client The property list service client
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when a parameter is invalid.
+ */
+property_list_service_error_t property_list_service_get_metrics(property_list_service_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->connection || !metrics)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	if (idevice_connection_get_metrics(client->connection, metrics) != IDEVICE_E_SUCCESS)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
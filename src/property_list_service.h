@@ -32,8 +32,33 @@
 
 #define PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR       -256
 
+/** Default size limit for received messages */
+#define PLIST_DEFAULT_MAX_MESSAGE_SIZE (256 * 1024 * 1024)
+
+/** Plist encoding used by property_list_service_send_plist() */
+typedef enum {
+	PROPERTY_LIST_SERVICE_FORMAT_XML = 0,
+	PROPERTY_LIST_SERVICE_FORMAT_BINARY = 1,
+	PROPERTY_LIST_SERVICE_FORMAT_AUTO = 2
+} property_list_service_format_t;
+
 struct property_list_service_client_private {
 	idevice_connection_t connection;
+	char *send_buffer;
+	uint32_t send_buffer_size;
+	char *recv_buffer;
+	uint32_t recv_buffer_size;
+	property_list_service_format_t format;
+	int peer_binary;
+	uint32_t max_message_size;
+	char *ahead_buffer;
+	uint32_t ahead_size;
+	uint32_t ahead_pos;
+	uint32_t ahead_length;
+	/* message data handed out by property_list_service_receive_plist_with_data() */
+	int recv_buffer_held;
+	char *spool_map;
+	uint32_t spool_map_size;
 };
 
 typedef struct property_list_service_client_private *property_list_service_client_t;
@@ -47,12 +72,22 @@ property_list_service_error_t property_list_service_client_free(property_list_se
 /* sending */
 property_list_service_error_t property_list_service_send_xml_plist(property_list_service_client_t client, plist_t plist);
 property_list_service_error_t property_list_service_send_binary_plist(property_list_service_client_t client, plist_t plist);
+property_list_service_error_t property_list_service_send_plist(property_list_service_client_t client, plist_t plist);
+property_list_service_error_t property_list_service_send_binary_plists(property_list_service_client_t client, plist_t *plists, uint32_t count);
+property_list_service_error_t property_list_service_send_plists(property_list_service_client_t client, plist_t *plists, uint32_t count);
+property_list_service_error_t property_list_service_send_serialized_plist(property_list_service_client_t client, const char *content, uint32_t length, int binary);
 
 /* receiving */
 property_list_service_error_t property_list_service_receive_plist_with_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout);
 property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist);
+property_list_service_error_t property_list_service_receive_plist_with_data(property_list_service_client_t client, plist_t *plist, const char *key, const char **data, uint64_t *length);
+property_list_service_error_t property_list_service_receive_raw(property_list_service_client_t client, char *data, uint32_t length, uint32_t *bytes);
 
 /* misc */
+property_list_service_error_t property_list_service_set_max_message_size(property_list_service_client_t client, uint32_t max_size);
+property_list_service_error_t property_list_service_set_receive_ahead(property_list_service_client_t client, uint32_t size);
+property_list_service_error_t property_list_service_get_metrics(property_list_service_client_t client, idevice_connection_metrics_t *metrics);
+property_list_service_error_t property_list_service_set_format(property_list_service_client_t client, property_list_service_format_t format);
 property_list_service_error_t property_list_service_enable_ssl(property_list_service_client_t client);
 property_list_service_error_t property_list_service_disable_ssl(property_list_service_client_t client);
 
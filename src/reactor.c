@@ -0,0 +1,372 @@
+/*
+ * reactor.c
+ * Dispatches incoming data of many connections to a small thread pool.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <glib.h>
+
+#include "idevice.h"
+#include "debug.h"
+
+/** A connection watched by a reactor */
+struct idevice_reactor_watch {
+	idevice_connection_t connection;
+	int fd;
+	idevice_reactor_cb_t callback;
+	void *user_data;
+	int armed;
+	int removed;
+	int waiting;
+	int busy;
+	GThread *running;
+};
+
+struct idevice_reactor_private {
+	GMutex *mutex;
+	GCond *cond;
+	GThread *poller;
+	GThreadPool *pool;
+	GList *watches;
+	int wakeup[2];
+	int quit;
+};
+
+/**
+ * Interrupts the poll() of the reactor so it picks up changed watches.
+ */
+static void reactor_wakeup(idevice_reactor_t reactor)
+{
+	char c = 0;
+	while ((write(reactor->wakeup[1], &c, 1) < 0) && (errno == EINTR));
+}
+
+/**
+ * Looks up the watch of a connection. The caller must hold the mutex.
+ */
+static struct idevice_reactor_watch *reactor_find_watch(idevice_reactor_t reactor, idevice_connection_t connection)
+{
+	GList *node;
+
+	for (node = reactor->watches; node; node = node->next) {
+		struct idevice_reactor_watch *watch = (struct idevice_reactor_watch *) node->data;
+		if ((watch->connection == connection) && !watch->removed)
+			return watch;
+	}
+	return NULL;
+}
+
+/**
+ * Runs the callback of a watch on a pool thread and arms the watch again
+ * afterwards. Data already buffered by the connection is dispatched right
+ * away, as poll() would not report it.
+ */
+static void reactor_dispatch(gpointer data, gpointer user_data)
+{
+	struct idevice_reactor_watch *watch = (struct idevice_reactor_watch *) data;
+	idevice_reactor_t reactor = (idevice_reactor_t) user_data;
+
+	g_mutex_lock(reactor->mutex);
+	watch->running = g_thread_self();
+	while (!watch->removed && !reactor->quit) {
+		g_mutex_unlock(reactor->mutex);
+		watch->callback(watch->connection, watch->user_data);
+		g_mutex_lock(reactor->mutex);
+		/* the connection may be gone once the watch was removed */
+		if (watch->removed || !idevice_connection_has_pending_data(watch->connection))
+			break;
+	}
+
+	watch->running = NULL;
+	watch->busy = 0;
+	/* a removed watch is freed by the poller thread */
+	if (!watch->removed)
+		watch->armed = 1;
+	reactor_wakeup(reactor);
+	g_cond_broadcast(reactor->cond);
+	g_mutex_unlock(reactor->mutex);
+}
+
+/**
+ * Frees the watches that were removed and are no longer used by a callback
+ * or a waiting idevice_reactor_remove(). Only the poller thread does this,
+ * once it no longer refers to the watches of its last poll(). The caller
+ * must hold the mutex.
+ */
+static void reactor_reap_watches(idevice_reactor_t reactor)
+{
+	GList *node = reactor->watches;
+
+	while (node) {
+		GList *next = node->next;
+		struct idevice_reactor_watch *watch = (struct idevice_reactor_watch *) node->data;
+		if (watch->removed && !watch->busy && !watch->waiting) {
+			reactor->watches = g_list_delete_link(reactor->watches, node);
+			free(watch);
+		}
+		node = next;
+	}
+}
+
+/**
+ * Thread function polling the file descriptors of all armed watches and
+ * handing readable connections to the thread pool.
+ */
+static gpointer reactor_poll(gpointer data)
+{
+	idevice_reactor_t reactor = (idevice_reactor_t) data;
+	struct pollfd *fds = NULL;
+	struct idevice_reactor_watch **watches = NULL;
+	unsigned int allocated = 0;
+
+	g_mutex_lock(reactor->mutex);
+	while (!reactor->quit) {
+		unsigned int count = 1, i;
+		GList *node;
+		int res;
+
+		reactor_reap_watches(reactor);
+		if (allocated < g_list_length(reactor->watches) + 1) {
+			allocated = g_list_length(reactor->watches) + 1;
+			fds = (struct pollfd *) realloc(fds, sizeof(struct pollfd) * allocated);
+			watches = (struct idevice_reactor_watch **) realloc(watches, sizeof(struct idevice_reactor_watch *) * allocated);
+		}
+		fds[0].fd = reactor->wakeup[0];
+		fds[0].events = POLLIN;
+		for (node = reactor->watches; node; node = node->next) {
+			struct idevice_reactor_watch *watch = (struct idevice_reactor_watch *) node->data;
+			if (!watch->armed || watch->removed)
+				continue;
+			fds[count].fd = watch->fd;
+			fds[count].events = POLLIN;
+			watches[count] = watch;
+			count++;
+		}
+		g_mutex_unlock(reactor->mutex);
+
+		res = poll(fds, count, -1);
+
+		g_mutex_lock(reactor->mutex);
+		if (res < 0) {
+			if (errno != EINTR) {
+				debug_info("ERROR: poll failed: %s", strerror(errno));
+				break;
+			}
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			while (read(reactor->wakeup[0], buf, sizeof(buf)) > 0);
+		}
+		for (i = 1; i < count; i++) {
+			struct idevice_reactor_watch *watch = watches[i];
+			if (!fds[i].revents || !watch->armed || watch->removed)
+				continue;
+			/* one callback per connection at a time */
+			watch->armed = 0;
+			watch->busy = 1;
+			g_thread_pool_push(reactor->pool, watch, NULL);
+		}
+	}
+	g_mutex_unlock(reactor->mutex);
+
+	free(fds);
+	free(watches);
+	return NULL;
+}
+
+/**
+ * Creates a reactor that dispatches incoming data of many connections to
+ * a small pool of threads, so that a thread per connection is not needed.
+ *
+ * @param threads Number of threads running callbacks. Pass 0 to use 4.
+ * @param reactor Pointer that will be set to the newly allocated reactor.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_reactor_new(unsigned int threads, idevice_reactor_t *reactor)
+{
+	idevice_reactor_t reactor_loc;
+
+	if (!reactor)
+		return IDEVICE_E_INVALID_ARG;
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	reactor_loc = (idevice_reactor_t) calloc(1, sizeof(struct idevice_reactor_private));
+	if (pipe(reactor_loc->wakeup) < 0) {
+		free(reactor_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	fcntl(reactor_loc->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(reactor_loc->wakeup[1], F_SETFL, O_NONBLOCK);
+
+	reactor_loc->mutex = g_mutex_new();
+	reactor_loc->cond = g_cond_new();
+	reactor_loc->pool = g_thread_pool_new(reactor_dispatch, reactor_loc, threads ? (gint)threads : 4, FALSE, NULL);
+	reactor_loc->poller = g_thread_create(reactor_poll, reactor_loc, TRUE, NULL);
+	if (!reactor_loc->pool || !reactor_loc->poller) {
+		if (reactor_loc->pool)
+			g_thread_pool_free(reactor_loc->pool, TRUE, FALSE);
+		g_cond_free(reactor_loc->cond);
+		g_mutex_free(reactor_loc->mutex);
+		close(reactor_loc->wakeup[0]);
+		close(reactor_loc->wakeup[1]);
+		free(reactor_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	*reactor = reactor_loc;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Frees a reactor. Callbacks that are running are waited for; the watched
+ * connections are not closed.
+ *
+ * @param reactor The reactor to free.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_reactor_free(idevice_reactor_t reactor)
+{
+	GList *node;
+
+	if (!reactor)
+		return IDEVICE_E_INVALID_ARG;
+
+	g_mutex_lock(reactor->mutex);
+	reactor->quit = 1;
+	reactor_wakeup(reactor);
+	g_mutex_unlock(reactor->mutex);
+
+	g_thread_join(reactor->poller);
+	g_thread_pool_free(reactor->pool, FALSE, TRUE);
+
+	for (node = reactor->watches; node; node = node->next) {
+		free(node->data);
+	}
+	g_list_free(reactor->watches);
+	g_cond_free(reactor->cond);
+	g_mutex_free(reactor->mutex);
+	close(reactor->wakeup[0]);
+	close(reactor->wakeup[1]);
+	free(reactor);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Starts watching a connection. The callback is invoked on one of the
+ * reactor's threads whenever data can be received from the connection,
+ * and is never run for the same connection twice at the same time.
+ *
+ * The callback should receive what the connection has to offer, for
+ * example with property_list_service_receive_plist() or
+ * idevice_connection_receive(), and return. It must not wait for further
+ * data that is not part of the message it is receiving.
+ *
+ * @param reactor The reactor to add the connection to.
+ * @param connection The connection to watch.
+ * @param callback Function called when data is available.
+ * @param user_data Pointer passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG if an argument is
+ *     NULL or the connection is already watched, otherwise an error code.
+ */
+idevice_error_t idevice_reactor_add(idevice_reactor_t reactor, idevice_connection_t connection, idevice_reactor_cb_t callback, void *user_data)
+{
+	struct idevice_reactor_watch *watch;
+	int fd = -1;
+
+	if (!reactor || !connection || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (idevice_connection_get_fd(connection, &fd) != IDEVICE_E_SUCCESS)
+		return IDEVICE_E_UNKNOWN_ERROR;
+
+	g_mutex_lock(reactor->mutex);
+	if (reactor_find_watch(reactor, connection)) {
+		g_mutex_unlock(reactor->mutex);
+		return IDEVICE_E_INVALID_ARG;
+	}
+	watch = (struct idevice_reactor_watch *) calloc(1, sizeof(struct idevice_reactor_watch));
+	watch->connection = connection;
+	watch->fd = fd;
+	watch->callback = callback;
+	watch->user_data = user_data;
+	reactor->watches = g_list_prepend(reactor->watches, watch);
+	if (idevice_connection_has_pending_data(connection)) {
+		watch->busy = 1;
+		g_thread_pool_push(reactor->pool, watch, NULL);
+	} else {
+		watch->armed = 1;
+		reactor_wakeup(reactor);
+	}
+	g_mutex_unlock(reactor->mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Stops watching a connection. If the callback for the connection is
+ * running on another thread, this function waits until it has returned,
+ * so the connection can safely be closed afterwards. It may also be called
+ * from within the callback itself.
+ *
+ * @param reactor The reactor the connection was added to.
+ * @param connection The connection to stop watching.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG if the connection
+ *     is not watched by the reactor.
+ */
+idevice_error_t idevice_reactor_remove(idevice_reactor_t reactor, idevice_connection_t connection)
+{
+	struct idevice_reactor_watch *watch;
+
+	if (!reactor || !connection)
+		return IDEVICE_E_INVALID_ARG;
+
+	g_mutex_lock(reactor->mutex);
+	watch = reactor_find_watch(reactor, connection);
+	if (!watch) {
+		g_mutex_unlock(reactor->mutex);
+		return IDEVICE_E_INVALID_ARG;
+	}
+	/* the poller thread may still refer to the watch, it frees it */
+	watch->removed = 1;
+	watch->armed = 0;
+	if (watch->busy && (watch->running != g_thread_self())) {
+		/* wait until the callback has returned */
+		watch->waiting = 1;
+		while (watch->busy) {
+			g_cond_wait(reactor->cond, reactor->mutex);
+		}
+		watch->waiting = 0;
+	}
+	reactor_wakeup(reactor);
+	g_mutex_unlock(reactor->mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
@@ -0,0 +1,444 @@
+/*
+ * replay.c
+ * Recording of connections and playback of recorded sessions.
+ *
+ * A session file starts with the magic "IDEVREC1" followed by the length
+ * and the UUID of the recorded device. After that come records of the
+ * form type (1 byte), connection id (4 bytes), length (4 bytes) and data,
+ * all numbers in little endian. An OPEN record carries the port of the
+ * connection, SEND and RECV records the data as seen by the application,
+ * which is before encryption when SSL was enabled.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "replay.h"
+#include "debug.h"
+
+#define REPLAY_MAGIC "IDEVREC1"
+#define REPLAY_MAGIC_LEN 8
+#define REPLAY_RECORD_HEADER_LEN 9
+
+struct replay_recorder_private {
+	FILE *file;
+	GMutex *mutex;
+	int refcount;
+	uint32_t next_id;
+};
+
+struct replay_record {
+	uint8_t type;
+	uint32_t length;
+	uint32_t offset;
+	char *data;
+};
+
+struct replay_stream_private {
+	replay_session_t session;
+	GMutex *mutex;
+	uint16_t port;
+	int used;
+	GQueue *records;
+};
+
+struct replay_session_private {
+	char *uuid;
+	GList *streams;
+	GMutex *mutex;
+	int refcount;
+};
+
+static void write_uint32(char *p, uint32_t value)
+{
+	value = GUINT32_TO_LE(value);
+	memcpy(p, &value, sizeof(uint32_t));
+}
+
+static uint32_t read_uint32(const char *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(uint32_t));
+	return GUINT32_FROM_LE(value);
+}
+
+/**
+ * Creates a recorder that writes the connections passed to it to a
+ * session file.
+ *
+ * @param path The file to write, an existing file is overwritten.
+ * @param uuid The UUID of the recorded device.
+ * @param recorder Pointer that will be set to the new recorder.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_UNKNOWN_ERROR if the file
+ *     could not be created.
+ */
+idevice_error_t replay_recorder_new(const char *path, const char *uuid, replay_recorder_t *recorder)
+{
+	char header[REPLAY_MAGIC_LEN + sizeof(uint32_t)];
+	uint32_t uuid_len = uuid ? strlen(uuid) : 0;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		debug_info("could not create %s", path);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	memcpy(header, REPLAY_MAGIC, REPLAY_MAGIC_LEN);
+	write_uint32(header + REPLAY_MAGIC_LEN, uuid_len);
+	if ((fwrite(header, 1, sizeof(header), f) != sizeof(header)) || (fwrite(uuid, 1, uuid_len, f) != uuid_len)) {
+		fclose(f);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	replay_recorder_t rec = (replay_recorder_t)malloc(sizeof(struct replay_recorder_private));
+	rec->file = f;
+	rec->mutex = g_mutex_new();
+	rec->refcount = 1;
+	rec->next_id = 1;
+
+	*recorder = rec;
+	return IDEVICE_E_SUCCESS;
+}
+
+replay_recorder_t replay_recorder_ref(replay_recorder_t recorder)
+{
+	g_mutex_lock(recorder->mutex);
+	recorder->refcount++;
+	g_mutex_unlock(recorder->mutex);
+	return recorder;
+}
+
+/**
+ * Drops a reference to a recorder. The session file is closed when the
+ * device and all recorded connections have let go of it.
+ */
+void replay_recorder_unref(replay_recorder_t recorder)
+{
+	int refcount;
+
+	g_mutex_lock(recorder->mutex);
+	refcount = --recorder->refcount;
+	g_mutex_unlock(recorder->mutex);
+	if (refcount > 0)
+		return;
+
+	fclose(recorder->file);
+	g_mutex_free(recorder->mutex);
+	free(recorder);
+}
+
+/**
+ * Writes a record to the session file.
+ */
+void replay_recorder_write(replay_recorder_t recorder, uint32_t id, uint8_t type, const char *data, uint32_t length)
+{
+	char header[REPLAY_RECORD_HEADER_LEN];
+
+	header[0] = (char)type;
+	write_uint32(header + 1, id);
+	write_uint32(header + 5, length);
+
+	g_mutex_lock(recorder->mutex);
+	fwrite(header, 1, sizeof(header), recorder->file);
+	if (length > 0)
+		fwrite(data, 1, length, recorder->file);
+	if (type == REPLAY_RECORD_CLOSE)
+		fflush(recorder->file);
+	g_mutex_unlock(recorder->mutex);
+}
+
+/**
+ * Records the opening of a connection to the given port.
+ *
+ * @return The id under which the data of the connection is recorded.
+ */
+uint32_t replay_recorder_open(replay_recorder_t recorder, uint16_t port)
+{
+	char data[2];
+	uint32_t id;
+
+	g_mutex_lock(recorder->mutex);
+	id = recorder->next_id++;
+	g_mutex_unlock(recorder->mutex);
+
+	data[0] = (char)(port & 0xff);
+	data[1] = (char)(port >> 8);
+	replay_recorder_write(recorder, id, REPLAY_RECORD_OPEN, data, sizeof(data));
+	return id;
+}
+
+static void replay_record_free(gpointer data, gpointer user_data)
+{
+	struct replay_record *record = (struct replay_record*)data;
+	free(record->data);
+	free(record);
+}
+
+static void replay_stream_free(gpointer data, gpointer user_data)
+{
+	replay_stream_t stream = (replay_stream_t)data;
+
+	g_queue_foreach(stream->records, replay_record_free, NULL);
+	g_queue_free(stream->records);
+	g_mutex_free(stream->mutex);
+	free(stream);
+}
+
+/**
+ * Reads a session file into memory, so it can be played back without
+ * any file I/O.
+ *
+ * @param path The session file written by a recorder.
+ * @param session Pointer that will be set to the loaded session.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_UNKNOWN_ERROR if the file
+ *     could not be read, or IDEVICE_E_BAD_HEADER if it is not a valid
+ *     session file.
+ */
+idevice_error_t replay_session_load(const char *path, replay_session_t *session)
+{
+	gchar *contents = NULL;
+	gsize size = 0;
+	GHashTable *streams;
+	uint32_t uuid_len;
+	gsize pos;
+
+	if (!g_file_get_contents(path, &contents, &size, NULL)) {
+		debug_info("could not read %s", path);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	if ((size < REPLAY_MAGIC_LEN + sizeof(uint32_t)) || memcmp(contents, REPLAY_MAGIC, REPLAY_MAGIC_LEN)) {
+		g_free(contents);
+		return IDEVICE_E_BAD_HEADER;
+	}
+	uuid_len = read_uint32(contents + REPLAY_MAGIC_LEN);
+	pos = REPLAY_MAGIC_LEN + sizeof(uint32_t);
+	if (uuid_len > size - pos) {
+		g_free(contents);
+		return IDEVICE_E_BAD_HEADER;
+	}
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	replay_session_t s = (replay_session_t)malloc(sizeof(struct replay_session_private));
+	s->uuid = g_strndup(contents + pos, uuid_len);
+	s->streams = NULL;
+	s->mutex = g_mutex_new();
+	s->refcount = 1;
+	pos += uuid_len;
+
+	streams = g_hash_table_new(g_direct_hash, g_direct_equal);
+	while (size - pos >= REPLAY_RECORD_HEADER_LEN) {
+		uint8_t type = (uint8_t)contents[pos];
+		uint32_t id = read_uint32(contents + pos + 1);
+		uint32_t length = read_uint32(contents + pos + 5);
+		replay_stream_t stream;
+
+		pos += REPLAY_RECORD_HEADER_LEN;
+		if (length > size - pos) {
+			debug_info("truncated record at offset %lu", (unsigned long)pos);
+			break;
+		}
+
+		stream = (replay_stream_t)g_hash_table_lookup(streams, GUINT_TO_POINTER(id));
+		if (type == REPLAY_RECORD_OPEN && !stream && (length == 2)) {
+			stream = (replay_stream_t)malloc(sizeof(struct replay_stream_private));
+			stream->session = s;
+			stream->mutex = g_mutex_new();
+			stream->port = (uint8_t)contents[pos] | ((uint16_t)(uint8_t)contents[pos + 1] << 8);
+			stream->used = 0;
+			stream->records = g_queue_new();
+			g_hash_table_insert(streams, GUINT_TO_POINTER(id), stream);
+			s->streams = g_list_append(s->streams, stream);
+		} else if (stream && ((type == REPLAY_RECORD_SEND) || (type == REPLAY_RECORD_RECV)) && (length > 0)) {
+			struct replay_record *record = (struct replay_record*)malloc(sizeof(struct replay_record));
+			record->type = type;
+			record->length = length;
+			record->offset = 0;
+			record->data = (char*)malloc(length);
+			memcpy(record->data, contents + pos, length);
+			g_queue_push_tail(stream->records, record);
+		}
+		pos += length;
+	}
+	g_hash_table_destroy(streams);
+	g_free(contents);
+
+	*session = s;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Returns the UUID of the device a session was recorded with.
+ */
+const char *replay_session_get_uuid(replay_session_t session)
+{
+	return session->uuid;
+}
+
+/**
+ * Drops a reference to a session. It is freed when the device and all
+ * connections playing it back have let go of it.
+ */
+void replay_session_unref(replay_session_t session)
+{
+	int refcount;
+
+	g_mutex_lock(session->mutex);
+	refcount = --session->refcount;
+	g_mutex_unlock(session->mutex);
+	if (refcount > 0)
+		return;
+
+	g_list_foreach(session->streams, replay_stream_free, NULL);
+	g_list_free(session->streams);
+	g_mutex_free(session->mutex);
+	g_free(session->uuid);
+	free(session);
+}
+
+/**
+ * Starts playing back the next recorded connection to the given port.
+ * Connections to the same port are played back in the order they were
+ * recorded.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_UNKNOWN_ERROR if the
+ *     session has no more connections to that port.
+ */
+idevice_error_t replay_stream_open(replay_session_t session, uint16_t port, replay_stream_t *stream)
+{
+	idevice_error_t res = IDEVICE_E_UNKNOWN_ERROR;
+	GList *l;
+
+	g_mutex_lock(session->mutex);
+	for (l = session->streams; l; l = l->next) {
+		replay_stream_t st = (replay_stream_t)l->data;
+		if (!st->used && (st->port == port)) {
+			st->used = 1;
+			session->refcount++;
+			*stream = st;
+			res = IDEVICE_E_SUCCESS;
+			break;
+		}
+	}
+	g_mutex_unlock(session->mutex);
+
+	if (res != IDEVICE_E_SUCCESS)
+		debug_info("no recorded connection to port %d left", port);
+	return res;
+}
+
+/**
+ * Ends the playback of a connection.
+ */
+void replay_stream_close(replay_stream_t stream)
+{
+	replay_session_unref(stream->session);
+}
+
+/**
+ * Plays back sending data. The data itself is not compared to the
+ * recording, as it usually contains values like labels or identifiers
+ * that legitimately differ between runs; the recorded data sent is only
+ * skipped.
+ */
+idevice_error_t replay_stream_send(replay_stream_t stream, uint32_t length, uint32_t *sent_bytes)
+{
+	uint32_t left = length;
+
+	g_mutex_lock(stream->mutex);
+	while (left > 0) {
+		struct replay_record *record = (struct replay_record*)g_queue_peek_head(stream->records);
+		if (!record || (record->type != REPLAY_RECORD_SEND))
+			break;
+		if (record->length - record->offset > left) {
+			record->offset += left;
+			break;
+		}
+		left -= record->length - record->offset;
+		g_queue_pop_head(stream->records);
+		replay_record_free(record, NULL);
+	}
+	g_mutex_unlock(stream->mutex);
+
+	*sent_bytes = length;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Plays back receiving data. The data the device sent next in the
+ * recording is returned right away; recorded data sent before it that
+ * the application did not send is skipped.
+ *
+ * @return IDEVICE_E_SUCCESS on success or IDEVICE_E_UNKNOWN_ERROR when the
+ *     recording of the connection has ended.
+ */
+idevice_error_t replay_stream_receive(replay_stream_t stream, char *data, uint32_t length, uint32_t *recv_bytes)
+{
+	idevice_error_t res = IDEVICE_E_UNKNOWN_ERROR;
+	struct replay_record *record;
+
+	*recv_bytes = 0;
+
+	g_mutex_lock(stream->mutex);
+	while ((record = (struct replay_record*)g_queue_peek_head(stream->records)) && (record->type == REPLAY_RECORD_SEND)) {
+		g_queue_pop_head(stream->records);
+		replay_record_free(record, NULL);
+	}
+	if (record) {
+		uint32_t avail = record->length - record->offset;
+		uint32_t len = (length < avail) ? length : avail;
+		memcpy(data, record->data + record->offset, len);
+		record->offset += len;
+		if (record->offset == record->length) {
+			g_queue_pop_head(stream->records);
+			replay_record_free(record, NULL);
+		}
+		*recv_bytes = len;
+		res = IDEVICE_E_SUCCESS;
+	}
+	g_mutex_unlock(stream->mutex);
+
+	return res;
+}
+
+/**
+ * Checks whether the recording has data the device sent left.
+ */
+int replay_stream_has_data(replay_stream_t stream)
+{
+	GList *l;
+	int res = 0;
+
+	g_mutex_lock(stream->mutex);
+	for (l = stream->records->head; l; l = l->next) {
+		if (((struct replay_record*)l->data)->type == REPLAY_RECORD_RECV) {
+			res = 1;
+			break;
+		}
+	}
+	g_mutex_unlock(stream->mutex);
+	return res;
+}
@@ -0,0 +1,53 @@
+/*
+ * replay.h
+ * Recording of connections and playback of recorded sessions -- header file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <glib.h>
+
+#include "libimobiledevice/libimobiledevice.h"
+
+/* record types of a session file */
+#define REPLAY_RECORD_OPEN  1
+#define REPLAY_RECORD_SEND  2
+#define REPLAY_RECORD_RECV  3
+#define REPLAY_RECORD_CLOSE 4
+
+typedef struct replay_recorder_private *replay_recorder_t;
+typedef struct replay_session_private *replay_session_t;
+typedef struct replay_stream_private *replay_stream_t;
+
+/* recording */
+G_GNUC_INTERNAL idevice_error_t replay_recorder_new(const char *path, const char *uuid, replay_recorder_t *recorder);
+G_GNUC_INTERNAL replay_recorder_t replay_recorder_ref(replay_recorder_t recorder);
+G_GNUC_INTERNAL void replay_recorder_unref(replay_recorder_t recorder);
+G_GNUC_INTERNAL uint32_t replay_recorder_open(replay_recorder_t recorder, uint16_t port);
+G_GNUC_INTERNAL void replay_recorder_write(replay_recorder_t recorder, uint32_t id, uint8_t type, const char *data, uint32_t length);
+
+/* playback */
+G_GNUC_INTERNAL idevice_error_t replay_session_load(const char *path, replay_session_t *session);
+G_GNUC_INTERNAL const char *replay_session_get_uuid(replay_session_t session);
+G_GNUC_INTERNAL void replay_session_unref(replay_session_t session);
+G_GNUC_INTERNAL idevice_error_t replay_stream_open(replay_session_t session, uint16_t port, replay_stream_t *stream);
+G_GNUC_INTERNAL void replay_stream_close(replay_stream_t stream);
+G_GNUC_INTERNAL idevice_error_t replay_stream_send(replay_stream_t stream, uint32_t length, uint32_t *sent_bytes);
+G_GNUC_INTERNAL idevice_error_t replay_stream_receive(replay_stream_t stream, char *data, uint32_t length, uint32_t *recv_bytes);
+G_GNUC_INTERNAL int replay_stream_has_data(replay_stream_t stream);
+
+#endif
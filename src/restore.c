@@ -23,6 +23,9 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <glib.h>
 #include <plist/plist.h>
 
@@ -34,6 +37,9 @@
 #define RESULT_SUCCESS 0
 #define RESULT_FAILURE 1
 
+/** Size of the chunks a data channel reads and sends a file in */
+#define RESTORED_DATA_CHUNK_SIZE (1 << 20)
+
 /**
  * Internally used function for checking the result from restore's answer
  * plist to a previously sent request.
@@ -106,6 +112,10 @@ restored_error_t restored_client_free(restored_client_t client)
 		
 	restored_error_t ret = RESTORE_E_UNKNOWN_ERROR;
 
+	if (client->reactor) {
+		restored_client_detach(client);
+	}
+
 	if (client->parent) {
 		restored_goodbye(client);
 
@@ -125,6 +135,10 @@ restored_error_t restored_client_free(restored_client_t client)
 		plist_free(client->info);
 	}
 
+	if (client->mutex) {
+		g_mutex_free(client->mutex);
+	}
+
 	free(client);
 	return ret;
 }
@@ -153,11 +167,11 @@ void restored_client_set_label(restored_client_t client, const char *label)
  * @param plist The plist to store the received data
  *
  * @return RESTORE_E_SUCCESS on success, NP_E_INVALID_ARG when client or
- *  plist is NULL
+ *  plist is NULL or the client is attached to a reactor
  */
 restored_error_t restored_receive(restored_client_t client, plist_t *plist)
 {
-	if (!client || !plist || (plist && *plist))
+	if (!client || !plist || (plist && *plist) || client->reactor)
 		return RESTORE_E_INVALID_ARG;
 		
 	restored_error_t ret = RESTORE_E_SUCCESS;
@@ -194,7 +208,10 @@ restored_error_t restored_send(restored_client_t client, plist_t plist)
 	restored_error_t ret = RESTORE_E_SUCCESS;
 	idevice_error_t err;
 
-	err = property_list_service_send_xml_plist(client->parent, plist);
+	/* requests may be sent from reactor callbacks and other threads */
+	g_mutex_lock(client->mutex);
+	err = property_list_service_send_plist(client->parent, plist);
+	g_mutex_unlock(client->mutex);
 	if (err != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		ret = RESTORE_E_UNKNOWN_ERROR;
 	}
@@ -325,8 +342,15 @@ restored_error_t restored_client_new(idevice_t device, restored_client_t *client
 		return RESTORE_E_MUX_ERROR;
 	}
 
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
 	restored_client_t client_loc = (restored_client_t) malloc(sizeof(struct restored_client_private));
+	memset(client_loc, '\0', sizeof(struct restored_client_private));
 	client_loc->parent = plistclient;
+	client_loc->device = device;
+	client_loc->mutex = g_mutex_new();
 	client_loc->uuid = NULL;
 	client_loc->label = NULL;
 	if (label != NULL)
@@ -456,3 +480,284 @@ restored_error_t restored_reboot(restored_client_t client)
 	return ret;
 }
 
+
+/**
+ * Reactor callback receiving one message from restored and passing it on.
+ */
+static void restored_reactor_dispatch(idevice_connection_t connection, void *user_data)
+{
+	restored_client_t client = (restored_client_t)user_data;
+	plist_t message = NULL;
+
+	property_list_service_error_t err = property_list_service_receive_plist(client->parent, &message);
+	if ((err == PROPERTY_LIST_SERVICE_E_SUCCESS) && message) {
+		client->callback(client, message, client->user_data);
+		plist_free(message);
+		return;
+	}
+	if (message) {
+		plist_free(message);
+	}
+	if (err == PROPERTY_LIST_SERVICE_E_PLIST_ERROR) {
+		debug_info("ignoring invalid message");
+		return;
+	}
+
+	/* the connection is gone, tell the owner once */
+	debug_info("connection to restored failed, error %d", err);
+	idevice_reactor_remove(client->reactor, connection);
+	client->reactor = NULL;
+	client->callback(client, NULL, client->user_data);
+}
+
+/**
+ * Lets a reactor receive the messages restored sends and pass them to a
+ * callback, so no thread has to block waiting for progress and status
+ * messages. One reactor can serve the restored clients of many devices.
+ *
+ * While attached, restored_receive() and the functions waiting for a reply
+ * must not be used. Requests are sent with restored_send(), which may be
+ * called from any thread including the callback; the replies arrive at the
+ * callback like any other message.
+ *
+ * @param client The restored client
+ * @param reactor The reactor to receive the messages with.
+ * @param callback Function called on a reactor thread for each message.
+ *     The message is freed after the callback returns. It is called with a
+ *     NULL message once when the connection fails; the client is detached
+ *     then.
+ * @param user_data Passed to the callback.
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when one of
+ *     the parameters is NULL or the client is attached already.
+ */
+restored_error_t restored_client_attach(restored_client_t client, idevice_reactor_t reactor, restored_message_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || !reactor || !callback || client->reactor)
+		return RESTORE_E_INVALID_ARG;
+
+	client->callback = callback;
+	client->user_data = user_data;
+	client->reactor = reactor;
+	if (idevice_reactor_add(reactor, client->parent->connection, restored_reactor_dispatch, client) != IDEVICE_E_SUCCESS) {
+		client->reactor = NULL;
+		return RESTORE_E_INVALID_ARG;
+	}
+
+	return RESTORE_E_SUCCESS;
+}
+
+/**
+ * Stops passing restored messages to the callback set with
+ * restored_client_attach(). Waits for a running callback to return unless
+ * called from the callback itself.
+ *
+ * @param client The restored client
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when client is
+ *     NULL or not attached.
+ */
+restored_error_t restored_client_detach(restored_client_t client)
+{
+	if (!client || !client->reactor)
+		return RESTORE_E_INVALID_ARG;
+
+	idevice_reactor_t reactor = client->reactor;
+	client->reactor = NULL;
+	idevice_reactor_remove(reactor, client->parent->connection);
+
+	return RESTORE_E_SUCCESS;
+}
+
+/**
+ * Opens a data channel to a port of the restore mode device, for example
+ * the ASR port a system image is streamed to. Payloads are sent on it
+ * independent of the messages exchanged with restored.
+ *
+ * @param client The restored client
+ * @param port The port to connect to on the device.
+ * @param channel Pointer that will point to a newly allocated
+ *     restored_data_channel_t upon successful return.
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when one of
+ *     the parameters is invalid, or RESTORE_E_MUX_ERROR if the connection
+ *     could not be established.
+ */
+restored_error_t restored_data_channel_new(restored_client_t client, uint16_t port, restored_data_channel_t *channel)
+{
+	if (!client || !client->device || (port == 0) || !channel)
+		return RESTORE_E_INVALID_ARG;
+
+	idevice_connection_t connection = NULL;
+	if (idevice_connect(client->device, port, &connection) != IDEVICE_E_SUCCESS) {
+		debug_info("could not connect to port %d", port);
+		return RESTORE_E_MUX_ERROR;
+	}
+
+	restored_data_channel_t channel_loc = (restored_data_channel_t) malloc(sizeof(struct restored_data_channel_private));
+	memset(channel_loc, '\0', sizeof(struct restored_data_channel_private));
+	channel_loc->connection = connection;
+	channel_loc->fd = -1;
+	channel_loc->result = RESTORE_E_SUCCESS;
+
+	*channel = channel_loc;
+	return RESTORE_E_SUCCESS;
+}
+
+/**
+ * Gets the connection of a data channel, for protocols that need to receive
+ * on it or send more than file contents.
+ *
+ * @param channel The data channel
+ * @param connection Pointer that will be set to the connection. It is owned
+ *     by the channel.
+ *
+ * @return RESTORE_E_SUCCESS on success, or RESTORE_E_INVALID_ARG when one of
+ *     the parameters is NULL.
+ */
+restored_error_t restored_data_channel_get_connection(restored_data_channel_t channel, idevice_connection_t *connection)
+{
+	if (!channel || !connection)
+		return RESTORE_E_INVALID_ARG;
+
+	*connection = channel->connection;
+	return RESTORE_E_SUCCESS;
+}
+
+static gpointer restored_data_channel_sender(gpointer data)
+{
+	restored_data_channel_t channel = (restored_data_channel_t)data;
+	char *buffer = (char*)malloc(RESTORED_DATA_CHUNK_SIZE);
+	uint64_t done = 0;
+
+	while (done < channel->total) {
+		ssize_t length = read(channel->fd, buffer, RESTORED_DATA_CHUNK_SIZE);
+		if (length < 0 && errno == EINTR)
+			continue;
+		if (length <= 0) {
+			debug_info("could not read the payload: %s", (length < 0) ? strerror(errno) : "unexpected end of file");
+			channel->result = RESTORE_E_NOT_ENOUGH_DATA;
+			break;
+		}
+
+		uint32_t sent = 0;
+		while (sent < (uint32_t)length) {
+			uint32_t bytes = 0;
+			if ((idevice_connection_send(channel->connection, buffer + sent, (uint32_t)length - sent, &bytes) != IDEVICE_E_SUCCESS) || (bytes == 0)) {
+				channel->result = RESTORE_E_MUX_ERROR;
+				break;
+			}
+			sent += bytes;
+		}
+		done += sent;
+		if (channel->callback)
+			channel->callback(done, channel->total, channel->user_data);
+		if (channel->result != RESTORE_E_SUCCESS)
+			break;
+	}
+
+	free(buffer);
+	close(channel->fd);
+	channel->fd = -1;
+
+	return NULL;
+}
+
+/**
+ * Starts streaming a file over a data channel on a thread of its own and
+ * returns right away. Use restored_data_channel_wait() to get the result.
+ *
+ * @param channel The data channel
+ * @param path Path of the file on the host.
+ * @param callback Function called with the number of bytes sent after each
+ *     chunk, or NULL. It runs on the sending thread.
+ * @param user_data Passed to the callback.
+ *
+ * @return RESTORE_E_SUCCESS if the transfer was started,
+ *     RESTORE_E_INVALID_ARG when one of the parameters is invalid or a
+ *     transfer is running already, or RESTORE_E_NOT_ENOUGH_DATA if the file
+ *     could not be opened.
+ */
+restored_error_t restored_data_channel_send_file(restored_data_channel_t channel, const char *path, restored_progress_cb_t callback, void *user_data)
+{
+	struct stat st;
+
+	if (!channel || !path || channel->thread)
+		return RESTORE_E_INVALID_ARG;
+
+	/* makes sure thread environment is available */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	channel->fd = open(path, O_RDONLY);
+	if (channel->fd < 0) {
+		debug_info("could not open %s: %s", path, strerror(errno));
+		return RESTORE_E_NOT_ENOUGH_DATA;
+	}
+	if (fstat(channel->fd, &st) < 0) {
+		close(channel->fd);
+		channel->fd = -1;
+		return RESTORE_E_NOT_ENOUGH_DATA;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(channel->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	channel->total = st.st_size;
+	channel->callback = callback;
+	channel->user_data = user_data;
+	channel->result = RESTORE_E_SUCCESS;
+	channel->thread = g_thread_create(restored_data_channel_sender, channel, TRUE, NULL);
+	if (!channel->thread) {
+		close(channel->fd);
+		channel->fd = -1;
+		return RESTORE_E_UNKNOWN_ERROR;
+	}
+
+	return RESTORE_E_SUCCESS;
+}
+
+/**
+ * Waits for the transfer started with restored_data_channel_send_file()
+ * to finish.
+ *
+ * @param channel The data channel
+ *
+ * @return RESTORE_E_SUCCESS if the whole file was sent or no transfer was
+ *     started, RESTORE_E_INVALID_ARG when channel is NULL, or the error that
+ *     stopped the transfer.
+ */
+restored_error_t restored_data_channel_wait(restored_data_channel_t channel)
+{
+	if (!channel)
+		return RESTORE_E_INVALID_ARG;
+
+	if (channel->thread) {
+		g_thread_join(channel->thread);
+		channel->thread = NULL;
+	}
+
+	return channel->result;
+}
+
+/**
+ * Waits for a running transfer, closes the data channel and frees it.
+ *
+ * @param channel The data channel
+ *
+ * @return RESTORE_E_SUCCESS on success, or RESTORE_E_INVALID_ARG when
+ *     channel is NULL.
+ */
+restored_error_t restored_data_channel_free(restored_data_channel_t channel)
+{
+	if (!channel)
+		return RESTORE_E_INVALID_ARG;
+
+	restored_data_channel_wait(channel);
+	if (channel->connection) {
+		idevice_disconnect(channel->connection);
+	}
+	free(channel);
+
+	return RESTORE_E_SUCCESS;
+}
@@ -23,6 +23,7 @@
 #define RESTORED_H
 
 #include <string.h>
+#include <glib.h>
 
 #include "libimobiledevice/restore.h"
 #include "property_list_service.h"
@@ -32,6 +33,21 @@ struct restored_client_private {
 	char *uuid;
 	char *label;
 	plist_t info;
+	idevice_t device;
+	GMutex *mutex;
+	idevice_reactor_t reactor;
+	restored_message_cb_t callback;
+	void *user_data;
+};
+
+struct restored_data_channel_private {
+	idevice_connection_t connection;
+	GThread *thread;
+	int fd;
+	uint64_t total;
+	restored_progress_cb_t callback;
+	void *user_data;
+	restored_error_t result;
 };
 
 #endif
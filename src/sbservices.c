@@ -28,6 +28,9 @@
 #include "property_list_service.h"
 #include "debug.h"
 
+/** Number of getIconPNGData requests sent ahead of the replies. */
+#define SBS_ICON_WINDOW 8
+
 /**
  * Locks an sbservices client, used for thread safety.
  *
@@ -36,7 +39,7 @@
 static void sbs_lock(sbservices_client_t client)
 {
 	debug_info("SBServices: Locked");
-	g_mutex_lock(client->mutex);
+	client->lock_time = idevice_connection_lock_mutex(client->parent ? client->parent->connection : NULL, client->mutex);
 }
 
 /**
@@ -47,7 +50,7 @@ static void sbs_lock(sbservices_client_t client)
 static void sbs_unlock(sbservices_client_t client)
 {
 	debug_info("SBServices: Unlocked");
-	g_mutex_unlock(client->mutex);
+	idevice_connection_unlock_mutex(client->parent ? client->parent->connection : NULL, client->mutex, client->lock_time);
 }
 
 /**
@@ -105,6 +108,7 @@ sbservices_error_t sbservices_client_new(idevice_t device, uint16_t port, sbserv
 	sbservices_client_t client_loc = (sbservices_client_t) malloc(sizeof(struct sbservices_client_private));
 	client_loc->parent = plistclient;
 	client_loc->mutex = g_mutex_new();
+	client_loc->icon_cache_dir = NULL;
 
 	*client = client_loc;
 	return SBSERVICES_E_SUCCESS;
@@ -129,11 +133,33 @@ sbservices_error_t sbservices_client_free(sbservices_client_t client)
 	if (client->mutex) {
 		g_mutex_free(client->mutex);
 	}
+	free(client->icon_cache_dir);
 	free(client);
 
 	return err;
 }
 
+/**
+ * Gets the transfer statistics of the connection used by a sbservices
+ * client, including the lock statistics of the client when enabled with
+ * idevice_set_lock_profiling().
+ *
+ * @param client The sbservices client.
+ * @param metrics Structure that will be filled with the statistics.
+ *
+ * @return SBSERVICES_E_SUCCESS on success or SBSERVICES_E_INVALID_ARG when a parameter
+ *     is invalid.
+ */
+sbservices_error_t sbservices_client_get_metrics(sbservices_client_t client, idevice_connection_metrics_t *metrics)
+{
+	if (!client || !client->parent || !metrics)
+		return SBSERVICES_E_INVALID_ARG;
+
+	if (property_list_service_get_metrics(client->parent, metrics) != PROPERTY_LIST_SERVICE_E_SUCCESS)
+		return SBSERVICES_E_INVALID_ARG;
+	return SBSERVICES_E_SUCCESS;
+}
+
 /**
  * Gets the icon state of the connected device.
  *
@@ -223,6 +249,66 @@ sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist_t
 	return res;
 }
 
+/**
+ * Sends a getIconPNGData request without waiting for the reply.
+ */
+static sbservices_error_t sbs_send_icon_request(sbservices_client_t client, const char *bundleId)
+{
+	sbservices_error_t res;
+
+	plist_t dict = plist_new_dict();
+	plist_dict_insert_item(dict, "command", plist_new_string("getIconPNGData"));
+	plist_dict_insert_item(dict, "bundleId", plist_new_string(bundleId));
+
+	res = sbservices_error(property_list_service_send_binary_plist(client->parent, dict));
+	if (res != SBSERVICES_E_SUCCESS) {
+		debug_info("could not send plist, error %d", res);
+	}
+	plist_free(dict);
+
+	return res;
+}
+
+/**
+ * Receives the reply to a getIconPNGData request. The PNG data is passed
+ * by reference into the receive buffer when possible, so it is only valid
+ * until the next message is received.
+ *
+ * @param client The sbservices client to receive the reply with.
+ * @param pngdata Set to point to the PNG data, or to NULL if the device
+ *     has no icon for the app.
+ * @param pngsize Set to the size of the PNG data.
+ * @param copy Set to a newly allocated buffer holding the PNG data when it
+ *     could not be passed by reference, or to NULL. It is up to the caller
+ *     to free it.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, or an SBSERVICES_E_* error code
+ *     otherwise.
+ */
+static sbservices_error_t sbs_receive_icon_reply(sbservices_client_t client, const char **pngdata, uint64_t *pngsize, char **copy)
+{
+	sbservices_error_t res;
+	plist_t dict = NULL;
+
+	*pngdata = NULL;
+	*pngsize = 0;
+	*copy = NULL;
+
+	res = sbservices_error(property_list_service_receive_plist_with_data(client->parent, &dict, "pngData", pngdata, pngsize));
+	if ((res == SBSERVICES_E_SUCCESS) && !*pngdata && (plist_get_node_type(dict) == PLIST_DICT)) {
+		/* XML reply, the data is part of the plist */
+		plist_t node = plist_dict_get_item(dict, "pngData");
+		if (node && (plist_get_node_type(node) == PLIST_DATA)) {
+			plist_get_data_val(node, copy, pngsize);
+			*pngdata = *copy;
+		}
+	}
+	if (dict) {
+		plist_free(dict);
+	}
+	return res;
+}
+
 /**
  * Get the icon of the specified app as PNG data.
  *
@@ -244,36 +330,127 @@ sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const
 		return SBSERVICES_E_INVALID_ARG;
 
 	sbservices_error_t res = SBSERVICES_E_UNKNOWN_ERROR;
-
-	plist_t dict = plist_new_dict();
-	plist_dict_insert_item(dict, "command", plist_new_string("getIconPNGData"));
-	plist_dict_insert_item(dict, "bundleId", plist_new_string(bundleId));
+	const char *data = NULL;
+	uint64_t size = 0;
+	char *copy = NULL;
 
 	sbs_lock(client);
 
-	res = sbservices_error(property_list_service_send_binary_plist(client->parent, dict));
-	if (res != SBSERVICES_E_SUCCESS) {
-		debug_info("could not send plist, error %d", res);
-		goto leave_unlock;
+	res = sbs_send_icon_request(client, bundleId);
+	if (res == SBSERVICES_E_SUCCESS) {
+		res = sbs_receive_icon_reply(client, &data, &size, &copy);
 	}
-	plist_free(dict);
-
-	dict = NULL;
-	res = sbservices_error(property_list_service_receive_plist(client->parent, &dict));
-	if (res	== SBSERVICES_E_SUCCESS) {
-		plist_t node = plist_dict_get_item(dict, "pngData");
-		if (node) {
-			plist_get_data_val(node, pngdata, pngsize);
+	if ((res == SBSERVICES_E_SUCCESS) && data) {
+		if (!copy) {
+			copy = (char*)malloc(size);
+			if (copy)
+				memcpy(copy, data, size);
+		}
+		if (copy) {
+			*pngdata = copy;
+			if (pngsize)
+				*pngsize = size;
+		} else if (size > 0) {
+			res = SBSERVICES_E_UNKNOWN_ERROR;
 		}
 	}
 
-leave_unlock:
-	if (dict) {
-		plist_free(dict);
+	sbs_unlock(client);
+	return res;
+}
+
+/**
+ * Get the icon of the specified app as PNG data written into a buffer
+ * obtained from the given function, so it is copied only once from the
+ * received message to its final memory. The buffer can for instance be
+ * part of a memory mapping shared with another process.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundleId The bundle identifier of the app to retrieve the icon for.
+ * @param get_buffer Called with the size of the PNG data; returns a buffer
+ *     of at least that size, or NULL when no such buffer is available. It
+ *     is not called if the device has no icon for the app.
+ * @param user_data Passed to get_buffer.
+ * @param pngsize Pointer to a uint64_t that will be set to the size of the
+ *     PNG data, or to 0 if the device has no icon for the app. It is also
+ *     set when no buffer was available.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client, bundleId, get_buffer, or pngsize are invalid,
+ *     SBSERVICES_E_BUFFER_TOO_SMALL if get_buffer returned NULL, or an
+ *     SBSERVICES_E_* error code otherwise.
+ */
+sbservices_error_t sbservices_get_icon_pngdata_with_buffer_cb(sbservices_client_t client, const char *bundleId, sbservices_buffer_cb_t get_buffer, void *user_data, uint64_t *pngsize)
+{
+	if (!client || !client->parent || !bundleId || !get_buffer || !pngsize)
+		return SBSERVICES_E_INVALID_ARG;
+
+	sbservices_error_t res = SBSERVICES_E_UNKNOWN_ERROR;
+	const char *data = NULL;
+	uint64_t size = 0;
+	char *copy = NULL;
+
+	sbs_lock(client);
+
+	*pngsize = 0;
+	res = sbs_send_icon_request(client, bundleId);
+	if (res == SBSERVICES_E_SUCCESS) {
+		res = sbs_receive_icon_reply(client, &data, &size, &copy);
+	}
+	if ((res == SBSERVICES_E_SUCCESS) && data) {
+		char *buffer = get_buffer(size, user_data);
+		*pngsize = size;
+		if (buffer) {
+			memcpy(buffer, data, size);
+		} else {
+			debug_info("no buffer for %llu bytes of icon data", (unsigned long long)size);
+			res = SBSERVICES_E_BUFFER_TOO_SMALL;
+		}
 	}
+	free(copy);
+
 	sbs_unlock(client);
 	return res;
+}
+
+struct sbs_fixed_buffer {
+	char *buffer;
+	uint64_t size;
+};
+
+static char *sbs_get_fixed_buffer(uint64_t size, void *user_data)
+{
+	struct sbs_fixed_buffer *fixed = (struct sbs_fixed_buffer*)user_data;
+	return (size <= fixed->size) ? fixed->buffer : NULL;
+}
+
+/**
+ * Get the icon of the specified app as PNG data written into a buffer
+ * provided by the caller.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundleId The bundle identifier of the app to retrieve the icon for.
+ * @param buffer The buffer to write the PNG data to.
+ * @param bufsize The size of buffer.
+ * @param pngsize Pointer to a uint64_t that will be set to the size of the
+ *     PNG data, or to 0 if the device has no icon for the app. When buffer
+ *     is too small, it is the size needed.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client, bundleId, buffer, or pngsize are invalid,
+ *     SBSERVICES_E_BUFFER_TOO_SMALL if the PNG data does not fit into
+ *     buffer, or an SBSERVICES_E_* error code otherwise.
+ */
+sbservices_error_t sbservices_get_icon_pngdata_to_buffer(sbservices_client_t client, const char *bundleId, char *buffer, uint64_t bufsize, uint64_t *pngsize)
+{
+	struct sbs_fixed_buffer fixed;
 
+	if (!buffer)
+		return SBSERVICES_E_INVALID_ARG;
+
+	fixed.buffer = buffer;
+	fixed.size = bufsize;
+	return sbservices_get_icon_pngdata_with_buffer_cb(client, bundleId, sbs_get_fixed_buffer, &fixed, pngsize);
 }
 
 /**
@@ -325,3 +502,208 @@ leave_unlock:
 	sbs_unlock(client);
 	return res;
 }
+
+/**
+ * Builds the path of the cached icon of the given app version. Bundle
+ * identifiers and versions are used as file names, path separators in them
+ * are replaced.
+ */
+static char *sbs_icon_cache_path(sbservices_client_t client, const char *bundleId, const char *version, char **dirname)
+{
+	char *bundle = g_strdelimit(g_strdup(bundleId), "/\\", '_');
+	char *name = g_strdelimit(g_strconcat(version, ".png", NULL), "/\\", '_');
+	char *path;
+
+	if (bundle[0] == '.')
+		bundle[0] = '_';
+	if (name[0] == '.')
+		name[0] = '_';
+
+	*dirname = g_build_filename(client->icon_cache_dir, bundle, NULL);
+	path = g_build_filename(*dirname, name, NULL);
+	g_free(bundle);
+	g_free(name);
+
+	return path;
+}
+
+/**
+ * Reads the cached icon of an app version.
+ *
+ * @return 1 if a cached icon was found, 0 otherwise.
+ */
+static int sbs_icon_cache_read(sbservices_client_t client, const char *bundleId, const char *version, char **pngdata, uint64_t *pngsize)
+{
+	char *dirname = NULL;
+	char *path = sbs_icon_cache_path(client, bundleId, version, &dirname);
+	gchar *data = NULL;
+	gsize length = 0;
+	int found = 0;
+
+	if (g_file_get_contents(path, &data, &length, NULL) && (length > 0)) {
+		*pngdata = (char*)malloc(length);
+		memcpy(*pngdata, data, length);
+		*pngsize = length;
+		found = 1;
+	}
+	g_free(data);
+	g_free(path);
+	g_free(dirname);
+
+	return found;
+}
+
+/**
+ * Stores an icon in the cache replacing the icons of other versions of the
+ * same app.
+ */
+static void sbs_icon_cache_store(sbservices_client_t client, const char *bundleId, const char *version, const char *pngdata, uint64_t pngsize)
+{
+	char *dirname = NULL;
+	char *path = sbs_icon_cache_path(client, bundleId, version, &dirname);
+	char *name = strrchr(path, G_DIR_SEPARATOR) + 1;
+	const gchar *entry;
+	GDir *dir;
+
+	if (g_mkdir_with_parents(dirname, 0755) < 0) {
+		debug_info("could not create cache directory %s", dirname);
+		goto leave;
+	}
+
+	dir = g_dir_open(dirname, 0, NULL);
+	if (dir) {
+		while ((entry = g_dir_read_name(dir))) {
+			if (strcmp(entry, name)) {
+				char *stale = g_build_filename(dirname, entry, NULL);
+				g_unlink(stale);
+				g_free(stale);
+			}
+		}
+		g_dir_close(dir);
+	}
+
+	if (!g_file_set_contents(path, pngdata, (gssize)pngsize, NULL)) {
+		debug_info("could not write %s", path);
+	}
+
+leave:
+	g_free(path);
+	g_free(dirname);
+}
+
+/**
+ * Sets the directory used to cache icons fetched with
+ * sbservices_get_icons_pngdata(). Icons are kept per bundle identifier and
+ * only the icon of the version last fetched is kept.
+ *
+ * @param client The connected sbservices client to use.
+ * @param path The cache directory, created when needed, or NULL to disable
+ *     the cache.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, or SBSERVICES_E_INVALID_ARG when
+ *     client is NULL.
+ */
+sbservices_error_t sbservices_set_icon_cache(sbservices_client_t client, const char *path)
+{
+	if (!client)
+		return SBSERVICES_E_INVALID_ARG;
+
+	sbs_lock(client);
+	free(client->icon_cache_dir);
+	client->icon_cache_dir = path ? strdup(path) : NULL;
+	sbs_unlock(client);
+
+	return SBSERVICES_E_SUCCESS;
+}
+
+/**
+ * Get the icons of several apps as PNG data. Up to SBS_ICON_WINDOW requests
+ * are sent ahead of the replies, so the device never waits for a round
+ * trip. If an icon cache is set with sbservices_set_icon_cache(), icons of
+ * app versions fetched before are read from it instead of the device.
+ *
+ * @note The callback is called with the client locked and must not use it.
+ *     Icons from the cache are passed before the replies to requests sent
+ *     earlier, so the order of the callbacks is not the order of bundleIds.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundleIds The bundle identifiers of the apps to retrieve the icons
+ *     for.
+ * @param bundleVersions The versions of the apps, e.g. the bundleVersion
+ *     values of the icon state, used as cache keys. Can be NULL, or contain
+ *     NULL entries, to bypass the cache.
+ * @param count The number of bundle identifiers.
+ * @param callback Function called for each icon with the PNG data, or NULL
+ *     if the device has no icon for the app. The data is only valid until
+ *     the callback returns. Returning a non-zero value stops fetching icons.
+ * @param user_data Passed to the callback.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client, bundleIds, or callback are invalid, or an SBSERVICES_E_* error
+ *     code otherwise.
+ */
+sbservices_error_t sbservices_get_icons_pngdata(sbservices_client_t client, const char **bundleIds, const char **bundleVersions, uint32_t count, sbservices_icon_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || !bundleIds || !callback)
+		return SBSERVICES_E_INVALID_ARG;
+
+	sbservices_error_t res = SBSERVICES_E_SUCCESS;
+	uint32_t pending[SBS_ICON_WINDOW];
+	uint32_t head = 0;
+	uint32_t npending = 0;
+	uint32_t next = 0;
+	int stop = 0;
+
+	sbs_lock(client);
+
+	while ((res == SBSERVICES_E_SUCCESS) && ((!stop && (next < count)) || (npending > 0))) {
+		/* keep the request window full */
+		while (!stop && (next < count) && (npending < SBS_ICON_WINDOW)) {
+			uint32_t i = next++;
+			const char *version = bundleVersions ? bundleVersions[i] : NULL;
+			if (client->icon_cache_dir && version) {
+				char *data = NULL;
+				uint64_t size = 0;
+				if (sbs_icon_cache_read(client, bundleIds[i], version, &data, &size)) {
+					stop = callback(bundleIds[i], data, size, user_data);
+					free(data);
+					continue;
+				}
+			}
+			res = sbs_send_icon_request(client, bundleIds[i]);
+			if (res != SBSERVICES_E_SUCCESS)
+				break;
+			pending[(head + npending) % SBS_ICON_WINDOW] = i;
+			npending++;
+		}
+		if (npending == 0)
+			continue;
+
+		/* the replies arrive in the order of the requests */
+		uint32_t i = pending[head];
+		const char *data = NULL;
+		uint64_t size = 0;
+		char *copy = NULL;
+
+		head = (head + 1) % SBS_ICON_WINDOW;
+		npending--;
+
+		res = sbs_receive_icon_reply(client, &data, &size, &copy);
+		if (res != SBSERVICES_E_SUCCESS) {
+			debug_info("could not get icon of %s, error %d", bundleIds[i], res);
+			break;
+		}
+
+		if (data && (size > 0) && client->icon_cache_dir && bundleVersions && bundleVersions[i]) {
+			sbs_icon_cache_store(client, bundleIds[i], bundleVersions[i], data, size);
+		}
+		/* replies to requests already sent are still read after a stop */
+		if (!stop) {
+			stop = callback(bundleIds[i], data, size, user_data);
+		}
+		free(copy);
+	}
+
+	sbs_unlock(client);
+	return res;
+}
@@ -29,6 +29,8 @@
 struct sbservices_client_private {
 	property_list_service_client_t parent;
 	GMutex *mutex;
+	uint64_t lock_time;
+	char *icon_cache_dir;
 };
 
 #endif
@@ -22,6 +22,7 @@
 #include <plist/plist.h>
 #include <string.h>
 #include <stdlib.h>
+#include <glib.h>
 
 #include "screenshotr.h"
 #include "device_link_service.h"
@@ -120,57 +121,79 @@ screenshotr_error_t screenshotr_client_free(screenshotr_client_t client)
 	return err;
 }
 
-/**
- * Get a screen shot from the connected device.
- *
- * @param client The connection screenshotr service client.
- * @param imgdata Pointer that will point to a newly allocated buffer
- *     containing TIFF image data upon successful return. It is up to the
- *     caller to free the memory.
- * @param imgsize Pointer to a uint64_t that will be set to the size of the
- *     buffer imgdata points to upon successful return.
- *
- * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
- *     one or more parameters are invalid, or another error code if an
- *     error occured.
- */
-screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+static screenshotr_error_t screenshotr_send_request(screenshotr_client_t client)
 {
-	if (!client || !client->parent || !imgdata)
-		return SCREENSHOTR_E_INVALID_ARG;
-
-	screenshotr_error_t res = SCREENSHOTR_E_UNKNOWN_ERROR;
-
 	plist_t dict = plist_new_dict();
 	plist_dict_insert_item(dict, "MessageType", plist_new_string("ScreenShotRequest"));
 
-	res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
+	screenshotr_error_t res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
 	plist_free(dict);
 	if (res != SCREENSHOTR_E_SUCCESS) {
 		debug_info("could not send plist, error %d", res);
-		return res;
 	}
+	return res;
+}
+
+/**
+ * Receives a ScreenShotReply. The image data is passed by reference into
+ * the receive buffer when possible, so it is only valid until the next
+ * message is received.
+ *
+ * @param client The screenshotr client to receive the reply with.
+ * @param imgdata Set to point to the TIFF image data.
+ * @param imgsize Set to the size of the image data.
+ * @param copy Set to a newly allocated buffer holding the image data when
+ *     it could not be passed by reference, or to NULL. It is up to the
+ *     caller to free it.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, or an error code otherwise.
+ */
+static screenshotr_error_t screenshotr_receive_reply(screenshotr_client_t client, const char **imgdata, uint64_t *imgsize, char **copy)
+{
+	screenshotr_error_t res = SCREENSHOTR_E_UNKNOWN_ERROR;
+	plist_t pmsg = NULL;
+	plist_t dict = NULL;
+	plist_t node = NULL;
+	char *strval = NULL;
+
+	*imgdata = NULL;
+	*imgsize = 0;
+	*copy = NULL;
 
-	dict = NULL;
-	res = screenshotr_error(device_link_service_receive_process_message(client->parent, &dict));
+	res = screenshotr_error(device_link_service_receive_with_data(client->parent, &pmsg, "ScreenShotData", imgdata, imgsize));
 	if (res != SCREENSHOTR_E_SUCCESS) {
 		debug_info("could not get screenshot data, error %d", res);
 		goto leave;
 	}
-	if (!dict) {
+	if (!pmsg || (plist_get_node_type(pmsg) != PLIST_ARRAY) || (plist_array_get_size(pmsg) != 2)) {
 		debug_info("did not receive screenshot data!");
 		res = SCREENSHOTR_E_PLIST_ERROR;
 		goto leave;
 	}
 
-	plist_t node = plist_dict_get_item(dict, "MessageType");
-	char *strval = NULL;
-	plist_get_string_val(node, &strval);
+	node = plist_array_get_item(pmsg, 0);
+	if (node && (plist_get_node_type(node) == PLIST_STRING))
+		plist_get_string_val(node, &strval);
+	if (!strval || strcmp(strval, "DLMessageProcessMessage")) {
+		debug_info("Did not receive DLMessageProcessMessage as expected!");
+		free(strval);
+		res = SCREENSHOTR_E_PLIST_ERROR;
+		goto leave;
+	}
+	free(strval);
+	strval = NULL;
+
+	dict = plist_array_get_item(pmsg, 1);
+	node = (dict && (plist_get_node_type(dict) == PLIST_DICT)) ? plist_dict_get_item(dict, "MessageType") : NULL;
+	if (node && (plist_get_node_type(node) == PLIST_STRING))
+		plist_get_string_val(node, &strval);
 	if (!strval || strcmp(strval, "ScreenShotReply")) {
 		debug_info("invalid screenshot data received!");
+		free(strval);
 		res = SCREENSHOTR_E_PLIST_ERROR;
 		goto leave;
 	}
+	free(strval);
 	node = plist_dict_get_item(dict, "ScreenShotData");
 	if (!node || plist_get_node_type(node) != PLIST_DATA) {
 		debug_info("no PNG data received!");
@@ -178,12 +201,258 @@ screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, cha
 		goto leave;
 	}
 
-	plist_get_data_val(node, imgdata, imgsize);
+	if (!*imgdata) {
+		/* XML reply, the data is part of the plist */
+		plist_get_data_val(node, copy, imgsize);
+		*imgdata = *copy;
+	}
 	res = SCREENSHOTR_E_SUCCESS;
 
 leave:
-	if (dict)
-		plist_free(dict);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		*imgdata = NULL;
+		*imgsize = 0;
+	}
+	if (pmsg)
+		plist_free(pmsg);
+
+	return res;
+}
+
+/**
+ * Reads and drops a ScreenShotReply.
+ */
+static screenshotr_error_t screenshotr_skip_reply(screenshotr_client_t client)
+{
+	const char *imgdata = NULL;
+	uint64_t imgsize = 0;
+	char *copy = NULL;
+
+	screenshotr_error_t res = screenshotr_receive_reply(client, &imgdata, &imgsize, &copy);
+	free(copy);
+	return res;
+}
+
+/**
+ * Get a screen shot from the connected device.
+ *
+ * @param client The connection screenshotr service client.
+ * @param imgdata Pointer that will point to a newly allocated buffer
+ *     containing TIFF image data upon successful return. It is up to the
+ *     caller to free the memory.
+ * @param imgsize Pointer to a uint64_t that will be set to the size of the
+ *     buffer imgdata points to upon successful return.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, or another error code if an
+ *     error occured.
+ */
+screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+{
+	const char *data = NULL;
+	uint64_t size = 0;
+	char *copy = NULL;
+
+	if (!client || !client->parent || !imgdata)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = screenshotr_send_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+	res = screenshotr_receive_reply(client, &data, &size, &copy);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+	if (!copy) {
+		copy = (char*)malloc(size);
+		if (!copy && (size > 0))
+			return SCREENSHOTR_E_UNKNOWN_ERROR;
+		memcpy(copy, data, size);
+	}
+	*imgdata = copy;
+	if (imgsize)
+		*imgsize = size;
+	return res;
+}
+
+/**
+ * Get a screen shot from the connected device and write the image data
+ * into a buffer obtained from the given function, so it is copied only
+ * once from the received message to its final memory. The buffer can for
+ * instance be part of a memory mapping shared with another process.
+ *
+ * @param client The connection screenshotr service client.
+ * @param get_buffer Called with the size of the image data; returns a
+ *     buffer of at least that size, or NULL when no such buffer is
+ *     available.
+ * @param user_data Passed to get_buffer.
+ * @param imgsize Pointer to a uint64_t that will be set to the size of the
+ *     image data. It is also set when no buffer was available.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, SCREENSHOTR_E_BUFFER_TOO_SMALL
+ *     if get_buffer returned NULL, in which case the screen shot is
+ *     dropped, or another error code if an error occured.
+ */
+screenshotr_error_t screenshotr_take_screenshot_with_buffer_cb(screenshotr_client_t client, screenshotr_buffer_cb_t get_buffer, void *user_data, uint64_t *imgsize)
+{
+	const char *data = NULL;
+	uint64_t size = 0;
+	char *copy = NULL;
+	char *buffer;
+
+	if (!client || !client->parent || !get_buffer || !imgsize)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = screenshotr_send_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+	res = screenshotr_receive_reply(client, &data, &size, &copy);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+	*imgsize = size;
+	buffer = get_buffer(size, user_data);
+	if (buffer) {
+		memcpy(buffer, data, size);
+	} else {
+		debug_info("no buffer for %llu bytes of image data", (unsigned long long)size);
+		res = SCREENSHOTR_E_BUFFER_TOO_SMALL;
+	}
+	free(copy);
+	return res;
+}
+
+struct screenshotr_fixed_buffer {
+	char *buffer;
+	uint64_t size;
+};
+
+static char *screenshotr_get_fixed_buffer(uint64_t size, void *user_data)
+{
+	struct screenshotr_fixed_buffer *fixed = (struct screenshotr_fixed_buffer*)user_data;
+	return (size <= fixed->size) ? fixed->buffer : NULL;
+}
+
+/**
+ * Get a screen shot from the connected device and write the image data
+ * into a buffer provided by the caller.
+ *
+ * @param client The connection screenshotr service client.
+ * @param buffer The buffer to write the TIFF image data to.
+ * @param bufsize The size of buffer.
+ * @param imgsize Pointer to a uint64_t that will be set to the size of the
+ *     image data. When buffer is too small, it is the size needed, which
+ *     can be used to size the buffer for the next screen shot.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, SCREENSHOTR_E_BUFFER_TOO_SMALL
+ *     if the image data does not fit into buffer, in which case the screen
+ *     shot is dropped, or another error code if an error occured.
+ */
+screenshotr_error_t screenshotr_take_screenshot_to_buffer(screenshotr_client_t client, char *buffer, uint64_t bufsize, uint64_t *imgsize)
+{
+	struct screenshotr_fixed_buffer fixed;
+
+	if (!buffer)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	fixed.buffer = buffer;
+	fixed.size = bufsize;
+	return screenshotr_take_screenshot_with_buffer_cb(client, screenshotr_get_fixed_buffer, &fixed, imgsize);
+}
+
+static uint64_t screenshotr_now()
+{
+	GTimeVal tv;
+	g_get_current_time(&tv);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Captures a series of screen shots. The request for the next frame is
+ * sent before the current one is handed to the callback, so the device
+ * takes the next screen shot while the caller processes this one.
+ *
+ * @param client The connection screenshotr service client.
+ * @param interval Minimum time between two frames in milliseconds, or 0
+ *     to capture as fast as the device delivers.
+ * @param count Number of frames to capture, or 0 to capture until the
+ *     callback asks to stop.
+ * @param callback Called with the TIFF image data of each frame. The data
+ *     points into the receive buffer and is only valid during the call. Return 0 to continue capturing or any
+ *     other value to stop.
+ * @param user_data Passed to the callback.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, or another error code if an
+ *     error occured.
+ */
+screenshotr_error_t screenshotr_capture(screenshotr_client_t client, unsigned int interval, unsigned int count, screenshotr_frame_cb_t callback, void *user_data)
+{
+	screenshotr_error_t res;
+	uint64_t start;
+	unsigned int frame = 0;
+	int outstanding;
+	int stop = 0;
+
+	if (!client || !client->parent || !callback)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	start = screenshotr_now();
+	res = screenshotr_send_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS)
+		return res;
+	outstanding = 1;
+
+	while (outstanding) {
+		const char *imgdata = NULL;
+		uint64_t imgsize = 0;
+		char *copy = NULL;
+		uint64_t next = start + (uint64_t)(frame + 1) * interval;
+
+		res = screenshotr_receive_reply(client, &imgdata, &imgsize, &copy);
+		outstanding = 0;
+		if (res != SCREENSHOTR_E_SUCCESS)
+			break;
+		frame++;
+		if (count && (frame >= count))
+			stop = 1;
+
+		/* keep the device busy while the frame is handed out */
+		if (!stop && (screenshotr_now() >= next)) {
+			res = screenshotr_send_request(client);
+			if (res != SCREENSHOTR_E_SUCCESS) {
+				free(copy);
+				break;
+			}
+			outstanding = 1;
+		}
+
+		if (callback(imgdata, imgsize, user_data) != 0)
+			stop = 1;
+		free(copy);
+
+		if (stop) {
+			if (outstanding) {
+				/* the reply has to be read before the next request */
+				res = screenshotr_skip_reply(client);
+			}
+			break;
+		}
+		if (!outstanding) {
+			uint64_t now = screenshotr_now();
+			if (now < next) {
+				g_usleep((next - now) * 1000);
+			}
+			res = screenshotr_send_request(client);
+			if (res != SCREENSHOTR_E_SUCCESS)
+				break;
+			outstanding = 1;
+		}
+	}
 
 	return res;
 }
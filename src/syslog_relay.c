@@ -0,0 +1,364 @@
+/*
+ * syslog_relay.c
+ * com.apple.syslog_relay service implementation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "syslog_relay.h"
+#include "idevice.h"
+#include "debug.h"
+
+/**
+ * Connects to the syslog_relay service on the specified device.
+ *
+ * @param device The device to connect to.
+ * @param port Destination port (usually given by lockdownd_start_service).
+ * @param client Reference that will point to a newly allocated
+ *     syslog_relay_client_t upon successful return.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *     SYSLOG_RELAY_E_INVALID_ARG when one of the parameters is invalid,
+ *     or SYSLOG_RELAY_E_MUX_ERROR when the connection failed.
+ */
+syslog_relay_error_t syslog_relay_client_new(idevice_t device, uint16_t port, syslog_relay_client_t *client)
+{
+	if (!device || port == 0 || !client || *client) {
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	}
+
+	idevice_connection_t connection = NULL;
+	if (idevice_connect(device, port, &connection) != IDEVICE_E_SUCCESS) {
+		return SYSLOG_RELAY_E_MUX_ERROR;
+	}
+
+	syslog_relay_client_t client_loc = (syslog_relay_client_t) malloc(sizeof(struct syslog_relay_client_private));
+	memset(client_loc, '\0', sizeof(struct syslog_relay_client_private));
+	client_loc->connection = connection;
+	client_loc->buffer = (char*)malloc(SYSLOG_RELAY_BUFFER_SIZE);
+	client_loc->mutex = g_mutex_new();
+	client_loc->cond = g_cond_new();
+
+	*client = client_loc;
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Disconnects a syslog_relay client from the device and frees up the
+ * syslog_relay client data.
+ *
+ * @param client The syslog_relay client to disconnect and free.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *     when client is NULL.
+ */
+syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client)
+{
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	syslog_relay_client_detach(client);
+	if (client->connection) {
+		idevice_disconnect(client->connection);
+	}
+	if (client->regex) {
+		g_regex_unref(client->regex);
+	}
+	free(client->process);
+	free(client->buffer);
+	g_cond_free(client->cond);
+	g_mutex_free(client->mutex);
+	free(client);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Restricts the lines passed to the callback of syslog_relay_receive().
+ * Lines are filtered before they are handed out, so filtered lines cost
+ * no more than a scan of the receive buffer.
+ *
+ * @param client The syslog_relay client
+ * @param process Only pass lines logged by the process with this name,
+ *     or NULL for all processes.
+ * @param pattern Only pass lines matching this regular expression (Perl
+ *     syntax, see GRegex), or NULL for all lines.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, or SYSLOG_RELAY_E_INVALID_ARG
+ *     when client is NULL or pattern is not a valid regular expression.
+ */
+syslog_relay_error_t syslog_relay_set_filter(syslog_relay_client_t client, const char *process, const char *pattern)
+{
+	GRegex *regex = NULL;
+
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (pattern) {
+		GError *error = NULL;
+		regex = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &error);
+		if (!regex) {
+			debug_info("invalid pattern: %s", error ? error->message : pattern);
+			if (error)
+				g_error_free(error);
+			return SYSLOG_RELAY_E_INVALID_ARG;
+		}
+	}
+
+	if (client->regex) {
+		g_regex_unref(client->regex);
+	}
+	client->regex = regex;
+	free(client->process);
+	client->process = process ? strdup(process) : NULL;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Checks if a line was logged by the given process. Lines look like
+ * "Mon DD HH:MM:SS devicename process[pid] <Level>: message".
+ */
+static int syslog_relay_line_has_process(const char *line, uint32_t length, const char *process)
+{
+	const char *p = line;
+	const char *end = line + length;
+	size_t plen = strlen(process);
+	int field;
+
+	/* skip month, day, time and device name */
+	for (field = 0; field < 4; field++) {
+		while ((p < end) && (*p == ' '))
+			p++;
+		while ((p < end) && (*p != ' '))
+			p++;
+	}
+	while ((p < end) && (*p == ' '))
+		p++;
+
+	if ((size_t)(end - p) < plen || memcmp(p, process, plen))
+		return 0;
+	p += plen;
+	return (p == end) || (*p == '[') || (*p == ':') || (*p == ' ');
+}
+
+static void syslog_relay_deliver(syslog_relay_client_t client, char *line, uint32_t length, syslog_relay_line_cb_t callback, void *user_data)
+{
+	char *r;
+	char *w;
+	char *end = line + length;
+
+	/* the device pads messages with NUL bytes, drop them */
+	r = memchr(line, '\0', length);
+	if (r) {
+		for (w = r; r < end; r++) {
+			if (*r != '\0')
+				*w++ = *r;
+		}
+		length = w - line;
+	}
+	if (length == 0)
+		return;
+
+	if (client->process && !syslog_relay_line_has_process(line, length, client->process))
+		return;
+	if (client->regex && !g_regex_match_full(client->regex, line, length, 0, 0, NULL, NULL))
+		return;
+
+	callback(line, length, user_data);
+}
+
+/**
+ * Receives the syslog data available and passes every complete line to
+ * the callback. An incomplete line at the end stays in the client's buffer
+ * until the rest of it arrives.
+ *
+ * @param client The syslog_relay client
+ * @param callback Function called for each line that passes the filter.
+ * @param user_data Passed to the callback.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS when data was received,
+ *     SYSLOG_RELAY_E_TIMEOUT when no data arrived in time,
+ *     SYSLOG_RELAY_E_INVALID_ARG when client or callback is NULL, or
+ *     SYSLOG_RELAY_E_MUX_ERROR when the connection failed or was closed.
+ */
+syslog_relay_error_t syslog_relay_receive(syslog_relay_client_t client, syslog_relay_line_cb_t callback, void *user_data, unsigned int timeout)
+{
+	struct pollfd pfd;
+	uint32_t bytes = 0;
+	uint32_t start;
+	char *nl;
+	int fd = -1;
+	int res;
+
+	if (!client || !client->connection || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (idevice_connection_get_fd(client->connection, &fd) != IDEVICE_E_SUCCESS)
+		return SYSLOG_RELAY_E_MUX_ERROR;
+
+	if (!idevice_connection_has_pending_data(client->connection)) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		do {
+			res = poll(&pfd, 1, timeout);
+		} while ((res < 0) && (errno == EINTR));
+		if (res == 0)
+			return SYSLOG_RELAY_E_TIMEOUT;
+		if (res < 0)
+			return SYSLOG_RELAY_E_MUX_ERROR;
+	}
+
+	if ((idevice_connection_receive_timeout(client->connection, client->buffer + client->length, SYSLOG_RELAY_BUFFER_SIZE - client->length, &bytes, 0) != IDEVICE_E_SUCCESS) || (bytes == 0)) {
+		debug_info("connection closed");
+		return SYSLOG_RELAY_E_MUX_ERROR;
+	}
+	client->length += bytes;
+
+	/* hand out the complete lines straight from the buffer */
+	start = 0;
+	while ((nl = memchr(client->buffer + start, '\n', client->length - start))) {
+		uint32_t len = nl - (client->buffer + start);
+		syslog_relay_deliver(client, client->buffer + start, len, callback, user_data);
+		start += len + 1;
+	}
+
+	if (start == 0 && client->length == SYSLOG_RELAY_BUFFER_SIZE) {
+		/* no line break in a full buffer, pass on what we have */
+		syslog_relay_deliver(client, client->buffer, client->length, callback, user_data);
+		start = client->length;
+	}
+
+	/* keep the beginning of the next line */
+	if (start > 0) {
+		client->length -= start;
+		if (client->length > 0)
+			memmove(client->buffer, client->buffer + start, client->length);
+	}
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Reactor callback passing the lines that arrived to the owner.
+ */
+static void syslog_relay_reactor_dispatch(idevice_connection_t connection, void *user_data)
+{
+	syslog_relay_client_t client = (syslog_relay_client_t)user_data;
+
+	syslog_relay_error_t err = syslog_relay_receive(client, client->callback, client->user_data, 0);
+	if ((err == SYSLOG_RELAY_E_SUCCESS) || (err == SYSLOG_RELAY_E_TIMEOUT))
+		return;
+
+	/* the connection is gone, tell the owner once unless detached meanwhile */
+	debug_info("syslog connection failed, error %d", err);
+	g_mutex_lock(client->mutex);
+	idevice_reactor_t reactor = client->reactor;
+	client->reactor = NULL;
+	if (reactor)
+		client->failing = g_thread_self();
+	g_mutex_unlock(client->mutex);
+	if (!reactor)
+		return;
+
+	idevice_reactor_remove(reactor, connection);
+	client->callback(NULL, 0, client->user_data);
+
+	/* syslog_relay_client_detach() waits for this */
+	g_mutex_lock(client->mutex);
+	client->failing = NULL;
+	g_cond_broadcast(client->cond);
+	g_mutex_unlock(client->mutex);
+}
+
+/**
+ * Lets a reactor receive the syslog of the device and pass its lines to a
+ * callback, so no thread has to wait for data. One reactor can relay the
+ * syslog of many devices. The filter set with syslog_relay_set_filter()
+ * applies as with syslog_relay_receive(), which must not be used while
+ * the client is attached.
+ *
+ * @param client The syslog_relay client
+ * @param reactor The reactor to receive the syslog with.
+ * @param callback Function called on a reactor thread for each line. It is
+ *     called with a NULL line once when the connection fails; the client is
+ *     detached then and should be freed, but not from the callback.
+ * @param user_data Passed to the callback.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, SYSLOG_RELAY_E_INVALID_ARG when
+ *     one of the parameters is NULL or the client is attached already.
+ */
+syslog_relay_error_t syslog_relay_client_attach(syslog_relay_client_t client, idevice_reactor_t reactor, syslog_relay_line_cb_t callback, void *user_data)
+{
+	if (!client || !client->connection || !reactor || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	g_mutex_lock(client->mutex);
+	if (client->reactor || client->failing) {
+		g_mutex_unlock(client->mutex);
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	}
+	client->callback = callback;
+	client->user_data = user_data;
+	client->reactor = reactor;
+	g_mutex_unlock(client->mutex);
+
+	if (idevice_reactor_add(reactor, client->connection, syslog_relay_reactor_dispatch, client) != IDEVICE_E_SUCCESS) {
+		g_mutex_lock(client->mutex);
+		client->reactor = NULL;
+		g_mutex_unlock(client->mutex);
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	}
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+/**
+ * Stops passing syslog lines to the callback set with
+ * syslog_relay_client_attach(). Waits for a running callback to return
+ * unless called from the callback itself, including the one reporting a
+ * failed connection.
+ *
+ * @param client The syslog_relay client
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success, SYSLOG_RELAY_E_INVALID_ARG when
+ *     client is NULL or not attached.
+ */
+syslog_relay_error_t syslog_relay_client_detach(syslog_relay_client_t client)
+{
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	g_mutex_lock(client->mutex);
+	idevice_reactor_t reactor = client->reactor;
+	client->reactor = NULL;
+	if (!reactor) {
+		/* a failed connection is being reported, let that finish */
+		while (client->failing && (client->failing != g_thread_self()))
+			g_cond_wait(client->cond, client->mutex);
+		g_mutex_unlock(client->mutex);
+		return SYSLOG_RELAY_E_INVALID_ARG;
+	}
+	g_mutex_unlock(client->mutex);
+	idevice_reactor_remove(reactor, client->connection);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
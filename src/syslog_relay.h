@@ -0,0 +1,43 @@
+/*
+ * syslog_relay.h
+ * com.apple.syslog_relay service header file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef SYSLOG_RELAY_H
+#define SYSLOG_RELAY_H
+
+#include <glib.h>
+
+#include "libimobiledevice/syslog_relay.h"
+
+/** Size of the receive buffer; longer lines are delivered in pieces */
+#define SYSLOG_RELAY_BUFFER_SIZE 65536
+
+struct syslog_relay_client_private {
+	idevice_connection_t connection;
+	char *buffer;
+	uint32_t length;
+	char *process;
+	GRegex *regex;
+	GMutex *mutex;
+	GCond *cond;
+	idevice_reactor_t reactor;
+	GThread *failing;
+	syslog_relay_line_cb_t callback;
+	void *user_data;
+};
+
+#endif
@@ -26,11 +26,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include <gcrypt.h>
 
 #include "userpref.h"
+#define DEBUG_DOMAIN IDEVICE_DEBUG_DOMAIN_SSL
 #include "debug.h"
 
 #define LIBIMOBILEDEVICE_CONF_DIR  "libimobiledevice"
@@ -41,6 +43,33 @@
 #define LIBIMOBILEDEVICE_ROOT_CERTIF "RootCertificate.pem"
 #define LIBIMOBILEDEVICE_HOST_CERTIF "HostCertificate.pem"
 
+/** Identifies the version of a file on disk */
+struct userpref_file_stamp {
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+};
+
+static const char *userpref_credential_files[4] = {
+	LIBIMOBILEDEVICE_ROOT_PRIVKEY,
+	LIBIMOBILEDEVICE_HOST_PRIVKEY,
+	LIBIMOBILEDEVICE_ROOT_CERTIF,
+	LIBIMOBILEDEVICE_HOST_CERTIF
+};
+
+static GStaticMutex userpref_cache_mutex = G_STATIC_MUTEX_INIT;
+
+/* keys and certificates of the last successful userpref_get_credentials() */
+static userpref_credentials_t cached_credentials = NULL;
+static struct userpref_file_stamp cached_credentials_stamps[4];
+static time_t cached_credentials_time = 0;
+static volatile gint preparing_credentials = 0;
+
+/* UUIDs of the paired devices as found in the config directory */
+static GHashTable *cached_paired_devices = NULL;
+static struct userpref_file_stamp cached_paired_devices_stamp;
+static time_t cached_paired_devices_time = 0;
+
 
 /**
  * Creates a freedesktop compatible configuration directory.
@@ -162,6 +191,102 @@ void userpref_get_host_id(char **host_id)
 	debug_info("Using %s as HostID", *host_id);
 }
 
+/**
+ * Gets the stamp of a file in the config directory, or of the directory
+ * itself if name is NULL.
+ *
+ * @return 1 if the file exists, 0 otherwise.
+ */
+static int userpref_get_file_stamp(const char *name, struct userpref_file_stamp *stamp)
+{
+	struct stat st;
+	gchar *path = g_build_path(G_DIR_SEPARATOR_S, g_get_user_config_dir(), LIBIMOBILEDEVICE_CONF_DIR, name, NULL);
+	int res = (stat(path, &st) == 0);
+
+	g_free(path);
+	memset(stamp, '\0', sizeof(struct userpref_file_stamp));
+	if (res) {
+		stamp->mtime = st.st_mtime;
+		stamp->size = st.st_size;
+		stamp->ino = st.st_ino;
+	}
+	return res;
+}
+
+/**
+ * Checks whether data read from a file at read_time is still current.
+ * A change within the same second as the read cannot be told from the
+ * mtime, so data read in the second of the last change is never trusted.
+ */
+static int userpref_file_stamp_valid(const struct userpref_file_stamp *cached, const struct userpref_file_stamp *current, time_t read_time)
+{
+	return (cached->mtime == current->mtime) && (cached->size == current->size) && (cached->ino == current->ino) && (cached->mtime < read_time);
+}
+
+/**
+ * Checks whether a file of the config directory is the pairing record of
+ * a device, named after its UUID, rather than a key or certificate of the
+ * host.
+ */
+static int userpref_is_device_record(const char *name)
+{
+	if (!g_str_has_suffix(name, ".pem") || (strlen(name) <= 4))
+		return 0;
+	return strcmp(name, LIBIMOBILEDEVICE_ROOT_PRIVKEY) && strcmp(name, LIBIMOBILEDEVICE_HOST_PRIVKEY)
+		&& strcmp(name, LIBIMOBILEDEVICE_ROOT_CERTIF) && strcmp(name, LIBIMOBILEDEVICE_HOST_CERTIF);
+}
+
+/**
+ * Gets the cached set of paired devices, reading the config directory
+ * again if it has changed. The caller must hold userpref_cache_mutex.
+ */
+static GHashTable *userpref_get_paired_devices(void)
+{
+	struct userpref_file_stamp stamp;
+	GDir *config_dir;
+	gchar *config_path;
+	const gchar *dir_file;
+
+	userpref_get_file_stamp(NULL, &stamp);
+	if (cached_paired_devices && userpref_file_stamp_valid(&cached_paired_devices_stamp, &stamp, cached_paired_devices_time)) {
+		return cached_paired_devices;
+	}
+
+	if (cached_paired_devices) {
+		g_hash_table_destroy(cached_paired_devices);
+	}
+	cached_paired_devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	cached_paired_devices_time = time(NULL);
+	cached_paired_devices_stamp = stamp;
+
+	config_path = g_build_path(G_DIR_SEPARATOR_S, g_get_user_config_dir(), LIBIMOBILEDEVICE_CONF_DIR, NULL);
+	config_dir = g_dir_open(config_path,0,NULL);
+	if (config_dir) {
+		while ((dir_file = g_dir_read_name(config_dir))) {
+			if (userpref_is_device_record(dir_file)) {
+				g_hash_table_replace(cached_paired_devices, g_strndup(dir_file, strlen(dir_file)-4), GINT_TO_POINTER(1));
+			}
+		}
+		g_dir_close(config_dir);
+	}
+	g_free(config_path);
+
+	return cached_paired_devices;
+}
+
+/**
+ * Forgets the cached set of paired devices.
+ */
+static void userpref_invalidate_paired_devices(void)
+{
+	g_static_mutex_lock(&userpref_cache_mutex);
+	if (cached_paired_devices) {
+		g_hash_table_destroy(cached_paired_devices);
+		cached_paired_devices = NULL;
+	}
+	g_static_mutex_unlock(&userpref_cache_mutex);
+}
+
 /**
  * Determines whether this device has been connected to this system before.
  *
@@ -173,15 +298,15 @@ void userpref_get_host_id(char **host_id)
 int userpref_has_device_public_key(const char *uuid)
 {
 	int ret = 0;
-	gchar *config_file;
 
-	/* first get config file */
-	gchar *device_file = g_strconcat(uuid, ".pem", NULL);
-	config_file = g_build_path(G_DIR_SEPARATOR_S, g_get_user_config_dir(), LIBIMOBILEDEVICE_CONF_DIR, device_file, NULL);
-	if (g_file_test(config_file, (G_FILE_TEST_EXISTS | G_FILE_TEST_IS_REGULAR)))
+	if (!uuid)
+		return 0;
+
+	g_static_mutex_lock(&userpref_cache_mutex);
+	if (g_hash_table_lookup(userpref_get_paired_devices(), uuid))
 		ret = 1;
-	g_free(config_file);
-	g_free(device_file);
+	g_static_mutex_unlock(&userpref_cache_mutex);
+
 	return ret;
 }
 
@@ -223,7 +348,7 @@ userpref_error_t userpref_get_paired_uuids(char ***list, unsigned int *count)
 	config_dir = g_dir_open(config_path,0,NULL);
 	if (config_dir) {
 		while ((dir_file = g_dir_read_name(config_dir))) {
-			if (g_str_has_suffix(dir_file, ".pem") && (strlen(dir_file) == 44)) {
+			if (userpref_is_device_record(dir_file)) {
 				uuids = g_list_append(uuids, g_strndup(dir_file, strlen(dir_file)-4));
 				found++;
 			}
@@ -276,6 +401,8 @@ userpref_error_t userpref_set_device_public_key(const char *uuid, gnutls_datum_t
 	g_free(pem);
 	g_free(device_file);
 
+	userpref_invalidate_paired_devices();
+
 	return USERPREF_E_SUCCESS;
 }
 
@@ -301,6 +428,8 @@ userpref_error_t userpref_remove_device_public_key(const char *uuid)
 	g_free(pem);
 	g_free(device_file);
 
+	userpref_invalidate_paired_devices();
+
 	return USERPREF_E_SUCCESS;
 }
 
@@ -336,6 +465,15 @@ static int userpref_get_file_contents(const char *file, gnutls_datum_t * data)
 	return success;
 }
 
+/**
+ * Thread function generating one of the two host RSA keys.
+ */
+static gpointer userpref_gen_key_thread(gpointer data)
+{
+	gnutls_x509_privkey_generate((gnutls_x509_privkey_t)data, GNUTLS_PK_RSA, 2048, 0);
+	return NULL;
+}
+
 /**
  * Private function which generate private keys and certificates.
  *
@@ -349,8 +487,10 @@ static userpref_error_t userpref_gen_keys_and_cert(void)
 	gnutls_x509_crt_t root_cert;
 	gnutls_x509_privkey_t host_privkey;
 	gnutls_x509_crt_t host_cert;
+	GThread *keygen = NULL;
 
-	gnutls_global_deinit();
+	/* this may run while other connections use gnutls, so the global
+	 * state must not be torn down here */
 	gnutls_global_init();
 
 	//use less secure random to speed up key generation
@@ -362,9 +502,15 @@ static userpref_error_t userpref_gen_keys_and_cert(void)
 	gnutls_x509_crt_init(&root_cert);
 	gnutls_x509_crt_init(&host_cert);
 
-	/* generate root key */
+	/* generate the root and the host key at the same time */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+	keygen = g_thread_create(userpref_gen_key_thread, host_privkey, TRUE, NULL);
 	gnutls_x509_privkey_generate(root_privkey, GNUTLS_PK_RSA, 2048, 0);
-	gnutls_x509_privkey_generate(host_privkey, GNUTLS_PK_RSA, 2048, 0);
+	if (keygen)
+		g_thread_join(keygen);
+	else
+		gnutls_x509_privkey_generate(host_privkey, GNUTLS_PK_RSA, 2048, 0);
 
 	/* generate certificates */
 	gnutls_x509_crt_set_key(root_cert, root_privkey);
@@ -429,9 +575,12 @@ static userpref_error_t userpref_gen_keys_and_cert(void)
 	gnutls_free(host_key_pem.data);
 	gnutls_free(host_cert_pem.data);
 
-	//restore gnutls env
+	gnutls_x509_crt_deinit(root_cert);
+	gnutls_x509_crt_deinit(host_cert);
+	gnutls_x509_privkey_deinit(root_privkey);
+	gnutls_x509_privkey_deinit(host_privkey);
+
 	gnutls_global_deinit();
-	gnutls_global_init();
 
 	return ret;
 }
@@ -533,6 +682,161 @@ userpref_error_t userpref_get_keys_and_certs(gnutls_x509_privkey_t root_privkey,
 	return ret;
 }
 
+/**
+ * Releases a reference to host keys and certificates obtained with
+ * userpref_get_credentials().
+ *
+ * @param credentials The credentials to release.
+ */
+void userpref_release_credentials(userpref_credentials_t credentials)
+{
+	if (!credentials || !g_atomic_int_dec_and_test(&credentials->refcount))
+		return;
+
+	gnutls_x509_privkey_deinit(credentials->root_privkey);
+	gnutls_x509_crt_deinit(credentials->root_cert);
+	gnutls_x509_privkey_deinit(credentials->host_privkey);
+	gnutls_x509_crt_deinit(credentials->host_cert);
+	gnutls_free(credentials->root_cert_pem.data);
+	gnutls_free(credentials->host_cert_pem.data);
+	free(credentials);
+}
+
+/**
+ * Private function which exports a certificate in PEM format.
+ *
+ * @return 1 if the certificate was exported, 0 otherwise
+ */
+static int userpref_export_crt(gnutls_x509_crt_t cert, gnutls_datum_t *pem)
+{
+	size_t export_size = 0;
+
+	gnutls_x509_crt_export(cert, GNUTLS_X509_FMT_PEM, NULL, &export_size);
+	if (export_size == 0)
+		return 0;
+	pem->data = gnutls_malloc(export_size);
+	if (GNUTLS_E_SUCCESS != gnutls_x509_crt_export(cert, GNUTLS_X509_FMT_PEM, pem->data, &export_size)) {
+		gnutls_free(pem->data);
+		pem->data = NULL;
+		return 0;
+	}
+	pem->size = export_size;
+	return 1;
+}
+
+/**
+ * Function to retrieve host keys and certificates shared by all callers.
+ *
+ * The keys and certificates are only read and parsed again after one of
+ * their files has changed. Like userpref_get_keys_and_certs() this
+ * triggers key generation if they do not exist yet or are invalid.
+ * The returned objects must not be modified.
+ *
+ * @param credentials Set to a reference to the keys and certificates that
+ *     must be released with userpref_release_credentials().
+ *
+ * @return USERPREF_E_SUCCESS on success or an USERPREF_E_* error value.
+ */
+userpref_error_t userpref_get_credentials(userpref_credentials_t *credentials)
+{
+	struct userpref_file_stamp stamps[4];
+	userpref_credentials_t creds = NULL;
+	userpref_error_t ret = USERPREF_E_SUCCESS;
+	int i, valid = 1;
+
+	if (!credentials)
+		return USERPREF_E_INVALID_ARG;
+
+	g_static_mutex_lock(&userpref_cache_mutex);
+
+	for (i = 0; i < 4; i++) {
+		if (!userpref_get_file_stamp(userpref_credential_files[i], &stamps[i]) || !userpref_file_stamp_valid(&cached_credentials_stamps[i], &stamps[i], cached_credentials_time))
+			valid = 0;
+	}
+	if (cached_credentials && valid) {
+		g_atomic_int_inc(&cached_credentials->refcount);
+		*credentials = cached_credentials;
+		g_static_mutex_unlock(&userpref_cache_mutex);
+		return USERPREF_E_SUCCESS;
+	}
+
+	debug_info("loading keys and certificates");
+	creds = (userpref_credentials_t)calloc(1, sizeof(struct userpref_credentials));
+	creds->refcount = 1;
+	gnutls_x509_privkey_init(&creds->root_privkey);
+	gnutls_x509_crt_init(&creds->root_cert);
+	gnutls_x509_privkey_init(&creds->host_privkey);
+	gnutls_x509_crt_init(&creds->host_cert);
+
+	cached_credentials_time = time(NULL);
+	ret = userpref_get_keys_and_certs(creds->root_privkey, creds->root_cert, creds->host_privkey, creds->host_cert);
+	if (ret == USERPREF_E_SUCCESS && (!userpref_export_crt(creds->root_cert, &creds->root_cert_pem) || !userpref_export_crt(creds->host_cert, &creds->host_cert_pem)))
+		ret = USERPREF_E_SSL_ERROR;
+	if (ret != USERPREF_E_SUCCESS) {
+		userpref_release_credentials(creds);
+		g_static_mutex_unlock(&userpref_cache_mutex);
+		return ret;
+	}
+
+	/* the files might just have been generated */
+	for (i = 0; i < 4; i++) {
+		userpref_get_file_stamp(userpref_credential_files[i], &cached_credentials_stamps[i]);
+	}
+	userpref_release_credentials(cached_credentials);
+	cached_credentials = creds;
+
+	g_atomic_int_inc(&creds->refcount);
+	*credentials = creds;
+
+	g_static_mutex_unlock(&userpref_cache_mutex);
+
+	return USERPREF_E_SUCCESS;
+}
+
+/**
+ * Thread function loading the shared credentials into the cache.
+ */
+static gpointer userpref_prepare_credentials_thread(gpointer data)
+{
+	userpref_credentials_t creds = NULL;
+
+	if (USERPREF_E_SUCCESS == userpref_get_credentials(&creds))
+		userpref_release_credentials(creds);
+	g_atomic_int_set(&preparing_credentials, 0);
+	return NULL;
+}
+
+/**
+ * Starts loading the host keys and certificates in the background, which
+ * includes generating them when they do not exist yet.
+ *
+ * Key generation takes a few seconds, so starting it before the first
+ * device needs to be paired hides that delay behind the connection setup.
+ * Callers of userpref_get_credentials() during the generation wait for
+ * its result instead of generating keys of their own. Does nothing when
+ * the credentials are already loaded or are being loaded.
+ */
+void userpref_prepare_credentials(void)
+{
+	GThread *thread;
+
+	g_static_mutex_lock(&userpref_cache_mutex);
+	if (cached_credentials) {
+		g_static_mutex_unlock(&userpref_cache_mutex);
+		return;
+	}
+	g_static_mutex_unlock(&userpref_cache_mutex);
+
+	if (!g_atomic_int_compare_and_exchange(&preparing_credentials, 0, 1))
+		return;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+	thread = g_thread_create(userpref_prepare_credentials_thread, NULL, FALSE, NULL);
+	if (!thread)
+		g_atomic_int_set(&preparing_credentials, 0);
+}
+
 /**
  * Function to retrieve certificates encoded in PEM format.
  *
@@ -34,6 +34,22 @@
 
 typedef int16_t userpref_error_t;
 
+/** Parsed host keys and certificates shared by all connections */
+struct userpref_credentials {
+	volatile gint refcount;
+	gnutls_x509_privkey_t root_privkey;
+	gnutls_x509_crt_t root_cert;
+	gnutls_x509_privkey_t host_privkey;
+	gnutls_x509_crt_t host_cert;
+	gnutls_datum_t root_cert_pem;
+	gnutls_datum_t host_cert_pem;
+};
+typedef struct userpref_credentials *userpref_credentials_t;
+
+G_GNUC_INTERNAL userpref_error_t userpref_get_credentials(userpref_credentials_t *credentials);
+G_GNUC_INTERNAL void userpref_release_credentials(userpref_credentials_t credentials);
+G_GNUC_INTERNAL void userpref_prepare_credentials(void);
+
 G_GNUC_INTERNAL userpref_error_t userpref_get_keys_and_certs(gnutls_x509_privkey_t root_privkey, gnutls_x509_crt_t root_crt, gnutls_x509_privkey_t host_privkey, gnutls_x509_crt_t host_crt);
 G_GNUC_INTERNAL userpref_error_t userpref_set_keys_and_certs(gnutls_datum_t * root_key, gnutls_datum_t * root_cert, gnutls_datum_t * host_key, gnutls_datum_t * host_cert);
 G_GNUC_INTERNAL userpref_error_t userpref_get_certs_as_pem(gnutls_datum_t *pem_root_cert, gnutls_datum_t *pem_host_cert);
@@ -7,6 +7,8 @@
  #include <libimobiledevice/lockdown.h>
  #include <libimobiledevice/mobilesync.h>
  #include <libimobiledevice/notification_proxy.h>
+ #include <libimobiledevice/afc.h>
+ #include <libimobiledevice/mobilebackup2.h>
  #include <plist/plist.h>
  #include <plist/plist++.h>
  #include "../src/debug.h"
@@ -30,6 +32,26 @@ typedef struct {
     np_client_t client;
 } NotificationProxy;
 
+typedef struct {
+    idevice* dev;
+    afc_client_t client;
+} AFC;
+
+typedef struct {
+    idevice* dev;
+    mobilebackup2_client_t client;
+} MobileBackup2;
+
+/* release the interpreter lock around calls that block on the device,
+ * so that other Python threads keep running */
+#ifdef SWIGPYTHON
+#define BEGIN_BLOCKING_CALL Py_BEGIN_ALLOW_THREADS
+#define END_BLOCKING_CALL Py_END_ALLOW_THREADS
+#else
+#define BEGIN_BLOCKING_CALL {
+#define END_BLOCKING_CALL }
+#endif
+
 //now declare funtions to handle creation and deletion of objects
 static void my_delete_idevice(idevice* dev) {
 	if (dev) {
@@ -41,9 +63,13 @@ static void my_delete_idevice(idevice* dev) {
 static Lockdownd* my_new_Lockdownd(idevice* device) {
     if (!device) return NULL;
     Lockdownd* client = (Lockdownd*) malloc(sizeof(Lockdownd));
+    lockdownd_error_t err;
     client->dev = device;
     client->client = NULL;
-    if (LOCKDOWN_E_SUCCESS == lockdownd_client_new_with_handshake(device->dev , &(client->client), NULL)) {
+    BEGIN_BLOCKING_CALL
+    err = lockdownd_client_new_with_handshake(device->dev , &(client->client), NULL);
+    END_BLOCKING_CALL
+    if (LOCKDOWN_E_SUCCESS == err) {
         return client;
     }
     else {
@@ -59,15 +85,27 @@ static void my_delete_Lockdownd(Lockdownd* lckd) {
     }
 }
 
+/* starts a service, returns its port or 0 */
+static uint16_t my_start_service(Lockdownd* lckd, const char* service) {
+	uint16_t port = 0;
+	lockdownd_error_t err;
+	BEGIN_BLOCKING_CALL
+	err = lockdownd_start_service(lckd->client, service, &port);
+	END_BLOCKING_CALL
+	return (LOCKDOWN_E_SUCCESS == err) ? port : 0;
+}
+
 static MobileSync* my_new_MobileSync(Lockdownd* lckd) {
 	if (!lckd || !lckd->dev) return NULL;
 	MobileSync* client = NULL;
-	uint16_t port = 0;
-	if (LOCKDOWN_E_SUCCESS == lockdownd_start_service(lckd->client, "com.apple.mobilesync", &port)) {
+	uint16_t port = my_start_service(lckd, "com.apple.mobilesync");
+	if (port) {
 		client = (MobileSync*) malloc(sizeof(MobileSync));
 		client->dev = lckd->dev;
 		client->client = NULL;
+		BEGIN_BLOCKING_CALL
 		mobilesync_client_new(lckd->dev->dev, port, &(client->client));
+		END_BLOCKING_CALL
 	}
 	return client;
 }
@@ -75,8 +113,8 @@ static MobileSync* my_new_MobileSync(Lockdownd* lckd) {
 static NotificationProxy* my_new_NotificationProxy(Lockdownd* lckd) {
     if (!lckd || !lckd->dev) return NULL;
     NotificationProxy* client = NULL;
-    uint16_t port = 0;
-	if (LOCKDOWN_E_SUCCESS == lockdownd_start_service(lckd->client, "com.apple.mobile.notification_proxy", &port)) {
+    uint16_t port = my_start_service(lckd, "com.apple.mobile.notification_proxy");
+	if (port) {
         client = (NotificationProxy*) malloc(sizeof(NotificationProxy));
         client->dev = lckd->dev;
         client->client = NULL;
@@ -85,6 +123,46 @@ static NotificationProxy* my_new_NotificationProxy(Lockdownd* lckd) {
     return client;
 }
 
+static AFC* my_new_AFC(Lockdownd* lckd) {
+	if (!lckd || !lckd->dev) return NULL;
+	AFC* client = NULL;
+	afc_error_t err = AFC_E_UNKNOWN_ERROR;
+	uint16_t port = my_start_service(lckd, "com.apple.afc");
+	if (port) {
+		client = (AFC*) malloc(sizeof(AFC));
+		client->dev = lckd->dev;
+		client->client = NULL;
+		BEGIN_BLOCKING_CALL
+		err = afc_client_new(lckd->dev->dev, port, &(client->client));
+		END_BLOCKING_CALL
+		if (err != AFC_E_SUCCESS) {
+			free(client);
+			client = NULL;
+		}
+	}
+	return client;
+}
+
+static MobileBackup2* my_new_MobileBackup2(Lockdownd* lckd) {
+	if (!lckd || !lckd->dev) return NULL;
+	MobileBackup2* client = NULL;
+	mobilebackup2_error_t err = MOBILEBACKUP2_E_UNKNOWN_ERROR;
+	uint16_t port = my_start_service(lckd, "com.apple.mobilebackup2");
+	if (port) {
+		client = (MobileBackup2*) malloc(sizeof(MobileBackup2));
+		client->dev = lckd->dev;
+		client->client = NULL;
+		BEGIN_BLOCKING_CALL
+		err = mobilebackup2_client_new(lckd->dev->dev, port, &(client->client));
+		END_BLOCKING_CALL
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			free(client);
+			client = NULL;
+		}
+	}
+	return client;
+}
+
 static PList::Node* new_node_from_plist(plist_t node)
 {
 	PList::Node* ret = NULL;
@@ -124,6 +202,8 @@ static PList::Node* new_node_from_plist(plist_t node)
 #ifdef SWIGPYTHON
 static void NotificationProxyPythonCallback(const char *notification, void* user_data) {
     PyObject *func, *arglist;
+    /* called from the notification thread, which doesn't hold the GIL */
+    PyGILState_STATE gstate = PyGILState_Ensure();
 
     func = (PyObject *) user_data;
     arglist = Py_BuildValue("(s)",notification);
@@ -131,10 +211,33 @@ static void NotificationProxyPythonCallback(const char *notification, void* user
     PyEval_CallObject(func, arglist);
 
     Py_DECREF(arglist);
+    PyGILState_Release(gstate);
+}
+
+/* turns a NULL terminated string list into a Python list and frees it */
+static PyObject* my_string_list_to_python(char** list) {
+	PyObject* res = PyList_New(0);
+	int i;
+	if (!list) return res;
+	for (i = 0; list[i]; i++) {
+		PyObject* str = PyString_FromString(list[i]);
+		PyList_Append(res, str);
+		Py_DECREF(str);
+		free(list[i]);
+	}
+	free(list);
+	return res;
 }
 #endif
  %}
 
+#ifdef SWIGPYTHON
+%init %{
+	/* callbacks and threads calling back into Python need this */
+	PyEval_InitThreads();
+%}
+#endif
+
 /* Parse the header file to generate wrappers */
 %include "stdint.i"
 %include "cstring.i"
@@ -191,6 +294,29 @@ static void NotificationProxyPythonCallback(const char *notification, void* user
 %typemap(freearg) (const char **string_list) {
     free((char *) $1);
 }
+
+/* reads go straight into a writable buffer object (bytearray, memoryview
+ * and the like), writes take any readable one; no copies are made */
+%typemap(in) (char *buffer, uint32_t length) (Py_buffer view) {
+    if (PyObject_GetBuffer($input, &view, PyBUF_WRITABLE | PyBUF_SIMPLE) != 0) {
+        return NULL;
+    }
+    $1 = (char *) view.buf;
+    $2 = (uint32_t) view.len;
+}
+%typemap(freearg) (char *buffer, uint32_t length) {
+    PyBuffer_Release(&view$argnum);
+}
+%typemap(in) (const char *data, uint32_t length) (Py_buffer view) {
+    if (PyObject_GetBuffer($input, &view, PyBUF_SIMPLE) != 0) {
+        return NULL;
+    }
+    $1 = (char *) view.buf;
+    $2 = (uint32_t) view.len;
+}
+%typemap(freearg) (const char *data, uint32_t length) {
+    PyBuffer_Release(&view$argnum);
+}
 #endif
 
  typedef struct {
@@ -212,6 +338,16 @@ typedef struct {
     np_client_t client;
 } NotificationProxy;
 
+typedef struct {
+    idevice* dev;
+    afc_client_t client;
+} AFC;
+
+typedef struct {
+    idevice* dev;
+    mobilebackup2_client_t client;
+} MobileBackup2;
+
 
 %extend idevice {             // Attach these functions to struct idevice
 	idevice() {
@@ -262,12 +398,17 @@ typedef struct {
 	}
 
 	void send(PList::Node* node) {
-		lockdownd_send($self->client, node->GetPlist());
+		plist_t plist = node->GetPlist();
+		BEGIN_BLOCKING_CALL
+		lockdownd_send($self->client, plist);
+		END_BLOCKING_CALL
 	}
 
 	PList::Node* receive() {
 		plist_t node = NULL;
+		BEGIN_BLOCKING_CALL
 		lockdownd_receive($self->client, &node);
+		END_BLOCKING_CALL
 		return new_node_from_plist(node);
 	}
 
@@ -278,6 +419,14 @@ typedef struct {
     NotificationProxy* get_notification_proxy_client() {
         return my_new_NotificationProxy($self);
     }
+
+	AFC* get_afc_client() {
+		return my_new_AFC($self);
+	}
+
+	MobileBackup2* get_mobilebackup2_client() {
+		return my_new_MobileBackup2($self);
+	}
 };
 
 %extend MobileSync {             // Attach these functions to struct MobileSync
@@ -291,16 +440,214 @@ typedef struct {
 	}
 
 	void send(PList::Node* node) {
-		mobilesync_send($self->client, node->GetPlist());
+		plist_t plist = node->GetPlist();
+		BEGIN_BLOCKING_CALL
+		mobilesync_send($self->client, plist);
+		END_BLOCKING_CALL
 	}
 
 	PList::Node* receive() {
 		plist_t node = NULL;
+		BEGIN_BLOCKING_CALL
 		mobilesync_receive($self->client, &node);
+		END_BLOCKING_CALL
 		return new_node_from_plist(node);
 	}
 };
 
+#define AFC_FOPEN_RDONLY   0x00000001
+#define AFC_FOPEN_RW       0x00000002
+#define AFC_FOPEN_WRONLY   0x00000003
+#define AFC_FOPEN_WR       0x00000004
+#define AFC_FOPEN_APPEND   0x00000005
+#define AFC_FOPEN_RDAPPEND 0x00000006
+
+/* Methods returning a byte count return a negative value on failure: the
+ * negated error code for AFC, the (already negative) one for MobileBackup2.
+ * The other methods return the error code itself. */
+%extend AFC {
+	AFC(Lockdownd* lckd) {
+		return my_new_AFC(lckd);
+	}
+
+	~AFC() {
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		afc_client_free(client);
+		END_BLOCKING_CALL
+		free($self);
+	}
+
+	int16_t set_pipeline_depth(uint32_t depth) {
+		return afc_client_set_pipeline_depth($self->client, depth);
+	}
+
+	int16_t set_multiplexing(int enable) {
+		return afc_client_set_multiplexing($self->client, enable);
+	}
+
+	uint64_t file_open(const char* filename, int mode) {
+		uint64_t handle = 0;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		afc_file_open(client, filename, (afc_file_mode_t)mode, &handle);
+		END_BLOCKING_CALL
+		return handle;
+	}
+
+	int16_t file_close(uint64_t handle) {
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_file_close(client, handle);
+		END_BLOCKING_CALL
+		return err;
+	}
+
+	int64_t file_read_into(uint64_t handle, char *buffer, uint32_t length) {
+		uint32_t bytes = 0;
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_file_read(client, handle, buffer, length, &bytes);
+		END_BLOCKING_CALL
+		return (err == AFC_E_SUCCESS) ? (int64_t)bytes : -(int64_t)err;
+	}
+
+	int64_t file_write(uint64_t handle, const char *data, uint32_t length) {
+		uint32_t bytes = 0;
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_file_write(client, handle, data, length, &bytes);
+		END_BLOCKING_CALL
+		return (err == AFC_E_SUCCESS) ? (int64_t)bytes : -(int64_t)err;
+	}
+
+	int16_t file_seek(uint64_t handle, int64_t offset, int whence) {
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_file_seek(client, handle, offset, whence);
+		END_BLOCKING_CALL
+		return err;
+	}
+
+	int16_t remove_path(const char* path) {
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_remove_path(client, path);
+		END_BLOCKING_CALL
+		return err;
+	}
+
+	int16_t rename_path(const char* from, const char* to) {
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_rename_path(client, from, to);
+		END_BLOCKING_CALL
+		return err;
+	}
+
+	int16_t make_directory(const char* dir) {
+		afc_error_t err;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = afc_make_directory(client, dir);
+		END_BLOCKING_CALL
+		return err;
+	}
+};
+
+#ifdef SWIGPYTHON
+%extend AFC {
+	PyObject* read_directory(const char* dir) {
+		char** list = NULL;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		afc_read_directory(client, dir, &list);
+		END_BLOCKING_CALL
+		return my_string_list_to_python(list);
+	}
+
+	PyObject* get_file_info(const char* path) {
+		char** list = NULL;
+		afc_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		afc_get_file_info(client, path, &list);
+		END_BLOCKING_CALL
+		return my_string_list_to_python(list);
+	}
+};
+#endif
+
+%extend MobileBackup2 {
+	MobileBackup2(Lockdownd* lckd) {
+		return my_new_MobileBackup2(lckd);
+	}
+
+	~MobileBackup2() {
+		mobilebackup2_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		mobilebackup2_client_free(client);
+		END_BLOCKING_CALL
+		free($self);
+	}
+
+	int16_t send_request(const char* request, const char* target_identifier, const char* source_identifier, PList::Node* options) {
+		mobilebackup2_error_t err;
+		mobilebackup2_client_t client = $self->client;
+		plist_t plist = options ? options->GetPlist() : NULL;
+		BEGIN_BLOCKING_CALL
+		err = mobilebackup2_send_request(client, request, target_identifier, source_identifier, plist);
+		END_BLOCKING_CALL
+		return err;
+	}
+
+	int16_t send_status_response(int status_code, const char* status1, PList::Node* status2) {
+		mobilebackup2_error_t err;
+		mobilebackup2_client_t client = $self->client;
+		plist_t plist = status2 ? status2->GetPlist() : NULL;
+		BEGIN_BLOCKING_CALL
+		err = mobilebackup2_send_status_response(client, status_code, status1, plist);
+		END_BLOCKING_CALL
+		return err;
+	}
+
+	PList::Node* receive_message() {
+		plist_t node = NULL;
+		char* dlmessage = NULL;
+		mobilebackup2_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		mobilebackup2_receive_message(client, &node, &dlmessage);
+		END_BLOCKING_CALL
+		free(dlmessage);
+		return new_node_from_plist(node);
+	}
+
+	int64_t receive_raw_into(char *buffer, uint32_t length) {
+		uint32_t bytes = 0;
+		mobilebackup2_error_t err;
+		mobilebackup2_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = mobilebackup2_receive_raw(client, buffer, length, &bytes);
+		END_BLOCKING_CALL
+		return (err == MOBILEBACKUP2_E_SUCCESS) ? (int64_t)bytes : (int64_t)err;
+	}
+
+	int64_t send_raw(const char *data, uint32_t length) {
+		uint32_t bytes = 0;
+		mobilebackup2_error_t err;
+		mobilebackup2_client_t client = $self->client;
+		BEGIN_BLOCKING_CALL
+		err = mobilebackup2_send_raw(client, data, length, &bytes);
+		END_BLOCKING_CALL
+		return (err == MOBILEBACKUP2_E_SUCCESS) ? (int64_t)bytes : (int64_t)err;
+	}
+};
+
 #define NP_SYNC_WILL_START           "com.apple.itunes-mobdev.syncWillStart"
 #define NP_SYNC_DID_START            "com.apple.itunes-mobdev.syncDidStart"
 #define NP_SYNC_DID_FINISH           "com.apple.itunes-mobdev.syncDidFinish"
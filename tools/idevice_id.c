@@ -1,12 +1,75 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <glib.h>
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 
 #define MODE_NONE 0
 #define MODE_SHOW_ID 1
 #define MODE_LIST_DEVICES 2
+#define MODE_LIST_NAMES 3
+
+/** Number of devices queried at the same time by --names */
+#define PARALLEL_QUERIES 8
+
+/** A device whose name is queried by --names */
+struct device_name_query {
+	char *uuid;
+	char *name;
+};
+
+static void query_device_name(gpointer data, gpointer user_data)
+{
+	struct device_name_query *query = (struct device_name_query *)data;
+	idevice_t phone = NULL;
+	lockdownd_client_t client = NULL;
+
+	if (idevice_new(&phone, query->uuid) != IDEVICE_E_SUCCESS)
+		return;
+	if (lockdownd_client_new(phone, &client, "idevice_id") == LOCKDOWN_E_SUCCESS) {
+		lockdownd_get_device_name(client, &query->name);
+		lockdownd_client_free(client);
+	}
+	idevice_free(phone);
+}
+
+/**
+ * Prints the UUID and name of every attached device. The names are
+ * queried on several threads at once.
+ */
+static int list_device_names()
+{
+	struct device_name_query *queries;
+	GThreadPool *pool;
+	char **dev_list = NULL;
+	int count = 0;
+	int i;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (idevice_get_device_list(&dev_list, &count) < 0) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return -1;
+	}
+
+	queries = (struct device_name_query *)calloc(count ? count : 1, sizeof(struct device_name_query));
+	pool = g_thread_pool_new(query_device_name, NULL, PARALLEL_QUERIES, TRUE, NULL);
+	for (i = 0; i < count; i++) {
+		queries[i].uuid = dev_list[i];
+		g_thread_pool_push(pool, &queries[i], NULL);
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (i = 0; i < count; i++) {
+		printf("%s %s\n", queries[i].uuid, queries[i].name ? queries[i].name : "(unknown)");
+		free(queries[i].name);
+	}
+	free(queries);
+	idevice_device_list_free(dev_list);
+	return 0;
+}
 
 static void print_usage(int argc, char **argv)
 {
@@ -18,6 +81,7 @@ static void print_usage(int argc, char **argv)
 	printf("  The UUID is a 40-digit hexadecimal number of the device\n");
 	printf("  for which the name should be retrieved.\n\n");
 	printf("  -l, --list\t\tlist UUID of all attached devices\n");
+	printf("  -n, --names\t\tlist UUID and name of all attached devices\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
@@ -45,6 +109,10 @@ int main(int argc, char **argv)
 			mode = MODE_LIST_DEVICES;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--names")) {
+			mode = MODE_LIST_NAMES;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -92,6 +160,8 @@ int main(int argc, char **argv)
 		}
 
 		return ret;
+	case MODE_LIST_NAMES:
+		return list_device_names();
 	case MODE_LIST_DEVICES:
 	default:
 		if (idevice_get_device_list(&dev_list, &i) < 0) {
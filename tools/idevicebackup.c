@@ -25,9 +25,12 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <pthread.h>
 #include <glib.h>
 #include <gcrypt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -41,6 +44,9 @@
 #define LOCK_ATTEMPTS 50
 #define LOCK_WAIT 200000
 
+/* libgcrypt before 1.6 needs locking callbacks to be used from threads */
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
 static mobilebackup_client_t mobilebackup = NULL;
 static lockdownd_client_t client = NULL;
 static idevice_t phone = NULL;
@@ -80,6 +86,9 @@ static int compare_hash(const unsigned char *hash1, const unsigned char *hash2,
 	return 1;
 }
 
+/** Buffer size for hashing files that can't be mapped */
+#define HASH_BUFFER_SIZE (1024 * 1024)
+
 static void compute_datahash(const char *path, const char *destpath, uint8_t greylist, const char *domain, const char *appid, const char *version, unsigned char *hash_out)
 {
 	gcry_md_hd_t hd = NULL;
@@ -90,14 +99,26 @@ static void compute_datahash(const char *path, const char *destpath, uint8_t gre
 	}
 	gcry_md_reset(hd);
 
-	FILE *f = fopen(path, "rb");
-	if (f) {
-		unsigned char buf[16384];
-		size_t len;
-		while ((len = fread(buf, 1, 16384, f)) > 0) {
-			gcry_md_write(hd, buf, len);
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		struct stat fst;
+		void *map = MAP_FAILED;
+		if ((fstat(fd, &fst) == 0) && (fst.st_size > 0)) {
+			map = mmap(NULL, fst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		if (map != MAP_FAILED) {
+			madvise(map, fst.st_size, MADV_SEQUENTIAL);
+			gcry_md_write(hd, map, fst.st_size);
+			munmap(map, fst.st_size);
+		} else {
+			unsigned char *buf = (unsigned char*)malloc(HASH_BUFFER_SIZE);
+			ssize_t len;
+			while ((len = read(fd, buf, HASH_BUFFER_SIZE)) > 0) {
+				gcry_md_write(hd, buf, len);
+			}
+			free(buf);
 		}
-		fclose(f);
+		close(fd);
 		gcry_md_write(hd, destpath, strlen(destpath));
 		gcry_md_write(hd, ";", 1);
 		if (greylist == 1) {
@@ -459,7 +480,7 @@ static int mobilebackup_delete_backup_file_by_hash(const char *backup_directory,
 	return ret;
 }
 
-static int mobilebackup_check_file_integrity(const char *backup_directory, const char *hash, plist_t filedata)
+static int mobilebackup_check_file_integrity(const char *backup_directory, const char *hash, plist_t filedata, const char **reason)
 {
 	char *datapath;
 	char *infopath;
@@ -472,6 +493,7 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 		printf("\r\n");
 		printf("ERROR: '%s.mddata' is missing!\n", hash);
 		free(datapath);
+		*reason = "mddata missing";
 		return 0;
 	}
 
@@ -482,6 +504,7 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 		printf("\r\n");
 		printf("ERROR: '%s.mdinfo' is missing or corrupted!\n", hash);
 		free(datapath);
+		*reason = "mdinfo missing or corrupted";
 		return 0;
 	}
 
@@ -492,6 +515,7 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 		printf("ERROR: Could not get DataHash for file entry '%s'\n", hash);
 		plist_free(mdinfo);
 		free(datapath);
+		*reason = "no DataHash in manifest";
 		return 0;
 	}
 
@@ -501,6 +525,7 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 		printf("ERROR: Could not find Metadata in plist '%s.mdinfo'\n", hash);
 		plist_free(mdinfo);
 		free(datapath);
+		*reason = "no Metadata in mdinfo";
 		return 0;
 	}
 
@@ -516,6 +541,7 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 		printf("ERROR: Could not get Metadata from plist '%s.mdinfo'\n", hash);
 		plist_free(mdinfo);
 		free(datapath);
+		*reason = "invalid Metadata in mdinfo";
 		return 0;
 	}
 
@@ -594,6 +620,8 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 	g_free(domain);
 	g_free(version);
 	g_free(destpath);
+	g_free(meta_bin);
+	plist_free(metadata);
 
 	if (!hash_ok) {
 		printf("\r\n");
@@ -603,6 +631,7 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 		printf("\nfilehash: ");
 		print_hash(file_hash, 20);
 		printf("\n");
+		*reason = "DataHash mismatch";
 		res = 0;
 	}
 	g_free(data_hash);
@@ -610,6 +639,147 @@ static int mobilebackup_check_file_integrity(const char *backup_directory, const
 	return res;
 }
 
+/** Maximum number of threads verifying backup files */
+#define VERIFY_MAX_THREADS 8
+
+struct verify_job {
+	char *hash;
+	plist_t filedata;
+	int result;
+	const char *reason;
+};
+
+struct verify_state {
+	const char *backup_directory;
+	GMutex *mutex;
+	GCond *cond;
+	int done;
+	int failed;
+	int stop_on_error;
+};
+
+static void mobilebackup_verify_worker(gpointer data, gpointer user_data)
+{
+	struct verify_job *job = (struct verify_job*)data;
+	struct verify_state *state = (struct verify_state*)user_data;
+	int skip;
+
+	g_mutex_lock(state->mutex);
+	skip = (state->failed && state->stop_on_error) || quit_flag;
+	g_mutex_unlock(state->mutex);
+
+	if (skip) {
+		job->result = -1;
+		job->reason = "not verified";
+	} else {
+		job->result = mobilebackup_check_file_integrity(state->backup_directory, job->hash, job->filedata, &job->reason);
+	}
+
+	g_mutex_lock(state->mutex);
+	state->done++;
+	if (job->result == 0) {
+		state->failed++;
+	}
+	g_cond_signal(state->cond);
+	g_mutex_unlock(state->mutex);
+}
+
+/**
+ * Verifies all files listed in the Files dictionary of a manifest on a
+ * pool of threads, so reading and parsing the .mdinfo plists and hashing
+ * the .mddata files of different entries overlap.
+ *
+ * @param backup_directory The backup directory.
+ * @param files The Files dictionary of the manifest.
+ * @param report_path If not NULL, a tab separated line with hash, verdict
+ *   and reason is written to this file for every entry, and all entries
+ *   are verified even after a failure.
+ *
+ * @return 1 if all files are valid, 0 otherwise.
+ */
+static int mobilebackup_verify_files(const char *backup_directory, plist_t files, const char *report_path)
+{
+	struct verify_state state;
+	struct verify_job *jobs;
+	GThreadPool *pool;
+	plist_dict_iter iter = NULL;
+	plist_t node = NULL;
+	char *hash = NULL;
+	uint32_t total_files = plist_dict_get_size(files);
+	uint32_t count = 0;
+	uint32_t i;
+	int threads;
+
+	if (total_files == 0)
+		return 1;
+
+	plist_dict_new_iter(files, &iter);
+	if (!iter)
+		return 0;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 2)
+		threads = 2;
+	else if (threads > VERIFY_MAX_THREADS)
+		threads = VERIFY_MAX_THREADS;
+
+	state.backup_directory = backup_directory;
+	state.mutex = g_mutex_new();
+	state.cond = g_cond_new();
+	state.done = 0;
+	state.failed = 0;
+	state.stop_on_error = (report_path == NULL);
+
+	jobs = (struct verify_job*)calloc(total_files, sizeof(struct verify_job));
+	pool = g_thread_pool_new(mobilebackup_verify_worker, &state, threads, TRUE, NULL);
+
+	plist_dict_next_item(files, iter, &hash, &node);
+	while (node && (count < total_files)) {
+		jobs[count].hash = hash;
+		jobs[count].filedata = node;
+		g_thread_pool_push(pool, &jobs[count], NULL);
+		count++;
+		hash = NULL;
+		node = NULL;
+		plist_dict_next_item(files, iter, &hash, &node);
+	}
+	free(hash);
+	free(iter);
+
+	/* report progress while the workers are busy */
+	g_mutex_lock(state.mutex);
+	while (state.done < (int)count) {
+		printf("Verifying file %d/%d (%d%%) \r", state.done, count, (state.done*100/count));
+		fflush(stdout);
+		g_cond_wait(state.cond, state.mutex);
+	}
+	g_mutex_unlock(state.mutex);
+	printf("Verifying file %d/%d (100%%) \n", count, count);
+
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	if (report_path) {
+		FILE *report = fopen(report_path, "w");
+		if (report) {
+			for (i = 0; i < count; i++) {
+				fprintf(report, "%s\t%s\t%s\n", jobs[i].hash, (jobs[i].result > 0) ? "OK" : ((jobs[i].result == 0) ? "FAILED" : "SKIPPED"), (jobs[i].result > 0) ? "" : jobs[i].reason);
+			}
+			fclose(report);
+		} else {
+			printf("ERROR: Could not write verification report to '%s'\n", report_path);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		free(jobs[i].hash);
+	}
+	free(jobs);
+	g_cond_free(state.cond);
+	g_mutex_free(state.mutex);
+
+	return (state.failed == 0) && !quit_flag;
+}
+
 static void do_post_notification(const char *notification)
 {
 	uint16_t nport = 0;
@@ -677,6 +847,7 @@ static void print_usage(int argc, char **argv)
 	printf("options:\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID\n");
+	printf("  --verify-report FILE\twrite the result of verifying each file to FILE\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
 }
@@ -691,6 +862,7 @@ int main(int argc, char *argv[])
 	int cmd = -1;
 	int is_full_backup = 0;
 	char *backup_directory = NULL;
+	const char *verify_report = NULL;
 	struct stat st;
 	plist_t node = NULL;
 	plist_t node_tmp = NULL;
@@ -703,6 +875,14 @@ int main(int argc, char *argv[])
 	enum device_link_file_status_t file_status = DEVICE_LINK_FILE_STATUS_NONE;
 	uint64_t c = 0;
 
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	/* the backup is verified from a pool of threads; this has to come
+	   before any other libgcrypt call */
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	gcry_check_version(NULL);
+
 	/* we need to exit cleanly on running backups and restores or we cause havok */
 	signal(SIGINT, clean_exit);
 	signal(SIGQUIT, clean_exit);
@@ -724,6 +904,15 @@ int main(int argc, char *argv[])
 			strcpy(uuid, argv[i]);
 			continue;
 		}
+		else if (!strcmp(argv[i], "--verify-report")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			verify_report = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -800,7 +989,6 @@ int main(int argc, char *argv[])
 	ret = lockdownd_start_service(client, NP_SERVICE_NAME, &port);
 	if ((ret == LOCKDOWN_E_SUCCESS) && port) {
 		np_client_new(phone, port, &np);
-		np_set_notify_callback(np, notify_cb, NULL);
 		const char *noties[5] = {
 			NP_SYNC_CANCEL_REQUEST,
 			NP_SYNC_SUSPEND_REQUEST,
@@ -808,7 +996,7 @@ int main(int argc, char *argv[])
 			NP_BACKUP_DOMAIN_CHANGED,
 			NULL
 		};
-		np_observe_notifications(np, noties);
+		np_observe_notifications_with_callback(np, noties, notify_cb, NULL);
 	} else {
 		printf("ERROR: Could not start service %s.\n", NP_SERVICE_NAME);
 	}
@@ -987,10 +1175,14 @@ int main(int argc, char *argv[])
 			char *format_size = NULL;
 			gboolean is_manifest = FALSE;
 			uint8_t b = 0;
+			const char *hunk_data = NULL;
+			uint64_t hunk_length = 0;
+			FILE *file_out = NULL;
 
 			/* process series of DLSendFile messages */
 			do {
-				mobilebackup_receive(mobilebackup, &message);
+				/* file data is written straight from the receive buffer */
+				mobilebackup_receive_with_data(mobilebackup, &message, &hunk_data, &hunk_length);
 				if (!message) {
 					printf("Device is not ready yet. Going to try again in 2 seconds...\n");
 					sleep(2);
@@ -1087,25 +1279,41 @@ int main(int argc, char *argv[])
 
 					filename_mddata = mobilebackup_build_path(backup_directory, file_path, is_manifest ? NULL: ".mddata");
 
-					/* if this is the first hunk, remove any existing file */
-					if ((hunk_index == 0) && (stat(filename_mddata, &st) == 0))
-						remove(filename_mddata);
+					/* if this is the first hunk, replace any existing file */
+					if (hunk_index == 0) {
+						if (file_out)
+							fclose(file_out);
+						file_out = fopen(filename_mddata, "wb");
+						if (!file_out)
+							printf("ERROR: Could not open '%s' for writing: %s\n", filename_mddata, strerror(errno));
+					}
 
-					/* get file data hunk */
-					node_tmp = plist_array_get_item(message, 1);
-					plist_get_data_val(node_tmp, &buffer, &length);
+					/* XML messages carry the file data hunk in the plist */
+					if (!hunk_data) {
+						node_tmp = plist_array_get_item(message, 1);
+						plist_get_data_val(node_tmp, &buffer, &length);
+						hunk_data = buffer;
+						hunk_length = length;
+					}
 
-					buffer_write_to_filename(filename_mddata, buffer, length);
+					if (file_out && (hunk_length > 0) && (fwrite(hunk_data, 1, hunk_length, file_out) != hunk_length))
+						printf("ERROR: Could not write to '%s': %s\n", filename_mddata, strerror(errno));
 					if (!is_manifest)
-						file_size_current += length;
+						file_size_current += hunk_length;
 
-					/* activate currently sent manifest */
-					if ((file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) && (is_manifest)) {
-						rename(filename_mddata, manifest_path);
+					if (file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) {
+						if (file_out) {
+							fclose(file_out);
+							file_out = NULL;
+						}
+						/* activate currently sent manifest */
+						if (is_manifest)
+							rename(filename_mddata, manifest_path);
 					}
 
 					free(buffer);
 					buffer = NULL;
+					hunk_data = NULL;
 
 					g_free(filename_mddata);
 				}
@@ -1154,6 +1362,9 @@ files_out:
 				}
 			} while (1);
 
+			if (file_out)
+				fclose(file_out);
+
 			printf("Received %d files from device.\n", file_index);
 
 			if (!quit_flag && !plist_strcmp(node, "DLMessageProcessMessage")) {
@@ -1268,37 +1479,12 @@ files_out:
 			}
 			plist_t files = plist_dict_get_item(backup_data, "Files");
 			if (files && (plist_get_node_type(files) == PLIST_DICT)) {
-				plist_dict_iter iter = NULL;
-				plist_dict_new_iter(files, &iter);
-				if (iter) {
-					/* loop over Files entries in Manifest data plist */
-					char *hash = NULL;
-					int file_ok = 0;
-					int total_files = plist_dict_get_size(files);
-					int cur_file = 1;
-					node = NULL;
-					plist_dict_next_item(files, iter, &hash, &node);
-					while (node) {
-						printf("Verifying file %d/%d (%d%%) \r", cur_file, total_files, (cur_file*100/total_files));
-						cur_file++;
-						/* make sure both .mddata/.mdinfo files are available for each entry */
-						file_ok = mobilebackup_check_file_integrity(backup_directory, hash, node);
-						node = NULL;
-						free(hash);
-						hash = NULL;
-						if (!file_ok) {
-							break;
-						}
-						plist_dict_next_item(files, iter, &hash, &node);
-					}
-					printf("\n");
-					free(iter);
-					if (!file_ok) {
-						plist_free(backup_data);
-						break;
-					}
-					printf("All backup files appear to be valid\n");
+				/* make sure both .mddata/.mdinfo files are available for each entry */
+				if (!mobilebackup_verify_files(backup_directory, files, verify_report)) {
+					plist_free(backup_data);
+					break;
 				}
+				printf("All backup files appear to be valid\n");
 			}
 
 			printf("Requesting restore from device...\n");
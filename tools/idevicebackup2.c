@@ -20,6 +20,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA 
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -29,6 +33,23 @@
 #include <glib/gstdio.h>
 #include <gcrypt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#ifndef FS_IOC_FIEMAP
+#define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+#endif
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -51,9 +72,15 @@ static mobilebackup2_client_t mobilebackup2 = NULL;
 static lockdownd_client_t client = NULL;
 static afc_client_t afc = NULL;
 static idevice_t phone = NULL;
+/* keeps the lockdown sessions of the daemon mode alive between uses */
+static lockdownd_pool_t lockdown_pool = NULL;
 
 static int verbose = 1;
 static int quit_flag = 0;
+/* set by signals, unlike quit_flag which also follows cancel requests of the device */
+static volatile sig_atomic_t exit_requested = 0;
+static char *store_dir = NULL;
+static int compress_files = 0;
 
 #define PRINT_VERBOSE(min_level, ...) if (verbose >= min_level) { printf(__VA_ARGS__); };
 
@@ -63,6 +90,8 @@ enum cmd_mode {
 	CMD_INFO,
 	CMD_LIST,
 	CMD_UNBACK,
+	CMD_VERIFY,
+	CMD_DAEMON,
 	CMD_LEAVE
 };
 
@@ -75,7 +104,8 @@ enum cmd_flags {
 	CMD_FLAG_RESTORE_SYSTEM_FILES       = 0,
 	CMD_FLAG_RESTORE_REBOOT             = (1 << 1),
 	CMD_FLAG_RESTORE_COPY_BACKUP        = (1 << 2),
-	CMD_FLAG_RESTORE_SETTINGS           = (1 << 3)
+	CMD_FLAG_RESTORE_SETTINGS           = (1 << 3),
+	CMD_FLAG_VERIFY_DEEP                = (1 << 4)
 };
 
 static void notify_cb(const char *notification, void *userdata)
@@ -101,6 +131,28 @@ static void free_dictionary(char **dictionary)
 	free(dictionary);
 }
 
+/* files read for Info.plist in daemon mode, by device and path */
+static GHashTable *afc_file_cache = NULL;
+
+struct mb2_afc_cached_file {
+	uint64_t size;
+	char *mtime;
+	char *data;
+};
+
+static void mb2_afc_cached_file_free(gpointer data)
+{
+	struct mb2_afc_cached_file *cached = (struct mb2_afc_cached_file*)data;
+	free(cached->mtime);
+	free(cached->data);
+	free(cached);
+}
+
+/**
+ * Reads a file from the device with AFC. When the daemon mode keeps a
+ * cache, a file whose size and modification time did not change since
+ * it was last read is answered from the cache.
+ */
 static void mobilebackup_afc_get_file_contents(const char *filename, char **data, uint64_t *size)
 {
 	if (!afc || !data || !size) {
@@ -109,6 +161,8 @@ static void mobilebackup_afc_get_file_contents(const char *filename, char **data
 
 	char **fileinfo = NULL;
 	uint32_t fsize = 0;
+	char *mtime = NULL;
+	gchar *cache_key = NULL;
 		
 	afc_get_file_info(afc, filename, &fileinfo);
 	if (!fileinfo) {
@@ -118,25 +172,47 @@ static void mobilebackup_afc_get_file_contents(const char *filename, char **data
 	for (i = 0; fileinfo[i]; i+=2) {
 		if (!strcmp(fileinfo[i], "st_size")) {
 			fsize = atol(fileinfo[i+1]);
-			break;
+		} else if (!strcmp(fileinfo[i], "st_mtime")) {
+			mtime = strdup(fileinfo[i+1]);
 		}
 	}
 	free_dictionary(fileinfo);
 
 	if (fsize == 0) {
+		free(mtime);
 		return;
 	}
+
+	if (afc_file_cache && mtime) {
+		char *uuid = NULL;
+		struct mb2_afc_cached_file *cached;
+		idevice_get_uuid(phone, &uuid);
+		cache_key = g_strconcat(uuid ? uuid : "", filename, NULL);
+		free(uuid);
+		cached = (struct mb2_afc_cached_file*)g_hash_table_lookup(afc_file_cache, cache_key);
+		if (cached && (cached->size == fsize) && !strcmp(cached->mtime, mtime)) {
+			PRINT_VERBOSE(2, "%s is unchanged\n", filename);
+			*data = (char*)malloc(fsize);
+			memcpy(*data, cached->data, fsize);
+			*size = fsize;
+			g_free(cache_key);
+			free(mtime);
+			return;
+		}
+	}
 		
 	uint64_t f = 0;
 	afc_file_open(afc, filename, AFC_FOPEN_RDONLY, &f);
 	if (!f) {
+		g_free(cache_key);
+		free(mtime);
 		return;
 	}
 	char *buf = (char*)malloc((uint32_t)fsize);
 	uint32_t done = 0;
 	while (done < fsize) {
 		uint32_t bread = 0;
-		afc_file_read(afc, f, buf+done, 65536, &bread);
+		afc_file_read(afc, f, buf+done, ((fsize - done) < 65536) ? (fsize - done) : 65536, &bread);
 		if (bread > 0) {
 			
 		} else {
@@ -147,10 +223,22 @@ static void mobilebackup_afc_get_file_contents(const char *filename, char **data
 	if (done == fsize) {
 		*size = fsize;
 		*data = buf;
+		if (cache_key) {
+			struct mb2_afc_cached_file *cached = (struct mb2_afc_cached_file*)malloc(sizeof(struct mb2_afc_cached_file));
+			cached->size = fsize;
+			cached->mtime = mtime;
+			cached->data = (char*)malloc(fsize);
+			memcpy(cached->data, buf, fsize);
+			mtime = NULL;
+			g_hash_table_replace(afc_file_cache, cache_key, cached);
+			cache_key = NULL;
+		}
 	} else {
 		free(buf);
 	}
 	afc_file_close(afc, f);
+	g_free(cache_key);
+	free(mtime);
 }
 
 static plist_t mobilebackup_factory_info_plist_new()
@@ -438,15 +526,50 @@ static int mobilebackup_info_is_current_device(plist_t info)
 	return ret;
 }
 
+/**
+ * Sets up the lockdown client with a running session, leasing it from the
+ * pool of the daemon mode if there is one.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int mb2_lockdown_connect()
+{
+	lockdownd_error_t lerr;
+
+	if (client)
+		return 0;
+	if (lockdown_pool)
+		lerr = lockdownd_pool_acquire(lockdown_pool, phone, "idevicebackup", &client);
+	else
+		lerr = lockdownd_client_new_with_handshake(phone, &client, "idevicebackup");
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		client = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Closes the lockdown client, or returns it to the pool to be reused.
+ */
+static void mb2_lockdown_close()
+{
+	if (!client)
+		return;
+	if (lockdown_pool)
+		lockdownd_pool_release(lockdown_pool, client, 1);
+	else
+		lockdownd_client_free(client);
+	client = NULL;
+}
+
 static void do_post_notification(const char *notification)
 {
 	uint16_t nport = 0;
 	np_client_t np;
 
-	if (!client) {
-		if (lockdownd_client_new_with_handshake(phone, &client, "idevicebackup") != LOCKDOWN_E_SUCCESS) {
-			return;
-		}
+	if (mb2_lockdown_connect() < 0) {
+		return;
 	}
 
 	lockdownd_start_service(client, NP_SERVICE_NAME, &nport);
@@ -463,16 +586,14 @@ static void do_post_notification(const char *notification)
 
 static void print_progress_real(double progress, int flush)
 {
+	char bar[51];
 	int i = 0;
-	PRINT_VERBOSE(1, "\r[");
+
 	for(i = 0; i < 50; i++) {
-		if(i < progress / 2) {
-			PRINT_VERBOSE(1, "=");
-		} else {
-			PRINT_VERBOSE(1, " ");
-		}
+		bar[i] = (i < progress / 2) ? '=' : ' ';
 	}
-	PRINT_VERBOSE(1, "] %3.0f%%", progress);
+	bar[50] = '\0';
+	PRINT_VERBOSE(1, "\r[%s] %3.0f%%", bar, progress);
 
 	if (flush > 0) {
 		fflush(stdout);
@@ -481,28 +602,176 @@ static void print_progress_real(double progress, int flush)
 	}
 }
 
-static void print_progress(uint64_t current, uint64_t total)
+/** Minimum time between two progress updates, in milliseconds */
+#define PROGRESS_INTERVAL 250
+
+/** Number of samples the transfer rate is averaged over; together with
+ *  PROGRESS_INTERVAL this gives a window of about 8 seconds */
+#define PROGRESS_SAMPLES 32
+
+struct mb2_progress_sample {
+	int64_t time;
+	uint64_t bytes;
+	uint64_t files;
+};
+
+/**
+ * Keeps track of the transfer progress. Counting is cheap enough to be
+ * done for every block; output is produced at most every
+ * PROGRESS_INTERVAL milliseconds, on the terminal and optionally as one
+ * JSON object per line on a separate file descriptor.
+ */
+struct mb2_progress {
+	int active;
+	int64_t start;
+	int64_t next_update;
+	uint64_t bytes;
+	uint64_t files;
+	uint64_t total_bytes;
+	double device_percent;
+	struct mb2_progress_sample samples[PROGRESS_SAMPLES];
+	unsigned int sample_count;
+	unsigned int sample_next;
+};
+
+static struct mb2_progress progress;
+static int progress_fd = -1;
+
+static int64_t mb2_progress_now()
 {
-	gchar *format_size = NULL;
-	double progress = ((double)current/(double)total)*100;
-	if (progress < 0)
-		return;
+	GTimeVal tv;
+	g_get_current_time(&tv);
+	return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
 
-	if (progress > 100)
-		progress = 100;
+/**
+ * Starts counting a transfer.
+ *
+ * @param total_bytes The expected number of bytes or 0 if not known
+ */
+static void mb2_progress_start(uint64_t total_bytes)
+{
+	memset(&progress, '\0', sizeof(progress));
+	progress.active = 1;
+	progress.start = mb2_progress_now();
+	progress.total_bytes = total_bytes;
+}
 
-	print_progress_real((double)progress, 0);
+static void mb2_progress_set_total(uint64_t total_bytes)
+{
+	if (total_bytes > progress.bytes)
+		progress.total_bytes = total_bytes;
+}
 
-	format_size = g_format_size_for_display(current);
-	PRINT_VERBOSE(1, " (%s", format_size);
-	g_free(format_size);
-	format_size = g_format_size_for_display(total);
-	PRINT_VERBOSE(1, "/%s)     ", format_size);
-	g_free(format_size);
+/** Records the overall progress reported by the device, in percent */
+static void mb2_progress_set_device_percent(double percent)
+{
+	progress.device_percent = percent;
+}
+
+static void mb2_progress_output(int64_t now, int final)
+{
+	struct mb2_progress_sample *oldest;
+	double elapsed;
+	double bytes_rate = 0;
+	double files_rate = 0;
+	double percent = -1;
+	int64_t eta = -1;
+	char line[256];
+	int len;
+
+	/* take a sample, the oldest one is the start of the window */
+	progress.samples[progress.sample_next].time = now;
+	progress.samples[progress.sample_next].bytes = progress.bytes;
+	progress.samples[progress.sample_next].files = progress.files;
+	progress.sample_next = (progress.sample_next + 1) % PROGRESS_SAMPLES;
+	if (progress.sample_count < PROGRESS_SAMPLES)
+		progress.sample_count++;
+	oldest = &progress.samples[(progress.sample_count < PROGRESS_SAMPLES) ? 0 : progress.sample_next];
+	if (final) {
+		oldest = NULL;
+	}
+
+	if (oldest && (now > oldest->time)) {
+		elapsed = (double)(now - oldest->time) / 1000;
+		bytes_rate = (double)(progress.bytes - oldest->bytes) / elapsed;
+		files_rate = (double)(progress.files - oldest->files) / elapsed;
+	} else if (now > progress.start) {
+		elapsed = (double)(now - progress.start) / 1000;
+		bytes_rate = (double)progress.bytes / elapsed;
+		files_rate = (double)progress.files / elapsed;
+	}
+
+	if (progress.total_bytes > 0) {
+		percent = ((double)progress.bytes / (double)progress.total_bytes) * 100;
+		if (percent > 100)
+			percent = 100;
+		if (bytes_rate > 0)
+			eta = (int64_t)((double)(progress.total_bytes - MIN(progress.bytes, progress.total_bytes)) / bytes_rate);
+	} else if (progress.device_percent > 0) {
+		/* no size given, extrapolate from the device's estimate */
+		percent = progress.device_percent;
+		eta = (int64_t)((double)(now - progress.start) / 1000 * (100 - percent) / percent);
+	}
+
+	if (verbose >= 1) {
+		gchar *format_size = g_format_size_for_display(progress.bytes);
+		if (percent >= 0) {
+			print_progress_real(percent, 0);
+		} else {
+			printf("\r");
+		}
+		printf(" %s, %.1f MB/s, %.0f files/s", format_size, bytes_rate / (1024 * 1024), files_rate);
+		if (eta >= 0) {
+			printf(", %d:%02d:%02d left", (int)(eta / 3600), (int)((eta / 60) % 60), (int)(eta % 60));
+		}
+		printf("     %s", final ? "\n" : "");
+		fflush(stdout);
+		g_free(format_size);
+	}
+
+	if (progress_fd >= 0) {
+		len = snprintf(line, sizeof(line), "{\"bytes\":%llu,\"total_bytes\":%llu,\"files\":%llu,\"bytes_per_second\":%.0f,\"files_per_second\":%.1f,\"percent\":%.1f,\"eta\":%lld,\"done\":%s}\n",
+			(unsigned long long)progress.bytes, (unsigned long long)progress.total_bytes, (unsigned long long)progress.files,
+			bytes_rate, files_rate, percent, (long long)eta, final ? "true" : "false");
+		if ((len > 0) && (write(progress_fd, line, len) < 0) && (errno == EPIPE)) {
+			/* the reader went away, stop reporting */
+			progress_fd = -1;
+		}
+	}
+}
+
+/**
+ * Counts transferred data and produces output if it's due.
+ */
+static void mb2_progress_add(uint64_t bytes, uint64_t files)
+{
+	int64_t now;
+
+	if (!progress.active)
+		return;
+
+	progress.bytes += bytes;
+	progress.files += files;
+
+	now = mb2_progress_now();
+	if (now < progress.next_update)
+		return;
+	progress.next_update = now + PROGRESS_INTERVAL;
+	mb2_progress_output(now, 0);
+}
 
-	fflush(stdout);
-	if (progress == 100)
-		PRINT_VERBOSE(1, "\n");
+/**
+ * Ends counting and prints the final figures, averaged over the whole
+ * transfer.
+ */
+static void mb2_progress_finish()
+{
+	if (!progress.active)
+		return;
+	if (progress.bytes > 0 || progress.files > 0)
+		mb2_progress_output(mb2_progress_now(), 1);
+	progress.active = 0;
 }
 
 static void mb2_multi_status_add_file_error(plist_t status_dict, const char *path, int error_code, const char *error_message)
@@ -526,6 +795,178 @@ static int errno_to_device_error(int errno_value)
 	}
 }
 
+/** Marks a file stored compressed; followed by the uncompressed size as
+ *  a 64-bit little endian value and a zlib stream */
+#define COMPRESS_MAGIC "\x89MBZ\r\n\x1a\n"
+#define COMPRESS_MAGIC_SIZE 8
+#define COMPRESS_HEADER_SIZE (COMPRESS_MAGIC_SIZE + 8)
+
+/** Fast level, the writer threads have to keep up with the device */
+#define COMPRESS_LEVEL 3
+
+/** Size of the buffers passed through the codec */
+#define COMPRESS_CHUNK_SIZE (256 * 1024)
+
+/**
+ * Checks if a file of the backup holds file contents from the device.
+ * Only those are compressed; the plists next to them are read by this
+ * tool from disk and stay as they are.
+ */
+static int mb2_is_payload_file(const char *path)
+{
+	const char *name = strrchr(path, G_DIR_SEPARATOR);
+	int i;
+
+	name = name ? name + 1 : path;
+	if (strlen(name) != 40)
+		return 0;
+	for (i = 0; i < 40; i++) {
+		if (!g_ascii_isxdigit(name[i]))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Reads the header of a file that may be stored compressed.
+ *
+ * @return 1 and the uncompressed size if the file is compressed, 0 if it
+ *     is not. The file is positioned after the header or at its start.
+ */
+static int mb2_compressed_header_read(FILE *f, uint64_t *size)
+{
+	char header[COMPRESS_HEADER_SIZE];
+
+	if ((fread(header, 1, COMPRESS_HEADER_SIZE, f) == COMPRESS_HEADER_SIZE) && !memcmp(header, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE)) {
+		memcpy(size, header + COMPRESS_MAGIC_SIZE, 8);
+		*size = GUINT64_FROM_LE(*size);
+		return 1;
+	}
+	rewind(f);
+	return 0;
+}
+
+/**
+ * Gets the size of the contents of a payload file, which differs from
+ * its size on disk when it is stored compressed.
+ */
+static uint64_t mb2_payload_size(const char *path, uint64_t disk_size)
+{
+	uint64_t size = disk_size;
+	FILE *f;
+
+	if ((disk_size < COMPRESS_HEADER_SIZE) || !mb2_is_payload_file(path))
+		return disk_size;
+	f = fopen(path, "rb");
+	if (f) {
+		if (!mb2_compressed_header_read(f, &size))
+			size = disk_size;
+		fclose(f);
+	}
+	return size;
+}
+
+/** Size of the file data frames sent during a restore */
+#define SEND_CHUNK_SIZE (1024 * 1024)
+
+/** Reads a file ahead into two buffers while the other one is being sent */
+struct mb2_file_reader {
+	FILE *f;
+	char *buf[2];
+	uint32_t len[2];
+	int full[2];
+	int error;
+	int quit;
+	GMutex *mutex;
+	GCond *cond;
+#ifdef HAVE_ZLIB
+	int compressed;
+	z_stream zs;
+	char *zbuf;
+#endif
+};
+
+/**
+ * Reads the next chunk of file contents, uncompressing them if the file
+ * is stored compressed.
+ *
+ * @return The number of bytes read, 0 at the end or on error.
+ */
+static size_t mb2_file_reader_read(struct mb2_file_reader *reader, char *buf, int *error)
+{
+#ifdef HAVE_ZLIB
+	if (reader->compressed) {
+		int zerr = Z_OK;
+		reader->zs.next_out = (Bytef*)buf;
+		reader->zs.avail_out = SEND_CHUNK_SIZE;
+		while ((reader->zs.avail_out > 0) && (zerr == Z_OK)) {
+			if (reader->zs.avail_in == 0) {
+				size_t r = fread(reader->zbuf, 1, COMPRESS_CHUNK_SIZE, reader->f);
+				if (r == 0) {
+					/* stream ended early */
+					*error = ferror(reader->f) ? (errno ? errno : EIO) : EIO;
+					break;
+				}
+				reader->zs.next_in = (Bytef*)reader->zbuf;
+				reader->zs.avail_in = r;
+			}
+			zerr = inflate(&reader->zs, Z_NO_FLUSH);
+			if ((zerr != Z_OK) && (zerr != Z_STREAM_END)) {
+				printf("Error uncompressing file: %s\n", reader->zs.msg ? reader->zs.msg : "corrupt data");
+				*error = EIO;
+			}
+		}
+		if (*error)
+			return 0;
+		return SEND_CHUNK_SIZE - reader->zs.avail_out;
+	}
+#endif
+	size_t r = fread(buf, 1, SEND_CHUNK_SIZE, reader->f);
+	if (ferror(reader->f)) {
+		*error = errno ? errno : EIO;
+	}
+	return r;
+}
+
+static gpointer mb2_file_reader_thread(gpointer data)
+{
+	struct mb2_file_reader *reader = (struct mb2_file_reader*)data;
+	int idx = 0;
+
+	while (1) {
+		size_t r;
+
+		g_mutex_lock(reader->mutex);
+		while (reader->full[idx] && !reader->quit) {
+			g_cond_wait(reader->cond, reader->mutex);
+		}
+		if (reader->quit) {
+			g_mutex_unlock(reader->mutex);
+			break;
+		}
+		g_mutex_unlock(reader->mutex);
+
+		int error = 0;
+		r = mb2_file_reader_read(reader, reader->buf[idx], &error);
+
+		g_mutex_lock(reader->mutex);
+		if (error) {
+			reader->error = error;
+		}
+		reader->len[idx] = r;
+		reader->full[idx] = 1;
+		g_cond_broadcast(reader->cond);
+		g_mutex_unlock(reader->mutex);
+
+		/* an empty buffer tells the sender there is nothing more */
+		if (r == 0)
+			break;
+		idx = !idx;
+	}
+
+	return NULL;
+}
+
 static int mb2_handle_send_file(const char *backup_dir, const char *path, plist_t *errplist)
 {
 	uint32_t nlen = 0;
@@ -533,35 +974,38 @@ static int mb2_handle_send_file(const char *backup_dir, const char *path, plist_
 	uint32_t bytes = 0;
 	gchar *localfile = g_build_path(G_DIR_SEPARATOR_S, backup_dir, path, NULL);
 	char buf[32768];
+	char header[5];
+	char trailer[5];
+	struct iovec iov[3];
 	struct stat fst;
+	struct mb2_file_reader reader;
+	GThread *reader_thread = NULL;
 
 	FILE *f = NULL;
 	uint32_t slen = 0;
 	int errcode = -1;
 	int result = -1;
+	int trailer_sent = 0;
+	int idx = 0;
 	uint32_t length;
 	off_t total;
 	off_t sent;
 
 	mobilebackup2_error_t err;
 
-	/* send path length */
-	nlen = GUINT32_TO_BE(pathlen);
-	err = mobilebackup2_send_raw(mobilebackup2, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
-	}
-	if (bytes != (uint32_t)sizeof(nlen)) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
-	}
+	memset(&reader, '\0', sizeof(reader));
 
-	/* send path */
-	err = mobilebackup2_send_raw(mobilebackup2, path, pathlen, &bytes);
+	/* send path length and path */
+	nlen = GUINT32_TO_BE(pathlen);
+	iov[0].iov_base = &nlen;
+	iov[0].iov_len = sizeof(nlen);
+	iov[1].iov_base = (char*)path;
+	iov[1].iov_len = pathlen;
+	err = mobilebackup2_send_rawv(mobilebackup2, iov, 2, &bytes);
 	if (err != MOBILEBACKUP2_E_SUCCESS) {
 		goto leave_proto_err;
 	}
-	if (bytes != pathlen) {
+	if (bytes != (uint32_t)sizeof(nlen) + pathlen) {
 		err = MOBILEBACKUP2_E_MUX_ERROR;
 		goto leave_proto_err;
 	}
@@ -573,7 +1017,33 @@ static int mb2_handle_send_file(const char *backup_dir, const char *path, plist_
 		goto leave;
 	}
 
+	f = fopen(localfile, "rb");
+	if (!f) {
+		printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
+		errcode = errno;
+		goto leave;
+	}
+
 	total = fst.st_size;
+	if (mb2_is_payload_file(localfile)) {
+		uint64_t size = 0;
+		if (mb2_compressed_header_read(f, &size)) {
+#ifdef HAVE_ZLIB
+			reader.compressed = 1;
+			reader.zbuf = (char*)malloc(COMPRESS_CHUNK_SIZE);
+			if (inflateInit(&reader.zs) != Z_OK) {
+				reader.compressed = 0;
+				errcode = ENOMEM;
+				goto leave;
+			}
+			total = size;
+#else
+			printf("%s: '%s' is stored compressed but compression support is not available\n", __func__, localfile);
+			errcode = ENOTSUP;
+			goto leave;
+#endif
+		}
+	}
 
 	gchar *format_size = g_format_size_for_display(total);
 	PRINT_VERBOSE(1, "Sending '%s' (%s)\n", path, format_size);
@@ -584,57 +1054,80 @@ static int mb2_handle_send_file(const char *backup_dir, const char *path, plist_
 		goto leave;
 	}
 
-	f = fopen(localfile, "rb");
-	if (!f) {
-		printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
-		errcode = errno;
-		goto leave;
+	reader.f = f;
+	reader.buf[0] = (char*)malloc(SEND_CHUNK_SIZE);
+	if (total > SEND_CHUNK_SIZE) {
+		/* read the next chunk while the current one is sent */
+		reader.buf[1] = (char*)malloc(SEND_CHUNK_SIZE);
+		reader.mutex = g_mutex_new();
+		reader.cond = g_cond_new();
+		reader_thread = g_thread_create(mb2_file_reader_thread, &reader, TRUE, NULL);
 	}
 
+	nlen = GUINT32_TO_BE(1);
+	memcpy(trailer, &nlen, sizeof(nlen));
+	trailer[4] = CODE_SUCCESS;
+
 	sent = 0;
 	do {
-		length = ((total-sent) < (off_t)sizeof(buf)) ? (uint32_t)total-sent : (uint32_t)sizeof(buf);
-		/* send data size (file size + 1) */
-		nlen = GUINT32_TO_BE(length+1);
-		memcpy(buf, &nlen, sizeof(nlen));
-		buf[4] = CODE_FILE_DATA;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, 5, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			goto leave_proto_err;
-		}
-		if (bytes != 5) {
-			goto leave_proto_err;
+		if (reader_thread) {
+			g_mutex_lock(reader.mutex);
+			while (!reader.full[idx]) {
+				g_cond_wait(reader.cond, reader.mutex);
+			}
+			g_mutex_unlock(reader.mutex);
+			length = reader.len[idx];
+		} else {
+			length = mb2_file_reader_read(&reader, reader.buf[0], &reader.error);
 		}
-
-		/* send file contents */
-		size_t r = fread(buf, 1, sizeof(buf), f);
-		if (r <= 0) {
+		if (length == 0) {
 			printf("%s: read error\n", __func__);
-			errcode = errno;
+			errcode = reader.error ? reader.error : (errno ? errno : EIO);
 			goto leave;
 		}
-		err = mobilebackup2_send_raw(mobilebackup2, buf, r, &bytes);
+
+		/* send data size (file size + 1) along with the data */
+		nlen = GUINT32_TO_BE(length+1);
+		memcpy(header, &nlen, sizeof(nlen));
+		header[4] = CODE_FILE_DATA;
+		iov[0].iov_base = header;
+		iov[0].iov_len = 5;
+		iov[1].iov_base = reader.buf[idx];
+		iov[1].iov_len = length;
+		if (sent + length >= total) {
+			/* the last chunk carries the success code, too */
+			iov[2].iov_base = trailer;
+			iov[2].iov_len = 5;
+			trailer_sent = 1;
+		}
+		err = mobilebackup2_send_rawv(mobilebackup2, iov, trailer_sent ? 3 : 2, &bytes);
 		if (err != MOBILEBACKUP2_E_SUCCESS) {
 			goto leave_proto_err;
 		}
-		if (bytes != (uint32_t)r) {
-			printf("Error: sent only %d of %d bytes\n", bytes, (int)r);
+		if (bytes != 5 + length + (trailer_sent ? 5 : 0)) {
+			printf("Error: sent only %d of %d bytes\n", bytes, 5 + length + (trailer_sent ? 5 : 0));
 			goto leave_proto_err;
 		}
-		sent += r;
+		sent += length;
+		mb2_progress_add(length, 0);
+
+		if (reader_thread) {
+			g_mutex_lock(reader.mutex);
+			reader.full[idx] = 0;
+			g_cond_broadcast(reader.cond);
+			g_mutex_unlock(reader.mutex);
+			idx = !idx;
+		}
 	} while (sent < total);
-	fclose(f);
-	f = NULL;
 	errcode = 0;
 
 leave:
 	if (errcode == 0) {
 		result = 0;
-		nlen = 1;
-		nlen = GUINT32_TO_BE(nlen);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_SUCCESS;
-		mobilebackup2_send_raw(mobilebackup2, buf, 5, &bytes);
+		if (!trailer_sent) {
+			mobilebackup2_send_raw(mobilebackup2, trailer, 5, &bytes);
+		}
+		mb2_progress_add(0, 1);
 	} else {
 		if (!*errplist) {
 			*errplist = plist_new_dict();
@@ -659,718 +1152,2885 @@ leave:
 	}
 
 leave_proto_err:
+	if (reader_thread) {
+		g_mutex_lock(reader.mutex);
+		reader.quit = 1;
+		g_cond_broadcast(reader.cond);
+		g_mutex_unlock(reader.mutex);
+		g_thread_join(reader_thread);
+	}
+	if (reader.mutex) {
+		g_cond_free(reader.cond);
+		g_mutex_free(reader.mutex);
+	}
+	free(reader.buf[0]);
+	free(reader.buf[1]);
+#ifdef HAVE_ZLIB
+	if (reader.compressed) {
+		inflateEnd(&reader.zs);
+	}
+	free(reader.zbuf);
+#endif
 	if (f)
 		fclose(f);
 	g_free(localfile);
 	return result;
 }
 
-static void mb2_handle_send_files(plist_t message, const char *backup_dir)
-{
-	uint32_t cnt; 
-	uint32_t i = 0;
+/** Number of requested files read ahead of the one being sent */
+#define PREFETCH_FILES 64
+
+/** Maximum amount of data read ahead in one go */
+#define PREFETCH_BYTES (64 * 1024 * 1024)
+
+/**
+ * Reads the files the device asked for ahead of sending them. The files
+ * have to be sent in the order they were requested, which is random order
+ * on disk. The prefetcher takes a window of upcoming files, sorts it by
+ * position on disk and hands it to the kernel's readahead in that order,
+ * so the disk sweeps across the window once and the sender finds the data
+ * in the page cache.
+ */
+struct mb2_prefetch {
+	GThread *thread;
+	GMutex *mutex;
+	GCond *cond;
+	gchar **paths;
+	uint32_t count;
+	uint32_t next;
 	uint32_t sent;
-	plist_t errplist = NULL;
+	int quit;
+};
 
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+#ifdef HAVE_POSIX_FADVISE
+struct mb2_prefetch_item {
+	int fd;
+	uint64_t key;
+	off_t size;
+};
 
-	plist_t files = plist_array_get_item(message, 1);
-	cnt = plist_array_get_size(files);
-	if (cnt == 0) return;
+static int mb2_prefetch_item_compare(const void *a, const void *b)
+{
+	const struct mb2_prefetch_item *ia = (const struct mb2_prefetch_item*)a;
+	const struct mb2_prefetch_item *ib = (const struct mb2_prefetch_item*)b;
 
-	for (i = 0; i < cnt; i++) {
-		plist_t val = plist_array_get_item(files, i);
-		if (plist_get_node_type(val) != PLIST_STRING) {
+	if (ia->key < ib->key)
+		return -1;
+	return (ia->key > ib->key);
+}
+
+/**
+ * Opens a file to prefetch and determines where it is on disk: its first
+ * physical extent where the filesystem tells, otherwise its inode number,
+ * which most filesystems allocate close to the data.
+ */
+static int mb2_prefetch_item_open(const char *path, struct mb2_prefetch_item *item)
+{
+	struct stat fst;
+
+	item->fd = open(path, O_RDONLY);
+	if (item->fd < 0)
+		return -1;
+	if (fstat(item->fd, &fst) < 0) {
+		close(item->fd);
+		return -1;
+	}
+	item->size = fst.st_size;
+	item->key = fst.st_ino;
+#ifdef FS_IOC_FIEMAP
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fm;
+	memset(&fm, '\0', sizeof(fm));
+	fm.map.fm_length = ~0ULL;
+	fm.map.fm_extent_count = 1;
+	if ((fst.st_size > 0) && (ioctl(item->fd, FS_IOC_FIEMAP, &fm.map) == 0) && (fm.map.fm_mapped_extents > 0)) {
+		item->key = fm.extent.fe_physical;
+	}
+#endif
+	return 0;
+}
+
+static gpointer mb2_prefetch_thread(gpointer data)
+{
+	struct mb2_prefetch *pf = (struct mb2_prefetch*)data;
+	struct mb2_prefetch_item items[PREFETCH_FILES];
+
+	g_mutex_lock(pf->mutex);
+	while (!pf->quit && (pf->next < pf->count)) {
+		uint32_t end = pf->sent + PREFETCH_FILES;
+		uint32_t i = pf->next;
+		uint32_t n = 0;
+		uint32_t j;
+		off_t bytes = 0;
+
+		if (end > pf->count)
+			end = pf->count;
+		if (i >= end) {
+			/* far enough ahead, wait for the sender */
+			g_cond_wait(pf->cond, pf->mutex);
 			continue;
 		}
-		char *str = NULL;
-		plist_get_string_val(val, &str);
-		if (!str)
-			continue;
+		g_mutex_unlock(pf->mutex);
 
-		if (mb2_handle_send_file(backup_dir, str, &errplist) < 0) {
-			//printf("Error when sending file '%s' to device\n", str);
-			// TODO: perhaps we can continue, we've got a multi status response?!
-			break;
+		/* collect the window, up to the byte limit but at least one file */
+		for (; (i < end) && ((n == 0) || (bytes < PREFETCH_BYTES)); i++) {
+			if (mb2_prefetch_item_open(pf->paths[i], &items[n]) == 0) {
+				bytes += items[n].size;
+				n++;
+			}
+		}
+		qsort(items, n, sizeof(struct mb2_prefetch_item), mb2_prefetch_item_compare);
+		for (j = 0; j < n; j++) {
+			posix_fadvise(items[j].fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(items[j].fd);
 		}
+
+		g_mutex_lock(pf->mutex);
+		pf->next = i;
 	}
+	g_mutex_unlock(pf->mutex);
 
-	/* send terminating 0 dword */
-	uint32_t zero = 0;
-	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
+	return NULL;
+}
+#endif
 
-	if (!errplist) {
-		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, plist_new_dict());
-	} else {
-		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
-		plist_free(errplist);
+/**
+ * Starts prefetching the files requested by a DLMessageDownloadFiles
+ * message.
+ *
+ * @return The prefetcher, or NULL when prefetching is not available or
+ *     not worth it.
+ */
+static struct mb2_prefetch *mb2_prefetch_start(plist_t files, const char *backup_dir)
+{
+#ifdef HAVE_POSIX_FADVISE
+	struct mb2_prefetch *pf;
+	uint32_t cnt = plist_array_get_size(files);
+	uint32_t i;
+
+	if (cnt < 2)
+		return NULL;
+
+	pf = (struct mb2_prefetch*)calloc(1, sizeof(struct mb2_prefetch));
+	pf->paths = (gchar**)calloc(cnt, sizeof(gchar*));
+	for (i = 0; i < cnt; i++) {
+		plist_t val = plist_array_get_item(files, i);
+		char *str = NULL;
+		if (plist_get_node_type(val) == PLIST_STRING)
+			plist_get_string_val(val, &str);
+		if (!str)
+			continue;
+		pf->paths[pf->count++] = g_build_path(G_DIR_SEPARATOR_S, backup_dir, str, NULL);
+		free(str);
 	}
+	pf->mutex = g_mutex_new();
+	pf->cond = g_cond_new();
+	pf->thread = g_thread_create(mb2_prefetch_thread, pf, TRUE, NULL);
+	return pf;
+#else
+	return NULL;
+#endif
 }
 
-static int mb2_handle_receive_files(plist_t message, const char *backup_dir)
+/**
+ * Tells the prefetcher that another file has been sent, so it can move
+ * its window on.
+ */
+static void mb2_prefetch_advance(struct mb2_prefetch *pf)
 {
-	uint64_t backup_real_size = 0;
-	uint64_t backup_total_size = 0;
-	uint32_t blocksize;
-	uint32_t bdone;
-	uint32_t rlen;
-	uint32_t nlen = 0;
-	uint32_t r;
-	char buf[32768];
-	char *fname = NULL;
-	char *dname = NULL;
-	gchar *bname = NULL;
-	char code = 0;
-	char last_code = 0;
-	plist_t node = NULL;
-	FILE *f = NULL;
-	unsigned int file_count = 0;
+	if (!pf)
+		return;
+	g_mutex_lock(pf->mutex);
+	pf->sent++;
+	g_cond_signal(pf->cond);
+	g_mutex_unlock(pf->mutex);
+}
 
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
+static void mb2_prefetch_stop(struct mb2_prefetch *pf)
+{
+	uint32_t i;
 
-	node = plist_array_get_item(message, 3);
-	if (plist_get_node_type(node) == PLIST_UINT) {
-		plist_get_uint_val(node, &backup_total_size);
-	}
-	if (backup_total_size > 0) {
-		PRINT_VERBOSE(1, "Receiving files\n");
+	if (!pf)
+		return;
+	g_mutex_lock(pf->mutex);
+	pf->quit = 1;
+	g_cond_signal(pf->cond);
+	g_mutex_unlock(pf->mutex);
+	if (pf->thread)
+		g_thread_join(pf->thread);
+	for (i = 0; i < pf->count; i++) {
+		g_free(pf->paths[i]);
 	}
+	free(pf->paths);
+	g_cond_free(pf->cond);
+	g_mutex_free(pf->mutex);
+	free(pf);
+}
 
-	do {
-		if (quit_flag)
-			break;
-		r = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-		nlen = GUINT32_FROM_BE(nlen);
-		if (nlen == 0) {
-			// we're done here
-			break;
-		} else if (nlen > 4096) {
-			// too very long path
-			printf("ERROR: %s: too long device filename (%d)!\n", __func__, nlen);
-			break;
-		}
-		if (dname != NULL)
-			free(dname);
-		dname = (char*)malloc(nlen+1);
-		r = 0;
-		mobilebackup2_receive_raw(mobilebackup2, dname, nlen, &r);
-		if (r != nlen) {
-			printf("ERROR: %s: could not read device filename\n", __func__);
-			break;
-		}
-		dname[r] = 0;
-		nlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-		nlen = GUINT32_FROM_BE(nlen);
-		if (nlen == 0) {
-			printf("ERROR: %s: zero-length backup filename!\n", __func__);
-			break;
-		} else if (nlen > 4096) {
-			printf("ERROR: %s: too long backup filename (%d)!\n", __func__, nlen);
-			break;
-		}
-		fname = (char*)malloc(nlen+1);
-		mobilebackup2_receive_raw(mobilebackup2, fname, nlen, &r);
-		if (r != nlen) {
-			printf("ERROR: %s: could not receive backup filename!\n", __func__);
-			break;
-		}
-		fname[r] = 0;
-		if (bname != NULL)
-			g_free(bname);
-		bname = g_build_path(G_DIR_SEPARATOR_S, backup_dir, fname, NULL);
-		free(fname);
-		nlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-		if (r != 4) {
-			printf("ERROR: %s: could not receive code length!\n", __func__);
-			break;
+static void mb2_handle_send_files(plist_t message, const char *backup_dir)
+{
+	uint32_t cnt; 
+	uint32_t i = 0;
+	uint32_t sent;
+	plist_t errplist = NULL;
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+
+	plist_t files = plist_array_get_item(message, 1);
+	cnt = plist_array_get_size(files);
+	if (cnt == 0) return;
+
+	struct mb2_prefetch *prefetch = mb2_prefetch_start(files, backup_dir);
+
+	for (i = 0; i < cnt; i++) {
+		plist_t val = plist_array_get_item(files, i);
+		if (plist_get_node_type(val) != PLIST_STRING) {
+			continue;
 		}
-		nlen = GUINT32_FROM_BE(nlen);
-		last_code = code;
-		code = 0;
-		mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-		if (r != 1) {
-			printf("ERROR: %s: could not receive code!\n", __func__);
+		char *str = NULL;
+		plist_get_string_val(val, &str);
+		if (!str)
+			continue;
+
+		if (mb2_handle_send_file(backup_dir, str, &errplist) < 0) {
+			//printf("Error when sending file '%s' to device\n", str);
+			// TODO: perhaps we can continue, we've got a multi status response?!
+			free(str);
 			break;
 		}
+		free(str);
+		mb2_prefetch_advance(prefetch);
+	}
+	mb2_prefetch_stop(prefetch);
 
-		/* TODO remove this */
-		if ((code != CODE_SUCCESS) && (code != CODE_FILE_DATA) && (code != CODE_ERROR_REMOTE)) {
-			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
-		}
+	/* send terminating 0 dword */
+	uint32_t zero = 0;
+	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
 
-		remove(bname);
-		f = fopen(bname, "wb");
-		while (f && (code == CODE_FILE_DATA)) {
-			blocksize = nlen-1;
-			bdone = 0;
-			rlen = 0;
-			while (bdone < blocksize) {
-				if ((blocksize - bdone) < sizeof(buf)) {
-					rlen = blocksize - bdone;
-				} else {
-					rlen = sizeof(buf);
-				}
-				mobilebackup2_receive_raw(mobilebackup2, buf, rlen, &r);
-				if ((int)r <= 0) {
-					break;
-				}
-				fwrite(buf, 1, r, f);
-				bdone += r;
-			}
-			if (bdone == blocksize) {
-				backup_real_size += blocksize;
-			}
-			if (backup_total_size > 0) {
-				print_progress(backup_real_size, backup_total_size);
-			}
-			if (quit_flag)
-				break;
-			nlen = 0;
-			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-			nlen = GUINT32_FROM_BE(nlen);
-			if (nlen > 0) {
-				last_code = code;
-				mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-			} else {
-				break;
+	if (!errplist) {
+		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, plist_new_dict());
+	} else {
+		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
+		plist_free(errplist);
+	}
+}
+
+/** Files smaller than this are not worth sharing through the store */
+#define STORE_MIN_FILE_SIZE 4096
+
+/**
+ * Shares a received file through the content-addressed store: if the
+ * store already has an object with the same hash, the file is replaced by
+ * a hard link to it, otherwise the file becomes the store object.
+ *
+ * Files in the backup directory are never modified in place (they are
+ * removed before being written again), so sharing them is safe.
+ */
+static void mb2_store_add(const char *path, const char *hash)
+{
+	char prefix[3];
+	gchar *objdir;
+	gchar *objpath;
+
+	prefix[0] = hash[0];
+	prefix[1] = hash[1];
+	prefix[2] = '\0';
+	objdir = g_build_path(G_DIR_SEPARATOR_S, store_dir, prefix, NULL);
+	objpath = g_build_path(G_DIR_SEPARATOR_S, objdir, hash, NULL);
+
+	if (link(path, objpath) < 0) {
+		if ((errno == ENOENT) && (g_mkdir_with_parents(objdir, 0755) == 0) && (link(path, objpath) == 0)) {
+			/* first file with this content */
+		} else if (errno == EEXIST) {
+			gchar *tmppath = g_strconcat(path, ".dedup", NULL);
+			remove(tmppath);
+			if ((link(objpath, tmppath) < 0) || (rename(tmppath, path) < 0)) {
+				/* e.g. too many links, keep the private copy */
+				remove(tmppath);
 			}
-		}
-		if (f) {
-			fclose(f);
-			file_count++;
+			g_free(tmppath);
+		} else if (errno == EXDEV) {
+			static int exdev_reported = 0;
+			if (!exdev_reported)
+				printf("The store must be on the same filesystem as the backup directory.\n");
+			exdev_reported = 1;
 		} else {
-			printf("Error opening '%s' for writing: %s\n", bname, strerror(errno));
-		}
-		if (nlen == 0) {
-			break;
+			printf("Could not add '%s' to store: %s\n", path, strerror(errno));
 		}
+	}
 
-		/* check if an error message was received */
-		if (code == CODE_ERROR_REMOTE) {
-			/* error message */
-			char *msg = (char*)malloc(nlen);
-			mobilebackup2_receive_raw(mobilebackup2, msg, nlen-1, &r);
-			msg[r] = 0;
-			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
-			if (last_code != CODE_FILE_DATA) {
-				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
-			}
-			free(msg);
-		}
-	} while (1);
+	g_free(objpath);
+	g_free(objdir);
+}
 
-	/* if there are leftovers to read, finish up cleanly */
-	if ((int)nlen-1 > 0) {
-		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
-		fname = (char*)malloc(nlen-1);
-		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
-		free(fname);
-		remove(bname);
-	}
+/** Journal of the files received completely, kept in the device's
+ *  backup directory until a backup finishes so that an interrupted
+ *  backup can be resumed */
+#define JOURNAL_FILE_NAME "Transfers.journal"
 
-	/* clean up */
-	if (bname != NULL)
-		g_free(bname);
+/** Minimum time between two checkpoints of received files, in seconds */
+#define CHECKPOINT_INTERVAL 30
 
-	if (dname != NULL)
-		free(dname);
+static FILE *journal = NULL;
+static gchar *journal_base = NULL;
+static GHashTable *resume_files = NULL;
+static volatile gint resume_kept = 0;
 
-	// TODO error handling?!
-	mobilebackup2_send_status_response(mobilebackup2, 0, NULL, plist_new_dict());
-	return file_count;
-}
+/* the backup directory, for resolving device paths with the *at() calls */
+static int backup_dirfd = -1;
 
-static void mb2_handle_list_directory(plist_t message, const char *backup_dir)
+/**
+ * Gets a path sent by the device relative to the backup directory.
+ */
+static const char *mb2_fs_relpath(const char *path)
 {
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+	while (*path == G_DIR_SEPARATOR)
+		path++;
+	return (*path) ? path : ".";
+}
 
-	plist_t node = plist_array_get_item(message, 1);
-	char *str = NULL;
-	if (plist_get_node_type(node) == PLIST_STRING) {
-		plist_get_string_val(node, &str);
-	}
-	if (!str) {
-		printf("ERROR: Malformed DLContentsOfDirectory message\n");
-		// TODO error handling
-		return;
-	}
+/**
+ * Gets the path of a file relative to a backup directory.
+ */
+static const char *mb2_relpath(const char *base, const char *path)
+{
+	size_t len = strlen(base);
+
+	if (strncmp(path, base, len))
+		return path;
+	path += len;
+	while (*path == G_DIR_SEPARATOR)
+		path++;
+	return path;
+}
 
-	gchar *path = g_build_path(G_DIR_SEPARATOR_S, backup_dir, str, NULL);
-	free(str);
+/**
+ * Gets the path of a file relative to the backup directory, as recorded
+ * in the journal.
+ */
+static const char *mb2_journal_relpath(const char *path)
+{
+	return mb2_relpath(journal_base, path);
+}
 
-	plist_t dirlist = plist_new_dict();
+/**
+ * Opens the journal of the backup directory. The files recorded by an
+ * earlier, interrupted run are compared with what the device sends again
+ * instead of being written anew.
+ */
+static void mb2_journal_open(const char *backup_dir, const char *uuid)
+{
+	gchar *path = g_build_path(G_DIR_SEPARATOR_S, backup_dir, uuid, JOURNAL_FILE_NAME, NULL);
+	FILE *f;
 
-	GDir *cur_dir = g_dir_open(path, 0, NULL);
-	if (cur_dir) {
-		gchar *dir_file;
-		while ((dir_file = (gchar *)g_dir_read_name(cur_dir))) {
-			gchar *fpath = g_build_filename(path, dir_file, NULL);
-			if (fpath) {
-				plist_t fdict = plist_new_dict();
-				GStatBuf st;
-				g_stat(fpath, &st);
-				const char *ftype = "DLFileTypeUnknown";
-				if (g_file_test(fpath, G_FILE_TEST_IS_DIR)) {
-					ftype = "DLFileTypeDirectory";
-				} else if (g_file_test(fpath, G_FILE_TEST_IS_REGULAR)) {
-					ftype = "DLFileTypeRegular";
-				}
-				plist_dict_insert_item(fdict, "DLFileType", plist_new_string(ftype));
-				plist_dict_insert_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
-				plist_dict_insert_item(fdict, "DLFileModificationDate", plist_new_date(st.st_mtime, 0));
+	journal_base = g_strdup(backup_dir);
+	resume_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	resume_kept = 0;
 
-				plist_dict_insert_item(dirlist, dir_file, fdict);
-				g_free(fpath);
-			}
+	f = fopen(path, "r");
+	if (f) {
+		char line[1024];
+		while (fgets(line, sizeof(line), f)) {
+			size_t len = strlen(line);
+			/* a line cut short by a crash has no newline */
+			if ((len < 2) || (line[len-1] != '\n'))
+				continue;
+			line[len-1] = '\0';
+			g_hash_table_replace(resume_files, g_strdup(line), GINT_TO_POINTER(1));
+		}
+		fclose(f);
+		if (g_hash_table_size(resume_files) > 0) {
+			PRINT_VERBOSE(1, "Resuming interrupted backup, %d files were received before.\n", g_hash_table_size(resume_files));
 		}
-		g_dir_close(cur_dir);
 	}
-	g_free(path);
 
-	/* TODO error handling */
-	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, 0, NULL, dirlist);
-	plist_free(dirlist);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		printf("Could not send status response, error %d\n", err);
+	journal = fopen(path, "a");
+	if (!journal) {
+		printf("Could not open journal '%s': %s\n", path, strerror(errno));
 	}
+	g_free(path);
 }
 
-static void mb2_handle_make_directory(plist_t message, const char *backup_dir)
+/**
+ * Closes the journal. Once a backup has finished, nothing needs to be
+ * resumed and the journal is removed.
+ */
+static void mb2_journal_close(const char *uuid, int finished)
 {
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+	if (journal) {
+		fclose(journal);
+		journal = NULL;
+	}
+	if (finished && journal_base) {
+		gchar *path = g_build_path(G_DIR_SEPARATOR_S, journal_base, uuid, JOURNAL_FILE_NAME, NULL);
+		remove(path);
+		g_free(path);
+	}
+	if (resume_kept > 0) {
+		PRINT_VERBOSE(1, "%d files received before were already complete.\n", resume_kept);
+	}
+	if (resume_files) {
+		g_hash_table_destroy(resume_files);
+		resume_files = NULL;
+	}
+	g_free(journal_base);
+	journal_base = NULL;
+}
 
-	plist_t dir = plist_array_get_item(message, 1);
-	char *str = NULL;
-	int errcode = 0;
-	char *errdesc = NULL;
-	plist_get_string_val(dir, &str);
+static int mb2_journal_has_file(const char *path)
+{
+	if (!resume_files || !journal_base)
+		return 0;
+	return (g_hash_table_lookup(resume_files, mb2_journal_relpath(path)) != NULL);
+}
 
-	gchar *newpath = g_build_path(G_DIR_SEPARATOR_S, backup_dir, str, NULL);
-	g_free(str);
+/** Digests of the files received, computed while they are written and
+ *  kept in the device's backup directory so that a backup can be
+ *  verified without hashing it again */
+#define DIGEST_FILE_NAME "Manifest.digests"
 
-	if (g_mkdir_with_parents(newpath, 0755) < 0) {
-		errdesc = strerror(errno);
-		if (errno != EEXIST) {
-			printf("mkdir: %s (%d)\n", errdesc, errno);
+struct mb2_digest {
+	unsigned char sha1[20];
+	uint64_t size;
+};
+
+static GHashTable *digests = NULL;
+static gchar *digests_base = NULL;
+static gchar *digests_path = NULL;
+static GStaticMutex digests_mutex = G_STATIC_MUTEX_INIT;
+
+/**
+ * Reads a digest file. Every line holds the SHA-1 of a file in hex, the
+ * size of its contents and its path relative to the backup directory.
+ *
+ * @return A table mapping paths to struct mb2_digest, empty if the file
+ *     does not exist.
+ */
+static GHashTable *mb2_digests_load(const char *path)
+{
+	GHashTable *table = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	char line[1024];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return table;
+	while (fgets(line, sizeof(line), f)) {
+		size_t len = strlen(line);
+		struct mb2_digest *digest;
+		char *p;
+		int i;
+
+		if ((len < 44) || (line[len-1] != '\n') || (line[40] != ' '))
+			continue;
+		line[len-1] = '\0';
+		digest = (struct mb2_digest*)malloc(sizeof(struct mb2_digest));
+		for (i = 0; i < 20; i++) {
+			char hex[3] = { line[i*2], line[i*2+1], '\0' };
+			digest->sha1[i] = (unsigned char)strtoul(hex, NULL, 16);
 		}
-		errcode = errno_to_device_error(errno);
-	}
-	g_free(newpath);
-	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, NULL);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		printf("Could not send status response, error %d\n", err);
+		digest->size = g_ascii_strtoull(line + 41, &p, 10);
+		if (!p || (*p != ' ')) {
+			free(digest);
+			continue;
+		}
+		g_hash_table_replace(table, g_strdup(p + 1), digest);
 	}
+	fclose(f);
+
+	return table;
 }
 
-static void mb2_copy_file_by_path(const gchar *src, const gchar *dst)
+/**
+ * Loads the digests recorded by earlier backups of the device, so the
+ * ones of the files received now can be added.
+ */
+static void mb2_digests_open(const char *backup_dir, const char *uuid)
 {
-	FILE *from, *to;
-	char buf[BUFSIZ];
-	size_t length;
+	digests_base = g_strdup(backup_dir);
+	digests_path = g_build_path(G_DIR_SEPARATOR_S, backup_dir, uuid, DIGEST_FILE_NAME, NULL);
+	digests = mb2_digests_load(digests_path);
+}
 
-	/* open source file */
-	if ((from = fopen(src, "rb")) == NULL) {
-		printf("Cannot open source path '%s'.\n", src);
+/**
+ * Records the digest of a file that was written completely.
+ */
+static void mb2_digests_set(const char *path, const unsigned char *sha1, uint64_t size)
+{
+	struct mb2_digest *digest;
+
+	if (!digests)
 		return;
-	}
+	digest = (struct mb2_digest*)malloc(sizeof(struct mb2_digest));
+	memcpy(digest->sha1, sha1, 20);
+	digest->size = size;
+	g_static_mutex_lock(&digests_mutex);
+	g_hash_table_replace(digests, g_strdup(mb2_relpath(digests_base, path)), digest);
+	g_static_mutex_unlock(&digests_mutex);
+}
 
-	/* open destination file */
-	if ((to = fopen(dst, "wb")) == NULL) {
-		printf("Cannot open destination file '%s'.\n", dst);
+static gboolean mb2_digests_match_prefix(gpointer key, gpointer value, gpointer user_data)
+{
+	const char *prefix = (const char*)user_data;
+	size_t len = strlen(prefix);
+
+	return (!strncmp((const char*)key, prefix, len) && (((const char*)key)[len] == G_DIR_SEPARATOR));
+}
+
+/**
+ * Forgets the digests of a file that is removed or rewritten, or of all
+ * files in a directory that is removed.
+ *
+ * @param relpath Path relative to the backup directory.
+ * @param is_dir 1 if a directory was removed.
+ */
+static void mb2_digests_forget(const char *relpath, int is_dir)
+{
+	if (!digests)
 		return;
+	g_static_mutex_lock(&digests_mutex);
+	if (!g_hash_table_remove(digests, relpath) && is_dir) {
+		/* only directories need the scan over all digests */
+		g_hash_table_foreach_remove(digests, mb2_digests_match_prefix, (gpointer)relpath);
 	}
+	g_static_mutex_unlock(&digests_mutex);
+}
 
-	/* copy the file */
-	while ((length = fread(buf, 1, BUFSIZ, from)) != 0) {
-		fwrite(buf, 1, length, to);
-	}
+struct mb2_digests_move_ctx {
+	const char *from;
+	GList *moved;
+};
 
-	if(fclose(from) == EOF) {
-		printf("Error closing source file.\n");
-	}
+static gboolean mb2_digests_steal_prefix(gpointer key, gpointer value, gpointer user_data)
+{
+	struct mb2_digests_move_ctx *ctx = (struct mb2_digests_move_ctx*)user_data;
 
-	if(fclose(to) == EOF) {
-		printf("Error closing destination file.\n");
-	}
+	if (!mb2_digests_match_prefix(key, value, (gpointer)ctx->from))
+		return FALSE;
+	ctx->moved = g_list_prepend(ctx->moved, key);
+	ctx->moved = g_list_prepend(ctx->moved, value);
+	return TRUE;
 }
 
-static void mb2_copy_directory_by_path(const gchar *src, const gchar *dst)
+/**
+ * Moves the digest of a renamed file, or those of all files in a renamed
+ * directory.
+ *
+ * @param from Old path relative to the backup directory.
+ * @param to New path relative to the backup directory.
+ * @param is_dir 1 if a directory was renamed.
+ */
+static void mb2_digests_move(const char *from, const char *to, int is_dir)
 {
-	if (!src || !dst) {
-		return;
-	}
+	struct mb2_digests_move_ctx ctx;
+	gpointer key = NULL;
+	gpointer value = NULL;
+	GList *node;
 
-	/* if src does not exist */
-	if (!g_file_test(src, G_FILE_TEST_EXISTS)) {
-		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
+	if (!digests)
 		return;
+	g_static_mutex_lock(&digests_mutex);
+	/* the target is replaced */
+	g_hash_table_remove(digests, to);
+	if (is_dir) {
+		g_hash_table_foreach_remove(digests, mb2_digests_match_prefix, (gpointer)to);
 	}
-
-	/* if dst directory does not exist */
-	if (!g_file_test(dst, G_FILE_TEST_IS_DIR)) {
-		/* create it */
-		if (g_mkdir_with_parents(dst, 0755) < 0) {
-			printf("ERROR: Unable to create destination directory '%s': %s (%d)\n", dst, strerror(errno), errno);
-			return;
+	if (g_hash_table_lookup_extended(digests, from, &key, &value)) {
+		g_hash_table_steal(digests, from);
+		g_free(key);
+		g_hash_table_insert(digests, g_strdup(to), value);
+	} else if (is_dir) {
+		ctx.from = from;
+		ctx.moved = NULL;
+		g_hash_table_foreach_steal(digests, mb2_digests_steal_prefix, &ctx);
+		/* the list holds value, key pairs */
+		for (node = ctx.moved; node && node->next; node = node->next->next) {
+			char *oldkey = (char*)node->next->data;
+			g_hash_table_insert(digests, g_strconcat(to, oldkey + strlen(from), NULL), node->data);
+			g_free(oldkey);
 		}
+		g_list_free(ctx.moved);
 	}
+	g_static_mutex_unlock(&digests_mutex);
+}
 
-	/* loop over src directory contents */
-	GDir *cur_dir = g_dir_open(src, 0, NULL);
-	if (cur_dir) {
-		gchar *dir_file;
-		while ((dir_file = (gchar *)g_dir_read_name(cur_dir))) {
-			gchar *srcpath = g_build_filename(src, dir_file, NULL);
-			gchar *dstpath = g_build_filename(dst, dir_file, NULL);
-			if (srcpath && dstpath) {
-				/* copy file */
-				mb2_copy_file_by_path(srcpath, dstpath);
+static void mb2_digests_write_entry(gpointer key, gpointer value, gpointer user_data)
+{
+	struct mb2_digest *digest = (struct mb2_digest*)value;
+	FILE *f = (FILE*)user_data;
+	int i;
 
-				g_free(srcpath);
-				g_free(dstpath);
-			}
-		}
-		g_dir_close(cur_dir);
+	for (i = 0; i < 20; i++) {
+		fprintf(f, "%02x", digest->sha1[i]);
 	}
+	fprintf(f, " %llu %s\n", (unsigned long long)digest->size, (const char*)key);
 }
 
 /**
- * signal handler function for cleaning up properly
+ * Saves the digests, replacing the digest file in one go, and frees them.
  */
-static void clean_exit(int sig)
+static void mb2_digests_close()
 {
-	fprintf(stderr, "Exiting...\n");
-	quit_flag++;
+	if (!digests)
+		return;
+
+	gchar *tmppath = g_strconcat(digests_path, ".tmp", NULL);
+	FILE *f = fopen(tmppath, "w");
+	if (f) {
+		int ok;
+		g_hash_table_foreach(digests, mb2_digests_write_entry, f);
+		ok = (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+		if ((fclose(f) != 0) || !ok || (rename(tmppath, digests_path) < 0)) {
+			printf("Could not save digests '%s': %s\n", digests_path, strerror(errno));
+			remove(tmppath);
+		}
+	} else {
+		printf("Could not save digests '%s': %s\n", digests_path, strerror(errno));
+	}
+	g_free(tmppath);
+
+	g_hash_table_destroy(digests);
+	digests = NULL;
+	g_free(digests_base);
+	digests_base = NULL;
+	g_free(digests_path);
+	digests_path = NULL;
 }
 
-static void print_usage(int argc, char **argv)
+/**
+ * Hashes the contents of a backup file, uncompressing them if the file is
+ * stored compressed.
+ *
+ * @return 0 on success, an errno value otherwise.
+ */
+static int mb2_hash_file(const char *path, uint64_t size, unsigned char *sha1)
 {
-	char *name = NULL;
-	name = strrchr(argv[0], '/');
-	printf("Usage: %s [OPTIONS] CMD [CMDOPTIONS] DIRECTORY\n", (name ? name + 1: argv[0]));
-	printf("Create or restore backup from the current or specified directory.\n\n");
-	printf("commands:\n");
-	printf("  backup\tcreate backup for the device\n");
-	printf("  restore\trestore last backup to the device\n");
-	printf("    --system\trestore system files, too.\n");
-	printf("    --reboot\treboot the system when done.\n");
-	printf("    --copy\tcreate a copy of backup folder before restoring.\n");
-	printf("    --settings\trestore device settings from the backup.\n");
-	printf("  info\t\tshow details about last completed backup of device\n");
-	printf("  list\t\tlist files of last completed backup in CSV format\n");
-	printf("  unback\tunpack a completed backup in DIRECTORY/_unback_/\n\n");
-	printf("options:\n");
-	printf("  -d, --debug\t\tenable communication debugging\n");
-	printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID\n");
-	printf("  -h, --help\t\tprints usage information\n");
-	printf("\n");
+	struct mb2_file_reader reader;
+	gcry_md_hd_t hash = NULL;
+	uint64_t done = 0;
+	uint64_t total = 0;
+	char *buf;
+	int error = 0;
+
+	memset(&reader, '\0', sizeof(reader));
+	reader.f = fopen(path, "rb");
+	if (!reader.f)
+		return errno;
+	if (mb2_is_payload_file(path) && mb2_compressed_header_read(reader.f, &total)) {
+#ifdef HAVE_ZLIB
+		reader.compressed = 1;
+		reader.zbuf = (char*)malloc(COMPRESS_CHUNK_SIZE);
+		if (inflateInit(&reader.zs) != Z_OK) {
+			free(reader.zbuf);
+			fclose(reader.f);
+			return ENOMEM;
+		}
+#else
+		fclose(reader.f);
+		return ENOTSUP;
+#endif
+	}
+
+	gcry_md_open(&hash, GCRY_MD_SHA1, 0);
+	buf = (char*)malloc(SEND_CHUNK_SIZE);
+	while (done < size) {
+		size_t r = mb2_file_reader_read(&reader, buf, &error);
+		if (r == 0) {
+			if (!error)
+				error = EIO;
+			break;
+		}
+		gcry_md_write(hash, buf, r);
+		done += r;
+	}
+	if (!error)
+		memcpy(sha1, gcry_md_read(hash, GCRY_MD_SHA1), 20);
+	gcry_md_close(hash);
+	free(buf);
+
+#ifdef HAVE_ZLIB
+	if (reader.compressed) {
+		inflateEnd(&reader.zs);
+		free(reader.zbuf);
+	}
+#endif
+	fclose(reader.f);
+	return error;
 }
 
-int main(int argc, char *argv[])
+struct mb2_verify_ctx {
+	const char *backup_dir;
+	int deep;
+	unsigned int checked;
+	unsigned int failed;
+};
+
+static void mb2_verify_entry(gpointer key, gpointer value, gpointer user_data)
 {
-	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
-	int i;
-	char uuid[41];
-	uint16_t port = 0;
-	uuid[0] = 0;
-	int cmd = -1;
-	int cmd_flags = 0;
-	int is_full_backup = 0;
-	char *backup_directory = NULL;
+	struct mb2_verify_ctx *ctx = (struct mb2_verify_ctx*)user_data;
+	struct mb2_digest *digest = (struct mb2_digest*)value;
+	gchar *path = g_build_path(G_DIR_SEPARATOR_S, ctx->backup_dir, (const char*)key, NULL);
+	unsigned char sha1[20];
 	struct stat st;
-	plist_t node_tmp = NULL;
-	plist_t info_plist = NULL;
-	plist_t opts = NULL;
-	mobilebackup2_error_t err;
-
-	/* we need to exit cleanly on running backups and restores or we cause havok */
-	signal(SIGINT, clean_exit);
-	signal(SIGQUIT, clean_exit);
-	signal(SIGTERM, clean_exit);
-	signal(SIGPIPE, SIG_IGN);
-
-	/* parse cmdline args */
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
-			idevice_set_debug_level(1);
-			continue;
-		}
-		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--uuid")) {
-			i++;
-			if (!argv[i] || (strlen(argv[i]) != 40)) {
-				print_usage(argc, argv);
-				return 0;
-			}
-			strcpy(uuid, argv[i]);
-			continue;
-		}
-		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-			print_usage(argc, argv);
-			return 0;
-		}
-		else if (!strcmp(argv[i], "backup")) {
-			cmd = CMD_BACKUP;
-		}
-		else if (!strcmp(argv[i], "restore")) {
-			cmd = CMD_RESTORE;
-		}
-		else if (!strcmp(argv[i], "--system")) {
-			cmd_flags |= CMD_FLAG_RESTORE_SYSTEM_FILES;
-		}
-		else if (!strcmp(argv[i], "--reboot")) {
-			cmd_flags |= CMD_FLAG_RESTORE_REBOOT;
-		}
-		else if (!strcmp(argv[i], "--copy")) {
-			cmd_flags |= CMD_FLAG_RESTORE_COPY_BACKUP;
-		}
-		else if (!strcmp(argv[i], "--settings")) {
-			cmd_flags |= CMD_FLAG_RESTORE_SETTINGS;
-		}
-		else if (!strcmp(argv[i], "info")) {
-			cmd = CMD_INFO;
-			verbose = 0;
-		}
-		else if (!strcmp(argv[i], "list")) {
-			cmd = CMD_LIST;
-			verbose = 0;
-		}
-		else if (!strcmp(argv[i], "unback")) {
-			cmd = CMD_UNBACK;
-		}
-		else if (backup_directory == NULL) {
-			backup_directory = argv[i];
-		}
-		else {
-			print_usage(argc, argv);
-			return 0;
+	int error;
+
+	ctx->checked++;
+	if (stat(path, &st) < 0) {
+		printf("%s: missing\n", (const char*)key);
+		ctx->failed++;
+	} else if (mb2_payload_size(path, st.st_size) != digest->size) {
+		printf("%s: size differs\n", (const char*)key);
+		ctx->failed++;
+	} else if (ctx->deep) {
+		error = mb2_hash_file(path, digest->size, sha1);
+		if (error) {
+			printf("%s: could not be read: %s\n", (const char*)key, strerror(error));
+			ctx->failed++;
+		} else if (memcmp(sha1, digest->sha1, 20)) {
+			printf("%s: contents differ\n", (const char*)key);
+			ctx->failed++;
 		}
 	}
+	g_free(path);
+}
 
-	/* verify options */
-	if (cmd == -1) {
-		printf("No command specified.\n");
-		print_usage(argc, argv);
-		return -1;
-	}
+/**
+ * Checks the files of a backup against the digests recorded while they
+ * were received. Without deep, only presence and sizes are checked, which
+ * is all a backup that was just made needs as its digests were computed
+ * from the data written. With deep, every file is read and hashed again
+ * to find damage that happened later.
+ *
+ * @return 0 if all files are fine, -1 otherwise.
+ */
+static int mb2_verify_backup(const char *backup_dir, const char *uuid, int deep)
+{
+	struct mb2_verify_ctx ctx;
+	gchar *path = g_build_path(G_DIR_SEPARATOR_S, backup_dir, uuid, DIGEST_FILE_NAME, NULL);
+	GHashTable *table;
 
-	if (backup_directory == NULL) {
-		printf("No target backup directory specified.\n");
-		print_usage(argc, argv);
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+		printf("No digests were recorded for the backup of %s.\n", uuid);
+		g_free(path);
 		return -1;
 	}
+	table = mb2_digests_load(path);
+	g_free(path);
 
-	/* verify if passed backup directory exists */
-	if (stat(backup_directory, &st) != 0) {
-		printf("ERROR: Backup directory \"%s\" does not exist!\n", backup_directory);
-		return -1;
-	}
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.backup_dir = backup_dir;
+	ctx.deep = deep;
+	g_hash_table_foreach(table, mb2_verify_entry, &ctx);
+	g_hash_table_destroy(table);
 
-	if (uuid[0] != 0) {
-		ret = idevice_new(&phone, uuid);
-		if (ret != IDEVICE_E_SUCCESS) {
-			printf("No device found with uuid %s, is it plugged in?\n", uuid);
-			return -1;
-		}
-	}
-	else
-	{
-		ret = idevice_new(&phone, NULL);
-		if (ret != IDEVICE_E_SUCCESS) {
-			printf("No device found, is it plugged in?\n");
-			return -1;
-		}
-		char *newuuid = NULL;
-		idevice_get_uuid(phone, &newuuid);
-		strcpy(uuid, newuuid);
-		free(newuuid);
-	}
+	printf("Verified %u files, %u failed.\n", ctx.checked, ctx.failed);
+	return (ctx.failed == 0) ? 0 : -1;
+}
 
-	/* backup directory must contain an Info.plist */
-	gchar *info_path = g_build_path(G_DIR_SEPARATOR_S, backup_directory, uuid, "Info.plist", NULL);
-	if (cmd == CMD_RESTORE) {
-		if (stat(info_path, &st) != 0) {
-			g_free(info_path);
-			printf("ERROR: Backup directory \"%s\" is invalid. No Info.plist found for UUID %s.\n", backup_directory, uuid);
-			return -1;
-		}
-	}
+/** Size of the blocks handed to the writer threads */
+#define WRITE_BLOCK_SIZE (1024 * 1024)
 
-	PRINT_VERBOSE(1, "Backup directory is \"%s\"\n", backup_directory);
+/** Maximum amount of received data waiting to be written */
+#define WRITE_QUEUE_LIMIT (32 * 1024 * 1024)
 
-	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(phone, &client, "idevicebackup")) {
-		idevice_free(phone);
-		return -1;
-	}
+/** Number of threads writing received files */
+#define WRITER_THREADS 2
 
-	/* start notification_proxy */
-	np_client_t np = NULL;
-	ret = lockdownd_start_service(client, NP_SERVICE_NAME, &port);
-	if ((ret == LOCKDOWN_E_SUCCESS) && port) {
-		np_client_new(phone, port, &np);
-		np_set_notify_callback(np, notify_cb, NULL);
-		const char *noties[5] = {
-			NP_SYNC_CANCEL_REQUEST,
-			NP_SYNC_SUSPEND_REQUEST,
-			NP_SYNC_RESUME_REQUEST,
-			NP_BACKUP_DOMAIN_CHANGED,
-			NULL
-		};
-		np_observe_notifications(np, noties);
-	} else {
-		printf("ERROR: Could not start service %s.\n", NP_SERVICE_NAME);
+enum mb2_write_op {
+	WRITE_OP_OPEN,
+	WRITE_OP_DATA,
+	WRITE_OP_CLOSE,
+	WRITE_OP_REMOVE,
+	WRITE_OP_QUIT
+};
+
+struct mb2_write_item {
+	enum mb2_write_op op;
+	char *path;
+	char *data;
+	uint32_t length;
+};
+
+struct mb2_writer;
+
+struct mb2_writer_thread {
+	struct mb2_writer *writer;
+	GThread *thread;
+	GAsyncQueue *queue;
+	int fd;
+	uint64_t size;
+	gcry_md_hd_t hash;
+#ifdef HAVE_ZLIB
+	int compressing;
+	z_stream zs;
+	char *zbuf;
+#endif
+	int verify_fd;
+	char *verify_buf;
+	char *tmp_path;
+};
+
+/**
+ * Writes received files on separate threads so that filesystem stalls
+ * don't hold up receiving from the device. All operations on one file go
+ * to the same thread and are carried out in order.
+ */
+struct mb2_writer {
+	struct mb2_writer_thread threads[WRITER_THREADS];
+	unsigned int next;
+	GMutex *mutex;
+	GCond *cond;
+	uint64_t queued_bytes;
+	unsigned int queued_items;
+	GList *written;
+	int error;
+};
+
+static struct mb2_writer *writer = NULL;
+
+static void mb2_writer_done(struct mb2_writer *w, struct mb2_write_item *item, int error)
+{
+	g_mutex_lock(w->mutex);
+	w->queued_bytes -= item->length;
+	w->queued_items--;
+	if (error && !w->error) {
+		w->error = error;
+	}
+	if ((item->op == WRITE_OP_CLOSE) && item->path && !error) {
+		w->written = g_list_prepend(w->written, item->path);
+		item->path = NULL;
 	}
+	g_cond_broadcast(w->cond);
+	g_mutex_unlock(w->mutex);
 
-	afc = NULL;
-	if (cmd == CMD_BACKUP) {
-		/* start AFC, we need this for the lock file */
-		port = 0;
-		ret = lockdownd_start_service(client, "com.apple.afc", &port);
-		if ((ret == LOCKDOWN_E_SUCCESS) && port) {
-			afc_client_new(phone, port, &afc);
-		}
+	free(item->data);
+	free(item->path);
+	free(item);
+}
+
+/*
+ * Disk writes can be paced by a scheduler shared by several backups
+ * (see idevicebackupfleet). Before every write a request carrying its
+ * size is sent on io_fd, then the write waits for the grant and reports
+ * when it is done. One request of a backup waits for its grant at a time,
+ * but the writes granted may run in parallel.
+ */
+#define IO_MSG_REQUEST 'R'
+#define IO_MSG_GRANT 'G'
+#define IO_MSG_DONE 'D'
+
+/* io_mutex guards io_fd and the messages sent on it */
+static int io_fd = -1;
+static GStaticMutex io_mutex = G_STATIC_MUTEX_INIT;
+/* held while waiting for a grant, without holding io_mutex, so that
+   granted writes can report they are done meanwhile */
+static GStaticMutex io_grant_mutex = G_STATIC_MUTEX_INIT;
+
+/**
+ * Sends a message to the I/O scheduler.
+ *
+ * @return The channel, or -1 if writes are not scheduled (anymore).
+ */
+static int mb2_io_send(const char *msg, size_t length)
+{
+	int fd;
+
+	g_static_mutex_lock(&io_mutex);
+	fd = io_fd;
+	if ((fd >= 0) && (write(fd, msg, length) != (ssize_t)length)) {
+		/* the scheduler went away, write unpaced from now on */
+		io_fd = fd = -1;
 	}
+	g_static_mutex_unlock(&io_mutex);
+	return fd;
+}
 
-	/* start mobilebackup service and retrieve port */
-	port = 0;
-	ret = lockdownd_start_service(client, MOBILEBACKUP2_SERVICE_NAME, &port);
-	if ((ret == LOCKDOWN_E_SUCCESS) && port) {
-		PRINT_VERBOSE(1, "Started \"%s\" service on port %d.\n", MOBILEBACKUP2_SERVICE_NAME, port);
-		mobilebackup2_client_new(phone, port, &mobilebackup2);
+/**
+ * Waits until the I/O scheduler allows writing length bytes.
+ *
+ * @return 1 if the write was granted and mb2_io_done() has to be called
+ *     after it, 0 if writes are not scheduled.
+ */
+static int mb2_io_request(uint32_t length)
+{
+	char msg[5];
+	char grant = 0;
+	ssize_t res;
+	int fd;
+
+	msg[0] = IO_MSG_REQUEST;
+	memcpy(msg + 1, &length, sizeof(uint32_t));
+
+	g_static_mutex_lock(&io_grant_mutex);
+	fd = mb2_io_send(msg, sizeof(msg));
+	if (fd < 0) {
+		g_static_mutex_unlock(&io_grant_mutex);
+		return 0;
+	}
+	do {
+		res = read(fd, &grant, 1);
+	} while ((res < 0) && (errno == EINTR));
+	g_static_mutex_unlock(&io_grant_mutex);
+
+	if ((res != 1) || (grant != IO_MSG_GRANT)) {
+		g_static_mutex_lock(&io_mutex);
+		io_fd = -1;
+		g_static_mutex_unlock(&io_mutex);
+		return 0;
+	}
+	return 1;
+}
 
-		/* send Hello message */
-		double local_versions[2] = {2.0, 2.1};
-		double remote_version = 0.0;
-		err = mobilebackup2_version_exchange(mobilebackup2, local_versions, 2, &remote_version);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			printf("Could not perform backup protocol version exchange, error code %d\n", err);
-			cmd = CMD_LEAVE;
-			goto checkpoint;
+/**
+ * Tells the I/O scheduler that a granted write has finished.
+ */
+static void mb2_io_done()
+{
+	char msg = IO_MSG_DONE;
+
+	mb2_io_send(&msg, 1);
+}
+
+static int mb2_write_all(int fd, const char *data, uint32_t length)
+{
+	uint32_t done = 0;
+	int scheduled = mb2_io_request(length);
+
+	while (done < length) {
+		ssize_t res = write(fd, data + done, length - done);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			int error = errno;
+			if (scheduled)
+				mb2_io_done();
+			return error;
 		}
+		done += res;
+	}
+	if (scheduled)
+		mb2_io_done();
+	return 0;
+}
 
-		PRINT_VERBOSE(1, "Negotiated Protocol Version %.1f\n", remote_version);
+#ifdef HAVE_ZLIB
+/**
+ * Passes data through the compressor of a writer thread and writes out
+ * what it produces.
+ *
+ * @return 0 on success or an errno value.
+ */
+static int mb2_writer_deflate(struct mb2_writer_thread *wt, const char *data, uint32_t length, int flush)
+{
+	int zerr;
 
-		/* check abort conditions */
-		if (quit_flag > 0) {
-			PRINT_VERBOSE(1, "Aborting as requested by user...\n");
-			cmd = CMD_LEAVE;
-			goto checkpoint;
+	wt->zs.next_in = (Bytef*)data;
+	wt->zs.avail_in = length;
+	do {
+		int error;
+		wt->zs.next_out = (Bytef*)wt->zbuf;
+		wt->zs.avail_out = COMPRESS_CHUNK_SIZE;
+		zerr = deflate(&wt->zs, flush);
+		if (zerr == Z_STREAM_ERROR)
+			return EIO;
+		error = mb2_write_all(wt->fd, wt->zbuf, COMPRESS_CHUNK_SIZE - wt->zs.avail_out);
+		if (error)
+			return error;
+	} while ((wt->zs.avail_out == 0) || ((flush == Z_FINISH) && (zerr != Z_STREAM_END)));
+
+	return 0;
+}
+#endif
+
+static void mb2_writer_file_close(struct mb2_writer_thread *wt)
+{
+	if (wt->fd >= 0) {
+		close(wt->fd);
+		wt->fd = -1;
+	}
+#ifdef HAVE_ZLIB
+	if (wt->compressing) {
+		deflateEnd(&wt->zs);
+		wt->compressing = 0;
+	}
+#endif
+	if (wt->verify_fd >= 0) {
+		close(wt->verify_fd);
+		wt->verify_fd = -1;
+	}
+	if (wt->tmp_path) {
+		remove(wt->tmp_path);
+		free(wt->tmp_path);
+		wt->tmp_path = NULL;
+	}
+}
+
+static uint32_t mb2_pread_all(int fd, char *buf, uint32_t length, uint64_t offset)
+{
+	uint32_t done = 0;
+
+	while (done < length) {
+		ssize_t res = pread(fd, buf + done, length - done, offset + done);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
+		if (res == 0)
+			break;
+		done += res;
+	}
+	return done;
+}
 
-		/* verify existing Info.plist */
-		if (stat(info_path, &st) == 0) {
-			PRINT_VERBOSE(1, "Reading Info.plist from backup.\n");
-			plist_read_from_filename(&info_plist, info_path);
+/**
+ * Stops comparing a resumed file with the copy from the interrupted run
+ * once the data differs. The part that matched so far is copied into a
+ * new file, which replaces the old one when it is complete; the old file
+ * may be shared with the store and must not be written to.
+ *
+ * @return 0 on success or an errno value.
+ */
+static int mb2_writer_diverge(struct mb2_writer_thread *wt)
+{
+	uint64_t done = 0;
+	int error = 0;
 
-			if (!info_plist) {
-				printf("Could not read Info.plist\n");
-				is_full_backup = 1;
+	remove(wt->tmp_path);
+	wt->fd = open(wt->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (wt->fd < 0) {
+		error = errno;
+	}
+	while (!error && (done < wt->size)) {
+		uint32_t len = ((wt->size - done) > WRITE_BLOCK_SIZE) ? WRITE_BLOCK_SIZE : (uint32_t)(wt->size - done);
+		if (mb2_pread_all(wt->verify_fd, wt->verify_buf, len, done) != len) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		error = mb2_write_all(wt->fd, wt->verify_buf, len);
+		done += len;
+	}
+	close(wt->verify_fd);
+	wt->verify_fd = -1;
+	if (error) {
+		mb2_writer_file_close(wt);
+	}
+	return error;
+}
+
+/**
+ * Carries out a queued operation.
+ *
+ * @return 1 if the writer thread should stop, 0 otherwise.
+ */
+static int mb2_writer_process(struct mb2_writer_thread *wt, struct mb2_write_item *item)
+{
+	enum mb2_write_op op = item->op;
+	int error = 0;
+
+	switch (op) {
+	case WRITE_OP_OPEN:
+		wt->size = 0;
+		if (wt->hash) {
+			gcry_md_reset(wt->hash);
+		}
+		/* recorded again once the file is complete */
+		if (digests)
+			mb2_digests_forget(mb2_relpath(digests_base, item->path), 0);
+		if (!compress_files && mb2_journal_has_file(item->path)) {
+			/* received before, compare instead of writing it again */
+			wt->verify_fd = open(item->path, O_RDONLY);
+			if (wt->verify_fd >= 0) {
+				if (!wt->verify_buf) {
+					wt->verify_buf = (char*)malloc(WRITE_BLOCK_SIZE);
+				}
+				wt->tmp_path = g_strconcat(item->path, ".resume", NULL);
+				break;
 			}
-			if (info_plist && ((cmd == CMD_BACKUP) || (cmd == CMD_RESTORE))) {
-				if (!mobilebackup_info_is_current_device(info_plist)) {
-					printf("Aborting. Backup data is not compatible with the current device.\n");
-					cmd = CMD_LEAVE;
+		}
+		remove(item->path);
+		wt->fd = open(item->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (wt->fd < 0) {
+			error = errno;
+			printf("Error opening '%s' for writing: %s\n", item->path, strerror(errno));
+			break;
+		}
+#ifdef HAVE_ZLIB
+		if (compress_files && mb2_is_payload_file(item->path)) {
+			char header[COMPRESS_HEADER_SIZE];
+			memset(&wt->zs, '\0', sizeof(z_stream));
+			if (deflateInit(&wt->zs, COMPRESS_LEVEL) == Z_OK) {
+				wt->compressing = 1;
+				/* the size is filled in when the file is complete */
+				memset(header, '\0', sizeof(header));
+				memcpy(header, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE);
+				error = mb2_write_all(wt->fd, header, sizeof(header));
+				if (error) {
+					printf("Error writing to '%s': %s\n", item->path, strerror(error));
+					mb2_writer_file_close(wt);
 				}
 			}
-		} else {
-			if (cmd == CMD_RESTORE) {
-				printf("Aborting restore. Info.plist is missing.\n");
-				cmd = CMD_LEAVE;
-			} else {
-				is_full_backup = 1;
+		}
+#endif
+		break;
+	case WRITE_OP_DATA:
+		if (wt->verify_fd >= 0) {
+			if ((mb2_pread_all(wt->verify_fd, wt->verify_buf, item->length, wt->size) == item->length) && !memcmp(wt->verify_buf, item->data, item->length)) {
+				if (wt->hash) {
+					gcry_md_write(wt->hash, item->data, item->length);
+				}
+				wt->size += item->length;
+				break;
+			}
+			error = mb2_writer_diverge(wt);
+			if (error) {
+				printf("Error writing to file: %s\n", strerror(error));
+				break;
 			}
 		}
-
-		uint64_t lockfile = 0;
-		if (cmd == CMD_BACKUP) {
-			do_post_notification(NP_SYNC_WILL_START);
-			afc_file_open(afc, "/com.apple.itunes.lock_sync", AFC_FOPEN_RW, &lockfile);
+		if (wt->fd >= 0) {
+#ifdef HAVE_ZLIB
+			if (wt->compressing) {
+				error = mb2_writer_deflate(wt, item->data, item->length, Z_NO_FLUSH);
+			} else
+#endif
+			error = mb2_write_all(wt->fd, item->data, item->length);
+			if (error) {
+				printf("Error writing to file: %s\n", strerror(error));
+				mb2_writer_file_close(wt);
+				break;
+			}
+			if (wt->hash) {
+				gcry_md_write(wt->hash, item->data, item->length);
+			}
+			wt->size += item->length;
 		}
-		if (lockfile) {
-			afc_error_t aerr;
-			do_post_notification(NP_SYNC_LOCK_REQUEST);
-			for (i = 0; i < LOCK_ATTEMPTS; i++) {
-				aerr = afc_file_lock(afc, lockfile, AFC_LOCK_EX);
-				if (aerr == AFC_E_SUCCESS) {
-					do_post_notification(NP_SYNC_DID_START);
-					break;
-				} else if (aerr == AFC_E_OP_WOULD_BLOCK) {
-					usleep(LOCK_WAIT);
-					continue;
-				} else {
-					fprintf(stderr, "ERROR: could not lock file! error code: %d\n", aerr);
-					afc_file_close(afc, lockfile);
-					lockfile = 0;
-					cmd = CMD_LEAVE;
+		break;
+	case WRITE_OP_CLOSE:
+		if (wt->verify_fd >= 0) {
+			struct stat fst;
+			if ((fstat(wt->verify_fd, &fst) == 0) && ((uint64_t)fst.st_size == wt->size)) {
+				/* the file was complete already */
+				mb2_writer_file_close(wt);
+				if (wt->hash) {
+					mb2_digests_set(item->path, gcry_md_read(wt->hash, GCRY_MD_SHA1), wt->size);
 				}
+				g_atomic_int_inc(&resume_kept);
+				free(item->path);
+				item->path = NULL;
+				break;
 			}
-			if (i == LOCK_ATTEMPTS) {
-				fprintf(stderr, "ERROR: timeout while locking for sync\n");
-				afc_file_close(afc, lockfile);
-				lockfile = 0;
-				cmd = CMD_LEAVE;
+			/* the old file is longer, keep the part that matched */
+			error = mb2_writer_diverge(wt);
+			if (error) {
+				printf("Error writing '%s': %s\n", item->path, strerror(error));
+			}
+		}
+		if (wt->fd >= 0) {
+			int compressed = 0;
+#ifdef HAVE_ZLIB
+			if (wt->compressing) {
+				uint64_t size = GUINT64_TO_LE(wt->size);
+				compressed = 1;
+				error = mb2_writer_deflate(wt, NULL, 0, Z_FINISH);
+				if (!error && (pwrite(wt->fd, &size, sizeof(size), COMPRESS_MAGIC_SIZE) != sizeof(size))) {
+					error = errno ? errno : EIO;
+				}
+				deflateEnd(&wt->zs);
+				wt->compressing = 0;
+			}
+#endif
+			if ((close(wt->fd) < 0) && !error) {
+				error = errno;
+			}
+			wt->fd = -1;
+			if (!error && wt->tmp_path && (rename(wt->tmp_path, item->path) < 0)) {
+				error = errno;
+			}
+			if (wt->tmp_path) {
+				if (error)
+					remove(wt->tmp_path);
+				free(wt->tmp_path);
+				wt->tmp_path = NULL;
+			}
+			if (error) {
+				printf("Error writing '%s': %s\n", item->path, strerror(error));
 			}
+			if (!error && wt->hash) {
+				unsigned char *digest = gcry_md_read(wt->hash, GCRY_MD_SHA1);
+				mb2_digests_set(item->path, digest, wt->size);
+				if (store_dir && (wt->size >= STORE_MIN_FILE_SIZE)) {
+					char hash[43];
+					int i;
+					for (i = 0; i < 20; i++) {
+						snprintf(hash + i*2, 3, "%02x", digest[i]);
+					}
+					/* compressed and plain copies are different objects */
+					if (compressed) {
+						strcpy(hash + 40, ".z");
+					}
+					mb2_store_add(item->path, hash);
+				}
+			}
+		} else {
+			/* nothing was written, so there is nothing to sync */
+			free(item->path);
+			item->path = NULL;
 		}
+		break;
+	case WRITE_OP_REMOVE:
+		mb2_writer_file_close(wt);
+		remove(item->path);
+		if (digests)
+			mb2_digests_forget(mb2_relpath(digests_base, item->path), 0);
+		break;
+	default:
+		break;
+	}
+	mb2_writer_done(wt->writer, item, error);
 
-checkpoint:
+	return (op == WRITE_OP_QUIT);
+}
 
-		switch(cmd) {
-			case CMD_BACKUP:
-			PRINT_VERBOSE(1, "Starting backup...\n");
+static gpointer mb2_writer_thread_func(gpointer data)
+{
+	struct mb2_writer_thread *wt = (struct mb2_writer_thread*)data;
 
-			/* make sure backup device sub-directory exists */
-			gchar *devbackupdir = g_build_path(G_DIR_SEPARATOR_S, backup_directory, uuid, NULL);
-			g_mkdir(devbackupdir, 0755);
-			g_free(devbackupdir);
+	while (!mb2_writer_process(wt, (struct mb2_write_item*)g_async_queue_pop(wt->queue)));
 
-			/* TODO: check domain com.apple.mobile.backup key RequiresEncrypt and WillEncrypt with lockdown */
-			/* TODO: verify battery on AC enough battery remaining */	
+	return NULL;
+}
 
-			/* re-create Info.plist (Device infos, IC-Info.sidb, photos, app_ids, iTunesPrefs) */
-			if (info_plist) {
-				plist_free(info_plist);
-				info_plist = NULL;
-			}
-			info_plist = mobilebackup_factory_info_plist_new();
-			remove(info_path);
-			plist_write_to_filename(info_plist, info_path, PLIST_FORMAT_XML);
-			g_free(info_path);
+static struct mb2_writer *mb2_writer_new()
+{
+	struct mb2_writer *w = (struct mb2_writer*)malloc(sizeof(struct mb2_writer));
+	int i;
 
-			plist_free(info_plist);
-			info_plist = NULL;
+	memset(w, '\0', sizeof(struct mb2_writer));
+	w->mutex = g_mutex_new();
+	w->cond = g_cond_new();
+	for (i = 0; i < WRITER_THREADS; i++) {
+		w->threads[i].writer = w;
+		w->threads[i].queue = g_async_queue_new();
+		w->threads[i].fd = -1;
+		w->threads[i].verify_fd = -1;
+		/* hash the data on the way to disk, for the digests and the store */
+		gcry_md_open(&w->threads[i].hash, GCRY_MD_SHA1, 0);
+#ifdef HAVE_ZLIB
+		if (compress_files) {
+			w->threads[i].zbuf = (char*)malloc(COMPRESS_CHUNK_SIZE);
+		}
+#endif
+		w->threads[i].thread = g_thread_create(mb2_writer_thread_func, &w->threads[i], TRUE, NULL);
+	}
 
-			/* request backup from device with manifest from last backup */
-			PRINT_VERBOSE(1, "Requesting backup from device...\n");
+	return w;
+}
 
-			err = mobilebackup2_send_request(mobilebackup2, "Backup", uuid, NULL, NULL);
-			if (err == MOBILEBACKUP2_E_SUCCESS) {
-				if (is_full_backup) {
-					PRINT_VERBOSE(1, "Full backup mode.\n");
-				}	else {
-					PRINT_VERBOSE(1, "Incremental backup mode.\n");
-				}
-			} else {
-				if (err == MOBILEBACKUP2_E_BAD_VERSION) {
-					printf("ERROR: Could not start backup process: backup protocol version mismatch!\n");
-				} else if (err == MOBILEBACKUP2_E_REPLY_NOT_OK) {
-					printf("ERROR: Could not start backup process: device refused to start the backup process.\n");
-				} else {
-					printf("ERROR: Could not start backup process: unspecified error occured\n");
-				}
-				cmd = CMD_LEAVE;
-			}
-			break;
-			case CMD_RESTORE:
-			/* TODO: verify battery on AC enough battery remaining */
+static void mb2_writer_push(struct mb2_writer *w, unsigned int idx, enum mb2_write_op op, const char *path, char *data, uint32_t length)
+{
+	struct mb2_write_item *item = (struct mb2_write_item*)malloc(sizeof(struct mb2_write_item));
 
-			/* verify if Status.plist says we read from an successful backup */
-			if (!mb2_status_check_snapshot_state(backup_directory, uuid, "finished")) {
-				printf("ERROR: Cannot ensure we restore from a successful backup. Aborting.\n");
-				cmd = CMD_LEAVE;
-				break;
-			}
+	item->op = op;
+	item->path = path ? strdup(path) : NULL;
+	item->data = data;
+	item->length = length;
+
+	g_mutex_lock(w->mutex);
+	/* hold up the receiver while too much data is waiting */
+	while ((length > 0) && (w->queued_bytes > 0) && (w->queued_bytes + length > WRITE_QUEUE_LIMIT)) {
+		g_cond_wait(w->cond, w->mutex);
+	}
+	w->queued_bytes += length;
+	w->queued_items++;
+	g_mutex_unlock(w->mutex);
+
+	if (!w->threads[idx].thread) {
+		/* no thread to hand it to, do it right here */
+		mb2_writer_process(&w->threads[idx], item);
+		return;
+	}
+	g_async_queue_push(w->threads[idx].queue, item);
+}
+
+/**
+ * Starts writing a new file.
+ *
+ * @return The writer slot to pass to the following operations on the file.
+ */
+static unsigned int mb2_writer_open(struct mb2_writer *w, const char *path)
+{
+	unsigned int idx = w->next;
+	w->next = (w->next + 1) % WRITER_THREADS;
+	mb2_writer_push(w, idx, WRITE_OP_OPEN, path, NULL, 0);
+	return idx;
+}
+
+/**
+ * Queues a block of data for the file opened on the given slot. The
+ * writer takes ownership of data.
+ */
+static void mb2_writer_write(struct mb2_writer *w, unsigned int idx, char *data, uint32_t length)
+{
+	mb2_writer_push(w, idx, WRITE_OP_DATA, NULL, data, length);
+}
+
+static void mb2_writer_close(struct mb2_writer *w, unsigned int idx, const char *path)
+{
+	mb2_writer_push(w, idx, WRITE_OP_CLOSE, path, NULL, 0);
+}
+
+static void mb2_writer_remove(struct mb2_writer *w, unsigned int idx, const char *path)
+{
+	mb2_writer_push(w, idx, WRITE_OP_REMOVE, path, NULL, 0);
+}
+
+/**
+ * Waits until everything queued so far has been written.
+ *
+ * @return 0 if all writes succeeded since the last call, or the errno
+ *     value of the first write that failed.
+ */
+static int mb2_writer_drain(struct mb2_writer *w)
+{
+	int error;
+
+	if (!w)
+		return 0;
+
+	g_mutex_lock(w->mutex);
+	while (w->queued_items > 0) {
+		g_cond_wait(w->cond, w->mutex);
+	}
+	error = w->error;
+	w->error = 0;
+	g_mutex_unlock(w->mutex);
+
+	return error;
+}
+
+/**
+ * Flushes the files written since the last call to disk and records them
+ * in the journal, or just forgets about them if sync_files is 0.
+ */
+static void mb2_writer_sync(struct mb2_writer *w, int sync_files)
+{
+	GList *written;
+	GList *l;
+	int recorded = 0;
+
+	g_mutex_lock(w->mutex);
+	written = w->written;
+	w->written = NULL;
+	g_mutex_unlock(w->mutex);
+
+	for (l = written; l; l = l->next) {
+		if (sync_files) {
+			int fd = open((char*)l->data, O_WRONLY);
+			if (fd >= 0) {
+				if ((fsync(fd) == 0) && journal) {
+					fprintf(journal, "%s\n", mb2_journal_relpath((char*)l->data));
+					recorded++;
+				}
+				close(fd);
+			}
+		}
+		free(l->data);
+	}
+	g_list_free(written);
+
+	if (recorded > 0) {
+		fflush(journal);
+		fsync(fileno(journal));
+	}
+}
+
+/**
+ * Waits for the pending writes and makes the files received so far
+ * durable, so that a later run can resume from here.
+ */
+static void mb2_writer_checkpoint(struct mb2_writer *w)
+{
+	int error;
+
+	if (!w)
+		return;
+
+	error = mb2_writer_drain(w);
+	if (error) {
+		printf("Error writing received files: %s\n", strerror(error));
+	}
+	PRINT_VERBOSE(2, "Checkpoint of received files\n");
+	mb2_writer_sync(w, 1);
+}
+
+/**
+ * Finishes all pending writes, stops the writer threads and frees the
+ * writer. The files written are flushed to disk together at this point
+ * instead of one by one while receiving.
+ */
+static void mb2_writer_free(struct mb2_writer *w, int sync_files)
+{
+	int i;
+
+	if (!w)
+		return;
+
+	for (i = 0; i < WRITER_THREADS; i++) {
+		if (w->threads[i].thread) {
+			mb2_writer_push(w, i, WRITE_OP_QUIT, NULL, NULL, 0);
+			g_thread_join(w->threads[i].thread);
+		}
+		mb2_writer_file_close(&w->threads[i]);
+		free(w->threads[i].verify_buf);
+#ifdef HAVE_ZLIB
+		free(w->threads[i].zbuf);
+#endif
+		if (w->threads[i].hash) {
+			gcry_md_close(w->threads[i].hash);
+		}
+		g_async_queue_unref(w->threads[i].queue);
+	}
+
+	if (sync_files && w->written) {
+		PRINT_VERBOSE(1, "Flushing received files to disk\n");
+	}
+	mb2_writer_sync(w, sync_files);
+	g_cond_free(w->cond);
+	g_mutex_free(w->mutex);
+	free(w);
+}
+
+static int mb2_handle_receive_files(plist_t message, const char *backup_dir)
+{
+	uint64_t backup_total_size = 0;
+	uint32_t blocksize;
+	uint32_t bdone;
+	uint32_t rlen;
+	uint32_t nlen = 0;
+	uint32_t r;
+	char *block = NULL;
+	uint32_t block_len = 0;
+	unsigned int slot = 0;
+	char *fname = NULL;
+	char *dname = NULL;
+	gchar *bname = NULL;
+	char code = 0;
+	char last_code = 0;
+	plist_t node = NULL;
+	unsigned int file_count = 0;
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
+
+	node = plist_array_get_item(message, 3);
+	if (plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &backup_total_size);
+	}
+	if (backup_total_size > 0) {
+		PRINT_VERBOSE(1, "Receiving files\n");
+		mb2_progress_set_total(backup_total_size);
+	}
+
+	do {
+		if (quit_flag)
+			break;
+		r = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
+		nlen = GUINT32_FROM_BE(nlen);
+		if (nlen == 0) {
+			// we're done here
+			break;
+		} else if (nlen > 4096) {
+			// too very long path
+			printf("ERROR: %s: too long device filename (%d)!\n", __func__, nlen);
+			break;
+		}
+		if (dname != NULL)
+			free(dname);
+		dname = (char*)malloc(nlen+1);
+		r = 0;
+		mobilebackup2_receive_raw(mobilebackup2, dname, nlen, &r);
+		if (r != nlen) {
+			printf("ERROR: %s: could not read device filename\n", __func__);
+			break;
+		}
+		dname[r] = 0;
+		nlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
+		nlen = GUINT32_FROM_BE(nlen);
+		if (nlen == 0) {
+			printf("ERROR: %s: zero-length backup filename!\n", __func__);
+			break;
+		} else if (nlen > 4096) {
+			printf("ERROR: %s: too long backup filename (%d)!\n", __func__, nlen);
+			break;
+		}
+		fname = (char*)malloc(nlen+1);
+		mobilebackup2_receive_raw(mobilebackup2, fname, nlen, &r);
+		if (r != nlen) {
+			printf("ERROR: %s: could not receive backup filename!\n", __func__);
+			break;
+		}
+		fname[r] = 0;
+		if (bname != NULL)
+			g_free(bname);
+		bname = g_build_path(G_DIR_SEPARATOR_S, backup_dir, fname, NULL);
+		free(fname);
+		nlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
+		if (r != 4) {
+			printf("ERROR: %s: could not receive code length!\n", __func__);
+			break;
+		}
+		nlen = GUINT32_FROM_BE(nlen);
+		last_code = code;
+		code = 0;
+		mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
+		if (r != 1) {
+			printf("ERROR: %s: could not receive code!\n", __func__);
+			break;
+		}
+
+		/* TODO remove this */
+		if ((code != CODE_SUCCESS) && (code != CODE_FILE_DATA) && (code != CODE_ERROR_REMOTE)) {
+			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
+		}
+
+		/* the writer threads take care of the filesystem from here */
+		slot = mb2_writer_open(writer, bname);
+		while (code == CODE_FILE_DATA) {
+			blocksize = nlen-1;
+			bdone = 0;
+			rlen = 0;
+			while (bdone < blocksize) {
+				if (!block) {
+					block = (char*)malloc(WRITE_BLOCK_SIZE);
+					block_len = 0;
+				}
+				if ((blocksize - bdone) < (WRITE_BLOCK_SIZE - block_len)) {
+					rlen = blocksize - bdone;
+				} else {
+					rlen = WRITE_BLOCK_SIZE - block_len;
+				}
+				mobilebackup2_receive_raw(mobilebackup2, block + block_len, rlen, &r);
+				if ((int)r <= 0) {
+					break;
+				}
+				block_len += r;
+				bdone += r;
+				mb2_progress_add(r, 0);
+				if (block_len == WRITE_BLOCK_SIZE) {
+					mb2_writer_write(writer, slot, block, block_len);
+					block = NULL;
+				}
+			}
+			if (quit_flag)
+				break;
+			nlen = 0;
+			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
+			nlen = GUINT32_FROM_BE(nlen);
+			if (nlen > 0) {
+				last_code = code;
+				mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
+			} else {
+				break;
+			}
+		}
+		if (block && (block_len > 0)) {
+			mb2_writer_write(writer, slot, block, block_len);
+			block = NULL;
+		}
+		mb2_writer_close(writer, slot, bname);
+		file_count++;
+		mb2_progress_add(0, 1);
+		if (nlen == 0) {
+			break;
+		}
+
+		/* check if an error message was received */
+		if (code == CODE_ERROR_REMOTE) {
+			/* error message */
+			char *msg = (char*)malloc(nlen);
+			mobilebackup2_receive_raw(mobilebackup2, msg, nlen-1, &r);
+			msg[r] = 0;
+			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
+			if (last_code != CODE_FILE_DATA) {
+				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
+			}
+			free(msg);
+		}
+	} while (1);
+
+	/* if there are leftovers to read, finish up cleanly */
+	if ((int)nlen-1 > 0) {
+		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
+		fname = (char*)malloc(nlen-1);
+		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
+		free(fname);
+		mb2_writer_remove(writer, slot, bname);
+	}
+
+	/* clean up */
+	free(block);
+	if (bname != NULL)
+		g_free(bname);
+
+	if (dname != NULL)
+		free(dname);
+
+	// TODO error handling?!
+	mobilebackup2_send_status_response(mobilebackup2, 0, NULL, plist_new_dict());
+	return file_count;
+}
+
+/** Name of the directory listing index kept in the backup directory */
+#define INDEX_FILE_NAME "Index.mbix"
+#define INDEX_MAGIC "MBIX"
+#define INDEX_VERSION 1
+
+enum mb2_index_type {
+	INDEX_TYPE_UNKNOWN = 0,
+	INDEX_TYPE_REGULAR,
+	INDEX_TYPE_DIRECTORY
+};
+
+/** On-disk header, followed by the directory records, the entry records
+ *  and the names of all entries */
+struct mb2_index_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t dir_count;
+	uint32_t entry_count;
+	uint64_t names_size;
+};
+
+/** On-disk record of a directory, sorted by key */
+struct mb2_index_dir_record {
+	unsigned char key[20];
+	uint32_t first_entry;
+	uint64_t entry_count;
+	int64_t mtime;
+	uint64_t inode;
+};
+
+/** On-disk record of a directory entry */
+struct mb2_index_entry_record {
+	uint64_t name_offset;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t type;
+	uint32_t reserved;
+};
+
+struct mb2_index_entry {
+	const char *name;
+	uint32_t type;
+	uint64_t size;
+	int64_t mtime;
+};
+
+struct mb2_index_listing {
+	unsigned char key[20];
+	int64_t mtime;
+	uint64_t inode;
+	uint32_t count;
+	struct mb2_index_entry *entries;
+	GStringChunk *names;
+};
+
+/**
+ * Index of directory listings of a backup directory. Listings are kept
+ * with the modification time and inode of their directory, so a listing
+ * is answered from the index only while the directory is unchanged. The
+ * index file is mapped and searched in place; listings scanned during a
+ * run are merged into it when it's saved.
+ */
+struct mb2_index {
+	gchar *path;
+	void *map;
+	size_t map_size;
+	const struct mb2_index_header *header;
+	const struct mb2_index_dir_record *dirs;
+	const struct mb2_index_entry_record *entries;
+	const char *names;
+	GHashTable *updates;
+};
+
+static struct mb2_index *manifest_index = NULL;
+
+static void mb2_index_key(const char *reldir, unsigned char *key)
+{
+	gcry_md_hash_buffer(GCRY_MD_SHA1, key, reldir, strlen(reldir));
+}
+
+static guint mb2_index_key_hash(gconstpointer key)
+{
+	guint h;
+	memcpy(&h, key, sizeof(h));
+	return h;
+}
+
+static gboolean mb2_index_key_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, 20) == 0;
+}
+
+static void mb2_index_listing_free(gpointer data)
+{
+	struct mb2_index_listing *listing = (struct mb2_index_listing*)data;
+	free(listing->entries);
+	if (listing->names)
+		g_string_chunk_free(listing->names);
+	free(listing);
+}
+
+static struct mb2_index *mb2_index_open(const char *backup_dir)
+{
+	struct mb2_index *idx = (struct mb2_index*)malloc(sizeof(struct mb2_index));
+	struct stat st;
+	int fd;
+
+	memset(idx, '\0', sizeof(struct mb2_index));
+	idx->path = g_build_path(G_DIR_SEPARATOR_S, backup_dir, INDEX_FILE_NAME, NULL);
+	idx->updates = g_hash_table_new_full(mb2_index_key_hash, mb2_index_key_equal, NULL, mb2_index_listing_free);
+
+	fd = open(idx->path, O_RDONLY);
+	if (fd < 0)
+		return idx;
+
+	if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(struct mb2_index_header))) {
+		idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (idx->map == MAP_FAILED) {
+			idx->map = NULL;
+		} else {
+			idx->map_size = st.st_size;
+		}
+	}
+	close(fd);
+
+	if (idx->map) {
+		const struct mb2_index_header *header = (const struct mb2_index_header*)idx->map;
+		uint64_t expected = sizeof(struct mb2_index_header) + (uint64_t)header->dir_count * sizeof(struct mb2_index_dir_record) + (uint64_t)header->entry_count * sizeof(struct mb2_index_entry_record) + header->names_size;
+		if (memcmp(header->magic, INDEX_MAGIC, 4) || (header->version != INDEX_VERSION) || (expected != idx->map_size)) {
+			PRINT_VERBOSE(1, "Ignoring invalid index '%s'\n", idx->path);
+			munmap(idx->map, idx->map_size);
+			idx->map = NULL;
+			idx->map_size = 0;
+		} else {
+			idx->header = header;
+			idx->dirs = (const struct mb2_index_dir_record*)(header + 1);
+			idx->entries = (const struct mb2_index_entry_record*)(idx->dirs + header->dir_count);
+			idx->names = (const char*)(idx->entries + header->entry_count);
+		}
+	}
+
+	return idx;
+}
+
+static int mb2_index_dir_compare(const void *key, const void *member)
+{
+	return memcmp(key, ((const struct mb2_index_dir_record*)member)->key, 20);
+}
+
+/**
+ * Looks up the listing of a directory.
+ *
+ * @param idx The index
+ * @param reldir Path of the directory relative to the backup directory
+ * @param st Current stat() data of the directory
+ * @param count Set to the number of entries found
+ *
+ * @return A newly allocated array of the entries, or NULL if the index has
+ *     no current listing of the directory. The names are owned by the
+ *     index.
+ */
+static struct mb2_index_entry *mb2_index_lookup(struct mb2_index *idx, const char *reldir, const struct stat *st, uint32_t *count)
+{
+	unsigned char key[20];
+	struct mb2_index_listing *listing;
+	const struct mb2_index_dir_record *dir = NULL;
+	struct mb2_index_entry *entries;
+	uint32_t i;
+
+	if (!idx)
+		return NULL;
+
+	mb2_index_key(reldir, key);
+
+	listing = (struct mb2_index_listing*)g_hash_table_lookup(idx->updates, key);
+	if (listing) {
+		if ((listing->mtime != (int64_t)st->st_mtime) || (listing->inode != (uint64_t)st->st_ino))
+			return NULL;
+		entries = (struct mb2_index_entry*)malloc(sizeof(struct mb2_index_entry) * (listing->count + 1));
+		memcpy(entries, listing->entries, sizeof(struct mb2_index_entry) * listing->count);
+		*count = listing->count;
+		return entries;
+	}
+
+	if (idx->header) {
+		dir = (const struct mb2_index_dir_record*)bsearch(key, idx->dirs, idx->header->dir_count, sizeof(struct mb2_index_dir_record), mb2_index_dir_compare);
+	}
+	if (!dir || (dir->mtime != (int64_t)st->st_mtime) || (dir->inode != (uint64_t)st->st_ino))
+		return NULL;
+	if ((uint64_t)dir->first_entry + dir->entry_count > idx->header->entry_count)
+		return NULL;
+
+	entries = (struct mb2_index_entry*)malloc(sizeof(struct mb2_index_entry) * (dir->entry_count + 1));
+	for (i = 0; i < dir->entry_count; i++) {
+		const struct mb2_index_entry_record *rec = &idx->entries[dir->first_entry + i];
+		if (rec->name_offset >= idx->header->names_size) {
+			free(entries);
+			return NULL;
+		}
+		entries[i].name = idx->names + rec->name_offset;
+		entries[i].type = rec->type;
+		entries[i].size = rec->size;
+		entries[i].mtime = rec->mtime;
+	}
+	*count = dir->entry_count;
+	return entries;
+}
+
+/**
+ * Records the listing of a directory that has just been scanned. Listings
+ * of directories modified in the current second are not recorded, since
+ * a change later in the same second would go unnoticed.
+ */
+static void mb2_index_store(struct mb2_index *idx, const char *reldir, const struct stat *st, time_t scan_time, struct mb2_index_entry *entries, uint32_t count)
+{
+	struct mb2_index_listing *listing;
+	uint32_t i;
+
+	if (!idx || (st->st_mtime >= scan_time))
+		return;
+
+	listing = (struct mb2_index_listing*)malloc(sizeof(struct mb2_index_listing));
+	mb2_index_key(reldir, listing->key);
+	listing->mtime = st->st_mtime;
+	listing->inode = st->st_ino;
+	listing->count = count;
+	listing->names = g_string_chunk_new(4096);
+	listing->entries = (struct mb2_index_entry*)malloc(sizeof(struct mb2_index_entry) * (count + 1));
+	for (i = 0; i < count; i++) {
+		listing->entries[i] = entries[i];
+		listing->entries[i].name = g_string_chunk_insert(listing->names, entries[i].name);
+	}
+	g_hash_table_replace(idx->updates, listing->key, listing);
+}
+
+static void mb2_index_collect(gpointer key, gpointer value, gpointer user_data)
+{
+	g_ptr_array_add((GPtrArray*)user_data, value);
+}
+
+static int mb2_index_listing_compare(gconstpointer a, gconstpointer b)
+{
+	const struct mb2_index_listing *la = *(const struct mb2_index_listing**)a;
+	const struct mb2_index_listing *lb = *(const struct mb2_index_listing**)b;
+	return memcmp(la->key, lb->key, 20);
+}
+
+/**
+ * Writes the index back, merging the listings recorded in this run with
+ * the ones of the previous index, and frees it.
+ */
+static void mb2_index_close(struct mb2_index *idx, int save)
+{
+	if (!idx)
+		return;
+
+	if (save && (g_hash_table_size(idx->updates) > 0)) {
+		GPtrArray *updated = g_ptr_array_new();
+		gchar *tmppath = g_strconcat(idx->path, ".tmp", NULL);
+		FILE *f = fopen(tmppath, "wb");
+		uint32_t old_count = idx->header ? idx->header->dir_count : 0;
+		uint32_t i = 0, j = 0, k;
+		uint32_t dir_count = 0;
+		uint32_t entry_count = 0;
+		uint64_t names_size = 0;
+		int pass;
+
+		g_hash_table_foreach(idx->updates, mb2_index_collect, updated);
+		g_ptr_array_sort(updated, mb2_index_listing_compare);
+
+		/* pass 0 counts, pass 1 writes records, pass 2 writes entries,
+		   pass 3 writes names; both inputs are sorted by key */
+		for (pass = 0; f && (pass < 4); pass++) {
+			uint32_t entry_index = 0;
+			uint64_t name_offset = 0;
+			if (pass == 1) {
+				struct mb2_index_header header;
+				memcpy(header.magic, INDEX_MAGIC, 4);
+				header.version = INDEX_VERSION;
+				header.dir_count = dir_count;
+				header.entry_count = entry_count;
+				header.names_size = names_size;
+				fwrite(&header, sizeof(header), 1, f);
+			}
+			i = 0;
+			j = 0;
+			while ((i < old_count) || (j < updated->len)) {
+				const struct mb2_index_dir_record *old = (i < old_count) ? &idx->dirs[i] : NULL;
+				const struct mb2_index_listing *cur = (j < updated->len) ? (const struct mb2_index_listing*)g_ptr_array_index(updated, j) : NULL;
+				int cmp = (!old) ? 1 : ((!cur) ? -1 : memcmp(old->key, cur->key, 20));
+				uint32_t count;
+
+				if (cmp == 0) {
+					/* superseded by the new listing */
+					i++;
+					continue;
+				}
+				count = (cmp < 0) ? (uint32_t)old->entry_count : cur->count;
+
+				if (pass == 0) {
+					dir_count++;
+					entry_count += count;
+					for (k = 0; k < count; k++) {
+						const char *name = (cmp < 0) ? idx->names + idx->entries[old->first_entry + k].name_offset : cur->entries[k].name;
+						names_size += strlen(name) + 1;
+					}
+				} else if (pass == 1) {
+					struct mb2_index_dir_record rec;
+					memset(&rec, '\0', sizeof(rec));
+					memcpy(rec.key, (cmp < 0) ? old->key : cur->key, 20);
+					rec.first_entry = entry_index;
+					rec.entry_count = count;
+					rec.mtime = (cmp < 0) ? old->mtime : cur->mtime;
+					rec.inode = (cmp < 0) ? old->inode : cur->inode;
+					fwrite(&rec, sizeof(rec), 1, f);
+				}
+				for (k = 0; (pass >= 2) && (k < count); k++) {
+					const char *name;
+					struct mb2_index_entry_record rec;
+					memset(&rec, '\0', sizeof(rec));
+					if (cmp < 0) {
+						rec = idx->entries[old->first_entry + k];
+						name = idx->names + rec.name_offset;
+					} else {
+						rec.size = cur->entries[k].size;
+						rec.mtime = cur->entries[k].mtime;
+						rec.type = cur->entries[k].type;
+						name = cur->entries[k].name;
+					}
+					rec.name_offset = name_offset;
+					name_offset += strlen(name) + 1;
+					if (pass == 2) {
+						fwrite(&rec, sizeof(rec), 1, f);
+					} else {
+						fwrite(name, 1, strlen(name) + 1, f);
+					}
+				}
+				entry_index += count;
+				if (cmp < 0)
+					i++;
+				else
+					j++;
+			}
+		}
+		if (f) {
+			int ok = (fflush(f) == 0) && !ferror(f);
+			fclose(f);
+			if (!ok || (rename(tmppath, idx->path) < 0)) {
+				printf("Could not write index '%s'\n", idx->path);
+				remove(tmppath);
+			}
+		}
+		g_free(tmppath);
+		g_ptr_array_free(updated, TRUE);
+	}
+
+	if (idx->map)
+		munmap(idx->map, idx->map_size);
+	g_hash_table_destroy(idx->updates);
+	g_free(idx->path);
+	free(idx);
+}
+
+static void mb2_index_entry_add(plist_t dirlist, const struct mb2_index_entry *entry)
+{
+	const char *ftype = "DLFileTypeUnknown";
+	plist_t fdict;
+
+	/* the index is not part of the backup */
+	if (!strcmp(entry->name, INDEX_FILE_NAME) || !strcmp(entry->name, INDEX_FILE_NAME ".tmp") || !strcmp(entry->name, JOURNAL_FILE_NAME))
+		return;
+
+	if (entry->type == INDEX_TYPE_DIRECTORY) {
+		ftype = "DLFileTypeDirectory";
+	} else if (entry->type == INDEX_TYPE_REGULAR) {
+		ftype = "DLFileTypeRegular";
+	}
+	fdict = plist_new_dict();
+	plist_dict_insert_item(fdict, "DLFileType", plist_new_string(ftype));
+	plist_dict_insert_item(fdict, "DLFileSize", plist_new_uint(entry->size));
+	plist_dict_insert_item(fdict, "DLFileModificationDate", plist_new_date(entry->mtime, 0));
+	plist_dict_insert_item(dirlist, entry->name, fdict);
+}
+
+/**
+ * Gets the size of the contents of a payload file in an open directory, like
+ * mb2_payload_size() does for a path.
+ */
+static uint64_t mb2_payload_size_at(int dfd, const char *name, uint64_t disk_size)
+{
+	char header[COMPRESS_HEADER_SIZE];
+	uint64_t size = disk_size;
+	int fd;
+
+	if ((disk_size < COMPRESS_HEADER_SIZE) || !mb2_is_payload_file(name))
+		return disk_size;
+	fd = openat(dfd, name, O_RDONLY);
+	if (fd >= 0) {
+		if ((pread(fd, header, COMPRESS_HEADER_SIZE, 0) == COMPRESS_HEADER_SIZE) && !memcmp(header, COMPRESS_MAGIC, COMPRESS_MAGIC_SIZE)) {
+			memcpy(&size, header + COMPRESS_MAGIC_SIZE, 8);
+			size = GUINT64_FROM_LE(size);
+		}
+		close(fd);
+	}
+	return size;
+}
+
+/** Smallest number of entries allocated for a directory scan */
+#define LIST_MIN_ENTRIES 64
+
+/** Largest number of entries allocated up front for a directory scan */
+#define LIST_MAX_PREALLOC 65536
+
+/**
+ * Reads the entries of an open directory with one fstatat() per entry and
+ * adds them to dirlist while reading.
+ *
+ * @param fd Descriptor of the directory, closed by this function.
+ * @param dst Status of the directory, used to size the entry array.
+ * @param names Chunk holding the names of the returned entries.
+ * @param count Set to the number of entries.
+ *
+ * @return The entries, to be freed with free().
+ */
+static struct mb2_index_entry *mb2_list_directory_scan(int fd, const struct stat *dst, plist_t dirlist, GStringChunk *names, uint32_t *count)
+{
+	/* directories take at least about 32 bytes per entry on disk */
+	uint32_t alloc = (uint32_t)MIN(MAX((uint64_t)dst->st_size / 32, LIST_MIN_ENTRIES), LIST_MAX_PREALLOC);
+	struct mb2_index_entry *entries = (struct mb2_index_entry*)malloc(sizeof(struct mb2_index_entry) * alloc);
+	struct dirent *ep;
+	DIR *dir;
+
+	*count = 0;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return entries;
+	}
+
+	while ((ep = readdir(dir))) {
+		struct mb2_index_entry *entry;
+		struct stat st;
+
+		if ((ep->d_name[0] == '.') && (!ep->d_name[1] || ((ep->d_name[1] == '.') && !ep->d_name[2])))
+			continue;
+		if (fstatat(fd, ep->d_name, &st, 0) < 0) {
+			memset(&st, '\0', sizeof(st));
+		}
+		if (*count == alloc) {
+			alloc *= 2;
+			entries = (struct mb2_index_entry*)realloc(entries, sizeof(struct mb2_index_entry) * alloc);
+		}
+		entry = &entries[*count];
+		entry->name = g_string_chunk_insert(names, ep->d_name);
+		entry->type = INDEX_TYPE_UNKNOWN;
+		if (S_ISDIR(st.st_mode)) {
+			entry->type = INDEX_TYPE_DIRECTORY;
+		} else if (S_ISREG(st.st_mode)) {
+			entry->type = INDEX_TYPE_REGULAR;
+		}
+		/* d_type tells which entries can be payload files without looking */
+		if (S_ISREG(st.st_mode) && ((ep->d_type == DT_REG) || (ep->d_type == DT_UNKNOWN) || (ep->d_type == DT_LNK))) {
+			entry->size = mb2_payload_size_at(fd, ep->d_name, st.st_size);
+		} else {
+			entry->size = (uint64_t)st.st_size;
+		}
+		entry->mtime = st.st_mtime;
+		mb2_index_entry_add(dirlist, entry);
+		(*count)++;
+	}
+	closedir(dir);
+
+	return entries;
+}
+
+static void mb2_handle_list_directory(plist_t message, const char *backup_dir)
+{
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+
+	plist_t node = plist_array_get_item(message, 1);
+	char *str = NULL;
+	if (plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &str);
+	}
+	if (!str) {
+		printf("ERROR: Malformed DLContentsOfDirectory message\n");
+		// TODO error handling
+		return;
+	}
+
+	plist_t dirlist = plist_new_dict();
+
+	struct mb2_index_entry *entries = NULL;
+	uint32_t count = 0;
+	uint32_t i;
+	struct stat dst;
+	int fd = openat(backup_dirfd, mb2_fs_relpath(str), O_RDONLY | O_DIRECTORY);
+	int have_dir = (fd >= 0) && (fstat(fd, &dst) == 0);
+
+	if (have_dir) {
+		entries = mb2_index_lookup(manifest_index, str, &dst, &count);
+		if (entries) {
+			PRINT_VERBOSE(2, "Listing of '%s' taken from index\n", str);
+			for (i = 0; i < count; i++) {
+				mb2_index_entry_add(dirlist, &entries[i]);
+			}
+		} else {
+			time_t scan_time = time(NULL);
+			GStringChunk *names = g_string_chunk_new(4096);
+			entries = mb2_list_directory_scan(fd, &dst, dirlist, names, &count);
+			fd = -1;
+			mb2_index_store(manifest_index, str, &dst, scan_time, entries, count);
+			g_string_chunk_free(names);
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(entries);
+	free(str);
+
+	/* TODO error handling */
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, 0, NULL, dirlist);
+	plist_free(dirlist);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+static void mb2_handle_make_directory(plist_t message, const char *backup_dir)
+{
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+
+	plist_t dir = plist_array_get_item(message, 1);
+	char *str = NULL;
+	int errcode = 0;
+	char *errdesc = NULL;
+	plist_get_string_val(dir, &str);
+
+	gchar *newpath = g_build_path(G_DIR_SEPARATOR_S, backup_dir, str, NULL);
+	g_free(str);
+
+	if (g_mkdir_with_parents(newpath, 0755) < 0) {
+		errdesc = strerror(errno);
+		if (errno != EEXIST) {
+			printf("mkdir: %s (%d)\n", errdesc, errno);
+		}
+		errcode = errno_to_device_error(errno);
+	}
+	g_free(newpath);
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, NULL);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+/** Batches with at least this many operations are spread over threads */
+#define FS_PARALLEL_MIN_OPS 256
+
+/** Number of threads working on a large batch of filesystem operations */
+#define FS_WORKERS 4
+
+enum {
+	FS_OP_MOVE,
+	FS_OP_REMOVE,
+	FS_OP_COPY
+};
+
+struct mb2_fs_op {
+	char *from;
+	char *to;
+	int error;
+	/* run in list order after the independent operations */
+	int ordered;
+};
+
+struct mb2_fs_batch {
+	int type;
+	struct mb2_fs_op *ops;
+	guint count;
+	guint alloc;
+	volatile gint next;
+	volatile gint failed;
+	int stop_on_error;
+};
+
+static void mb2_fs_batch_init(struct mb2_fs_batch *batch, int type, int stop_on_error)
+{
+	memset(batch, '\0', sizeof(struct mb2_fs_batch));
+	batch->type = type;
+	batch->stop_on_error = stop_on_error;
+}
+
+/**
+ * Adds an operation to a batch, taking ownership of the paths.
+ */
+static void mb2_fs_batch_add(struct mb2_fs_batch *batch, char *from, char *to)
+{
+	if (batch->count == batch->alloc) {
+		batch->alloc = batch->alloc ? batch->alloc * 2 : 64;
+		batch->ops = (struct mb2_fs_op*)realloc(batch->ops, sizeof(struct mb2_fs_op) * batch->alloc);
+	}
+	batch->ops[batch->count].from = from;
+	batch->ops[batch->count].to = to;
+	batch->ops[batch->count].error = 0;
+	batch->ops[batch->count].ordered = 0;
+	batch->count++;
+}
+
+static void mb2_fs_batch_free(struct mb2_fs_batch *batch)
+{
+	guint i;
+
+	for (i = 0; i < batch->count; i++) {
+		free(batch->ops[i].from);
+		free(batch->ops[i].to);
+	}
+	free(batch->ops);
+	batch->ops = NULL;
+	batch->count = batch->alloc = 0;
+}
+
+/**
+ * Removes a file or an empty directory like remove().
+ *
+ * @param is_dir Set to 1 if a directory was removed.
+ *
+ * @return 0 on success or -1 with errno set.
+ */
+static int mb2_fs_remove(const char *path, int *is_dir)
+{
+	*is_dir = 0;
+	if (unlinkat(backup_dirfd, path, 0) == 0)
+		return 0;
+	if ((errno != EISDIR) && (errno != EPERM))
+		return -1;
+	*is_dir = 1;
+	return unlinkat(backup_dirfd, path, AT_REMOVEDIR);
+}
+
+/**
+ * Copies a file. The copy shares the data with the source if possible,
+ * as a hard link when using a store and otherwise as a reflink.
+ *
+ * @return 0 on success or an errno value.
+ */
+static int mb2_fs_copy_file(const char *src, const char *dst)
+{
+	int from, to, is_dir;
+	char buf[65536];
+	ssize_t length;
+	int res = 0;
+
+	/* never write through an existing file, it may be shared */
+	mb2_fs_remove(dst, &is_dir);
+
+	if (store_dir && (linkat(backup_dirfd, src, backup_dirfd, dst, 0) == 0)) {
+		return 0;
+	}
+
+	/* open source file */
+	if ((from = openat(backup_dirfd, src, O_RDONLY)) < 0) {
+		res = errno;
+		printf("Cannot open source path '%s'.\n", src);
+		return res;
+	}
+
+	/* open destination file */
+	if ((to = openat(backup_dirfd, dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		res = errno;
+		printf("Cannot open destination file '%s'.\n", dst);
+		close(from);
+		return res;
+	}
+
+#ifdef FICLONE
+	/* let the filesystem share the data if it can */
+	if (ioctl(to, FICLONE, from) == 0) {
+		close(from);
+		close(to);
+		return 0;
+	}
+#endif
+
+	/* copy the file */
+	while ((length = read(from, buf, sizeof(buf))) != 0) {
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			res = errno;
+			printf("Error reading source file.\n");
+			break;
+		}
+		if (write(to, buf, length) != length) {
+			res = errno ? errno : EIO;
+			printf("Error writing destination file.\n");
+			break;
+		}
+	}
+
+	if (close(from) < 0) {
+		printf("Error closing source file.\n");
+	}
+
+	if (close(to) < 0) {
+		if (!res)
+			res = errno;
+		printf("Error closing destination file.\n");
+	}
+	return res;
+}
+
+/**
+ * Performs a single operation of a batch.
+ */
+static void mb2_fs_op_run(int type, struct mb2_fs_op *op)
+{
+	struct stat st;
+	int is_dir = 0;
+
+	switch (type) {
+	case FS_OP_MOVE:
+		/* the target is replaced */
+		mb2_fs_remove(op->to, &is_dir);
+		if (renameat(backup_dirfd, op->from, backup_dirfd, op->to) < 0) {
+			op->error = errno;
+			printf("Renameing '%s' to '%s' failed: %s (%d)\n", op->from, op->to, strerror(errno), errno);
+			break;
+		}
+		is_dir = (fstatat(backup_dirfd, op->to, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode);
+		mb2_digests_move(op->from, op->to, is_dir);
+		break;
+	case FS_OP_REMOVE:
+		if (mb2_fs_remove(op->from, &is_dir) < 0) {
+			op->error = errno;
+			printf("Could not remove '%s': %s (%d)\n", op->from, strerror(errno), errno);
+			break;
+		}
+		mb2_digests_forget(op->from, is_dir);
+		break;
+	case FS_OP_COPY:
+		op->error = mb2_fs_copy_file(op->from, op->to);
+		break;
+	default:
+		break;
+	}
+}
+
+static gpointer mb2_fs_worker(gpointer data)
+{
+	struct mb2_fs_batch *batch = (struct mb2_fs_batch*)data;
+	guint i;
+
+	while ((i = (guint)g_atomic_int_exchange_and_add(&batch->next, 1)) < batch->count) {
+		if (batch->stop_on_error && g_atomic_int_get(&batch->failed))
+			break;
+		if (batch->ops[i].ordered)
+			continue;
+		mb2_fs_op_run(batch->type, &batch->ops[i]);
+		if (batch->ops[i].error)
+			g_atomic_int_set(&batch->failed, 1);
+	}
+	return NULL;
+}
+
+static int mb2_fs_is_dir(const char *path)
+{
+	struct stat st;
+	return (fstatat(backup_dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Marks the operations of a batch that depend on others and have to keep
+ * their order. Removals list the contents of a directory before the
+ * directory, which only goes once it is empty, so directories are removed
+ * in list order after all files. Moves of directories, or moves sharing a
+ * path with another move, depend on each other; such batches are run in
+ * order completely. Copies are always independent files, as directories
+ * are created while collecting them.
+ */
+static void mb2_fs_batch_order(struct mb2_fs_batch *batch)
+{
+	GHashTable *paths;
+	int independent = 1;
+	guint i;
+
+	switch (batch->type) {
+	case FS_OP_REMOVE:
+		for (i = 0; i < batch->count; i++) {
+			batch->ops[i].ordered = mb2_fs_is_dir(batch->ops[i].from);
+		}
+		break;
+	case FS_OP_MOVE:
+		paths = g_hash_table_new(g_str_hash, g_str_equal);
+		for (i = 0; i < batch->count; i++) {
+			struct mb2_fs_op *op = &batch->ops[i];
+			if (mb2_fs_is_dir(op->from) || g_hash_table_lookup(paths, op->from) || g_hash_table_lookup(paths, op->to)) {
+				independent = 0;
+				break;
+			}
+			g_hash_table_insert(paths, op->from, op);
+			g_hash_table_insert(paths, op->to, op);
+		}
+		g_hash_table_destroy(paths);
+		for (i = 0; !independent && (i < batch->count); i++) {
+			batch->ops[i].ordered = 1;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Performs all operations of a batch. Large batches are spread over
+ * FS_WORKERS threads, except for the operations that have to keep their
+ * order (see mb2_fs_batch_order()), which are run in list order on the
+ * calling thread afterwards.
+ *
+ * @return The errno value of the first failed operation, or 0.
+ */
+static int mb2_fs_batch_run(struct mb2_fs_batch *batch)
+{
+	GThread *workers[FS_WORKERS];
+	int nworkers = 0;
+	guint i;
+
+	if (batch->count >= FS_PARALLEL_MIN_OPS) {
+		mb2_fs_batch_order(batch);
+		for (i = 0; i < FS_WORKERS - 1; i++) {
+			workers[nworkers] = g_thread_create(mb2_fs_worker, batch, TRUE, NULL);
+			if (workers[nworkers])
+				nworkers++;
+		}
+	}
+	mb2_fs_worker(batch);
+	for (i = 0; i < (guint)nworkers; i++) {
+		g_thread_join(workers[i]);
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->stop_on_error && batch->failed)
+			break;
+		if (!batch->ops[i].ordered)
+			continue;
+		mb2_fs_op_run(batch->type, &batch->ops[i]);
+		if (batch->ops[i].error)
+			batch->failed = 1;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		if (batch->ops[i].error)
+			return batch->ops[i].error;
+	}
+	return 0;
+}
+
+/**
+ * Adds copies of all files below a directory to a batch, creating the
+ * directories of the copy on the way.
+ *
+ * @return 0 on success or an errno value.
+ */
+static int mb2_fs_collect_copies(struct mb2_fs_batch *batch, const char *src, const char *dst)
+{
+	struct dirent *ep;
+	struct stat st;
+	DIR *dir;
+	int fd;
+
+	if ((mkdirat(backup_dirfd, dst, 0755) < 0) && (errno != EEXIST)) {
+		printf("ERROR: Unable to create destination directory '%s': %s (%d)\n", dst, strerror(errno), errno);
+		return errno;
+	}
+
+	fd = openat(backup_dirfd, src, O_RDONLY | O_DIRECTORY);
+	if ((fd < 0) || !(dir = fdopendir(fd))) {
+		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
+		if (fd >= 0)
+			close(fd);
+		return errno;
+	}
+
+	while ((ep = readdir(dir))) {
+		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+			continue;
+		char *srcpath = g_build_filename(src, ep->d_name, NULL);
+		char *dstpath = g_build_filename(dst, ep->d_name, NULL);
+		int type = ep->d_type;
+		if ((type == DT_UNKNOWN) && (fstatat(fd, ep->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)) {
+			type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+		}
+		if (type == DT_DIR) {
+			mb2_fs_collect_copies(batch, srcpath, dstpath);
+			g_free(srcpath);
+			g_free(dstpath);
+		} else if (type == DT_REG) {
+			/* the batch frees its paths with free() */
+			mb2_fs_batch_add(batch, strdup(srcpath), strdup(dstpath));
+			g_free(srcpath);
+			g_free(dstpath);
+		} else {
+			g_free(srcpath);
+			g_free(dstpath);
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static void mb2_handle_move_files(plist_t message)
+{
+	struct mb2_fs_batch batch;
+	plist_dict_iter iter = NULL;
+	plist_t moves = plist_array_get_item(message, 1);
+	uint32_t cnt = plist_dict_get_size(moves);
+	int errcode = 0;
+	const char *errdesc = NULL;
+
+	PRINT_VERBOSE(1, "Moving %d file%s\n", cnt, (cnt == 1) ? "" : "s");
+
+	mb2_fs_batch_init(&batch, FS_OP_MOVE, 1);
+	plist_dict_new_iter(moves, &iter);
+	if (iter) {
+		char *key = NULL;
+		plist_t val = NULL;
+		do {
+			plist_dict_next_item(moves, iter, &key, &val);
+			if (key && (plist_get_node_type(val) == PLIST_STRING)) {
+				char *str = NULL;
+				plist_get_string_val(val, &str);
+				if (str) {
+					mb2_fs_batch_add(&batch, strdup(mb2_fs_relpath(key)), strdup(mb2_fs_relpath(str)));
+					free(str);
+				}
+			}
+			free(key);
+			key = NULL;
+		} while (val);
+		free(iter);
+
+		errcode = mb2_fs_batch_run(&batch);
+		if (errcode) {
+			errdesc = strerror(errcode);
+			errcode = errno_to_device_error(errcode);
+		}
+	} else {
+		errcode = -1;
+		errdesc = "Could not create dict iterator";
+		printf("Could not create dict iterator\n");
+	}
+	mb2_fs_batch_free(&batch);
+
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, plist_new_dict());
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+static void mb2_handle_remove_files(plist_t message)
+{
+	struct mb2_fs_batch batch;
+	plist_t removes = plist_array_get_item(message, 1);
+	uint32_t cnt = plist_array_get_size(removes);
+	uint32_t ii;
+	int errcode = 0;
+	const char *errdesc = NULL;
+
+	PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
+
+	mb2_fs_batch_init(&batch, FS_OP_REMOVE, 0);
+	for (ii = 0; ii < cnt; ii++) {
+		plist_t val = plist_array_get_item(removes, ii);
+		if (plist_get_node_type(val) == PLIST_STRING) {
+			char *str = NULL;
+			plist_get_string_val(val, &str);
+			if (str) {
+				mb2_fs_batch_add(&batch, strdup(mb2_fs_relpath(str)), NULL);
+				free(str);
+			}
+		}
+	}
+	errcode = mb2_fs_batch_run(&batch);
+	if (errcode) {
+		errdesc = strerror(errcode);
+		errcode = errno_to_device_error(errcode);
+	}
+	mb2_fs_batch_free(&batch);
+
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, plist_new_dict());
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+static void mb2_handle_copy_item(plist_t message)
+{
+	plist_t srcpath = plist_array_get_item(message, 1);
+	plist_t dstpath = plist_array_get_item(message, 2);
+	int errcode = 0;
+	const char *errdesc = NULL;
+
+	if ((plist_get_node_type(srcpath) == PLIST_STRING) && (plist_get_node_type(dstpath) == PLIST_STRING)) {
+		char *src = NULL;
+		char *dst = NULL;
+		plist_get_string_val(srcpath, &src);
+		plist_get_string_val(dstpath, &dst);
+		if (src && dst) {
+			const char *from = mb2_fs_relpath(src);
+			const char *to = mb2_fs_relpath(dst);
+			struct stat st;
+
+			PRINT_VERBOSE(1, "Copying '%s' to '%s'\n", src, dst);
+
+			/* check that src exists */
+			if (fstatat(backup_dirfd, from, &st, 0) == 0) {
+				struct mb2_fs_batch batch;
+				mb2_fs_batch_init(&batch, FS_OP_COPY, 0);
+				if (S_ISDIR(st.st_mode)) {
+					mb2_fs_collect_copies(&batch, from, to);
+				} else if (S_ISREG(st.st_mode)) {
+					mb2_fs_batch_add(&batch, strdup(from), strdup(to));
+				}
+				mb2_fs_batch_run(&batch);
+				mb2_fs_batch_free(&batch);
+			}
+		}
+		free(src);
+		free(dst);
+	}
+
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, plist_new_dict());
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+/**
+ * Runs a command against the device in phone, from the lockdown handshake
+ * over the DLMessage exchange to the final notifications.
+ *
+ * @param backup_directory The backup directory
+ * @param uuid UUID of the device
+ * @param cmd The command to run
+ * @param cmd_flags Flags of the command
+ * @param completed If not NULL, set to 1 if the operation was successful
+ *
+ * @return 0 when the command was run, -1 if it could not be started.
+ */
+static int mb2_run(const char *backup_directory, const char *uuid, int cmd, int cmd_flags, int *completed)
+{
+	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
+	int i;
+	uint16_t port = 0;
+	int is_full_backup = 0;
+	int completed_loc = 0;
+	struct stat st;
+	plist_t node_tmp = NULL;
+	plist_t info_plist = NULL;
+	plist_t opts = NULL;
+	uint64_t lockfile = 0;
+	mobilebackup2_error_t err;
+
+	if (completed)
+		*completed = 0;
+
+	/* backup directory must contain an Info.plist */
+	gchar *info_path = g_build_path(G_DIR_SEPARATOR_S, backup_directory, uuid, "Info.plist", NULL);
+	if (cmd == CMD_RESTORE) {
+		if (stat(info_path, &st) != 0) {
+			g_free(info_path);
+			printf("ERROR: Backup directory \"%s\" is invalid. No Info.plist found for UUID %s.\n", backup_directory, uuid);
+			return -1;
+		}
+	}
+
+	PRINT_VERBOSE(1, "Backup directory is \"%s\"\n", backup_directory);
+
+	if (mb2_lockdown_connect() < 0) {
+		g_free(info_path);
+		return -1;
+	}
+
+	/* start notification_proxy */
+	np_client_t np = NULL;
+	ret = lockdownd_start_service(client, NP_SERVICE_NAME, &port);
+	if ((ret == LOCKDOWN_E_SUCCESS) && port) {
+		np_client_new(phone, port, &np);
+		const char *noties[5] = {
+			NP_SYNC_CANCEL_REQUEST,
+			NP_SYNC_SUSPEND_REQUEST,
+			NP_SYNC_RESUME_REQUEST,
+			NP_BACKUP_DOMAIN_CHANGED,
+			NULL
+		};
+		np_observe_notifications_with_callback(np, noties, notify_cb, NULL);
+	} else {
+		printf("ERROR: Could not start service %s.\n", NP_SERVICE_NAME);
+	}
+
+	afc = NULL;
+	if (cmd == CMD_BACKUP) {
+		/* start AFC, we need this for the lock file */
+		port = 0;
+		ret = lockdownd_start_service(client, "com.apple.afc", &port);
+		if ((ret == LOCKDOWN_E_SUCCESS) && port) {
+			afc_client_new(phone, port, &afc);
+		}
+	}
+
+	/* start mobilebackup service and retrieve port */
+	port = 0;
+	ret = lockdownd_start_service(client, MOBILEBACKUP2_SERVICE_NAME, &port);
+	if ((ret == LOCKDOWN_E_SUCCESS) && port) {
+		PRINT_VERBOSE(1, "Started \"%s\" service on port %d.\n", MOBILEBACKUP2_SERVICE_NAME, port);
+		mobilebackup2_client_new(phone, port, &mobilebackup2);
+
+		/* send Hello message */
+		double local_versions[2] = {2.0, 2.1};
+		double remote_version = 0.0;
+		err = mobilebackup2_version_exchange(mobilebackup2, local_versions, 2, &remote_version);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			printf("Could not perform backup protocol version exchange, error code %d\n", err);
+			cmd = CMD_LEAVE;
+			goto checkpoint;
+		}
+
+		PRINT_VERBOSE(1, "Negotiated Protocol Version %.1f\n", remote_version);
+
+		/* check abort conditions */
+		if (quit_flag > 0) {
+			PRINT_VERBOSE(1, "Aborting as requested by user...\n");
+			cmd = CMD_LEAVE;
+			goto checkpoint;
+		}
+
+		/* verify existing Info.plist */
+		if (stat(info_path, &st) == 0) {
+			PRINT_VERBOSE(1, "Reading Info.plist from backup.\n");
+			plist_read_from_filename(&info_plist, info_path);
+
+			if (!info_plist) {
+				printf("Could not read Info.plist\n");
+				is_full_backup = 1;
+			}
+			if (info_plist && ((cmd == CMD_BACKUP) || (cmd == CMD_RESTORE))) {
+				if (!mobilebackup_info_is_current_device(info_plist)) {
+					printf("Aborting. Backup data is not compatible with the current device.\n");
+					cmd = CMD_LEAVE;
+				}
+			}
+		} else {
+			if (cmd == CMD_RESTORE) {
+				printf("Aborting restore. Info.plist is missing.\n");
+				cmd = CMD_LEAVE;
+			} else {
+				is_full_backup = 1;
+			}
+		}
+
+		if (cmd == CMD_BACKUP) {
+			do_post_notification(NP_SYNC_WILL_START);
+			afc_file_open(afc, "/com.apple.itunes.lock_sync", AFC_FOPEN_RW, &lockfile);
+		}
+		if (lockfile) {
+			afc_error_t aerr;
+			do_post_notification(NP_SYNC_LOCK_REQUEST);
+			for (i = 0; i < LOCK_ATTEMPTS; i++) {
+				aerr = afc_file_lock(afc, lockfile, AFC_LOCK_EX);
+				if (aerr == AFC_E_SUCCESS) {
+					do_post_notification(NP_SYNC_DID_START);
+					break;
+				} else if (aerr == AFC_E_OP_WOULD_BLOCK) {
+					usleep(LOCK_WAIT);
+					continue;
+				} else {
+					fprintf(stderr, "ERROR: could not lock file! error code: %d\n", aerr);
+					afc_file_close(afc, lockfile);
+					lockfile = 0;
+					cmd = CMD_LEAVE;
+				}
+			}
+			if (i == LOCK_ATTEMPTS) {
+				fprintf(stderr, "ERROR: timeout while locking for sync\n");
+				afc_file_close(afc, lockfile);
+				lockfile = 0;
+				cmd = CMD_LEAVE;
+			}
+		}
+
+checkpoint:
+
+		switch(cmd) {
+			case CMD_BACKUP:
+			PRINT_VERBOSE(1, "Starting backup...\n");
+
+			/* make sure backup device sub-directory exists */
+			gchar *devbackupdir = g_build_path(G_DIR_SEPARATOR_S, backup_directory, uuid, NULL);
+			g_mkdir(devbackupdir, 0755);
+			g_free(devbackupdir);
+
+			/* TODO: check domain com.apple.mobile.backup key RequiresEncrypt and WillEncrypt with lockdown */
+			/* TODO: verify battery on AC enough battery remaining */	
+
+			/* re-create Info.plist (Device infos, IC-Info.sidb, photos, app_ids, iTunesPrefs) */
+			if (info_plist) {
+				plist_free(info_plist);
+				info_plist = NULL;
+			}
+			info_plist = mobilebackup_factory_info_plist_new();
+			remove(info_path);
+			plist_write_to_filename(info_plist, info_path, PLIST_FORMAT_XML);
+
+			plist_free(info_plist);
+			info_plist = NULL;
+
+			/* request backup from device with manifest from last backup */
+			PRINT_VERBOSE(1, "Requesting backup from device...\n");
+
+			err = mobilebackup2_send_request(mobilebackup2, "Backup", uuid, NULL, NULL);
+			if (err == MOBILEBACKUP2_E_SUCCESS) {
+				if (is_full_backup) {
+					PRINT_VERBOSE(1, "Full backup mode.\n");
+				}	else {
+					PRINT_VERBOSE(1, "Incremental backup mode.\n");
+				}
+			} else {
+				if (err == MOBILEBACKUP2_E_BAD_VERSION) {
+					printf("ERROR: Could not start backup process: backup protocol version mismatch!\n");
+				} else if (err == MOBILEBACKUP2_E_REPLY_NOT_OK) {
+					printf("ERROR: Could not start backup process: device refused to start the backup process.\n");
+				} else {
+					printf("ERROR: Could not start backup process: unspecified error occured\n");
+				}
+				cmd = CMD_LEAVE;
+			}
+			break;
+			case CMD_RESTORE:
+			/* TODO: verify battery on AC enough battery remaining */
+
+			/* verify if Status.plist says we read from an successful backup */
+			if (!mb2_status_check_snapshot_state(backup_directory, uuid, "finished")) {
+				printf("ERROR: Cannot ensure we restore from a successful backup. Aborting.\n");
+				cmd = CMD_LEAVE;
+				break;
+			}
 
 			PRINT_VERBOSE(1, "Starting Restore...\n");
 
@@ -1428,10 +4088,7 @@ checkpoint:
 		}
 
 		/* close down the lockdown connection as it is no longer needed */
-		if (client) {
-			lockdownd_client_free(client);
-			client = NULL;
-		}
+		mb2_lockdown_close();
 
 		if (cmd != CMD_LEAVE) {
 			/* reset operation success status */
@@ -1441,7 +4098,21 @@ checkpoint:
 			char *dlmsg = NULL;
 			int file_count = 0;
 			int errcode = 0;
-			const char *errdesc = NULL;
+
+			time_t last_checkpoint = time(NULL);
+			int snapshot_state = 0;
+
+			if (cmd == CMD_BACKUP) {
+				mb2_journal_open(backup_directory, uuid);
+				mb2_digests_open(backup_directory, uuid);
+			}
+			mb2_progress_start(0);
+			writer = mb2_writer_new();
+			manifest_index = mb2_index_open(backup_directory);
+			backup_dirfd = open(backup_directory, O_RDONLY | O_DIRECTORY);
+			if (backup_dirfd < 0) {
+				printf("ERROR: Could not open backup directory: %s\n", strerror(errno));
+			}
 
 			/* process series of DLMessage* operations */
 			do {
@@ -1455,13 +4126,26 @@ checkpoint:
 					sleep(2);
 					goto files_out;
 				}
-				
+
+				if (strcmp(dlmsg, "DLMessageUploadFiles")) {
+					/* everything else may depend on the received files */
+					errcode = mb2_writer_drain(writer);
+					if (errcode) {
+						printf("Error writing received files: %s\n", strerror(errcode));
+						errcode = 0;
+					}
+				}
+
 				if (!strcmp(dlmsg, "DLMessageDownloadFiles")) {
 					/* device wants to download files from the computer */
 					mb2_handle_send_files(message, backup_directory);
 				} else if (!strcmp(dlmsg, "DLMessageUploadFiles")) {
 					/* device wants to send files to the computer */
 					file_count += mb2_handle_receive_files(message, backup_directory);
+					if (journal && (time(NULL) - last_checkpoint >= CHECKPOINT_INTERVAL)) {
+						mb2_writer_checkpoint(writer);
+						last_checkpoint = time(NULL);
+					}
 				} else if (!strcmp(dlmsg, "DLContentsOfDirectory")) {
 					/* list directory contents */
 					mb2_handle_list_directory(message, backup_directory);
@@ -1470,112 +4154,11 @@ checkpoint:
 					mb2_handle_make_directory(message, backup_directory);
 				} else if (!strcmp(dlmsg, "DLMessageMoveFiles")) {
 					/* perform a series of rename operations */
-					plist_t moves = plist_array_get_item(message, 1);
-					uint32_t cnt = plist_dict_get_size(moves);
-					PRINT_VERBOSE(1, "Moving %d file%s\n", cnt, (cnt == 1) ? "" : "s");
-					plist_dict_iter iter = NULL;
-					plist_dict_new_iter(moves, &iter);
-					errcode = 0;
-					errdesc = NULL;
-					if (iter) {
-						char *key = NULL;
-						plist_t val = NULL;
-						do {
-							plist_dict_next_item(moves, iter, &key, &val);
-							if (key && (plist_get_node_type(val) == PLIST_STRING)) {
-								char *str = NULL;
-								plist_get_string_val(val, &str);
-								if (str) {
-									gchar *newpath = g_build_path(G_DIR_SEPARATOR_S, backup_directory, str, NULL);
-									g_free(str);
-									gchar *oldpath = g_build_path(G_DIR_SEPARATOR_S, backup_directory, key, NULL);
-
-									remove(newpath);
-									if (rename(oldpath, newpath) < 0) {
-										printf("Renameing '%s' to '%s' failed: %s (%d)\n", oldpath, newpath, strerror(errno), errno);
-										errcode = errno_to_device_error(errno);
-										errdesc = strerror(errno);
-										break;
-									}
-									g_free(oldpath);
-									g_free(newpath);
-								}
-								free(key);
-								key = NULL;
-							}
-						} while (val);
-						free(iter);
-					} else {
-						errcode = -1;
-						errdesc = "Could not create dict iterator";
-						printf("Could not create dict iterator\n");
-					}
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, plist_new_dict());
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
+					mb2_handle_move_files(message);
 				} else if (!strcmp(dlmsg, "DLMessageRemoveFiles")) {
-					plist_t removes = plist_array_get_item(message, 1);
-					uint32_t cnt = plist_array_get_size(removes);
-					PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
-					uint32_t ii = 0;
-					errcode = 0;
-					errdesc = NULL;
-					for (ii = 0; ii < cnt; ii++) {
-						plist_t val = plist_array_get_item(removes, ii);
-						if (plist_get_node_type(val) == PLIST_STRING) {
-							char *str = NULL;
-							plist_get_string_val(val, &str);
-							if (str) {
-								gchar *newpath = g_build_path(G_DIR_SEPARATOR_S, backup_directory, str, NULL);
-								g_free(str);
-								if (remove(newpath) < 0) {
-									printf("Could not remove '%s': %s (%d)\n", newpath, strerror(errno), errno);
-									errcode = errno_to_device_error(errno);
-									errdesc = strerror(errno);
-								}
-								g_free(newpath);
-							}
-						}
-					}
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, plist_new_dict());
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
+					mb2_handle_remove_files(message);
 				} else if (!strcmp(dlmsg, "DLMessageCopyItem")) {
-					plist_t srcpath = plist_array_get_item(message, 1);
-					plist_t dstpath = plist_array_get_item(message, 2);
-					errcode = 0;
-					errdesc = NULL;
-					if ((plist_get_node_type(srcpath) == PLIST_STRING) && (plist_get_node_type(dstpath) == PLIST_STRING)) {
-						char *src = NULL;
-						char *dst = NULL;
-						plist_get_string_val(srcpath, &src);
-						plist_get_string_val(dstpath, &dst);
-						if (src && dst) {
-							gchar *oldpath = g_build_path(G_DIR_SEPARATOR_S, backup_directory, src, NULL);
-							gchar *newpath = g_build_path(G_DIR_SEPARATOR_S, backup_directory, dst, NULL);
-
-							PRINT_VERBOSE(1, "Copying '%s' to '%s'\n", src, dst);
-
-							/* check that src exists */
-							if (g_file_test(oldpath, G_FILE_TEST_IS_DIR)) {
-								mb2_copy_directory_by_path(oldpath, newpath);
-							} else if (g_file_test(oldpath, G_FILE_TEST_IS_REGULAR)) {
-								mb2_copy_file_by_path(oldpath, newpath);
-							}
-
-							g_free(newpath);
-							g_free(oldpath);
-						}
-						g_free(src);
-						g_free(dst);
-					}
-
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, plist_new_dict());
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
+					mb2_handle_copy_item(message);
 				} else if (!strcmp(dlmsg, "DLMessageDisconnect")) {
 					break;
 				} else if (!strcmp(dlmsg, "DLMessageProcessMessage")) {
@@ -1618,115 +4201,597 @@ checkpoint:
 						free(str);
 					}
 
-					break;
-				}
+					break;
+				}
+
+				/* print status */
+				if (plist_array_get_size(message) >= 3) {
+					plist_t pnode = plist_array_get_item(message, 3);
+					if (pnode && (plist_get_node_type(pnode) == PLIST_REAL)) {
+						double percent = 0.0;
+						plist_get_real_val(pnode, &percent);
+						if (percent > 0) {
+							mb2_progress_set_device_percent(percent);
+							mb2_progress_add(0, 0);
+						}
+					}
+				}
+
+				if (message)
+					plist_free(message);
+				message = NULL;
+
+files_out:
+				if (quit_flag > 0) {
+					/* need to cancel the backup here */
+					//mobilebackup_send_error(mobilebackup, "Cancelling DLSendFile");
+
+					/* remove any atomic Manifest.plist.tmp */
+
+					/*manifest_path = mobilebackup_build_path(backup_directory, "Manifest", ".plist.tmp");
+					if (stat(manifest_path, &st) == 0)
+						remove(manifest_path);*/
+					break;
+				}
+			} while (1);
+
+			/* all received files hit the disk together */
+			errcode = mb2_writer_drain(writer);
+			if (errcode) {
+				printf("Error writing received files: %s\n", strerror(errcode));
+			}
+			mb2_progress_finish();
+
+			/* files received in an interrupted backup are kept for resuming */
+			mb2_writer_free(writer, (cmd == CMD_BACKUP));
+			writer = NULL;
+			mb2_index_close(manifest_index, !quit_flag);
+			manifest_index = NULL;
+			if (backup_dirfd >= 0) {
+				close(backup_dirfd);
+				backup_dirfd = -1;
+			}
+			if (cmd == CMD_BACKUP) {
+				snapshot_state = mb2_status_check_snapshot_state(backup_directory, uuid, "finished");
+				mb2_journal_close(uuid, (snapshot_state == 1));
+				mb2_digests_close();
+			}
+
+			/* report operation status to user */
+			switch (cmd) {
+				case CMD_BACKUP:
+					PRINT_VERBOSE(1, "Received %d files from device.\n", file_count);
+					if (snapshot_state) {
+						completed_loc = (snapshot_state == 1);
+						PRINT_VERBOSE(1, "Backup Successful.\n");
+					} else {
+						if (quit_flag) {
+							PRINT_VERBOSE(1, "Backup Aborted.\n");
+						} else {
+							PRINT_VERBOSE(1, "Backup Failed.\n");
+						}
+					}
+				break;
+				case CMD_UNBACK:
+				if (quit_flag) {
+					PRINT_VERBOSE(1, "Unback Aborted.\n");
+				} else {
+					PRINT_VERBOSE(1, "The files can now be found in the \"_unback_\" directory.\n");
+					completed_loc = 1;
+					PRINT_VERBOSE(1, "Unback Successful.\n");
+				}
+				break;
+				case CMD_RESTORE:
+				if (cmd_flags & CMD_FLAG_RESTORE_REBOOT)
+					PRINT_VERBOSE(1, "The device should reboot now.\n");
+				if (operation_ok) {
+					completed_loc = 1;
+					PRINT_VERBOSE(1, "Restore Successful.\n");
+				} else {
+					PRINT_VERBOSE(1, "Restore Failed.\n");
+				}
+				
+				break;
+				case CMD_INFO:
+				case CMD_LIST:
+				case CMD_LEAVE:
+				default:
+				if (quit_flag) {
+					PRINT_VERBOSE(1, "Operation Aborted.\n");
+				} else if (cmd == CMD_LEAVE) {
+					PRINT_VERBOSE(1, "Operation Failed.\n");
+				} else {
+					completed_loc = 1;
+					PRINT_VERBOSE(1, "Operation Successful.\n");
+				}
+				break;
+			}
+		}
+		if (lockfile) {
+			afc_file_lock(afc, lockfile, AFC_LOCK_UN);
+			afc_file_close(afc, lockfile);
+			lockfile = 0;
+			if (cmd == CMD_BACKUP)
+				do_post_notification(NP_SYNC_DID_FINISH);
+		}
+	} else {
+		printf("ERROR: Could not start service %s.\n", MOBILEBACKUP2_SERVICE_NAME);
+	}
+
+	mb2_lockdown_close();
+
+	if (mobilebackup2) {
+		mobilebackup2_client_free(mobilebackup2);
+		mobilebackup2 = NULL;
+	}
+
+	if (afc) {
+		afc_client_free(afc);
+		afc = NULL;
+	}
+
+	if (np)
+		np_client_free(np);
+
+	g_free(info_path);
+
+	if (completed)
+		*completed = completed_loc;
+
+	return 0;
+}
+
+/** Default time between two backups of a device in daemon mode */
+#define DAEMON_DEFAULT_INTERVAL 86400
+
+/** Delay before a failed backup is retried, doubled with every failure */
+#define DAEMON_RETRY_DELAY 60
+
+/** Seconds a pooled lockdown session stays open while unused */
+#define DAEMON_SESSION_IDLE_TIMEOUT 300
+
+struct mb2_daemon_device {
+	idevice_t device;
+	int attached;
+	time_t next_run;
+	unsigned int failures;
+	/* attached again since the handle was created */
+	int renew;
+};
+
+struct mb2_daemon {
+	GMutex *mutex;
+	GCond *cond;
+	GHashTable *devices;
+	const char *backup_directory;
+	const char *only_uuid;
+	unsigned int interval;
+};
+
+struct mb2_daemon_pick {
+	time_t now;
+	const char *uuid;
+	struct mb2_daemon_device *dev;
+};
+
+static void mb2_daemon_device_free(gpointer data)
+{
+	struct mb2_daemon_device *dev = (struct mb2_daemon_device*)data;
+	if (dev->device)
+		idevice_free(dev->device);
+	free(dev);
+}
+
+/**
+ * Returns when the last backup of the device finished, or 0 if there is
+ * no finished backup.
+ */
+static time_t mb2_daemon_last_backup(const char *backup_directory, const char *uuid)
+{
+	struct stat st;
+	gchar *path = g_build_path(G_DIR_SEPARATOR_S, backup_directory, uuid, "Status.plist", NULL);
+	int res = stat(path, &st);
+
+	g_free(path);
+	if ((res != 0) || (mb2_status_check_snapshot_state(backup_directory, uuid, "finished") != 1))
+		return 0;
+	return st.st_mtime;
+}
+
+static void mb2_daemon_event_cb(const idevice_event_t *event, void *user_data)
+{
+	struct mb2_daemon *d = (struct mb2_daemon*)user_data;
+	struct mb2_daemon_device *dev;
+
+	if (d->only_uuid && strcmp(event->uuid, d->only_uuid))
+		return;
+
+	g_mutex_lock(d->mutex);
+	dev = (struct mb2_daemon_device*)g_hash_table_lookup(d->devices, event->uuid);
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		if (!dev) {
+			dev = (struct mb2_daemon_device*)calloc(1, sizeof(struct mb2_daemon_device));
+			g_hash_table_insert(d->devices, g_strdup(event->uuid), dev);
+		}
+		if (!dev->attached) {
+			time_t last = mb2_daemon_last_backup(d->backup_directory, event->uuid);
+			dev->attached = 1;
+			dev->renew = 1;
+			dev->failures = 0;
+			dev->next_run = last ? last + d->interval : 0;
+			PRINT_VERBOSE(1, "Device %s attached\n", event->uuid);
+		}
+	} else if ((event->event == IDEVICE_DEVICE_REMOVE) && dev) {
+		dev->attached = 0;
+		PRINT_VERBOSE(1, "Device %s removed\n", event->uuid);
+	}
+	g_cond_signal(d->cond);
+	g_mutex_unlock(d->mutex);
+}
+
+/**
+ * Picks the attached device whose backup is due the longest.
+ */
+static void mb2_daemon_pick_device(gpointer key, gpointer value, gpointer user_data)
+{
+	struct mb2_daemon_pick *pick = (struct mb2_daemon_pick*)user_data;
+	struct mb2_daemon_device *dev = (struct mb2_daemon_device*)value;
+
+	if (!dev->attached || (dev->next_run > pick->now))
+		return;
+	if (!pick->dev || (dev->next_run < pick->dev->next_run)) {
+		pick->uuid = (const char*)key;
+		pick->dev = dev;
+	}
+}
+
+static gboolean mb2_daemon_is_detached(gpointer key, gpointer value, gpointer user_data)
+{
+	return !((struct mb2_daemon_device*)value)->attached;
+}
+
+/**
+ * Runs as a daemon that backs up devices incrementally, once they are
+ * attached and then every interval seconds while they stay attached.
+ * The device handles, the lockdown sessions and the files read for the
+ * Info.plist are kept between the backups, so a backup mostly costs the
+ * transfer of what changed.
+ *
+ * @param backup_directory The backup directory
+ * @param uuid UUID of the only device to back up, or NULL for all
+ * @param interval Seconds between two backups of a device
+ *
+ * @return 0 when exiting as requested, -1 on error.
+ */
+static int mb2_daemon(const char *backup_directory, const char *uuid, unsigned int interval)
+{
+	struct mb2_daemon d;
+	int res = 0;
+
+	d.mutex = g_mutex_new();
+	d.cond = g_cond_new();
+	d.devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, mb2_daemon_device_free);
+	d.backup_directory = backup_directory;
+	d.only_uuid = uuid;
+	d.interval = interval;
+
+	lockdownd_pool_new(&lockdown_pool);
+	lockdownd_pool_set_limits(lockdown_pool, 1, DAEMON_SESSION_IDLE_TIMEOUT);
+	afc_file_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, mb2_afc_cached_file_free);
+
+	if (idevice_event_subscribe(mb2_daemon_event_cb, &d) != IDEVICE_E_SUCCESS) {
+		printf("ERROR: Could not subscribe to device events.\n");
+		exit_requested = 1;
+		res = -1;
+	} else {
+		PRINT_VERBOSE(1, "Waiting for devices, backing up every %u seconds.\n", interval);
+	}
+
+	g_mutex_lock(d.mutex);
+	while (!exit_requested) {
+		struct mb2_daemon_pick pick;
+		struct mb2_daemon_device *dev;
+		gchar *dev_uuid;
+		int completed = 0;
+
+		/* handles of detached devices are stale */
+		g_hash_table_foreach_remove(d.devices, mb2_daemon_is_detached, NULL);
+
+		pick.now = time(NULL);
+		pick.uuid = NULL;
+		pick.dev = NULL;
+		g_hash_table_foreach(d.devices, mb2_daemon_pick_device, &pick);
+		if (!pick.dev) {
+			/* signals don't wake us, so check for them every second */
+			GTimeVal tv;
+			g_get_current_time(&tv);
+			g_time_val_add(&tv, G_USEC_PER_SEC);
+			g_cond_timed_wait(d.cond, d.mutex, &tv);
+			continue;
+		}
+		dev = pick.dev;
+		dev_uuid = g_strdup(pick.uuid);
+		if (dev->renew && dev->device) {
+			idevice_free(dev->device);
+			dev->device = NULL;
+		}
+		dev->renew = 0;
+		g_mutex_unlock(d.mutex);
+
+		/* only this thread frees devices, so dev stays valid */
+		if (!dev->device && (idevice_new(&dev->device, dev_uuid) != IDEVICE_E_SUCCESS)) {
+			dev->device = NULL;
+		}
+		if (dev->device) {
+			PRINT_VERBOSE(1, "Starting incremental backup of %s\n", dev_uuid);
+			phone = dev->device;
+			mb2_run(backup_directory, dev_uuid, CMD_BACKUP, 0, &completed);
+			phone = NULL;
+		}
+		if (!exit_requested) {
+			/* a cancel request of the device only ends the current backup */
+			quit_flag = 0;
+		}
+
+		g_mutex_lock(d.mutex);
+		if (completed) {
+			dev->failures = 0;
+			dev->next_run = time(NULL) + interval;
+		} else {
+			unsigned int delay = DAEMON_RETRY_DELAY << ((dev->failures < 10) ? dev->failures : 10);
+			dev->failures++;
+			dev->next_run = time(NULL) + ((delay < interval) ? delay : interval);
+		}
+		PRINT_VERBOSE(1, "Next backup of %s in %ld seconds\n", dev_uuid, (long)(dev->next_run - time(NULL)));
+		g_free(dev_uuid);
+	}
+	g_mutex_unlock(d.mutex);
+
+	idevice_event_unsubscribe();
+	lockdownd_pool_free(lockdown_pool);
+	lockdown_pool = NULL;
+	g_hash_table_destroy(afc_file_cache);
+	afc_file_cache = NULL;
+	g_hash_table_destroy(d.devices);
+	g_cond_free(d.cond);
+	g_mutex_free(d.mutex);
+
+	return res;
+}
 
-				/* print status */
-				if (plist_array_get_size(message) >= 3) {
-					plist_t pnode = plist_array_get_item(message, 3);
-					if (pnode && (plist_get_node_type(pnode) == PLIST_REAL)) {
-						double progress = 0.0;
-						plist_get_real_val(pnode, &progress);
-						if (progress > 0) {
-							print_progress_real(progress, 0);
-							PRINT_VERBOSE(1, " Finished\n");
-						}
-					}
-				}
+/**
+ * signal handler function for cleaning up properly
+ */
+static void clean_exit(int sig)
+{
+	fprintf(stderr, "Exiting...\n");
+	exit_requested = 1;
+	quit_flag++;
+}
 
-				if (message)
-					plist_free(message);
-				message = NULL;
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] CMD [CMDOPTIONS] DIRECTORY\n", (name ? name + 1: argv[0]));
+	printf("Create or restore backup from the current or specified directory.\n\n");
+	printf("commands:\n");
+	printf("  backup\tcreate backup for the device\n");
+	printf("  restore\trestore last backup to the device\n");
+	printf("    --system\trestore system files, too.\n");
+	printf("    --reboot\treboot the system when done.\n");
+	printf("    --copy\tcreate a copy of backup folder before restoring.\n");
+	printf("    --settings\trestore device settings from the backup.\n");
+	printf("  info\t\tshow details about last completed backup of device\n");
+	printf("  list\t\tlist files of last completed backup in CSV format\n");
+	printf("  unback\tunpack a completed backup in DIRECTORY/_unback_/\n");
+	printf("  verify\tcheck the files of the backup against the digests recorded\n");
+	printf("  \t\twhile receiving them; no device is needed with --uuid\n");
+	printf("    --deep\tread and hash all files again instead of checking sizes\n");
+	printf("  daemon\tkeep running and back up devices incrementally when they\n");
+	printf("  \t\tare attached and then on a schedule\n");
+	printf("    --interval SEC\tseconds between backups of a device (default 86400)\n\n");
+	printf("options:\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID\n");
+	printf("  --store DIR\t\tshare identical files of all backups through DIR\n");
+	printf("  --compress\t\tstore backed up file contents compressed\n");
+	printf("  --progress-fd FD\twrite progress as JSON lines to file descriptor FD\n");
+	printf("  --io-fd FD\t\tpace disk writes through the scheduler connected to FD\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
 
-files_out:
-				if (quit_flag > 0) {
-					/* need to cancel the backup here */
-					//mobilebackup_send_error(mobilebackup, "Cancelling DLSendFile");
+int main(int argc, char *argv[])
+{
+	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
+	int i;
+	char uuid[41];
+	uuid[0] = 0;
+	int cmd = -1;
+	int cmd_flags = 0;
+	unsigned int interval = DAEMON_DEFAULT_INTERVAL;
+	char *backup_directory = NULL;
+	struct stat st;
+	int res;
 
-					/* remove any atomic Manifest.plist.tmp */
+	if (!g_thread_supported())
+		g_thread_init(NULL);
 
-					/*manifest_path = mobilebackup_build_path(backup_directory, "Manifest", ".plist.tmp");
-					if (stat(manifest_path, &st) == 0)
-						remove(manifest_path);*/
-					break;
-				}
-			} while (1);
+	/* we need to exit cleanly on running backups and restores or we cause havok */
+	signal(SIGINT, clean_exit);
+	signal(SIGQUIT, clean_exit);
+	signal(SIGTERM, clean_exit);
+	signal(SIGPIPE, SIG_IGN);
 
-			/* report operation status to user */
-			switch (cmd) {
-				case CMD_BACKUP:
-					PRINT_VERBOSE(1, "Received %d files from device.\n", file_count);
-					if (mb2_status_check_snapshot_state(backup_directory, uuid, "finished")) {
-						PRINT_VERBOSE(1, "Backup Successful.\n");
-					} else {
-						if (quit_flag) {
-							PRINT_VERBOSE(1, "Backup Aborted.\n");
-						} else {
-							PRINT_VERBOSE(1, "Backup Failed.\n");
-						}
-					}
-				break;
-				case CMD_UNBACK:
-				if (quit_flag) {
-					PRINT_VERBOSE(1, "Unback Aborted.\n");
-				} else {
-					PRINT_VERBOSE(1, "The files can now be found in the \"_unback_\" directory.\n");
-					PRINT_VERBOSE(1, "Unback Successful.\n");
-				}
-				break;
-				case CMD_RESTORE:
-				if (cmd_flags & CMD_FLAG_RESTORE_REBOOT)
-					PRINT_VERBOSE(1, "The device should reboot now.\n");
-				if (operation_ok) {
-					PRINT_VERBOSE(1, "Restore Successful.\n");
-				} else {
-					PRINT_VERBOSE(1, "Restore Failed.\n");
-				}
-				
-				break;
-				case CMD_INFO:
-				case CMD_LIST:
-				case CMD_LEAVE:
-				default:
-				if (quit_flag) {
-					PRINT_VERBOSE(1, "Operation Aborted.\n");
-				} else if (cmd == CMD_LEAVE) {
-					PRINT_VERBOSE(1, "Operation Failed.\n");
-				} else {
-					PRINT_VERBOSE(1, "Operation Successful.\n");
-				}
-				break;
+	/* parse cmdline args */
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--uuid")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) != 40)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			strcpy(uuid, argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--store")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
 			}
+			store_dir = argv[i];
+			continue;
 		}
-		if (lockfile) {
-			afc_file_lock(afc, lockfile, AFC_LOCK_UN);
-			afc_file_close(afc, lockfile);
-			lockfile = 0;
-			if (cmd == CMD_BACKUP)
-				do_post_notification(NP_SYNC_DID_FINISH);
+		else if (!strcmp(argv[i], "--progress-fd")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) < 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			progress_fd = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--io-fd")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) < 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			io_fd = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--compress")) {
+#ifdef HAVE_ZLIB
+			compress_files = 1;
+#else
+			printf("This build of %s has no compression support.\n", argv[0]);
+			return -1;
+#endif
+			continue;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		else if (!strcmp(argv[i], "backup")) {
+			cmd = CMD_BACKUP;
+		}
+		else if (!strcmp(argv[i], "restore")) {
+			cmd = CMD_RESTORE;
+		}
+		else if (!strcmp(argv[i], "--system")) {
+			cmd_flags |= CMD_FLAG_RESTORE_SYSTEM_FILES;
+		}
+		else if (!strcmp(argv[i], "--reboot")) {
+			cmd_flags |= CMD_FLAG_RESTORE_REBOOT;
+		}
+		else if (!strcmp(argv[i], "--copy")) {
+			cmd_flags |= CMD_FLAG_RESTORE_COPY_BACKUP;
+		}
+		else if (!strcmp(argv[i], "--settings")) {
+			cmd_flags |= CMD_FLAG_RESTORE_SETTINGS;
+		}
+		else if (!strcmp(argv[i], "info")) {
+			cmd = CMD_INFO;
+			verbose = 0;
+		}
+		else if (!strcmp(argv[i], "list")) {
+			cmd = CMD_LIST;
+			verbose = 0;
+		}
+		else if (!strcmp(argv[i], "unback")) {
+			cmd = CMD_UNBACK;
+		}
+		else if (!strcmp(argv[i], "verify")) {
+			cmd = CMD_VERIFY;
+		}
+		else if (!strcmp(argv[i], "--deep")) {
+			cmd_flags |= CMD_FLAG_VERIFY_DEEP;
+		}
+		else if (!strcmp(argv[i], "daemon")) {
+			cmd = CMD_DAEMON;
+		}
+		else if (!strcmp(argv[i], "--interval")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) <= 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			interval = atoi(argv[i]);
+			continue;
+		}
+		else if (backup_directory == NULL) {
+			backup_directory = argv[i];
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
 		}
-	} else {
-		printf("ERROR: Could not start service %s.\n", MOBILEBACKUP2_SERVICE_NAME);
-		lockdownd_client_free(client);
-		client = NULL;
 	}
 
-	if (client) {
-		lockdownd_client_free(client);
-		client = NULL;
+	/* verify options */
+	if (cmd == -1) {
+		printf("No command specified.\n");
+		print_usage(argc, argv);
+		return -1;
 	}
 
-	if (mobilebackup2)
-		mobilebackup2_client_free(mobilebackup2);
+	if (backup_directory == NULL) {
+		printf("No target backup directory specified.\n");
+		print_usage(argc, argv);
+		return -1;
+	}
 
-	if (afc)
-		afc_client_free(afc);
+	/* verify if passed backup directory exists */
+	if (stat(backup_directory, &st) != 0) {
+		printf("ERROR: Backup directory \"%s\" does not exist!\n", backup_directory);
+		return -1;
+	}
 
-	if (np)
-		np_client_free(np);
+	if ((cmd == CMD_VERIFY) && (uuid[0] != 0)) {
+		return mb2_verify_backup(backup_directory, uuid, (cmd_flags & CMD_FLAG_VERIFY_DEEP));
+	}
+
+	if (cmd == CMD_DAEMON) {
+		return mb2_daemon(backup_directory, (uuid[0] != 0) ? uuid : NULL, interval);
+	}
+
+	if (uuid[0] != 0) {
+		ret = idevice_new(&phone, uuid);
+		if (ret != IDEVICE_E_SUCCESS) {
+			printf("No device found with uuid %s, is it plugged in?\n", uuid);
+			return -1;
+		}
+	}
+	else
+	{
+		ret = idevice_new(&phone, NULL);
+		if (ret != IDEVICE_E_SUCCESS) {
+			printf("No device found, is it plugged in?\n");
+			return -1;
+		}
+		char *newuuid = NULL;
+		idevice_get_uuid(phone, &newuuid);
+		strcpy(uuid, newuuid);
+		free(newuuid);
+	}
+
+	if (cmd == CMD_VERIFY) {
+		/* the device was only needed for its UUID */
+		idevice_free(phone);
+		return mb2_verify_backup(backup_directory, uuid, (cmd_flags & CMD_FLAG_VERIFY_DEEP));
+	}
+
+	res = mb2_run(backup_directory, uuid, cmd, cmd_flags, NULL);
 
 	idevice_free(phone);
 
-	return 0;
+	return res;
 }
 
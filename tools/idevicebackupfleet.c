@@ -0,0 +1,601 @@
+/*
+ * idevicebackupfleet.c
+ * Backs up many devices at once, sharing one disk I/O scheduler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+
+/* messages of the I/O channel, see mb2_io_request() in idevicebackup2.c */
+#define IO_MSG_REQUEST 'R'
+#define IO_MSG_GRANT 'G'
+#define IO_MSG_DONE 'D'
+
+/** Default number of backups running at the same time */
+#define DEFAULT_JOBS 4
+
+/** Default number of disk writes granted at the same time */
+#define DEFAULT_IO_SLOTS 2
+
+/** Interval in milliseconds at which finished backups are collected */
+#define POLL_INTERVAL 100
+
+enum device_state {
+	DEVICE_QUEUED,
+	DEVICE_RUNNING,
+	DEVICE_DONE
+};
+
+struct fleet_device {
+	char *uuid;
+	unsigned int group;
+	enum device_state state;
+	pid_t pid;
+	int io_fd;
+	int status;
+	/* I/O scheduling */
+	char msg[5];
+	unsigned int msg_len;
+	int waiting;
+	uint32_t request;
+	/* writes granted and not done yet */
+	unsigned int writing;
+	double tokens;
+	uint64_t bytes_written;
+};
+
+struct fleet {
+	struct fleet_device *devices;
+	unsigned int num_devices;
+	char **groups;
+	unsigned int num_groups;
+	unsigned int next_group;
+	unsigned int *next_in_group;
+	unsigned int io_slots;
+	unsigned int io_inflight;
+	double bandwidth;
+	gint64 last_refill;
+};
+
+static int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static gint64 fleet_now()
+{
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return ((gint64)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/**
+ * Looks up a group by name, adding it if it doesn't exist yet.
+ */
+static unsigned int fleet_group(struct fleet *fleet, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < fleet->num_groups; i++) {
+		if (!strcmp(fleet->groups[i], name))
+			return i;
+	}
+	fleet->groups = (char **)realloc(fleet->groups, sizeof(char *) * (fleet->num_groups + 1));
+	fleet->groups[fleet->num_groups] = strdup(name);
+	return fleet->num_groups++;
+}
+
+/**
+ * Starts the backup of a device as a child process. Its output goes to
+ * DIRECTORY/UUID.log, its disk writes are paced through a socket pair.
+ */
+static int fleet_start(struct fleet_device *dev, const char *tool, const char *directory, char **extra_args, int num_extra)
+{
+	int fds[2];
+	char fdstr[16];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		fprintf(stderr, "ERROR: socketpair failed: %s\n", strerror(errno));
+		return -1;
+	}
+	/* keep the channels of the other backups out of later children */
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "ERROR: fork failed: %s\n", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		char **args = (char **)malloc(sizeof(char *) * (num_extra + 9));
+		gchar *logpath = g_strdup_printf("%s/%s.log", directory, dev->uuid);
+		int logfd = open(logpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int n = 0;
+		int i;
+
+		close(fds[0]);
+		if (logfd >= 0) {
+			dup2(logfd, STDOUT_FILENO);
+			dup2(logfd, STDERR_FILENO);
+			close(logfd);
+		}
+		/* signals are handled by the orchestrator, which stops the children */
+		signal(SIGINT, SIG_IGN);
+
+		snprintf(fdstr, sizeof(fdstr), "%d", fds[1]);
+		args[n++] = (char *)tool;
+		args[n++] = (char *)"--uuid";
+		args[n++] = dev->uuid;
+		args[n++] = (char *)"--io-fd";
+		args[n++] = fdstr;
+		for (i = 0; i < num_extra; i++) {
+			args[n++] = extra_args[i];
+		}
+		args[n++] = (char *)"backup";
+		args[n++] = (char *)directory;
+		args[n] = NULL;
+		execvp(tool, args);
+		fprintf(stderr, "ERROR: could not run %s: %s\n", tool, strerror(errno));
+		_exit(127);
+	}
+
+	close(fds[1]);
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	dev->pid = pid;
+	dev->io_fd = fds[0];
+	dev->state = DEVICE_RUNNING;
+	dev->msg_len = 0;
+	dev->waiting = 0;
+	dev->writing = 0;
+	dev->tokens = 0;
+	printf("%s: backup started\n", dev->uuid);
+	return 0;
+}
+
+/**
+ * Stops scheduling the writes of a device whose channel was closed.
+ */
+static void fleet_close_io(struct fleet *fleet, struct fleet_device *dev)
+{
+	if (dev->io_fd < 0)
+		return;
+	close(dev->io_fd);
+	dev->io_fd = -1;
+	dev->waiting = 0;
+	fleet->io_inflight -= dev->writing;
+	dev->writing = 0;
+}
+
+/**
+ * Reads the messages a backup sent over its I/O channel.
+ */
+static void fleet_read_io(struct fleet *fleet, struct fleet_device *dev)
+{
+	char buf[64];
+	ssize_t res;
+	ssize_t i;
+
+	res = read(dev->io_fd, buf, sizeof(buf));
+	if (res < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR))
+			return;
+	}
+	if (res <= 0) {
+		fleet_close_io(fleet, dev);
+		return;
+	}
+
+	for (i = 0; i < res; i++) {
+		if (dev->msg_len == 0 && buf[i] == IO_MSG_DONE) {
+			if (dev->writing > 0) {
+				dev->writing--;
+				fleet->io_inflight--;
+			}
+			continue;
+		}
+		dev->msg[dev->msg_len++] = buf[i];
+		if ((dev->msg[0] != IO_MSG_REQUEST) || (dev->msg_len == sizeof(dev->msg))) {
+			if (dev->msg[0] == IO_MSG_REQUEST) {
+				memcpy(&dev->request, dev->msg + 1, sizeof(uint32_t));
+				dev->waiting = 1;
+			}
+			dev->msg_len = 0;
+		}
+	}
+}
+
+/**
+ * Refills the bandwidth allowance of all devices.
+ */
+static void fleet_refill(struct fleet *fleet)
+{
+	gint64 now = fleet_now();
+	double elapsed = (double)(now - fleet->last_refill) / 1000000.0;
+	unsigned int i;
+
+	fleet->last_refill = now;
+	if (fleet->bandwidth <= 0)
+		return;
+	for (i = 0; i < fleet->num_devices; i++) {
+		struct fleet_device *dev = &fleet->devices[i];
+		dev->tokens += fleet->bandwidth * elapsed;
+		/* allow bursts of at most one second */
+		if (dev->tokens > fleet->bandwidth)
+			dev->tokens = fleet->bandwidth;
+	}
+}
+
+/**
+ * Grants waiting writes as long as I/O slots are free. Groups (usually
+ * one per USB controller) take turns, and so do the devices of a group,
+ * so a busy group can't starve the others. A device that used up its
+ * bandwidth allowance waits until it is refilled.
+ */
+static void fleet_schedule(struct fleet *fleet)
+{
+	unsigned int tried_groups;
+
+	fleet_refill(fleet);
+
+	while (fleet->io_inflight < fleet->io_slots) {
+		struct fleet_device *chosen = NULL;
+
+		for (tried_groups = 0; !chosen && (tried_groups < fleet->num_groups); tried_groups++) {
+			unsigned int g = (fleet->next_group + tried_groups) % fleet->num_groups;
+			unsigned int start = fleet->next_in_group[g];
+			unsigned int j;
+
+			for (j = 0; j < fleet->num_devices; j++) {
+				unsigned int idx = (start + j) % fleet->num_devices;
+				struct fleet_device *dev = &fleet->devices[idx];
+				if ((dev->group != g) || !dev->waiting || (dev->io_fd < 0))
+					continue;
+				if ((fleet->bandwidth > 0) && (dev->tokens <= 0))
+					continue;
+				chosen = dev;
+				fleet->next_in_group[g] = idx + 1;
+				fleet->next_group = g + 1;
+				break;
+			}
+		}
+		if (!chosen)
+			break;
+
+		char grant = IO_MSG_GRANT;
+		if (write(chosen->io_fd, &grant, 1) != 1) {
+			fleet_close_io(fleet, chosen);
+			continue;
+		}
+		chosen->waiting = 0;
+		chosen->writing++;
+		chosen->tokens -= chosen->request;
+		chosen->bytes_written += chosen->request;
+		fleet->io_inflight++;
+	}
+}
+
+/**
+ * Parses a size like "512", "64K" or "10M".
+ */
+static double parse_size(const char *str)
+{
+	char *end = NULL;
+	double val = strtod(str, &end);
+
+	if (end && (*end == 'k' || *end == 'K'))
+		val *= 1024;
+	else if (end && (*end == 'm' || *end == 'M'))
+		val *= 1024 * 1024;
+	else if (end && (*end == 'g' || *end == 'G'))
+		val *= 1024 * 1024 * 1024;
+	return val;
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] DIRECTORY\n", (name ? name + 1: argv[0]));
+	printf("Back up several devices at once into DIRECTORY.\n\n");
+	printf("Every device is backed up by its own idevicebackup2 process, which logs\n");
+	printf("to DIRECTORY/UUID.log. The disk writes of all backups are scheduled here.\n\n");
+	printf("options:\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -u, --uuid UUID\tback up this device, can be given several times.\n");
+	printf("  \t\t\tDefault: all attached devices\n");
+	printf("  -j, --jobs NUM\trun at most NUM backups at the same time. Default: %d\n", DEFAULT_JOBS);
+	printf("  -b, --bandwidth SIZE\tlimit the disk writes of every device to SIZE bytes\n");
+	printf("  \t\t\tper second; K, M and G suffixes are accepted\n");
+	printf("  -s, --io-slots NUM\tgrant at most NUM disk writes at the same time. Default: %d\n", DEFAULT_IO_SLOTS);
+	printf("  -g, --group UUID=NAME\tput a device into an I/O group, e.g. named after its\n");
+	printf("  \t\t\tUSB controller; groups get equal shares of the disk\n");
+	printf("  --tool PATH\t\tidevicebackup2 executable to run. Default: idevicebackup2\n");
+	printf("  --compress\t\tpassed on to idevicebackup2\n");
+	printf("  --store DIR\t\tpassed on to idevicebackup2\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fleet fleet;
+	GPtrArray *uuids = g_ptr_array_new();
+	GPtrArray *group_args = g_ptr_array_new();
+	char *extra_args[4];
+	int num_extra = 0;
+	const char *tool = "idevicebackup2";
+	char *directory = NULL;
+	char **dev_list = NULL;
+	unsigned int jobs = DEFAULT_JOBS;
+	unsigned int running = 0;
+	unsigned int next = 0;
+	unsigned int failed = 0;
+	unsigned int i;
+	int count = 0;
+	struct stat st;
+
+	memset(&fleet, '\0', sizeof(fleet));
+	fleet.io_slots = DEFAULT_IO_SLOTS;
+
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* parse cmdline args */
+	for (i = 1; i < (unsigned int)argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			if (num_extra < 4)
+				extra_args[num_extra++] = (char *)"--debug";
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--uuid")) {
+			i++;
+			if (!argv[i] || (strlen(argv[i]) != 40)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			g_ptr_array_add(uuids, argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) < 1)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			jobs = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bandwidth")) {
+			i++;
+			if (!argv[i] || (parse_size(argv[i]) <= 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			fleet.bandwidth = parse_size(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--io-slots")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) < 1)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			fleet.io_slots = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-g") || !strcmp(argv[i], "--group")) {
+			i++;
+			if (!argv[i] || !strchr(argv[i], '=')) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			g_ptr_array_add(group_args, argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--tool")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			tool = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--compress")) {
+			if (num_extra > 3) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			extra_args[num_extra++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--store")) {
+			i++;
+			if (!argv[i] || (num_extra > 2)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			extra_args[num_extra++] = (char *)"--store";
+			extra_args[num_extra++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		else if (directory == NULL) {
+			directory = argv[i];
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	if (directory == NULL) {
+		printf("No target backup directory specified.\n");
+		print_usage(argc, argv);
+		return -1;
+	}
+	if (stat(directory, &st) != 0) {
+		printf("ERROR: Backup directory \"%s\" does not exist!\n", directory);
+		return -1;
+	}
+
+	if (uuids->len == 0) {
+		if (idevice_get_device_list(&dev_list, &count) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+			return -1;
+		}
+		for (i = 0; i < (unsigned int)count; i++) {
+			g_ptr_array_add(uuids, dev_list[i]);
+		}
+	}
+	if (uuids->len == 0) {
+		printf("No device found, is it plugged in?\n");
+		return -1;
+	}
+
+	/* devices without a group get one of their own */
+	fleet.num_devices = uuids->len;
+	fleet.devices = (struct fleet_device *)calloc(fleet.num_devices, sizeof(struct fleet_device));
+	for (i = 0; i < fleet.num_devices; i++) {
+		struct fleet_device *dev = &fleet.devices[i];
+		const char *group = NULL;
+		unsigned int j;
+
+		dev->uuid = (char *)g_ptr_array_index(uuids, i);
+		dev->io_fd = -1;
+		dev->state = DEVICE_QUEUED;
+		for (j = 0; j < group_args->len; j++) {
+			const char *arg = (const char *)g_ptr_array_index(group_args, j);
+			if (!strncmp(arg, dev->uuid, 40) && (arg[40] == '=')) {
+				group = arg + 41;
+			}
+		}
+		dev->group = fleet_group(&fleet, group ? group : dev->uuid);
+	}
+	fleet.next_in_group = (unsigned int *)calloc(fleet.num_groups, sizeof(unsigned int));
+	fleet.last_refill = fleet_now();
+
+	while (1) {
+		struct pollfd *pfds;
+		struct fleet_device **polled;
+		unsigned int npfds = 0;
+		int status;
+		pid_t pid;
+
+		/* start as many backups as allowed */
+		while (!quit_flag && (running < jobs) && (next < fleet.num_devices)) {
+			if (fleet_start(&fleet.devices[next], tool, directory, extra_args, num_extra) == 0) {
+				running++;
+			} else {
+				fleet.devices[next].state = DEVICE_DONE;
+				failed++;
+			}
+			next++;
+		}
+
+		/* collect finished backups */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < fleet.num_devices; i++) {
+				struct fleet_device *dev = &fleet.devices[i];
+				if ((dev->state != DEVICE_RUNNING) || (dev->pid != pid))
+					continue;
+				fleet_close_io(&fleet, dev);
+				dev->state = DEVICE_DONE;
+				dev->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+				if (dev->status != 0)
+					failed++;
+				running--;
+				printf("%s: backup %s (%llu bytes written)\n", dev->uuid, (dev->status == 0) ? "finished" : "failed", (unsigned long long)dev->bytes_written);
+			}
+		}
+
+		if (running == 0 && (quit_flag || (next >= fleet.num_devices)))
+			break;
+
+		if (quit_flag == 1) {
+			printf("Stopping all backups...\n");
+			for (i = 0; i < fleet.num_devices; i++) {
+				if (fleet.devices[i].state == DEVICE_RUNNING)
+					kill(fleet.devices[i].pid, SIGINT);
+			}
+			quit_flag++;
+		}
+
+		/* wait for messages from the running backups */
+		pfds = (struct pollfd *)malloc(sizeof(struct pollfd) * fleet.num_devices);
+		polled = (struct fleet_device **)malloc(sizeof(struct fleet_device *) * fleet.num_devices);
+		for (i = 0; i < fleet.num_devices; i++) {
+			if (fleet.devices[i].io_fd >= 0) {
+				pfds[npfds].fd = fleet.devices[i].io_fd;
+				pfds[npfds].events = POLLIN;
+				pfds[npfds].revents = 0;
+				polled[npfds++] = &fleet.devices[i];
+			}
+		}
+		if (poll(pfds, npfds, POLL_INTERVAL) > 0) {
+			for (i = 0; i < npfds; i++) {
+				if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+					fleet_read_io(&fleet, polled[i]);
+			}
+		}
+		free(polled);
+		free(pfds);
+
+		fleet_schedule(&fleet);
+	}
+
+	printf("%u of %u backups finished successfully.\n", fleet.num_devices - failed, fleet.num_devices);
+
+	for (i = 0; i < fleet.num_groups; i++) {
+		free(fleet.groups[i]);
+	}
+	free(fleet.groups);
+	free(fleet.next_in_group);
+	free(fleet.devices);
+	g_ptr_array_free(uuids, TRUE);
+	g_ptr_array_free(group_args, TRUE);
+	if (dev_list)
+		idevice_device_list_free(dev_list);
+
+	return (failed == 0) ? 0 : -1;
+}
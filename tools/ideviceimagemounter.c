@@ -29,7 +29,7 @@
 #include <getopt.h>
 #include <errno.h>
 #include <glib.h>
-#include <libgen.h>
+#include <sys/stat.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -44,9 +44,6 @@ static int xml_mode = 0;
 static char *uuid = NULL;
 static char *imagetype = NULL;
 
-static const char PKG_PATH[] = "PublicStaging";
-static const char PATH_PREFIX[] = "/private/var/mobile/Media";
-
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -239,6 +236,16 @@ static void plist_node_to_string(plist_t node)
 	}
 }
 
+static void upload_progress(uint64_t bytes_done, uint64_t bytes_total, void *user_data)
+{
+	if (bytes_total > 0) {
+		printf("\r%llu of %llu bytes (%d%%)", (long long unsigned int)bytes_done, (long long unsigned int)bytes_total, (int)((bytes_done * 100) / bytes_total));
+	} else {
+		printf("\r%llu bytes", (long long unsigned int)bytes_done);
+	}
+	fflush(stdout);
+}
+
 static void print_xml(plist_t node)
 {
 	char *xml = NULL;
@@ -362,85 +369,21 @@ int main(int argc, char **argv)
 			goto leave;
 		}
 
-		f = fopen(image_path, "r");
-		if (!f) {
+		struct stat fst;
+		if (stat(image_path, &fst) != 0) {
 			fprintf(stderr, "Error opening image file '%s': %s\n", image_path, strerror(errno));
 			goto leave;
 		}
 
-		char *targetname = NULL;
-		if (asprintf(&targetname, "%s/%s", PKG_PATH, basename(image_path)) < 0) {
-			fprintf(stderr, "Out of memory!?\n");
-			goto leave;
-		}
-		char *mountname = NULL;
-		if (asprintf(&mountname, "%s/%s", PATH_PREFIX, targetname) < 0) {
-			fprintf(stderr, "Out of memory!?\n");
-			goto leave;
-		}
-
-		printf("Copying '%s' --> '%s'\n", image_path, targetname);
-
-		char **strs = NULL;
-		if (afc_get_file_info(afc, PKG_PATH, &strs) != AFC_E_SUCCESS) {
-			if (afc_make_directory(afc, PKG_PATH) != AFC_E_SUCCESS) {
-				fprintf(stderr, "WARNING: Could not create directory '%s' on device!\n", PKG_PATH);
-			}
-		}
-		if (strs) {
-			int i = 0;
-			while (strs[i]) {
-				free(strs[i]);
-				i++;
-			}
-			free(strs);
-		}
-
-		uint64_t af = 0;
-		if ((afc_file_open(afc, targetname, AFC_FOPEN_WRONLY, &af) !=
-			 AFC_E_SUCCESS) || !af) {
-			fclose(f);
-			fprintf(stderr, "afc_file_open on '%s' failed!\n", targetname);
-			goto leave;
-		}
-
-		char buf[8192];
-		size_t amount = 0;
-		do {
-			amount = fread(buf, 1, sizeof(buf), f);
-			if (amount > 0) {
-				uint32_t written, total = 0;
-				while (total < amount) {
-					written = 0;
-					if (afc_file_write(afc, af, buf, amount, &written) !=
-						AFC_E_SUCCESS) {
-						fprintf(stderr, "AFC Write error!\n");
-						break;
-					}
-					total += written;
-				}
-				if (total != amount) {
-					fprintf(stderr, "Error: wrote only %d of %d\n", total,
-							(unsigned int)amount);
-					afc_file_close(afc, af);
-					fclose(f);
-					goto leave;
-				}
-			}
-		}
-		while (amount > 0);
-
-		afc_file_close(afc, af);
-		fclose(f);
-
-		printf("done.\n");
+		printf("Uploading '%s'\n", image_path);
 
-		printf("Mounting...\n");
 		if (!imagetype) {
 			imagetype = strdup("Developer");
 		}
-		err = mobile_image_mounter_mount_image(mim, mountname, sig, sig_length, imagetype, &result);
+		/* skips the upload if the image is mounted already */
+		err = mobile_image_mounter_upload_and_mount_image(mim, afc, image_path, sig, sig_length, imagetype, upload_progress, NULL, &result);
 		free(imagetype);
+		printf("\n");
 		if (err == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 			if (result) {
 				plist_t node = plist_dict_get_item(result, "Status");
@@ -493,6 +436,8 @@ int main(int argc, char **argv)
 					}
 				}
 			}
+		} else if (err == MOBILE_IMAGE_MOUNTER_E_UPLOAD_FAILED) {
+			fprintf(stderr, "Error: could not upload '%s'\n", image_path);
 		} else {
 			printf("Error: mount_image returned %d\n", err);
 
@@ -30,6 +30,13 @@
 
 #define FORMAT_KEY_VALUE 1
 #define FORMAT_XML 2
+#define FORMAT_JSON 3
+
+/** Maximum number of keys that can be queried at once in fleet mode */
+#define MAX_KEYS 64
+
+/** Default number of devices queried at the same time in fleet mode */
+#define DEFAULT_PARALLEL 8
 
 static const char *domains[] = {
 	"com.apple.disk_usage",
@@ -192,6 +199,285 @@ static void plist_node_to_string(plist_t node)
 	}
 }
 
+static void plist_node_to_json(plist_t node);
+
+static void json_print_string(const char *str)
+{
+	const unsigned char *p;
+
+	putchar('"');
+	for (p = (const unsigned char *)str; *p; p++) {
+		switch (*p) {
+		case '"':
+			printf("\\\"");
+			break;
+		case '\\':
+			printf("\\\\");
+			break;
+		case '\n':
+			printf("\\n");
+			break;
+		case '\r':
+			printf("\\r");
+			break;
+		case '\t':
+			printf("\\t");
+			break;
+		default:
+			if (*p < 0x20)
+				printf("\\u%04x", *p);
+			else
+				putchar(*p);
+			break;
+		}
+	}
+	putchar('"');
+}
+
+static void plist_array_to_json(plist_t node)
+{
+	int i, count;
+
+	count = plist_array_get_size(node);
+	printf("[");
+	for (i = 0; i < count; i++) {
+		if (i > 0)
+			printf(",");
+		plist_node_to_json(plist_array_get_item(node, i));
+	}
+	printf("]");
+}
+
+static void plist_dict_to_json(plist_t node)
+{
+	plist_dict_iter it = NULL;
+	char* key = NULL;
+	plist_t subnode = NULL;
+	int first = 1;
+
+	printf("{");
+	plist_dict_new_iter(node, &it);
+	plist_dict_next_item(node, it, &key, &subnode);
+	while (subnode) {
+		if (!first)
+			printf(",");
+		first = 0;
+		json_print_string(key);
+		printf(":");
+		free(key);
+		key = NULL;
+		plist_node_to_json(subnode);
+		plist_dict_next_item(node, it, &key, &subnode);
+	}
+	free(it);
+	printf("}");
+}
+
+static void plist_node_to_json(plist_t node)
+{
+	char *s = NULL;
+	char *data = NULL;
+	double d;
+	uint8_t b;
+	uint64_t u = 0;
+	GTimeVal tv = { 0, 0 };
+
+	if (!node) {
+		printf("null");
+		return;
+	}
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_BOOLEAN:
+		plist_get_bool_val(node, &b);
+		printf("%s", (b ? "true" : "false"));
+		break;
+
+	case PLIST_UINT:
+		plist_get_uint_val(node, &u);
+		printf("%llu", (long long)u);
+		break;
+
+	case PLIST_REAL:
+		plist_get_real_val(node, &d);
+		printf("%f", d);
+		break;
+
+	case PLIST_STRING:
+	case PLIST_KEY:
+		if (plist_get_node_type(node) == PLIST_KEY)
+			plist_get_key_val(node, &s);
+		else
+			plist_get_string_val(node, &s);
+		json_print_string(s ? s : "");
+		free(s);
+		break;
+
+	case PLIST_DATA:
+		plist_get_data_val(node, &data, &u);
+		s = g_base64_encode((guchar *)data, u);
+		free(data);
+		json_print_string(s);
+		g_free(s);
+		break;
+
+	case PLIST_DATE:
+		plist_get_date_val(node, (int32_t*)&tv.tv_sec, (int32_t*)&tv.tv_usec);
+		s = g_time_val_to_iso8601(&tv);
+		json_print_string(s);
+		g_free(s);
+		break;
+
+	case PLIST_ARRAY:
+		plist_array_to_json(node);
+		break;
+
+	case PLIST_DICT:
+		plist_dict_to_json(node);
+		break;
+
+	default:
+		printf("null");
+		break;
+	}
+}
+
+/** What fleet mode queries on every device */
+struct fleet_query {
+	int simple;
+	const char *domain;
+	const char **keys;
+	uint32_t num_keys;
+};
+
+/** One device queried in fleet mode */
+struct fleet_device {
+	struct fleet_query *query;
+	char *uuid;
+	plist_t result;
+};
+
+static void fleet_set_error(struct fleet_device *dev, const char *error)
+{
+	plist_dict_insert_item(dev->result, "Error", plist_new_string(error));
+}
+
+/**
+ * Queries one device, run on the threads of the pool. Several keys are
+ * requested at once with lockdownd_get_values().
+ */
+static void fleet_query_device(gpointer data, gpointer user_data)
+{
+	struct fleet_device *dev = (struct fleet_device *)data;
+	struct fleet_query *query = dev->query;
+	lockdownd_client_t client = NULL;
+	idevice_t phone = NULL;
+	lockdownd_error_t lerr;
+	uint32_t i;
+
+	dev->result = plist_new_dict();
+
+	if (idevice_new(&phone, dev->uuid) != IDEVICE_E_SUCCESS) {
+		fleet_set_error(dev, "Device not found");
+		return;
+	}
+
+	lerr = query->simple ?
+		lockdownd_client_new(phone, &client, "ideviceinfo") :
+		lockdownd_client_new_with_handshake(phone, &client, "ideviceinfo");
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		fleet_set_error(dev, "Could not connect to lockdownd");
+		idevice_free(phone);
+		return;
+	}
+
+	if (query->num_keys == 0) {
+		plist_t node = NULL;
+		if ((lockdownd_get_value(client, query->domain, NULL, &node) == LOCKDOWN_E_SUCCESS) && node) {
+			plist_free(dev->result);
+			dev->result = node;
+		} else {
+			fleet_set_error(dev, "Query failed");
+		}
+	} else {
+		const char **query_domains = (const char **)malloc(sizeof(char*) * query->num_keys);
+		plist_t *values = (plist_t *)malloc(sizeof(plist_t) * query->num_keys);
+		for (i = 0; i < query->num_keys; i++) {
+			query_domains[i] = query->domain;
+		}
+		if (lockdownd_get_values(client, query_domains, query->keys, query->num_keys, values) == LOCKDOWN_E_SUCCESS) {
+			for (i = 0; i < query->num_keys; i++) {
+				if (values[i])
+					plist_dict_insert_item(dev->result, query->keys[i], values[i]);
+			}
+		} else {
+			for (i = 0; i < query->num_keys; i++) {
+				if (values[i])
+					plist_free(values[i]);
+			}
+			fleet_set_error(dev, "Query failed");
+		}
+		free(values);
+		free(query_domains);
+	}
+
+	lockdownd_client_free(client);
+	idevice_free(phone);
+}
+
+/**
+ * Queries all attached devices on a bounded number of threads and prints
+ * the results as one document, a dictionary keyed by device uuid.
+ */
+static int fleet_run(struct fleet_query *query, int parallel, int format)
+{
+	struct fleet_device *devs;
+	GThreadPool *pool;
+	char **dev_list = NULL;
+	plist_t root;
+	char *xml_doc = NULL;
+	uint32_t xml_length = 0;
+	int count = 0;
+	int i;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (idevice_get_device_list(&dev_list, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return -1;
+	}
+
+	devs = (struct fleet_device *)calloc(count ? count : 1, sizeof(struct fleet_device));
+	pool = g_thread_pool_new(fleet_query_device, NULL, parallel, TRUE, NULL);
+	for (i = 0; i < count; i++) {
+		devs[i].query = query;
+		devs[i].uuid = dev_list[i];
+		g_thread_pool_push(pool, &devs[i], NULL);
+	}
+	/* waits for all queries to finish */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	root = plist_new_dict();
+	for (i = 0; i < count; i++) {
+		plist_dict_insert_item(root, devs[i].uuid, devs[i].result);
+	}
+
+	if (format == FORMAT_JSON) {
+		plist_node_to_json(root);
+		printf("\n");
+	} else {
+		plist_to_xml(root, &xml_doc, &xml_length);
+		printf("%s", xml_doc);
+		free(xml_doc);
+	}
+
+	plist_free(root);
+	free(devs);
+	idevice_device_list_free(dev_list);
+	return 0;
+}
+
 static void print_usage(int argc, char **argv)
 {
 	int i = 0;
@@ -206,6 +492,10 @@ static void print_usage(int argc, char **argv)
 	printf("  -q, --domain NAME\tset domain of query to NAME. Default: None\n");
 	printf("  -k, --key NAME\tonly query key specified by NAME. Default: All keys.\n");
 	printf("  -x, --xml\t\toutput information as xml plist instead of key/value pairs\n");
+	printf("  -a, --all\t\tquery all attached devices at once (fleet mode), -k can\n");
+	printf("  \t\t\tbe given several times; prints one xml plist keyed by UUID\n");
+	printf("  -p, --parallel NUM\tquery at most NUM devices at the same time. Default: %d\n", DEFAULT_PARALLEL);
+	printf("  -j, --json\t\toutput json instead of an xml plist in fleet mode\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
 	printf("  Known domains are:\n\n");
@@ -230,6 +520,10 @@ int main(int argc, char *argv[])
 	uint32_t xml_length;
 	plist_t node = NULL;
 	plist_type node_type;
+	int fleet = 0;
+	int parallel = DEFAULT_PARALLEL;
+	const char *keys[MAX_KEYS];
+	uint32_t num_keys = 0;
 	uuid[0] = 0;
 
 	/* parse cmdline args */
@@ -265,7 +559,29 @@ int main(int argc, char *argv[])
 				print_usage(argc, argv);
 				return 0;
 			}
-			key = strdup(argv[i]);
+			if (num_keys == MAX_KEYS) {
+				fprintf(stderr, "ERROR: Too many keys.\n");
+				return -1;
+			}
+			key = argv[i];
+			keys[num_keys++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--all")) {
+			fleet = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--parallel")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) < 1)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			parallel = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--json")) {
+			format = FORMAT_JSON;
 			continue;
 		}
 		else if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "--xml")) {
@@ -286,6 +602,20 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (fleet) {
+		struct fleet_query query;
+		int res;
+
+		query.simple = simple;
+		query.domain = domain;
+		query.keys = keys;
+		query.num_keys = num_keys;
+		res = fleet_run(&query, parallel, format);
+		if (domain != NULL)
+			free(domain);
+		return res;
+	}
+
 	if (uuid[0] != 0) {
 		ret = idevice_new(&phone, uuid);
 		if (ret != IDEVICE_E_SUCCESS) {
@@ -313,6 +643,10 @@ int main(int argc, char *argv[])
 	if(lockdownd_get_value(client, domain, key, &node) == LOCKDOWN_E_SUCCESS) {
 		if (node) {
 			switch (format) {
+			case FORMAT_JSON:
+				plist_node_to_json(node);
+				printf("\n");
+				break;
 			case FORMAT_XML:
 				plist_to_xml(node, &xml_doc, &xml_length);
 				printf("%s", xml_doc);
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -33,6 +34,44 @@
 
 void print_usage(int argc, char **argv);
 
+static int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+struct capture_state {
+	unsigned int frames;
+	int error;
+};
+
+static int save_frame_cb(const char *imgdata, uint64_t imgsize, void *user_data)
+{
+	struct capture_state *state = (struct capture_state*)user_data;
+	char filename[48];
+	char stamp[24];
+	time_t now = time(NULL);
+	FILE *f;
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d-%H-%M-%S", gmtime(&now));
+	snprintf(filename, sizeof(filename), "screenshot-%s-%05u.tiff", stamp, state->frames);
+	f = fopen(filename, "w");
+	if (!f) {
+		printf("Could not open %s for writing: %s\n", filename, strerror(errno));
+		state->error = 1;
+		return 1;
+	}
+	if (fwrite(imgdata, 1, (size_t)imgsize, f) != (size_t)imgsize) {
+		printf("Could not save screenshot to file %s!\n", filename);
+		state->error = 1;
+	}
+	fclose(f);
+	state->frames++;
+
+	return (state->error || quit_flag);
+}
+
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -42,6 +81,10 @@ int main(int argc, char **argv)
 	int result = -1;
 	int i;
 	char *uuid = NULL;
+	unsigned int count = 1;
+	unsigned int interval = 0;
+	int continuous = 0;
+	int count_given = 0;
 
 	/* parse cmdline args */
 	for (i = 1; i < argc; i++) {
@@ -58,6 +101,27 @@ int main(int argc, char **argv)
 			uuid = strdup(argv[i]);
 			continue;
 		}
+		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--count")) {
+			i++;
+			if (!argv[i] || (atoi(argv[i]) < 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			count = atoi(argv[i]);
+			count_given = 1;
+			continuous = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rate")) {
+			i++;
+			if (!argv[i] || (atof(argv[i]) <= 0)) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			interval = (unsigned int)(1000 / atof(argv[i]));
+			continuous = 1;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -68,6 +132,10 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (continuous && !count_given) {
+		count = 0;
+	}
+
 	if (IDEVICE_E_SUCCESS != idevice_new(&device, uuid)) {
 		printf("No device found, is it plugged in?\n");
 		if (uuid) {
@@ -90,6 +158,18 @@ int main(int argc, char **argv)
 	if (port > 0) {
 		if (screenshotr_client_new(device, port, &shotr) != SCREENSHOTR_E_SUCCESS) {
 			printf("Could not connect to screenshotr!\n");
+		} else if (continuous) {
+			struct capture_state state;
+			memset(&state, '\0', sizeof(state));
+			signal(SIGINT, clean_exit);
+			signal(SIGTERM, clean_exit);
+			if ((screenshotr_capture(shotr, interval, count, save_frame_cb, &state) == SCREENSHOTR_E_SUCCESS) && !state.error) {
+				result = 0;
+			} else if (!state.error) {
+				printf("Could not get screenshot!\n");
+			}
+			printf("%u screenshot%s saved\n", state.frames, (state.frames == 1) ? "" : "s");
+			screenshotr_client_free(shotr);
 		} else {
 			char *imgdata = NULL;
 			char filename[36];
@@ -134,6 +214,8 @@ void print_usage(int argc, char **argv)
         printf("the screenshotr service is not available.\n\n");
         printf("  -d, --debug\t\tenable communication debugging\n");
         printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID\n");
+        printf("  -n, --count N\t\ttake N screenshots in a row, 0 until interrupted\n");
+        printf("  -r, --rate FPS\t\ttake at most FPS screenshots per second until interrupted\n");
         printf("  -h, --help\t\tprints usage information\n");
         printf("\n");
 }
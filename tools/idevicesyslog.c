@@ -24,12 +24,69 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <glib.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/syslog_relay.h>
 
 static int quit_flag = 0;
+static int reopen_flag = 0;
+
+/** Output is collected in a buffer of this size and written in one go */
+#define OUTPUT_BUFFER_SIZE 65536
+
+/** Interval in milliseconds at which collected output is written */
+#define FLUSH_INTERVAL 200
+
+/** Lines of more than this many bytes waiting to be written hold up the devices */
+#define MAX_PENDING_OUTPUT (4 * 1024 * 1024)
+
+/** Events of a device within this many milliseconds are collapsed */
+#define EVENT_DEBOUNCE 500
+
+/** Number of rotated output files kept by default */
+#define DEFAULT_KEEP 5
+
+/**
+ * Writer collecting the lines of all devices and writing them out in
+ * batches from its own thread.
+ */
+struct syslog_writer {
+	GMutex *mutex;
+	GCond *cond;
+	GString *pending;
+	GThread *thread;
+	int quit;
+	FILE *out;
+	const char *path;
+	off_t size;
+	off_t rotate_size;
+	unsigned int keep;
+	/* host time of the last line, formatted once per second */
+	time_t stamp_time;
+	char stamp[32];
+};
+
+/** A device whose syslog is relayed by the aggregator */
+struct syslog_device {
+	struct syslog_aggregator *agg;
+	char *uuid;
+	idevice_t device;
+	syslog_relay_client_t relay;
+	int dead;
+};
+
+struct syslog_aggregator {
+	struct syslog_writer writer;
+	idevice_reactor_t reactor;
+	GMutex *mutex;
+	GHashTable *devices;
+	const char *process;
+	const char *pattern;
+};
 
 void print_usage(int argc, char **argv);
 
@@ -42,6 +99,383 @@ static void clean_exit(int sig)
 	quit_flag++;
 }
 
+/**
+ * signal handler function asking to reopen the output file, e.g. after
+ * it was rotated by logrotate
+ */
+static void reopen_output(int sig)
+{
+	reopen_flag++;
+}
+
+static void syslog_line_cb(const char *line, uint32_t length, void *user_data)
+{
+	fwrite(line, 1, length, stdout);
+	putchar('\n');
+}
+
+/**
+ * Opens the output file of the writer for appending.
+ */
+static int writer_open(struct syslog_writer *writer)
+{
+	struct stat st;
+
+	writer->out = fopen(writer->path, "a");
+	if (!writer->out) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", writer->path, strerror(errno));
+		return -1;
+	}
+	writer->size = (fstat(fileno(writer->out), &st) == 0) ? st.st_size : 0;
+	return 0;
+}
+
+/**
+ * Moves FILE to FILE.1, FILE.1 to FILE.2 and so on, dropping the oldest
+ * file, and starts a new FILE.
+ */
+static void writer_rotate(struct syslog_writer *writer)
+{
+	unsigned int i;
+
+	fclose(writer->out);
+	writer->out = NULL;
+	if (writer->keep == 0) {
+		remove(writer->path);
+	} else {
+		for (i = writer->keep; i > 0; i--) {
+			gchar *from = (i == 1) ? g_strdup(writer->path) : g_strdup_printf("%s.%u", writer->path, i - 1);
+			gchar *to = g_strdup_printf("%s.%u", writer->path, i);
+			rename(from, to);
+			g_free(from);
+			g_free(to);
+		}
+	}
+	writer_open(writer);
+}
+
+/**
+ * Thread function writing the collected lines every FLUSH_INTERVAL
+ * milliseconds, or as soon as OUTPUT_BUFFER_SIZE bytes are waiting.
+ */
+static gpointer writer_thread(gpointer data)
+{
+	struct syslog_writer *writer = (struct syslog_writer *)data;
+	GString *batch = g_string_sized_new(OUTPUT_BUFFER_SIZE);
+	GString *tmp;
+	GTimeVal until;
+	int quit = 0;
+
+	g_mutex_lock(writer->mutex);
+	while (!quit) {
+		if (!writer->quit && (writer->pending->len < OUTPUT_BUFFER_SIZE)) {
+			g_get_current_time(&until);
+			g_time_val_add(&until, FLUSH_INTERVAL * 1000);
+			g_cond_timed_wait(writer->cond, writer->mutex, &until);
+		}
+		quit = writer->quit;
+		/* take the lines and let the devices go on while writing */
+		tmp = batch;
+		batch = writer->pending;
+		writer->pending = tmp;
+		g_cond_broadcast(writer->cond);
+		g_mutex_unlock(writer->mutex);
+
+		if (writer->path && reopen_flag) {
+			reopen_flag = 0;
+			if (writer->out)
+				fclose(writer->out);
+			writer_open(writer);
+		}
+		if ((batch->len > 0) && writer->out) {
+			if (fwrite(batch->str, 1, batch->len, writer->out) != batch->len) {
+				fprintf(stderr, "ERROR: Could not write output: %s\n", strerror(errno));
+			}
+			fflush(writer->out);
+			writer->size += batch->len;
+			if (writer->path && (writer->rotate_size > 0) && (writer->size >= writer->rotate_size))
+				writer_rotate(writer);
+		}
+		g_string_truncate(batch, 0);
+
+		g_mutex_lock(writer->mutex);
+	}
+	g_mutex_unlock(writer->mutex);
+
+	g_string_free(batch, TRUE);
+	return NULL;
+}
+
+/**
+ * Queues a line for writing, prefixed with the host time and the tag of
+ * the device. Waits while too much output is pending.
+ */
+static void writer_add_line(struct syslog_writer *writer, const char *tag, const char *line, uint32_t length)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+
+	g_mutex_lock(writer->mutex);
+	while ((writer->pending->len >= MAX_PENDING_OUTPUT) && !writer->quit) {
+		g_cond_wait(writer->cond, writer->mutex);
+	}
+	if (now.tv_sec != writer->stamp_time) {
+		struct tm tm;
+		time_t t = now.tv_sec;
+		localtime_r(&t, &tm);
+		strftime(writer->stamp, sizeof(writer->stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		writer->stamp_time = now.tv_sec;
+	}
+	g_string_append_printf(writer->pending, "%s.%03d %s ", writer->stamp, (int)(now.tv_usec / 1000), tag);
+	g_string_append_len(writer->pending, line, length);
+	g_string_append_c(writer->pending, '\n');
+	if (writer->pending->len >= OUTPUT_BUFFER_SIZE)
+		g_cond_broadcast(writer->cond);
+	g_mutex_unlock(writer->mutex);
+}
+
+/**
+ * Called on a reactor thread for each line of a device.
+ */
+static void aggregator_line_cb(const char *line, uint32_t length, void *user_data)
+{
+	struct syslog_device *dev = (struct syslog_device *)user_data;
+	struct syslog_aggregator *agg = dev->agg;
+
+	if (!line) {
+		/* connection lost, the main loop cleans up */
+		const char msg[] = "--- syslog relay ended";
+		writer_add_line(&agg->writer, dev->uuid, msg, sizeof(msg) - 1);
+		g_mutex_lock(agg->mutex);
+		dev->dead = 1;
+		g_mutex_unlock(agg->mutex);
+		return;
+	}
+	writer_add_line(&agg->writer, dev->uuid, line, length);
+}
+
+/**
+ * Disconnects a device and frees it.
+ */
+static void device_free(struct syslog_device *dev)
+{
+	if (dev->relay)
+		syslog_relay_client_free(dev->relay);
+	if (dev->device)
+		idevice_free(dev->device);
+	free(dev->uuid);
+	free(dev);
+}
+
+/**
+ * Connects to the syslog_relay service of a device that appeared and
+ * hands the connection to the reactor.
+ */
+static void aggregator_add_device(struct syslog_aggregator *agg, const char *uuid)
+{
+	struct syslog_device *dev;
+	lockdownd_client_t client = NULL;
+	uint16_t port = 0;
+
+	g_mutex_lock(agg->mutex);
+	dev = (struct syslog_device *)g_hash_table_lookup(agg->devices, uuid);
+	g_mutex_unlock(agg->mutex);
+	if (dev)
+		return;
+
+	dev = (struct syslog_device *)calloc(1, sizeof(struct syslog_device));
+	dev->uuid = strdup(uuid);
+	dev->agg = agg;
+
+	if (idevice_new(&dev->device, uuid) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "%s: ERROR: Could not connect to device\n", uuid);
+		device_free(dev);
+		return;
+	}
+	if (lockdownd_client_new_with_handshake(dev->device, &client, "idevicesyslog") != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "%s: ERROR: Could not connect to lockdownd\n", uuid);
+		device_free(dev);
+		return;
+	}
+	if ((lockdownd_start_service(client, "com.apple.syslog_relay", &port) != LOCKDOWN_E_SUCCESS) || !port) {
+		fprintf(stderr, "%s: ERROR: Could not start service com.apple.syslog_relay.\n", uuid);
+		lockdownd_client_free(client);
+		device_free(dev);
+		return;
+	}
+	lockdownd_client_free(client);
+
+	if (syslog_relay_client_new(dev->device, port, &dev->relay) != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "%s: ERROR: Could not open usbmux connection.\n", uuid);
+		device_free(dev);
+		return;
+	}
+	syslog_relay_set_filter(dev->relay, agg->process, agg->pattern);
+
+	g_mutex_lock(agg->mutex);
+	g_hash_table_insert(agg->devices, dev->uuid, dev);
+	g_mutex_unlock(agg->mutex);
+
+	if (syslog_relay_client_attach(dev->relay, agg->reactor, aggregator_line_cb, dev) != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "%s: ERROR: Could not receive syslog\n", uuid);
+		g_mutex_lock(agg->mutex);
+		dev->dead = 1;
+		g_mutex_unlock(agg->mutex);
+		return;
+	}
+	fprintf(stderr, "%s: relaying syslog\n", uuid);
+}
+
+/**
+ * Stops relaying the syslog of a device that went away.
+ */
+static void aggregator_remove_device(struct syslog_aggregator *agg, const char *uuid)
+{
+	struct syslog_device *dev;
+
+	g_mutex_lock(agg->mutex);
+	dev = (struct syslog_device *)g_hash_table_lookup(agg->devices, uuid);
+	if (dev)
+		g_hash_table_remove(agg->devices, uuid);
+	g_mutex_unlock(agg->mutex);
+
+	/* outside the lock, as the line callback may be waited for */
+	if (dev)
+		device_free(dev);
+}
+
+/**
+ * Called on an event hub worker for devices being added or removed. The
+ * hub never delivers events of one device to two workers at once.
+ */
+static void aggregator_event_cb(const idevice_event_t *event, void *user_data)
+{
+	struct syslog_aggregator *agg = (struct syslog_aggregator *)user_data;
+
+	if (event->event == IDEVICE_DEVICE_ADD)
+		aggregator_add_device(agg, event->uuid);
+	else if (event->event == IDEVICE_DEVICE_REMOVE)
+		aggregator_remove_device(agg, event->uuid);
+}
+
+static gboolean collect_dead_device(gpointer key, gpointer value, gpointer user_data)
+{
+	struct syslog_device *dev = (struct syslog_device *)value;
+	GList **dead = (GList **)user_data;
+
+	if (!dev->dead)
+		return FALSE;
+	*dead = g_list_prepend(*dead, dev);
+	return TRUE;
+}
+
+/**
+ * Frees the devices whose connection failed, or all devices.
+ */
+static void aggregator_sweep(struct syslog_aggregator *agg, int all)
+{
+	GList *dead = NULL;
+	GList *node;
+
+	g_mutex_lock(agg->mutex);
+	if (all) {
+		GList *devs = g_hash_table_get_values(agg->devices);
+		for (node = devs; node; node = node->next) {
+			((struct syslog_device *)node->data)->dead = 1;
+		}
+		g_list_free(devs);
+	}
+	g_hash_table_foreach_steal(agg->devices, collect_dead_device, &dead);
+	g_mutex_unlock(agg->mutex);
+
+	for (node = dead; node; node = node->next) {
+		device_free((struct syslog_device *)node->data);
+	}
+	g_list_free(dead);
+}
+
+/**
+ * Relays the syslog of every device attached, now or later, to one output.
+ */
+static int run_aggregator(const char *output, off_t rotate_size, unsigned int keep, const char *process, const char *pattern)
+{
+	struct syslog_aggregator agg;
+	idevice_event_hub_t hub = NULL;
+	int res = 0;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	memset(&agg, '\0', sizeof(agg));
+	agg.process = process;
+	agg.pattern = pattern;
+	if (pattern) {
+		/* check the pattern once instead of complaining for every device */
+		GRegex *regex = g_regex_new(pattern, 0, 0, NULL);
+		if (!regex) {
+			printf("ERROR: Invalid pattern '%s'.\n", pattern);
+			return -1;
+		}
+		g_regex_unref(regex);
+	}
+
+	agg.writer.path = output;
+	agg.writer.rotate_size = rotate_size;
+	agg.writer.keep = keep;
+	if (output) {
+		if (writer_open(&agg.writer) < 0)
+			return -1;
+		signal(SIGHUP, reopen_output);
+	} else {
+		agg.writer.out = stdout;
+	}
+	agg.writer.mutex = g_mutex_new();
+	agg.writer.cond = g_cond_new();
+	agg.writer.pending = g_string_sized_new(OUTPUT_BUFFER_SIZE);
+	agg.writer.thread = g_thread_create(writer_thread, &agg.writer, TRUE, NULL);
+
+	agg.mutex = g_mutex_new();
+	agg.devices = g_hash_table_new(g_str_hash, g_str_equal);
+
+	if (idevice_reactor_new(0, &agg.reactor) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not set up the reactor.\n");
+		res = -1;
+	} else if ((idevice_event_hub_new(0, 0, EVENT_DEBOUNCE, &hub) != IDEVICE_E_SUCCESS) || (idevice_event_hub_subscribe(hub, aggregator_event_cb, &agg) != IDEVICE_E_SUCCESS)) {
+		fprintf(stderr, "ERROR: Could not subscribe to device events.\n");
+		res = -1;
+	} else {
+		while (!quit_flag) {
+			g_usleep(500000);
+			aggregator_sweep(&agg, 0);
+		}
+	}
+
+	if (hub) {
+		idevice_event_hub_unsubscribe(hub, aggregator_event_cb, &agg);
+		idevice_event_hub_free(hub);
+	}
+	aggregator_sweep(&agg, 1);
+	if (agg.reactor)
+		idevice_reactor_free(agg.reactor);
+	g_hash_table_destroy(agg.devices);
+	g_mutex_free(agg.mutex);
+
+	/* write what is left and stop the writer */
+	g_mutex_lock(agg.writer.mutex);
+	agg.writer.quit = 1;
+	g_cond_broadcast(agg.writer.cond);
+	g_mutex_unlock(agg.writer.mutex);
+	g_thread_join(agg.writer.thread);
+	g_string_free(agg.writer.pending, TRUE);
+	g_cond_free(agg.writer.cond);
+	g_mutex_free(agg.writer.mutex);
+	if (output && agg.writer.out)
+		fclose(agg.writer.out);
+
+	return res;
+}
+
 int main(int argc, char *argv[])
 {
 	lockdownd_client_t client = NULL;
@@ -51,6 +485,12 @@ int main(int argc, char *argv[])
 	char uuid[41];
 	uint16_t port = 0;
 	uuid[0] = 0;
+	const char *process = NULL;
+	const char *pattern = NULL;
+	const char *output = NULL;
+	off_t rotate_size = 0;
+	unsigned int keep = DEFAULT_KEEP;
+	int aggregate = 0;
 
 	signal(SIGINT, clean_exit);
 	signal(SIGQUIT, clean_exit);
@@ -72,6 +512,66 @@ int main(int argc, char *argv[])
 			strcpy(uuid, argv[i]);
 			continue;
 		}
+		else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--process")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			process = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--match")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			pattern = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--all")) {
+			aggregate = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			output = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rotate")) {
+			char *end = NULL;
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			rotate_size = strtoll(argv[i], &end, 10);
+			if (end && (*end == 'k' || *end == 'K'))
+				rotate_size <<= 10;
+			else if (end && (*end == 'm' || *end == 'M'))
+				rotate_size <<= 20;
+			else if (end && (*end == 'g' || *end == 'G'))
+				rotate_size <<= 30;
+			if (rotate_size <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keep")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			keep = atoi(argv[i]);
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -82,6 +582,15 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (aggregate) {
+		return run_aggregator(output, rotate_size, keep, process, pattern);
+	}
+	if (output || rotate_size) {
+		printf("Output files are only written with --all.\n");
+		print_usage(argc, argv);
+		return -1;
+	}
+
 	if (uuid[0] != 0) {
 		ret = idevice_new(&phone, uuid);
 		if (ret != IDEVICE_E_SUCCESS) {
@@ -109,43 +618,27 @@ int main(int argc, char *argv[])
 		lockdownd_client_free(client);
 		
 		/* connect to socket relay messages */
-		idevice_connection_t conn = NULL;
-		if ((idevice_connect(phone, port, &conn) != IDEVICE_E_SUCCESS) || !conn) {
+		syslog_relay_client_t relay = NULL;
+		if ((syslog_relay_client_new(phone, port, &relay) != SYSLOG_RELAY_E_SUCCESS) || !relay) {
 			printf("ERROR: Could not open usbmux connection.\n");
+		} else if (syslog_relay_set_filter(relay, process, pattern) != SYSLOG_RELAY_E_SUCCESS) {
+			printf("ERROR: Invalid pattern '%s'.\n", pattern);
 		} else {
+			/* lines are written out together after each receive */
+			setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
 			while (!quit_flag) {
-				char *receive = NULL;
-				uint32_t datalen = 0, bytes = 0, recv_bytes = 0;
-
-				ret = idevice_connection_receive(conn, (char *) &datalen, sizeof(datalen), &bytes);
-				if (ret < 0) {
+				syslog_relay_error_t serr = syslog_relay_receive(relay, syslog_line_cb, NULL, 500);
+				if (serr == SYSLOG_RELAY_E_TIMEOUT)
+					continue;
+				if (serr != SYSLOG_RELAY_E_SUCCESS) {
 					fprintf(stderr, "Error receiving data. Exiting...\n");
 					break;
 				}
-
-				datalen = GUINT32_FROM_BE(datalen);
-
-				if (datalen == 0)
-					continue;
-
-				recv_bytes += bytes;
-				receive = (char *) malloc(sizeof(char) * datalen);
-
-				while (!quit_flag && (recv_bytes <= datalen)) {
-					ret = idevice_connection_receive(conn, receive, datalen, &bytes);
-
-					if (bytes == 0)
-						break;
-
-					recv_bytes += bytes;
-
-					fwrite(receive, sizeof(char), bytes, stdout);
-				}
-
-				free(receive);
+				fflush(stdout);
 			}
 		}
-		idevice_disconnect(conn);
+		if (relay)
+			syslog_relay_client_free(relay);
 	} else {
 		printf("ERROR: Could not start service com.apple.syslog_relay.\n");
 	}
@@ -164,6 +657,15 @@ void print_usage(int argc, char **argv)
 	printf("Relay syslog of a connected iPhone/iPod Touch.\n\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -u, --uuid UUID\ttarget specific device by its 40-digit device UUID\n");
+	printf("  -p, --process NAME\tonly show messages of the process NAME\n");
+	printf("  -m, --match REGEX\tonly show messages matching REGEX\n");
+	printf("  -a, --all\t\trelay the syslog of all devices as they are attached,\n");
+	printf("  \t\t\tprefixing every line with the host time and device UUID\n");
+	printf("  -o, --output FILE\twith --all, append to FILE instead of stdout;\n");
+	printf("  \t\t\tSIGHUP reopens it\n");
+	printf("  -r, --rotate SIZE\trotate FILE when it grows beyond SIZE bytes;\n");
+	printf("  \t\t\tK, M and G suffixes are accepted\n");
+	printf("  -k, --keep NUM\t\tkeep NUM rotated files FILE.1 .. FILE.NUM. Default: %d\n", DEFAULT_KEEP);
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("\n");
 }